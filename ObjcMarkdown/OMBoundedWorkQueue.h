@@ -0,0 +1,33 @@
+// ObjcMarkdown
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
+
+// FIFO of work blocks drained by at most workerLimit workers on a dispatch
+// queue. A worker is started only when one is missing and exits once the
+// FIFO is empty, so a burst of submissions never parks more than
+// workerLimit threads, unlike dispatch_async plus a semaphore wait, which
+// holds a thread per waiting block. Blocks run in their own autorelease
+// pool; an exception escaping a block is logged and does not stop the
+// worker. Thread-safe.
+@interface OMBoundedWorkQueue : NSObject
+{
+    dispatch_queue_t _queue;
+    NSMutableArray *_pendingWork;
+    NSUInteger _workerLimit;
+    NSUInteger _activeWorkers;
+}
+
+// Workers run on queue (retained), which should be concurrent when
+// workerLimit is above one. A workerLimit of zero is treated as one.
+- (id)initWithQueue:(dispatch_queue_t)queue workerLimit:(NSUInteger)workerLimit;
+
+@property (nonatomic, readonly) NSUInteger workerLimit;
+
+- (void)addWork:(dispatch_block_t)work;
+
+// Submitted blocks not yet picked up by a worker.
+- (NSUInteger)pendingWorkCount;
+
+@end
@@ -0,0 +1,96 @@
+// ObjcMarkdown
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#import "OMBoundedWorkQueue.h"
+
+@interface OMBoundedWorkQueue ()
+- (void)drainPendingWork;
+@end
+
+@implementation OMBoundedWorkQueue
+
+@synthesize workerLimit = _workerLimit;
+
+- (id)initWithQueue:(dispatch_queue_t)queue workerLimit:(NSUInteger)workerLimit
+{
+    self = [super init];
+    if (self != nil) {
+        if (queue == NULL) {
+            [self release];
+            return nil;
+        }
+        dispatch_retain(queue);
+        _queue = queue;
+        _pendingWork = [[NSMutableArray alloc] init];
+        _workerLimit = MAX(workerLimit, (NSUInteger)1);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_queue != NULL) {
+        dispatch_release(_queue);
+    }
+    [_pendingWork release];
+    [super dealloc];
+}
+
+- (void)addWork:(dispatch_block_t)work
+{
+    if (work == nil) {
+        return;
+    }
+    BOOL startWorker = NO;
+    dispatch_block_t copiedWork = [work copy];
+    @synchronized (_pendingWork) {
+        [_pendingWork addObject:copiedWork];
+        if (_activeWorkers < _workerLimit) {
+            _activeWorkers += 1;
+            startWorker = YES;
+        }
+    }
+    [copiedWork release];
+    if (startWorker) {
+        // The worker keeps the queue alive until it has drained it.
+        [self retain];
+        dispatch_async(_queue, ^{
+            [self drainPendingWork];
+            [self release];
+        });
+    }
+}
+
+- (NSUInteger)pendingWorkCount
+{
+    @synchronized (_pendingWork) {
+        return [_pendingWork count];
+    }
+}
+
+- (void)drainPendingWork
+{
+    while (YES) {
+        dispatch_block_t work = nil;
+        @synchronized (_pendingWork) {
+            if ([_pendingWork count] == 0) {
+                // Decided under the lock, so a block added after this point
+                // always finds a free worker slot.
+                _activeWorkers -= 1;
+                return;
+            }
+            work = [[_pendingWork objectAtIndex:0] retain];
+            [_pendingWork removeObjectAtIndex:0];
+        }
+        @autoreleasepool {
+            @try {
+                work();
+            } @catch (NSException *exception) {
+                NSLog(@"OMBoundedWorkQueue: work raised %@: %@", [exception name], [exception reason]);
+            }
+        }
+        [work release];
+    }
+}
+
+@end
@@ -0,0 +1,59 @@
+// ObjcMarkdown
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#import <Foundation/Foundation.h>
+
+#include <stdint.h>
+
+// 64-bit FNV-1a over bytes, continuing from basis (14695981039346656037 to
+// start a fresh hash).
+FOUNDATION_EXPORT uint64_t OMDiskCacheFNV1aHash64(const unsigned char *bytes, NSUInteger length, uint64_t basis);
+
+// "<user cache directory>/ObjcMarkdown/<name>": XDG_CACHE_HOME (or
+// ~/.cache), ~/Library/Caches on macOS, LOCALAPPDATA on Windows. Not created.
+FOUNDATION_EXPORT NSString *OMDiskCacheUserDirectory(NSString *name);
+
+// Disk budget in bytes from the first non-empty environment variable in
+// environmentKeys, else from the defaultsKey user default, else
+// defaultBytes. Both settings are in megabytes; 0 disables the cache.
+FOUNDATION_EXPORT unsigned long long OMDiskCacheLimitSetting(NSArray *environmentKeys,
+                                                             NSString *defaultsKey,
+                                                             unsigned long long defaultBytes);
+
+// Content-addressed, size-bounded file cache. An entry's file name is two
+// independent FNV-1a hashes of its key, so keys may be arbitrarily long.
+// Reads refresh an entry's modification date; once the files exceed the
+// byte limit the least recently used go first, down to three quarters of
+// the limit so eviction does not run on every store. Entries are written
+// atomically, so concurrent readers never see a partial file. Thread-safe.
+@interface OMDiskCache : NSObject
+
+// directory is created if needed. A nil or empty directory, one that
+// cannot be created, or a zero byteLimit gives a disabled cache.
+- (id)initWithDirectory:(NSString *)directory byteLimit:(unsigned long long)byteLimit;
+
+// nil when the cache is disabled.
+@property (nonatomic, readonly) NSString *directory;
+@property (nonatomic, readonly) unsigned long long byteLimit;
+
+- (BOOL)isEnabled;
+
+// Where key's entry lives, whether or not it exists.
+- (NSString *)pathForKey:(NSString *)key extension:(NSString *)extension;
+// Same, but nil unless the entry exists; counts as a use of it.
+- (NSString *)existingPathForKey:(NSString *)key extension:(NSString *)extension;
+- (NSData *)dataForKey:(NSString *)key extension:(NSString *)extension;
+// Replaces any previous entry for key. Data larger than the byte limit is
+// not stored.
+- (BOOL)storeData:(NSData *)data forKey:(NSString *)key extension:(NSString *)extension;
+- (void)removeDataForKey:(NSString *)key extension:(NSString *)extension;
+
+// Bytes held on disk, from a directory scan on first use plus the stores
+// since.
+- (unsigned long long)trackedBytes;
+// Lookups through -existingPathForKey:extension: and -dataForKey:extension:
+// since the cache was created.
+- (NSUInteger)hitCount;
+- (NSUInteger)missCount;
+
+@end
@@ -0,0 +1,293 @@
+// ObjcMarkdown
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#import "OMDiskCache.h"
+
+@interface OMDiskCache ()
+- (void)scanSizeIfNeeded;
+- (void)evictIfNeeded;
+- (void)recordLookup:(BOOL)hit;
+@end
+
+uint64_t OMDiskCacheFNV1aHash64(const unsigned char *bytes, NSUInteger length, uint64_t basis)
+{
+    uint64_t hash = basis;
+    for (NSUInteger index = 0; index < length; index++) {
+        hash ^= (uint64_t)bytes[index];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+NSString *OMDiskCacheUserDirectory(NSString *name)
+{
+    NSDictionary *environment = [[NSProcessInfo processInfo] environment];
+#if defined(_WIN32)
+    NSString *base = [environment objectForKey:@"LOCALAPPDATA"];
+    if (base == nil || [base length] == 0) {
+        base = NSTemporaryDirectory();
+    }
+#elif defined(__APPLE__)
+    (void)environment;
+    NSString *base = [NSHomeDirectory() stringByAppendingPathComponent:@"Library/Caches"];
+#else
+    NSString *base = [environment objectForKey:@"XDG_CACHE_HOME"];
+    if (base == nil || [base length] == 0) {
+        base = [NSHomeDirectory() stringByAppendingPathComponent:@".cache"];
+    }
+#endif
+    if (base == nil || [base length] == 0 || [name length] == 0) {
+        return nil;
+    }
+    return [[base stringByAppendingPathComponent:@"ObjcMarkdown"] stringByAppendingPathComponent:name];
+}
+
+unsigned long long OMDiskCacheLimitSetting(NSArray *environmentKeys,
+                                           NSString *defaultsKey,
+                                           unsigned long long defaultBytes)
+{
+    NSDictionary *environment = [[NSProcessInfo processInfo] environment];
+    for (NSString *key in environmentKeys) {
+        NSString *value = [environment objectForKey:key];
+        if (value != nil && [value length] > 0) {
+            return (unsigned long long)MAX([value longLongValue], 0LL) * 1024ULL * 1024ULL;
+        }
+    }
+    if (defaultsKey != nil) {
+        id defaultsValue = [[NSUserDefaults standardUserDefaults] objectForKey:defaultsKey];
+        if ([defaultsValue respondsToSelector:@selector(longLongValue)]) {
+            return (unsigned long long)MAX([defaultsValue longLongValue], 0LL) * 1024ULL * 1024ULL;
+        }
+    }
+    return defaultBytes;
+}
+
+static NSComparisonResult OMDiskCacheCompareEntries(id left, id right, void *context)
+{
+    (void)context;
+    return [[left objectAtIndex:1] compare:[right objectAtIndex:1]];
+}
+
+@implementation OMDiskCache
+{
+    unsigned long long _trackedBytes;
+    BOOL _sizeScanned;
+    NSUInteger _hitCount;
+    NSUInteger _missCount;
+}
+
+@synthesize directory = _directory;
+@synthesize byteLimit = _byteLimit;
+
+- (id)initWithDirectory:(NSString *)directory byteLimit:(unsigned long long)byteLimit
+{
+    self = [super init];
+    if (self != nil) {
+        NSString *path = [directory length] > 0 ? [directory stringByExpandingTildeInPath] : nil;
+        if (path != nil && byteLimit > 0 &&
+            [[NSFileManager defaultManager] createDirectoryAtPath:path
+                                      withIntermediateDirectories:YES
+                                                       attributes:nil
+                                                            error:NULL]) {
+            _directory = [path copy];
+        }
+        _byteLimit = byteLimit;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_directory release];
+    [super dealloc];
+}
+
+- (BOOL)isEnabled
+{
+    return _directory != nil;
+}
+
+- (NSString *)pathForKey:(NSString *)key extension:(NSString *)extension
+{
+    if (_directory == nil || [key length] == 0) {
+        return nil;
+    }
+    NSData *data = [key dataUsingEncoding:NSUTF8StringEncoding];
+    if (data == nil) {
+        return nil;
+    }
+    const unsigned char *bytes = (const unsigned char *)[data bytes];
+    NSUInteger length = [data length];
+    uint64_t high = OMDiskCacheFNV1aHash64(bytes, length, 14695981039346656037ULL);
+    uint64_t low = OMDiskCacheFNV1aHash64(bytes, length, 0x84222325cbf29ce4ULL ^ (uint64_t)length);
+    NSString *name = [NSString stringWithFormat:@"%016llx%016llx",
+                      (unsigned long long)high,
+                      (unsigned long long)low];
+    if ([extension length] > 0) {
+        name = [name stringByAppendingPathExtension:extension];
+    }
+    return [_directory stringByAppendingPathComponent:name];
+}
+
+- (void)recordLookup:(BOOL)hit
+{
+    @synchronized (self) {
+        if (hit) {
+            _hitCount += 1;
+        } else {
+            _missCount += 1;
+        }
+    }
+}
+
+- (NSString *)existingPathForKey:(NSString *)key extension:(NSString *)extension
+{
+    NSString *path = [self pathForKey:key extension:extension];
+    if (path == nil) {
+        return nil;
+    }
+    if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        [self recordLookup:NO];
+        return nil;
+    }
+    NSDictionary *touched = [NSDictionary dictionaryWithObject:[NSDate date]
+                                                        forKey:NSFileModificationDate];
+    [[NSFileManager defaultManager] setAttributes:touched ofItemAtPath:path error:NULL];
+    [self recordLookup:YES];
+    return path;
+}
+
+- (NSData *)dataForKey:(NSString *)key extension:(NSString *)extension
+{
+    NSString *path = [self pathForKey:key extension:extension];
+    if (path == nil) {
+        return nil;
+    }
+    NSData *data = [NSData dataWithContentsOfFile:path];
+    if ([data length] == 0) {
+        [self recordLookup:NO];
+        return nil;
+    }
+    NSDictionary *touched = [NSDictionary dictionaryWithObject:[NSDate date]
+                                                        forKey:NSFileModificationDate];
+    [[NSFileManager defaultManager] setAttributes:touched ofItemAtPath:path error:NULL];
+    [self recordLookup:YES];
+    return data;
+}
+
+- (BOOL)storeData:(NSData *)data forKey:(NSString *)key extension:(NSString *)extension
+{
+    NSString *path = [self pathForKey:key extension:extension];
+    unsigned long long length = (unsigned long long)[data length];
+    if (path == nil || length == 0 || length > _byteLimit) {
+        return NO;
+    }
+    // The size of the entry being replaced is read under the lock, so a
+    // rewrite of an existing key is not counted twice.
+    @synchronized (self) {
+        [self scanSizeIfNeeded];
+        NSDictionary *previous = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
+        if (![data writeToFile:path atomically:YES]) {
+            return NO;
+        }
+        unsigned long long previousLength = [[previous objectForKey:NSFileSize] unsignedLongLongValue];
+        _trackedBytes -= MIN(previousLength, _trackedBytes);
+        _trackedBytes += length;
+        [self evictIfNeeded];
+    }
+    return YES;
+}
+
+- (void)removeDataForKey:(NSString *)key extension:(NSString *)extension
+{
+    NSString *path = [self pathForKey:key extension:extension];
+    if (path == nil) {
+        return;
+    }
+    @synchronized (self) {
+        [self scanSizeIfNeeded];
+        NSDictionary *previous = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
+        if (previous != nil && [[NSFileManager defaultManager] removeItemAtPath:path error:NULL]) {
+            unsigned long long previousLength = [[previous objectForKey:NSFileSize] unsignedLongLongValue];
+            _trackedBytes -= MIN(previousLength, _trackedBytes);
+        }
+    }
+}
+
+- (unsigned long long)trackedBytes
+{
+    @synchronized (self) {
+        [self scanSizeIfNeeded];
+        return _trackedBytes;
+    }
+}
+
+- (NSUInteger)hitCount
+{
+    @synchronized (self) {
+        return _hitCount;
+    }
+}
+
+- (NSUInteger)missCount
+{
+    @synchronized (self) {
+        return _missCount;
+    }
+}
+
+// Caller holds the lock.
+- (void)scanSizeIfNeeded
+{
+    if (_sizeScanned || _directory == nil) {
+        return;
+    }
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    unsigned long long total = 0;
+    for (NSString *name in [fileManager contentsOfDirectoryAtPath:_directory error:NULL]) {
+        NSDictionary *attributes = [fileManager attributesOfItemAtPath:[_directory stringByAppendingPathComponent:name]
+                                                                 error:NULL];
+        total += [[attributes objectForKey:NSFileSize] unsignedLongLongValue];
+    }
+    _trackedBytes = total;
+    _sizeScanned = YES;
+}
+
+// Rescans rather than trusting the tracked total, since other processes
+// share the directory. Caller holds the lock.
+- (void)evictIfNeeded
+{
+    if (_trackedBytes <= _byteLimit) {
+        return;
+    }
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableArray *entries = [NSMutableArray array];
+    unsigned long long total = 0;
+    for (NSString *name in [fileManager contentsOfDirectoryAtPath:_directory error:NULL]) {
+        NSString *path = [_directory stringByAppendingPathComponent:name];
+        NSDictionary *attributes = [fileManager attributesOfItemAtPath:path error:NULL];
+        NSDate *modified = [attributes objectForKey:NSFileModificationDate];
+        NSNumber *size = [attributes objectForKey:NSFileSize];
+        if (modified == nil || size == nil) {
+            continue;
+        }
+        total += [size unsignedLongLongValue];
+        [entries addObject:[NSArray arrayWithObjects:path, modified, size, nil]];
+    }
+    if (total > _byteLimit) {
+        [entries sortUsingFunction:OMDiskCacheCompareEntries context:NULL];
+        unsigned long long target = (_byteLimit / 4ULL) * 3ULL;
+        for (NSArray *entry in entries) {
+            if (total <= target) {
+                break;
+            }
+            if ([fileManager removeItemAtPath:[entry objectAtIndex:0] error:NULL]) {
+                total -= [[entry objectAtIndex:2] unsignedLongLongValue];
+            }
+        }
+    }
+    _trackedBytes = total;
+}
+
+@end
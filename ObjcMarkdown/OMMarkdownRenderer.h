@@ -3,11 +3,15 @@
 
 #import <Foundation/Foundation.h>
 #import <AppKit/AppKit.h>
+#import <dispatch/dispatch.h>
 #import "OMMarkdownParsingOptions.h"
 
 @class OMTheme;
+@class OMDiskCache;
 
 FOUNDATION_EXPORT NSString * const OMMarkdownRendererMathArtifactsDidWarmNotification;
+// Posted on the main thread once a batch of background image loads (remote,
+// or local with asynchronousImageLoadingEnabled) is in the image cache.
 FOUNDATION_EXPORT NSString * const OMMarkdownRendererRemoteImagesDidWarmNotification;
 FOUNDATION_EXPORT NSString * const OMMarkdownRendererAnchorSourceStartLineKey;
 FOUNDATION_EXPORT NSString * const OMMarkdownRendererAnchorSourceEndLineKey;
@@ -15,20 +19,164 @@ FOUNDATION_EXPORT NSString * const OMMarkdownRendererAnchorTargetStartKey;
 FOUNDATION_EXPORT NSString * const OMMarkdownRendererAnchorTargetLengthKey;
 FOUNDATION_EXPORT NSString * const OMMarkdownRendererAnchorBlockIDKey;
 
+// Progress callback for the progressive render. partial replaces everything
+// from offset onwards in the caller's copy of the output. Ranges and anchors
+// cover the whole output so far. A priorityOnly call carries just the
+// viewport blocks and is superseded by the first in-order call (offset 0).
+typedef void (^OMMarkdownRendererProgressHandler)(NSAttributedString *partial,
+                                                  NSUInteger offset,
+                                                  NSArray *codeBlockRanges,
+                                                  NSArray *blockquoteRanges,
+                                                  NSArray *blockAnchors,
+                                                  BOOL priorityOnly);
+
+typedef NS_ENUM(NSInteger, OMMarkdownRendererExportPhase) {
+    // Math and image assets are being generated at the export zoom.
+    OMMarkdownRendererExportPhaseAssets = 0,
+    // Top-level blocks are being rendered.
+    OMMarkdownRendererExportPhaseBlocks = 1
+};
+
+// Progress of an export render; completed counts up to total within each
+// phase. Called on worker threads, one call at a time.
+typedef void (^OMMarkdownRendererExportProgressHandler)(OMMarkdownRendererExportPhase phase,
+                                                        NSUInteger completed,
+                                                        NSUInteger total);
+
+typedef NS_OPTIONS(NSUInteger, OMMarkdownBlockFlags) {
+    OMMarkdownBlockFlagTopLevel = 1 << 0,
+    OMMarkdownBlockFlagInBlockquote = 1 << 1,
+    OMMarkdownBlockFlagInList = 1 << 2,
+    OMMarkdownBlockFlagInCodeBlock = 1 << 3
+};
+
+// One block-level node of a parsed document, in document order. nodeType is
+// a cmark_node_type value; lines are cmark's 1-based source positions as
+// reported (not clamped). The InBlockquote/InList/InCodeBlock flags include
+// the node itself, so a list item carries OMMarkdownBlockFlagInList.
+typedef struct {
+    NSInteger nodeType;
+    NSInteger startLine;
+    NSInteger endLine;
+    OMMarkdownBlockFlags flags;
+} OMMarkdownBlockDescriptor;
+
+// Parse result of one markdown revision, shared by the renderer and the
+// editor-side consumers (source highlighting, preview sync) so a revision is
+// parsed once. Immutable and safe to read from any thread.
+@interface OMMarkdownDocumentSnapshot : NSObject
+// Returns a remembered snapshot of markdown (and, for the second form,
+// cmarkOptions); otherwise parses and remembers a new one. The last few
+// revisions are kept, so several open documents each find their own.
+// Block structure does not depend on cmark options, so callers that only
+// need lines and block descriptors should use the first form.
++ (instancetype)snapshotForMarkdown:(NSString *)markdown;
++ (instancetype)snapshotForMarkdown:(NSString *)markdown cmarkOptions:(NSUInteger)cmarkOptions;
+// Parses without consulting or replacing the remembered snapshot, e.g. for
+// a fragment of a larger document.
+- (instancetype)initWithMarkdown:(NSString *)markdown cmarkOptions:(NSUInteger)cmarkOptions;
+@property (nonatomic, readonly) NSString *markdown;
+@property (nonatomic, readonly) NSUInteger cmarkOptions;
+@property (nonatomic, readonly) NSUInteger lineCount;
+// Line content without its terminator; lineNumber is 1-based.
+- (NSRange)rangeOfLine:(NSUInteger)lineNumber;
+// 1-based line containing characterIndex; 0 for an empty document.
+- (NSUInteger)lineNumberForCharacterIndex:(NSUInteger)characterIndex;
+// Line strings in the same form, for callers that index lines by number.
+- (NSArray *)sourceLines;
+@property (nonatomic, readonly) NSUInteger blockCount;
+- (const OMMarkdownBlockDescriptor *)blockDescriptors;
+@end
+
+// Waits for semaphore; a timeout of 0 waits for ever. On the main thread
+// the renderer's AppKit steps (table layout, text measuring, image drawing)
+// of worker-thread renders keep running meanwhile, so use this instead of
+// dispatch_semaphore_wait when main waits for a render. Returns NO on
+// timeout.
+FOUNDATION_EXPORT BOOL OMMarkdownRendererWaitForSemaphore(dispatch_semaphore_t semaphore, NSTimeInterval timeout);
+
+// The renderer's theme, zoom, layout width and options at one moment, for a
+// render that runs later on another thread while the renderer is
+// reconfigured. Immutable.
+@interface OMMarkdownRenderSettings : NSObject
+@end
+
 @interface OMMarkdownRenderer : NSObject
 
 - (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown;
+// Incremental variant backed by a per-block fragment cache. Only top-level
+// blocks whose source changed since the previous call are rendered again.
+// previousChangedRange is the range of the previously returned string that
+// must be replaced by changedRange of the new one.
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                previousChangedRange:(NSRange *)previousChangedRangeOut
+                                        changedRange:(NSRange *)changedRangeOut;
+// Returns nil, leaving the cache untouched, once isCancelled reports YES.
+// Safe to call from a worker queue; settings are captured when it starts.
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                previousChangedRange:(NSRange *)previousChangedRangeOut
+                                        changedRange:(NSRange *)changedRangeOut
+                                   cancellationCheck:(BOOL (^)(void))isCancelled;
+// Same, rendering with settings captured earlier by -currentRenderSettings.
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                      renderSettings:(OMMarkdownRenderSettings *)settings
+                                previousChangedRange:(NSRange *)previousChangedRangeOut
+                                        changedRange:(NSRange *)changedRangeOut
+                                   cancellationCheck:(BOOL (^)(void))isCancelled;
+// Progressive variant for very large documents. Blocks intersecting
+// priorityLineRange (1-based source lines, as in block anchors) are reported
+// first; the document then follows in order, roughly every progressInterval
+// characters. Updates the same cache as the incremental variant.
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                   priorityLineRange:(NSRange)priorityLineRange
+                                    progressInterval:(NSUInteger)progressInterval
+                                     progressHandler:(OMMarkdownRendererProgressHandler)progressHandler
+                                   cancellationCheck:(BOOL (^)(void))isCancelled;
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                      renderSettings:(OMMarkdownRenderSettings *)settings
+                                   priorityLineRange:(NSRange)priorityLineRange
+                                    progressInterval:(NSUInteger)progressInterval
+                                     progressHandler:(OMMarkdownRendererProgressHandler)progressHandler
+                                   cancellationCheck:(BOOL (^)(void))isCancelled;
+// Whole-document render for print and export. The math and image assets the
+// document needs at this zoom are generated first on the shared artifact
+// workers; top-level blocks are then rendered concurrently and joined in
+// document order. The incremental fragment cache is left alone. Blocks the
+// calling thread until the output is complete.
+- (NSAttributedString *)exportAttributedStringFromMarkdown:(NSString *)markdown
+                                           progressHandler:(OMMarkdownRendererExportProgressHandler)progressHandler;
+// Same, with settings captured earlier by -currentRenderSettings. Returns nil
+// once isCancelled reports YES.
+- (NSAttributedString *)exportAttributedStringFromMarkdown:(NSString *)markdown
+                                            renderSettings:(OMMarkdownRenderSettings *)settings
+                                           progressHandler:(OMMarkdownRendererExportProgressHandler)progressHandler
+                                         cancellationCheck:(BOOL (^)(void))isCancelled;
+- (void)invalidateBlockRenderCache;
+// Everything besides the markdown text that rendered output depends on:
+// theme, zoom, layout width, options and warmed math/image artifacts. Output
+// produced under an equal key can be redisplayed for the same markdown.
+- (NSString *)renderConfigurationKey;
+- (OMMarkdownRenderSettings *)currentRenderSettings;
 - (instancetype)initWithTheme:(OMTheme *)theme;
 - (instancetype)initWithTheme:(OMTheme *)theme parsingOptions:(OMMarkdownParsingOptions *)parsingOptions;
 + (BOOL)isTreeSitterAvailable;
+// Disk caches of generated math artifacts and of prepared local images,
+// shared by every renderer in the process.
++ (OMDiskCache *)mathArtifactDiskCache;
++ (OMDiskCache *)imageDiskCache;
 @property (nonatomic, assign) CGFloat zoomScale;
 @property (nonatomic, assign) CGFloat layoutWidth;
 @property (nonatomic, assign) BOOL allowTableHorizontalOverflow;
 @property (nonatomic, assign) BOOL asynchronousMathGenerationEnabled;
+// Local images not yet decoded render as placeholders of their final size
+// while a background loader prepares them.
+@property (nonatomic, assign) BOOL asynchronousImageLoadingEnabled;
 @property (nonatomic, retain) OMMarkdownParsingOptions *parsingOptions;
 - (NSColor *)backgroundColor;
 @property (nonatomic, readonly) NSArray *codeBlockRanges;
 @property (nonatomic, readonly) NSArray *blockquoteRanges;
 @property (nonatomic, readonly) NSArray *blockAnchors;
+@property (nonatomic, readonly) NSUInteger lastRenderedBlockCount;
+@property (nonatomic, readonly) NSUInteger lastReusedBlockCount;
 
 @end
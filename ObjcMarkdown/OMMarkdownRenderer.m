@@ -3,6 +3,9 @@
 
 #import "OMMarkdownRenderer.h"
 #import "OMTheme.h"
+#import "OMPerfTrace.h"
+#import "OMDiskCache.h"
+#import "OMBoundedWorkQueue.h"
 
 #import <dispatch/dispatch.h>
 
@@ -14,6 +17,7 @@
 #include <dlfcn.h>
 #endif
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -31,6 +35,8 @@ typedef struct {
     NSUInteger mathCacheMisses;
     NSUInteger mathAssetCacheHits;
     NSUInteger mathAssetCacheMisses;
+    NSUInteger mathDiskCacheHits;
+    NSUInteger mathDiskCacheMisses;
     NSUInteger mathRendered;
     NSUInteger mathFailures;
     NSUInteger latexRuns;
@@ -41,7 +47,10 @@ typedef struct {
     NSTimeInterval mathTotalSeconds;
 } OMMathPerfStats;
 
+@class OMRenderArtifactWait;
+
 typedef struct {
+    OMTheme *theme;
     OMMarkdownParsingOptions *parsingOptions;
     NSArray *sourceLines;
     NSMutableArray *blockAnchors;
@@ -50,6 +59,8 @@ typedef struct {
     CGFloat layoutWidth;
     BOOL allowTableHorizontalOverflow;
     BOOL asynchronousMathGenerationEnabled;
+    BOOL asynchronousImageLoadingEnabled;
+    OMRenderArtifactWait *artifactWait;
 } OMRenderContext;
 
 static NSString *OMExecutablePathNamed(NSString *name);
@@ -63,6 +74,213 @@ static NSTimeInterval OMNow(void)
     return [NSDate timeIntervalSinceReferenceDate];
 }
 
+// GNUstep's text measuring and image drawing are not thread-safe: string
+// sizes come from shared layout managers and lockFocus changes the current
+// graphics context. Renders running on worker queues hand those steps to
+// the main thread, one at a time, and wait for them.
+static NSMutableArray *OMMainThreadWorkItems(void)
+{
+    static NSMutableArray *items = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        items = [[NSMutableArray alloc] init];
+    });
+    return items;
+}
+
+static void OMDrainMainThreadWork(void)
+{
+    NSMutableArray *items = OMMainThreadWorkItems();
+    for (;;) {
+        NSArray *item = nil;
+        @synchronized (items) {
+            if ([items count] == 0) {
+                return;
+            }
+            item = [[items objectAtIndex:0] retain];
+            [items removeObjectAtIndex:0];
+        }
+        void (^work)(void) = [item objectAtIndex:0];
+        dispatch_semaphore_t done = (dispatch_semaphore_t)[[item objectAtIndex:1] pointerValue];
+        @autoreleasepool {
+            @try {
+                work();
+            } @catch (NSException *exception) {
+                NSLog(@"[Renderer] main-thread render step failed: %@", exception);
+            }
+        }
+        dispatch_semaphore_signal(done);
+        [item release];
+    }
+}
+
+static void OMPerformAppKitWork(void (^work)(void))
+{
+    if (work == nil) {
+        return;
+    }
+    if ([NSThread isMainThread]) {
+        work();
+        return;
+    }
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    NSArray *item = [NSArray arrayWithObjects:[[work copy] autorelease],
+                                              [NSValue valueWithPointer:done],
+                                              nil];
+    NSMutableArray *items = OMMainThreadWorkItems();
+    @synchronized (items) {
+        [items addObject:item];
+    }
+    dispatch_async(dispatch_get_main_queue(), ^{
+        OMDrainMainThreadWork();
+    });
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    dispatch_release(done);
+}
+
+// The background artifacts (formulas, images) one export asked for, so that
+// it waits for those and not for whatever else the shared workers are doing.
+@interface OMRenderArtifactWait : NSObject
+{
+    dispatch_group_t _group;
+    NSUInteger _requested;
+    NSUInteger _finished;
+}
+- (void)addArtifact;
+- (void)finishArtifact;
+- (NSUInteger)requestedCount;
+- (NSUInteger)finishedCount;
+- (dispatch_group_t)group;
+@end
+
+@implementation OMRenderArtifactWait
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        _group = dispatch_group_create();
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    dispatch_release(_group);
+    [super dealloc];
+}
+
+- (void)addArtifact
+{
+    @synchronized (self) {
+        _requested += 1;
+    }
+    dispatch_group_enter(_group);
+}
+
+- (void)finishArtifact
+{
+    @synchronized (self) {
+        _finished += 1;
+    }
+    dispatch_group_leave(_group);
+}
+
+- (NSUInteger)requestedCount
+{
+    @synchronized (self) {
+        return _requested;
+    }
+}
+
+- (NSUInteger)finishedCount
+{
+    @synchronized (self) {
+        return _finished;
+    }
+}
+
+- (dispatch_group_t)group
+{
+    return _group;
+}
+
+@end
+
+// Artifact key -> the waits registered for it.
+static NSMutableDictionary *OMRenderArtifactWaiters(void)
+{
+    static NSMutableDictionary *waiters = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        waiters = [[NSMutableDictionary alloc] init];
+    });
+    return waiters;
+}
+
+// Called with the artifact's pending set locked, so that the key cannot
+// finish between the pending check and the registration.
+static void OMRegisterRenderArtifactWait(NSString *key, const OMRenderContext *renderContext)
+{
+    OMRenderArtifactWait *wait = renderContext != NULL ? renderContext->artifactWait : nil;
+    if (wait == nil || key == nil) {
+        return;
+    }
+    NSMutableDictionary *waiters = OMRenderArtifactWaiters();
+    @synchronized (waiters) {
+        NSMutableArray *waits = [waiters objectForKey:key];
+        if (waits == nil) {
+            waits = [NSMutableArray array];
+            [waiters setObject:waits forKey:key];
+        }
+        [waits addObject:wait];
+        [wait addArtifact];
+    }
+}
+
+// Called once key has left its pending set, whether or not it succeeded.
+static void OMFinishRenderArtifact(NSString *key)
+{
+    if (key == nil) {
+        return;
+    }
+    NSArray *waits = nil;
+    NSMutableDictionary *waiters = OMRenderArtifactWaiters();
+    @synchronized (waiters) {
+        waits = [[waiters objectForKey:key] retain];
+        [waiters removeObjectForKey:key];
+    }
+    for (OMRenderArtifactWait *wait in waits) {
+        [wait finishArtifact];
+    }
+    [waits release];
+}
+
+BOOL OMMarkdownRendererWaitForSemaphore(dispatch_semaphore_t semaphore, NSTimeInterval timeout)
+{
+    if (semaphore == NULL) {
+        return YES;
+    }
+    if (![NSThread isMainThread]) {
+        dispatch_time_t deadline = (timeout > 0.0
+                                    ? dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * (double)NSEC_PER_SEC))
+                                    : DISPATCH_TIME_FOREVER);
+        return dispatch_semaphore_wait(semaphore, deadline) == 0;
+    }
+    // On the main thread the render being waited for may itself need the
+    // main thread, so its AppKit steps run here between short waits.
+    NSTimeInterval deadline = OMNow() + timeout;
+    for (;;) {
+        OMDrainMainThreadWork();
+        if (dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, 2 * NSEC_PER_MSEC)) == 0) {
+            return YES;
+        }
+        if (timeout > 0.0 && OMNow() >= deadline) {
+            return NO;
+        }
+    }
+}
+
 #if defined(_WIN32)
 static NSString *OMWindowsNormalizedPath(NSString *value)
 {
@@ -575,40 +793,6 @@ static OMCodeSyntaxPalette OMCodePaletteForBackground(NSColor *backgroundColor)
     return palette;
 }
 
-static NSMutableDictionary *OMCodeRegexCache(void)
-{
-    static NSMutableDictionary *cache = nil;
-    if (cache == nil) {
-        cache = [[NSMutableDictionary alloc] init];
-    }
-    return cache;
-}
-
-static NSRegularExpression *OMCachedRegex(NSString *pattern, NSRegularExpressionOptions options)
-{
-    if (pattern == nil || [pattern length] == 0) {
-        return nil;
-    }
-
-    NSMutableDictionary *cache = OMCodeRegexCache();
-    NSString *key = [NSString stringWithFormat:@"%lu|%@",
-                     (unsigned long)options,
-                     pattern];
-    @synchronized (cache) {
-        NSRegularExpression *regex = [cache objectForKey:key];
-        if (regex != nil) {
-            return regex;
-        }
-        NSRegularExpression *created = [NSRegularExpression regularExpressionWithPattern:pattern
-                                                                                  options:options
-                                                                                    error:NULL];
-        if (created != nil) {
-            [cache setObject:created forKey:key];
-        }
-        return created;
-    }
-}
-
 static NSString *OMPrimaryFenceTokenFromFenceInfo(NSString *fenceInfo)
 {
     if (fenceInfo == nil || [fenceInfo length] == 0) {
@@ -736,486 +920,1186 @@ static OMCodeLanguage OMLanguageForFenceToken(NSString *token)
     return OMCodeLanguageUnknown;
 }
 
-static void OMApplyRegexColor(NSMutableAttributedString *text,
-                              NSString *pattern,
-                              NSRegularExpressionOptions options,
-                              NSColor *color)
+// Fenced code is colored by one scan over the UTF-16 buffer. Each language
+// is a short list of token rules in paint order: matches of one rule never
+// overlap each other, and where matches of different rules overlap the later
+// rule's color wins. That is exactly what running one regex pass per rule
+// would produce, so each matcher below keeps the semantics of the pattern in
+// its comment (ICU \b, \w, \s and multiline anchors included).
+typedef NS_ENUM(uint8_t, OMCodeTokenClass) {
+    OMCodeTokenClassNone = 0,
+    OMCodeTokenClassKeyword = 1,
+    OMCodeTokenClassComment = 2,
+    OMCodeTokenClassString = 3,
+    OMCodeTokenClassNumber = 4,
+    OMCodeTokenClassDirective = 5
+};
+
+typedef NS_ENUM(uint8_t, OMCodeRuleKind) {
+    OMCodeRuleKeywords = 0,          // \b(?:words)\b
+    OMCodeRuleNumbers,               // \b(?:0x[0-9A-Fa-f]+|-?\d+(?:\.\d+)?)\b
+    OMCodeRuleStrings,               // "(?:[^"\\]|\\.)*" and the other quotes
+    OMCodeRuleComments,              // //.*$, #.*$, --.*$, /\*[\s\S]*?\*/, <!--.*?-->
+    OMCodeRuleJSONKey,               // "(?:[^"\\]|\\.)*"\s*:
+    OMCodeRuleShellVariable,         // \$\{?[A-Za-z_][A-Za-z0-9_]*\}?
+    OMCodeRuleSymbol,                // \:[A-Za-z_][A-Za-z0-9_]*
+    OMCodeRuleMarkupTag,             // </?[A-Za-z][A-Za-z0-9:_-]*
+    OMCodeRuleMarkupAttribute,       // \b[A-Za-z_:][A-Za-z0-9_:\-]*\s*=
+    OMCodeRuleMarkdownLink,          // \[[^\]\n]+\]\([^\)\n]+\)
+    OMCodeRuleMarkdownStrong,        // \*\*[^*\n]+\*\*|__[^_\n]+__
+    OMCodeRuleMarkdownEmphasis,      // (?<!\*)\*[^*\n]+\*(?!\*)|(?<!_)_[^_\n]+_(?!_)
+    OMCodeRuleMarkdownCode,          // `[^`\n]+`
+    OMCodeRuleMarkdownMath,          // \$\$[\s\S]*?\$\$|\$[^$\n]+\$
+    // Anchored at line starts. The leading \s* may run across blank lines.
+    OMCodeRulePreprocessorLine,      // ^\s*#\s*[A-Za-z_][A-Za-z0-9_]*.*$
+    OMCodeRuleDecorator,             // ^\s*@\w+
+    OMCodeRuleHashCommentLine,       // ^\s*#.*$
+    OMCodeRuleListMarker,            // ^\s*-\s+
+    OMCodeRuleYAMLKey,               // ^\s*[A-Za-z0-9_\-"']+\s*:
+    OMCodeRuleTOMLTable,             // ^\s*\[[^\]\n]+\]
+    OMCodeRuleTOMLKey,               // ^\s*[A-Za-z0-9_\.-]+\s*=
+    OMCodeRuleMarkdownHeading        // ^\s{0,3}#{1,6}\s+.*$
+};
+
+enum {
+    OMCodeFlagDoubleQuote = 1 << 0,
+    OMCodeFlagSingleQuote = 1 << 1,
+    OMCodeFlagBacktick = 1 << 2,
+    OMCodeFlagAtPrefix = 1 << 3,
+    OMCodeFlagTripleQuotes = 1 << 4,
+    OMCodeFlagEscapedNewlines = 1 << 5,
+    OMCodeFlagSlashComments = 1 << 6,
+    OMCodeFlagHashComments = 1 << 7,
+    OMCodeFlagDashComments = 1 << 8,
+    OMCodeFlagBlockComments = 1 << 9,
+    OMCodeFlagMarkupComments = 1 << 10,
+    OMCodeFlagSignedNumbers = 1 << 11,
+    OMCodeFlagCaseInsensitive = 1 << 12
+};
+
+enum {
+    OMCodeMaxRules = 6
+};
+
+typedef struct {
+    OMCodeRuleKind kind;
+    OMCodeTokenClass tokenClass;
+    uint16_t flags;
+    const char *keywords;
+} OMCodeRule;
+
+typedef struct {
+    NSUInteger ruleCount;
+    OMCodeRule rules[OMCodeMaxRules];
+} OMCodeLanguageRules;
+
+#define OMCodeJavaScriptKeywordList "if else for while do switch case break continue return function const let var class extends new try catch finally throw import export default from as this null undefined true false"
+
+static const char OMCodeCFamilyKeywords[] = "@interface @implementation @end @property @synthesize @dynamic @protocol @class @selector @autoreleasepool id instancetype self super nil YES NO if else for while switch case break continue return typedef struct enum static const void int float double char long short unsigned signed BOOL SEL Class namespace template typename using public private protected virtual override constexpr auto new delete this nullptr try catch throw package import func defer select go chan map interface impl trait where match let mut pub crate mod fn protocol extension guard deinit class actor async await yield throws true false var val";
+static const char OMCodePythonKeywords[] = "and as assert async await break class continue def del elif else except False finally for from global if import in is lambda None nonlocal not or pass raise return True try while with yield";
+static const char OMCodeJavaScriptKeywords[] = OMCodeJavaScriptKeywordList;
+static const char OMCodeTypeScriptKeywords[] = OMCodeJavaScriptKeywordList " interface type implements enum namespace readonly public private protected abstract declare keyof infer unknown never any";
+static const char OMCodeJSONKeywords[] = "true false null";
+static const char OMCodeBashKeywords[] = "if then else elif fi for while do done case esac function in select until time";
+static const char OMCodeYAMLKeywords[] = "true false null yes no on off";
+static const char OMCodeTOMLKeywords[] = "true false";
+static const char OMCodeSQLKeywords[] = "SELECT FROM WHERE ORDER BY GROUP HAVING INSERT INTO VALUES UPDATE SET DELETE CREATE TABLE ALTER DROP JOIN LEFT RIGHT INNER OUTER ON AS DISTINCT LIMIT OFFSET UNION ALL AND OR NOT NULL IS IN LIKE CASE WHEN THEN ELSE END";
+static const char OMCodeRubyKeywords[] = "def class module end if elsif else unless case when while until for in do break next redo retry return yield super self nil true false and or not begin rescue ensure require include extend attr_reader attr_writer attr_accessor";
+
+static const OMCodeLanguageRules OMCodeLanguageRuleTable[] = {
+    [OMCodeLanguageCFamily] = { 5, {
+        { OMCodeRulePreprocessorLine, OMCodeTokenClassDirective, 0, NULL },
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeCFamilyKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagAtPrefix | OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagSlashComments | OMCodeFlagBlockComments, NULL }
+    } },
+    [OMCodeLanguagePython] = { 5, {
+        { OMCodeRuleDecorator, OMCodeTokenClassDirective, 0, NULL },
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodePythonKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagTripleQuotes | OMCodeFlagSingleQuote | OMCodeFlagDoubleQuote | OMCodeFlagEscapedNewlines, NULL },
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagHashComments, NULL }
+    } },
+    [OMCodeLanguageJavaScript] = { 4, {
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeJavaScriptKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagBacktick | OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagSlashComments | OMCodeFlagBlockComments, NULL }
+    } },
+    // Both keyword passes paint the same color, so one set covers them.
+    [OMCodeLanguageTypeScript] = { 4, {
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeTypeScriptKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagBacktick | OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagSlashComments | OMCodeFlagBlockComments, NULL }
+    } },
+    [OMCodeLanguageJSON] = { 4, {
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagDoubleQuote, NULL },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, 0, NULL },
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeJSONKeywords },
+        { OMCodeRuleJSONKey, OMCodeTokenClassDirective, 0, NULL }
+    } },
+    [OMCodeLanguageBash] = { 5, {
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeBashKeywords },
+        { OMCodeRuleShellVariable, OMCodeTokenClassDirective, 0, NULL },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagHashComments, NULL }
+    } },
+    [OMCodeLanguageMarkdown] = { 6, {
+        { OMCodeRuleMarkdownHeading, OMCodeTokenClassKeyword, 0, NULL },
+        { OMCodeRuleMarkdownLink, OMCodeTokenClassDirective, 0, NULL },
+        { OMCodeRuleMarkdownStrong, OMCodeTokenClassKeyword, 0, NULL },
+        { OMCodeRuleMarkdownEmphasis, OMCodeTokenClassKeyword, 0, NULL },
+        { OMCodeRuleMarkdownCode, OMCodeTokenClassString, 0, NULL },
+        { OMCodeRuleMarkdownMath, OMCodeTokenClassNumber, 0, NULL }
+    } },
+    [OMCodeLanguageYAML] = { 6, {
+        { OMCodeRuleHashCommentLine, OMCodeTokenClassComment, 0, NULL },
+        { OMCodeRuleListMarker, OMCodeTokenClassKeyword, 0, NULL },
+        { OMCodeRuleYAMLKey, OMCodeTokenClassDirective, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeYAMLKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, OMCodeFlagSignedNumbers, NULL }
+    } },
+    [OMCodeLanguageTOML] = { 6, {
+        { OMCodeRuleHashCommentLine, OMCodeTokenClassComment, 0, NULL },
+        { OMCodeRuleTOMLTable, OMCodeTokenClassKeyword, 0, NULL },
+        { OMCodeRuleTOMLKey, OMCodeTokenClassDirective, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeTOMLKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, OMCodeFlagSignedNumbers, NULL }
+    } },
+    [OMCodeLanguageSQL] = { 4, {
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, OMCodeFlagCaseInsensitive, OMCodeSQLKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, OMCodeFlagSignedNumbers, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagSingleQuote | OMCodeFlagDoubleQuote, NULL },
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagDashComments | OMCodeFlagBlockComments, NULL }
+    } },
+    [OMCodeLanguageRuby] = { 5, {
+        { OMCodeRuleKeywords, OMCodeTokenClassKeyword, 0, OMCodeRubyKeywords },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, OMCodeFlagSignedNumbers, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagHashComments, NULL },
+        { OMCodeRuleSymbol, OMCodeTokenClassDirective, 0, NULL }
+    } },
+    [OMCodeLanguageMarkup] = { 5, {
+        { OMCodeRuleComments, OMCodeTokenClassComment, OMCodeFlagMarkupComments | OMCodeFlagBlockComments, NULL },
+        { OMCodeRuleMarkupTag, OMCodeTokenClassKeyword, 0, NULL },
+        { OMCodeRuleMarkupAttribute, OMCodeTokenClassDirective, 0, NULL },
+        { OMCodeRuleStrings, OMCodeTokenClassString, OMCodeFlagDoubleQuote | OMCodeFlagSingleQuote, NULL },
+        { OMCodeRuleNumbers, OMCodeTokenClassNumber, OMCodeFlagSignedNumbers, NULL }
+    } }
+};
+
+static const NSUInteger OMCodeLanguageRuleTableCount = sizeof(OMCodeLanguageRuleTable) / sizeof(OMCodeLanguageRuleTable[0]);
+
+typedef struct {
+    uint32_t hash;
+    uint32_t length;
+    const char *word;
+} OMCodeKeywordSlot;
+
+typedef struct {
+    OMCodeKeywordSlot *slots;
+    NSUInteger slotMask;
+    NSUInteger maximumLength;
+    BOOL caseInsensitive;
+} OMCodeKeywordSet;
+
+typedef struct {
+    const OMCodeLanguageRules *rules;
+    uint8_t startMask[128];
+    uint8_t otherStartMask;
+    uint8_t lineStartMask;
+    OMCodeKeywordSet keywordSets[OMCodeMaxRules];
+} OMCodeLexer;
+
+typedef struct {
+    const unichar *chars;
+    NSUInteger length;
+    // A quote scan from any start before quoteFailure fails the same way.
+    NSUInteger quoteFailure[OMCodeMaxRules][3];
+    // Terminators (bit per OMCodeTerminator) that no longer occur ahead.
+    NSUInteger exhaustedTerminators[OMCodeMaxRules];
+    // Line-anchored rules fail for every line start up to lineFailure.
+    NSUInteger lineFailure[OMCodeMaxRules];
+} OMCodeScan;
+
+typedef NS_ENUM(NSUInteger, OMCodeTerminator) {
+    OMCodeTerminatorTripleSingleQuote = 0,
+    OMCodeTerminatorTripleDoubleQuote = 1,
+    OMCodeTerminatorBlockComment = 2,
+    OMCodeTerminatorMarkupComment = 3,
+    OMCodeTerminatorDisplayMath = 4
+};
+
+static NSCharacterSet *OMCodeAlphanumericCharacterSet(void)
 {
-    if (text == nil || color == nil || [text length] == 0) {
-        return;
-    }
-    NSRegularExpression *regex = OMCachedRegex(pattern, options);
-    if (regex == nil) {
-        return;
-    }
-    NSRange fullRange = NSMakeRange(0, [text length]);
-    NSArray *matches = [regex matchesInString:[text string] options:0 range:fullRange];
-    for (NSTextCheckingResult *match in matches) {
-        NSRange range = [match range];
-        if (range.length == 0) {
-            continue;
-        }
-        [text addAttribute:NSForegroundColorAttributeName value:color range:range];
-    }
-}
-
-static void OMApplyCFamilySyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                             OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*#\\s*[A-Za-z_][A-Za-z0-9_]*.*$",
-                      0,
-                      palette.directiveColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:@interface|@implementation|@end|@property|@synthesize|@dynamic|@protocol|@class|@selector|@autoreleasepool|id|instancetype|self|super|nil|YES|NO|if|else|for|while|switch|case|break|continue|return|typedef|struct|enum|static|const|void|int|float|double|char|long|short|unsigned|signed|BOOL|SEL|Class|namespace|template|typename|using|public|private|protected|virtual|override|constexpr|auto|new|delete|this|nullptr|try|catch|throw|package|import|func|defer|select|go|chan|map|interface|impl|trait|where|match|let|mut|pub|crate|mod|fn|impl|enum|protocol|extension|guard|deinit|class|actor|async|await|yield|throws|throw|nil|true|false|var|val)\\b",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-    OMApplyRegexColor(codeSegment,
-                      @"@?\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)//.*$|/\\*[\\s\\S]*?\\*/",
-                      0,
-                      palette.commentColor);
-}
-
-static void OMApplyPythonSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                            OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*@\\w+",
-                      0,
-                      palette.directiveColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:and|as|assert|async|await|break|class|continue|def|del|elif|else|except|False|finally|for|from|global|if|import|in|is|lambda|None|nonlocal|not|or|pass|raise|return|True|try|while|with|yield)\\b",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?s)(?:'''[\\s\\S]*?'''|\"\"\"[\\s\\S]*?\"\"\"|'(?:[^'\\\\]|\\\\.)*'|\"(?:[^\"\\\\]|\\\\.)*\")",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)#.*$",
-                      0,
-                      palette.commentColor);
-}
-
-static void OMApplyJSSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                        OMCodeSyntaxPalette palette,
-                                        BOOL includeTypeScriptKeywords)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:if|else|for|while|do|switch|case|break|continue|return|function|const|let|var|class|extends|new|try|catch|finally|throw|import|export|default|from|as|this|null|undefined|true|false)\\b",
-                      0,
-                      palette.keywordColor);
-    if (includeTypeScriptKeywords) {
-        OMApplyRegexColor(codeSegment,
-                          @"\\b(?:interface|type|implements|enum|namespace|readonly|public|private|protected|abstract|declare|keyof|infer|unknown|never|any)\\b",
-                          0,
-                          palette.keywordColor);
-    }
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-    OMApplyRegexColor(codeSegment,
-                      @"`(?:[^`\\\\]|\\\\.)*`|\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)//.*$|/\\*[\\s\\S]*?\\*/",
-                      0,
-                      palette.commentColor);
-}
-
-static void OMApplyJSONSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                          OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"\"(?:[^\"\\\\]|\\\\.)*\"",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:true|false|null)\\b",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\"(?:[^\"\\\\]|\\\\.)*\"\\s*:",
-                      0,
-                      palette.directiveColor);
-}
-
-static void OMApplyBashSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                          OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:if|then|else|elif|fi|for|while|do|done|case|esac|function|in|select|until|time)\\b",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\$\\{?[A-Za-z_][A-Za-z0-9_]*\\}?",
-                      0,
-                      palette.directiveColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)#.*$",
-                      0,
-                      palette.commentColor);
-}
-
-static void OMApplyMarkdownSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                              OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s{0,3}#{1,6}\\s+.*$",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\[[^\\]\\n]+\\]\\([^\\)\\n]+\\)",
-                      0,
-                      palette.directiveColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?:\\*\\*[^*\\n]+\\*\\*|__[^_\\n]+__)",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?<!\\*)\\*[^*\\n]+\\*(?!\\*)|(?<!_)_[^_\\n]+_(?!_)",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"`[^`\\n]+`",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\$\\$[\\s\\S]*?\\$\\$|\\$[^$\\n]+\\$",
-                      0,
-                      palette.numberColor);
-}
-
-static void OMApplyYAMLSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                          OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*#.*$",
-                      0,
-                      palette.commentColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*-\\s+",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*[A-Za-z0-9_\\-\"']+\\s*:",
-                      0,
-                      palette.directiveColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:true|false|null|yes|no|on|off)\\b",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-}
-
-static void OMApplyTOMLSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                          OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*#.*$",
-                      0,
-                      palette.commentColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*\\[[^\\]\\n]+\\]",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)^\\s*[A-Za-z0-9_\\.-]+\\s*=",
-                      0,
-                      palette.directiveColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:true|false)\\b",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-}
-
-static void OMApplySQLSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                         OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:SELECT|FROM|WHERE|ORDER|BY|GROUP|HAVING|INSERT|INTO|VALUES|UPDATE|SET|DELETE|CREATE|TABLE|ALTER|DROP|JOIN|LEFT|RIGHT|INNER|OUTER|ON|AS|DISTINCT|LIMIT|OFFSET|UNION|ALL|AND|OR|NOT|NULL|IS|IN|LIKE|CASE|WHEN|THEN|ELSE|END)\\b",
-                      NSRegularExpressionCaseInsensitive,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-    OMApplyRegexColor(codeSegment,
-                      @"'(?:[^'\\\\]|\\\\.)*'|\"(?:[^\"\\\\]|\\\\.)*\"",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)--.*$|/\\*[\\s\\S]*?\\*/",
-                      0,
-                      palette.commentColor);
-}
-
-static void OMApplyRubySyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                          OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:def|class|module|end|if|elsif|else|unless|case|when|while|until|for|in|do|break|next|redo|retry|return|yield|super|self|nil|true|false|and|or|not|begin|rescue|ensure|require|include|extend|attr_reader|attr_writer|attr_accessor)\\b",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)#.*$",
-                      0,
-                      palette.commentColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\:[A-Za-z_][A-Za-z0-9_]*",
-                      0,
-                      palette.directiveColor);
-}
-
-static void OMApplyMarkupSyntaxHighlighting(NSMutableAttributedString *codeSegment,
-                                            OMCodeSyntaxPalette palette)
-{
-    OMApplyRegexColor(codeSegment,
-                      @"(?m)<!--.*?-->|/\\*[\\s\\S]*?\\*/",
-                      NSRegularExpressionDotMatchesLineSeparators,
-                      palette.commentColor);
-    OMApplyRegexColor(codeSegment,
-                      @"</?[A-Za-z][A-Za-z0-9:_-]*",
-                      0,
-                      palette.keywordColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b[A-Za-z_:][A-Za-z0-9_:\\-]*\\s*=",
-                      0,
-                      palette.directiveColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'",
-                      0,
-                      palette.stringColor);
-    OMApplyRegexColor(codeSegment,
-                      @"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b",
-                      0,
-                      palette.numberColor);
+    static NSCharacterSet *set = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        set = [[NSCharacterSet alphanumericCharacterSet] retain];
+    });
+    return set;
 }
 
-static void OMApplyCodeSyntaxHighlighting(cmark_node *codeBlockNode,
-                                          NSMutableAttributedString *codeSegment,
-                                          NSColor *backgroundColor,
-                                          const OMRenderContext *renderContext)
+static NSCharacterSet *OMCodeDecimalDigitCharacterSet(void)
 {
-    if (!OMShouldApplyCodeSyntaxHighlighting(renderContext)) {
-        return;
-    }
+    static NSCharacterSet *set = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        set = [[NSCharacterSet decimalDigitCharacterSet] retain];
+    });
+    return set;
+}
 
-    NSString *token = OMPrimaryFenceToken(codeBlockNode);
-    OMCodeLanguage language = OMLanguageForFenceToken(token);
-    if (language == OMCodeLanguageUnknown) {
-        return;
-    }
+static BOOL OMCodeIsASCIILetter(unichar c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
 
-    OMCodeSyntaxPalette palette = OMCodePaletteForBackground(backgroundColor);
+static BOOL OMCodeIsASCIIDigit(unichar c)
+{
+    return c >= '0' && c <= '9';
+}
 
-    [codeSegment beginEditing];
-    switch (language) {
-        case OMCodeLanguageCFamily:
-            OMApplyCFamilySyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguagePython:
-            OMApplyPythonSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageJavaScript:
-            OMApplyJSSyntaxHighlighting(codeSegment, palette, NO);
-            break;
-        case OMCodeLanguageTypeScript:
-            OMApplyJSSyntaxHighlighting(codeSegment, palette, YES);
-            break;
-        case OMCodeLanguageJSON:
-            OMApplyJSONSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageBash:
-            OMApplyBashSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageMarkdown:
-            OMApplyMarkdownSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageYAML:
-            OMApplyYAMLSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageTOML:
-            OMApplyTOMLSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageSQL:
-            OMApplySQLSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageRuby:
-            OMApplyRubySyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageMarkup:
-            OMApplyMarkupSyntaxHighlighting(codeSegment, palette);
-            break;
-        case OMCodeLanguageUnknown:
-        default:
-            break;
-    }
-    [codeSegment endEditing];
+static BOOL OMCodeIsIdentifierCharacter(unichar c)
+{
+    return OMCodeIsASCIILetter(c) || OMCodeIsASCIIDigit(c) || c == '_';
 }
 
-static void OMAppendString(NSMutableAttributedString *output,
-                           NSString *string,
-                           NSDictionary *attributes)
+// \w
+static BOOL OMCodeIsWordCharacter(unichar c)
 {
-    if (string == nil || [string length] == 0) {
-        return;
+    if (c < 128) {
+        return OMCodeIsIdentifierCharacter(c);
     }
-    NSAttributedString *segment = [[[NSAttributedString alloc] initWithString:string
-                                                                    attributes:attributes] autorelease];
-    [output appendAttributedString:segment];
+    return c == 0x200C || c == 0x200D || [OMCodeAlphanumericCharacterSet() characterIsMember:c];
 }
 
-static void OMAppendAttributedSegment(NSMutableAttributedString *output,
-                                      NSAttributedString *segment)
+// \d
+static BOOL OMCodeIsDigit(unichar c)
 {
-    if (segment == nil || [segment length] == 0) {
-        return;
+    if (c < 128) {
+        return OMCodeIsASCIIDigit(c);
     }
-    [output appendAttributedString:segment];
+    return [OMCodeDecimalDigitCharacterSet() characterIsMember:c];
 }
 
-static NSMutableParagraphStyle *OMParagraphStyleWithIndent(CGFloat firstIndent,
-                                                           CGFloat headIndent,
-                                                           CGFloat spacingAfter,
-                                                           CGFloat lineSpacing,
-                                                           CGFloat lineHeightMultiple,
-                                                           CGFloat fontSize)
+static BOOL OMCodeIsHexDigit(unichar c)
 {
-    NSMutableParagraphStyle *style = [[[NSMutableParagraphStyle alloc] init] autorelease];
-    [style setFirstLineHeadIndent:firstIndent];
-    [style setHeadIndent:headIndent];
-    [style setParagraphSpacing:spacingAfter];
-    [style setLineSpacing:lineSpacing];
-    [style setLineHeightMultiple:lineHeightMultiple];
-    if (fontSize > 0.0 && lineHeightMultiple > 0.0) {
-        CGFloat lineHeight = fontSize * lineHeightMultiple;
-        [style setMinimumLineHeight:lineHeight];
-    }
-    return style;
+    return OMCodeIsASCIIDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
 }
 
-static void OMTrimTrailingNewlines(NSMutableAttributedString *output)
+// \s, i.e. [\t\n\f\r\p{Z}]
+static BOOL OMCodeIsSpace(unichar c)
 {
-    while ([output length] > 0) {
-        unichar ch = [[output string] characterAtIndex:[output length] - 1];
-        if (ch == '\n') {
-            [output deleteCharactersInRange:NSMakeRange([output length] - 1, 1)];
-        } else {
-            break;
-        }
+    if (c < 128) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
     }
+    return c == 0x00A0 || c == 0x1680 || (c >= 0x2000 && c <= 0x200A) ||
+           c == 0x2028 || c == 0x2029 || c == 0x202F || c == 0x205F || c == 0x3000;
 }
 
-static NSArray *OMSourceLinesForMarkdown(NSString *markdown)
+// What . refuses to match and where (?m)^ and $ anchor.
+static BOOL OMCodeIsLineTerminator(unichar c)
 {
-    NSMutableArray *lines = [NSMutableArray array];
-    if (markdown == nil || [markdown length] == 0) {
-        return lines;
-    }
+    return c == '\n' || c == 0x0B || c == '\f' || c == '\r' ||
+           c == 0x0085 || c == 0x2028 || c == 0x2029;
+}
 
-    NSUInteger totalLength = [markdown length];
-    NSUInteger cursor = 0;
-    while (cursor < totalLength) {
-        NSRange lineRange = [markdown lineRangeForRange:NSMakeRange(cursor, 0)];
-        NSUInteger lineStart = lineRange.location;
-        NSUInteger contentLength = lineRange.length;
+static unichar OMCodeCharacterAt(const OMCodeScan *scan, NSUInteger index)
+{
+    return index < scan->length ? scan->chars[index] : 0;
+}
 
-        while (contentLength > 0) {
-            unichar ch = [markdown characterAtIndex:lineStart + contentLength - 1];
-            if (ch == '\n' || ch == '\r') {
-                contentLength -= 1;
-                continue;
-            }
-            break;
-        }
+static BOOL OMCodeWordCharacterAt(const OMCodeScan *scan, NSUInteger index)
+{
+    return index < scan->length && OMCodeIsWordCharacter(scan->chars[index]);
+}
 
-        NSString *line = [markdown substringWithRange:NSMakeRange(lineStart, contentLength)];
-        [lines addObject:line];
-        cursor = NSMaxRange(lineRange);
-    }
-    return lines;
+static BOOL OMCodeIsWordBoundary(const OMCodeScan *scan, NSUInteger index)
+{
+    BOOL wordBefore = index > 0 && OMCodeIsWordCharacter(scan->chars[index - 1]);
+    return wordBefore != OMCodeWordCharacterAt(scan, index);
 }
 
-static NSString *OMNormalizedBlockIDText(NSString *text)
+static BOOL OMCodeIsLineStart(const unichar *chars, NSUInteger index)
 {
-    if (text == nil || [text length] == 0) {
-        return @"";
+    if (index == 0) {
+        return YES;
     }
+    unichar previous = chars[index - 1];
+    return OMCodeIsLineTerminator(previous) && !(previous == '\r' && chars[index] == '\n');
+}
 
-    NSMutableString *normalized = [NSMutableString stringWithCapacity:[text length]];
-    NSCharacterSet *alphanumeric = [NSCharacterSet alphanumericCharacterSet];
-    BOOL previousWasSpace = YES;
-    NSUInteger length = [text length];
-    NSUInteger i = 0;
-    for (; i < length; i++) {
-        unichar ch = [text characterAtIndex:i];
-        if ([alphanumeric characterIsMember:ch]) {
-            NSString *s = [[NSString stringWithCharacters:&ch length:1] lowercaseString];
-            [normalized appendString:s];
-            previousWasSpace = NO;
-        } else if (!previousWasSpace) {
-            [normalized appendString:@" "];
-            previousWasSpace = YES;
-        }
+static NSUInteger OMCodeLineEnd(const OMCodeScan *scan, NSUInteger index)
+{
+    while (index < scan->length && !OMCodeIsLineTerminator(scan->chars[index])) {
+        index += 1;
     }
+    return index;
+}
 
-    while ([normalized hasSuffix:@" "]) {
-        [normalized deleteCharactersInRange:NSMakeRange([normalized length] - 1, 1)];
+static NSUInteger OMCodeSkipSpaces(const OMCodeScan *scan, NSUInteger index)
+{
+    while (index < scan->length && OMCodeIsSpace(scan->chars[index])) {
+        index += 1;
     }
-    return normalized;
+    return index;
 }
 
-static BOOL OMNodeLineBounds(cmark_node *node, NSUInteger *startLineOut, NSUInteger *endLineOut)
+static uint32_t OMCodeKeywordHashStep(uint32_t hash, unichar c)
+{
+    return (hash ^ (uint32_t)c) * 16777619u;
+}
+
+static unichar OMCodeFoldASCII(unichar c, BOOL caseInsensitive)
+{
+    return (caseInsensitive && c >= 'A' && c <= 'Z') ? (unichar)(c + ('a' - 'A')) : c;
+}
+
+static void OMCodeKeywordSetBuild(OMCodeKeywordSet *set, const char *list, BOOL caseInsensitive, uint8_t *startMask, uint8_t bit)
+{
+    char *storage = strdup(list);
+    NSUInteger wordCount = 0;
+    const char *cursor = list;
+    for (; *cursor != '\0'; cursor++) {
+        if (*cursor != ' ' && (cursor == list || cursor[-1] == ' ')) {
+            wordCount += 1;
+        }
+    }
+
+    NSUInteger slotCount = 16;
+    while (slotCount < wordCount * 2) {
+        slotCount *= 2;
+    }
+    set->slots = calloc(slotCount, sizeof(OMCodeKeywordSlot));
+    set->slotMask = slotCount - 1;
+    set->maximumLength = 0;
+    set->caseInsensitive = caseInsensitive;
+    if (storage == NULL || set->slots == NULL) {
+        free(storage);
+        free(set->slots);
+        set->slots = NULL;
+        return;
+    }
+
+    char *word = storage;
+    while (*word != '\0') {
+        if (*word == ' ') {
+            word += 1;
+            continue;
+        }
+        char *wordEnd = word;
+        while (*wordEnd != '\0' && *wordEnd != ' ') {
+            wordEnd += 1;
+        }
+        BOOL lastWord = (*wordEnd == '\0');
+        *wordEnd = '\0';
+
+        uint32_t hash = 2166136261u;
+        uint32_t length = 0;
+        for (; word[length] != '\0'; length++) {
+            if (caseInsensitive && word[length] >= 'A' && word[length] <= 'Z') {
+                word[length] = (char)(word[length] + ('a' - 'A'));
+            }
+            hash = OMCodeKeywordHashStep(hash, (unichar)(unsigned char)word[length]);
+        }
+        NSUInteger slot = hash & set->slotMask;
+        BOOL duplicate = NO;
+        while (set->slots[slot].word != NULL) {
+            if (set->slots[slot].hash == hash && strcmp(set->slots[slot].word, word) == 0) {
+                duplicate = YES;
+                break;
+            }
+            slot = (slot + 1) & set->slotMask;
+        }
+        if (!duplicate) {
+            set->slots[slot].hash = hash;
+            set->slots[slot].length = length;
+            set->slots[slot].word = word;
+            if (length > set->maximumLength) {
+                set->maximumLength = length;
+            }
+            unsigned char first = (unsigned char)word[0];
+            startMask[first] |= bit;
+            if (caseInsensitive && first >= 'a' && first <= 'z') {
+                startMask[first - ('a' - 'A')] |= bit;
+            }
+        }
+        if (lastWord) {
+            break;
+        }
+        word = wordEnd + 1;
+    }
+}
+
+static BOOL OMCodeKeywordSetContains(const OMCodeKeywordSet *set, const unichar *chars, NSUInteger start, NSUInteger end)
+{
+    NSUInteger length = end - start;
+    if (set->slots == NULL || length == 0 || length > set->maximumLength) {
+        return NO;
+    }
+    uint32_t hash = 2166136261u;
+    NSUInteger index = start;
+    for (; index < end; index++) {
+        if (chars[index] >= 128) {
+            return NO;
+        }
+        hash = OMCodeKeywordHashStep(hash, OMCodeFoldASCII(chars[index], set->caseInsensitive));
+    }
+
+    NSUInteger slot = hash & set->slotMask;
+    while (set->slots[slot].word != NULL) {
+        const OMCodeKeywordSlot *candidate = &set->slots[slot];
+        if (candidate->hash == hash && candidate->length == length) {
+            NSUInteger offset = 0;
+            while (offset < length &&
+                   (unichar)(unsigned char)candidate->word[offset] == OMCodeFoldASCII(chars[start + offset], set->caseInsensitive)) {
+                offset += 1;
+            }
+            if (offset == length) {
+                return YES;
+            }
+        }
+        slot = (slot + 1) & set->slotMask;
+    }
+    return NO;
+}
+
+static void OMCodeLexerBuild(OMCodeLexer *lexer, const OMCodeLanguageRules *rules)
+{
+    lexer->rules = rules;
+    NSUInteger ruleIndex = 0;
+    for (; ruleIndex < rules->ruleCount; ruleIndex++) {
+        const OMCodeRule *rule = &rules->rules[ruleIndex];
+        uint8_t bit = (uint8_t)(1u << ruleIndex);
+        uint8_t *mask = lexer->startMask;
+        unichar c = 0;
+        switch (rule->kind) {
+            case OMCodeRuleKeywords:
+                OMCodeKeywordSetBuild(&lexer->keywordSets[ruleIndex],
+                                      rule->keywords,
+                                      (rule->flags & OMCodeFlagCaseInsensitive) != 0,
+                                      mask,
+                                      bit);
+                break;
+            case OMCodeRuleNumbers:
+                for (c = '0'; c <= '9'; c++) {
+                    mask[c] |= bit;
+                }
+                if ((rule->flags & OMCodeFlagSignedNumbers) != 0) {
+                    mask['-'] |= bit;
+                }
+                lexer->otherStartMask |= bit;
+                break;
+            case OMCodeRuleStrings:
+                if ((rule->flags & OMCodeFlagDoubleQuote) != 0) {
+                    mask['"'] |= bit;
+                }
+                if ((rule->flags & OMCodeFlagSingleQuote) != 0) {
+                    mask['\''] |= bit;
+                }
+                if ((rule->flags & OMCodeFlagBacktick) != 0) {
+                    mask['`'] |= bit;
+                }
+                if ((rule->flags & OMCodeFlagAtPrefix) != 0) {
+                    mask['@'] |= bit;
+                }
+                break;
+            case OMCodeRuleComments:
+                if ((rule->flags & (OMCodeFlagSlashComments | OMCodeFlagBlockComments)) != 0) {
+                    mask['/'] |= bit;
+                }
+                if ((rule->flags & OMCodeFlagHashComments) != 0) {
+                    mask['#'] |= bit;
+                }
+                if ((rule->flags & OMCodeFlagDashComments) != 0) {
+                    mask['-'] |= bit;
+                }
+                if ((rule->flags & OMCodeFlagMarkupComments) != 0) {
+                    mask['<'] |= bit;
+                }
+                break;
+            case OMCodeRuleJSONKey:
+                mask['"'] |= bit;
+                break;
+            case OMCodeRuleShellVariable:
+            case OMCodeRuleMarkdownMath:
+                mask['$'] |= bit;
+                break;
+            case OMCodeRuleSymbol:
+                mask[':'] |= bit;
+                break;
+            case OMCodeRuleMarkupTag:
+                mask['<'] |= bit;
+                break;
+            case OMCodeRuleMarkupAttribute:
+                for (c = 0; c < 128; c++) {
+                    if (OMCodeIsASCIILetter(c) || c == '_' || c == ':') {
+                        mask[c] |= bit;
+                    }
+                }
+                break;
+            case OMCodeRuleMarkdownLink:
+                mask['['] |= bit;
+                break;
+            case OMCodeRuleMarkdownStrong:
+            case OMCodeRuleMarkdownEmphasis:
+                mask['*'] |= bit;
+                mask['_'] |= bit;
+                break;
+            case OMCodeRuleMarkdownCode:
+                mask['`'] |= bit;
+                break;
+            case OMCodeRulePreprocessorLine:
+            case OMCodeRuleDecorator:
+            case OMCodeRuleHashCommentLine:
+            case OMCodeRuleListMarker:
+            case OMCodeRuleYAMLKey:
+            case OMCodeRuleTOMLTable:
+            case OMCodeRuleTOMLKey:
+            case OMCodeRuleMarkdownHeading:
+                lexer->lineStartMask |= bit;
+                break;
+        }
+    }
+}
+
+static const OMCodeLexer *OMCodeLexerForLanguage(OMCodeLanguage language)
+{
+    static OMCodeLexer *lexers = NULL;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        lexers = calloc(OMCodeLanguageRuleTableCount, sizeof(OMCodeLexer));
+        if (lexers == NULL) {
+            return;
+        }
+        NSUInteger index = 0;
+        for (; index < OMCodeLanguageRuleTableCount; index++) {
+            if (OMCodeLanguageRuleTable[index].ruleCount > 0) {
+                OMCodeLexerBuild(&lexers[index], &OMCodeLanguageRuleTable[index]);
+            }
+        }
+    });
+    if (lexers == NULL || (NSUInteger)language >= OMCodeLanguageRuleTableCount ||
+        lexers[language].rules == NULL) {
+        return NULL;
+    }
+    return &lexers[language];
+}
+
+// Returns the index after the closing quote of the string opened at start,
+// or 0. A backslash escapes one character other than a line terminator
+// unless escapedNewlines is set.
+static NSUInteger OMCodeMatchQuoted(OMCodeScan *scan,
+                                    NSUInteger ruleIndex,
+                                    NSUInteger start,
+                                    BOOL escapedNewlines)
+{
+    unichar quote = scan->chars[start];
+    NSUInteger slot = quote == '"' ? 0 : (quote == '\'' ? 1 : 2);
+    if (start < scan->quoteFailure[ruleIndex][slot]) {
+        return 0;
+    }
+
+    NSUInteger index = start + 1;
+    while (index < scan->length) {
+        unichar c = scan->chars[index];
+        if (c == '\\') {
+            if (index + 1 >= scan->length ||
+                (!escapedNewlines && OMCodeIsLineTerminator(scan->chars[index + 1]))) {
+                scan->quoteFailure[ruleIndex][slot] = index;
+                return 0;
+            }
+            index += 2;
+            continue;
+        }
+        if (c == quote) {
+            return index + 1;
+        }
+        index += 1;
+    }
+    scan->quoteFailure[ruleIndex][slot] = scan->length;
+    return 0;
+}
+
+// Index of the next occurrence of terminator at or after from, or NSNotFound.
+static NSUInteger OMCodeFindTerminator(OMCodeScan *scan,
+                                       NSUInteger ruleIndex,
+                                       OMCodeTerminator terminator,
+                                       NSUInteger from)
+{
+    static const unichar terminators[][3] = {
+        { '\'', '\'', '\'' },
+        { '"', '"', '"' },
+        { '*', '/', 0 },
+        { '-', '-', '>' },
+        { '$', '$', 0 }
+    };
+    NSUInteger bit = (NSUInteger)1 << terminator;
+    if ((scan->exhaustedTerminators[ruleIndex] & bit) != 0) {
+        return NSNotFound;
+    }
+
+    const unichar *needle = terminators[terminator];
+    NSUInteger needleLength = needle[2] != 0 ? 3 : 2;
+    NSUInteger index = from;
+    for (; index + needleLength <= scan->length; index++) {
+        if (scan->chars[index] == needle[0] &&
+            scan->chars[index + 1] == needle[1] &&
+            (needleLength == 2 || scan->chars[index + 2] == needle[2])) {
+            return index;
+        }
+    }
+    scan->exhaustedTerminators[ruleIndex] |= bit;
+    return NSNotFound;
+}
+
+static NSUInteger OMCodeMatchNumber(const OMCodeScan *scan, NSUInteger start, BOOL signedNumbers)
+{
+    const unichar *chars = scan->chars;
+    if (!OMCodeIsWordBoundary(scan, start)) {
+        return 0;
+    }
+
+    NSUInteger digits = start;
+    if (chars[start] == '-') {
+        if (!signedNumbers || start + 1 >= scan->length || !OMCodeIsDigit(chars[start + 1])) {
+            return 0;
+        }
+        digits = start + 1;
+    } else if (!OMCodeIsDigit(chars[start])) {
+        return 0;
+    }
+
+    if (digits == start && chars[start] == '0' &&
+        OMCodeCharacterAt(scan, start + 1) == 'x' &&
+        OMCodeIsHexDigit(OMCodeCharacterAt(scan, start + 2))) {
+        NSUInteger end = start + 2;
+        while (end < scan->length && OMCodeIsHexDigit(chars[end])) {
+            end += 1;
+        }
+        if (!OMCodeWordCharacterAt(scan, end)) {
+            return end;
+        }
+    }
+
+    NSUInteger end = digits;
+    while (end < scan->length && OMCodeIsDigit(chars[end])) {
+        end += 1;
+    }
+    if (OMCodeCharacterAt(scan, end) == '.' && end + 1 < scan->length && OMCodeIsDigit(chars[end + 1])) {
+        NSUInteger fractionEnd = end + 1;
+        while (fractionEnd < scan->length && OMCodeIsDigit(chars[fractionEnd])) {
+            fractionEnd += 1;
+        }
+        if (!OMCodeWordCharacterAt(scan, fractionEnd)) {
+            return fractionEnd;
+        }
+    }
+    return OMCodeWordCharacterAt(scan, end) ? 0 : end;
+}
+
+static NSUInteger OMCodeMatchKeyword(const OMCodeScan *scan, const OMCodeKeywordSet *set, NSUInteger start)
+{
+    if (!OMCodeIsWordBoundary(scan, start)) {
+        return 0;
+    }
+    NSUInteger end = start;
+    if (scan->chars[end] == '@') {
+        end += 1;
+    }
+    while (end < scan->length && OMCodeIsWordCharacter(scan->chars[end])) {
+        end += 1;
+    }
+    return OMCodeKeywordSetContains(set, scan->chars, start, end) ? end : 0;
+}
+
+// [^<delimiter>\n]+<delimiter>, returning the index of the delimiter or 0.
+static NSUInteger OMCodeScanToDelimiter(const OMCodeScan *scan, NSUInteger from, unichar delimiter)
+{
+    NSUInteger index = from;
+    while (index < scan->length && scan->chars[index] != delimiter && scan->chars[index] != '\n') {
+        index += 1;
+    }
+    if (index == from || OMCodeCharacterAt(scan, index) != delimiter) {
+        return 0;
+    }
+    return index;
+}
+
+static NSUInteger OMCodeMatchRule(OMCodeScan *scan, const OMCodeLexer *lexer, NSUInteger ruleIndex, NSUInteger start)
+{
+    const OMCodeRule *rule = &lexer->rules->rules[ruleIndex];
+    const unichar *chars = scan->chars;
+    unichar c = chars[start];
+    NSUInteger end = 0;
+    switch (rule->kind) {
+        case OMCodeRuleKeywords:
+            return OMCodeMatchKeyword(scan, &lexer->keywordSets[ruleIndex], start);
+
+        case OMCodeRuleNumbers:
+            return OMCodeMatchNumber(scan, start, (rule->flags & OMCodeFlagSignedNumbers) != 0);
+
+        case OMCodeRuleStrings: {
+            BOOL escapedNewlines = (rule->flags & OMCodeFlagEscapedNewlines) != 0;
+            if (c == '@') {
+                if ((rule->flags & OMCodeFlagAtPrefix) == 0 || OMCodeCharacterAt(scan, start + 1) != '"') {
+                    return 0;
+                }
+                return OMCodeMatchQuoted(scan, ruleIndex, start + 1, escapedNewlines);
+            }
+            if ((rule->flags & OMCodeFlagTripleQuotes) != 0 &&
+                (c == '\'' || c == '"') &&
+                OMCodeCharacterAt(scan, start + 1) == c &&
+                OMCodeCharacterAt(scan, start + 2) == c) {
+                OMCodeTerminator terminator = c == '\'' ? OMCodeTerminatorTripleSingleQuote : OMCodeTerminatorTripleDoubleQuote;
+                NSUInteger close = OMCodeFindTerminator(scan, ruleIndex, terminator, start + 3);
+                if (close != NSNotFound) {
+                    return close + 3;
+                }
+            }
+            return OMCodeMatchQuoted(scan, ruleIndex, start, escapedNewlines);
+        }
+
+        case OMCodeRuleComments: {
+            unichar next = OMCodeCharacterAt(scan, start + 1);
+            if (c == '/' && next == '/' && (rule->flags & OMCodeFlagSlashComments) != 0) {
+                return OMCodeLineEnd(scan, start);
+            }
+            if (c == '/' && next == '*' && (rule->flags & OMCodeFlagBlockComments) != 0) {
+                NSUInteger close = OMCodeFindTerminator(scan, ruleIndex, OMCodeTerminatorBlockComment, start + 2);
+                return close != NSNotFound ? close + 2 : 0;
+            }
+            if (c == '#' && (rule->flags & OMCodeFlagHashComments) != 0) {
+                return OMCodeLineEnd(scan, start);
+            }
+            if (c == '-' && next == '-' && (rule->flags & OMCodeFlagDashComments) != 0) {
+                return OMCodeLineEnd(scan, start);
+            }
+            if (c == '<' && next == '!' &&
+                OMCodeCharacterAt(scan, start + 2) == '-' &&
+                OMCodeCharacterAt(scan, start + 3) == '-' &&
+                (rule->flags & OMCodeFlagMarkupComments) != 0) {
+                NSUInteger close = OMCodeFindTerminator(scan, ruleIndex, OMCodeTerminatorMarkupComment, start + 4);
+                return close != NSNotFound ? close + 3 : 0;
+            }
+            return 0;
+        }
+
+        case OMCodeRuleJSONKey:
+            end = OMCodeMatchQuoted(scan, ruleIndex, start, NO);
+            if (end == 0) {
+                return 0;
+            }
+            end = OMCodeSkipSpaces(scan, end);
+            return OMCodeCharacterAt(scan, end) == ':' ? end + 1 : 0;
+
+        case OMCodeRuleShellVariable:
+            end = start + 1;
+            if (OMCodeCharacterAt(scan, end) == '{') {
+                end += 1;
+            }
+            if (!OMCodeIsASCIILetter(OMCodeCharacterAt(scan, end)) && OMCodeCharacterAt(scan, end) != '_') {
+                return 0;
+            }
+            while (end < scan->length && OMCodeIsIdentifierCharacter(chars[end])) {
+                end += 1;
+            }
+            if (OMCodeCharacterAt(scan, end) == '}') {
+                end += 1;
+            }
+            return end;
+
+        case OMCodeRuleSymbol:
+            if (!OMCodeIsASCIILetter(OMCodeCharacterAt(scan, start + 1)) && OMCodeCharacterAt(scan, start + 1) != '_') {
+                return 0;
+            }
+            end = start + 2;
+            while (end < scan->length && OMCodeIsIdentifierCharacter(chars[end])) {
+                end += 1;
+            }
+            return end;
+
+        case OMCodeRuleMarkupTag:
+            end = start + 1;
+            if (OMCodeCharacterAt(scan, end) == '/') {
+                end += 1;
+            }
+            if (!OMCodeIsASCIILetter(OMCodeCharacterAt(scan, end))) {
+                return 0;
+            }
+            end += 1;
+            while (end < scan->length &&
+                   (OMCodeIsASCIILetter(chars[end]) || OMCodeIsASCIIDigit(chars[end]) ||
+                    chars[end] == ':' || chars[end] == '_' || chars[end] == '-')) {
+                end += 1;
+            }
+            return end;
+
+        case OMCodeRuleMarkupAttribute:
+            if (!OMCodeIsWordBoundary(scan, start)) {
+                return 0;
+            }
+            end = start + 1;
+            while (end < scan->length &&
+                   (OMCodeIsIdentifierCharacter(chars[end]) || chars[end] == ':' || chars[end] == '-')) {
+                end += 1;
+            }
+            end = OMCodeSkipSpaces(scan, end);
+            return OMCodeCharacterAt(scan, end) == '=' ? end + 1 : 0;
+
+        case OMCodeRuleMarkdownLink: {
+            NSUInteger labelEnd = OMCodeScanToDelimiter(scan, start + 1, ']');
+            if (labelEnd == 0 || OMCodeCharacterAt(scan, labelEnd + 1) != '(') {
+                return 0;
+            }
+            NSUInteger destinationEnd = OMCodeScanToDelimiter(scan, labelEnd + 2, ')');
+            return destinationEnd != 0 ? destinationEnd + 1 : 0;
+        }
+
+        case OMCodeRuleMarkdownStrong:
+            if (OMCodeCharacterAt(scan, start + 1) != c) {
+                return 0;
+            }
+            end = OMCodeScanToDelimiter(scan, start + 2, c);
+            return (end != 0 && OMCodeCharacterAt(scan, end + 1) == c) ? end + 2 : 0;
+
+        case OMCodeRuleMarkdownEmphasis:
+            if (start > 0 && chars[start - 1] == c) {
+                return 0;
+            }
+            end = OMCodeScanToDelimiter(scan, start + 1, c);
+            return (end != 0 && OMCodeCharacterAt(scan, end + 1) != c) ? end + 1 : 0;
+
+        case OMCodeRuleMarkdownCode:
+            end = OMCodeScanToDelimiter(scan, start + 1, '`');
+            return end != 0 ? end + 1 : 0;
+
+        case OMCodeRuleMarkdownMath:
+            if (OMCodeCharacterAt(scan, start + 1) == '$') {
+                NSUInteger close = OMCodeFindTerminator(scan, ruleIndex, OMCodeTerminatorDisplayMath, start + 2);
+                return close != NSNotFound ? close + 2 : 0;
+            }
+            end = OMCodeScanToDelimiter(scan, start + 1, '$');
+            return end != 0 ? end + 1 : 0;
+
+        case OMCodeRuleMarkdownHeading: {
+            NSUInteger index = start;
+            NSUInteger spaces = 0;
+            while (spaces < 3 && index < scan->length && OMCodeIsSpace(chars[index])) {
+                index += 1;
+                spaces += 1;
+            }
+            NSUInteger hashes = 0;
+            while (hashes < 6 && OMCodeCharacterAt(scan, index) == '#') {
+                index += 1;
+                hashes += 1;
+            }
+            if (hashes == 0 || index >= scan->length || !OMCodeIsSpace(chars[index])) {
+                return 0;
+            }
+            return OMCodeLineEnd(scan, OMCodeSkipSpaces(scan, index));
+        }
+
+        case OMCodeRulePreprocessorLine:
+        case OMCodeRuleDecorator:
+        case OMCodeRuleHashCommentLine:
+        case OMCodeRuleListMarker:
+        case OMCodeRuleYAMLKey:
+        case OMCodeRuleTOMLTable:
+        case OMCodeRuleTOMLKey:
+            break;
+    }
+
+    // ^\s* rules: every line start inside one run of spaces reaches the same
+    // first non-space character, so a failure covers the whole run.
+    if (scan->lineFailure[ruleIndex] != NSNotFound && start <= scan->lineFailure[ruleIndex]) {
+        return 0;
+    }
+    NSUInteger first = OMCodeSkipSpaces(scan, start);
+    unichar head = OMCodeCharacterAt(scan, first);
+    end = 0;
+    switch (rule->kind) {
+        case OMCodeRulePreprocessorLine:
+            if (head == '#') {
+                NSUInteger name = OMCodeSkipSpaces(scan, first + 1);
+                unichar nameHead = OMCodeCharacterAt(scan, name);
+                if (OMCodeIsASCIILetter(nameHead) || nameHead == '_') {
+                    end = OMCodeLineEnd(scan, name);
+                }
+            }
+            break;
+        case OMCodeRuleDecorator:
+            if (head == '@' && OMCodeWordCharacterAt(scan, first + 1)) {
+                end = first + 1;
+                while (OMCodeWordCharacterAt(scan, end)) {
+                    end += 1;
+                }
+            }
+            break;
+        case OMCodeRuleHashCommentLine:
+            if (head == '#') {
+                end = OMCodeLineEnd(scan, first);
+            }
+            break;
+        case OMCodeRuleListMarker:
+            if (head == '-' && first + 1 < scan->length && OMCodeIsSpace(chars[first + 1])) {
+                end = OMCodeSkipSpaces(scan, first + 1);
+            }
+            break;
+        case OMCodeRuleYAMLKey:
+        case OMCodeRuleTOMLKey: {
+            BOOL yaml = rule->kind == OMCodeRuleYAMLKey;
+            NSUInteger index = first;
+            while (index < scan->length &&
+                   (OMCodeIsIdentifierCharacter(chars[index]) || chars[index] == '-' ||
+                    (yaml ? (chars[index] == '"' || chars[index] == '\'') : chars[index] == '.'))) {
+                index += 1;
+            }
+            if (index > first) {
+                index = OMCodeSkipSpaces(scan, index);
+                if (OMCodeCharacterAt(scan, index) == (yaml ? ':' : '=')) {
+                    end = index + 1;
+                }
+            }
+            break;
+        }
+        case OMCodeRuleTOMLTable:
+            if (head == '[') {
+                NSUInteger close = OMCodeScanToDelimiter(scan, first + 1, ']');
+                end = close != 0 ? close + 1 : 0;
+            }
+            break;
+        default:
+            break;
+    }
+    if (end == 0) {
+        scan->lineFailure[ruleIndex] = first;
+    }
+    return end;
+}
+
+static NSColor *OMCodeColorForTokenClass(OMCodeTokenClass tokenClass, const OMCodeSyntaxPalette *palette)
+{
+    switch (tokenClass) {
+        case OMCodeTokenClassKeyword:
+            return palette->keywordColor;
+        case OMCodeTokenClassComment:
+            return palette->commentColor;
+        case OMCodeTokenClassString:
+            return palette->stringColor;
+        case OMCodeTokenClassNumber:
+            return palette->numberColor;
+        case OMCodeTokenClassDirective:
+            return palette->directiveColor;
+        case OMCodeTokenClassNone:
+        default:
+            return nil;
+    }
+}
+
+static void OMCodeApplyTokenRun(NSMutableAttributedString *codeSegment,
+                                OMCodeTokenClass tokenClass,
+                                NSUInteger start,
+                                NSUInteger end,
+                                const OMCodeSyntaxPalette *palette)
+{
+    NSColor *color = OMCodeColorForTokenClass(tokenClass, palette);
+    if (color == nil || end <= start) {
+        return;
+    }
+    [codeSegment addAttribute:NSForegroundColorAttributeName
+                        value:color
+                        range:NSMakeRange(start, end - start)];
+}
+
+static void OMApplyCodeLexer(NSMutableAttributedString *codeSegment,
+                             const OMCodeLexer *lexer,
+                             OMCodeSyntaxPalette palette)
+{
+    NSString *string = [codeSegment string];
+    NSUInteger length = [string length];
+    if (length == 0) {
+        return;
+    }
+    unichar *chars = malloc(sizeof(unichar) * length);
+    if (chars == NULL) {
+        return;
+    }
+    [string getCharacters:chars range:NSMakeRange(0, length)];
+
+    OMCodeScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.chars = chars;
+    scan.length = length;
+    NSUInteger ruleCount = lexer->rules->ruleCount;
+    NSUInteger ruleIndex = 0;
+    for (; ruleIndex < OMCodeMaxRules; ruleIndex++) {
+        scan.lineFailure[ruleIndex] = NSNotFound;
+    }
+
+    // resumeAt: where each rule may match next. activeEnd: end of each
+    // rule's current match; the highest active rule paints the character.
+    NSUInteger resumeAt[OMCodeMaxRules] = { 0 };
+    NSUInteger activeEnd[OMCodeMaxRules] = { 0 };
+    OMCodeTokenClass currentClass = OMCodeTokenClassNone;
+    NSUInteger currentClassEnd = 0;
+    OMCodeTokenClass runClass = OMCodeTokenClassNone;
+    NSUInteger runStart = 0;
+    NSUInteger index = 0;
+    for (; index < length; index++) {
+        unichar c = chars[index];
+        uint8_t candidates = c < 128 ? lexer->startMask[c] : lexer->otherStartMask;
+        if (lexer->lineStartMask != 0 && OMCodeIsLineStart(chars, index)) {
+            candidates |= lexer->lineStartMask;
+        }
+
+        BOOL matched = NO;
+        for (ruleIndex = 0; candidates != 0 && ruleIndex < ruleCount; ruleIndex++) {
+            if ((candidates & (1u << ruleIndex)) == 0 || resumeAt[ruleIndex] > index) {
+                continue;
+            }
+            NSUInteger end = OMCodeMatchRule(&scan, lexer, ruleIndex, index);
+            if (end > index) {
+                resumeAt[ruleIndex] = end;
+                activeEnd[ruleIndex] = end;
+                matched = YES;
+            }
+        }
+
+        if (matched || index >= currentClassEnd) {
+            currentClass = OMCodeTokenClassNone;
+            currentClassEnd = NSUIntegerMax;
+            for (ruleIndex = ruleCount; ruleIndex > 0; ruleIndex--) {
+                if (activeEnd[ruleIndex - 1] > index) {
+                    currentClass = lexer->rules->rules[ruleIndex - 1].tokenClass;
+                    currentClassEnd = activeEnd[ruleIndex - 1];
+                    break;
+                }
+            }
+        }
+
+        if (currentClass != runClass) {
+            OMCodeApplyTokenRun(codeSegment, runClass, runStart, index, &palette);
+            runClass = currentClass;
+            runStart = index;
+        }
+    }
+    OMCodeApplyTokenRun(codeSegment, runClass, runStart, length, &palette);
+    free(chars);
+}
+
+static void OMApplyCodeSyntaxHighlighting(cmark_node *codeBlockNode,
+                                          NSMutableAttributedString *codeSegment,
+                                          NSColor *backgroundColor,
+                                          const OMRenderContext *renderContext)
+{
+    if (!OMShouldApplyCodeSyntaxHighlighting(renderContext)) {
+        return;
+    }
+
+    NSString *token = OMPrimaryFenceToken(codeBlockNode);
+    OMCodeLanguage language = OMLanguageForFenceToken(token);
+    const OMCodeLexer *lexer = OMCodeLexerForLanguage(language);
+    if (lexer == NULL) {
+        return;
+    }
+
+    OMCodeSyntaxPalette palette = OMCodePaletteForBackground(backgroundColor);
+
+    [codeSegment beginEditing];
+    OMApplyCodeLexer(codeSegment, lexer, palette);
+    [codeSegment endEditing];
+}
+
+static void OMAppendString(NSMutableAttributedString *output,
+                           NSString *string,
+                           NSDictionary *attributes)
+{
+    if (string == nil || [string length] == 0) {
+        return;
+    }
+    NSAttributedString *segment = [[[NSAttributedString alloc] initWithString:string
+                                                                    attributes:attributes] autorelease];
+    [output appendAttributedString:segment];
+}
+
+static void OMAppendAttributedSegment(NSMutableAttributedString *output,
+                                      NSAttributedString *segment)
+{
+    if (segment == nil || [segment length] == 0) {
+        return;
+    }
+    [output appendAttributedString:segment];
+}
+
+static NSMutableParagraphStyle *OMParagraphStyleWithIndent(CGFloat firstIndent,
+                                                           CGFloat headIndent,
+                                                           CGFloat spacingAfter,
+                                                           CGFloat lineSpacing,
+                                                           CGFloat lineHeightMultiple,
+                                                           CGFloat fontSize)
+{
+    NSMutableParagraphStyle *style = [[[NSMutableParagraphStyle alloc] init] autorelease];
+    [style setFirstLineHeadIndent:firstIndent];
+    [style setHeadIndent:headIndent];
+    [style setParagraphSpacing:spacingAfter];
+    [style setLineSpacing:lineSpacing];
+    [style setLineHeightMultiple:lineHeightMultiple];
+    if (fontSize > 0.0 && lineHeightMultiple > 0.0) {
+        CGFloat lineHeight = fontSize * lineHeightMultiple;
+        [style setMinimumLineHeight:lineHeight];
+    }
+    return style;
+}
+
+static void OMTrimTrailingNewlines(NSMutableAttributedString *output)
+{
+    while ([output length] > 0) {
+        unichar ch = [[output string] characterAtIndex:[output length] - 1];
+        if (ch == '\n') {
+            [output deleteCharactersInRange:NSMakeRange([output length] - 1, 1)];
+        } else {
+            break;
+        }
+    }
+}
+
+static NSString *OMNormalizedBlockIDText(NSString *text)
+{
+    if (text == nil || [text length] == 0) {
+        return @"";
+    }
+
+    NSMutableString *normalized = [NSMutableString stringWithCapacity:[text length]];
+    NSCharacterSet *alphanumeric = [NSCharacterSet alphanumericCharacterSet];
+    BOOL previousWasSpace = YES;
+    NSUInteger length = [text length];
+    NSUInteger i = 0;
+    for (; i < length; i++) {
+        unichar ch = [text characterAtIndex:i];
+        if ([alphanumeric characterIsMember:ch]) {
+            NSString *s = [[NSString stringWithCharacters:&ch length:1] lowercaseString];
+            [normalized appendString:s];
+            previousWasSpace = NO;
+        } else if (!previousWasSpace) {
+            [normalized appendString:@" "];
+            previousWasSpace = YES;
+        }
+    }
+
+    while ([normalized hasSuffix:@" "]) {
+        [normalized deleteCharactersInRange:NSMakeRange([normalized length] - 1, 1)];
+    }
+    return normalized;
+}
+
+static BOOL OMNodeLineBounds(cmark_node *node, NSUInteger *startLineOut, NSUInteger *endLineOut)
 {
     if (node == NULL) {
         return NO;
@@ -1552,141 +2436,570 @@ static NSString *OMListPrefix(NSMutableArray *listStack)
         return @"- ";
     }
 
-    NSNumber *index = [list objectForKey:@"index"];
-    if (index == nil) {
-        return @"1. ";
+    NSNumber *index = [list objectForKey:@"index"];
+    if (index == nil) {
+        return @"1. ";
+    }
+    return [NSString stringWithFormat:@"%@. ", index];
+}
+
+static void OMIncrementListIndex(NSMutableArray *listStack)
+{
+    NSMutableDictionary *list = OMListContext(listStack);
+    if (list == nil) {
+        return;
+    }
+    NSNumber *index = [list objectForKey:@"index"];
+    if (index == nil) {
+        return;
+    }
+    [list setObject:[NSNumber numberWithInteger:[index integerValue] + 1] forKey:@"index"];
+}
+
+static NSDictionary *OMHeadingAttributes(OMTheme *theme, NSUInteger level, CGFloat scale)
+{
+    static const CGFloat scales[6] = { 1.6, 1.4, 1.2, 1.1, 1.0, 0.95 };
+    CGFloat baseSize = theme.baseFont != nil ? [theme.baseFont pointSize] : 14.0;
+    NSUInteger idx = level > 0 ? level - 1 : 0;
+    if (idx > 5) {
+        idx = 5;
+    }
+    return [theme headingAttributesForSize:(baseSize * scales[idx] * scale)];
+}
+
+static NSString *OMRuleLineString(NSFont *font, CGFloat width)
+{
+    if (font == nil || width <= 0.0) {
+        return @"────────────────────────────────────────────────────────";
+    }
+
+    NSDictionary *attrs = [NSDictionary dictionaryWithObject:font forKey:NSFontAttributeName];
+    __block NSSize charSize = NSZeroSize;
+    OMPerformAppKitWork(^{
+        charSize = [@"─" sizeWithAttributes:attrs];
+    });
+    CGFloat charWidth = charSize.width > 0.0 ? charSize.width : 6.0;
+    NSInteger count = (NSInteger)floor(width / charWidth);
+    if (count < 8) {
+        count = 8;
+    }
+
+    NSMutableString *rule = [NSMutableString stringWithCapacity:(NSUInteger)count];
+    for (NSInteger i = 0; i < count; i++) {
+        [rule appendString:@"─"];
+    }
+    return rule;
+}
+
+static NSCache *OMImageAttachmentCache(void)
+{
+    static NSCache *cache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        cache = [[NSCache alloc] init];
+        [cache setCountLimit:256];
+    });
+    return cache;
+}
+
+static NSUInteger OMImageLoadConcurrencyLimit(void)
+{
+    static NSUInteger limit = 0;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSUInteger resolved = 2;
+        NSInteger cpuCount = [[NSProcessInfo processInfo] activeProcessorCount];
+        if (cpuCount >= 4) {
+            resolved = 4;
+        }
+        limit = resolved;
+    });
+    return limit;
+}
+
+static dispatch_queue_t OMImageLoadQueue(void)
+{
+    static dispatch_queue_t queue = NULL;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        queue = dispatch_queue_create("org.objcmarkdown.images", DISPATCH_QUEUE_CONCURRENT);
+    });
+    return queue;
+}
+
+// Image jobs from every batch share these workers, so a large batch queues
+// instead of holding one thread per job.
+static OMBoundedWorkQueue *OMImageLoadWorkQueue(void)
+{
+    static OMBoundedWorkQueue *workQueue = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        workQueue = [[OMBoundedWorkQueue alloc] initWithQueue:OMImageLoadQueue()
+                                                  workerLimit:OMImageLoadConcurrencyLimit()];
+    });
+    return workQueue;
+}
+
+static NSMutableSet *OMPendingImageCacheKeys(void)
+{
+    static NSMutableSet *keys = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        keys = [[NSMutableSet alloc] init];
+    });
+    return keys;
+}
+
+static NSString *OMImageAttachmentCacheKey(NSString *urlKey,
+                                           CGFloat scale,
+                                           CGFloat layoutWidth,
+                                           BOOL allowRemoteImages)
+{
+    return [NSString stringWithFormat:@"%@|%.2f|%.1f|allowRemote:%d",
+            urlKey,
+            scale,
+            layoutWidth,
+            (int)(allowRemoteImages ? 1 : 0)];
+}
+
+// Display size of an image of naturalSize: at most the layout width less a
+// scaled gutter, keeping the aspect ratio.
+static NSSize OMPreparedImageSize(NSSize naturalSize,
+                                  CGFloat scale,
+                                  CGFloat layoutWidth)
+{
+    CGFloat maxWidth = 0.0;
+    if (layoutWidth > 0.0) {
+        maxWidth = floor(layoutWidth - (24.0 * scale));
+    }
+    if (maxWidth > 0.0 && naturalSize.width > maxWidth && naturalSize.width > 0.0) {
+        CGFloat ratio = maxWidth / naturalSize.width;
+        if (ratio > 0.0) {
+            CGFloat height = floor(naturalSize.height * ratio);
+            if (height < 1.0) {
+                height = 1.0;
+            }
+            return NSMakeSize(maxWidth, height);
+        }
+    }
+    return naturalSize;
+}
+
+static NSImage *OMPreparedImageForAttachment(NSImage *image,
+                                             CGFloat scale,
+                                             CGFloat layoutWidth)
+{
+    if (image == nil) {
+        return nil;
+    }
+
+    NSImage *preparedImage = [[image copy] autorelease];
+    NSSize imageSize = [preparedImage size];
+    NSSize targetSize = OMPreparedImageSize(imageSize, scale, layoutWidth);
+    if (!NSEqualSizes(targetSize, imageSize)) {
+        [preparedImage setScalesWhenResized:YES];
+        [preparedImage setSize:targetSize];
+    }
+    return preparedImage;
+}
+
+static uint32_t OMImageProbeBigEndian32(const unsigned char *bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+           ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+static uint32_t OMImageProbeLittleEndian32(const unsigned char *bytes)
+{
+    return ((uint32_t)bytes[3] << 24) | ((uint32_t)bytes[2] << 16) |
+           ((uint32_t)bytes[1] << 8) | (uint32_t)bytes[0];
+}
+
+// Reads the pixel dimensions of a PNG, GIF, BMP or JPEG file from its header
+// without decoding it. JPEG segments are skipped by seeking, so EXIF blocks
+// in front of the frame header are never read.
+static BOOL OMProbeImageFileDimensions(NSString *path, NSSize *sizeOut)
+{
+    NSFileHandle *handle = [NSFileHandle fileHandleForReadingAtPath:path];
+    if (handle == nil) {
+        return NO;
+    }
+
+    BOOL found = NO;
+    NSSize size = NSZeroSize;
+    @try {
+        NSData *header = [handle readDataOfLength:32];
+        const unsigned char *bytes = (const unsigned char *)[header bytes];
+        NSUInteger length = [header length];
+        if (length >= 24 &&
+            memcmp(bytes, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+            memcmp(bytes + 12, "IHDR", 4) == 0) {
+            size = NSMakeSize(OMImageProbeBigEndian32(bytes + 16), OMImageProbeBigEndian32(bytes + 20));
+            found = YES;
+        } else if (length >= 10 &&
+                   (memcmp(bytes, "GIF87a", 6) == 0 || memcmp(bytes, "GIF89a", 6) == 0)) {
+            size = NSMakeSize(bytes[6] | (bytes[7] << 8), bytes[8] | (bytes[9] << 8));
+            found = YES;
+        } else if (length >= 26 && bytes[0] == 'B' && bytes[1] == 'M') {
+            int32_t height = (int32_t)OMImageProbeLittleEndian32(bytes + 22);
+            size = NSMakeSize(OMImageProbeLittleEndian32(bytes + 18), height < 0 ? -(CGFloat)height : (CGFloat)height);
+            found = YES;
+        } else if (length >= 4 && bytes[0] == 0xFF && bytes[1] == 0xD8) {
+            unsigned long long offset = 2;
+            NSUInteger segments = 0;
+            while (!found && segments < 256) {
+                segments += 1;
+                [handle seekToFileOffset:offset];
+                NSData *markerData = [handle readDataOfLength:9];
+                const unsigned char *marker = (const unsigned char *)[markerData bytes];
+                if ([markerData length] < 4 || marker[0] != 0xFF) {
+                    break;
+                }
+                unsigned char type = marker[1];
+                if (type == 0xFF) {
+                    offset += 1;
+                    continue;
+                }
+                NSUInteger segmentLength = ((NSUInteger)marker[2] << 8) | marker[3];
+                BOOL frameHeader = (type >= 0xC0 && type <= 0xCF &&
+                                    type != 0xC4 && type != 0xC8 && type != 0xCC);
+                if (frameHeader) {
+                    if ([markerData length] < 9) {
+                        break;
+                    }
+                    size = NSMakeSize(((NSUInteger)marker[7] << 8) | marker[8],
+                                      ((NSUInteger)marker[5] << 8) | marker[6]);
+                    found = YES;
+                } else if (type == 0xD9 || type == 0xDA || segmentLength < 2) {
+                    break;
+                } else {
+                    offset += 2 + segmentLength;
+                }
+            }
+        }
+    } @catch (NSException *exception) {
+        (void)exception;
+        found = NO;
+    }
+    [handle closeFile];
+
+    if (!found || size.width <= 0.0 || size.height <= 0.0) {
+        return NO;
+    }
+    if (sizeOut != NULL) {
+        *sizeOut = size;
+    }
+    return YES;
+}
+
+// Decodes data and, when it is wider than the layout allows, resamples it
+// to the display size so only the pixels that are shown stay in memory.
+// Safe off the main thread: decoding and encoding run on the caller, the
+// resampling draw goes through OMPerformAppKitWork because it needs a
+// graphics context. pngOut receives an encoding of the result for the disk
+// cache.
+static NSImage *OMDecodedPreparedImage(NSData *data,
+                                       CGFloat scale,
+                                       CGFloat layoutWidth,
+                                       NSData **pngOut)
+{
+    if (data == nil || [data length] == 0) {
+        return nil;
+    }
+
+    NSBitmapImageRep *source = nil;
+    @try {
+        source = [NSBitmapImageRep imageRepWithData:data];
+    } @catch (NSException *exception) {
+        (void)exception;
+        source = nil;
+    }
+    if (source == nil) {
+        NSImage *fallback = [[[NSImage alloc] initWithData:data] autorelease];
+        return OMPreparedImageForAttachment(fallback, scale, layoutWidth);
+    }
+
+    NSSize naturalSize = [source size];
+    NSSize targetSize = OMPreparedImageSize(naturalSize, scale, layoutWidth);
+    __block NSBitmapImageRep *prepared = source;
+    if (!NSEqualSizes(targetSize, naturalSize)) {
+        NSInteger pixelsWide = (NSInteger)ceil(targetSize.width);
+        NSInteger pixelsHigh = (NSInteger)ceil(targetSize.height);
+        NSBitmapImageRep *scaled = [[[NSBitmapImageRep alloc] initWithBitmapDataPlanes:NULL
+                                                                            pixelsWide:pixelsWide
+                                                                            pixelsHigh:pixelsHigh
+                                                                         bitsPerSample:8
+                                                                       samplesPerPixel:4
+                                                                              hasAlpha:YES
+                                                                              isPlanar:NO
+                                                                        colorSpaceName:NSCalibratedRGBColorSpace
+                                                                           bytesPerRow:0
+                                                                          bitsPerPixel:0] autorelease];
+        OMPerformAppKitWork(^{
+            NSGraphicsContext *context = (scaled != nil ? [NSGraphicsContext graphicsContextWithBitmapImageRep:scaled] : nil);
+            if (context != nil) {
+                [NSGraphicsContext saveGraphicsState];
+                @try {
+                    [NSGraphicsContext setCurrentContext:context];
+                    [context setImageInterpolation:NSImageInterpolationHigh];
+                    [source drawInRect:NSMakeRect(0.0, 0.0, pixelsWide, pixelsHigh)];
+                    [context flushGraphics];
+                    [scaled setSize:targetSize];
+                    prepared = scaled;
+                } @catch (NSException *exception) {
+                    (void)exception;
+                } @finally {
+                    [NSGraphicsContext restoreGraphicsState];
+                }
+            }
+        });
+    }
+
+    NSImage *image = [[[NSImage alloc] initWithSize:targetSize] autorelease];
+    [image addRepresentation:prepared];
+    if (pngOut != NULL) {
+        *pngOut = [prepared representationUsingType:NSPNGFileType
+                                         properties:[NSDictionary dictionary]];
+    }
+    return image;
+}
+
+@interface OMImagePlaceholderAttachmentCell : NSTextAttachmentCell
+{
+    NSSize _placeholderSize;
+}
+- (instancetype)initWithPlaceholderSize:(NSSize)placeholderSize;
+@end
+
+@implementation OMImagePlaceholderAttachmentCell
+
+- (instancetype)initWithPlaceholderSize:(NSSize)placeholderSize
+{
+    self = [super init];
+    if (self != nil) {
+        _placeholderSize = placeholderSize;
+    }
+    return self;
+}
+
+- (NSSize)cellSize
+{
+    return _placeholderSize;
+}
+
+- (void)drawWithFrame:(NSRect)cellFrame inView:(NSView *)controlView
+{
+    (void)controlView;
+    NSRect frame = NSMakeRect(NSMinX(cellFrame), NSMinY(cellFrame),
+                              _placeholderSize.width, _placeholderSize.height);
+    [[NSColor colorWithCalibratedWhite:0.5 alpha:0.10] setFill];
+    NSRectFillUsingOperation(frame, NSCompositeSourceOver);
+    [[NSColor colorWithCalibratedWhite:0.5 alpha:0.30] setStroke];
+    NSFrameRectWithWidthUsingOperation(frame, 1.0, NSCompositeSourceOver);
+}
+
+- (void)drawWithFrame:(NSRect)cellFrame
+               inView:(NSView *)controlView
+       characterIndex:(NSUInteger)charIndex
+{
+    (void)charIndex;
+    [self drawWithFrame:cellFrame inView:controlView];
+}
+
+- (void)drawWithFrame:(NSRect)cellFrame
+               inView:(NSView *)controlView
+       characterIndex:(NSUInteger)charIndex
+        layoutManager:(NSLayoutManager *)layoutManager
+{
+    (void)charIndex;
+    (void)layoutManager;
+    [self drawWithFrame:cellFrame inView:controlView];
+}
+
+@end
+
+static const unsigned long long OMImageDiskCacheDefaultLimitBytes = 256ULL * 1024ULL * 1024ULL;
+
+// OMD_IMAGE_CACHE_DIR moves the cache (an empty value disables it) and
+// OMD_IMAGE_CACHE_MB sets its budget.
+static OMDiskCache *OMImageDiskCache(void)
+{
+    static OMDiskCache *cache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSString *directory = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_IMAGE_CACHE_DIR"];
+        if (directory == nil) {
+            directory = OMDiskCacheUserDirectory(@"images");
+        }
+        unsigned long long limit = OMDiskCacheLimitSetting([NSArray arrayWithObject:@"OMD_IMAGE_CACHE_MB"],
+                                                           @"ObjcMarkdownImageCacheMB",
+                                                           OMImageDiskCacheDefaultLimitBytes);
+        cache = [[OMDiskCache alloc] initWithDirectory:directory byteLimit:limit];
+    });
+    return cache;
+}
+
+// Identity of a prepared local image: the source file as of its last
+// modification, and the size it is shown at.
+static NSString *OMImageDiskCacheKey(NSString *path, NSDictionary *fileAttributes, NSSize targetSize)
+{
+    if (path == nil || fileAttributes == nil) {
+        return nil;
     }
-    return [NSString stringWithFormat:@"%@. ", index];
+    NSDate *modified = [fileAttributes objectForKey:NSFileModificationDate];
+    unsigned long long fileSize = [[fileAttributes objectForKey:NSFileSize] unsignedLongLongValue];
+    return [NSString stringWithFormat:@"%@|%.3f|%llu|%.0fx%.0f",
+            path,
+            modified != nil ? [modified timeIntervalSinceReferenceDate] : 0.0,
+            fileSize,
+            targetSize.width,
+            targetSize.height];
 }
 
-static void OMIncrementListIndex(NSMutableArray *listStack)
+static NSImage *OMImageDiskCacheImageForKey(NSString *diskKey, NSSize targetSize)
 {
-    NSMutableDictionary *list = OMListContext(listStack);
-    if (list == nil) {
-        return;
-    }
-    NSNumber *index = [list objectForKey:@"index"];
-    if (index == nil) {
-        return;
+    NSData *data = [OMImageDiskCache() dataForKey:diskKey extension:@"png"];
+    NSBitmapImageRep *rep = (data != nil ? [NSBitmapImageRep imageRepWithData:data] : nil);
+    if (rep == nil) {
+        return nil;
     }
-    [list setObject:[NSNumber numberWithInteger:[index integerValue] + 1] forKey:@"index"];
+    [rep setSize:targetSize];
+    NSImage *image = [[[NSImage alloc] initWithSize:targetSize] autorelease];
+    [image addRepresentation:rep];
+    return image;
 }
 
-static NSDictionary *OMHeadingAttributes(OMTheme *theme, NSUInteger level, CGFloat scale)
+static void OMImageDiskCacheStoreData(NSData *data, NSString *diskKey)
 {
-    static const CGFloat scales[6] = { 1.6, 1.4, 1.2, 1.1, 1.0, 0.95 };
-    CGFloat baseSize = theme.baseFont != nil ? [theme.baseFont pointSize] : 14.0;
-    NSUInteger idx = level > 0 ? level - 1 : 0;
-    if (idx > 5) {
-        idx = 5;
+    if (diskKey == nil) {
+        return;
     }
-    return [theme headingAttributesForSize:(baseSize * scales[idx] * scale)];
+    [OMImageDiskCache() storeData:data forKey:diskKey extension:@"png"];
 }
 
-static NSString *OMRuleLineString(NSFont *font, CGFloat width)
+// Fetches (remote) or reads (local) one image, prepares it and files it in
+// the memory cache, and in the disk cache when it has a disk key.
+static BOOL OMRunImageLoadJob(NSDictionary *job)
 {
-    if (font == nil || width <= 0.0) {
-        return @"────────────────────────────────────────────────────────";
+    OM_PERF_TRACE_SCOPE("image", "image-load");
+    NSString *cacheKey = [job objectForKey:@"cacheKey"];
+    NSString *path = [job objectForKey:@"path"];
+    NSData *data = nil;
+    if (path != nil) {
+        data = [NSData dataWithContentsOfFile:path];
+    } else {
+        NSString *urlString = [job objectForKey:@"url"];
+        NSURL *remoteURL = urlString != nil ? [NSURL URLWithString:urlString] : nil;
+        if (remoteURL != nil) {
+            data = [NSData dataWithContentsOfURL:remoteURL];
+        }
     }
 
-    NSDictionary *attrs = [NSDictionary dictionaryWithObject:font forKey:NSFontAttributeName];
-    NSSize charSize = [@"─" sizeWithAttributes:attrs];
-    CGFloat charWidth = charSize.width > 0.0 ? charSize.width : 6.0;
-    NSInteger count = (NSInteger)floor(width / charWidth);
-    if (count < 8) {
-        count = 8;
+    NSData *png = nil;
+    NSImage *prepared = OMDecodedPreparedImage(data,
+                                               [[job objectForKey:@"scale"] doubleValue],
+                                               [[job objectForKey:@"layoutWidth"] doubleValue],
+                                               &png);
+    if (prepared == nil) {
+        return NO;
     }
-
-    NSMutableString *rule = [NSMutableString stringWithCapacity:(NSUInteger)count];
-    for (NSInteger i = 0; i < count; i++) {
-        [rule appendString:@"─"];
+    NSCache *cache = OMImageAttachmentCache();
+    @synchronized (cache) {
+        [cache setObject:prepared forKey:cacheKey];
     }
-    return rule;
-}
-
-static NSCache *OMImageAttachmentCache(void)
-{
-    static NSCache *cache = nil;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        cache = [[NSCache alloc] init];
-        [cache setCountLimit:256];
-    });
-    return cache;
+    OMImageDiskCacheStoreData(png, [job objectForKey:@"diskKey"]);
+    return YES;
 }
 
-static dispatch_queue_t OMRemoteImageQueue(void)
-{
-    static dispatch_queue_t queue = NULL;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        queue = dispatch_queue_create("org.objcmarkdown.remote-images", DISPATCH_QUEUE_SERIAL);
-    });
-    return queue;
-}
+static const NSTimeInterval OMImageBatchCollectionWindow = 0.04;
+static BOOL OMImageBatchFlushScheduled = NO;
 
-static NSMutableSet *OMPendingRemoteImageCacheKeys(void)
+static NSMutableArray *OMPendingImageLoadJobs(void)
 {
-    static NSMutableSet *keys = nil;
+    static NSMutableArray *jobs = nil;
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
-        keys = [[NSMutableSet alloc] init];
+        jobs = [[NSMutableArray alloc] init];
     });
-    return keys;
-}
-
-static NSString *OMImageAttachmentCacheKey(NSString *urlKey,
-                                           CGFloat scale,
-                                           CGFloat layoutWidth,
-                                           BOOL allowRemoteImages)
-{
-    return [NSString stringWithFormat:@"%@|%.2f|%.1f|allowRemote:%d",
-            urlKey,
-            scale,
-            layoutWidth,
-            (int)(allowRemoteImages ? 1 : 0)];
+    return jobs;
 }
 
-static NSImage *OMPreparedImageForAttachment(NSImage *image,
-                                             CGFloat scale,
-                                             CGFloat layoutWidth)
+// Runs the images requested by one render with bounded concurrency and
+// posts a single warm notification once the whole batch is in the cache.
+static void OMFlushPendingImageLoads(void)
 {
-    if (image == nil) {
-        return nil;
+    NSArray *jobs = nil;
+    NSMutableArray *pendingJobs = OMPendingImageLoadJobs();
+    @synchronized (pendingJobs) {
+        jobs = [pendingJobs copy];
+        [pendingJobs removeAllObjects];
+        OMImageBatchFlushScheduled = NO;
     }
-
-    NSImage *preparedImage = [[image copy] autorelease];
-    NSSize imageSize = [preparedImage size];
-    CGFloat maxWidth = 0.0;
-    if (layoutWidth > 0.0) {
-        maxWidth = floor(layoutWidth - (24.0 * scale));
+    if ([jobs count] == 0) {
+        [jobs release];
+        return;
     }
-    if (maxWidth > 0.0 && imageSize.width > maxWidth && imageSize.width > 0.0) {
-        CGFloat ratio = maxWidth / imageSize.width;
-        if (ratio > 0.0) {
-            CGFloat height = floor(imageSize.height * ratio);
-            if (height < 1.0) {
-                height = 1.0;
+
+    NSTimeInterval batchStart = OMNow();
+    uint64_t batchTraceStart = OMPerfTraceNowMicros();
+    NSMutableArray *loadedKeys = [[NSMutableArray alloc] init];
+    dispatch_group_t group = dispatch_group_create();
+    for (NSDictionary *job in jobs) {
+        dispatch_group_enter(group);
+        [OMImageLoadWorkQueue() addWork:^{
+            NSString *cacheKey = [job objectForKey:@"cacheKey"];
+            @try {
+                if (OMRunImageLoadJob(job)) {
+                    @synchronized (loadedKeys) {
+                        [loadedKeys addObject:cacheKey];
+                    }
+                }
+            } @finally {
+                NSMutableSet *pending = OMPendingImageCacheKeys();
+                @synchronized (pending) {
+                    [pending removeObject:cacheKey];
+                }
+                OMFinishRenderArtifact(cacheKey);
+                dispatch_group_leave(group);
             }
-            [preparedImage setScalesWhenResized:YES];
-            [preparedImage setSize:NSMakeSize(maxWidth, height)];
+        }];
+    }
+    dispatch_group_notify(group, dispatch_get_main_queue(), ^{
+        NSUInteger loaded = [loadedKeys count];
+        OMPerfTraceRecordSpan("image", "image-batch", batchTraceStart, OMPerfTraceNowMicros());
+        OMPerfTraceCounter("image", "images-loaded", (int64_t)loaded);
+        if (OMPerformanceLoggingEnabled()) {
+            NSLog(@"[Perf][Renderer] image-batch size=%lu ok=%lu workers=%lu total=%.1fms",
+                  (unsigned long)[jobs count],
+                  (unsigned long)loaded,
+                  (unsigned long)OMImageLoadConcurrencyLimit(),
+                  (OMNow() - batchStart) * 1000.0);
         }
-    }
-    return preparedImage;
+        if (loaded > 0) {
+            [[NSNotificationCenter defaultCenter]
+                postNotificationName:OMMarkdownRendererRemoteImagesDidWarmNotification
+                              object:nil];
+        }
+        [loadedKeys release];
+        [jobs release];
+    });
+    dispatch_release(group);
 }
 
-static void OMScheduleAsyncRemoteImageWarm(NSURL *url,
-                                           NSString *cacheKey,
-                                           CGFloat scale,
-                                           CGFloat layoutWidth,
-                                           BOOL allowRemoteImages)
+// Queues an image for the background loader. Requests made while a render
+// runs are collected into one batch. path is set for local files, whose
+// prepared result is also kept on disk under diskKey.
+static void OMScheduleAsyncImageLoad(NSURL *url,
+                                     NSString *path,
+                                     NSString *diskKey,
+                                     NSString *cacheKey,
+                                     CGFloat scale,
+                                     CGFloat layoutWidth,
+                                     const OMRenderContext *renderContext)
 {
     if (url == nil || cacheKey == nil || [cacheKey length] == 0) {
         return;
     }
-    if (!OMURLUsesRemoteScheme(url) || !allowRemoteImages) {
-        return;
-    }
 
     NSCache *cache = OMImageAttachmentCache();
     @synchronized (cache) {
@@ -1695,50 +3008,45 @@ static void OMScheduleAsyncRemoteImageWarm(NSURL *url,
         }
     }
 
-    NSMutableSet *pending = OMPendingRemoteImageCacheKeys();
-    BOOL shouldSchedule = NO;
+    NSMutableSet *pending = OMPendingImageCacheKeys();
     @synchronized (pending) {
-        if (![pending containsObject:cacheKey]) {
-            [pending addObject:cacheKey];
-            shouldSchedule = YES;
+        OMRegisterRenderArtifactWait(cacheKey, renderContext);
+        if ([pending containsObject:cacheKey]) {
+            return;
         }
+        [pending addObject:cacheKey];
     }
-    if (!shouldSchedule) {
-        return;
+
+    NSMutableDictionary *job = [NSMutableDictionary dictionary];
+    [job setObject:[[[url absoluteString] copy] autorelease] forKey:@"url"];
+    [job setObject:[[cacheKey copy] autorelease] forKey:@"cacheKey"];
+    [job setObject:[NSNumber numberWithDouble:scale] forKey:@"scale"];
+    [job setObject:[NSNumber numberWithDouble:layoutWidth] forKey:@"layoutWidth"];
+    if (path != nil) {
+        [job setObject:[[path copy] autorelease] forKey:@"path"];
+    }
+    if (diskKey != nil) {
+        [job setObject:[[diskKey copy] autorelease] forKey:@"diskKey"];
     }
 
-    NSString *urlStringCopy = [[url absoluteString] copy];
-    NSString *cacheKeyCopy = [cacheKey copy];
-    dispatch_async(OMRemoteImageQueue(), ^{
-        @autoreleasepool {
-            NSURL *remoteURL = urlStringCopy != nil ? [NSURL URLWithString:urlStringCopy] : nil;
-            NSData *data = nil;
-            if (remoteURL != nil) {
-                data = [NSData dataWithContentsOfURL:remoteURL];
-            }
-            NSData *dataCopy = [data retain];
-            dispatch_async(dispatch_get_main_queue(), ^{
-                if (dataCopy != nil && [dataCopy length] > 0) {
-                    NSImage *loaded = [[[NSImage alloc] initWithData:dataCopy] autorelease];
-                    NSImage *prepared = OMPreparedImageForAttachment(loaded, scale, layoutWidth);
-                    if (prepared != nil) {
-                        @synchronized (cache) {
-                            [cache setObject:prepared forKey:cacheKeyCopy];
-                        }
-                        [[NSNotificationCenter defaultCenter]
-                            postNotificationName:OMMarkdownRendererRemoteImagesDidWarmNotification
-                                          object:nil];
-                    }
-                }
-                [dataCopy release];
-                @synchronized (pending) {
-                    [pending removeObject:cacheKeyCopy];
-                }
-                [urlStringCopy release];
-                [cacheKeyCopy release];
-            });
+    BOOL scheduleFlush = NO;
+    NSMutableArray *pendingJobs = OMPendingImageLoadJobs();
+    @synchronized (pendingJobs) {
+        [pendingJobs addObject:job];
+        if (!OMImageBatchFlushScheduled) {
+            OMImageBatchFlushScheduled = YES;
+            scheduleFlush = YES;
         }
-    });
+    }
+    if (scheduleFlush) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(OMImageBatchCollectionWindow * NSEC_PER_SEC)),
+                       OMImageLoadQueue(),
+                       ^{
+            @autoreleasepool {
+                OMFlushPendingImageLoads();
+            }
+        });
+    }
 }
 
 static void OMAppendInlineTextFromNode(cmark_node *node, NSMutableString *buffer)
@@ -1868,6 +3176,306 @@ static NSString *OMNormalizeGFMStrikethroughMarkdown(NSString *markdown)
     return normalized;
 }
 
+// Recently parsed revisions, most recent last. Several documents are
+// usually open at once (tabs, a preview and its editor), so one slot would
+// make them evict each other on every switch.
+static const NSUInteger OMRecentDocumentSnapshotLimit = 8;
+
+static NSMutableArray *OMRecentDocumentSnapshots(void)
+{
+    static NSMutableArray *snapshots = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        snapshots = [[NSMutableArray alloc] initWithCapacity:OMRecentDocumentSnapshotLimit];
+    });
+    return snapshots;
+}
+
+@interface OMMarkdownDocumentSnapshot () {
+    NSString *_markdown;
+    NSUInteger _cmarkOptions;
+    NSData *_parsedData;
+    cmark_node *_document;
+    NSRange *_lineRanges;
+    NSUInteger _lineCount;
+    OMMarkdownBlockDescriptor *_blocks;
+    NSUInteger _blockCount;
+    NSUInteger _blockCapacity;
+    NSArray *_sourceLines;
+}
+- (void)buildLineTable;
+- (void)collectBlocksFromNode:(cmark_node *)node flags:(OMMarkdownBlockFlags)inheritedFlags;
+- (void)materializeNodeStrings;
+// Only the renderer walks the tree, possibly from several threads at once.
+// Node strings that cmark converts lazily are materialized while parsing,
+// so walking it never writes; nothing is mutated after the initializer.
+- (cmark_node *)documentNode;
++ (OMMarkdownDocumentSnapshot *)recentSnapshotForMarkdown:(NSString *)markdown
+                                             cmarkOptions:(NSUInteger)cmarkOptions
+                                             matchOptions:(BOOL)matchOptions;
+@end
+
+@implementation OMMarkdownDocumentSnapshot
+
+@synthesize markdown = _markdown;
+@synthesize cmarkOptions = _cmarkOptions;
+@synthesize lineCount = _lineCount;
+@synthesize blockCount = _blockCount;
+
+// Moves a hit to the most recent end. Caller must not hold the lock.
++ (OMMarkdownDocumentSnapshot *)recentSnapshotForMarkdown:(NSString *)markdown
+                                             cmarkOptions:(NSUInteger)cmarkOptions
+                                             matchOptions:(BOOL)matchOptions
+{
+    NSMutableArray *snapshots = OMRecentDocumentSnapshots();
+    @synchronized (snapshots) {
+        NSUInteger index = [snapshots count];
+        while (index > 0) {
+            index -= 1;
+            OMMarkdownDocumentSnapshot *candidate = [snapshots objectAtIndex:index];
+            if (matchOptions && candidate->_cmarkOptions != cmarkOptions) {
+                continue;
+            }
+            if (candidate->_markdown == markdown || [candidate->_markdown isEqualToString:markdown]) {
+                [[candidate retain] autorelease];
+                if (index + 1 < [snapshots count]) {
+                    [snapshots removeObjectAtIndex:index];
+                    [snapshots addObject:candidate];
+                }
+                return candidate;
+            }
+        }
+    }
+    return nil;
+}
+
++ (instancetype)snapshotForMarkdown:(NSString *)markdown
+{
+    OMMarkdownDocumentSnapshot *snapshot = [self recentSnapshotForMarkdown:(markdown != nil ? markdown : @"")
+                                                              cmarkOptions:0
+                                                              matchOptions:NO];
+    if (snapshot != nil) {
+        return snapshot;
+    }
+    return [self snapshotForMarkdown:markdown cmarkOptions:(NSUInteger)CMARK_OPT_DEFAULT];
+}
+
++ (instancetype)snapshotForMarkdown:(NSString *)markdown cmarkOptions:(NSUInteger)cmarkOptions
+{
+    if (markdown == nil) {
+        markdown = @"";
+    }
+    OMMarkdownDocumentSnapshot *snapshot = [self recentSnapshotForMarkdown:markdown
+                                                              cmarkOptions:cmarkOptions
+                                                              matchOptions:YES];
+    if (snapshot != nil) {
+        return snapshot;
+    }
+
+    // Parse outside the lock; a concurrent caller may build the same
+    // revision, in which case both are remembered until they age out.
+    snapshot = [[[self alloc] initWithMarkdown:markdown cmarkOptions:cmarkOptions] autorelease];
+    NSMutableArray *snapshots = OMRecentDocumentSnapshots();
+    @synchronized (snapshots) {
+        [snapshots addObject:snapshot];
+        if ([snapshots count] > OMRecentDocumentSnapshotLimit) {
+            [snapshots removeObjectAtIndex:0];
+        }
+    }
+    return snapshot;
+}
+
+- (instancetype)initWithMarkdown:(NSString *)markdown cmarkOptions:(NSUInteger)cmarkOptions
+{
+    self = [super init];
+    if (self == nil) {
+        return nil;
+    }
+
+    _markdown = [(markdown != nil ? markdown : @"") copy];
+    _cmarkOptions = cmarkOptions;
+    [self buildLineTable];
+
+    NSString *markdownForParsing = OMNormalizeGFMStrikethroughMarkdown(_markdown);
+    if (markdownForParsing == nil) {
+        markdownForParsing = _markdown;
+    }
+    _parsedData = [[markdownForParsing dataUsingEncoding:NSUTF8StringEncoding] retain];
+    if (_parsedData != nil) {
+        OM_PERF_TRACE_SCOPE("renderer", "parse");
+        _document = cmark_parse_document((const char *)[_parsedData bytes],
+                                         (size_t)[_parsedData length],
+                                         (int)cmarkOptions);
+    }
+    if (_document != NULL) {
+        [self materializeNodeStrings];
+        [self collectBlocksFromNode:cmark_node_first_child(_document) flags:OMMarkdownBlockFlagTopLevel];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_document != NULL) {
+        cmark_node_free(_document);
+    }
+    free(_lineRanges);
+    free(_blocks);
+    [_sourceLines release];
+    [_parsedData release];
+    [_markdown release];
+    [super dealloc];
+}
+
+// Same line semantics as -lineRangeForRange:, minus trailing CR/LF.
+- (void)buildLineTable
+{
+    NSUInteger totalLength = [_markdown length];
+    NSUInteger capacity = 0;
+    NSUInteger cursor = 0;
+    while (cursor < totalLength) {
+        NSRange lineRange = [_markdown lineRangeForRange:NSMakeRange(cursor, 0)];
+        NSUInteger contentLength = lineRange.length;
+        while (contentLength > 0) {
+            unichar ch = [_markdown characterAtIndex:lineRange.location + contentLength - 1];
+            if (ch != '\n' && ch != '\r') {
+                break;
+            }
+            contentLength -= 1;
+        }
+
+        if (_lineCount == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 256;
+            _lineRanges = (NSRange *)realloc(_lineRanges, capacity * sizeof(NSRange));
+        }
+        _lineRanges[_lineCount] = NSMakeRange(lineRange.location, contentLength);
+        _lineCount += 1;
+        cursor = NSMaxRange(lineRange);
+    }
+
+    NSMutableArray *lines = [[NSMutableArray alloc] initWithCapacity:_lineCount];
+    NSUInteger index = 0;
+    for (; index < _lineCount; index++) {
+        [lines addObject:[_markdown substringWithRange:_lineRanges[index]]];
+    }
+    _sourceLines = lines;
+}
+
+// Older cmark releases keep literals, URLs and info strings as chunks and
+// convert them to C strings, in place, on first access. Touching every one
+// here means later readers on any thread only ever read.
+- (void)materializeNodeStrings
+{
+    cmark_iter *iterator = cmark_iter_new(_document);
+    if (iterator == NULL) {
+        return;
+    }
+    cmark_event_type event;
+    while ((event = cmark_iter_next(iterator)) != CMARK_EVENT_DONE) {
+        if (event != CMARK_EVENT_ENTER) {
+            continue;
+        }
+        cmark_node *node = cmark_iter_get_node(iterator);
+        switch (cmark_node_get_type(node)) {
+            case CMARK_NODE_CODE_BLOCK:
+                (void)cmark_node_get_fence_info(node);
+                (void)cmark_node_get_literal(node);
+                break;
+            case CMARK_NODE_LINK:
+            case CMARK_NODE_IMAGE:
+                (void)cmark_node_get_url(node);
+                (void)cmark_node_get_title(node);
+                break;
+            case CMARK_NODE_HTML_BLOCK:
+            case CMARK_NODE_HTML_INLINE:
+            case CMARK_NODE_TEXT:
+            case CMARK_NODE_CODE:
+                (void)cmark_node_get_literal(node);
+                break;
+            default:
+                break;
+        }
+    }
+    cmark_iter_free(iterator);
+}
+
+- (void)collectBlocksFromNode:(cmark_node *)node flags:(OMMarkdownBlockFlags)inheritedFlags
+{
+    for (; node != NULL; node = cmark_node_next(node)) {
+        cmark_node_type type = cmark_node_get_type(node);
+        if (type < CMARK_NODE_FIRST_BLOCK || type > CMARK_NODE_LAST_BLOCK) {
+            continue;
+        }
+
+        OMMarkdownBlockFlags flags = inheritedFlags;
+        if (type == CMARK_NODE_BLOCK_QUOTE) {
+            flags |= OMMarkdownBlockFlagInBlockquote;
+        } else if (type == CMARK_NODE_LIST || type == CMARK_NODE_ITEM) {
+            flags |= OMMarkdownBlockFlagInList;
+        } else if (type == CMARK_NODE_CODE_BLOCK) {
+            flags |= OMMarkdownBlockFlagInCodeBlock;
+        }
+
+        if (_blockCount == _blockCapacity) {
+            _blockCapacity = _blockCapacity > 0 ? _blockCapacity * 2 : 128;
+            _blocks = (OMMarkdownBlockDescriptor *)realloc(_blocks,
+                                                           _blockCapacity * sizeof(OMMarkdownBlockDescriptor));
+        }
+        OMMarkdownBlockDescriptor *block = &_blocks[_blockCount];
+        block->nodeType = (NSInteger)type;
+        block->startLine = (NSInteger)cmark_node_get_start_line(node);
+        block->endLine = (NSInteger)cmark_node_get_end_line(node);
+        block->flags = flags;
+        _blockCount += 1;
+
+        [self collectBlocksFromNode:cmark_node_first_child(node)
+                              flags:(flags & ~OMMarkdownBlockFlagTopLevel)];
+    }
+}
+
+- (NSRange)rangeOfLine:(NSUInteger)lineNumber
+{
+    if (lineNumber == 0 || lineNumber > _lineCount) {
+        return NSMakeRange(NSNotFound, 0);
+    }
+    return _lineRanges[lineNumber - 1];
+}
+
+- (NSUInteger)lineNumberForCharacterIndex:(NSUInteger)characterIndex
+{
+    if (_lineCount == 0) {
+        return 0;
+    }
+    NSUInteger low = 0;
+    NSUInteger high = _lineCount;
+    while (high - low > 1) {
+        NSUInteger mid = low + (high - low) / 2;
+        if (_lineRanges[mid].location <= characterIndex) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low + 1;
+}
+
+- (NSArray *)sourceLines
+{
+    return _sourceLines;
+}
+
+- (const OMMarkdownBlockDescriptor *)blockDescriptors
+{
+    return _blocks;
+}
+
+- (cmark_node *)documentNode
+{
+    return _document;
+}
+
+@end
+
 typedef NS_ENUM(NSUInteger, OMPipeTableAlignment) {
     OMPipeTableAlignmentLeft = 0,
     OMPipeTableAlignmentCenter = 1,
@@ -2605,7 +4213,73 @@ static CGFloat OMPipeTableMeasuredTextHeight(NSAttributedString *segment,
     if (height < fallbackLineHeight) {
         height = fallbackLineHeight;
     }
-    return height;
+    return height;
+}
+
+static CGFloat OMPipeTableMeasuredRowHeight(NSArray *row,
+                                            NSUInteger columnCount,
+                                            NSArray *columnWidths,
+                                            CGFloat lineHeight,
+                                            CGFloat verticalPadding)
+{
+    CGFloat contentHeight = lineHeight;
+    NSUInteger columnIndex = 0;
+    for (; columnIndex < columnCount; columnIndex++) {
+        NSAttributedString *segment = (columnIndex < [row count] ? [row objectAtIndex:columnIndex] : nil);
+        NSMutableAttributedString *measureSegment = OMPipeTableDrawableSegment(segment,
+                                                                               OMPipeTableAlignmentLeft,
+                                                                               NSLineBreakByWordWrapping);
+        CGFloat contentWidth = [[columnWidths objectAtIndex:columnIndex] doubleValue];
+        CGFloat measured = OMPipeTableMeasuredTextHeight(measureSegment,
+                                                         contentWidth,
+                                                         lineHeight);
+        if (measured > contentHeight) {
+            contentHeight = measured;
+        }
+    }
+    return ceil(contentHeight + (verticalPadding * 2.0));
+}
+
+// Row height without a text layout pass. Exact when every cell fits on one
+// line of its column; otherwise *exactOut is NO and the wrapped-line guess
+// is replaced by OMPipeTableMeasuredRowHeight once the row is drawn.
+static CGFloat OMPipeTableEstimatedRowHeight(NSArray *row,
+                                             NSUInteger columnCount,
+                                             NSArray *columnWidths,
+                                             CGFloat lineHeight,
+                                             CGFloat verticalPadding,
+                                             BOOL *exactOut)
+{
+    BOOL exact = YES;
+    CGFloat contentHeight = lineHeight;
+    NSUInteger columnIndex = 0;
+    for (; columnIndex < columnCount; columnIndex++) {
+        NSAttributedString *segment = (columnIndex < [row count] ? [row objectAtIndex:columnIndex] : nil);
+        if (segment == nil || [segment length] == 0) {
+            continue;
+        }
+        CGFloat contentWidth = [[columnWidths objectAtIndex:columnIndex] doubleValue];
+        NSSize textSize = [segment size];
+        CGFloat height = ceil(textSize.height);
+        if (height < lineHeight) {
+            height = lineHeight;
+        }
+        BOOL hasLineBreak = ([[segment string] rangeOfCharacterFromSet:[NSCharacterSet newlineCharacterSet]].location != NSNotFound);
+        if (hasLineBreak || ceil(textSize.width) > contentWidth) {
+            exact = NO;
+            CGFloat lines = (contentWidth > 0.0 ? ceil(textSize.width / contentWidth) : 1.0);
+            if (lines > 1.0) {
+                height *= lines;
+            }
+        }
+        if (height > contentHeight) {
+            contentHeight = height;
+        }
+    }
+    if (exactOut != NULL) {
+        *exactOut = exact;
+    }
+    return ceil(contentHeight + (verticalPadding * 2.0));
 }
 
 static CGFloat OMPipeTableRoundToPixel(CGFloat value)
@@ -2630,8 +4304,12 @@ static BOOL OMPipeTableComputeLayout(NSArray *visibleRows,
                                      NSFont *headerFont,
                                      CGFloat scale,
                                      CGFloat maxWidth,
+                                     BOOL deferWrappedRows,
                                      NSMutableArray **columnWidthsOut,
                                      NSMutableArray **rowHeightsOut,
+                                     NSMutableIndexSet **estimatedRowsOut,
+                                     CGFloat *headerLineHeightOut,
+                                     CGFloat *bodyLineHeightOut,
                                      CGFloat *borderWidthOut,
                                      CGFloat *horizontalPaddingOut,
                                      CGFloat *verticalPaddingOut,
@@ -2687,30 +4365,36 @@ static BOOL OMPipeTableComputeLayout(NSArray *visibleRows,
         headerLineHeight = bodyLineHeight;
     }
 
+    // Large tables only pay for a text layout pass on rows that wrap, and
+    // only once those rows are drawn; see OMPipeTableAttachmentCell.
     NSMutableArray *rowHeights = [NSMutableArray arrayWithCapacity:rowCount];
+    NSMutableIndexSet *estimatedRows = [NSMutableIndexSet indexSet];
+    BOOL hasAttributedRows = (attributedRows != nil && [attributedRows count] == rowCount);
     NSUInteger rowIndex = 0;
     for (; rowIndex < rowCount; rowIndex++) {
         CGFloat lineHeight = (rowIndex == 0 ? headerLineHeight : bodyLineHeight);
-        CGFloat contentHeight = lineHeight;
-        if (attributedRows != nil && [attributedRows count] == rowCount) {
+        CGFloat rowHeight = ceil(lineHeight + (verticalPadding * 2.0));
+        if (hasAttributedRows) {
             NSArray *row = [attributedRows objectAtIndex:rowIndex];
-            NSUInteger columnIndex = 0;
-            for (; columnIndex < columnCount; columnIndex++) {
-                NSAttributedString *segment = (columnIndex < [row count] ? [row objectAtIndex:columnIndex] : nil);
-                OMPipeTableAlignment alignment = OMPipeTableAlignmentLeft;
-                NSMutableAttributedString *measureSegment = OMPipeTableDrawableSegment(segment,
-                                                                                       alignment,
-                                                                                       NSLineBreakByWordWrapping);
-                CGFloat contentWidth = [[columnWidths objectAtIndex:columnIndex] doubleValue];
-                CGFloat measured = OMPipeTableMeasuredTextHeight(measureSegment,
-                                                                 contentWidth,
-                                                                 lineHeight);
-                if (measured > contentHeight) {
-                    contentHeight = measured;
+            if (deferWrappedRows) {
+                BOOL exact = YES;
+                rowHeight = OMPipeTableEstimatedRowHeight(row,
+                                                          columnCount,
+                                                          columnWidths,
+                                                          lineHeight,
+                                                          verticalPadding,
+                                                          &exact);
+                if (!exact) {
+                    [estimatedRows addIndex:rowIndex];
                 }
+            } else {
+                rowHeight = OMPipeTableMeasuredRowHeight(row,
+                                                         columnCount,
+                                                         columnWidths,
+                                                         lineHeight,
+                                                         verticalPadding);
             }
         }
-        CGFloat rowHeight = ceil(contentHeight + (verticalPadding * 2.0));
         [rowHeights addObject:[NSNumber numberWithDouble:rowHeight]];
     }
 
@@ -2736,6 +4420,15 @@ static BOOL OMPipeTableComputeLayout(NSArray *visibleRows,
     if (rowHeightsOut != NULL) {
         *rowHeightsOut = rowHeights;
     }
+    if (estimatedRowsOut != NULL) {
+        *estimatedRowsOut = estimatedRows;
+    }
+    if (headerLineHeightOut != NULL) {
+        *headerLineHeightOut = headerLineHeight;
+    }
+    if (bodyLineHeightOut != NULL) {
+        *bodyLineHeightOut = bodyLineHeight;
+    }
     if (borderWidthOut != NULL) {
         *borderWidthOut = borderWidth;
     }
@@ -2788,8 +4481,12 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
                                   headerFont,
                                   scale,
                                   maxWidth,
+                                  NO,
                                   &columnWidths,
                                   &rowHeights,
+                                  NULL,
+                                  NULL,
+                                  NULL,
                                   &borderWidth,
                                   &horizontalPadding,
                                   &verticalPadding,
@@ -2847,12 +4544,112 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
     return image;
 }
 
+// Tables with more rows than this are laid out lazily and never rasterized
+// as a single image.
+static const NSUInteger OMPipeTableLazyRowThreshold = 64;
+static const NSUInteger OMPipeTableTileRowCount = 16;
+static const NSUInteger OMPipeTableTileCacheCostLimit = 48 * 1024 * 1024;
+
+static NSCache *OMPipeTableTileCache(void)
+{
+    static NSCache *cache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        cache = [[NSCache alloc] init];
+        [cache setTotalCostLimit:OMPipeTableTileCacheCostLimit];
+        [cache setCountLimit:512];
+    });
+    return cache;
+}
+
+static NSString *OMPipeTableColorKey(NSColor *color)
+{
+    CGFloat red = 0.0;
+    CGFloat green = 0.0;
+    CGFloat blue = 0.0;
+    CGFloat alpha = 0.0;
+    if (!OMColorRGBA(color, &red, &green, &blue, &alpha)) {
+        return (color != nil ? [color description] : @"-");
+    }
+    return [NSString stringWithFormat:@"%.4f,%.4f,%.4f,%.4f", red, green, blue, alpha];
+}
+
+static unsigned long long OMPipeTableAttributeValueHash(id value)
+{
+    if ([value isKindOfClass:[NSFont class]]) {
+        return (unsigned long long)[[value fontName] hash] ^ (unsigned long long)([value pointSize] * 100.0);
+    }
+    if ([value isKindOfClass:[NSColor class]]) {
+        return (unsigned long long)[OMPipeTableColorKey(value) hash];
+    }
+    return (unsigned long long)[value hash];
+}
+
+// Covers the inline attributes of every cell as well as its text, so rows
+// that differ only in emphasis, links or code spans get different tiles.
+static unsigned long long OMPipeTableContentHash(NSArray *attributedRows)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (NSArray *row in attributedRows) {
+        for (NSAttributedString *segment in row) {
+            hash ^= (unsigned long long)[[segment string] hash];
+            hash *= 1099511628211ULL;
+            hash ^= (unsigned long long)[segment length];
+            hash *= 1099511628211ULL;
+            NSUInteger length = [segment length];
+            NSUInteger location = 0;
+            while (location < length) {
+                NSRange run = NSMakeRange(location, 0);
+                NSDictionary *attributes = [segment attributesAtIndex:location effectiveRange:&run];
+                hash ^= (unsigned long long)NSMaxRange(run);
+                hash *= 1099511628211ULL;
+                for (NSString *name in attributes) {
+                    hash ^= (unsigned long long)[name hash] ^
+                            OMPipeTableAttributeValueHash([attributes objectForKey:name]);
+                    hash *= 1099511628211ULL;
+                }
+                location = NSMaxRange(run);
+            }
+        }
+        hash ^= 0xffULL;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The shorter drawing entry points do not pass the layout manager; a text
+// view still has one through its container, which a resize must invalidate.
+static NSLayoutManager *OMPipeTableLayoutManagerForView(NSView *controlView)
+{
+    if (![controlView isKindOfClass:[NSTextView class]]) {
+        return nil;
+    }
+    return [[(NSTextView *)controlView textContainer] layoutManager];
+}
+
+// Draws a pipe table from per-row heights kept as a prefix-sum array, so the
+// rows under a given offset are found by binary search. On screen only the
+// rows inside the view's visible rect are drawn, from row-band rasters shared
+// through OMPipeTableTileCache; the tile key covers content, zoom scale, fonts
+// and theme colors, so scrolling back or re-rendering at a previous zoom reuses
+// them. Rows whose height was only estimated (see OMPipeTableComputeLayout)
+// are measured when their band is first drawn; if that changes the table
+// height the layout manager is asked to lay the attachment out again.
 @interface OMPipeTableAttachmentCell : NSTextAttachmentCell
 {
     NSArray *_attributedRows;
     NSArray *_alignments;
     NSArray *_columnWidths;
-    NSArray *_rowHeights;
+    CGFloat *_rowHeights;
+    CGFloat *_rowOffsets;
+    NSUInteger _rowCount;
+    NSUInteger _validOffsetCount;
+    NSMutableIndexSet *_estimatedRows;
+    CGFloat _headerLineHeight;
+    CGFloat _bodyLineHeight;
+    NSString *_tileCacheKey;
+    NSLayoutManager *_relayoutManager;
+    NSUInteger _relayoutCharacterIndex;
     NSColor *_borderColor;
     NSColor *_headerBackgroundColor;
     NSColor *_bodyBackgroundColor;
@@ -2865,13 +4662,17 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
                             alignments:(NSArray *)alignments
                           columnWidths:(NSArray *)columnWidths
                             rowHeights:(NSArray *)rowHeights
+                         estimatedRows:(NSIndexSet *)estimatedRows
+                      headerLineHeight:(CGFloat)headerLineHeight
+                        bodyLineHeight:(CGFloat)bodyLineHeight
                            borderColor:(NSColor *)borderColor
                  headerBackgroundColor:(NSColor *)headerBackgroundColor
                    bodyBackgroundColor:(NSColor *)bodyBackgroundColor
                            borderWidth:(CGFloat)borderWidth
                      horizontalPadding:(CGFloat)horizontalPadding
                        verticalPadding:(CGFloat)verticalPadding
-                             tableSize:(NSSize)tableSize;
+                             tableSize:(NSSize)tableSize
+                          tileCacheKey:(NSString *)tileCacheKey;
 @end
 
 @implementation OMPipeTableAttachmentCell
@@ -2880,6 +4681,9 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
                             alignments:(NSArray *)alignments
                           columnWidths:(NSArray *)columnWidths
                             rowHeights:(NSArray *)rowHeights
+                         estimatedRows:(NSIndexSet *)estimatedRows
+                      headerLineHeight:(CGFloat)headerLineHeight
+                        bodyLineHeight:(CGFloat)bodyLineHeight
                            borderColor:(NSColor *)borderColor
                  headerBackgroundColor:(NSColor *)headerBackgroundColor
                    bodyBackgroundColor:(NSColor *)bodyBackgroundColor
@@ -2887,13 +4691,30 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
                      horizontalPadding:(CGFloat)horizontalPadding
                        verticalPadding:(CGFloat)verticalPadding
                              tableSize:(NSSize)tableSize
+                          tileCacheKey:(NSString *)tileCacheKey
 {
     self = [super init];
     if (self != nil) {
         _attributedRows = [attributedRows copy];
         _alignments = [alignments copy];
         _columnWidths = [columnWidths copy];
-        _rowHeights = [rowHeights copy];
+        _rowCount = [_attributedRows count];
+        if ([rowHeights count] < _rowCount) {
+            _rowCount = [rowHeights count];
+        }
+        _rowHeights = calloc(_rowCount + 1, sizeof(CGFloat));
+        _rowOffsets = calloc(_rowCount + 1, sizeof(CGFloat));
+        NSUInteger rowIndex = 0;
+        for (; rowIndex < _rowCount; rowIndex++) {
+            _rowHeights[rowIndex] = [[rowHeights objectAtIndex:rowIndex] doubleValue];
+        }
+        _validOffsetCount = 0;
+        if (estimatedRows != nil && [estimatedRows count] > 0) {
+            _estimatedRows = [estimatedRows mutableCopy];
+        }
+        _headerLineHeight = headerLineHeight;
+        _bodyLineHeight = bodyLineHeight;
+        _tileCacheKey = [tileCacheKey copy];
         _borderColor = [(borderColor != nil ? borderColor : [NSColor lightGrayColor]) retain];
         _headerBackgroundColor = [(headerBackgroundColor != nil ? headerBackgroundColor : [NSColor whiteColor]) retain];
         _bodyBackgroundColor = [(bodyBackgroundColor != nil ? bodyBackgroundColor : [NSColor whiteColor]) retain];
@@ -2910,7 +4731,11 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
     [_attributedRows release];
     [_alignments release];
     [_columnWidths release];
-    [_rowHeights release];
+    free(_rowHeights);
+    free(_rowOffsets);
+    [_estimatedRows release];
+    [_tileCacheKey release];
+    [_relayoutManager release];
     [_borderColor release];
     [_headerBackgroundColor release];
     [_bodyBackgroundColor release];
@@ -2922,45 +4747,93 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
     return _tableSize;
 }
 
-- (void)om_drawTableInFrame:(NSRect)cellFrame flipped:(BOOL)flipped
+// _rowOffsets[i] is the top of row i from the top of the table;
+// _rowOffsets[_rowCount] is the full height including the bottom border.
+- (void)om_ensureRowOffsets
 {
-    if (_attributedRows == nil || [_attributedRows count] == 0 ||
-        _alignments == nil || [_alignments count] == 0 ||
-        _columnWidths == nil || [_columnWidths count] == 0 ||
-        _rowHeights == nil || [_rowHeights count] == 0) {
+    if (_validOffsetCount > _rowCount) {
         return;
     }
-
-    NSGraphicsContext *context = [NSGraphicsContext currentContext];
-    [context saveGraphicsState];
-
-    NSRect tableRect = OMPipeTableIntegralRect(cellFrame);
-    if (tableRect.size.width < _tableSize.width) {
-        tableRect.size.width = _tableSize.width;
+    NSUInteger index = _validOffsetCount;
+    if (index == 0) {
+        _rowOffsets[0] = _borderWidth;
+        index = 1;
     }
-    if (tableRect.size.height < _tableSize.height) {
-        tableRect.size.height = _tableSize.height;
+    for (; index <= _rowCount; index++) {
+        _rowOffsets[index] = _rowOffsets[index - 1] + _rowHeights[index - 1] + _borderWidth;
     }
+    _validOffsetCount = _rowCount + 1;
+}
 
-    [_borderColor setFill];
-    NSRectFill(tableRect);
+// Row containing offset (from the table top), counting each row's bottom
+// border as part of it; _rowCount when offset is past the last row.
+- (NSUInteger)om_rowIndexAtOffset:(CGFloat)offset
+{
+    [self om_ensureRowOffsets];
+    NSUInteger low = 0;
+    NSUInteger high = _rowCount;
+    while (low < high) {
+        NSUInteger mid = low + ((high - low) / 2);
+        if (_rowOffsets[mid + 1] <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Replaces estimated heights in rows with measured ones. Returns YES when
+// any height changed, leaving offsets and the table size updated.
+- (BOOL)om_measureEstimatedRowsInRange:(NSRange)rows
+{
+    if (_estimatedRows == nil || ![_estimatedRows intersectsIndexesInRange:rows]) {
+        return NO;
+    }
 
-    NSUInteger rowCount = [_attributedRows count];
     NSUInteger columnCount = [_alignments count];
-    CGFloat y = flipped ? (NSMinY(tableRect) + _borderWidth) : (NSMaxY(tableRect) - _borderWidth);
-    NSUInteger rowIndex = 0;
-    for (; rowIndex < rowCount; rowIndex++) {
-        CGFloat rowHeight = [[_rowHeights objectAtIndex:rowIndex] doubleValue];
-        if (!flipped) {
-            y -= rowHeight;
+    BOOL changed = NO;
+    NSUInteger rowIndex = [_estimatedRows indexGreaterThanOrEqualToIndex:rows.location];
+    while (rowIndex != NSNotFound && rowIndex < NSMaxRange(rows)) {
+        CGFloat lineHeight = (rowIndex == 0 ? _headerLineHeight : _bodyLineHeight);
+        CGFloat measured = OMPipeTableMeasuredRowHeight([_attributedRows objectAtIndex:rowIndex],
+                                                        columnCount,
+                                                        _columnWidths,
+                                                        lineHeight,
+                                                        _verticalPadding);
+        if (measured != _rowHeights[rowIndex]) {
+            _rowHeights[rowIndex] = measured;
+            if (_validOffsetCount > rowIndex + 1) {
+                _validOffsetCount = rowIndex + 1;
+            }
+            changed = YES;
         }
+        rowIndex = [_estimatedRows indexGreaterThanIndex:rowIndex];
+    }
+    [_estimatedRows removeIndexesInRange:rows];
 
+    if (changed) {
+        [self om_ensureRowOffsets];
+        _tableSize.height = ceil(_rowOffsets[_rowCount]);
+    }
+    return changed;
+}
+
+- (void)om_drawRows:(NSRange)rows
+            originX:(CGFloat)originX
+           tableTop:(CGFloat)tableTop
+            flipped:(BOOL)flipped
+{
+    NSUInteger columnCount = [_alignments count];
+    NSUInteger rowIndex = rows.location;
+    for (; rowIndex < NSMaxRange(rows); rowIndex++) {
+        CGFloat rowHeight = _rowHeights[rowIndex];
+        CGFloat y = flipped ? (tableTop + _rowOffsets[rowIndex])
+                            : (tableTop - _rowOffsets[rowIndex] - rowHeight);
         NSColor *rowBackground = (rowIndex == 0 ? _headerBackgroundColor : _bodyBackgroundColor);
-        if (rowBackground == nil) {
-            rowBackground = [NSColor whiteColor];
-        }
+        NSArray *rowSegments = [_attributedRows objectAtIndex:rowIndex];
 
-        CGFloat x = NSMinX(tableRect) + _borderWidth;
+        CGFloat x = originX + _borderWidth;
         NSUInteger colIndex = 0;
         for (; colIndex < columnCount; colIndex++) {
             CGFloat contentWidth = [[_columnWidths objectAtIndex:colIndex] doubleValue];
@@ -2969,7 +4842,6 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
             [rowBackground setFill];
             NSRectFill(cellRect);
 
-            NSArray *rowSegments = [_attributedRows objectAtIndex:rowIndex];
             NSAttributedString *segment = (colIndex < [rowSegments count] ? [rowSegments objectAtIndex:colIndex] : nil);
             if (segment != nil && [segment length] > 0) {
                 OMPipeTableAlignment alignment = (OMPipeTableAlignment)[[_alignments objectAtIndex:colIndex] unsignedIntegerValue];
@@ -2984,10 +4856,191 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
             }
             x += cellWidth + _borderWidth;
         }
-        if (flipped) {
-            y += rowHeight + _borderWidth;
+    }
+}
+
+// Raster of the band [bandTop, bandTop + bandHeight) holding rows, or nil
+// when the band is too large to be worth keeping.
+- (NSImage *)om_tileImageForRows:(NSRange)rows
+                       tileIndex:(NSUInteger)tileIndex
+                         bandTop:(CGFloat)bandTop
+                      bandHeight:(CGFloat)bandHeight
+{
+    CGFloat width = _tableSize.width;
+    double cost = width * bandHeight * 4.0;
+    if (_tileCacheKey == nil || width <= 0.0 || bandHeight <= 0.0 ||
+        cost > (double)(OMPipeTableTileCacheCostLimit / 4)) {
+        return nil;
+    }
+
+    NSCache *cache = OMPipeTableTileCache();
+    NSString *key = [NSString stringWithFormat:@"%@|%lu", _tileCacheKey, (unsigned long)tileIndex];
+    NSSize tileSize = NSMakeSize(width, bandHeight);
+    // Entries are (image, rows drawn into it); the rows are compared on a
+    // hit so a content hash collision can never show another table's cells.
+    NSArray *tileRows = [_attributedRows subarrayWithRange:rows];
+    NSArray *entry = [cache objectForKey:key];
+    NSImage *image = [entry objectAtIndex:0];
+    if (image != nil && NSEqualSizes([image size], tileSize) &&
+        [[entry objectAtIndex:1] isEqualToArray:tileRows]) {
+        return image;
+    }
+
+    image = [[[NSImage alloc] initWithSize:tileSize] autorelease];
+    [image lockFocus];
+    [_borderColor setFill];
+    NSRectFill(NSMakeRect(0.0, 0.0, width, bandHeight));
+    [self om_drawRows:rows originX:0.0 tableTop:(bandTop + bandHeight) flipped:NO];
+    [image unlockFocus];
+    [cache setObject:[NSArray arrayWithObjects:image, tileRows, nil] forKey:key cost:(NSUInteger)cost];
+    return image;
+}
+
+- (void)om_relayoutAttachment
+{
+    NSLayoutManager *layoutManager = [_relayoutManager autorelease];
+    _relayoutManager = nil;
+    NSTextStorage *storage = [layoutManager textStorage];
+    NSUInteger charIndex = _relayoutCharacterIndex;
+    NSUInteger length = [storage length];
+    if (charIndex == NSNotFound) {
+        // Drawn through a path that did not say where the attachment is.
+        NSUInteger location = 0;
+        while (location < length && charIndex == NSNotFound) {
+            NSRange run = NSMakeRange(location, 0);
+            NSTextAttachment *candidate = [storage attribute:NSAttachmentAttributeName
+                                                     atIndex:location
+                                              effectiveRange:&run];
+            if ([candidate attachmentCell] == self) {
+                charIndex = location;
+            }
+            location = NSMaxRange(run);
+        }
+    }
+    if (storage == nil || charIndex >= length) {
+        return;
+    }
+    NSTextAttachment *attachment = [storage attribute:NSAttachmentAttributeName
+                                              atIndex:charIndex
+                                       effectiveRange:NULL];
+    if ([attachment attachmentCell] != self) {
+        return;
+    }
+    [layoutManager invalidateLayoutForCharacterRange:NSMakeRange(charIndex, 1)
+                                              isSoft:NO
+                                actualCharacterRange:NULL];
+}
+
+- (void)om_scheduleRelayoutWithLayoutManager:(NSLayoutManager *)layoutManager
+                              characterIndex:(NSUInteger)charIndex
+{
+    if (layoutManager == nil || _relayoutManager != nil) {
+        return;
+    }
+    // Layout must not change underneath the drawing pass that got us here.
+    _relayoutManager = [layoutManager retain];
+    _relayoutCharacterIndex = charIndex;
+    [self performSelector:@selector(om_relayoutAttachment) withObject:nil afterDelay:0.0];
+}
+
+- (void)om_drawTableInFrame:(NSRect)cellFrame
+                     inView:(NSView *)controlView
+             characterIndex:(NSUInteger)charIndex
+              layoutManager:(NSLayoutManager *)layoutManager
+{
+    if (_rowCount == 0 ||
+        _alignments == nil || [_alignments count] == 0 ||
+        _columnWidths == nil || [_columnWidths count] == 0) {
+        return;
+    }
+
+    BOOL flipped = (controlView != nil ? [controlView isFlipped] : NO);
+    NSRect tableRect = OMPipeTableIntegralRect(cellFrame);
+    if (tableRect.size.width < _tableSize.width) {
+        tableRect.size.width = _tableSize.width;
+    }
+    if (tableRect.size.height < _tableSize.height) {
+        tableRect.size.height = _tableSize.height;
+    }
+
+    // Printing and PDF export get every row as vector text.
+    BOOL toScreen = [NSGraphicsContext currentContextDrawingToScreen];
+    NSRect drawRect = tableRect;
+    if (toScreen && controlView != nil) {
+        drawRect = NSIntersectionRect(tableRect, [controlView visibleRect]);
+        if (NSIsEmptyRect(drawRect)) {
+            return;
+        }
+    }
+
+    NSUInteger firstTile = 0;
+    NSUInteger lastTile = 0;
+    BOOL resized = NO;
+    for (;;) {
+        CGFloat visibleTop = flipped ? (NSMinY(drawRect) - NSMinY(tableRect))
+                                     : (NSMaxY(tableRect) - NSMaxY(drawRect));
+        NSUInteger firstRow = [self om_rowIndexAtOffset:visibleTop];
+        NSUInteger lastRow = [self om_rowIndexAtOffset:(visibleTop + NSHeight(drawRect))];
+        if (firstRow >= _rowCount) {
+            firstRow = _rowCount - 1;
+        }
+        if (lastRow >= _rowCount) {
+            lastRow = _rowCount - 1;
+        }
+        firstTile = firstRow / OMPipeTableTileRowCount;
+        lastTile = lastRow / OMPipeTableTileRowCount;
+        NSUInteger measureStart = firstTile * OMPipeTableTileRowCount;
+        NSUInteger measureEnd = (lastTile + 1) * OMPipeTableTileRowCount;
+        if (measureEnd > _rowCount) {
+            measureEnd = _rowCount;
+        }
+        // Each pass retires the estimated rows it measured, so this settles.
+        if (![self om_measureEstimatedRowsInRange:NSMakeRange(measureStart, measureEnd - measureStart)]) {
+            break;
+        }
+        resized = YES;
+    }
+    if (resized) {
+        [self om_scheduleRelayoutWithLayoutManager:layoutManager characterIndex:charIndex];
+    }
+
+    NSGraphicsContext *context = [NSGraphicsContext currentContext];
+    [context saveGraphicsState];
+
+    CGFloat tableTop = flipped ? NSMinY(tableRect) : NSMaxY(tableRect);
+    NSUInteger tileIndex = firstTile;
+    for (; tileIndex <= lastTile; tileIndex++) {
+        NSUInteger tileStart = tileIndex * OMPipeTableTileRowCount;
+        NSUInteger tileEnd = tileStart + OMPipeTableTileRowCount;
+        if (tileEnd > _rowCount) {
+            tileEnd = _rowCount;
+        }
+        NSRange rows = NSMakeRange(tileStart, tileEnd - tileStart);
+        CGFloat bandTop = (tileStart == 0 ? 0.0 : _rowOffsets[tileStart]);
+        CGFloat bandBottom = (tileEnd == _rowCount ? _tableSize.height : _rowOffsets[tileEnd]);
+        CGFloat bandHeight = bandBottom - bandTop;
+        NSRect bandRect = flipped
+                          ? NSMakeRect(NSMinX(tableRect), tableTop + bandTop, _tableSize.width, bandHeight)
+                          : NSMakeRect(NSMinX(tableRect), tableTop - bandBottom, _tableSize.width, bandHeight);
+
+        NSImage *tile = nil;
+        if (toScreen) {
+            tile = [self om_tileImageForRows:rows
+                                   tileIndex:tileIndex
+                                     bandTop:bandTop
+                                  bandHeight:bandHeight];
+        }
+        if (tile != nil) {
+            [tile drawInRect:bandRect
+                    fromRect:NSZeroRect
+                   operation:NSCompositeSourceOver
+                    fraction:1.0
+              respectFlipped:YES
+                       hints:nil];
         } else {
-            y -= _borderWidth;
+            [_borderColor setFill];
+            NSRectFill(bandRect);
+            [self om_drawRows:rows originX:NSMinX(tableRect) tableTop:tableTop flipped:flipped];
         }
     }
     [context restoreGraphicsState];
@@ -2995,17 +5048,20 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
 
 - (void)drawWithFrame:(NSRect)cellFrame inView:(NSView *)controlView
 {
-    BOOL flipped = (controlView != nil ? [controlView isFlipped] : NO);
-    [self om_drawTableInFrame:cellFrame flipped:flipped];
+    [self om_drawTableInFrame:cellFrame
+                       inView:controlView
+               characterIndex:NSNotFound
+                layoutManager:OMPipeTableLayoutManagerForView(controlView)];
 }
 
 - (void)drawWithFrame:(NSRect)cellFrame
                inView:(NSView *)controlView
        characterIndex:(NSUInteger)charIndex
 {
-    (void)charIndex;
-    BOOL flipped = (controlView != nil ? [controlView isFlipped] : NO);
-    [self om_drawTableInFrame:cellFrame flipped:flipped];
+    [self om_drawTableInFrame:cellFrame
+                       inView:controlView
+               characterIndex:charIndex
+                layoutManager:OMPipeTableLayoutManagerForView(controlView)];
 }
 
 - (void)drawWithFrame:(NSRect)cellFrame
@@ -3013,10 +5069,10 @@ static NSImage *OMPipeTableImageFromRows(NSArray *attributedRows,
        characterIndex:(NSUInteger)charIndex
         layoutManager:(NSLayoutManager *)layoutManager
 {
-    (void)charIndex;
-    (void)layoutManager;
-    BOOL flipped = (controlView != nil ? [controlView isFlipped] : NO);
-    [self om_drawTableInFrame:cellFrame flipped:flipped];
+    [self om_drawTableInFrame:cellFrame
+                       inView:controlView
+               characterIndex:charIndex
+                layoutManager:(layoutManager != nil ? layoutManager : OMPipeTableLayoutManagerForView(controlView))];
 }
 
 @end
@@ -3040,8 +5096,12 @@ static NSAttributedString *OMPipeTableAttachmentAttributedString(NSArray *attrib
 
     NSUInteger rowCount = [attributedRows count];
     NSUInteger columnCount = [alignments count];
+    BOOL largeTable = (rowCount > OMPipeTableLazyRowThreshold);
     NSMutableArray *columnWidths = nil;
     NSMutableArray *rowHeights = nil;
+    NSMutableIndexSet *estimatedRows = nil;
+    CGFloat headerLineHeight = 0.0;
+    CGFloat bodyLineHeight = 0.0;
     CGFloat borderWidth = 0.0;
     CGFloat horizontalPadding = 0.0;
     CGFloat verticalPadding = 0.0;
@@ -3055,8 +5115,12 @@ static NSAttributedString *OMPipeTableAttachmentAttributedString(NSArray *attrib
                                               headerFont,
                                               scale,
                                               maxWidth,
+                                              largeTable,
                                               &columnWidths,
                                               &rowHeights,
+                                              &estimatedRows,
+                                              &headerLineHeight,
+                                              &bodyLineHeight,
                                               &borderWidth,
                                               &horizontalPadding,
                                               &verticalPadding,
@@ -3066,21 +5130,44 @@ static NSAttributedString *OMPipeTableAttachmentAttributedString(NSArray *attrib
         return nil;
     }
 
+    NSString *tileCacheKey = [NSString stringWithFormat:@"%016llx|%lux%lu|%.3f|%.1f|%@|%@ %.2f|%@ %.2f|%@|%@|%@|%@",
+                                                        OMPipeTableContentHash(attributedRows),
+                                                        (unsigned long)rowCount,
+                                                        (unsigned long)columnCount,
+                                                        scale,
+                                                        maxWidth,
+                                                        [alignments componentsJoinedByString:@","],
+                                                        [tableFont fontName],
+                                                        [tableFont pointSize],
+                                                        [headerFont fontName],
+                                                        [headerFont pointSize],
+                                                        OMPipeTableColorKey([attributes objectForKey:NSForegroundColorAttributeName]),
+                                                        OMPipeTableColorKey(borderColor),
+                                                        OMPipeTableColorKey(headerBackgroundColor),
+                                                        OMPipeTableColorKey(bodyBackgroundColor)];
+
     NSTextAttachment *attachment = [[[NSTextAttachment alloc] initWithFileWrapper:nil] autorelease];
     OMPipeTableAttachmentCell *cell = [[[OMPipeTableAttachmentCell alloc] initWithAttributedRows:attributedRows
                                                                                         alignments:alignments
                                                                                       columnWidths:columnWidths
                                                                                         rowHeights:rowHeights
+                                                                                     estimatedRows:estimatedRows
+                                                                                  headerLineHeight:headerLineHeight
+                                                                                    bodyLineHeight:bodyLineHeight
                                                                                        borderColor:borderColor
                                                                              headerBackgroundColor:headerBackgroundColor
                                                                                bodyBackgroundColor:bodyBackgroundColor
                                                                                        borderWidth:borderWidth
                                                                                  horizontalPadding:horizontalPadding
                                                                                    verticalPadding:verticalPadding
-                                                                                         tableSize:NSMakeSize(totalWidth, totalHeight)] autorelease];
+                                                                                         tableSize:NSMakeSize(totalWidth, totalHeight)
+                                                                                      tileCacheKey:tileCacheKey] autorelease];
     if (cell != nil) {
         [attachment setAttachmentCell:cell];
     } else {
+        if (largeTable) {
+            return nil;
+        }
         NSImage *tableImage = OMPipeTableImageFromRows(attributedRows,
                                                        visibleRows,
                                                        alignments,
@@ -3124,6 +5211,7 @@ static void OMRenderPipeTable(NSArray *rows,
     if (rows == nil || [rows count] == 0 || alignments == nil || [alignments count] == 0) {
         return;
     }
+    OM_PERF_TRACE_SCOPE("table", "table");
 
     NSUInteger columnCount = [alignments count];
     NSArray *visibleRows = OMPipeTableVisibleRows(rows);
@@ -3359,22 +5447,6 @@ static NSURL *OMResolvedImageURL(NSString *urlString,
     return fileURL;
 }
 
-static NSImage *OMLoadImageFromURL(NSURL *url)
-{
-    if (url == nil) {
-        return nil;
-    }
-
-    if ([url isFileURL]) {
-        NSString *path = [url path];
-        if (path == nil || [path length] == 0) {
-            return nil;
-        }
-        return [[[NSImage alloc] initWithContentsOfFile:path] autorelease];
-    }
-    return nil;
-}
-
 static NSURL *OMResolvedLinkURL(NSString *urlString,
                                 const OMRenderContext *renderContext)
 {
@@ -3422,10 +5494,12 @@ static NSURL *OMResolvedLinkURL(NSString *urlString,
     return fileURL;
 }
 
-static NSAttributedString *OMImageAttachmentAttributedString(cmark_node *imageNode,
-                                                             NSMutableDictionary *attributes,
-                                                             CGFloat scale,
-                                                             const OMRenderContext *renderContext)
+// The resolved URL of an image node and its memory cache key at this scale
+// and layout width; nil when the image cannot be shown.
+static NSURL *OMImageNodeURLAndCacheKey(cmark_node *imageNode,
+                                        CGFloat scale,
+                                        const OMRenderContext *renderContext,
+                                        NSString **cacheKeyOut)
 {
     if (imageNode == NULL) {
         return nil;
@@ -3446,12 +5520,26 @@ static NSAttributedString *OMImageAttachmentAttributedString(cmark_node *imageNo
         return nil;
     }
 
+    *cacheKeyOut = OMImageAttachmentCacheKey(urlKey,
+                                             scale,
+                                             renderContext != NULL ? renderContext->layoutWidth : 0.0,
+                                             OMShouldAllowRemoteImages(renderContext));
+    return url;
+}
+
+static NSAttributedString *OMImageAttachmentAttributedString(cmark_node *imageNode,
+                                                             NSMutableDictionary *attributes,
+                                                             CGFloat scale,
+                                                             const OMRenderContext *renderContext)
+{
+    NSString *cacheKey = nil;
+    NSURL *url = OMImageNodeURLAndCacheKey(imageNode, scale, renderContext, &cacheKey);
+    if (url == nil) {
+        return nil;
+    }
+
     BOOL allowRemoteImages = OMShouldAllowRemoteImages(renderContext);
     CGFloat layoutWidth = renderContext != NULL ? renderContext->layoutWidth : 0.0;
-    NSString *cacheKey = OMImageAttachmentCacheKey(urlKey,
-                                                   scale,
-                                                   layoutWidth,
-                                                   allowRemoteImages);
     NSCache *cache = OMImageAttachmentCache();
     NSImage *cachedImage = nil;
     @synchronized (cache) {
@@ -3459,31 +5547,70 @@ static NSAttributedString *OMImageAttachmentAttributedString(cmark_node *imageNo
     }
 
     NSImage *preparedImage = nil;
+    NSSize placeholderSize = NSZeroSize;
     if (cachedImage != nil) {
         preparedImage = [[cachedImage retain] autorelease];
     } else {
         if (OMURLUsesRemoteScheme(url)) {
-            OMScheduleAsyncRemoteImageWarm(url, cacheKey, scale, layoutWidth, allowRemoteImages);
+            if (allowRemoteImages) {
+                OMScheduleAsyncImageLoad(url, nil, nil, cacheKey, scale, layoutWidth, renderContext);
+            }
             return nil;
         }
 
-        NSImage *loaded = OMLoadImageFromURL(url);
-        if (loaded == nil) {
+        NSString *path = [url path];
+        if (path == nil || [path length] == 0) {
             return nil;
         }
-
-        preparedImage = OMPreparedImageForAttachment(loaded, scale, layoutWidth);
-        if (preparedImage == nil) {
+        NSDictionary *fileAttributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
+        if (fileAttributes == nil) {
             return nil;
         }
 
-        @synchronized (cache) {
-            [cache setObject:preparedImage forKey:cacheKey];
+        // The header gives the display size, and with it the disk cache key,
+        // without decoding the file.
+        NSString *diskKey = nil;
+        NSSize naturalSize = NSZeroSize;
+        if (OMProbeImageFileDimensions(path, &naturalSize)) {
+            NSSize targetSize = OMPreparedImageSize(naturalSize, scale, layoutWidth);
+            diskKey = OMImageDiskCacheKey(path, fileAttributes, targetSize);
+            preparedImage = OMImageDiskCacheImageForKey(diskKey, targetSize);
+            if (preparedImage == nil && renderContext != NULL &&
+                renderContext->asynchronousImageLoadingEnabled) {
+                OMScheduleAsyncImageLoad(url, path, diskKey, cacheKey, scale, layoutWidth, renderContext);
+                placeholderSize = targetSize;
+            }
+        }
+
+        if (preparedImage == nil && placeholderSize.width <= 0.0) {
+            NSData *png = nil;
+            preparedImage = OMDecodedPreparedImage([NSData dataWithContentsOfFile:path],
+                                                   scale,
+                                                   layoutWidth,
+                                                   &png);
+            if (preparedImage == nil) {
+                return nil;
+            }
+            if (diskKey == nil) {
+                diskKey = OMImageDiskCacheKey(path, fileAttributes, [preparedImage size]);
+            }
+            OMImageDiskCacheStoreData(png, diskKey);
+        }
+
+        if (preparedImage != nil) {
+            @synchronized (cache) {
+                [cache setObject:preparedImage forKey:cacheKey];
+            }
         }
     }
 
     NSTextAttachment *attachment = [[[NSTextAttachment alloc] initWithFileWrapper:nil] autorelease];
-    NSTextAttachmentCell *cell = [[[NSTextAttachmentCell alloc] initImageCell:preparedImage] autorelease];
+    NSTextAttachmentCell *cell = nil;
+    if (preparedImage != nil) {
+        cell = [[[NSTextAttachmentCell alloc] initImageCell:preparedImage] autorelease];
+    } else {
+        cell = [[[OMImagePlaceholderAttachmentCell alloc] initWithPlaceholderSize:placeholderSize] autorelease];
+    }
     [attachment setAttachmentCell:cell];
 
     NSMutableDictionary *attachmentAttributes = [NSMutableDictionary dictionary];
@@ -4105,14 +6232,15 @@ static dispatch_queue_t OMMathArtifactQueue(void)
     return queue;
 }
 
-static dispatch_semaphore_t OMMathArtifactSemaphore(void)
+static OMBoundedWorkQueue *OMMathArtifactWorkQueue(void)
 {
-    static dispatch_semaphore_t semaphore = NULL;
+    static OMBoundedWorkQueue *workQueue = nil;
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
-        semaphore = dispatch_semaphore_create((long)OMMathArtifactConcurrencyLimit());
+        workQueue = [[OMBoundedWorkQueue alloc] initWithQueue:OMMathArtifactQueue()
+                                                  workerLimit:OMMathArtifactConcurrencyLimit()];
     });
-    return semaphore;
+    return workQueue;
 }
 
 static NSMutableSet *OMMathPendingAssetKeys(void)
@@ -4173,6 +6301,25 @@ static NSImage *OMBestAvailableMathImage(NSString *formula,
     return image;
 }
 
+// A cached image of the formula rendered at renderZoom or finer, e.g. from
+// the on-screen preview when exporting at a smaller zoom. Scaling it down
+// loses nothing, so it stands in for a fresh TeX run.
+static NSImage *OMSharperCachedMathImage(NSString *formula,
+                                         BOOL displayMath,
+                                         CGFloat renderZoom,
+                                         CGFloat *renderZoomOut)
+{
+    CGFloat availableZoom = 0.0;
+    NSImage *image = OMBestAvailableMathImage(formula, displayMath, &availableZoom);
+    if (image == nil || availableZoom + 0.001 < renderZoom) {
+        return nil;
+    }
+    if (renderZoomOut != NULL) {
+        *renderZoomOut = availableZoom;
+    }
+    return image;
+}
+
 static CGFloat OMMathZoomForFontSize(CGFloat fontSize)
 {
     CGFloat zoom = fontSize > 0.0 ? (fontSize / 10.0) : 1.0;
@@ -4308,23 +6455,136 @@ static BOOL OMRunTask(NSString *launchPath,
     }
 #endif
 
-    return launched && !timedOut && [task terminationStatus] == 0;
+    return launched && !timedOut && [task terminationStatus] == 0;
+}
+
+static NSString *OMCreateMathTempDirectory(void)
+{
+    NSString *base = NSTemporaryDirectory();
+    if (base == nil || [base length] == 0) {
+        base = @"/tmp";
+    }
+    NSString *path = [base stringByAppendingPathComponent:
+        [NSString stringWithFormat:@"objcmarkdown-math-%@",
+         [[NSProcessInfo processInfo] globallyUniqueString]]];
+    BOOL created = [[NSFileManager defaultManager] createDirectoryAtPath:path
+                                              withIntermediateDirectories:YES
+                                                               attributes:nil
+                                                                    error:NULL];
+    return created ? path : nil;
+}
+
+// Bump whenever the generated TeX source or tool arguments change so stale
+// on-disk artifacts are never reused.
+static const NSUInteger OMMathDiskCachePreambleVersion = 1;
+static const unsigned long long OMMathDiskCacheDefaultLimitBytes = 128ULL * 1024ULL * 1024ULL;
+
+// OMD_MATH_CACHE_DIR moves the cache (an empty value disables it) and
+// OMD_MATH_CACHE_MB sets its budget; the OBJCMARKDOWN_ spellings still work.
+static OMDiskCache *OMMathDiskCache(void)
+{
+    static OMDiskCache *cache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSDictionary *environment = [[NSProcessInfo processInfo] environment];
+        NSString *directory = [environment objectForKey:@"OMD_MATH_CACHE_DIR"];
+        if (directory == nil) {
+            directory = [environment objectForKey:@"OBJCMARKDOWN_MATH_CACHE_DIR"];
+        }
+        if (directory == nil) {
+            directory = OMDiskCacheUserDirectory(@"math");
+        }
+        NSArray *limitKeys = [NSArray arrayWithObjects:@"OMD_MATH_CACHE_MB", @"OBJCMARKDOWN_MATH_CACHE_MB", nil];
+        unsigned long long limit = OMDiskCacheLimitSetting(limitKeys,
+                                                           @"ObjcMarkdownMathCacheMB",
+                                                           OMMathDiskCacheDefaultLimitBytes);
+        cache = [[OMDiskCache alloc] initWithDirectory:directory byteLimit:limit];
+    });
+    return cache;
+}
+
+static BOOL OMMathDiskCacheEnabled(void)
+{
+    return [OMMathDiskCache() isEnabled];
+}
+
+static NSString *OMMathDiskCacheBackendIdentifier(void)
+{
+    NSString *tex = OMLaTeXExecutablePath() != nil ? @"latex" : @"plaintex";
+#if defined(_WIN32)
+    return [NSString stringWithFormat:@"%@+dvipng", tex];
+#else
+    return [NSString stringWithFormat:@"%@+dvisvgm", tex];
+#endif
+}
+
+// An artifact's disk identity: the asset key, backend and preamble version.
+static NSString *OMMathDiskCacheKey(NSString *assetKey)
+{
+    if (assetKey == nil) {
+        return nil;
+    }
+    return [NSString stringWithFormat:@"v%lu|%@|%@",
+            (unsigned long)OMMathDiskCachePreambleVersion,
+            OMMathDiskCacheBackendIdentifier(),
+            assetKey];
+}
+
+static NSString *OMMathDiskCacheExistingPath(NSString *assetKey, NSString *extension)
+{
+    return [OMMathDiskCache() existingPathForKey:OMMathDiskCacheKey(assetKey) extension:extension];
+}
+
+static NSData *OMMathDiskCacheDataForAssetKey(NSString *assetKey, NSString *extension)
+{
+    return [OMMathDiskCache() dataForKey:OMMathDiskCacheKey(assetKey) extension:extension];
+}
+
+static void OMMathDiskCacheStoreData(NSData *data, NSString *assetKey, NSString *extension)
+{
+    [OMMathDiskCache() storeData:data forKey:OMMathDiskCacheKey(assetKey) extension:extension];
+}
+
+static void OMAppendMathTeXPreamble(NSMutableString *texSource, BOOL usingLaTeX)
+{
+    if (usingLaTeX) {
+        [texSource appendString:@"\\documentclass{article}\n"];
+        [texSource appendString:@"\\usepackage{amsmath}\n"];
+        [texSource appendString:@"\\pagestyle{empty}\n"];
+        [texSource appendString:@"\\begin{document}\n"];
+    } else {
+        [texSource appendString:@"\\hsize=10000pt\n"];
+        [texSource appendString:@"\\nopagenumbers\n"];
+    }
+}
+
+// Each formula ships out as exactly one page, which is what lets a batch
+// document be split back into per-formula artifacts.
+static void OMAppendMathTeXFormula(NSMutableString *texSource, NSString *formula, BOOL displayMath, BOOL usingLaTeX)
+{
+    if (usingLaTeX) {
+        if (displayMath) {
+            [texSource appendFormat:@"\\[\n%@\n\\]\n", formula];
+        } else {
+            [texSource appendFormat:@"$%@$ \n", formula];
+        }
+    } else {
+        if (displayMath) {
+            [texSource appendFormat:@"\\setbox0=\\vbox{$$%@$$}\n", formula];
+        } else {
+            [texSource appendFormat:@"\\setbox0=\\hbox{$%@$}\n", formula];
+        }
+        [texSource appendString:@"\\shipout\\box0\n"];
+    }
 }
-
-static NSString *OMCreateMathTempDirectory(void)
+
+static void OMAppendMathTeXPostamble(NSMutableString *texSource, BOOL usingLaTeX)
 {
-    NSString *base = NSTemporaryDirectory();
-    if (base == nil || [base length] == 0) {
-        base = @"/tmp";
-    }
-    NSString *path = [base stringByAppendingPathComponent:
-        [NSString stringWithFormat:@"objcmarkdown-math-%@",
-         [[NSProcessInfo processInfo] globallyUniqueString]]];
-    BOOL created = [[NSFileManager defaultManager] createDirectoryAtPath:path
-                                              withIntermediateDirectories:YES
-                                                               attributes:nil
-                                                                    error:NULL];
-    return created ? path : nil;
+    if (usingLaTeX) {
+        [texSource appendString:@"\\end{document}\n"];
+    } else {
+        [texSource appendString:@"\\bye\n"];
+    }
 }
 
 #if defined(_WIN32)
@@ -4495,6 +6755,7 @@ static NSImage *OMPNGImageForMathFormula(NSString *formula,
         return nil;
     }
 
+    NSString *assetKey = OMMathAssetCacheKey(formula, displayMath, renderZoom);
     NSString *tempDir = OMCreateMathTempDirectory();
     if (tempDir == nil) {
         return nil;
@@ -4518,28 +6779,9 @@ static NSImage *OMPNGImageForMathFormula(NSString *formula,
     }
 
     NSMutableString *texSource = [NSMutableString string];
-    if (usingLaTeX) {
-        [texSource appendString:@"\\documentclass{article}\n"];
-        [texSource appendString:@"\\usepackage{amsmath}\n"];
-        [texSource appendString:@"\\pagestyle{empty}\n"];
-        [texSource appendString:@"\\begin{document}\n"];
-        if (displayMath) {
-            [texSource appendFormat:@"\\[\n%@\n\\]\n", formula];
-        } else {
-            [texSource appendFormat:@"$%@$ \n", formula];
-        }
-        [texSource appendString:@"\\end{document}\n"];
-    } else {
-        [texSource appendString:@"\\hsize=10000pt\n"];
-        [texSource appendString:@"\\nopagenumbers\n"];
-        if (displayMath) {
-            [texSource appendFormat:@"\\setbox0=\\vbox{$$%@$$}\n", formula];
-        } else {
-            [texSource appendFormat:@"\\setbox0=\\hbox{$%@$}\n", formula];
-        }
-        [texSource appendString:@"\\shipout\\box0\n"];
-        [texSource appendString:@"\\bye\n"];
-    }
+    OMAppendMathTeXPreamble(texSource, usingLaTeX);
+    OMAppendMathTeXFormula(texSource, formula, displayMath, usingLaTeX);
+    OMAppendMathTeXPostamble(texSource, usingLaTeX);
 
     if (![texSource writeToFile:texPath
                      atomically:YES
@@ -4635,6 +6877,8 @@ static NSImage *OMPNGImageForMathFormula(NSString *formula,
                         OMMathLogSnippet([[attributes objectForKey:NSFileSize] description]),
                         OMMathLogSnippet(formula)]);
 #endif
+    } else {
+        OMMathDiskCacheStoreData([NSData dataWithContentsOfFile:pngPath], assetKey, @"png");
     }
     [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
     return image;
@@ -4655,6 +6899,7 @@ static NSData *OMSVGDataForMathFormula(NSString *formula,
         return nil;
     }
 
+    NSString *assetKey = OMMathAssetCacheKey(formula, displayMath, renderZoom);
     NSString *tempDir = OMCreateMathTempDirectory();
     if (tempDir == nil) {
         return nil;
@@ -4673,28 +6918,9 @@ static NSData *OMSVGDataForMathFormula(NSString *formula,
     }
 
     NSMutableString *texSource = [NSMutableString string];
-    if (usingLaTeX) {
-        [texSource appendString:@"\\documentclass{article}\n"];
-        [texSource appendString:@"\\usepackage{amsmath}\n"];
-        [texSource appendString:@"\\pagestyle{empty}\n"];
-        [texSource appendString:@"\\begin{document}\n"];
-        if (displayMath) {
-            [texSource appendFormat:@"\\[\n%@\n\\]\n", formula];
-        } else {
-            [texSource appendFormat:@"$%@$ \n", formula];
-        }
-        [texSource appendString:@"\\end{document}\n"];
-    } else {
-        [texSource appendString:@"\\hsize=10000pt\n"];
-        [texSource appendString:@"\\nopagenumbers\n"];
-        if (displayMath) {
-            [texSource appendFormat:@"\\setbox0=\\vbox{$$%@$$}\n", formula];
-        } else {
-            [texSource appendFormat:@"\\setbox0=\\hbox{$%@$}\n", formula];
-        }
-        [texSource appendString:@"\\shipout\\box0\n"];
-        [texSource appendString:@"\\bye\n"];
-    }
+    OMAppendMathTeXPreamble(texSource, usingLaTeX);
+    OMAppendMathTeXFormula(texSource, formula, displayMath, usingLaTeX);
+    OMAppendMathTeXPostamble(texSource, usingLaTeX);
 
     BOOL wroteTex = [texSource writeToFile:texPath
                                 atomically:YES
@@ -4705,71 +6931,500 @@ static NSData *OMSVGDataForMathFormula(NSString *formula,
         return nil;
     }
 
-    NSArray *texArguments = [NSArray arrayWithObjects:
-        @"-interaction=nonstopmode",
-        @"-halt-on-error",
-        @"-output-directory", @".",
-        @"formula.tex",
-        nil];
-    int texStatus = 0;
-    NSTimeInterval texStart = OMNow();
-    BOOL texOK = OMRunTask(texExecutable,
-                           tempDir,
-                           texArguments,
-                           NULL,
-                           NULL,
-                           &texStatus,
-                           externalToolTimeout);
-    if (stats != NULL) {
-        stats->latexRuns += 1;
-        stats->latexSeconds += (OMNow() - texStart);
+    NSArray *texArguments = [NSArray arrayWithObjects:
+        @"-interaction=nonstopmode",
+        @"-halt-on-error",
+        @"-output-directory", @".",
+        @"formula.tex",
+        nil];
+    int texStatus = 0;
+    NSTimeInterval texStart = OMNow();
+    BOOL texOK = OMRunTask(texExecutable,
+                           tempDir,
+                           texArguments,
+                           NULL,
+                           NULL,
+                           &texStatus,
+                           externalToolTimeout);
+    if (stats != NULL) {
+        stats->latexRuns += 1;
+        stats->latexSeconds += (OMNow() - texStart);
+    }
+    if (!texOK || ![[NSFileManager defaultManager] fileExistsAtPath:dviPath]) {
+        [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
+        return nil;
+    }
+
+    if (renderZoom < 0.5) {
+        renderZoom = 0.5;
+    } else if (renderZoom > 10.0) {
+        renderZoom = 10.0;
+    }
+    NSString *zoomArgument = [NSString stringWithFormat:@"--zoom=%.3f", renderZoom];
+
+    NSArray *svgArguments = [NSArray arrayWithObjects:
+        @"--no-fonts",
+        @"--exact-bbox",
+        zoomArgument,
+        @"--stdout",
+        @"formula.dvi",
+        nil];
+    NSData *svgData = nil;
+    int svgStatus = 0;
+    NSTimeInterval svgStart = OMNow();
+    BOOL svgOK = OMRunTask(OMDviSvgmExecutablePath(),
+                           tempDir,
+                           svgArguments,
+                           &svgData,
+                           NULL,
+                           &svgStatus,
+                           externalToolTimeout);
+    if (stats != NULL) {
+        stats->dvisvgmRuns += 1;
+        stats->dvisvgmSeconds += (OMNow() - svgStart);
+    }
+    [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
+
+    if (!svgOK || svgData == nil || [svgData length] == 0) {
+        return nil;
+    }
+    OMMathDiskCacheStoreData(svgData, assetKey, @"svg");
+    return svgData;
+}
+
+static const NSUInteger OMMathBatchMaximumSize = 32;
+static const NSTimeInterval OMMathBatchCollectionWindow = 0.04;
+// TeX runs per batch before the formulas still missing are compiled alone.
+static const NSUInteger OMMathBatchMaximumRuns = 3;
+
+static BOOL OMMathBatchingEnabled(void)
+{
+    static BOOL enabled = YES;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+#if defined(_WIN32)
+        // Batches are split into pages by dvisvgm; the Windows backend
+        // rasterizes single formulas with dvipng instead.
+        enabled = NO;
+#else
+        if (OMDviSvgmExecutablePath() == nil) {
+            enabled = NO;
+            return;
+        }
+        NSDictionary *environment = [[NSProcessInfo processInfo] environment];
+        NSString *flag = [environment objectForKey:@"OMD_MATH_BATCH"];
+        if (flag == nil || [flag length] == 0) {
+            flag = [environment objectForKey:@"OBJCMARKDOWN_MATH_BATCH"];
+        }
+        if (flag != nil && [flag length] > 0) {
+            enabled = OMTruthyFlagValue(flag);
+        } else {
+            id defaultsValue = [[NSUserDefaults standardUserDefaults] objectForKey:@"ObjcMarkdownMathBatch"];
+            if ([defaultsValue respondsToSelector:@selector(boolValue)]) {
+                enabled = [defaultsValue boolValue];
+            }
+        }
+#endif
+    });
+    return enabled;
+}
+
+// Pages of a batch share one TeX run, so a formula that defines macros or
+// assigns globally would change how the formulas after it typeset, and the
+// wrong artifacts would be persisted. Such formulas are compiled on their
+// own; the rest are also wrapped in a group when batched.
+static BOOL OMMathFormulaIsBatchable(NSString *formula)
+{
+    static NSSet *stateChangingCommands = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        stateChangingCommands = [[NSSet alloc] initWithObjects:
+            @"def", @"edef", @"gdef", @"xdef", @"global", @"let", @"futurelet",
+            @"newcommand", @"renewcommand", @"providecommand", @"DeclareMathOperator",
+            @"newenvironment", @"renewenvironment", @"newcounter", @"setcounter",
+            @"addtocounter", @"stepcounter", @"newlength", @"setlength", @"addtolength",
+            @"chardef", @"mathchardef", @"countdef", @"dimendef", @"skipdef", @"toksdef",
+            @"catcode", @"mathcode", @"delcode", @"uccode", @"lccode", @"sfcode",
+            @"everymath", @"everydisplay", @"everyhbox", @"everyvbox", @"everypar",
+            @"aftergroup", @"afterassignment", @"makeatletter", @"makeatother",
+            @"input", @"include", @"usepackage", @"RequirePackage",
+            @"csname", @"expandafter", @"begingroup", @"endgroup",
+            nil];
+    });
+
+    NSUInteger length = [formula length];
+    NSCharacterSet *letters = [NSCharacterSet letterCharacterSet];
+    NSUInteger index = 0;
+    while (index < length) {
+        if ([formula characterAtIndex:index] != '\\') {
+            index += 1;
+            continue;
+        }
+        NSUInteger start = index + 1;
+        NSUInteger end = start;
+        while (end < length && [letters characterIsMember:[formula characterAtIndex:end]]) {
+            end += 1;
+        }
+        if (end > start &&
+            [stateChangingCommands containsObject:[formula substringWithRange:NSMakeRange(start, end - start)]]) {
+            return NO;
+        }
+        // Skips the escaped character of a control symbol such as "\\".
+        index = (end > start ? end : start + 1);
+    }
+    return YES;
+}
+
+static NSUInteger OMMathBatchPageNumberForSVGName(NSString *name)
+{
+    // dvisvgm names pages "<stem>-<page>.svg"; the page may be zero padded.
+    NSString *stem = [name stringByDeletingPathExtension];
+    NSRange dash = [stem rangeOfString:@"-" options:NSBackwardsSearch];
+    if (dash.location == NSNotFound) {
+        return 0;
+    }
+    NSString *digits = [stem substringFromIndex:NSMaxRange(dash)];
+    if ([digits length] == 0 ||
+        [digits rangeOfCharacterFromSet:[[NSCharacterSet decimalDigitCharacterSet] invertedSet]].location != NSNotFound) {
+        return 0;
+    }
+    return (NSUInteger)[digits integerValue];
+}
+
+// Compiles every formula as one page of a single document: one TeX run and
+// one dvisvgm run for the whole batch. Returns SVG data in input order with
+// NSNull for pages that were not produced, or nil when nothing could be
+// compiled. TeX halts at the first formula it cannot typeset but still
+// finishes the DVI for the pages shipped before it, so those are kept.
+// Every formula must pass OMMathFormulaIsBatchable().
+static NSArray *OMSVGDataForMathFormulaBatch(NSArray *formulas,
+                                             NSArray *displayFlags,
+                                             CGFloat renderZoom,
+                                             NSTimeInterval externalToolTimeout,
+                                             OMMathPerfStats *stats)
+{
+    NSUInteger count = [formulas count];
+    if (!OMMathBackendAvailable() ||
+        OMDviSvgmExecutablePath() == nil ||
+        count == 0 ||
+        [displayFlags count] != count) {
+        return nil;
+    }
+
+    NSString *texExecutable = OMLaTeXExecutablePath();
+    BOOL usingLaTeX = texExecutable != nil;
+    if (!usingLaTeX) {
+        texExecutable = OMPlainTexExecutablePath();
+    }
+    if (texExecutable == nil) {
+        return nil;
+    }
+
+    NSString *tempDir = OMCreateMathTempDirectory();
+    if (tempDir == nil) {
+        return nil;
+    }
+
+    NSMutableString *texSource = [NSMutableString string];
+    OMAppendMathTeXPreamble(texSource, usingLaTeX);
+    for (NSUInteger index = 0; index < count; index++) {
+        if (usingLaTeX && index > 0) {
+            [texSource appendString:@"\\clearpage\n"];
+        }
+        // Local assignments end with the page that made them.
+        [texSource appendString:@"\\begingroup\n"];
+        OMAppendMathTeXFormula(texSource,
+                               [formulas objectAtIndex:index],
+                               [[displayFlags objectAtIndex:index] boolValue],
+                               usingLaTeX);
+        [texSource appendString:@"\\endgroup\n"];
+    }
+    OMAppendMathTeXPostamble(texSource, usingLaTeX);
+
+    NSString *texPath = [tempDir stringByAppendingPathComponent:@"formula.tex"];
+    NSString *dviPath = [tempDir stringByAppendingPathComponent:@"formula.dvi"];
+    if (![texSource writeToFile:texPath
+                     atomically:YES
+                       encoding:NSUTF8StringEncoding
+                          error:NULL]) {
+        [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
+        return nil;
+    }
+
+    // A batch pays its startup cost once, so give it the per-formula budget
+    // scaled by size rather than a single formula's timeout.
+    NSTimeInterval batchTimeout = externalToolTimeout > 0.0 ? externalToolTimeout * (NSTimeInterval)count : 0.0;
+    NSArray *texArguments = [NSArray arrayWithObjects:
+        @"-interaction=nonstopmode",
+        @"-halt-on-error",
+        @"-output-directory", @".",
+        @"formula.tex",
+        nil];
+    NSTimeInterval texStart = OMNow();
+    OMRunTask(texExecutable,
+              tempDir,
+              texArguments,
+              NULL,
+              NULL,
+              NULL,
+              batchTimeout);
+    if (stats != NULL) {
+        stats->latexRuns += 1;
+        stats->latexSeconds += (OMNow() - texStart);
+    }
+    if (![[NSFileManager defaultManager] fileExistsAtPath:dviPath]) {
+        [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
+        return nil;
+    }
+
+    if (renderZoom < 0.5) {
+        renderZoom = 0.5;
+    } else if (renderZoom > 10.0) {
+        renderZoom = 10.0;
+    }
+    NSArray *svgArguments = [NSArray arrayWithObjects:
+        @"--no-fonts",
+        @"--exact-bbox",
+        [NSString stringWithFormat:@"--zoom=%.3f", renderZoom],
+        @"--page=1-",
+        @"--output=formula-%p.svg",
+        @"formula.dvi",
+        nil];
+    NSTimeInterval svgStart = OMNow();
+    BOOL svgOK = OMRunTask(OMDviSvgmExecutablePath(),
+                           tempDir,
+                           svgArguments,
+                           NULL,
+                           NULL,
+                           NULL,
+                           batchTimeout);
+    if (stats != NULL) {
+        stats->dvisvgmRuns += 1;
+        stats->dvisvgmSeconds += (OMNow() - svgStart);
+    }
+
+    NSMutableArray *pages = nil;
+    if (svgOK) {
+        pages = [NSMutableArray arrayWithCapacity:count];
+        for (NSUInteger index = 0; index < count; index++) {
+            [pages addObject:[NSNull null]];
+        }
+        NSArray *names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:tempDir error:NULL];
+        for (NSString *name in names) {
+            if (![[[name pathExtension] lowercaseString] isEqualToString:@"svg"]) {
+                continue;
+            }
+            NSUInteger page = OMMathBatchPageNumberForSVGName(name);
+            if (page == 0 || page > count) {
+                pages = nil;
+                break;
+            }
+            NSData *data = [NSData dataWithContentsOfFile:[tempDir stringByAppendingPathComponent:name]];
+            if (data == nil || [data length] == 0) {
+                pages = nil;
+                break;
+            }
+            [pages replaceObjectAtIndex:(page - 1) withObject:data];
+        }
+    }
+    [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
+    return pages;
+}
+
+static void OMFinishMathAssetJob(NSDictionary *job)
+{
+    NSMutableSet *pending = OMMathPendingAssetKeys();
+    @synchronized (pending) {
+        [pending removeObject:[job objectForKey:@"assetKey"]];
+    }
+    OMFinishRenderArtifact([job objectForKey:@"assetKey"]);
+}
+
+static void OMStoreMathAssetJobResult(NSDictionary *job, NSData *svgData)
+{
+    if (svgData != nil) {
+        [OMMathBaseSVGDataCache() setObject:svgData forKey:[job objectForKey:@"assetKey"]];
+    }
+    OMFinishMathAssetJob(job);
+}
+
+// Jobs in one batch share render zoom and timeout (see the grouping in
+// OMFlushPendingMathBatch). Pages the batch produced are kept. The first
+// formula still missing is where TeX halted, so it is set aside and the
+// formulas after it are batched again; whatever is left after
+// OMMathBatchMaximumRuns, including the set-aside formulas, is compiled
+// one at a time.
+static void OMRunMathAssetBatch(NSArray *jobs)
+{
+    NSUInteger count = [jobs count];
+    if (count == 0) {
+        return;
+    }
+    OM_PERF_TRACE_SCOPE("math", "math-batch");
+    OMPerfTraceCounter("math", "math-batch-size", (int64_t)count);
+
+    NSDictionary *firstJob = [jobs objectAtIndex:0];
+    CGFloat renderZoom = (CGFloat)[[firstJob objectForKey:@"renderZoom"] doubleValue];
+    NSTimeInterval externalToolTimeout = [[firstJob objectForKey:@"timeout"] doubleValue];
+    OMMathPerfStats stats = {0};
+    NSTimeInterval batchStart = OMNow();
+    NSUInteger produced = 0;
+    NSUInteger fallbackCount = 0;
+
+    NSMutableArray *unbatched = [NSMutableArray array];
+    NSArray *remaining = jobs;
+    NSUInteger batchRuns = 0;
+    while ([remaining count] > 1 && batchRuns < OMMathBatchMaximumRuns) {
+        NSUInteger remainingCount = [remaining count];
+        NSMutableArray *formulas = [NSMutableArray arrayWithCapacity:remainingCount];
+        NSMutableArray *displayFlags = [NSMutableArray arrayWithCapacity:remainingCount];
+        for (NSDictionary *job in remaining) {
+            [formulas addObject:[job objectForKey:@"formula"]];
+            [displayFlags addObject:[job objectForKey:@"displayMath"]];
+        }
+        NSArray *pages = OMSVGDataForMathFormulaBatch(formulas,
+                                                      displayFlags,
+                                                      renderZoom,
+                                                      externalToolTimeout,
+                                                      &stats);
+        batchRuns += 1;
+        if (pages == nil) {
+            break;
+        }
+
+        NSMutableArray *missing = [NSMutableArray array];
+        for (NSUInteger index = 0; index < remainingCount; index++) {
+            NSDictionary *job = [remaining objectAtIndex:index];
+            id page = [pages objectAtIndex:index];
+            if (page == [NSNull null]) {
+                [missing addObject:job];
+                continue;
+            }
+            OMMathDiskCacheStoreData(page, [job objectForKey:@"assetKey"], @"svg");
+            OMStoreMathAssetJobResult(job, page);
+            produced += 1;
+        }
+        if ([missing count] > 0) {
+            [unbatched addObject:[missing objectAtIndex:0]];
+            [missing removeObjectAtIndex:0];
+        }
+        remaining = missing;
+    }
+    [unbatched addObjectsFromArray:remaining];
+
+    for (NSDictionary *job in unbatched) {
+        if (count > 1) {
+            fallbackCount += 1;
+        }
+        NSData *svgData = OMSVGDataForMathFormula([job objectForKey:@"formula"],
+                                                  [[job objectForKey:@"displayMath"] boolValue],
+                                                  renderZoom,
+                                                  [[job objectForKey:@"maximumFormulaLength"] unsignedIntegerValue],
+                                                  externalToolTimeout,
+                                                  &stats);
+        OMStoreMathAssetJobResult(job, svgData);
+        if (svgData != nil) {
+            produced += 1;
+        }
+    }
+
+    if (produced > 0) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [[NSNotificationCenter defaultCenter]
+                postNotificationName:OMMarkdownRendererMathArtifactsDidWarmNotification
+                              object:nil];
+        });
+    }
+
+    if (OMPerformanceLoggingEnabled()) {
+        // Two processes per formula when compiled one at a time.
+        NSUInteger processRuns = stats.latexRuns + stats.dvisvgmRuns;
+        NSUInteger unbatchedRuns = count * 2;
+        NSLog(@"[Perf][Renderer] math-batch size=%lu ok=%lu batches=%lu fallback=%lu processes=%lu saved=%ld zoom=%.2f total=%.1fms latex=%lums/%lu dvisvgm=%lums/%lu",
+              (unsigned long)count,
+              (unsigned long)produced,
+              (unsigned long)batchRuns,
+              (unsigned long)fallbackCount,
+              (unsigned long)processRuns,
+              (long)unbatchedRuns - (long)processRuns,
+              renderZoom,
+              (OMNow() - batchStart) * 1000.0,
+              (unsigned long)(stats.latexSeconds * 1000.0 + 0.5),
+              (unsigned long)stats.latexRuns,
+              (unsigned long)(stats.dvisvgmSeconds * 1000.0 + 0.5),
+              (unsigned long)stats.dvisvgmRuns);
     }
-    if (!texOK || ![[NSFileManager defaultManager] fileExistsAtPath:dviPath]) {
-        [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
-        return nil;
+}
+
+static NSMutableArray *OMMathPendingBatchJobs(void)
+{
+    static NSMutableArray *jobs = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        jobs = [[NSMutableArray alloc] init];
+    });
+    return jobs;
+}
+
+static BOOL OMMathBatchFlushScheduled = NO;
+
+static void OMFlushPendingMathBatch(void)
+{
+    NSArray *jobs = nil;
+    NSMutableArray *pendingJobs = OMMathPendingBatchJobs();
+    @synchronized (pendingJobs) {
+        jobs = [[pendingJobs copy] autorelease];
+        [pendingJobs removeAllObjects];
+        OMMathBatchFlushScheduled = NO;
     }
 
-    if (renderZoom < 0.5) {
-        renderZoom = 0.5;
-    } else if (renderZoom > 10.0) {
-        renderZoom = 10.0;
+    NSMutableDictionary *groups = [NSMutableDictionary dictionary];
+    NSMutableArray *groupOrder = [NSMutableArray array];
+    NSMutableArray *batches = [NSMutableArray array];
+    for (NSDictionary *job in jobs) {
+        if (!OMMathFormulaIsBatchable([job objectForKey:@"formula"])) {
+            [batches addObject:[NSArray arrayWithObject:job]];
+            continue;
+        }
+        NSString *groupKey = [NSString stringWithFormat:@"%.2f|%.3f",
+                              [[job objectForKey:@"renderZoom"] doubleValue],
+                              [[job objectForKey:@"timeout"] doubleValue]];
+        NSMutableArray *group = [groups objectForKey:groupKey];
+        if (group == nil) {
+            group = [NSMutableArray array];
+            [groups setObject:group forKey:groupKey];
+            [groupOrder addObject:groupKey];
+        }
+        [group addObject:job];
     }
-    NSString *zoomArgument = [NSString stringWithFormat:@"--zoom=%.3f", renderZoom];
 
-    NSArray *svgArguments = [NSArray arrayWithObjects:
-        @"--no-fonts",
-        @"--exact-bbox",
-        zoomArgument,
-        @"--stdout",
-        @"formula.dvi",
-        nil];
-    NSData *svgData = nil;
-    int svgStatus = 0;
-    NSTimeInterval svgStart = OMNow();
-    BOOL svgOK = OMRunTask(OMDviSvgmExecutablePath(),
-                           tempDir,
-                           svgArguments,
-                           &svgData,
-                           NULL,
-                           &svgStatus,
-                           externalToolTimeout);
-    if (stats != NULL) {
-        stats->dvisvgmRuns += 1;
-        stats->dvisvgmSeconds += (OMNow() - svgStart);
+    for (NSString *groupKey in groupOrder) {
+        NSArray *group = [groups objectForKey:groupKey];
+        NSUInteger groupCount = [group count];
+        for (NSUInteger start = 0; start < groupCount; start += OMMathBatchMaximumSize) {
+            NSUInteger length = MIN(OMMathBatchMaximumSize, groupCount - start);
+            [batches addObject:[group subarrayWithRange:NSMakeRange(start, length)]];
+        }
     }
-    [[NSFileManager defaultManager] removeItemAtPath:tempDir error:NULL];
 
-    if (!svgOK || svgData == nil || [svgData length] == 0) {
-        return nil;
+    for (NSArray *batchJobs in batches) {
+        NSArray *batch = [batchJobs retain];
+        [OMMathArtifactWorkQueue() addWork:^{
+            @try {
+                OMRunMathAssetBatch(batch);
+            } @finally {
+                [batch release];
+            }
+        }];
     }
-    return svgData;
 }
 
 static void OMScheduleAsyncMathAssetGeneration(NSString *formula,
                                                BOOL displayMath,
                                                CGFloat renderZoom,
                                                NSUInteger maximumFormulaLength,
-                                               NSTimeInterval externalToolTimeout)
+                                               NSTimeInterval externalToolTimeout,
+                                               const OMRenderContext *renderContext)
 {
     if (!OMMathBackendAvailable() ||
         formula == nil ||
@@ -4787,6 +7442,7 @@ static void OMScheduleAsyncMathAssetGeneration(NSString *formula,
     BOOL shouldSchedule = NO;
     NSMutableSet *pending = OMMathPendingAssetKeys();
     @synchronized (pending) {
+        OMRegisterRenderArtifactWait(assetKey, renderContext);
         if (![pending containsObject:assetKey]) {
             [pending addObject:assetKey];
             shouldSchedule = YES;
@@ -4795,37 +7451,65 @@ static void OMScheduleAsyncMathAssetGeneration(NSString *formula,
     if (!shouldSchedule) {
         return;
     }
+
+    if (OMMathBatchingEnabled()) {
+        NSDictionary *job = [NSDictionary dictionaryWithObjectsAndKeys:
+            [[formula copy] autorelease], @"formula",
+            [NSNumber numberWithBool:displayMath], @"displayMath",
+            [NSNumber numberWithDouble:renderZoom], @"renderZoom",
+            [NSNumber numberWithUnsignedInteger:maximumFormulaLength], @"maximumFormulaLength",
+            [NSNumber numberWithDouble:externalToolTimeout], @"timeout",
+            [[assetKey copy] autorelease], @"assetKey",
+            nil];
+        BOOL scheduleFlush = NO;
+        NSMutableArray *pendingJobs = OMMathPendingBatchJobs();
+        @synchronized (pendingJobs) {
+            [pendingJobs addObject:job];
+            if (!OMMathBatchFlushScheduled) {
+                OMMathBatchFlushScheduled = YES;
+                scheduleFlush = YES;
+            }
+        }
+        if (scheduleFlush) {
+            // Collect formulas from the rest of this render before compiling.
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(OMMathBatchCollectionWindow * NSEC_PER_SEC)),
+                           OMMathArtifactQueue(),
+                           ^{
+                @autoreleasepool {
+                    OMFlushPendingMathBatch();
+                }
+            });
+        }
+        return;
+    }
 
     NSString *formulaCopy = [formula copy];
     NSString *assetKeyCopy = [assetKey copy];
-    dispatch_async(OMMathArtifactQueue(), ^{
-        dispatch_semaphore_wait(OMMathArtifactSemaphore(), DISPATCH_TIME_FOREVER);
-        @autoreleasepool {
-            @try {
-                NSData *svgData = OMSVGDataForMathFormula(formulaCopy,
-                                                          displayMath,
-                                                          renderZoom,
-                                                          maximumFormulaLength,
-                                                          externalToolTimeout,
-                                                          NULL);
-                if (svgData != nil) {
-                    [OMMathBaseSVGDataCache() setObject:svgData forKey:assetKeyCopy];
-                    dispatch_async(dispatch_get_main_queue(), ^{
-                        [[NSNotificationCenter defaultCenter]
-                            postNotificationName:OMMarkdownRendererMathArtifactsDidWarmNotification
-                                          object:nil];
-                    });
-                }
-            } @finally {
-                @synchronized (pending) {
-                    [pending removeObject:assetKeyCopy];
-                }
-                [formulaCopy release];
-                [assetKeyCopy release];
-                dispatch_semaphore_signal(OMMathArtifactSemaphore());
+    [OMMathArtifactWorkQueue() addWork:^{
+        @try {
+            NSData *svgData = OMSVGDataForMathFormula(formulaCopy,
+                                                      displayMath,
+                                                      renderZoom,
+                                                      maximumFormulaLength,
+                                                      externalToolTimeout,
+                                                      NULL);
+            if (svgData != nil) {
+                [OMMathBaseSVGDataCache() setObject:svgData forKey:assetKeyCopy];
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    [[NSNotificationCenter defaultCenter]
+                        postNotificationName:OMMarkdownRendererMathArtifactsDidWarmNotification
+                                      object:nil];
+                });
             }
+        } @finally {
+            @synchronized (pending) {
+                [pending removeObject:assetKeyCopy];
+            }
+            OMFinishRenderArtifact(assetKeyCopy);
+            [formulaCopy release];
+            [assetKeyCopy release];
         }
-    });
+    }];
 }
 
 static NSAttributedString *OMMathAttachmentAttributedString(NSString *formula,
@@ -4840,6 +7524,7 @@ static NSAttributedString *OMMathAttachmentAttributedString(NSString *formula,
     }
 
     OMLogMathBackendStateIfNeeded();
+    OM_PERF_TRACE_SCOPE("math", "math");
 
     OMMathPerfStats *stats = renderContext != NULL ? renderContext->mathPerfStats : NULL;
     if (stats != NULL) {
@@ -4903,7 +7588,21 @@ static NSAttributedString *OMMathAttachmentAttributedString(NSString *formula,
         if (stats != NULL) {
             stats->mathAssetCacheMisses += 1;
         }
-        if (asyncMathGenerationEnabled) {
+        NSString *diskPath = OMMathDiskCacheExistingPath(assetKey, @"png");
+        if (diskPath != nil) {
+            baseImage = OMWindowsImageFromPNGFile(diskPath);
+        }
+        if (stats != NULL && OMMathDiskCacheEnabled()) {
+            if (baseImage != nil) {
+                stats->mathDiskCacheHits += 1;
+            } else {
+                stats->mathDiskCacheMisses += 1;
+            }
+        }
+        if (baseImage != nil) {
+            [OMMathBaseImageCache() setObject:baseImage forKey:assetKey];
+            OMRecordBestAvailableMathImage(formula, displayMath, renderZoom, baseImage);
+        } else if (asyncMathGenerationEnabled) {
             CGFloat fallbackRenderZoom = 0.0;
             NSImage *fallbackImage = OMBestAvailableMathImage(formula, displayMath, &fallbackRenderZoom);
             if (fallbackImage != nil) {
@@ -4914,9 +7613,18 @@ static NSAttributedString *OMMathAttachmentAttributedString(NSString *formula,
                     stats->mathAssetCacheHits += 1;
                 }
             }
+        } else {
+            CGFloat sharperRenderZoom = 0.0;
+            baseImage = OMSharperCachedMathImage(formula, displayMath, renderZoom, &sharperRenderZoom);
+            if (baseImage != nil) {
+                imageRenderZoom = sharperRenderZoom;
+                if (stats != NULL) {
+                    stats->mathAssetCacheHits += 1;
+                }
+            }
         }
 
-        if (!usedFallbackImage) {
+        if (baseImage == nil) {
             baseImage = OMPNGImageForMathFormula(formula,
                                                  displayMath,
                                                  renderZoom,
@@ -4949,12 +7657,25 @@ static NSAttributedString *OMMathAttachmentAttributedString(NSString *formula,
                 stats->mathAssetCacheMisses += 1;
             }
 
-            if (asyncMathGenerationEnabled) {
+            // Disk reads are cheap next to a TeX run, so try them inline even
+            // when generation itself would be deferred.
+            svgData = OMMathDiskCacheDataForAssetKey(assetKey, @"svg");
+            if (stats != NULL && OMMathDiskCacheEnabled()) {
+                if (svgData != nil) {
+                    stats->mathDiskCacheHits += 1;
+                } else {
+                    stats->mathDiskCacheMisses += 1;
+                }
+            }
+            if (svgData != nil) {
+                [OMMathBaseSVGDataCache() setObject:svgData forKey:assetKey];
+            } else if (asyncMathGenerationEnabled) {
                 OMScheduleAsyncMathAssetGeneration(formula,
                                                    displayMath,
                                                    renderZoom,
                                                    maxFormulaLength,
-                                                   externalToolTimeout);
+                                                   externalToolTimeout,
+                                                   renderContext);
                 CGFloat fallbackRenderZoom = 0.0;
                 NSImage *fallbackImage = OMBestAvailableMathImage(formula, displayMath, &fallbackRenderZoom);
                 if (fallbackImage != nil) {
@@ -4967,9 +7688,18 @@ static NSAttributedString *OMMathAttachmentAttributedString(NSString *formula,
                 } else {
                     return nil;
                 }
+            } else {
+                CGFloat sharperRenderZoom = 0.0;
+                baseImage = OMSharperCachedMathImage(formula, displayMath, renderZoom, &sharperRenderZoom);
+                if (baseImage != nil) {
+                    imageRenderZoom = sharperRenderZoom;
+                    if (stats != NULL) {
+                        stats->mathAssetCacheHits += 1;
+                    }
+                }
             }
 
-            if (!usedFallbackImage) {
+            if (baseImage == nil && svgData == nil) {
                 svgData = OMSVGDataForMathFormula(formula,
                                                   displayMath,
                                                   renderZoom,
@@ -5050,6 +7780,60 @@ static NSAttributedString *OMMathAttachmentAttributedString(NSString *formula,
     return immutable;
 }
 
+// The math span opened by the unescaped dollar at dollarLocation: $$...$$
+// display math, or $...$ inline math whose closing dollar follows a
+// non-space and is not followed by a digit. Returns the index just past the
+// span, or NSNotFound when the dollar is literal.
+static NSUInteger OMMathSpanAtDollar(NSString *text,
+                                     NSUInteger dollarLocation,
+                                     NSString **formulaOut,
+                                     BOOL *displayMathOut)
+{
+    NSUInteger length = [text length];
+    BOOL isDisplayStart = (dollarLocation + 1 < length &&
+                           [text characterAtIndex:dollarLocation + 1] == '$');
+
+    if (isDisplayStart) {
+        NSUInteger contentStart = dollarLocation + 2;
+        NSUInteger i = contentStart;
+        while (i + 1 < length) {
+            if ([text characterAtIndex:i] == '$' &&
+                [text characterAtIndex:i + 1] == '$' &&
+                !OMDollarIsEscaped(text, i)) {
+                if (i > contentStart) {
+                    *formulaOut = [text substringWithRange:NSMakeRange(contentStart, i - contentStart)];
+                    *displayMathOut = YES;
+                    return i + 2;
+                }
+                return NSNotFound;
+            }
+            i += 1;
+        }
+    } else if (dollarLocation + 1 < length &&
+               !OMCharacterIsWhitespaceOrNewline([text characterAtIndex:dollarLocation + 1])) {
+        NSUInteger i = dollarLocation + 1;
+        while (i < length) {
+            if ([text characterAtIndex:i] == '$' && !OMDollarIsEscaped(text, i)) {
+                BOOL precededByWhitespace = (i == 0) ? YES : OMCharacterIsWhitespaceOrNewline([text characterAtIndex:i - 1]);
+                BOOL followedByDigit = (i + 1 < length) ? OMCharacterIsDigit([text characterAtIndex:i + 1]) : NO;
+                BOOL adjacentToDollar = (i > 0 && [text characterAtIndex:i - 1] == '$') ||
+                                        (i + 1 < length && [text characterAtIndex:i + 1] == '$');
+                if (!precededByWhitespace && !followedByDigit && !adjacentToDollar) {
+                    NSString *formula = [text substringWithRange:NSMakeRange(dollarLocation + 1, i - (dollarLocation + 1))];
+                    if ([formula length] == 0) {
+                        return NSNotFound;
+                    }
+                    *formulaOut = formula;
+                    *displayMathOut = NO;
+                    return i + 1;
+                }
+            }
+            i += 1;
+        }
+    }
+    return NSNotFound;
+}
+
 static void OMAppendTextWithMathSpans(NSString *text,
                                       OMTheme *theme,
                                       NSMutableAttributedString *output,
@@ -5085,69 +7869,34 @@ static void OMAppendTextWithMathSpans(NSString *text,
             OMAppendString(output, [text substringWithRange:NSMakeRange(cursor, dollarLocation - cursor)], attributes);
         }
 
-        BOOL renderedMath = NO;
-        BOOL isDisplayStart = (dollarLocation + 1 < length &&
-                               [text characterAtIndex:dollarLocation + 1] == '$');
-
-        if (isDisplayStart) {
-            NSUInteger contentStart = dollarLocation + 2;
-            NSUInteger i = contentStart;
-            while (i + 1 < length) {
-                if ([text characterAtIndex:i] == '$' &&
-                    [text characterAtIndex:i + 1] == '$' &&
-                    !OMDollarIsEscaped(text, i)) {
-                    if (i > contentStart) {
-                        NSString *formula = [text substringWithRange:NSMakeRange(contentStart, i - contentStart)];
-                        OMAppendDisplayMathFormula(formula,
-                                                   theme,
-                                                   output,
-                                                   attributes,
-                                                   scale,
-                                                   renderContext);
-                        renderedMath = YES;
-                        cursor = i + 2;
-                    }
-                    break;
-                }
-                i += 1;
-            }
-        } else if (dollarLocation + 1 < length &&
-                   !OMCharacterIsWhitespaceOrNewline([text characterAtIndex:dollarLocation + 1])) {
-            NSUInteger i = dollarLocation + 1;
-            while (i < length) {
-                if ([text characterAtIndex:i] == '$' && !OMDollarIsEscaped(text, i)) {
-                    BOOL precededByWhitespace = (i == 0) ? YES : OMCharacterIsWhitespaceOrNewline([text characterAtIndex:i - 1]);
-                    BOOL followedByDigit = (i + 1 < length) ? OMCharacterIsDigit([text characterAtIndex:i + 1]) : NO;
-                    BOOL adjacentToDollar = (i > 0 && [text characterAtIndex:i - 1] == '$') ||
-                                            (i + 1 < length && [text characterAtIndex:i + 1] == '$');
-                    if (!precededByWhitespace && !followedByDigit && !adjacentToDollar) {
-                        NSString *formula = [text substringWithRange:NSMakeRange(dollarLocation + 1, i - (dollarLocation + 1))];
-                        if ([formula length] > 0) {
-                            NSAttributedString *attachment = OMMathAttachmentAttributedString(formula,
-                                                                                               theme,
-                                                                                               attributes,
-                                                                                               scale,
-                                                                                               NO,
-                                                                                               renderContext);
-                            if (attachment != nil) {
-                                OMAppendAttributedSegment(output, attachment);
-                            } else {
-                                NSDictionary *mathAttrs = OMMathAttributes(theme, attributes, scale, NO);
-                                OMAppendString(output, OMReadableMathFallbackString(formula), mathAttrs);
-                            }
-                            renderedMath = YES;
-                            cursor = i + 1;
-                        }
-                        break;
-                    }
-                }
-                i += 1;
-            }
-        }
-
-        if (!renderedMath) {
+        NSString *formula = nil;
+        BOOL displayMath = NO;
+        NSUInteger spanEnd = OMMathSpanAtDollar(text, dollarLocation, &formula, &displayMath);
+        if (spanEnd == NSNotFound) {
             OMAppendString(output, @"$", attributes);
             cursor = dollarLocation + 1;
+        } else if (displayMath) {
+            OMAppendDisplayMathFormula(formula,
+                                       theme,
+                                       output,
+                                       attributes,
+                                       scale,
+                                       renderContext);
+            cursor = spanEnd;
+        } else {
+            NSAttributedString *attachment = OMMathAttachmentAttributedString(formula,
+                                                                               theme,
+                                                                               attributes,
+                                                                               scale,
+                                                                               NO,
+                                                                               renderContext);
+            if (attachment != nil) {
+                OMAppendAttributedSegment(output, attachment);
+            } else {
+                NSDictionary *mathAttrs = OMMathAttributes(theme, attributes, scale, NO);
+                OMAppendString(output, OMReadableMathFallbackString(formula), mathAttrs);
+            }
+            cursor = spanEnd;
         }
     }
 }
@@ -5343,17 +8092,495 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
         } else {
             return NULL;
         }
-        cursor = cmark_node_next(cursor);
+        cursor = cmark_node_next(cursor);
+    }
+
+    return NULL;
+}
+
+// Queues the asset of one formula as OMMathAttachmentAttributedString would
+// ask for it at fontSize, unless it is already in memory or on disk.
+static void OMQueueMathAsset(NSString *formula,
+                             BOOL displayMath,
+                             CGFloat fontSize,
+                             const OMRenderContext *renderContext)
+{
+#if defined(_WIN32)
+    // dvipng images are generated in line; there is nothing to queue.
+    (void)formula;
+    (void)displayMath;
+    (void)fontSize;
+    (void)renderContext;
+#else
+    if (!OMExternalMathRenderingEnabled(renderContext) || [formula length] == 0) {
+        return;
+    }
+    CGFloat renderZoom = OMMathQuantizedRenderZoom(OMMathZoomForFontSize(fontSize),
+                                                   OMMathRasterOversampleFactor());
+    NSString *assetKey = OMMathAssetCacheKey(formula, displayMath, renderZoom);
+    if ([OMMathBaseImageCache() objectForKey:assetKey] != nil ||
+        [OMMathBaseSVGDataCache() objectForKey:assetKey] != nil ||
+        OMMathDiskCacheExistingPath(assetKey, @"svg") != nil) {
+        return;
+    }
+    OMScheduleAsyncMathAssetGeneration(formula,
+                                       displayMath,
+                                       renderZoom,
+                                       OMMathMaximumFormulaLength(renderContext),
+                                       OMExternalToolTimeout(renderContext),
+                                       renderContext);
+#endif
+}
+
+// Queues the load of one image at the size the render will show it, unless
+// the prepared image is already in memory or on disk. Local images whose
+// header cannot be probed are left to the render.
+static void OMQueueImageAsset(cmark_node *imageNode,
+                              CGFloat scale,
+                              const OMRenderContext *renderContext)
+{
+    NSString *cacheKey = nil;
+    NSURL *url = OMImageNodeURLAndCacheKey(imageNode, scale, renderContext, &cacheKey);
+    if (url == nil) {
+        return;
+    }
+    CGFloat layoutWidth = renderContext != NULL ? renderContext->layoutWidth : 0.0;
+    if (OMURLUsesRemoteScheme(url)) {
+        if (OMShouldAllowRemoteImages(renderContext)) {
+            OMScheduleAsyncImageLoad(url, nil, nil, cacheKey, scale, layoutWidth, renderContext);
+        }
+        return;
+    }
+
+    NSString *path = [url path];
+    NSDictionary *fileAttributes = ([path length] > 0 ?
+                                    [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL] :
+                                    nil);
+    NSSize naturalSize = NSZeroSize;
+    if (fileAttributes == nil || !OMProbeImageFileDimensions(path, &naturalSize)) {
+        return;
+    }
+    NSString *diskKey = OMImageDiskCacheKey(path,
+                                            fileAttributes,
+                                            OMPreparedImageSize(naturalSize, scale, layoutWidth));
+    NSString *diskPath = [OMImageDiskCache() pathForKey:diskKey extension:@"png"];
+    if (diskPath != nil && [[NSFileManager defaultManager] fileExistsAtPath:diskPath]) {
+        return;
+    }
+    OMScheduleAsyncImageLoad(url, path, diskKey, cacheKey, scale, layoutWidth, renderContext);
+}
+
+static void OMCollectInlineAssets(cmark_node *node,
+                                  CGFloat fontSize,
+                                  CGFloat scale,
+                                  const OMRenderContext *renderContext)
+{
+    BOOL parseMath = OMShouldParseMathSpans(renderContext);
+    cmark_node *child = cmark_node_first_child(node);
+    while (child != NULL) {
+        cmark_node_type type = cmark_node_get_type(child);
+        if (type == CMARK_NODE_TEXT && parseMath) {
+            if (OMTextNodeIsDisplayMathFence(child)) {
+                cmark_node *closing = cmark_node_next(child);
+                while (closing != NULL && !OMTextNodeIsDisplayMathFence(closing)) {
+                    closing = cmark_node_next(closing);
+                }
+                NSString *formula = closing != NULL ? OMRawDisplayMathFormulaFromNodes(child, closing, renderContext) : nil;
+                if ([formula length] > 0) {
+                    OMQueueMathAsset(formula, YES, fontSize, renderContext);
+                    child = cmark_node_next(closing);
+                    continue;
+                }
+            }
+            const char *literal = cmark_node_get_literal(child);
+            NSString *text = literal != NULL ? [NSString stringWithUTF8String:literal] : nil;
+            NSUInteger length = [text length];
+            NSUInteger cursor = 0;
+            while (cursor < length) {
+                NSRange dollar = [text rangeOfString:@"$" options:NSLiteralSearch range:NSMakeRange(cursor, length - cursor)];
+                if (dollar.location == NSNotFound) {
+                    break;
+                }
+                NSString *formula = nil;
+                BOOL displayMath = NO;
+                NSUInteger spanEnd = NSNotFound;
+                if (!OMDollarIsEscaped(text, dollar.location)) {
+                    spanEnd = OMMathSpanAtDollar(text, dollar.location, &formula, &displayMath);
+                }
+                if (spanEnd == NSNotFound) {
+                    cursor = dollar.location + 1;
+                } else {
+                    OMQueueMathAsset(formula, displayMath, fontSize, renderContext);
+                    cursor = spanEnd;
+                }
+            }
+        } else if (type == CMARK_NODE_IMAGE) {
+            if (OMShouldRenderImages(renderContext)) {
+                OMQueueImageAsset(child, scale, renderContext);
+            }
+        } else if (type != CMARK_NODE_CODE &&
+                   type != CMARK_NODE_HTML_INLINE &&
+                   type != CMARK_NODE_TEXT) {
+            OMCollectInlineAssets(child, fontSize, scale, renderContext);
+        }
+        child = cmark_node_next(child);
+    }
+}
+
+// Walks the blocks the way OMRenderBlocks does and queues the math and
+// images a render at this scale and width will ask for, without building
+// any text. Fenced display math consumes its source lines as it does in
+// the render. Tables are skipped; their cells are laid out on the main
+// thread and take their assets synchronously.
+static void OMCollectBlockAssets(cmark_node *node,
+                                 OMTheme *theme,
+                                 CGFloat scale,
+                                 const OMRenderContext *renderContext)
+{
+    CGFloat baseFontSize = (theme.baseFont != nil ? [theme.baseFont pointSize] : 14.0) * scale;
+    cmark_node_type type = cmark_node_get_type(node);
+    NSUInteger startLine = 0;
+    if (OMNodeLineBounds(node, &startLine, NULL)) {
+        if (OMDisplayMathLineAlreadyConsumed(startLine, renderContext)) {
+            return;
+        }
+        NSUInteger endFenceLine = 0;
+        NSString *formula = nil;
+        if (OMShouldParseMathSpans(renderContext) &&
+            type != CMARK_NODE_DOCUMENT &&
+            type != CMARK_NODE_LIST &&
+            type != CMARK_NODE_ITEM &&
+            type != CMARK_NODE_BLOCK_QUOTE &&
+            OMDisplayMathFenceRangeStartingAtLine(renderContext->sourceLines, startLine, &endFenceLine, &formula)) {
+            OMQueueMathAsset(formula, YES, baseFontSize, renderContext);
+            OMConsumeDisplayMathLineRange(startLine, endFenceLine, renderContext);
+            return;
+        }
+    }
+
+    switch (type) {
+        case CMARK_NODE_PARAGRAPH:
+            if (!OMPipeTableDataForParagraphNode(node, renderContext, NULL, NULL)) {
+                OMCollectInlineAssets(node, baseFontSize, scale, renderContext);
+            }
+            return;
+        case CMARK_NODE_HEADING: {
+            NSDictionary *headingStyle = OMHeadingAttributes(theme, (NSUInteger)cmark_node_get_heading_level(node), scale);
+            NSFont *font = [headingStyle objectForKey:NSFontAttributeName];
+            OMCollectInlineAssets(node, font != nil ? [font pointSize] : baseFontSize, scale, renderContext);
+            return;
+        }
+        case CMARK_NODE_CODE_BLOCK:
+        case CMARK_NODE_THEMATIC_BREAK:
+        case CMARK_NODE_HTML_BLOCK:
+        case CMARK_NODE_CUSTOM_BLOCK:
+            return;
+        default:
+            break;
+    }
+
+    cmark_node *child = cmark_node_first_child(node);
+    for (; child != NULL; child = cmark_node_next(child)) {
+        OMCollectBlockAssets(child, theme, scale, renderContext);
+    }
+}
+
+// A rendered top-level block kept between incremental renders. Ranges and
+// anchor targets are relative to the start of the fragment; anchor source
+// lines are stored as offsets from the block's first source line.
+@interface OMRenderedBlockFragment : NSObject
+@property (nonatomic, retain) NSAttributedString *content;
+@property (nonatomic, retain) NSArray *codeRanges;
+@property (nonatomic, retain) NSArray *blockquoteRanges;
+@property (nonatomic, retain) NSArray *anchors;
+@end
+
+@implementation OMRenderedBlockFragment
+
+@synthesize content = _content;
+@synthesize codeRanges = _codeRanges;
+@synthesize blockquoteRanges = _blockquoteRanges;
+@synthesize anchors = _anchors;
+
+- (void)dealloc
+{
+    [_content release];
+    [_codeRanges release];
+    [_blockquoteRanges release];
+    [_anchors release];
+    [super dealloc];
+}
+
+@end
+
+// Exact-source counterpart of OMStableBlockIDForTypeAndLineRange. The stable
+// ID normalizes away punctuation, so it is fine for scroll sync but cannot
+// decide whether a rendered fragment is still valid.
+static NSString *OMBlockFragmentCacheKeyForLineRange(cmark_node_type nodeType,
+                                                     NSArray *sourceLines,
+                                                     NSUInteger startLine,
+                                                     NSUInteger endLine)
+{
+    NSUInteger count = [sourceLines count];
+    if (count == 0 || startLine == 0 || startLine > count) {
+        return nil;
+    }
+    if (endLine < startLine) {
+        endLine = startLine;
+    }
+    if (endLine > count) {
+        endLine = count;
+    }
+
+    NSMutableString *key = [NSMutableString stringWithFormat:@"%d|", (int)nodeType];
+    NSUInteger line = startLine;
+    for (; line <= endLine; line++) {
+        if (line > startLine) {
+            [key appendString:@"\n"];
+        }
+        [key appendString:[sourceLines objectAtIndex:line - 1]];
+    }
+    return key;
+}
+
+// Raw display math can consume source lines past the node that opened it, and
+// whether it does depends on fences further down the document. Blocks that
+// touch a fence are therefore always rendered fresh.
+static BOOL OMLineRangeContainsDisplayMathFence(NSArray *sourceLines,
+                                                NSUInteger startLine,
+                                                NSUInteger endLine)
+{
+    NSUInteger line = startLine;
+    for (; line <= endLine; line++) {
+        if (OMSourceLineMatchesDisplayMathFence(sourceLines, line)) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// Link reference definitions change how every paragraph that uses them
+// renders, so they are part of the fragment cache environment.
+static NSString *OMLinkReferenceDefinitionsFingerprint(NSArray *sourceLines)
+{
+    NSMutableString *fingerprint = [NSMutableString string];
+    for (NSString *line in sourceLines) {
+        NSUInteger length = [line length];
+        NSUInteger index = 0;
+        while (index < length && index < 3 && [line characterAtIndex:index] == ' ') {
+            index += 1;
+        }
+        if (index >= length || [line characterAtIndex:index] != '[') {
+            continue;
+        }
+        if ([line rangeOfString:@"]:"].location == NSNotFound) {
+            continue;
+        }
+        [fingerprint appendString:line];
+        [fingerprint appendString:@"\n"];
     }
+    return fingerprint;
+}
 
-    return NULL;
+static NSString *OMParsingOptionsFingerprint(OMMarkdownParsingOptions *options)
+{
+    if (options == nil) {
+        return @"";
+    }
+    NSString *baseURLString = [[options baseURL] absoluteString];
+    return [NSString stringWithFormat:@"%lu|%@|%ld|%ld|%d|%d|%d|%ld|%lu|%.2f",
+            (unsigned long)[options cmarkOptions],
+            baseURLString != nil ? baseURLString : @"",
+            (long)[options inlineHTMLPolicy],
+            (long)[options blockHTMLPolicy],
+            (int)([options renderImages] ? 1 : 0),
+            (int)([options allowRemoteImages] ? 1 : 0),
+            (int)([options codeSyntaxHighlightingEnabled] ? 1 : 0),
+            (long)[options mathRenderingPolicy],
+            (unsigned long)[options maximumMathFormulaLength],
+            [options externalToolTimeout]];
+}
+
+static void OMAppendOffsetRanges(NSMutableArray *destination, NSArray *ranges, NSUInteger offset)
+{
+    for (NSValue *value in ranges) {
+        NSRange range = [value rangeValue];
+        range.location += offset;
+        [destination addObject:[NSValue valueWithRange:range]];
+    }
+}
+
+static NSMutableDictionary *OMBlockAnchorByShifting(NSDictionary *anchor,
+                                                    NSInteger lineDelta,
+                                                    NSInteger targetDelta)
+{
+    NSMutableDictionary *shifted = [NSMutableDictionary dictionaryWithDictionary:anchor];
+    NSNumber *sourceStart = [anchor objectForKey:OMMarkdownRendererAnchorSourceStartLineKey];
+    NSNumber *sourceEnd = [anchor objectForKey:OMMarkdownRendererAnchorSourceEndLineKey];
+    NSNumber *targetStart = [anchor objectForKey:OMMarkdownRendererAnchorTargetStartKey];
+    if (sourceStart != nil) {
+        [shifted setObject:[NSNumber numberWithInteger:[sourceStart integerValue] + lineDelta]
+                    forKey:OMMarkdownRendererAnchorSourceStartLineKey];
+    }
+    if (sourceEnd != nil) {
+        [shifted setObject:[NSNumber numberWithInteger:[sourceEnd integerValue] + lineDelta]
+                    forKey:OMMarkdownRendererAnchorSourceEndLineKey];
+    }
+    if (targetStart != nil) {
+        [shifted setObject:[NSNumber numberWithInteger:[targetStart integerValue] + targetDelta]
+                    forKey:OMMarkdownRendererAnchorTargetStartKey];
+    }
+    return shifted;
+}
+
+static OMRenderedBlockFragment *OMRenderBlockFragment(cmark_node *node,
+                                                      NSUInteger startLine,
+                                                      OMTheme *theme,
+                                                      NSMutableDictionary *attributes,
+                                                      CGFloat scale,
+                                                      CGFloat layoutWidth,
+                                                      OMRenderContext *renderContext)
+{
+    NSMutableAttributedString *content = [[[NSMutableAttributedString alloc] init] autorelease];
+    NSMutableArray *codeRanges = [NSMutableArray array];
+    NSMutableArray *blockquoteRanges = [NSMutableArray array];
+    NSMutableArray *anchors = [NSMutableArray array];
+    NSMutableArray *listStack = [NSMutableArray array];
+    renderContext->blockAnchors = anchors;
+    OMRenderBlocks(node,
+                   theme,
+                   content,
+                   attributes,
+                   codeRanges,
+                   blockquoteRanges,
+                   listStack,
+                   0,
+                   scale,
+                   layoutWidth,
+                   renderContext);
+    renderContext->blockAnchors = nil;
+
+    NSMutableArray *relativeAnchors = [NSMutableArray arrayWithCapacity:[anchors count]];
+    for (NSDictionary *anchor in anchors) {
+        [relativeAnchors addObject:OMBlockAnchorByShifting(anchor, -(NSInteger)startLine, 0)];
+    }
+
+    OMRenderedBlockFragment *fragment = [[[OMRenderedBlockFragment alloc] init] autorelease];
+    [fragment setContent:content];
+    [fragment setCodeRanges:codeRanges];
+    [fragment setBlockquoteRanges:blockquoteRanges];
+    [fragment setAnchors:relativeAnchors];
+    return fragment;
+}
+
+// Longest an export waits for its math and image assets before rendering
+// with whatever is ready; anything still missing is then produced inline.
+static const NSTimeInterval OMExportAssetWaitLimit = 120.0;
+
+static NSUInteger OMExportRenderConcurrencyLimit(void)
+{
+    static NSUInteger limit = 0;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSInteger resolved = [[NSProcessInfo processInfo] activeProcessorCount];
+        NSString *value = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_EXPORT_WORKERS"];
+        if ([value length] > 0 && [value integerValue] > 0) {
+            resolved = [value integerValue];
+        }
+        if (resolved < 1) {
+            resolved = 1;
+        } else if (resolved > 8) {
+            resolved = 8;
+        }
+        limit = (NSUInteger)resolved;
+    });
+    return limit;
+}
+
+@interface OMMarkdownRenderSettings ()
+{
+    OMRenderContext _renderContext;
+    CGFloat _zoomScale;
+}
+- (id)initWithRenderContext:(const OMRenderContext *)renderContext zoomScale:(CGFloat)zoomScale;
+- (OMRenderContext)renderContext;
+- (CGFloat)zoomScale;
+@end
+
+@implementation OMMarkdownRenderSettings
+
+- (id)initWithRenderContext:(const OMRenderContext *)renderContext zoomScale:(CGFloat)zoomScale
+{
+    self = [super init];
+    if (self != nil) {
+        _renderContext = *renderContext;
+        [_renderContext.theme retain];
+        [_renderContext.parsingOptions retain];
+        _renderContext.sourceLines = nil;
+        _renderContext.blockAnchors = nil;
+        _renderContext.consumedDisplayMathLineRanges = nil;
+        _renderContext.mathPerfStats = NULL;
+        _renderContext.artifactWait = nil;
+        _zoomScale = zoomScale;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_renderContext.theme release];
+    [_renderContext.parsingOptions release];
+    [super dealloc];
+}
+
+- (OMRenderContext)renderContext
+{
+    return _renderContext;
 }
 
+- (CGFloat)zoomScale
+{
+    return _zoomScale;
+}
+
+@end
+
 @interface OMMarkdownRenderer ()
+{
+    NSMutableDictionary *_blockFragmentCache;
+    NSString *_blockFragmentEnvironmentKey;
+    NSArray *_lastBlockFragments;
+    NSUInteger _lastBlockRenderLength;
+    NSUInteger _blockFragmentCacheGeneration;
+}
 @property (nonatomic, retain) OMTheme *theme;
 @property (nonatomic, retain) NSArray *codeBlockRanges;
 @property (nonatomic, retain) NSArray *blockquoteRanges;
 @property (nonatomic, retain) NSArray *blockAnchors;
+- (NSMutableDictionary *)baseRenderAttributesForScale:(CGFloat)scale theme:(OMTheme *)theme;
+- (NSAttributedString *)renderBlocksFromMarkdown:(NSString *)markdown
+                                  renderSettings:(OMMarkdownRenderSettings *)settings
+                            previousChangedRange:(NSRange *)previousChangedRangeOut
+                                    changedRange:(NSRange *)changedRangeOut
+                               priorityLineRange:(NSRange)priorityLineRange
+                                progressInterval:(NSUInteger)progressInterval
+                                 progressHandler:(OMMarkdownRendererProgressHandler)progressHandler
+                               cancellationCheck:(BOOL (^)(void))isCancelled;
+- (CGFloat)snapshotRenderContext:(OMRenderContext *)renderContext;
+- (CGFloat)renderContext:(OMRenderContext *)renderContext fromSettings:(OMMarkdownRenderSettings *)settings;
+- (NSString *)blockFragmentEnvironmentKeyForRenderContext:(const OMRenderContext *)renderContext
+                                                zoomScale:(CGFloat)zoomScale
+                                              sourceLines:(NSArray *)sourceLines;
+- (void)renderArtifactsDidWarm:(NSNotification *)notification;
+- (NSAttributedString *)renderBlocksConcurrentlyFromDocument:(cmark_node *)document
+                                                 sourceLines:(NSArray *)sourceLines
+                                                       scale:(CGFloat)scale
+                                               renderContext:(OMRenderContext *)renderContext
+                                                  codeRanges:(NSMutableArray *)codeRanges
+                                            blockquoteRanges:(NSMutableArray *)blockquoteRanges
+                                                blockAnchors:(NSMutableArray *)blockAnchors
+                                             progressHandler:(OMMarkdownRendererExportProgressHandler)progressHandler
+                                           cancellationCheck:(BOOL (^)(void))isCancelled;
 @end
 
 @implementation OMMarkdownRenderer
@@ -5362,16 +8589,29 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
 @synthesize layoutWidth = _layoutWidth;
 @synthesize allowTableHorizontalOverflow = _allowTableHorizontalOverflow;
 @synthesize asynchronousMathGenerationEnabled = _asynchronousMathGenerationEnabled;
+@synthesize asynchronousImageLoadingEnabled = _asynchronousImageLoadingEnabled;
 @synthesize parsingOptions = _parsingOptions;
 @synthesize codeBlockRanges = _codeBlockRanges;
 @synthesize blockquoteRanges = _blockquoteRanges;
 @synthesize blockAnchors = _blockAnchors;
+@synthesize lastRenderedBlockCount = _lastRenderedBlockCount;
+@synthesize lastReusedBlockCount = _lastReusedBlockCount;
 
 + (BOOL)isTreeSitterAvailable
 {
     return OMTreeSitterRuntimeAvailable();
 }
 
++ (OMDiskCache *)mathArtifactDiskCache
+{
+    return OMMathDiskCache();
+}
+
++ (OMDiskCache *)imageDiskCache
+{
+    return OMImageDiskCache();
+}
+
 - (instancetype)init
 {
     return [self initWithTheme:[OMTheme defaultTheme]
@@ -5400,12 +8640,25 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
         _layoutWidth = 0.0;
         _allowTableHorizontalOverflow = NO;
         _asynchronousMathGenerationEnabled = NO;
+        _asynchronousImageLoadingEnabled = NO;
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(renderArtifactsDidWarm:)
+                                                     name:OMMarkdownRendererMathArtifactsDidWarmNotification
+                                                   object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(renderArtifactsDidWarm:)
+                                                     name:OMMarkdownRendererRemoteImagesDidWarmNotification
+                                                   object:nil];
     }
     return self;
 }
 
 - (void)dealloc
 {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [_blockFragmentCache release];
+    [_blockFragmentEnvironmentKey release];
+    [_lastBlockFragments release];
     [_codeBlockRanges release];
     [_blockquoteRanges release];
     [_blockAnchors release];
@@ -5420,11 +8673,20 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
     if (resolved == nil) {
         resolved = [OMMarkdownParsingOptions defaultOptions];
     }
-    if (_parsingOptions == resolved) {
-        return;
+    @synchronized (self) {
+        if (_parsingOptions == resolved) {
+            return;
+        }
+        [_parsingOptions release];
+        _parsingOptions = [resolved copy];
+    }
+}
+
+- (OMMarkdownParsingOptions *)parsingOptions
+{
+    @synchronized (self) {
+        return [[_parsingOptions retain] autorelease];
     }
-    [_parsingOptions release];
-    _parsingOptions = [resolved copy];
 }
 
 - (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
@@ -5433,24 +8695,16 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
         return [[[NSAttributedString alloc] initWithString:@""] autorelease];
     }
 
-    NSString *markdownForParsing = OMNormalizeGFMStrikethroughMarkdown(markdown);
-    if (markdownForParsing == nil) {
-        markdownForParsing = markdown;
-    }
-
     BOOL perfLogging = OMPerformanceLoggingEnabled();
     NSTimeInterval totalStart = perfLogging ? OMNow() : 0.0;
+    OMRenderContext renderContext;
+    CGFloat zoomScale = [self snapshotRenderContext:&renderContext];
 
-    NSData *markdownData = [markdownForParsing dataUsingEncoding:NSUTF8StringEncoding];
-    if (markdownData == nil) {
-        return [[[NSAttributedString alloc] initWithString:@""] autorelease];
-    }
-
-    const char *bytes = (const char *)[markdownData bytes];
-    size_t length = (size_t)[markdownData length];
-    NSUInteger cmarkOptions = self.parsingOptions != nil ? [self.parsingOptions cmarkOptions] : (NSUInteger)CMARK_OPT_DEFAULT;
+    NSUInteger cmarkOptions = renderContext.parsingOptions != nil ? [renderContext.parsingOptions cmarkOptions] : (NSUInteger)CMARK_OPT_DEFAULT;
     NSTimeInterval parseStart = perfLogging ? OMNow() : 0.0;
-    cmark_node *document = cmark_parse_document(bytes, length, (int)cmarkOptions);
+    OMMarkdownDocumentSnapshot *snapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:markdown
+                                                                              cmarkOptions:cmarkOptions];
+    cmark_node *document = [snapshot documentNode];
     NSTimeInterval parseMs = perfLogging ? ((OMNow() - parseStart) * 1000.0) : 0.0;
     if (document == NULL) {
         if (perfLogging) {
@@ -5463,40 +8717,24 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
     }
 
     NSMutableAttributedString *output = [[[NSMutableAttributedString alloc] init] autorelease];
-    NSMutableDictionary *attributes = [[[self.theme baseAttributes] mutableCopy] autorelease];
-    CGFloat scale = self.zoomScale > 0.01 ? self.zoomScale : 1.0;
-    if (self.theme.baseFont != nil) {
-        NSFont *scaledFont = [NSFont fontWithName:[self.theme.baseFont fontName]
-                                             size:[self.theme.baseFont pointSize] * scale];
-        if (scaledFont != nil) {
-            [attributes setObject:scaledFont forKey:NSFontAttributeName];
-        } else {
-            [attributes setObject:self.theme.baseFont forKey:NSFontAttributeName];
-        }
-    }
-    if ([attributes objectForKey:NSForegroundColorAttributeName] == nil && self.theme.baseTextColor != nil) {
-        [attributes setObject:self.theme.baseTextColor forKey:NSForegroundColorAttributeName];
-    }
+    CGFloat scale = zoomScale > 0.01 ? zoomScale : 1.0;
+    NSMutableDictionary *attributes = [self baseRenderAttributesForScale:scale theme:renderContext.theme];
 
     NSMutableArray *listStack = [NSMutableArray array];
     NSMutableArray *codeRanges = [NSMutableArray array];
     NSMutableArray *blockquoteRanges = [NSMutableArray array];
     NSMutableArray *blockAnchors = [NSMutableArray array];
     NSMutableArray *consumedDisplayMathLineRanges = [NSMutableArray array];
-    NSArray *sourceLines = OMSourceLinesForMarkdown(markdown);
+    NSArray *sourceLines = [snapshot sourceLines];
     OMMathPerfStats stats = {0};
-    OMRenderContext renderContext;
-    renderContext.parsingOptions = self.parsingOptions;
     renderContext.sourceLines = sourceLines;
     renderContext.blockAnchors = blockAnchors;
     renderContext.consumedDisplayMathLineRanges = consumedDisplayMathLineRanges;
     renderContext.mathPerfStats = &stats;
-    renderContext.layoutWidth = self.layoutWidth;
-    renderContext.allowTableHorizontalOverflow = self.allowTableHorizontalOverflow;
-    renderContext.asynchronousMathGenerationEnabled = self.asynchronousMathGenerationEnabled;
     NSTimeInterval renderStart = perfLogging ? OMNow() : 0.0;
+    OMPerfTraceSpan renderSpan = OMPerfTraceBegin("renderer", "render");
     OMRenderBlocks(document,
-                   self.theme,
+                   renderContext.theme,
                    output,
                    attributes,
                    codeRanges,
@@ -5504,28 +8742,30 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
                    listStack,
                    0,
                    scale,
-                   self.layoutWidth,
+                   renderContext.layoutWidth,
                    &renderContext);
+    OMPerfTraceEnd(renderSpan);
     NSTimeInterval renderMs = perfLogging ? ((OMNow() - renderStart) * 1000.0) : 0.0;
     [self setCodeBlockRanges:codeRanges];
     [self setBlockquoteRanges:blockquoteRanges];
     [self setBlockAnchors:blockAnchors];
     OMTrimTrailingNewlines(output);
-    cmark_node_free(document);
     if (perfLogging) {
-        NSLog(@"[Perf][Renderer] total=%.1fms parse=%.1fms render=%.1fms charsIn=%lu charsOut=%lu zoom=%.2f width=%.1f math(req=%lu hit=%lu miss=%lu assetHit=%lu assetMiss=%lu ok=%lu fail=%lu total=%.1fms latex=%lums/%lu dvisvgm=%lums/%lu decode=%.1fms)",
+        NSLog(@"[Perf][Renderer] total=%.1fms parse=%.1fms render=%.1fms charsIn=%lu charsOut=%lu zoom=%.2f width=%.1f math(req=%lu hit=%lu miss=%lu assetHit=%lu assetMiss=%lu diskHit=%lu diskMiss=%lu ok=%lu fail=%lu total=%.1fms latex=%lums/%lu dvisvgm=%lums/%lu decode=%.1fms)",
               (OMNow() - totalStart) * 1000.0,
               parseMs,
               renderMs,
               (unsigned long)[markdown length],
               (unsigned long)[output length],
-              self.zoomScale,
-              self.layoutWidth,
+              zoomScale,
+              renderContext.layoutWidth,
               (unsigned long)stats.mathRequests,
               (unsigned long)stats.mathCacheHits,
               (unsigned long)stats.mathCacheMisses,
               (unsigned long)stats.mathAssetCacheHits,
               (unsigned long)stats.mathAssetCacheMisses,
+              (unsigned long)stats.mathDiskCacheHits,
+              (unsigned long)stats.mathDiskCacheMisses,
               (unsigned long)stats.mathRendered,
               (unsigned long)stats.mathFailures,
               stats.mathTotalSeconds * 1000.0,
@@ -5538,6 +8778,751 @@ static cmark_node *OMTryAppendMultiNodeDisplayMath(cmark_node *startNode,
     return output;
 }
 
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                previousChangedRange:(NSRange *)previousChangedRangeOut
+                                        changedRange:(NSRange *)changedRangeOut
+{
+    return [self attributedStringFromMarkdown:markdown
+                         previousChangedRange:previousChangedRangeOut
+                                 changedRange:changedRangeOut
+                            cancellationCheck:nil];
+}
+
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                previousChangedRange:(NSRange *)previousChangedRangeOut
+                                        changedRange:(NSRange *)changedRangeOut
+                                   cancellationCheck:(BOOL (^)(void))isCancelled
+{
+    return [self attributedStringFromMarkdown:markdown
+                               renderSettings:nil
+                         previousChangedRange:previousChangedRangeOut
+                                 changedRange:changedRangeOut
+                            cancellationCheck:isCancelled];
+}
+
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                      renderSettings:(OMMarkdownRenderSettings *)settings
+                                previousChangedRange:(NSRange *)previousChangedRangeOut
+                                        changedRange:(NSRange *)changedRangeOut
+                                   cancellationCheck:(BOOL (^)(void))isCancelled
+{
+    return [self renderBlocksFromMarkdown:markdown
+                           renderSettings:settings
+                     previousChangedRange:previousChangedRangeOut
+                             changedRange:changedRangeOut
+                        priorityLineRange:NSMakeRange(0, 0)
+                         progressInterval:0
+                          progressHandler:nil
+                        cancellationCheck:isCancelled];
+}
+
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                   priorityLineRange:(NSRange)priorityLineRange
+                                    progressInterval:(NSUInteger)progressInterval
+                                     progressHandler:(OMMarkdownRendererProgressHandler)progressHandler
+                                   cancellationCheck:(BOOL (^)(void))isCancelled
+{
+    return [self attributedStringFromMarkdown:markdown
+                               renderSettings:nil
+                            priorityLineRange:priorityLineRange
+                             progressInterval:progressInterval
+                              progressHandler:progressHandler
+                            cancellationCheck:isCancelled];
+}
+
+- (NSAttributedString *)attributedStringFromMarkdown:(NSString *)markdown
+                                      renderSettings:(OMMarkdownRenderSettings *)settings
+                                   priorityLineRange:(NSRange)priorityLineRange
+                                    progressInterval:(NSUInteger)progressInterval
+                                     progressHandler:(OMMarkdownRendererProgressHandler)progressHandler
+                                   cancellationCheck:(BOOL (^)(void))isCancelled
+{
+    return [self renderBlocksFromMarkdown:markdown
+                           renderSettings:settings
+                     previousChangedRange:NULL
+                             changedRange:NULL
+                        priorityLineRange:priorityLineRange
+                         progressInterval:progressInterval
+                          progressHandler:progressHandler
+                        cancellationCheck:isCancelled];
+}
+
+- (NSAttributedString *)renderBlocksFromMarkdown:(NSString *)markdown
+                                  renderSettings:(OMMarkdownRenderSettings *)settings
+                            previousChangedRange:(NSRange *)previousChangedRangeOut
+                                    changedRange:(NSRange *)changedRangeOut
+                               priorityLineRange:(NSRange)priorityLineRange
+                                progressInterval:(NSUInteger)progressInterval
+                                 progressHandler:(OMMarkdownRendererProgressHandler)progressHandler
+                               cancellationCheck:(BOOL (^)(void))isCancelled
+{
+    OM_PERF_TRACE_SCOPE("renderer", "render-blocks");
+    NSArray *previousFragments = nil;
+    NSDictionary *fragmentCache = nil;
+    NSString *previousEnvironmentKey = nil;
+    NSUInteger previousLength = 0;
+    NSUInteger cacheGeneration = 0;
+    @synchronized (self) {
+        previousFragments = [[_lastBlockFragments retain] autorelease];
+        fragmentCache = [[_blockFragmentCache retain] autorelease];
+        previousEnvironmentKey = [[_blockFragmentEnvironmentKey retain] autorelease];
+        previousLength = _lastBlockRenderLength;
+        cacheGeneration = _blockFragmentCacheGeneration;
+    }
+
+    if (markdown == nil) {
+        markdown = @"";
+    }
+    BOOL perfLogging = OMPerformanceLoggingEnabled();
+    NSTimeInterval totalStart = perfLogging ? OMNow() : 0.0;
+    OMRenderContext renderContext;
+    CGFloat zoomScale = [self renderContext:&renderContext fromSettings:settings];
+
+    NSUInteger cmarkOptions = renderContext.parsingOptions != nil ? [renderContext.parsingOptions cmarkOptions] : (NSUInteger)CMARK_OPT_DEFAULT;
+    NSTimeInterval parseStart = perfLogging ? OMNow() : 0.0;
+    OMMarkdownDocumentSnapshot *snapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:markdown
+                                                                              cmarkOptions:cmarkOptions];
+    cmark_node *document = [snapshot documentNode];
+    NSTimeInterval parseMs = perfLogging ? ((OMNow() - parseStart) * 1000.0) : 0.0;
+    if (document == NULL) {
+        NSAttributedString *fallback = [self attributedStringFromMarkdown:markdown];
+        @synchronized (self) {
+            [_lastBlockFragments release];
+            _lastBlockFragments = nil;
+            _lastBlockRenderLength = [fallback length];
+        }
+        if (previousChangedRangeOut != NULL) {
+            *previousChangedRangeOut = NSMakeRange(0, previousLength);
+        }
+        if (changedRangeOut != NULL) {
+            *changedRangeOut = NSMakeRange(0, [fallback length]);
+        }
+        return fallback;
+    }
+
+    NSMutableAttributedString *output = [[[NSMutableAttributedString alloc] init] autorelease];
+    CGFloat scale = zoomScale > 0.01 ? zoomScale : 1.0;
+    NSMutableDictionary *attributes = [self baseRenderAttributesForScale:scale theme:renderContext.theme];
+    NSArray *sourceLines = [snapshot sourceLines];
+    NSString *environmentKey = [self blockFragmentEnvironmentKeyForRenderContext:&renderContext
+                                                                       zoomScale:zoomScale
+                                                                     sourceLines:sourceLines];
+    if (previousEnvironmentKey == nil || ![environmentKey isEqualToString:previousEnvironmentKey]) {
+        fragmentCache = nil;
+    }
+
+    NSMutableArray *codeRanges = [NSMutableArray array];
+    NSMutableArray *blockquoteRanges = [NSMutableArray array];
+    NSMutableArray *blockAnchors = [NSMutableArray array];
+    NSMutableArray *consumedDisplayMathLineRanges = [NSMutableArray array];
+    NSMutableArray *fragments = [NSMutableArray array];
+    NSMutableDictionary *nextFragmentCache = [NSMutableDictionary dictionary];
+    OMMathPerfStats stats = {0};
+    renderContext.sourceLines = sourceLines;
+    renderContext.blockAnchors = nil;
+    renderContext.consumedDisplayMathLineRanges = consumedDisplayMathLineRanges;
+    renderContext.mathPerfStats = &stats;
+    BOOL displayMathFencesMatter = OMShouldParseMathSpans(&renderContext);
+    NSUInteger reusedCount = 0;
+
+    NSTimeInterval renderStart = perfLogging ? OMNow() : 0.0;
+    NSTimeInterval firstProgressMs = -1.0;
+    NSMutableDictionary *priorityFragments = nil;
+    NSUInteger priorityEndLine = NSMaxRange(priorityLineRange);
+    if (progressHandler != nil && priorityLineRange.length > 0 && priorityLineRange.location > 1) {
+        // The viewport is further down the document: render just its blocks
+        // first so something useful can be shown before the in-order pass
+        // reaches them. Display math fences consume lines across blocks, so
+        // that bookkeeping runs on a throwaway list here.
+        priorityFragments = [NSMutableDictionary dictionary];
+        NSMutableAttributedString *priorityOutput = [[[NSMutableAttributedString alloc] init] autorelease];
+        NSMutableArray *priorityCodeRanges = [NSMutableArray array];
+        NSMutableArray *priorityBlockquoteRanges = [NSMutableArray array];
+        OMRenderContext priorityContext = renderContext;
+        priorityContext.consumedDisplayMathLineRanges = [NSMutableArray array];
+        NSUInteger nodeIndex = 0;
+        cmark_node *node = cmark_node_first_child(document);
+        for (; node != NULL; node = cmark_node_next(node), nodeIndex++) {
+            NSUInteger startLine = 0;
+            NSUInteger endLine = 0;
+            if (!OMNodeLineBounds(node, &startLine, &endLine) || endLine < priorityLineRange.location) {
+                continue;
+            }
+            if (startLine >= priorityEndLine) {
+                break;
+            }
+            if (isCancelled != nil && isCancelled()) {
+                return nil;
+            }
+            if (OMDisplayMathLineAlreadyConsumed(startLine, &priorityContext)) {
+                continue;
+            }
+            OMRenderedBlockFragment *fragment = OMRenderBlockFragment(node,
+                                                                      startLine,
+                                                                      renderContext.theme,
+                                                                      attributes,
+                                                                      scale,
+                                                                      priorityContext.layoutWidth,
+                                                                      &priorityContext);
+            if (!(displayMathFencesMatter && OMLineRangeContainsDisplayMathFence(sourceLines, startLine, endLine))) {
+                [priorityFragments setObject:fragment forKey:[NSNumber numberWithUnsignedInteger:nodeIndex]];
+            }
+            NSUInteger offset = [priorityOutput length];
+            [priorityOutput appendAttributedString:[fragment content]];
+            OMAppendOffsetRanges(priorityCodeRanges, [fragment codeRanges], offset);
+            OMAppendOffsetRanges(priorityBlockquoteRanges, [fragment blockquoteRanges], offset);
+        }
+        if ([priorityOutput length] > 0) {
+            progressHandler(priorityOutput, 0, priorityCodeRanges, priorityBlockquoteRanges, nil, YES);
+            firstProgressMs = (OMNow() - renderStart) * 1000.0;
+        }
+    }
+
+    NSUInteger reportedLength = 0;
+    BOOL reportedInOrderPrefix = NO;
+    NSUInteger nodeIndex = 0;
+    cmark_node *child = cmark_node_first_child(document);
+    for (; child != NULL; child = cmark_node_next(child), nodeIndex++) {
+        if (isCancelled != nil && isCancelled()) {
+            // Leave the cache and diff baseline untouched for the next render.
+            return nil;
+        }
+        NSUInteger startLine = 0;
+        NSUInteger endLine = 0;
+        BOOL hasLineBounds = OMNodeLineBounds(child, &startLine, &endLine);
+        if (hasLineBounds && OMDisplayMathLineAlreadyConsumed(startLine, &renderContext)) {
+            continue;
+        }
+
+        NSString *cacheKey = nil;
+        if (hasLineBounds &&
+            !(displayMathFencesMatter && OMLineRangeContainsDisplayMathFence(sourceLines, startLine, endLine))) {
+            cacheKey = OMBlockFragmentCacheKeyForLineRange(cmark_node_get_type(child),
+                                                           sourceLines,
+                                                           startLine,
+                                                           endLine);
+        }
+        OMRenderedBlockFragment *fragment = cacheKey != nil ? [fragmentCache objectForKey:cacheKey] : nil;
+        if (fragment != nil) {
+            reusedCount += 1;
+        } else {
+            if (cacheKey != nil) {
+                // Possibly rendered already by the viewport pass above.
+                fragment = [priorityFragments objectForKey:[NSNumber numberWithUnsignedInteger:nodeIndex]];
+            }
+            if (fragment == nil) {
+                fragment = OMRenderBlockFragment(child,
+                                                 startLine,
+                                                 renderContext.theme,
+                                                 attributes,
+                                                 scale,
+                                                 renderContext.layoutWidth,
+                                                 &renderContext);
+            }
+        }
+        if (cacheKey != nil) {
+            [nextFragmentCache setObject:fragment forKey:cacheKey];
+        }
+
+        NSUInteger offset = [output length];
+        [output appendAttributedString:[fragment content]];
+        OMAppendOffsetRanges(codeRanges, [fragment codeRanges], offset);
+        OMAppendOffsetRanges(blockquoteRanges, [fragment blockquoteRanges], offset);
+        for (NSDictionary *anchor in [fragment anchors]) {
+            [blockAnchors addObject:OMBlockAnchorByShifting(anchor, (NSInteger)startLine, (NSInteger)offset)];
+        }
+        [fragments addObject:fragment];
+
+        if (progressHandler != nil) {
+            // The first in-order report waits until the viewport is covered;
+            // later ones go out every progressInterval characters.
+            NSUInteger pending = [output length] - reportedLength;
+            BOOL coversViewport = (!hasLineBounds || endLine + 1 >= priorityEndLine);
+            if (pending > 0 &&
+                ((!reportedInOrderPrefix && coversViewport) ||
+                 (reportedInOrderPrefix && pending >= progressInterval))) {
+                progressHandler([output attributedSubstringFromRange:NSMakeRange(reportedLength, pending)],
+                                reportedLength,
+                                [[codeRanges copy] autorelease],
+                                [[blockquoteRanges copy] autorelease],
+                                [[blockAnchors copy] autorelease],
+                                NO);
+                if (firstProgressMs < 0.0) {
+                    firstProgressMs = (OMNow() - renderStart) * 1000.0;
+                }
+                reportedLength = [output length];
+                reportedInOrderPrefix = YES;
+            }
+        }
+    }
+    NSUInteger untrimmedLength = [output length];
+    OMTrimTrailingNewlines(output);
+    NSUInteger outputLength = [output length];
+    NSTimeInterval renderMs = perfLogging ? ((OMNow() - renderStart) * 1000.0) : 0.0;
+
+    // Fragments are shared objects, so unchanged blocks compare by identity.
+    NSUInteger previousCount = [previousFragments count];
+    NSUInteger count = [fragments count];
+    NSUInteger prefixCount = 0;
+    NSUInteger prefixLength = 0;
+    while (prefixCount < previousCount && prefixCount < count &&
+           [previousFragments objectAtIndex:prefixCount] == [fragments objectAtIndex:prefixCount]) {
+        prefixLength += [[[fragments objectAtIndex:prefixCount] content] length];
+        prefixCount += 1;
+    }
+    NSUInteger suffixCount = 0;
+    NSUInteger suffixLength = 0;
+    while (suffixCount < previousCount - prefixCount && suffixCount < count - prefixCount &&
+           [previousFragments objectAtIndex:previousCount - 1 - suffixCount] ==
+           [fragments objectAtIndex:count - 1 - suffixCount]) {
+        suffixLength += [[[fragments objectAtIndex:count - 1 - suffixCount] content] length];
+        suffixCount += 1;
+    }
+    if (suffixCount > 0) {
+        // A shared tail was trimmed identically in both renders.
+        NSUInteger trimmed = untrimmedLength - outputLength;
+        suffixLength = suffixLength > trimmed ? suffixLength - trimmed : 0;
+    }
+    NSUInteger sharedLimit = MIN(previousLength, outputLength);
+    if (prefixLength > sharedLimit) {
+        prefixLength = sharedLimit;
+    }
+    if (suffixLength > sharedLimit - prefixLength) {
+        suffixLength = sharedLimit - prefixLength;
+    }
+    if (previousChangedRangeOut != NULL) {
+        *previousChangedRangeOut = NSMakeRange(prefixLength, previousLength - prefixLength - suffixLength);
+    }
+    if (changedRangeOut != NULL) {
+        *changedRangeOut = NSMakeRange(prefixLength, outputLength - prefixLength - suffixLength);
+    }
+
+    [self setCodeBlockRanges:codeRanges];
+    [self setBlockquoteRanges:blockquoteRanges];
+    [self setBlockAnchors:blockAnchors];
+    @synchronized (self) {
+        if (cacheGeneration == _blockFragmentCacheGeneration) {
+            [_blockFragmentCache release];
+            _blockFragmentCache = [nextFragmentCache retain];
+            [_blockFragmentEnvironmentKey release];
+            _blockFragmentEnvironmentKey = [environmentKey copy];
+        }
+        [_lastBlockFragments release];
+        _lastBlockFragments = [fragments copy];
+        _lastBlockRenderLength = outputLength;
+        _lastRenderedBlockCount = count;
+        _lastReusedBlockCount = reusedCount;
+    }
+    OMPerfTraceCounter("renderer", "blocks-rendered", (int64_t)count);
+    OMPerfTraceCounter("renderer", "blocks-reused", (int64_t)reusedCount);
+
+    if (perfLogging) {
+        NSLog(@"[Perf][Renderer] incremental total=%.1fms parse=%.1fms render=%.1fms firstProgress=%.1fms blocks=%lu reused=%lu changed=%lu charsIn=%lu charsOut=%lu zoom=%.2f width=%.1f math(req=%lu hit=%lu miss=%lu diskHit=%lu diskMiss=%lu ok=%lu fail=%lu total=%.1fms)",
+              (OMNow() - totalStart) * 1000.0,
+              parseMs,
+              renderMs,
+              firstProgressMs,
+              (unsigned long)count,
+              (unsigned long)reusedCount,
+              (unsigned long)(outputLength - prefixLength - suffixLength),
+              (unsigned long)[markdown length],
+              (unsigned long)outputLength,
+              zoomScale,
+              renderContext.layoutWidth,
+              (unsigned long)stats.mathRequests,
+              (unsigned long)stats.mathCacheHits,
+              (unsigned long)stats.mathCacheMisses,
+              (unsigned long)stats.mathDiskCacheHits,
+              (unsigned long)stats.mathDiskCacheMisses,
+              (unsigned long)stats.mathRendered,
+              (unsigned long)stats.mathFailures,
+              stats.mathTotalSeconds * 1000.0);
+    }
+    return output;
+}
+
+// Top-level blocks that do not depend on their neighbours (see the display
+// math notes above OMLineRangeContainsDisplayMathFence) are rendered on
+// worker threads, each with its own attributes and context. The in-order
+// pass then joins them and renders the remaining blocks itself. Table
+// layout and text measuring inside the fragments are handed to the main
+// thread (OMPerformAppKitWork), so only AppKit-free work runs in parallel.
+- (NSAttributedString *)renderBlocksConcurrentlyFromDocument:(cmark_node *)document
+                                                 sourceLines:(NSArray *)sourceLines
+                                                       scale:(CGFloat)scale
+                                               renderContext:(OMRenderContext *)renderContext
+                                                  codeRanges:(NSMutableArray *)codeRanges
+                                            blockquoteRanges:(NSMutableArray *)blockquoteRanges
+                                                blockAnchors:(NSMutableArray *)blockAnchors
+                                             progressHandler:(OMMarkdownRendererExportProgressHandler)progressHandler
+                                           cancellationCheck:(BOOL (^)(void))isCancelled
+{
+    NSMutableAttributedString *output = [[[NSMutableAttributedString alloc] init] autorelease];
+    OMTheme *theme = renderContext->theme;
+    NSMutableDictionary *attributes = [self baseRenderAttributesForScale:scale theme:theme];
+    CGFloat layoutWidth = renderContext->layoutWidth;
+    BOOL displayMathFencesMatter = OMShouldParseMathSpans(renderContext);
+
+    NSUInteger nodeCount = 0;
+    cmark_node *child = cmark_node_first_child(document);
+    for (; child != NULL; child = cmark_node_next(child)) {
+        nodeCount += 1;
+    }
+    if (nodeCount == 0) {
+        return output;
+    }
+
+    cmark_node **nodes = (cmark_node **)calloc(nodeCount, sizeof(cmark_node *));
+    NSUInteger *startLines = (NSUInteger *)calloc(nodeCount, sizeof(NSUInteger));
+    BOOL *hasLineBounds = (BOOL *)calloc(nodeCount, sizeof(BOOL));
+    BOOL *independent = (BOOL *)calloc(nodeCount, sizeof(BOOL));
+    OMRenderedBlockFragment **fragments = (OMRenderedBlockFragment **)calloc(nodeCount, sizeof(OMRenderedBlockFragment *));
+    if (nodes == NULL || startLines == NULL || hasLineBounds == NULL || independent == NULL || fragments == NULL) {
+        free(nodes);
+        free(startLines);
+        free(hasLineBounds);
+        free(independent);
+        free(fragments);
+        return nil;
+    }
+
+    NSUInteger nodeIndex = 0;
+    child = cmark_node_first_child(document);
+    for (; child != NULL; child = cmark_node_next(child), nodeIndex++) {
+        NSUInteger startLine = 0;
+        NSUInteger endLine = 0;
+        nodes[nodeIndex] = child;
+        hasLineBounds[nodeIndex] = OMNodeLineBounds(child, &startLine, &endLine);
+        startLines[nodeIndex] = startLine;
+        independent[nodeIndex] = (hasLineBounds[nodeIndex] &&
+                                  !(displayMathFencesMatter &&
+                                    OMLineRangeContainsDisplayMathFence(sourceLines, startLine, endLine)));
+    }
+
+    NSUInteger workerCount = MIN(OMExportRenderConcurrencyLimit(), nodeCount);
+    NSDictionary *attributeTemplate = [[attributes copy] autorelease];
+    NSObject *progressLock = [[[NSObject alloc] init] autorelease];
+    __block NSUInteger completed = 0;
+    OMRenderContext sharedContext = *renderContext;
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    NSUInteger worker = 0;
+    for (; worker < workerCount; worker++) {
+        dispatch_group_async(group, queue, ^{
+            @autoreleasepool {
+                OM_PERF_TRACE_SCOPE("renderer", "export-worker");
+                NSMutableDictionary *workerAttributes = [[attributeTemplate mutableCopy] autorelease];
+                OMRenderContext workerContext = sharedContext;
+                workerContext.consumedDisplayMathLineRanges = [NSMutableArray array];
+                workerContext.mathPerfStats = NULL;
+                NSUInteger index = worker;
+                // Interleaved so that one dense stretch of the document (a run
+                // of tables or formulas) is spread over all workers.
+                for (; index < nodeCount; index += workerCount) {
+                    if (isCancelled != nil && isCancelled()) {
+                        break;
+                    }
+                    if (independent[index]) {
+                        @autoreleasepool {
+                            fragments[index] = [OMRenderBlockFragment(nodes[index],
+                                                                      startLines[index],
+                                                                      theme,
+                                                                      workerAttributes,
+                                                                      scale,
+                                                                      layoutWidth,
+                                                                      &workerContext) retain];
+                        }
+                    }
+                    if (progressHandler != nil) {
+                        @synchronized (progressLock) {
+                            completed += 1;
+                            progressHandler(OMMarkdownRendererExportPhaseBlocks, completed, nodeCount);
+                        }
+                    }
+                }
+            }
+        });
+    }
+    // When the caller is the main thread it serves the workers' AppKit steps
+    // while it waits.
+    dispatch_semaphore_t workersDone = dispatch_semaphore_create(0);
+    dispatch_group_notify(group, queue, ^{
+        dispatch_semaphore_signal(workersDone);
+    });
+    OMMarkdownRendererWaitForSemaphore(workersDone, 0.0);
+    dispatch_release(workersDone);
+    dispatch_release(group);
+
+    BOOL cancelled = (isCancelled != nil && isCancelled());
+    for (nodeIndex = 0; nodeIndex < nodeCount && !cancelled; nodeIndex++) {
+        NSUInteger startLine = startLines[nodeIndex];
+        if (hasLineBounds[nodeIndex] && OMDisplayMathLineAlreadyConsumed(startLine, renderContext)) {
+            continue;
+        }
+        OMRenderedBlockFragment *fragment = fragments[nodeIndex];
+        if (fragment == nil) {
+            fragment = OMRenderBlockFragment(nodes[nodeIndex],
+                                             startLine,
+                                             theme,
+                                             attributes,
+                                             scale,
+                                             layoutWidth,
+                                             renderContext);
+        }
+        NSUInteger offset = [output length];
+        [output appendAttributedString:[fragment content]];
+        OMAppendOffsetRanges(codeRanges, [fragment codeRanges], offset);
+        OMAppendOffsetRanges(blockquoteRanges, [fragment blockquoteRanges], offset);
+        for (NSDictionary *anchor in [fragment anchors]) {
+            [blockAnchors addObject:OMBlockAnchorByShifting(anchor, (NSInteger)startLine, (NSInteger)offset)];
+        }
+    }
+
+    for (nodeIndex = 0; nodeIndex < nodeCount; nodeIndex++) {
+        [fragments[nodeIndex] release];
+    }
+    free(nodes);
+    free(startLines);
+    free(hasLineBounds);
+    free(independent);
+    free(fragments);
+    return cancelled ? nil : output;
+}
+
+- (NSAttributedString *)exportAttributedStringFromMarkdown:(NSString *)markdown
+                                           progressHandler:(OMMarkdownRendererExportProgressHandler)progressHandler
+{
+    return [self exportAttributedStringFromMarkdown:markdown
+                                     renderSettings:nil
+                                    progressHandler:progressHandler
+                                  cancellationCheck:nil];
+}
+
+- (NSAttributedString *)exportAttributedStringFromMarkdown:(NSString *)markdown
+                                            renderSettings:(OMMarkdownRenderSettings *)settings
+                                           progressHandler:(OMMarkdownRendererExportProgressHandler)progressHandler
+                                         cancellationCheck:(BOOL (^)(void))isCancelled
+{
+    if (markdown == nil) {
+        return [[[NSAttributedString alloc] initWithString:@""] autorelease];
+    }
+
+    OM_PERF_TRACE_SCOPE("renderer", "export-render");
+    BOOL perfLogging = OMPerformanceLoggingEnabled();
+    NSTimeInterval totalStart = OMNow();
+    OMRenderContext renderContext;
+    CGFloat zoomScale = [self renderContext:&renderContext fromSettings:settings];
+    CGFloat scale = zoomScale > 0.01 ? zoomScale : 1.0;
+
+    // Usually the revision the preview already parsed; the tree is read-only,
+    // so sharing it does not hold up the preview.
+    NSUInteger cmarkOptions = renderContext.parsingOptions != nil ? [renderContext.parsingOptions cmarkOptions] : (NSUInteger)CMARK_OPT_DEFAULT;
+    OMMarkdownDocumentSnapshot *snapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:markdown
+                                                                              cmarkOptions:cmarkOptions];
+    cmark_node *document = [snapshot documentNode];
+    if (document == NULL) {
+        return [[[NSAttributedString alloc] initWithString:markdown] autorelease];
+    }
+    NSArray *sourceLines = [snapshot sourceLines];
+    renderContext.sourceLines = sourceLines;
+    renderContext.blockAnchors = nil;
+    renderContext.mathPerfStats = NULL;
+
+    // Asset pass: a walk of the tree, with no rendering, queues exactly the
+    // formulas and pictures this zoom and width need on the shared batch
+    // workers, which then compile and decode them in parallel. The export
+    // waits only for the artifacts it asked for, then renders once.
+    OMPerfTraceSpan assetSpan = OMPerfTraceBegin("renderer", "export-assets");
+    OMRenderArtifactWait *artifactWait = [[[OMRenderArtifactWait alloc] init] autorelease];
+    OMRenderContext assetContext = renderContext;
+    assetContext.consumedDisplayMathLineRanges = [NSMutableArray array];
+    assetContext.artifactWait = artifactWait;
+    NSTimeInterval walkStart = OMNow();
+    OMCollectBlockAssets(document, renderContext.theme, scale, &assetContext);
+    NSTimeInterval walkMs = (OMNow() - walkStart) * 1000.0;
+
+    NSUInteger scheduledAssets = [artifactWait requestedCount];
+    NSTimeInterval waitStart = OMNow();
+    if (scheduledAssets > 0) {
+        dispatch_semaphore_t assetsReady = dispatch_semaphore_create(0);
+        // The notify block may outlive this call when the wait gives up.
+        dispatch_retain(assetsReady);
+        dispatch_group_notify([artifactWait group], dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            dispatch_semaphore_signal(assetsReady);
+            dispatch_release(assetsReady);
+        });
+        NSUInteger reported = NSNotFound;
+        BOOL ready = NO;
+        while (!ready) {
+            if (isCancelled != nil && isCancelled()) {
+                break;
+            }
+            NSTimeInterval remaining = OMExportAssetWaitLimit - (OMNow() - waitStart);
+            if (remaining <= 0.0) {
+                break;
+            }
+            NSUInteger finished = [artifactWait finishedCount];
+            if (progressHandler != nil && finished != reported) {
+                progressHandler(OMMarkdownRendererExportPhaseAssets, finished, scheduledAssets);
+                reported = finished;
+            }
+            ready = OMMarkdownRendererWaitForSemaphore(assetsReady, MIN(remaining, 0.1));
+        }
+        dispatch_release(assetsReady);
+        if (progressHandler != nil) {
+            progressHandler(OMMarkdownRendererExportPhaseAssets, [artifactWait finishedCount], scheduledAssets);
+        }
+    }
+    OMPerfTraceEnd(assetSpan);
+    OMPerfTraceCounter("renderer", "export-assets", (int64_t)scheduledAssets);
+    NSTimeInterval assetsMs = (OMNow() - waitStart) * 1000.0;
+    if (isCancelled != nil && isCancelled()) {
+        return nil;
+    }
+
+    NSMutableArray *codeRanges = [NSMutableArray array];
+    NSMutableArray *blockquoteRanges = [NSMutableArray array];
+    NSMutableArray *blockAnchors = [NSMutableArray array];
+    NSAttributedString *rendered = nil;
+    renderContext.consumedDisplayMathLineRanges = [NSMutableArray array];
+    rendered = [self renderBlocksConcurrentlyFromDocument:document
+                                              sourceLines:sourceLines
+                                                    scale:scale
+                                            renderContext:&renderContext
+                                               codeRanges:codeRanges
+                                         blockquoteRanges:blockquoteRanges
+                                             blockAnchors:blockAnchors
+                                          progressHandler:progressHandler
+                                        cancellationCheck:isCancelled];
+    if (isCancelled != nil && isCancelled()) {
+        return nil;
+    }
+    if (rendered == nil) {
+        return [[[NSAttributedString alloc] initWithString:markdown] autorelease];
+    }
+
+    NSMutableAttributedString *output = [[rendered mutableCopy] autorelease];
+    OMTrimTrailingNewlines(output);
+    [self setCodeBlockRanges:codeRanges];
+    [self setBlockquoteRanges:blockquoteRanges];
+    [self setBlockAnchors:blockAnchors];
+    if (perfLogging) {
+        NSLog(@"[Perf][Renderer] export total=%.1fms walk=%.1fms assets=%lu/%.1fms workers=%lu charsIn=%lu charsOut=%lu zoom=%.2f width=%.1f",
+              (OMNow() - totalStart) * 1000.0,
+              walkMs,
+              (unsigned long)scheduledAssets,
+              assetsMs,
+              (unsigned long)OMExportRenderConcurrencyLimit(),
+              (unsigned long)[markdown length],
+              (unsigned long)[output length],
+              zoomScale,
+              renderContext.layoutWidth);
+    }
+    return output;
+}
+
+- (void)invalidateBlockRenderCache
+{
+    @synchronized (self) {
+        [_blockFragmentCache release];
+        _blockFragmentCache = nil;
+        _blockFragmentCacheGeneration += 1;
+    }
+}
+
+- (NSString *)renderConfigurationKey
+{
+    NSUInteger cacheGeneration = 0;
+    @synchronized (self) {
+        cacheGeneration = _blockFragmentCacheGeneration;
+    }
+    OMRenderContext renderContext;
+    CGFloat zoomScale = [self snapshotRenderContext:&renderContext];
+    NSString *environmentKey = [self blockFragmentEnvironmentKeyForRenderContext:&renderContext
+                                                                       zoomScale:zoomScale
+                                                                     sourceLines:nil];
+    return [NSString stringWithFormat:@"%@#%lu", environmentKey, (unsigned long)cacheGeneration];
+}
+
+- (void)renderArtifactsDidWarm:(NSNotification *)notification
+{
+    (void)notification;
+    // Fragments rendered before the warm-up still hold text fallbacks.
+    [self invalidateBlockRenderCache];
+}
+
+- (NSMutableDictionary *)baseRenderAttributesForScale:(CGFloat)scale theme:(OMTheme *)theme
+{
+    NSMutableDictionary *attributes = [[[theme baseAttributes] mutableCopy] autorelease];
+    if (theme.baseFont != nil) {
+        NSFont *scaledFont = [NSFont fontWithName:[theme.baseFont fontName]
+                                             size:[theme.baseFont pointSize] * scale];
+        if (scaledFont != nil) {
+            [attributes setObject:scaledFont forKey:NSFontAttributeName];
+        } else {
+            [attributes setObject:theme.baseFont forKey:NSFontAttributeName];
+        }
+    }
+    if ([attributes objectForKey:NSForegroundColorAttributeName] == nil && theme.baseTextColor != nil) {
+        [attributes setObject:theme.baseTextColor forKey:NSForegroundColorAttributeName];
+    }
+    return attributes;
+}
+
+// Captures the settings a render depends on so that the main thread can keep
+// reconfiguring the renderer while a render runs on a worker queue.
+- (CGFloat)snapshotRenderContext:(OMRenderContext *)renderContext
+{
+    OMMarkdownParsingOptions *parsingOptions = nil;
+    @synchronized (self) {
+        parsingOptions = [[_parsingOptions retain] autorelease];
+    }
+    renderContext->theme = [[self.theme retain] autorelease];
+    renderContext->parsingOptions = parsingOptions;
+    renderContext->sourceLines = nil;
+    renderContext->blockAnchors = nil;
+    renderContext->consumedDisplayMathLineRanges = nil;
+    renderContext->mathPerfStats = NULL;
+    renderContext->layoutWidth = self.layoutWidth;
+    renderContext->allowTableHorizontalOverflow = self.allowTableHorizontalOverflow;
+    renderContext->asynchronousMathGenerationEnabled = self.asynchronousMathGenerationEnabled;
+    renderContext->asynchronousImageLoadingEnabled = self.asynchronousImageLoadingEnabled;
+    renderContext->artifactWait = nil;
+    return self.zoomScale;
+}
+
+- (CGFloat)renderContext:(OMRenderContext *)renderContext fromSettings:(OMMarkdownRenderSettings *)settings
+{
+    if (settings == nil) {
+        return [self snapshotRenderContext:renderContext];
+    }
+    *renderContext = [settings renderContext];
+    return [settings zoomScale];
+}
+
+- (OMMarkdownRenderSettings *)currentRenderSettings
+{
+    OMRenderContext renderContext;
+    CGFloat zoomScale = [self snapshotRenderContext:&renderContext];
+    return [[[OMMarkdownRenderSettings alloc] initWithRenderContext:&renderContext
+                                                          zoomScale:zoomScale] autorelease];
+}
+
+- (NSString *)blockFragmentEnvironmentKeyForRenderContext:(const OMRenderContext *)renderContext
+                                                zoomScale:(CGFloat)zoomScale
+                                              sourceLines:(NSArray *)sourceLines
+{
+    return [NSString stringWithFormat:@"%p|%.4f|%.1f|%d|%d|%d|%@|%@",
+            (void *)renderContext->theme,
+            zoomScale,
+            renderContext->layoutWidth,
+            (int)(renderContext->allowTableHorizontalOverflow ? 1 : 0),
+            (int)(renderContext->asynchronousMathGenerationEnabled ? 1 : 0),
+            (int)(renderContext->asynchronousImageLoadingEnabled ? 1 : 0),
+            OMParsingOptionsFingerprint(renderContext->parsingOptions),
+            OMLinkReferenceDefinitionsFingerprint(sourceLines)];
+}
+
 - (NSColor *)backgroundColor
 {
     return self.theme.baseBackgroundColor;
@@ -5556,16 +9541,19 @@ static void OMRenderParagraph(cmark_node *node,
     NSArray *tableAlignments = nil;
     if (OMPipeTableDataForParagraphNode(node, renderContext, &tableRows, &tableAlignments)) {
         CGFloat layoutWidth = (renderContext != NULL ? renderContext->layoutWidth : 0.0);
-        OMRenderPipeTable(tableRows,
-                          tableAlignments,
-                          theme,
-                          output,
-                          attributes,
-                          listStack,
-                          quoteLevel,
-                          scale,
-                          layoutWidth,
-                          renderContext);
+        // Measures cells with a layout manager and draws the table image.
+        OMPerformAppKitWork(^{
+            OMRenderPipeTable(tableRows,
+                              tableAlignments,
+                              theme,
+                              output,
+                              attributes,
+                              listStack,
+                              quoteLevel,
+                              scale,
+                              layoutWidth,
+                              renderContext);
+        });
         return;
     }
 
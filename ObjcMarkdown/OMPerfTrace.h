@@ -0,0 +1,59 @@
+// ObjcMarkdown
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#import <Foundation/Foundation.h>
+
+#include <stdint.h>
+
+// Process-wide performance trace. Spans and counters are appended to a
+// fixed-size ring buffer owned by the recording thread, so recording never
+// takes a lock or allocates; only the first event on a new thread registers
+// its buffer. Tracing is off unless OMD_TRACE (or OMD_TRACE_FILE) is set or
+// OMPerfTraceSetEnabled(YES) is called, and a disabled span costs one load.
+//
+// Category and name arguments must be string literals (or otherwise live for
+// the life of the process): only the pointers are stored.
+
+enum {
+    // Events kept per thread; older events are overwritten.
+    OMPerfTraceEventsPerThread = 16384
+};
+
+typedef struct {
+    const char *category;
+    const char *name;
+    uint64_t startMicros;
+} OMPerfTraceSpan;
+
+FOUNDATION_EXPORT BOOL OMPerfTraceIsEnabled(void);
+FOUNDATION_EXPORT void OMPerfTraceSetEnabled(BOOL enabled);
+
+// Monotonic clock shared by every span, in microseconds.
+FOUNDATION_EXPORT uint64_t OMPerfTraceNowMicros(void);
+
+FOUNDATION_EXPORT OMPerfTraceSpan OMPerfTraceBegin(const char *category, const char *name);
+FOUNDATION_EXPORT void OMPerfTraceEnd(OMPerfTraceSpan span);
+FOUNDATION_EXPORT void OMPerfTraceEndScope(OMPerfTraceSpan *span);
+
+// Records an interval measured by the caller, e.g. one that starts in an
+// event handler and ends in a later paint.
+FOUNDATION_EXPORT void OMPerfTraceRecordSpan(const char *category,
+                                             const char *name,
+                                             uint64_t startMicros,
+                                             uint64_t endMicros);
+FOUNDATION_EXPORT void OMPerfTraceCounter(const char *category, const char *name, int64_t value);
+
+// Drops everything recorded so far without stopping the trace.
+FOUNDATION_EXPORT void OMPerfTraceReset(void);
+
+// Chrome trace-event JSON ("traceEvents" object form) of the events still
+// held in the ring buffers; loads in chrome://tracing and Perfetto.
+FOUNDATION_EXPORT NSData *OMPerfTraceChromeJSONData(void);
+FOUNDATION_EXPORT BOOL OMPerfTraceWriteChromeJSON(NSString *path, NSError **error);
+
+// Closes the span when the enclosing scope exits, including early returns.
+#define OM_PERF_TRACE_CONCAT_(a, b) a##b
+#define OM_PERF_TRACE_CONCAT(a, b) OM_PERF_TRACE_CONCAT_(a, b)
+#define OM_PERF_TRACE_SCOPE(category, name) \
+    OMPerfTraceSpan OM_PERF_TRACE_CONCAT(omPerfTraceSpan, __LINE__) \
+        __attribute__((cleanup(OMPerfTraceEndScope), unused)) = OMPerfTraceBegin((category), (name))
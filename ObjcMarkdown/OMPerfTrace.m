@@ -0,0 +1,399 @@
+// ObjcMarkdown
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#import "OMPerfTrace.h"
+
+#import <dispatch/dispatch.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+typedef enum {
+    OMPerfTraceEventKindSpan = 0,
+    OMPerfTraceEventKindCounter = 1
+} OMPerfTraceEventKind;
+
+typedef struct {
+    const char *category;
+    const char *name;
+    uint64_t timestamp;
+    uint64_t duration;
+    int64_t value;
+    uint32_t kind;
+    uint32_t threadId;
+} OMPerfTraceEvent;
+
+// One per live thread. A buffer is written only by the thread that owns it;
+// head is published with release semantics so the exporter can copy the
+// slots below it. Buffers of exited threads are handed to new threads, which
+// is why every event carries its own thread id.
+typedef struct OMPerfTraceBuffer {
+    struct OMPerfTraceBuffer *next;
+    _Atomic uint64_t head;
+    _Atomic uint64_t floor;
+    _Atomic int owned;
+    _Atomic uint32_t ownerThreadId;
+    char ownerName[64];
+    OMPerfTraceEvent events[OMPerfTraceEventsPerThread];
+} OMPerfTraceBuffer;
+
+static _Atomic int OMPerfTraceState = -1;
+static _Atomic(OMPerfTraceBuffer *) OMPerfTraceBuffers = NULL;
+static _Atomic uint32_t OMPerfTraceNextThreadId = 1;
+static pthread_key_t OMPerfTraceBufferKey;
+static pthread_once_t OMPerfTraceBufferKeyOnce = PTHREAD_ONCE_INIT;
+
+static BOOL OMPerfTraceFlagValue(NSString *value)
+{
+    NSString *lower = [[value stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]] lowercaseString];
+    return [lower isEqualToString:@"1"] ||
+           [lower isEqualToString:@"true"] ||
+           [lower isEqualToString:@"yes"] ||
+           [lower isEqualToString:@"on"];
+}
+
+static NSString *OMPerfTraceExitFilePath(void)
+{
+    NSString *path = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_TRACE_FILE"];
+    return [path length] > 0 ? [path stringByExpandingTildeInPath] : nil;
+}
+
+static void OMPerfTraceWriteExitFile(void)
+{
+    @autoreleasepool {
+        NSString *path = OMPerfTraceExitFilePath();
+        NSError *error = nil;
+        if (path != nil && !OMPerfTraceWriteChromeJSON(path, &error)) {
+            NSLog(@"[Perf][Trace] unable to write %@: %@", path, [error localizedDescription]);
+        }
+    }
+}
+
+static int OMPerfTraceResolveState(void)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        @autoreleasepool {
+            NSString *flag = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_TRACE"];
+            BOOL writesOnExit = (OMPerfTraceExitFilePath() != nil);
+            BOOL enabled = ([flag length] > 0 ? OMPerfTraceFlagValue(flag) : writesOnExit);
+            int expected = -1;
+            // An explicit OMPerfTraceSetEnabled() before the first check wins.
+            atomic_compare_exchange_strong(&OMPerfTraceState, &expected, enabled ? 1 : 0);
+            if (writesOnExit) {
+                atexit(OMPerfTraceWriteExitFile);
+            }
+        }
+    });
+    return atomic_load_explicit(&OMPerfTraceState, memory_order_relaxed);
+}
+
+BOOL OMPerfTraceIsEnabled(void)
+{
+    int state = atomic_load_explicit(&OMPerfTraceState, memory_order_relaxed);
+    if (state < 0) {
+        state = OMPerfTraceResolveState();
+    }
+    return state == 1;
+}
+
+void OMPerfTraceSetEnabled(BOOL enabled)
+{
+    atomic_store(&OMPerfTraceState, enabled ? 1 : 0);
+}
+
+uint64_t OMPerfTraceNowMicros(void)
+{
+#if defined(_WIN32)
+    static LARGE_INTEGER frequency;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        QueryPerformanceFrequency(&frequency);
+    });
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((counter.QuadPart / frequency.QuadPart) * 1000000ULL +
+                      ((counter.QuadPart % frequency.QuadPart) * 1000000ULL) / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_nsec / 1000ULL;
+#endif
+}
+
+static void OMPerfTraceReleaseBuffer(void *value)
+{
+    OMPerfTraceBuffer *buffer = (OMPerfTraceBuffer *)value;
+    if (buffer != NULL) {
+        atomic_store_explicit(&buffer->owned, 0, memory_order_release);
+    }
+}
+
+static void OMPerfTraceCreateBufferKey(void)
+{
+    pthread_key_create(&OMPerfTraceBufferKey, OMPerfTraceReleaseBuffer);
+}
+
+static void OMPerfTraceNameBuffer(OMPerfTraceBuffer *buffer)
+{
+    @autoreleasepool {
+        NSString *name = nil;
+        if ([NSThread isMainThread]) {
+            name = @"main";
+        } else {
+            name = [[NSThread currentThread] name];
+        }
+        if ([name length] == 0) {
+            const char *label = dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL);
+            name = (label != NULL && label[0] != '\0') ? [NSString stringWithUTF8String:label] : nil;
+        }
+        if ([name length] == 0) {
+            name = [NSString stringWithFormat:@"thread-%u", (unsigned)buffer->ownerThreadId];
+        }
+        const char *utf8 = [name UTF8String];
+        strncpy(buffer->ownerName, utf8 != NULL ? utf8 : "", sizeof(buffer->ownerName) - 1);
+        buffer->ownerName[sizeof(buffer->ownerName) - 1] = '\0';
+    }
+}
+
+static OMPerfTraceBuffer *OMPerfTraceCurrentBuffer(void)
+{
+    pthread_once(&OMPerfTraceBufferKeyOnce, OMPerfTraceCreateBufferKey);
+    OMPerfTraceBuffer *buffer = (OMPerfTraceBuffer *)pthread_getspecific(OMPerfTraceBufferKey);
+    if (buffer != NULL) {
+        return buffer;
+    }
+
+    OMPerfTraceBuffer *candidate = atomic_load_explicit(&OMPerfTraceBuffers, memory_order_acquire);
+    for (; candidate != NULL; candidate = candidate->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&candidate->owned, &expected, 1)) {
+            buffer = candidate;
+            break;
+        }
+    }
+    if (buffer == NULL) {
+        buffer = (OMPerfTraceBuffer *)calloc(1, sizeof(OMPerfTraceBuffer));
+        if (buffer == NULL) {
+            return NULL;
+        }
+        atomic_init(&buffer->owned, 1);
+        OMPerfTraceBuffer *head = atomic_load_explicit(&OMPerfTraceBuffers, memory_order_relaxed);
+        do {
+            buffer->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&OMPerfTraceBuffers,
+                                                        &head,
+                                                        buffer,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+    }
+
+    atomic_store(&buffer->ownerThreadId, atomic_fetch_add(&OMPerfTraceNextThreadId, 1));
+    OMPerfTraceNameBuffer(buffer);
+    pthread_setspecific(OMPerfTraceBufferKey, buffer);
+    return buffer;
+}
+
+static void OMPerfTraceAppend(OMPerfTraceEventKind kind,
+                              const char *category,
+                              const char *name,
+                              uint64_t timestamp,
+                              uint64_t duration,
+                              int64_t value)
+{
+    OMPerfTraceBuffer *buffer = OMPerfTraceCurrentBuffer();
+    if (buffer == NULL) {
+        return;
+    }
+    uint64_t index = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    OMPerfTraceEvent *event = &buffer->events[index % OMPerfTraceEventsPerThread];
+    event->category = category;
+    event->name = name;
+    event->timestamp = timestamp;
+    event->duration = duration;
+    event->value = value;
+    event->kind = (uint32_t)kind;
+    event->threadId = atomic_load_explicit(&buffer->ownerThreadId, memory_order_relaxed);
+    atomic_store_explicit(&buffer->head, index + 1, memory_order_release);
+}
+
+OMPerfTraceSpan OMPerfTraceBegin(const char *category, const char *name)
+{
+    OMPerfTraceSpan span = { NULL, NULL, 0 };
+    if (!OMPerfTraceIsEnabled()) {
+        return span;
+    }
+    span.category = category;
+    span.name = name;
+    span.startMicros = OMPerfTraceNowMicros();
+    return span;
+}
+
+void OMPerfTraceEnd(OMPerfTraceSpan span)
+{
+    if (span.name == NULL) {
+        return;
+    }
+    OMPerfTraceRecordSpan(span.category, span.name, span.startMicros, OMPerfTraceNowMicros());
+}
+
+void OMPerfTraceEndScope(OMPerfTraceSpan *span)
+{
+    if (span != NULL) {
+        OMPerfTraceEnd(*span);
+    }
+}
+
+void OMPerfTraceRecordSpan(const char *category, const char *name, uint64_t startMicros, uint64_t endMicros)
+{
+    if (name == NULL || !OMPerfTraceIsEnabled()) {
+        return;
+    }
+    OMPerfTraceAppend(OMPerfTraceEventKindSpan,
+                      category,
+                      name,
+                      startMicros,
+                      endMicros > startMicros ? endMicros - startMicros : 0,
+                      0);
+}
+
+void OMPerfTraceCounter(const char *category, const char *name, int64_t value)
+{
+    if (name == NULL || !OMPerfTraceIsEnabled()) {
+        return;
+    }
+    OMPerfTraceAppend(OMPerfTraceEventKindCounter, category, name, OMPerfTraceNowMicros(), 0, value);
+}
+
+void OMPerfTraceReset(void)
+{
+    OMPerfTraceBuffer *buffer = atomic_load_explicit(&OMPerfTraceBuffers, memory_order_acquire);
+    for (; buffer != NULL; buffer = buffer->next) {
+        atomic_store(&buffer->floor, atomic_load_explicit(&buffer->head, memory_order_acquire));
+    }
+}
+
+static void OMPerfTraceAppendJSONString(NSMutableString *json, const char *value)
+{
+    [json appendString:@"\""];
+    const unsigned char *cursor = (const unsigned char *)(value != NULL ? value : "");
+    for (; *cursor != '\0'; cursor++) {
+        unsigned char character = *cursor;
+        if (character == '"' || character == '\\') {
+            [json appendFormat:@"\\%c", character];
+        } else if (character < 0x20) {
+            [json appendFormat:@"\\u%04x", (unsigned)character];
+        } else if (character < 0x80) {
+            [json appendFormat:@"%c", character];
+        } else {
+            // Multi-byte UTF-8: hand the whole sequence to NSString.
+            const unsigned char *start = cursor;
+            while (cursor[1] != '\0' && (cursor[1] & 0xC0) == 0x80) {
+                cursor++;
+            }
+            NSString *sequence = [[NSString alloc] initWithBytes:start
+                                                          length:(NSUInteger)(cursor - start + 1)
+                                                        encoding:NSUTF8StringEncoding];
+            if (sequence != nil) {
+                [json appendString:sequence];
+                [sequence release];
+            }
+        }
+    }
+    [json appendString:@"\""];
+}
+
+NSData *OMPerfTraceChromeJSONData(void)
+{
+    int pid = (int)[[NSProcessInfo processInfo] processIdentifier];
+    NSMutableString *json = [NSMutableString stringWithString:@"{\"displayTimeUnit\":\"ms\",\"traceEvents\":["];
+    [json appendFormat:@"{\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"name\":\"process_name\",\"args\":{\"name\":", pid];
+    OMPerfTraceAppendJSONString(json, [[[NSProcessInfo processInfo] processName] UTF8String]);
+    [json appendString:@"}}"];
+
+    OMPerfTraceEvent *copy = (OMPerfTraceEvent *)malloc(sizeof(OMPerfTraceEvent) * OMPerfTraceEventsPerThread);
+    if (copy == NULL) {
+        return nil;
+    }
+    OMPerfTraceBuffer *buffer = atomic_load_explicit(&OMPerfTraceBuffers, memory_order_acquire);
+    for (; buffer != NULL; buffer = buffer->next) {
+        uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t floor = atomic_load(&buffer->floor);
+        uint64_t first = head > OMPerfTraceEventsPerThread ? head - OMPerfTraceEventsPerThread : 0;
+        if (first < floor) {
+            first = floor;
+        }
+        uint64_t index = first;
+        for (; index < head; index++) {
+            copy[index - first] = buffer->events[index % OMPerfTraceEventsPerThread];
+        }
+        // The owner may have lapped the oldest slots while they were copied;
+        // anything it could have overwritten is dropped.
+        uint64_t headAfter = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t safeFirst = headAfter >= OMPerfTraceEventsPerThread ? headAfter - OMPerfTraceEventsPerThread + 1 : 0;
+        uint64_t emitFirst = first > safeFirst ? first : safeFirst;
+
+        if (atomic_load(&buffer->owned)) {
+            [json appendFormat:@",{\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":",
+                               pid,
+                               (unsigned)atomic_load(&buffer->ownerThreadId)];
+            OMPerfTraceAppendJSONString(json, buffer->ownerName);
+            [json appendString:@"}}"];
+        }
+
+        for (index = emitFirst; index < head; index++) {
+            const OMPerfTraceEvent *event = &copy[index - first];
+            if (event->name == NULL) {
+                continue;
+            }
+            [json appendString:(event->kind == OMPerfTraceEventKindCounter ? @",{\"ph\":\"C\",\"name\":" : @",{\"ph\":\"X\",\"name\":")];
+            OMPerfTraceAppendJSONString(json, event->name);
+            [json appendString:@",\"cat\":"];
+            OMPerfTraceAppendJSONString(json, event->category != NULL ? event->category : "default");
+            [json appendFormat:@",\"pid\":%d,\"tid\":%u,\"ts\":%llu",
+                               pid,
+                               (unsigned)event->threadId,
+                               (unsigned long long)event->timestamp];
+            if (event->kind == OMPerfTraceEventKindCounter) {
+                [json appendFormat:@",\"args\":{\"value\":%lld}}", (long long)event->value];
+            } else {
+                [json appendFormat:@",\"dur\":%llu}", (unsigned long long)event->duration];
+            }
+        }
+    }
+    free(copy);
+
+    [json appendString:@"]}"];
+    return [json dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+BOOL OMPerfTraceWriteChromeJSON(NSString *path, NSError **error)
+{
+    if ([path length] == 0) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain
+                                         code:NSFileWriteInvalidFileNameError
+                                     userInfo:[NSDictionary dictionaryWithObject:@"No trace file path was given."
+                                                                          forKey:NSLocalizedDescriptionKey]];
+        }
+        return NO;
+    }
+    NSData *data = OMPerfTraceChromeJSONData();
+    if (data == nil) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain
+                                         code:NSFileWriteOutOfSpaceError
+                                     userInfo:[NSDictionary dictionaryWithObject:@"Unable to allocate the trace export."
+                                                                          forKey:NSLocalizedDescriptionKey]];
+        }
+        return NO;
+    }
+    return [data writeToFile:path options:NSDataWritingAtomic error:error];
+}
@@ -0,0 +1,494 @@
+// ObjcMarkdownBench
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+// Headless batch renderer: renders every Markdown file under the given paths
+// through OMMarkdownRenderer and prints parse/render timings, allocation
+// counts and output sizes as JSON, so runs can be diffed and gated.
+
+#import <Foundation/Foundation.h>
+#import <AppKit/AppKit.h>
+#if defined(GNUSTEP)
+#import <Foundation/NSDebug.h>
+#endif
+
+#import "OMMarkdownParsingOptions.h"
+#import "OMMarkdownRenderer.h"
+#import "OMTheme.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    NSUInteger iterations;
+    NSUInteger warmupIterations;
+    BOOL countAllocations;
+    CGFloat zoomScale;
+    CGFloat layoutWidth;
+    NSString *themePath;
+    NSString *outputPath;
+} OMBSettings;
+
+static NSTimeInterval OMBNow(void)
+{
+    return [NSDate timeIntervalSinceReferenceDate];
+}
+
+static void OMBPrintUsage(void)
+{
+    fprintf(stderr,
+            "usage: omd-render-bench [options] <file-or-directory>...\n"
+            "\n"
+            "  --iterations N          timed renders per file (default 5)\n"
+            "  --warmup N              untimed renders per file first (default 1)\n"
+            "  --math MODE             disabled | styled | external (default styled)\n"
+            "  --no-images             do not load images\n"
+            "  --remote-images         allow remote images\n"
+            "  --no-code-highlighting  disable code syntax highlighting\n"
+            "  --zoom SCALE            zoom scale (default 1.0)\n"
+            "  --width POINTS          layout width (default 800)\n"
+            "  --theme PATH            TOML theme instead of the default theme\n"
+            "  --allocations           count object allocations of one extra run\n"
+            "  --output PATH           write the JSON report to PATH\n");
+}
+
+static BOOL OMBIsMarkdownPath(NSString *path)
+{
+    NSString *extension = [[path pathExtension] lowercaseString];
+    return [extension isEqualToString:@"md"] ||
+           [extension isEqualToString:@"markdown"] ||
+           [extension isEqualToString:@"mdown"];
+}
+
+static NSArray *OMBMarkdownFilesAtPaths(NSArray *paths)
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableArray *files = [NSMutableArray array];
+    for (NSString *path in paths) {
+        BOOL isDirectory = NO;
+        if (![fileManager fileExistsAtPath:path isDirectory:&isDirectory]) {
+            fprintf(stderr, "omd-render-bench: no such file or directory: %s\n", [path UTF8String]);
+            continue;
+        }
+        if (!isDirectory) {
+            [files addObject:path];
+            continue;
+        }
+
+        NSMutableArray *found = [NSMutableArray array];
+        NSDirectoryEnumerator *enumerator = [fileManager enumeratorAtPath:path];
+        NSString *relativePath = nil;
+        while ((relativePath = [enumerator nextObject]) != nil) {
+            if (OMBIsMarkdownPath(relativePath)) {
+                [found addObject:[path stringByAppendingPathComponent:relativePath]];
+            }
+        }
+        [found sortUsingSelector:@selector(compare:)];
+        [files addObjectsFromArray:found];
+    }
+    return files;
+}
+
+#if defined(GNUSTEP)
+static unsigned long long OMBAllocationTotal(void)
+{
+    unsigned long long total = 0;
+    Class *classes = GSDebugAllocationClassList();
+    if (classes == NULL) {
+        return 0;
+    }
+    NSUInteger index = 0;
+    for (; classes[index] != NULL; index++) {
+        total += (unsigned long long)GSDebugAllocationTotal(classes[index]);
+    }
+    NSZoneFree(NSDefaultMallocZone(), classes);
+    return total;
+}
+#endif
+
+static double OMBPercentile(NSArray *sortedSamples, double percentile)
+{
+    NSUInteger count = [sortedSamples count];
+    if (count == 0) {
+        return 0.0;
+    }
+    // Nearest-rank, so every reported value is an observed sample.
+    NSUInteger rank = (NSUInteger)ceil((percentile / 100.0) * (double)count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return [[sortedSamples objectAtIndex:rank - 1] doubleValue];
+}
+
+static NSNumber *OMBRounded(double value)
+{
+    return [NSNumber numberWithDouble:round(value * 1000.0) / 1000.0];
+}
+
+static NSDictionary *OMBStatistics(NSArray *samples)
+{
+    NSArray *sorted = [samples sortedArrayUsingSelector:@selector(compare:)];
+    NSUInteger count = [sorted count];
+    double sum = 0.0;
+    for (NSNumber *sample in sorted) {
+        sum += [sample doubleValue];
+    }
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedInteger:count], @"count",
+            OMBRounded(count > 0 ? [[sorted objectAtIndex:0] doubleValue] : 0.0), @"min",
+            OMBRounded(OMBPercentile(sorted, 50.0)), @"p50",
+            OMBRounded(OMBPercentile(sorted, 90.0)), @"p90",
+            OMBRounded(OMBPercentile(sorted, 99.0)), @"p99",
+            OMBRounded(count > 0 ? [[sorted lastObject] doubleValue] : 0.0), @"max",
+            OMBRounded(count > 0 ? sum / (double)count : 0.0), @"mean",
+            nil];
+}
+
+static NSUInteger OMBAttributeRunCount(NSAttributedString *output, NSUInteger *attachmentCountOut)
+{
+    NSUInteger runs = 0;
+    NSUInteger attachments = 0;
+    NSUInteger length = [output length];
+    NSUInteger location = 0;
+    while (location < length) {
+        NSRange effectiveRange = NSMakeRange(location, 0);
+        NSDictionary *attributes = [output attributesAtIndex:location effectiveRange:&effectiveRange];
+        if ([attributes objectForKey:NSAttachmentAttributeName] != nil) {
+            attachments += 1;
+        }
+        runs += 1;
+        location = NSMaxRange(effectiveRange) > location ? NSMaxRange(effectiveRange) : location + 1;
+    }
+    if (attachmentCountOut != NULL) {
+        *attachmentCountOut = attachments;
+    }
+    return runs;
+}
+
+static OMMarkdownRenderer *OMBNewRenderer(OMTheme *theme,
+                                          OMMarkdownParsingOptions *options,
+                                          const OMBSettings *settings)
+{
+    OMMarkdownRenderer *renderer = [[OMMarkdownRenderer alloc] initWithTheme:theme parsingOptions:options];
+    [renderer setZoomScale:settings->zoomScale];
+    [renderer setLayoutWidth:settings->layoutWidth];
+    // Math must finish inside the timed call to be measured.
+    [renderer setAsynchronousMathGenerationEnabled:NO];
+    return renderer;
+}
+
+// Parse is timed on a private snapshot; render is timed after the shared
+// snapshot for the same revision is in place, so it excludes parsing.
+static NSAttributedString *OMBRenderOnce(OMMarkdownRenderer *renderer,
+                                         NSString *markdown,
+                                         NSUInteger cmarkOptions,
+                                         double *parseMsOut,
+                                         double *renderMsOut)
+{
+    NSTimeInterval parseStart = OMBNow();
+    OMMarkdownDocumentSnapshot *snapshot = [[OMMarkdownDocumentSnapshot alloc] initWithMarkdown:markdown
+                                                                                  cmarkOptions:cmarkOptions];
+    NSTimeInterval parseEnd = OMBNow();
+    [snapshot release];
+
+    [OMMarkdownDocumentSnapshot snapshotForMarkdown:markdown cmarkOptions:cmarkOptions];
+    NSTimeInterval renderStart = OMBNow();
+    NSAttributedString *output = [renderer attributedStringFromMarkdown:markdown];
+    NSTimeInterval renderEnd = OMBNow();
+
+    if (parseMsOut != NULL) {
+        *parseMsOut = (parseEnd - parseStart) * 1000.0;
+    }
+    if (renderMsOut != NULL) {
+        *renderMsOut = (renderEnd - renderStart) * 1000.0;
+    }
+    return output;
+}
+
+static NSDictionary *OMBBenchmarkFile(NSString *path,
+                                      OMTheme *theme,
+                                      OMMarkdownParsingOptions *options,
+                                      const OMBSettings *settings)
+{
+    NSError *error = nil;
+    NSString *markdown = [NSString stringWithContentsOfFile:path encoding:NSUTF8StringEncoding error:&error];
+    if (markdown == nil) {
+        NSString *message = error != nil ? [error localizedDescription] : @"unreadable";
+        return [NSDictionary dictionaryWithObjectsAndKeys:path, @"path", message, @"error", nil];
+    }
+
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
+    [result setObject:path forKey:@"path"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:[markdown length]] forKey:@"inputLength"];
+
+    OMMarkdownParsingOptions *fileOptions = [[options copy] autorelease];
+    [fileOptions setBaseURL:[NSURL fileURLWithPath:[path stringByDeletingLastPathComponent]]];
+    OMMarkdownRenderer *renderer = OMBNewRenderer(theme, fileOptions, settings);
+    NSUInteger cmarkOptions = [fileOptions cmarkOptions];
+
+    NSUInteger iteration = 0;
+    for (; iteration < settings->warmupIterations; iteration++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        OMBRenderOnce(renderer, markdown, cmarkOptions, NULL, NULL);
+        [pool release];
+    }
+
+    NSMutableArray *parseSamples = [NSMutableArray array];
+    NSMutableArray *renderSamples = [NSMutableArray array];
+    NSUInteger outputLength = 0;
+    NSUInteger attributeRuns = 0;
+    NSUInteger attachments = 0;
+    for (iteration = 0; iteration < settings->iterations; iteration++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        double parseMs = 0.0;
+        double renderMs = 0.0;
+        NSAttributedString *output = OMBRenderOnce(renderer, markdown, cmarkOptions, &parseMs, &renderMs);
+        [parseSamples addObject:[NSNumber numberWithDouble:parseMs]];
+        [renderSamples addObject:[NSNumber numberWithDouble:renderMs]];
+        if (iteration == 0) {
+            outputLength = [output length];
+            attributeRuns = OMBAttributeRunCount(output, &attachments);
+        }
+        [pool release];
+    }
+
+    [result setObject:parseSamples forKey:@"parseSamplesMs"];
+    [result setObject:renderSamples forKey:@"renderSamplesMs"];
+    [result setObject:OMBStatistics(parseSamples) forKey:@"parseMs"];
+    [result setObject:OMBStatistics(renderSamples) forKey:@"renderMs"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:outputLength] forKey:@"outputLength"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:attributeRuns] forKey:@"attributeRuns"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:attachments] forKey:@"attachments"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:[[renderer codeBlockRanges] count]] forKey:@"codeBlocks"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:[[renderer blockAnchors] count]] forKey:@"blockAnchors"];
+
+#if defined(GNUSTEP)
+    if (settings->countAllocations) {
+        // Tracking slows allocation down, so it runs outside the timed loop.
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        GSDebugAllocationActive(YES);
+        unsigned long long before = OMBAllocationTotal();
+        OMMarkdownDocumentSnapshot *snapshot = [[OMMarkdownDocumentSnapshot alloc] initWithMarkdown:markdown
+                                                                                      cmarkOptions:cmarkOptions];
+        unsigned long long afterParse = OMBAllocationTotal();
+        [snapshot release];
+        [OMMarkdownDocumentSnapshot snapshotForMarkdown:markdown cmarkOptions:cmarkOptions];
+        unsigned long long beforeRender = OMBAllocationTotal();
+        [renderer attributedStringFromMarkdown:markdown];
+        unsigned long long afterRender = OMBAllocationTotal();
+        GSDebugAllocationActive(NO);
+        [pool release];
+
+        NSDictionary *allocations = [NSDictionary dictionaryWithObjectsAndKeys:
+                                     [NSNumber numberWithUnsignedLongLong:afterParse - before], @"parse",
+                                     [NSNumber numberWithUnsignedLongLong:afterRender - beforeRender], @"render",
+                                     nil];
+        [result setObject:allocations forKey:@"allocations"];
+    }
+#endif
+
+    [renderer release];
+    return result;
+}
+
+static NSString *OMBMathPolicyName(OMMarkdownMathRenderingPolicy policy)
+{
+    switch (policy) {
+        case OMMarkdownMathRenderingPolicyDisabled:
+            return @"disabled";
+        case OMMarkdownMathRenderingPolicyExternalTools:
+            return @"external";
+        case OMMarkdownMathRenderingPolicyStyledText:
+        default:
+            return @"styled";
+    }
+}
+
+static BOOL OMBParseArguments(NSArray *arguments,
+                              OMBSettings *settings,
+                              OMMarkdownParsingOptions *options,
+                              NSMutableArray *paths)
+{
+    NSUInteger count = [arguments count];
+    NSUInteger index = 1;
+    for (; index < count; index++) {
+        NSString *argument = [arguments objectAtIndex:index];
+        NSString *value = (index + 1 < count) ? [arguments objectAtIndex:index + 1] : nil;
+        if ([argument isEqualToString:@"--help"] || [argument isEqualToString:@"-h"]) {
+            return NO;
+        } else if ([argument isEqualToString:@"--no-images"]) {
+            [options setRenderImages:NO];
+        } else if ([argument isEqualToString:@"--remote-images"]) {
+            [options setAllowRemoteImages:YES];
+        } else if ([argument isEqualToString:@"--no-code-highlighting"]) {
+            [options setCodeSyntaxHighlightingEnabled:NO];
+        } else if ([argument isEqualToString:@"--allocations"]) {
+            settings->countAllocations = YES;
+        } else if ([argument hasPrefix:@"--"]) {
+            if (value == nil) {
+                fprintf(stderr, "omd-render-bench: %s needs a value\n", [argument UTF8String]);
+                return NO;
+            }
+            index += 1;
+            if ([argument isEqualToString:@"--iterations"]) {
+                settings->iterations = (NSUInteger)MAX(1, [value integerValue]);
+            } else if ([argument isEqualToString:@"--warmup"]) {
+                settings->warmupIterations = (NSUInteger)MAX(0, [value integerValue]);
+            } else if ([argument isEqualToString:@"--zoom"]) {
+                settings->zoomScale = (CGFloat)[value doubleValue];
+            } else if ([argument isEqualToString:@"--width"]) {
+                settings->layoutWidth = (CGFloat)[value doubleValue];
+            } else if ([argument isEqualToString:@"--theme"]) {
+                settings->themePath = value;
+            } else if ([argument isEqualToString:@"--output"]) {
+                settings->outputPath = value;
+            } else if ([argument isEqualToString:@"--math"]) {
+                NSString *mode = [value lowercaseString];
+                if ([mode isEqualToString:@"disabled"]) {
+                    [options setMathRenderingPolicy:OMMarkdownMathRenderingPolicyDisabled];
+                } else if ([mode isEqualToString:@"styled"]) {
+                    [options setMathRenderingPolicy:OMMarkdownMathRenderingPolicyStyledText];
+                } else if ([mode isEqualToString:@"external"]) {
+                    [options setMathRenderingPolicy:OMMarkdownMathRenderingPolicyExternalTools];
+                } else {
+                    fprintf(stderr, "omd-render-bench: unknown math mode %s\n", [value UTF8String]);
+                    return NO;
+                }
+            } else {
+                fprintf(stderr, "omd-render-bench: unknown option %s\n", [argument UTF8String]);
+                return NO;
+            }
+        } else {
+            [paths addObject:argument];
+        }
+    }
+    return [paths count] > 0;
+}
+
+int main(int argc, const char *argv[])
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    // Fonts and text measurement need the GUI backend even without windows.
+    [NSApplication sharedApplication];
+
+    OMBSettings settings;
+    settings.iterations = 5;
+    settings.warmupIterations = 1;
+    settings.countAllocations = NO;
+    settings.zoomScale = 1.0;
+    settings.layoutWidth = 800.0;
+    settings.themePath = nil;
+    settings.outputPath = nil;
+    OMMarkdownParsingOptions *options = [OMMarkdownParsingOptions defaultOptions];
+    NSMutableArray *paths = [NSMutableArray array];
+    if (!OMBParseArguments([[NSProcessInfo processInfo] arguments], &settings, options, paths)) {
+        OMBPrintUsage();
+        [pool release];
+        return 2;
+    }
+
+    OMTheme *theme = [OMTheme defaultTheme];
+    if (settings.themePath != nil) {
+        NSError *error = nil;
+        theme = [OMTheme themeWithContentsOfFile:settings.themePath error:&error];
+        if (theme == nil) {
+            fprintf(stderr, "omd-render-bench: could not load theme %s: %s\n",
+                    [settings.themePath UTF8String],
+                    [[error localizedDescription] UTF8String]);
+            [pool release];
+            return 1;
+        }
+    }
+
+    NSArray *files = OMBMarkdownFilesAtPaths(paths);
+    if ([files count] == 0) {
+        fprintf(stderr, "omd-render-bench: no Markdown files found\n");
+        [pool release];
+        return 1;
+    }
+
+    NSMutableArray *fileResults = [NSMutableArray array];
+    NSMutableArray *allParseSamples = [NSMutableArray array];
+    NSMutableArray *allRenderSamples = [NSMutableArray array];
+    unsigned long long totalInput = 0;
+    unsigned long long totalOutput = 0;
+    unsigned long long totalParseAllocations = 0;
+    unsigned long long totalRenderAllocations = 0;
+    BOOL failed = NO;
+    NSTimeInterval runStart = OMBNow();
+    for (NSString *file in files) {
+        NSAutoreleasePool *filePool = [[NSAutoreleasePool alloc] init];
+        NSDictionary *result = OMBBenchmarkFile(file, theme, options, &settings);
+        [fileResults addObject:result];
+        if ([result objectForKey:@"error"] != nil) {
+            failed = YES;
+        } else {
+            [allParseSamples addObjectsFromArray:[result objectForKey:@"parseSamplesMs"]];
+            [allRenderSamples addObjectsFromArray:[result objectForKey:@"renderSamplesMs"]];
+            totalInput += [[result objectForKey:@"inputLength"] unsignedLongLongValue];
+            totalOutput += [[result objectForKey:@"outputLength"] unsignedLongLongValue];
+            NSDictionary *allocations = [result objectForKey:@"allocations"];
+            totalParseAllocations += [[allocations objectForKey:@"parse"] unsignedLongLongValue];
+            totalRenderAllocations += [[allocations objectForKey:@"render"] unsignedLongLongValue];
+        }
+        [filePool release];
+    }
+
+    NSMutableDictionary *summary = [NSMutableDictionary dictionary];
+    [summary setObject:[NSNumber numberWithUnsignedInteger:[files count]] forKey:@"files"];
+    [summary setObject:OMBStatistics(allParseSamples) forKey:@"parseMs"];
+    [summary setObject:OMBStatistics(allRenderSamples) forKey:@"renderMs"];
+    [summary setObject:[NSNumber numberWithUnsignedLongLong:totalInput] forKey:@"inputLength"];
+    [summary setObject:[NSNumber numberWithUnsignedLongLong:totalOutput] forKey:@"outputLength"];
+    [summary setObject:OMBRounded((OMBNow() - runStart) * 1000.0) forKey:@"wallMs"];
+    if (settings.countAllocations) {
+        [summary setObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                            [NSNumber numberWithUnsignedLongLong:totalParseAllocations], @"parse",
+                            [NSNumber numberWithUnsignedLongLong:totalRenderAllocations], @"render",
+                            nil]
+                    forKey:@"allocations"];
+    }
+
+    NSDictionary *settingsReport = [NSDictionary dictionaryWithObjectsAndKeys:
+                                    [NSNumber numberWithUnsignedInteger:settings.iterations], @"iterations",
+                                    [NSNumber numberWithUnsignedInteger:settings.warmupIterations], @"warmup",
+                                    OMBMathPolicyName([options mathRenderingPolicy]), @"math",
+                                    [NSNumber numberWithBool:[options renderImages]], @"images",
+                                    [NSNumber numberWithBool:[options allowRemoteImages]], @"remoteImages",
+                                    [NSNumber numberWithBool:[options codeSyntaxHighlightingEnabled]], @"codeHighlighting",
+                                    [NSNumber numberWithDouble:settings.zoomScale], @"zoom",
+                                    [NSNumber numberWithDouble:settings.layoutWidth], @"layoutWidth",
+                                    [NSNumber numberWithBool:[OMMarkdownRenderer isTreeSitterAvailable]], @"treeSitter",
+                                    nil];
+    NSDictionary *report = [NSDictionary dictionaryWithObjectsAndKeys:
+                            @"omd-render-bench", @"tool",
+                            [NSNumber numberWithInteger:1], @"formatVersion",
+                            settingsReport, @"settings",
+                            summary, @"summary",
+                            fileResults, @"files",
+                            nil];
+
+    NSError *error = nil;
+    NSData *json = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:&error];
+    if (json == nil) {
+        fprintf(stderr, "omd-render-bench: could not encode report: %s\n", [[error localizedDescription] UTF8String]);
+        [pool release];
+        return 1;
+    }
+    if (settings.outputPath != nil) {
+        if (![json writeToFile:settings.outputPath atomically:YES]) {
+            fprintf(stderr, "omd-render-bench: could not write %s\n", [settings.outputPath UTF8String]);
+            [pool release];
+            return 1;
+        }
+    } else {
+        fwrite([json bytes], 1, [json length], stdout);
+        fputc('\n', stdout);
+    }
+
+    [pool release];
+    return failed ? 1 : 0;
+}
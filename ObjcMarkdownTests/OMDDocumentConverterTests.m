@@ -3,6 +3,8 @@
 
 #import <XCTest/XCTest.h>
 #import "OMDDocumentConverter.h"
+#import "OMDConversionCache.h"
+#import "OMDPandocConverter.h"
 
 @interface OMDDocumentConverterTests : XCTestCase
 @end
@@ -113,4 +115,116 @@
     }
 }
 
+- (void)testConversionCacheKeysOnContentVersionAndFormat
+{
+    NSData *source = [@"# Same bytes" dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *edited = [@"# Same bytes!" dataUsingEncoding:NSUTF8StringEncoding];
+    NSString *key = [OMDConversionCache keyForSourceData:source backendVersion:@"pandoc 3.1" targetFormat:@"docx"];
+
+    XCTAssertEqualObjects(key, [OMDConversionCache keyForSourceData:[[source copy] autorelease]
+                                                     backendVersion:@"pandoc 3.1"
+                                                       targetFormat:@"docx"]);
+    XCTAssertNotEqualObjects(key, [OMDConversionCache keyForSourceData:edited backendVersion:@"pandoc 3.1" targetFormat:@"docx"]);
+    XCTAssertNotEqualObjects(key, [OMDConversionCache keyForSourceData:source backendVersion:@"pandoc 3.2" targetFormat:@"docx"]);
+    XCTAssertNotEqualObjects(key, [OMDConversionCache keyForSourceData:source backendVersion:@"pandoc 3.1" targetFormat:@"odt"]);
+}
+
+- (void)testConversionCacheEvictsLeastRecentlyUsedEntries
+{
+    NSString *directory = [self temporaryPathWithExtension:@"cache"];
+    OMDConversionCache *cache = [[[OMDConversionCache alloc] initWithDirectory:directory byteLimit:4096] autorelease];
+    NSMutableData *payload = [NSMutableData dataWithLength:1500];
+
+    [cache storeData:payload forKey:@"first"];
+    [cache storeData:payload forKey:@"second"];
+    // Reading refreshes the entry, so the untouched one goes first.
+    NSDictionary *aged = [NSDictionary dictionaryWithObject:[NSDate dateWithTimeIntervalSinceNow:-60]
+                                                     forKey:NSFileModificationDate];
+    [[NSFileManager defaultManager] setAttributes:aged
+                                     ofItemAtPath:[cache pathForKey:@"second"]
+                                            error:NULL];
+    [[NSFileManager defaultManager] setAttributes:aged
+                                     ofItemAtPath:[cache pathForKey:@"first"]
+                                            error:NULL];
+    XCTAssertNotNil([cache dataForKey:@"first"]);
+    [cache storeData:payload forKey:@"third"];
+
+    XCTAssertNotNil([cache dataForKey:@"first"]);
+    XCTAssertNil([cache dataForKey:@"second"]);
+    XCTAssertNotNil([cache dataForKey:@"third"]);
+
+    [self removeFileIfPresent:directory];
+}
+
+- (void)testConversionCacheRewritesDoNotCountTowardsTheBudgetTwice
+{
+    NSString *directory = [self temporaryPathWithExtension:@"cache"];
+    OMDConversionCache *cache = [[[OMDConversionCache alloc] initWithDirectory:directory byteLimit:4096] autorelease];
+    NSMutableData *payload = [NSMutableData dataWithLength:1500];
+
+    [cache storeData:payload forKey:@"kept"];
+    NSUInteger index = 0;
+    for (; index < 6; index++) {
+        [cache storeData:payload forKey:@"rewritten"];
+    }
+
+    // Two entries fit the budget however often one of them is replaced.
+    XCTAssertNotNil([cache dataForKey:@"kept"]);
+    XCTAssertNotNil([cache dataForKey:@"rewritten"]);
+
+    [self removeFileIfPresent:directory];
+}
+
+- (void)testExportResourceFingerprintFollowsLocalImages
+{
+    NSString *directory = [self temporaryPathWithExtension:@"assets"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:NULL];
+    NSString *imagePath = [directory stringByAppendingPathComponent:@"figure.png"];
+    [[NSMutableData dataWithLength:16] writeToFile:imagePath atomically:YES];
+    NSString *markdown = @"# Report\n\n![figure](figure.png)\n\n<img src=\"https://example.com/remote.png\">\n";
+
+    NSString *before = OMDPandocLocalResourceFingerprint(markdown, directory);
+    XCTAssertTrue([before rangeOfString:[imagePath stringByStandardizingPath]].location != NSNotFound);
+    XCTAssertTrue([before rangeOfString:@"remote.png"].location == NSNotFound);
+    XCTAssertEqualObjects(before, OMDPandocLocalResourceFingerprint(markdown, directory));
+    // Same text run from elsewhere resolves the image to another file.
+    XCTAssertNotEqualObjects(before, OMDPandocLocalResourceFingerprint(markdown, NSTemporaryDirectory()));
+
+    [[NSMutableData dataWithLength:32] writeToFile:imagePath atomically:YES];
+    XCTAssertNotEqualObjects(before, OMDPandocLocalResourceFingerprint(markdown, directory));
+
+    [self removeFileIfPresent:directory];
+}
+
+- (void)testAsynchronousImportReportsErrorsOnMainQueueAndHonoursCancel
+{
+    OMDDocumentConverter *converter = [[[OMDDocumentConverter alloc] init] autorelease];
+    __block NSError *reported = nil;
+    __block BOOL cancelledCompletionRan = NO;
+
+    OMDConversionTask *cancelled = [converter importFileAtPath:@"/tmp/cancelled.docx"
+                                                    completion:^(NSString *markdown, NSError *error) {
+        cancelledCompletionRan = YES;
+    }];
+    [cancelled cancel];
+    [converter importFileAtPath:@"/tmp/missing.docx" completion:^(NSString *markdown, NSError *error) {
+        XCTAssertTrue([NSThread isMainThread]);
+        XCTAssertNil(markdown);
+        reported = [error retain];
+    }];
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while (reported == nil && [deadline timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.02]];
+    }
+    XCTAssertEqual([reported code], (NSInteger)OMDDocumentConverterErrorBackendUnavailable);
+    XCTAssertFalse(cancelledCompletionRan);
+    XCTAssertTrue([cancelled isCancelled]);
+    XCTAssertTrue([OMDDocumentConverter conversionWorkerCount] >= 1);
+    [reported release];
+}
+
 @end
@@ -0,0 +1,160 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <XCTest/XCTest.h>
+#import <Foundation/Foundation.h>
+
+#import "OMDFileWatcher.h"
+
+@interface OMDFileWatcherTests : XCTestCase
+@end
+
+@implementation OMDFileWatcherTests
+
+- (NSString *)temporaryDirectory
+{
+    NSString *name = [NSString stringWithFormat:@"omd-watch-%@", [[NSProcessInfo processInfo] globallyUniqueString]];
+    NSString *directory = [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:NULL];
+    return directory;
+}
+
+- (void)spinRunLoopForInterval:(NSTimeInterval)interval untilCondition:(BOOL *)condition
+{
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:interval];
+    while ((condition == NULL || !*condition) && [deadline timeIntervalSinceNow] > 0.0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                                 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.02]];
+    }
+}
+
+- (void)testBurstOfWritesIsCoalescedIntoOneCallback
+{
+    if (![OMDFileWatcher isSupported]) {
+        return;
+    }
+
+    NSString *directory = [self temporaryDirectory];
+    NSString *watchedPath = [directory stringByAppendingPathComponent:@"notes.md"];
+    NSString *otherPath = [directory stringByAppendingPathComponent:@"other.md"];
+    [@"# Notes\n" writeToFile:watchedPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+
+    __block NSUInteger callbackCount = 0;
+    __block BOOL sawWatchedPath = NO;
+    __block BOOL sawOtherPath = NO;
+    OMDFileWatcher *watcher = [[OMDFileWatcher alloc] initWithChangeHandler:^(NSSet *changedPaths) {
+        callbackCount += 1;
+        sawWatchedPath = sawWatchedPath || [changedPaths containsObject:watchedPath];
+        sawOtherPath = sawOtherPath || [changedPaths containsObject:otherPath];
+    }];
+    [watcher setCoalescingInterval:0.2];
+    XCTAssertTrue([watcher setWatchedPaths:[NSSet setWithObject:watchedPath]]);
+
+    NSUInteger index = 0;
+    for (; index < 8; index++) {
+        NSString *text = [NSString stringWithFormat:@"# Notes\n\nrevision %lu\n", (unsigned long)index];
+        [text writeToFile:watchedPath atomically:(index % 2 == 0) encoding:NSUTF8StringEncoding error:NULL];
+    }
+    [@"unrelated\n" writeToFile:otherPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+
+    [self spinRunLoopForInterval:3.0 untilCondition:&sawWatchedPath];
+    [self spinRunLoopForInterval:0.5 untilCondition:NULL];
+
+    XCTAssertTrue(sawWatchedPath);
+    XCTAssertFalse(sawOtherPath);
+    XCTAssertEqual(callbackCount, (NSUInteger)1);
+
+    [watcher invalidate];
+    [watcher release];
+    [[NSFileManager defaultManager] removeItemAtPath:directory error:NULL];
+}
+
+- (void)testDeletedDirectoryIsReportedAndWatchedAgainOnceRecreated
+{
+    if (![OMDFileWatcher isSupported]) {
+        return;
+    }
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *directory = [self temporaryDirectory];
+    NSString *watchedPath = [directory stringByAppendingPathComponent:@"notes.md"];
+    [@"# Notes\n" writeToFile:watchedPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+
+    __block BOOL sawWatchedPath = NO;
+    OMDFileWatcher *watcher = [[OMDFileWatcher alloc] initWithChangeHandler:^(NSSet *changedPaths) {
+        sawWatchedPath = sawWatchedPath || [changedPaths containsObject:watchedPath];
+    }];
+    [watcher setCoalescingInterval:0.05];
+    NSSet *paths = [NSSet setWithObject:watchedPath];
+    XCTAssertTrue([watcher setWatchedPaths:paths]);
+
+    XCTAssertTrue([fileManager removeItemAtPath:directory error:NULL]);
+    [self spinRunLoopForInterval:3.0 untilCondition:&sawWatchedPath];
+    XCTAssertTrue(sawWatchedPath);
+    XCTAssertEqual([[watcher watchedPaths] count], (NSUInteger)0);
+    XCTAssertEqualObjects([watcher requestedPaths], paths);
+
+    // Recreated the way a build tool does it; nobody calls
+    // -setWatchedPaths: again.
+    [self spinRunLoopForInterval:0.2 untilCondition:NULL];
+    sawWatchedPath = NO;
+    [fileManager createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:NULL];
+    [@"# Notes\n\nrebuilt\n" writeToFile:watchedPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+    [self spinRunLoopForInterval:3.0 untilCondition:&sawWatchedPath];
+    XCTAssertTrue(sawWatchedPath);
+    XCTAssertEqualObjects([watcher watchedPaths], paths);
+
+    [self spinRunLoopForInterval:0.2 untilCondition:NULL];
+    sawWatchedPath = NO;
+    [@"# Notes\n\nagain\n" writeToFile:watchedPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+    [self spinRunLoopForInterval:3.0 untilCondition:&sawWatchedPath];
+    XCTAssertTrue(sawWatchedPath);
+
+    [watcher invalidate];
+    [watcher release];
+    [fileManager removeItemAtPath:directory error:NULL];
+}
+
+- (void)testMissingDirectoryStaysPendingWhileOthersAreWatched
+{
+    if (![OMDFileWatcher isSupported]) {
+        return;
+    }
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *directory = [self temporaryDirectory];
+    NSString *presentPath = [directory stringByAppendingPathComponent:@"present.md"];
+    NSString *missingDirectory = [directory stringByAppendingPathComponent:@"build/out"];
+    NSString *missingPath = [missingDirectory stringByAppendingPathComponent:@"generated.md"];
+    [@"# Present\n" writeToFile:presentPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+
+    __block BOOL sawPresentPath = NO;
+    __block BOOL sawMissingPath = NO;
+    OMDFileWatcher *watcher = [[OMDFileWatcher alloc] initWithChangeHandler:^(NSSet *changedPaths) {
+        sawPresentPath = sawPresentPath || [changedPaths containsObject:presentPath];
+        sawMissingPath = sawMissingPath || [changedPaths containsObject:missingPath];
+    }];
+    [watcher setCoalescingInterval:0.05];
+    XCTAssertFalse([watcher setWatchedPaths:[NSSet setWithObjects:presentPath, missingPath, nil]]);
+    XCTAssertEqualObjects([watcher watchedPaths], [NSSet setWithObject:presentPath]);
+
+    [@"# Present\n\nedited\n" writeToFile:presentPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+    [self spinRunLoopForInterval:3.0 untilCondition:&sawPresentPath];
+    XCTAssertTrue(sawPresentPath);
+
+    // Two levels appear at once; the ancestor watch follows them down.
+    [fileManager createDirectoryAtPath:missingDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+    [@"# Generated\n" writeToFile:missingPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+    [self spinRunLoopForInterval:5.0 untilCondition:&sawMissingPath];
+    XCTAssertTrue(sawMissingPath);
+    XCTAssertTrue([[watcher watchedPaths] containsObject:missingPath]);
+
+    [watcher invalidate];
+    [watcher release];
+    [fileManager removeItemAtPath:directory error:NULL];
+}
+
+@end
@@ -0,0 +1,199 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <XCTest/XCTest.h>
+#import <Foundation/Foundation.h>
+
+#import "OMDGitHubClient.h"
+#import "OMDTestHTTPServer.h"
+
+@interface OMDGitHubClientTests : XCTestCase
+{
+    OMDTestHTTPServer *_server;
+    NSString *_cacheDirectory;
+}
+@end
+
+@implementation OMDGitHubClientTests
+
+- (void)setUp
+{
+    [super setUp];
+    _server = [[OMDTestHTTPServer alloc] init];
+    [_server setBody:[@"[{\"name\":\"guide.md\",\"path\":\"docs/guide.md\",\"type\":\"file\",\"size\":12}]"
+                         dataUsingEncoding:NSUTF8StringEncoding]
+         contentType:@"application/json"
+                etag:@"\"contents-v1\""
+   forPathContaining:@"/contents"];
+    [_server setBody:[@"[{\"name\":\"alpha\",\"updated_at\":\"2024-01-01T00:00:00Z\",\"fork\":false,\"archived\":false}]"
+                         dataUsingEncoding:NSUTF8StringEncoding]
+         contentType:@"application/json"
+                etag:@"\"repos-v1\""
+   forPathContaining:@"/repos"];
+    _cacheDirectory = [[NSTemporaryDirectory() stringByAppendingPathComponent:
+                        [NSString stringWithFormat:@"omd-github-cache-%@",
+                                                   [[NSProcessInfo processInfo] globallyUniqueString]]] copy];
+}
+
+- (void)tearDown
+{
+    [_server stop];
+    [_server release];
+    _server = nil;
+    [[NSFileManager defaultManager] removeItemAtPath:_cacheDirectory error:NULL];
+    [_cacheDirectory release];
+    _cacheDirectory = nil;
+    [super tearDown];
+}
+
+- (OMDGitHubClient *)client
+{
+    OMDGitHubClient *client = [[[OMDGitHubClient alloc] initWithAPIBaseURL:[_server baseURL]
+                                                            cacheDirectory:_cacheDirectory] autorelease];
+    [client setRevalidationInterval:3600.0];
+    return client;
+}
+
+- (BOOL)skipWithoutCurl:(NSError *)error
+{
+    if ([[error domain] isEqualToString:OMDGitHubClientErrorDomain] &&
+        [error code] == OMDGitHubClientErrorCurlUnavailable) {
+        NSLog(@"Skipping GitHub cache checks: curl is not installed.");
+        return YES;
+    }
+    return NO;
+}
+
+- (void)testRevisitedRepositoryListIsServedFromCacheAndRevalidatedConditionally
+{
+    XCTAssertNotNil(_server);
+    NSError *error = nil;
+    NSArray *repos = [[self client] publicRepositoriesForUser:@"octo" includeForksAndArchived:NO error:&error];
+    if ([self skipWithoutCurl:error]) {
+        return;
+    }
+    XCTAssertEqual([repos count], (NSUInteger)1);
+    XCTAssertEqual([[_server requests] count], (NSUInteger)1);
+
+    // A new client (as after relaunch) reads the persistent cache and makes
+    // no request at all.
+    NSArray *cached = [[self client] publicRepositoriesForUser:@"octo" includeForksAndArchived:NO error:&error];
+    XCTAssertEqualObjects(cached, repos);
+    XCTAssertEqual([[_server requests] count], (NSUInteger)1);
+
+    // Once stale, the cached copy is still returned at once and a
+    // conditional request runs in the background.
+    OMDGitHubClient *client = [self client];
+    [client setRevalidationInterval:0.0];
+    cached = [client publicRepositoriesForUser:@"octo" includeForksAndArchived:NO error:&error];
+    XCTAssertEqualObjects(cached, repos);
+    [client waitForBackgroundRequests];
+    NSArray *requests = [_server requests];
+    XCTAssertEqual([requests count], (NSUInteger)2);
+    XCTAssertTrue([[requests lastObject] rangeOfString:@"If-None-Match: \"repos-v1\""
+                                               options:NSCaseInsensitiveSearch].location != NSNotFound);
+}
+
+- (void)testChangedListingIsPostedAfterBackgroundRevalidation
+{
+    XCTAssertNotNil(_server);
+    NSError *error = nil;
+    NSArray *repos = [[self client] publicRepositoriesForUser:@"octo" includeForksAndArchived:NO error:&error];
+    if ([self skipWithoutCurl:error]) {
+        return;
+    }
+    XCTAssertEqualObjects([[repos lastObject] objectForKey:@"name"], @"alpha");
+
+    [_server setBody:[@"[{\"name\":\"beta\",\"updated_at\":\"2024-02-01T00:00:00Z\",\"fork\":false,\"archived\":false}]"
+                         dataUsingEncoding:NSUTF8StringEncoding]
+         contentType:@"application/json"
+                etag:@"\"repos-v2\""
+   forPathContaining:@"/repos"];
+
+    __block NSString *changedURL = nil;
+    id observer = [[NSNotificationCenter defaultCenter] addObserverForName:OMDGitHubClientCachedResponseDidChangeNotification
+                                                                    object:nil
+                                                                     queue:nil
+                                                                usingBlock:^(NSNotification *notification) {
+        [changedURL release];
+        changedURL = [[[notification userInfo] objectForKey:@"url"] copy];
+    }];
+
+    // The stale copy is served at once; the conditional request misses the
+    // new ETag, so the fresh body replaces it and the change is posted.
+    OMDGitHubClient *client = [self client];
+    [client setRevalidationInterval:0.0];
+    NSArray *stale = [client publicRepositoriesForUser:@"octo" includeForksAndArchived:NO error:&error];
+    XCTAssertEqualObjects(stale, repos);
+    [client waitForBackgroundRequests];
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while (changedURL == nil && [deadline timeIntervalSinceNow] > 0.0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                                 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    }
+    [[NSNotificationCenter defaultCenter] removeObserver:observer];
+    XCTAssertTrue([changedURL rangeOfString:@"/users/octo/repos"].location != NSNotFound);
+    [changedURL release];
+
+    NSArray *requests = [_server requests];
+    XCTAssertEqual([requests count], (NSUInteger)2);
+    XCTAssertTrue([[requests lastObject] rangeOfString:@"If-None-Match: \"repos-v1\""
+                                               options:NSCaseInsensitiveSearch].location != NSNotFound);
+
+    // The refreshed listing is what the next caller sees, without a request.
+    NSArray *refreshed = [[self client] publicRepositoriesForUser:@"octo" includeForksAndArchived:NO error:&error];
+    XCTAssertEqualObjects([[refreshed lastObject] objectForKey:@"name"], @"beta");
+    XCTAssertEqual([[_server requests] count], (NSUInteger)2);
+}
+
+- (void)testResponseCacheStaysWithinItsByteBudget
+{
+    XCTAssertNotNil(_server);
+    OMDGitHubClient *client = [[[OMDGitHubClient alloc] initWithAPIBaseURL:[_server baseURL]
+                                                            cacheDirectory:_cacheDirectory
+                                                                 byteLimit:2048] autorelease];
+    [client setRevalidationInterval:3600.0];
+    XCTAssertEqual([client cacheByteLimit], 2048ULL);
+
+    NSError *error = nil;
+    NSUInteger index = 0;
+    for (; index < 12; index++) {
+        NSString *path = [NSString stringWithFormat:@"docs/part%lu", (unsigned long)index];
+        [client contentsForUser:@"octo" repository:@"demo" path:path error:&error];
+        if ([self skipWithoutCurl:error]) {
+            return;
+        }
+    }
+    unsigned long long total = 0;
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    for (NSString *name in [fileManager contentsOfDirectoryAtPath:_cacheDirectory error:NULL]) {
+        NSDictionary *attributes = [fileManager attributesOfItemAtPath:[_cacheDirectory stringByAppendingPathComponent:name]
+                                                                 error:NULL];
+        total += [[attributes objectForKey:NSFileSize] unsignedLongLongValue];
+    }
+    XCTAssertTrue(total > 0);
+    XCTAssertTrue(total <= 2048ULL);
+    XCTAssertEqual([[_server requests] count], (NSUInteger)12);
+}
+
+- (void)testPrefetchedListingIsAvailableWithoutNetwork
+{
+    XCTAssertNotNil(_server);
+    OMDGitHubClient *client = [self client];
+    [client prefetchContentsForUser:@"octo" repository:@"demo" paths:[NSArray arrayWithObject:@"docs"]];
+    [client waitForBackgroundRequests];
+    if ([[_server requests] count] == 0) {
+        NSLog(@"Skipping GitHub prefetch checks: curl is not installed.");
+        return;
+    }
+    [_server stop];
+
+    NSError *error = nil;
+    NSArray *entries = [client contentsForUser:@"octo" repository:@"demo" path:@"docs" error:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual([entries count], (NSUInteger)1);
+    XCTAssertEqualObjects([[entries lastObject] objectForKey:@"path"], @"docs/guide.md");
+    XCTAssertEqual([[_server requests] count], (NSUInteger)1);
+}
+
+@end
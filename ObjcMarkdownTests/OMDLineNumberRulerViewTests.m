@@ -8,6 +8,7 @@
 
 @interface OMDLineNumberRulerView (Testing)
 - (NSArray *)lineStartIndexesForString:(NSString *)text;
+- (NSUInteger)lineNumberForCharacterIndex:(NSUInteger)characterIndex;
 @end
 
 @interface OMDLineNumberRulerViewTests : XCTestCase
@@ -97,4 +98,62 @@
     [textView release];
 }
 
+- (void)testLineIndexFollowsTextStorageEdits
+{
+    NSTextView *textView = nil;
+    NSScrollView *scrollView = nil;
+    OMDLineNumberRulerView *ruler = [self newRulerViewWithTextView:&textView
+                                                         scrollView:&scrollView];
+    NSTextStorage *storage = [textView textStorage];
+    XCTAssertEqual([ruler lineNumberForCharacterIndex:6], 2u);
+
+    [storage replaceCharactersInRange:NSMakeRange(5, 1) withString:@"\n\none\n"];
+    [storage replaceCharactersInRange:NSMakeRange(0, 0) withString:@"top\n"];
+    [storage replaceCharactersInRange:NSMakeRange(13, 6) withString:@"x"];
+    [storage replaceCharactersInRange:NSMakeRange([storage length], 0) withString:@"\n"];
+
+    NSString *text = [storage string];
+    NSArray *expected = [ruler lineStartIndexesForString:text];
+    NSUInteger line = 1;
+    NSUInteger i = 0;
+    for (; i <= [text length]; i++) {
+        if (line < [expected count] &&
+            [[expected objectAtIndex:line] unsignedIntegerValue] <= i) {
+            line += 1;
+        }
+        XCTAssertEqual([ruler lineNumberForCharacterIndex:i], line);
+    }
+    XCTAssertEqual([ruler lineNumberForCharacterIndex:[text length] + 10], [expected count]);
+
+    [ruler release];
+    [scrollView release];
+    [textView release];
+}
+
+- (void)testLineIndexFollowsReplacedTextStorage
+{
+    NSTextView *textView = nil;
+    NSScrollView *scrollView = nil;
+    OMDLineNumberRulerView *ruler = [self newRulerViewWithTextView:&textView
+                                                         scrollView:&scrollView];
+    XCTAssertEqual([ruler lineNumberForCharacterIndex:6], 2u);
+
+    // Same length as the original text, so only the storage identity shows
+    // that the index is stale.
+    NSTextStorage *replacement = [[NSTextStorage alloc] initWithString:@"a\nb\nc\nd\ne\nf\ng\nh\n\n"];
+    [[textView layoutManager] replaceTextStorage:replacement];
+    XCTAssertEqual([ruler lineNumberForCharacterIndex:6], 4u);
+
+    // Later edits reach the ruler through the new storage.
+    [replacement replaceCharactersInRange:NSMakeRange(0, 0) withString:@"top\nmore\n"];
+    XCTAssertEqual([ruler lineNumberForCharacterIndex:0], 1u);
+    XCTAssertEqual([ruler lineNumberForCharacterIndex:9], 3u);
+    XCTAssertEqual([ruler lineNumberForCharacterIndex:[replacement length]], 12u);
+
+    [replacement release];
+    [ruler release];
+    [scrollView release];
+    [textView release];
+}
+
 @end
@@ -0,0 +1,143 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <XCTest/XCTest.h>
+#import <Foundation/Foundation.h>
+
+#import "OMDMappedTextFile.h"
+
+@interface OMDMappedTextFileTests : XCTestCase
+@end
+
+@implementation OMDMappedTextFileTests
+
+- (NSString *)writeTemporaryData:(NSData *)data extension:(NSString *)extension
+{
+    NSString *name = [NSString stringWithFormat:@"omd-mapped-%@.%@",
+                                                [[NSProcessInfo processInfo] globallyUniqueString],
+                                                extension];
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+    [data writeToFile:path atomically:YES];
+    return path;
+}
+
+- (void)testSniffsByteOrderMarksAndBOMLessUTF16
+{
+    const unsigned char utf8BOM[] = { 0xEF, 0xBB, 0xBF, 'a' };
+    const unsigned char utf16LE[] = { 'a', 0, 'b', 0, '\n', 0, 'c', 0 };
+    const unsigned char latin1[] = { 'c', 'a', 'f', 0xE9, ' ', 'x' };
+    NSUInteger bomLength = 99;
+
+    XCTAssertEqual(OMDSniffTextEncoding(utf8BOM, sizeof(utf8BOM), &bomLength), NSUTF8StringEncoding);
+    XCTAssertEqual(bomLength, (NSUInteger)3);
+    XCTAssertEqual(OMDSniffTextEncoding(utf16LE, sizeof(utf16LE), &bomLength), NSUTF16LittleEndianStringEncoding);
+    XCTAssertEqual(bomLength, (NSUInteger)0);
+    XCTAssertEqual(OMDSniffTextEncoding(latin1, sizeof(latin1), NULL), NSWindowsCP1252StringEncoding);
+}
+
+- (void)testLeadingWindowEndsOnLineBoundaryAndCountsDecodedBytes
+{
+    NSMutableString *text = [NSMutableString string];
+    NSUInteger line = 0;
+    for (; line < 2000; line++) {
+        [text appendFormat:@"log line %04lu with some payload\n", (unsigned long)line];
+    }
+    NSString *path = [self writeTemporaryData:[text dataUsingEncoding:NSUTF8StringEncoding] extension:@"log"];
+
+    NSError *error = nil;
+    OMDMappedTextFile *file = [OMDMappedTextFile mappedTextFileAtPath:path error:&error];
+    XCTAssertNotNil(file);
+    XCTAssertNil(error);
+
+    BOOL truncated = NO;
+    NSString *window = [file leadingTextWithMaximumBytes:4096 markdownBlocks:NO truncated:&truncated error:&error];
+    XCTAssertTrue(truncated);
+    XCTAssertTrue([window hasSuffix:@"\n"]);
+    XCTAssertTrue([window length] <= 4096);
+    XCTAssertTrue([text hasPrefix:window]);
+    XCTAssertEqual([file decodedByteCount], (unsigned long long)[window length]);
+    XCTAssertEqual([file mappedByteCount], (unsigned long long)[text length]);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void)testConsecutiveWindowsTileTheFileOnLineBoundaries
+{
+    NSMutableString *text = [NSMutableString string];
+    NSUInteger line = 0;
+    for (; line < 2000; line++) {
+        [text appendFormat:@"entr\u00e9e %04lu with some payload\n", (unsigned long)line];
+    }
+    NSString *path = [self writeTemporaryData:[text dataUsingEncoding:NSUTF8StringEncoding] extension:@"log"];
+    OMDMappedTextFile *file = [OMDMappedTextFile mappedTextFileAtPath:path error:NULL];
+    XCTAssertNotNil(file);
+
+    NSMutableString *joined = [NSMutableString string];
+    unsigned long long offset = 0;
+    NSUInteger windows = 0;
+    while (offset < [file textByteCount] && windows < 1000) {
+        unsigned long long nextOffset = 0;
+        NSError *error = nil;
+        NSString *window = [file textAtByteOffset:offset
+                                     maximumBytes:4096
+                                   markdownBlocks:NO
+                                       nextOffset:&nextOffset
+                                            error:&error];
+        XCTAssertNotNil(window);
+        XCTAssertNil(error);
+        XCTAssertTrue(nextOffset > offset);
+        XCTAssertTrue([window hasSuffix:@"\n"]);
+        [joined appendString:window];
+        offset = nextOffset;
+        windows += 1;
+    }
+    XCTAssertTrue(windows > 1);
+    XCTAssertEqual(offset, [file textByteCount]);
+    XCTAssertEqualObjects(joined, text);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void)testMarkdownWindowDoesNotEndInsideFencedCode
+{
+    NSMutableString *text = [NSMutableString string];
+    NSUInteger index = 0;
+    for (; index < 60; index++) {
+        [text appendFormat:@"Paragraph %02lu of the preamble.\n\n", (unsigned long)index];
+    }
+    NSUInteger fenceStart = [text length];
+    [text appendString:@"```\n"];
+    for (index = 0; index < 300; index++) {
+        [text appendString:(index % 10 == 0 ? @"\n" : @"code line\n")];
+    }
+    [text appendString:@"```\n\nAfter.\n"];
+    NSString *path = [self writeTemporaryData:[text dataUsingEncoding:NSUTF8StringEncoding] extension:@"md"];
+
+    OMDMappedTextFile *file = [OMDMappedTextFile mappedTextFileAtPath:path error:NULL];
+    BOOL truncated = NO;
+    NSString *window = [file leadingTextWithMaximumBytes:fenceStart + 1200
+                                          markdownBlocks:YES
+                                               truncated:&truncated
+                                                   error:NULL];
+    XCTAssertTrue(truncated);
+    // Blank lines inside the fence are not block boundaries; the window
+    // stops before the fence opens.
+    XCTAssertEqual([window length], fenceStart);
+    XCTAssertEqual([window rangeOfString:@"```"].location, (NSUInteger)NSNotFound);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void)testBinaryFileIsRejected
+{
+    const unsigned char bytes[] = { 0x7F, 'E', 'L', 'F', 0x02, 0x01, 0x01, 0x00, 0x00, 0x00 };
+    NSString *path = [self writeTemporaryData:[NSData dataWithBytes:bytes length:sizeof(bytes)] extension:@"bin"];
+
+    NSError *error = nil;
+    XCTAssertNil([OMDMappedTextFile mappedTextFileAtPath:path error:&error]);
+    XCTAssertEqual([error code], (NSInteger)OMDMappedTextFileErrorBinary);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+@end
@@ -3,6 +3,7 @@
 
 #import <XCTest/XCTest.h>
 #import "OMDPreviewSync.h"
+#import "OMDTextDiff.h"
 #import "OMMarkdownRenderer.h"
 
 @interface OMDPreviewSyncTests : XCTestCase
@@ -410,4 +411,137 @@ static NSDictionary *OMDAnchor(NSUInteger sourceStartLine,
     XCTAssertEqual(mappedToSource, expectedToSource);
 }
 
+- (void)testTextAwareMappingAfterEditMatchesColdMapping
+{
+    NSString *target = @"Intro\n\nalpha beta\n\nlet fenced = value\n\ngamma delta\n\nOutro\n";
+    NSString *original = @"# Intro\n\nalpha beta\n\n```\nlet fenced = value\n```\n\ngamma delta\n\nOutro\n";
+    // Dropping the opening fence flips the fence state of every later line.
+    NSString *edited = @"# Intro\n\nalpha beta\n\nlet fenced = value\n```\n\ngamma delta\n\nOutro\n";
+    NSUInteger length = [edited length];
+
+    OMDMapLocationBetweenTexts(original, 0, target);
+    NSMutableArray *incremental = [NSMutableArray array];
+    NSUInteger location = 0;
+    for (; location < length; location++) {
+        [incremental addObject:[NSNumber numberWithUnsignedInteger:OMDMapLocationBetweenTexts(edited, location, target)]];
+    }
+
+    // Unrelated texts push both revisions out of the line-info cache.
+    NSArray *fillers = [NSArray arrayWithObjects:@"kkkk", @"wwww", @"xxxx", @"yyyy", nil];
+    for (NSString *filler in fillers) {
+        OMDMapLocationBetweenTexts(filler, 0, [filler uppercaseString]);
+    }
+
+    for (location = 0; location < length; location++) {
+        XCTAssertEqual(OMDMapLocationBetweenTexts(edited, location, target),
+                       [[incremental objectAtIndex:location] unsignedIntegerValue]);
+    }
+}
+
+- (void)testRevisedTargetTextIsRemappedAfterInPlaceChange
+{
+    NSString *source = @"# Title\n\nfirst paragraph words\n\nsecond paragraph here\n";
+    NSString *before = @"Title\n\nfirst paragraph words\n\nsecond paragraph here\n";
+    NSString *after = @"Title\n\nsecond paragraph here\n\nfirst paragraph words\n";
+    NSUInteger sourceLocation = [source rangeOfString:@"second"].location;
+    NSUInteger expectedBefore = OMDMapLocationBetweenTexts(source, sourceLocation, before);
+    NSUInteger expectedAfter = OMDMapLocationBetweenTexts(source, sourceLocation, after);
+    XCTAssertNotEqual(expectedBefore, expectedAfter);
+
+    // One object whose contents change, like a text storage's string.
+    NSMutableString *preview = [NSMutableString stringWithString:before];
+    NSArray *noAnchors = [NSArray array];
+    XCTAssertEqual(OMDMapSourceLocationWithBlockAnchorsAtRevision(source, sourceLocation, preview, 1, noAnchors),
+                   expectedBefore);
+    XCTAssertEqual(OMDMapSourceLocationWithBlockAnchorsAtRevision(source, sourceLocation, preview, 1, noAnchors),
+                   expectedBefore);
+    [preview setString:after];
+    XCTAssertEqual(OMDMapSourceLocationWithBlockAnchorsAtRevision(source, sourceLocation, preview, 2, noAnchors),
+                   expectedAfter);
+    NSUInteger previewLocation = [after rangeOfString:@"first"].location;
+    XCTAssertEqual(OMDMapTargetLocationWithBlockAnchorsAtRevision(source, preview, 2, previewLocation, noAnchors),
+                   OMDMapLocationBetweenTexts(after, previewLocation, source));
+    OMDForgetRevisedText(preview);
+}
+
+- (void)testScrollSyncOnOneMegabyteDocumentTakesUnderOneMillisecond
+{
+    NSMutableString *source = [NSMutableString string];
+    NSMutableString *preview = [NSMutableString string];
+    NSUInteger section = 0;
+    while ([source length] < 1024 * 1024) {
+        [source appendFormat:@"## Section %lu\n\n", (unsigned long)section];
+        [preview appendFormat:@"Section %lu\n\n", (unsigned long)section];
+        NSUInteger line = 0;
+        for (; line < 8; line++) {
+            NSString *text = [NSString stringWithFormat:@"paragraph %lu line %lu with words for the matcher",
+                                                        (unsigned long)section, (unsigned long)line];
+            [source appendFormat:@"- %@ **bold**\n", text];
+            [preview appendFormat:@"%@ bold\n", text];
+        }
+        [source appendString:@"\n"];
+        [preview appendString:@"\n"];
+        section += 1;
+    }
+    NSString *sourceText = [[source copy] autorelease];
+    NSArray *noAnchors = [NSArray array];
+    NSUInteger length = [sourceText length];
+
+    // The first call builds and analyzes both line tables.
+    OMDMapSourceLocationWithBlockAnchorsAtRevision(sourceText, 0, preview, 1, noAnchors);
+
+    NSUInteger queries = 200;
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    NSUInteger index = 0;
+    for (; index < queries; index++) {
+        NSUInteger location = (length / queries) * index;
+        OMDMapSourceLocationWithBlockAnchorsAtRevision(sourceText, location, preview, 1, noAnchors);
+    }
+    NSTimeInterval perQuery = ([NSDate timeIntervalSinceReferenceDate] - start) / (NSTimeInterval)queries;
+    OMDForgetRevisedText(preview);
+    XCTAssertTrue(perQuery < 0.001, @"scroll sync took %.3f ms per query", perQuery * 1000.0);
+}
+
+- (void)testCommonPrefixAndSuffixCrossChunkBoundaries
+{
+    NSMutableString *left = [NSMutableString string];
+    NSUInteger index = 0;
+    for (; index < 3 * OMDTextChunkLength; index++) {
+        [left appendFormat:@"%c", (char)('a' + index % 26)];
+    }
+    NSMutableString *right = [[left mutableCopy] autorelease];
+    NSUInteger changed = OMDTextChunkLength + 17;
+    [right replaceCharactersInRange:NSMakeRange(changed, 1) withString:@"#"];
+
+    XCTAssertEqual(OMDCommonPrefixLength(left, right), changed);
+    XCTAssertEqual(OMDCommonSuffixLength(left, right, [left length] - changed), [left length] - changed - 1);
+    XCTAssertEqual(OMDCommonPrefixLength(left, left), [left length]);
+    XCTAssertEqual(OMDCommonPrefixLength(left, @""), (NSUInteger)0);
+}
+
+- (void)testBlockAnchorMappingPrefersInnermostNestedAnchor
+{
+    NSString *source = @"- alpha\n- beta\n- gamma\n";
+    NSString *target = @"alpha\nbeta\ngamma\n";
+    NSRange betaTarget = [target rangeOfString:@"beta"];
+    XCTAssertTrue(betaTarget.location != NSNotFound);
+
+    NSArray *anchors = [NSArray arrayWithObjects:
+                        OMDAnchor(1, 3, 0, [target length]),
+                        OMDAnchor(1, 1, 0, 5),
+                        OMDAnchor(2, 2, betaTarget.location, betaTarget.length),
+                        OMDAnchor(3, 3, betaTarget.location + 5, 5),
+                        nil];
+
+    NSUInteger sourceLocation = [source rangeOfString:@"beta"].location;
+    NSUInteger mapped = OMDMapSourceLocationWithBlockAnchors(source, sourceLocation, target, anchors);
+    XCTAssertTrue(mapped >= betaTarget.location);
+    XCTAssertTrue(mapped < NSMaxRange(betaTarget));
+
+    NSUInteger mappedBack = OMDMapTargetLocationWithBlockAnchors(source, target, betaTarget.location + 1, anchors);
+    NSRange betaLine = [source lineRangeForRange:NSMakeRange(sourceLocation, 0)];
+    XCTAssertTrue(mappedBack >= betaLine.location);
+    XCTAssertTrue(mappedBack < NSMaxRange(betaLine));
+}
+
 @end
@@ -183,4 +183,78 @@ static NSColor *OMDColorAt(NSMutableAttributedString *string, NSString *needle)
     XCTAssertTrue([secondHeadingColor isEqual:base]);
 }
 
+static BOOL OMDForegroundColorsMatch(NSAttributedString *left, NSAttributedString *right)
+{
+    if ([left length] != [right length]) {
+        return NO;
+    }
+    NSUInteger index = 0;
+    for (; index < [left length]; index++) {
+        id leftColor = [left attribute:NSForegroundColorAttributeName atIndex:index effectiveRange:NULL];
+        id rightColor = [right attribute:NSForegroundColorAttributeName atIndex:index effectiveRange:NULL];
+        if (leftColor != rightColor && ![leftColor isEqual:rightColor]) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)testLineStyleIndexReparsesEditsToSameResultAsFullParse
+{
+    NSMutableString *markdown = [NSMutableString string];
+    NSUInteger i = 0;
+    for (; i < 200; i++) {
+        [markdown appendFormat:@"## Section %lu\n\nParagraph %lu with [link](x).\n\n- item %lu\n  continued\n\n> quote %lu\n\n",
+                               (unsigned long)i,
+                               (unsigned long)i,
+                               (unsigned long)i,
+                               (unsigned long)i];
+    }
+    NSColor *base = [NSColor colorWithCalibratedRed:0.10 green:0.10 blue:0.10 alpha:1.0];
+    NSColor *background = [NSColor colorWithCalibratedRed:0.96 green:0.96 blue:0.96 alpha:1.0];
+    OMDSourceLineStyleIndex *index = [[[OMDSourceLineStyleIndex alloc] init] autorelease];
+    NSDictionary *options = [NSDictionary dictionaryWithObject:index
+                                                        forKey:OMDSourceHighlighterOptionLineStyleIndex];
+    NSMutableAttributedString *styled = [[[NSMutableAttributedString alloc] initWithString:markdown] autorelease];
+    [OMDSourceHighlighter highlightAttributedString:styled
+                                      baseTextColor:base
+                                    backgroundColor:background
+                                            options:options
+                                        targetRange:NSMakeRange(NSNotFound, 0)];
+
+    // Opening a fence restyles everything below it, far outside the window.
+    NSUInteger fenceLocation = [[styled string] rangeOfString:@"## Section 3\n"].location;
+    NSString *edits[3][2] = {
+        { @"```\n", nil },
+        { @"```\n", @"## Section 9\n" },
+        { @"more ", @"Paragraph 150" }
+    };
+    NSUInteger step = 0;
+    for (; step < 3; step++) {
+        NSUInteger location = fenceLocation;
+        if (edits[step][1] != nil) {
+            location = [[styled string] rangeOfString:edits[step][1]].location;
+        }
+        [styled replaceCharactersInRange:NSMakeRange(location, 0) withString:edits[step][0]];
+        [OMDSourceHighlighter highlightAttributedString:styled
+                                          baseTextColor:base
+                                        backgroundColor:background
+                                                options:options
+                                            targetRange:NSMakeRange(location, [edits[step][0] length])];
+
+        NSMutableAttributedString *expected = [[[NSMutableAttributedString alloc] initWithString:[styled string]] autorelease];
+        OMDSourceLineStyleIndex *freshIndex = [[[OMDSourceLineStyleIndex alloc] init] autorelease];
+        [OMDSourceHighlighter highlightAttributedString:expected
+                                          baseTextColor:base
+                                        backgroundColor:background
+                                                options:[NSDictionary dictionaryWithObject:freshIndex
+                                                                                    forKey:OMDSourceHighlighterOptionLineStyleIndex]
+                                            targetRange:NSMakeRange(NSNotFound, 0)];
+        XCTAssertTrue(OMDForegroundColorsMatch(styled, expected), @"step %lu", (unsigned long)step);
+    }
+
+    // A plain paragraph edit only re-parses the blocks around it.
+    XCTAssertTrue([index lastReparsedLineCount] < 20);
+}
+
 @end
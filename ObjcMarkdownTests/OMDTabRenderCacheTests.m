@@ -0,0 +1,56 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <XCTest/XCTest.h>
+#import <Foundation/Foundation.h>
+
+#import "OMDTabRenderCache.h"
+
+@interface OMDTabRenderCacheTests : XCTestCase
+@end
+
+@implementation OMDTabRenderCacheTests
+
+- (OMDTabRenderSnapshot *)snapshotWithMarkdown:(NSString *)markdown length:(NSUInteger)length
+{
+    NSString *text = [@"" stringByPaddingToLength:length withString:@"x" startingAtIndex:0];
+    NSAttributedString *rendered = [[[NSAttributedString alloc] initWithString:text] autorelease];
+    return [[[OMDTabRenderSnapshot alloc] initWithMarkdown:markdown
+                                          configurationKey:@"config"
+                                                  rendered:rendered
+                                           codeBlockRanges:nil
+                                          blockquoteRanges:nil
+                                              blockAnchors:nil] autorelease];
+}
+
+- (void)testSnapshotIsReturnedOnlyForMatchingMarkdownAndConfiguration
+{
+    OMDTabRenderCache *cache = [[[OMDTabRenderCache alloc] initWithByteBudget:1024 * 1024] autorelease];
+    [cache storeSnapshot:[self snapshotWithMarkdown:@"# One" length:100] forTabIdentifier:@"tab-1"];
+    XCTAssertTrue([cache costForTabIdentifier:@"tab-1"] >= 200);
+
+    XCTAssertNotNil([cache snapshotForTabIdentifier:@"tab-1" markdown:@"# One" configurationKey:@"config"]);
+    XCTAssertNil([cache snapshotForTabIdentifier:@"tab-1" markdown:@"# One" configurationKey:@"zoomed"]);
+    // A stale entry is dropped rather than kept around.
+    XCTAssertEqual([cache costForTabIdentifier:@"tab-1"], (NSUInteger)0);
+    XCTAssertEqual([cache totalCost], (NSUInteger)0);
+}
+
+- (void)testLeastRecentlyUsedTabIsEvictedFirst
+{
+    OMDTabRenderSnapshot *probe = [self snapshotWithMarkdown:@"a" length:1000];
+    NSUInteger budget = [probe cost] * 2 + [probe cost] / 2;
+    OMDTabRenderCache *cache = [[[OMDTabRenderCache alloc] initWithByteBudget:budget] autorelease];
+
+    [cache storeSnapshot:[self snapshotWithMarkdown:@"a" length:1000] forTabIdentifier:@"a"];
+    [cache storeSnapshot:[self snapshotWithMarkdown:@"b" length:1000] forTabIdentifier:@"b"];
+    XCTAssertNotNil([cache snapshotForTabIdentifier:@"a" markdown:@"a" configurationKey:@"config"]);
+    [cache storeSnapshot:[self snapshotWithMarkdown:@"c" length:1000] forTabIdentifier:@"c"];
+
+    XCTAssertNotNil([cache peekSnapshotForTabIdentifier:@"a"]);
+    XCTAssertNil([cache peekSnapshotForTabIdentifier:@"b"]);
+    XCTAssertNotNil([cache peekSnapshotForTabIdentifier:@"c"]);
+    XCTAssertTrue([cache totalCost] <= budget);
+}
+
+@end
@@ -0,0 +1,29 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <Foundation/Foundation.h>
+
+// Minimal HTTP/1.1 stand-in on 127.0.0.1: one response per connection, taken
+// from the first route whose fragment occurs in the request line (404 when
+// none does). Every 200 carries the route's ETag, and a request with a
+// matching If-None-Match gets a 304.
+@interface OMDTestHTTPServer : NSObject
+{
+    int _listenSocket;
+    NSMutableArray *_requests;
+    NSMutableArray *_routes;
+}
+@property (nonatomic, readonly) unsigned short port;
+
+// "http://127.0.0.1:<port>"
+- (NSString *)baseURL;
+// Replaces the route for an existing fragment in place, so later requests
+// see the new body; otherwise appends a route.
+- (void)setBody:(NSData *)body
+    contentType:(NSString *)contentType
+           etag:(NSString *)etag
+forPathContaining:(NSString *)fragment;
+// Raw request heads, oldest first.
+- (NSArray *)requests;
+- (void)stop;
+@end
@@ -0,0 +1,185 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import "OMDTestHTTPServer.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+@interface OMDTestHTTPServer ()
+- (NSDictionary *)routeForRequest:(NSString *)request;
+- (void)serve;
+@end
+
+@implementation OMDTestHTTPServer
+
+@synthesize port = _port;
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        _requests = [[NSMutableArray alloc] init];
+        _routes = [[NSMutableArray alloc] init];
+        _listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t length = sizeof(address);
+        if (_listenSocket < 0 ||
+            bind(_listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+            listen(_listenSocket, 8) != 0 ||
+            getsockname(_listenSocket, (struct sockaddr *)&address, &length) != 0) {
+            [self release];
+            return nil;
+        }
+        _port = ntohs(address.sin_port);
+        [NSThread detachNewThreadSelector:@selector(serve) toTarget:self withObject:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_requests release];
+    [_routes release];
+    [super dealloc];
+}
+
+- (NSString *)baseURL
+{
+    return [NSString stringWithFormat:@"http://127.0.0.1:%u", (unsigned)_port];
+}
+
+- (void)setBody:(NSData *)body
+    contentType:(NSString *)contentType
+           etag:(NSString *)etag
+forPathContaining:(NSString *)fragment
+{
+    NSDictionary *route = [NSDictionary dictionaryWithObjectsAndKeys:
+        (fragment != nil ? fragment : @""), @"fragment",
+        (body != nil ? body : [NSData data]), @"body",
+        (contentType != nil ? contentType : @"application/octet-stream"), @"contentType",
+        (etag != nil ? etag : @"\"v1\""), @"etag",
+        nil];
+    @synchronized (_routes) {
+        NSUInteger index = 0;
+        for (; index < [_routes count]; index++) {
+            if ([[[_routes objectAtIndex:index] objectForKey:@"fragment"] isEqualToString:[route objectForKey:@"fragment"]]) {
+                [_routes replaceObjectAtIndex:index withObject:route];
+                return;
+            }
+        }
+        [_routes addObject:route];
+    }
+}
+
+- (NSArray *)requests
+{
+    @synchronized (_requests) {
+        return [[_requests copy] autorelease];
+    }
+}
+
+- (void)stop
+{
+    int listenSocket = _listenSocket;
+    _listenSocket = -1;
+    if (listenSocket >= 0) {
+        shutdown(listenSocket, SHUT_RDWR);
+        close(listenSocket);
+    }
+}
+
+- (NSDictionary *)routeForRequest:(NSString *)request
+{
+    NSRange lineEnd = [request rangeOfString:@"\r\n"];
+    NSString *requestLine = (lineEnd.location != NSNotFound ? [request substringToIndex:lineEnd.location] : request);
+    @synchronized (_routes) {
+        for (NSDictionary *route in _routes) {
+            NSString *fragment = [route objectForKey:@"fragment"];
+            if ([fragment length] == 0 || [requestLine rangeOfString:fragment].location != NSNotFound) {
+                return [[route retain] autorelease];
+            }
+        }
+    }
+    return nil;
+}
+
+- (void)serve
+{
+    [self retain];
+    while (_listenSocket >= 0) {
+        int connection = accept(_listenSocket, NULL, NULL);
+        if (connection < 0) {
+            break;
+        }
+        @autoreleasepool {
+            NSMutableData *received = [NSMutableData data];
+            char buffer[4096];
+            NSData *terminator = [@"\r\n\r\n" dataUsingEncoding:NSASCIIStringEncoding];
+            while ([received rangeOfData:terminator options:0 range:NSMakeRange(0, [received length])].location == NSNotFound) {
+                ssize_t count = read(connection, buffer, sizeof(buffer));
+                if (count <= 0) {
+                    break;
+                }
+                [received appendBytes:buffer length:(NSUInteger)count];
+            }
+            NSString *request = [[[NSString alloc] initWithData:received
+                                                       encoding:NSISOLatin1StringEncoding] autorelease];
+            if (request == nil) {
+                request = @"";
+            }
+            @synchronized (_requests) {
+                [_requests addObject:request];
+            }
+
+            NSDictionary *route = [self routeForRequest:request];
+            NSMutableData *response = [NSMutableData data];
+            NSString *head = nil;
+            if (route == nil) {
+                head = @"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            } else {
+                NSString *etag = [route objectForKey:@"etag"];
+                NSData *body = [route objectForKey:@"body"];
+                NSString *condition = [NSString stringWithFormat:@"If-None-Match: %@", etag];
+                if ([request rangeOfString:condition options:NSCaseInsensitiveSearch].location != NSNotFound) {
+                    head = [NSString stringWithFormat:@"HTTP/1.1 304 Not Modified\r\nETag: %@\r\n"
+                                                      @"Content-Length: 0\r\nConnection: close\r\n\r\n",
+                                                      etag];
+                } else {
+                    head = [NSString stringWithFormat:@"HTTP/1.1 200 OK\r\nETag: %@\r\n"
+                                                      @"Content-Type: %@\r\n"
+                                                      @"Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                                                      etag,
+                                                      [route objectForKey:@"contentType"],
+                                                      (unsigned long)[body length]];
+                    [response appendData:[head dataUsingEncoding:NSUTF8StringEncoding]];
+                    [response appendData:body];
+                    head = nil;
+                }
+            }
+            if (head != nil) {
+                [response appendData:[head dataUsingEncoding:NSUTF8StringEncoding]];
+            }
+            const char *bytes = (const char *)[response bytes];
+            NSUInteger remaining = [response length];
+            while (remaining > 0) {
+                ssize_t written = write(connection, bytes, remaining);
+                if (written <= 0) {
+                    break;
+                }
+                bytes += written;
+                remaining -= (NSUInteger)written;
+            }
+            close(connection);
+        }
+    }
+    [self release];
+}
+
+@end
@@ -0,0 +1,114 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <XCTest/XCTest.h>
+#import <Foundation/Foundation.h>
+
+#import "OMDiskCache.h"
+
+@interface OMDiskCacheTests : XCTestCase
+@end
+
+@implementation OMDiskCacheTests
+
+- (NSString *)temporaryCacheDirectory
+{
+    NSString *name = [NSString stringWithFormat:@"omd-disk-cache-%@",
+                                                [[NSProcessInfo processInfo] globallyUniqueString]];
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+}
+
+- (NSData *)dataOfLength:(NSUInteger)length byte:(unsigned char)byte
+{
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    memset([data mutableBytes], byte, length);
+    return data;
+}
+
+- (void)setModificationDate:(NSDate *)date ofPath:(NSString *)path
+{
+    NSDictionary *attributes = [NSDictionary dictionaryWithObject:date forKey:NSFileModificationDate];
+    [[NSFileManager defaultManager] setAttributes:attributes ofItemAtPath:path error:NULL];
+}
+
+- (void)testStoresPastTheLimitEvictLeastRecentlyUsedEntries
+{
+    NSString *directory = [self temporaryCacheDirectory];
+    OMDiskCache *cache = [[[OMDiskCache alloc] initWithDirectory:directory byteLimit:4000] autorelease];
+    XCTAssertTrue([cache isEnabled]);
+
+    NSArray *keys = [NSArray arrayWithObjects:@"a", @"b", @"c", nil];
+    NSUInteger index = 0;
+    for (NSString *key in keys) {
+        XCTAssertTrue([cache storeData:[self dataOfLength:1000 byte:(unsigned char)index] forKey:key extension:@"bin"]);
+        [self setModificationDate:[NSDate dateWithTimeIntervalSinceNow:-600.0 + (NSTimeInterval)index * 60.0]
+                           ofPath:[cache pathForKey:key extension:@"bin"]];
+        index++;
+    }
+    XCTAssertEqual([cache trackedBytes], 3000ULL);
+
+    // Reading "a" makes it the most recently used of the three.
+    XCTAssertNotNil([cache dataForKey:@"a" extension:@"bin"]);
+    XCTAssertTrue([cache storeData:[self dataOfLength:1000 byte:3] forKey:@"d" extension:@"bin"]);
+    XCTAssertEqual([cache trackedBytes], 4000ULL);
+    XCTAssertTrue([cache storeData:[self dataOfLength:1000 byte:4] forKey:@"e" extension:@"bin"]);
+
+    XCTAssertEqual([cache trackedBytes], 3000ULL);
+    XCTAssertNil([cache existingPathForKey:@"b" extension:@"bin"]);
+    XCTAssertNil([cache existingPathForKey:@"c" extension:@"bin"]);
+    XCTAssertNotNil([cache existingPathForKey:@"a" extension:@"bin"]);
+    XCTAssertNotNil([cache existingPathForKey:@"d" extension:@"bin"]);
+    XCTAssertNotNil([cache existingPathForKey:@"e" extension:@"bin"]);
+
+    [[NSFileManager defaultManager] removeItemAtPath:directory error:NULL];
+}
+
+- (void)testRewritingAnEntryReplacesItsTrackedSize
+{
+    NSString *directory = [self temporaryCacheDirectory];
+    OMDiskCache *cache = [[[OMDiskCache alloc] initWithDirectory:directory byteLimit:4000] autorelease];
+
+    XCTAssertTrue([cache storeData:[self dataOfLength:1000 byte:1] forKey:@"same" extension:@"bin"]);
+    XCTAssertTrue([cache storeData:[self dataOfLength:1000 byte:2] forKey:@"same" extension:@"bin"]);
+    XCTAssertTrue([cache storeData:[self dataOfLength:1000 byte:3] forKey:@"same" extension:@"bin"]);
+    XCTAssertEqual([cache trackedBytes], 1000ULL);
+    XCTAssertTrue([cache storeData:[self dataOfLength:400 byte:4] forKey:@"same" extension:@"bin"]);
+    XCTAssertEqual([cache trackedBytes], 400ULL);
+
+    // Oversized data is refused rather than evicting everything else.
+    XCTAssertFalse([cache storeData:[self dataOfLength:5000 byte:5] forKey:@"big" extension:@"bin"]);
+    XCTAssertEqual([cache trackedBytes], 400ULL);
+    XCTAssertNotNil([cache existingPathForKey:@"same" extension:@"bin"]);
+
+    [[NSFileManager defaultManager] removeItemAtPath:directory error:NULL];
+}
+
+- (void)testFreshCacheOnSameDirectoryHitsAndCountsExistingEntries
+{
+    NSString *directory = [self temporaryCacheDirectory];
+    OMDiskCache *first = [[[OMDiskCache alloc] initWithDirectory:directory byteLimit:4000] autorelease];
+    NSData *payload = [self dataOfLength:700 byte:7];
+    XCTAssertTrue([first storeData:payload forKey:@"v1|latex+dvisvgm|x^2" extension:@"svg"]);
+    XCTAssertTrue([first storeData:[self dataOfLength:300 byte:8] forKey:@"other" extension:@"svg"]);
+
+    OMDiskCache *second = [[[OMDiskCache alloc] initWithDirectory:directory byteLimit:4000] autorelease];
+    XCTAssertEqual([second trackedBytes], 1000ULL);
+    XCTAssertEqualObjects([second dataForKey:@"v1|latex+dvisvgm|x^2" extension:@"svg"], payload);
+    XCTAssertNil([second dataForKey:@"v1|latex+dvisvgm|y^2" extension:@"svg"]);
+    XCTAssertEqual([second hitCount], (NSUInteger)1);
+    XCTAssertEqual([second missCount], (NSUInteger)1);
+
+    [[NSFileManager defaultManager] removeItemAtPath:directory error:NULL];
+}
+
+- (void)testZeroLimitOrEmptyDirectoryDisablesCache
+{
+    OMDiskCache *noLimit = [[[OMDiskCache alloc] initWithDirectory:[self temporaryCacheDirectory] byteLimit:0] autorelease];
+    OMDiskCache *noDirectory = [[[OMDiskCache alloc] initWithDirectory:@"" byteLimit:4000] autorelease];
+    XCTAssertFalse([noLimit isEnabled]);
+    XCTAssertFalse([noDirectory isEnabled]);
+    XCTAssertFalse([noDirectory storeData:[self dataOfLength:10 byte:1] forKey:@"k" extension:@"bin"]);
+    XCTAssertNil([noDirectory dataForKey:@"k" extension:@"bin"]);
+}
+
+@end
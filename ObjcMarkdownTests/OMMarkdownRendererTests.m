@@ -5,6 +5,8 @@
 #import <AppKit/AppKit.h>
 #import <dispatch/dispatch.h>
 #import "OMMarkdownRenderer.h"
+#import "OMDiskCache.h"
+#import "OMDTestHTTPServer.h"
 
 static NSArray *OMDTestExecutableCandidateNames(NSString *name)
 {
@@ -92,6 +94,188 @@ static BOOL OMDMathToolchainAvailable(void)
             OMDTestExecutablePathNamed(@"tex") != nil);
 }
 
+// The regex highlighter the code lexer replaced, kept as the reference its
+// output is checked against: one NSRegularExpression pass per rule in paint
+// order, later rules painting over earlier ones.
+enum {
+    OMDRegexTokenNone = 0,
+    OMDRegexTokenKeyword = 1,
+    OMDRegexTokenComment = 2,
+    OMDRegexTokenString = 3,
+    OMDRegexTokenNumber = 4,
+    OMDRegexTokenDirective = 5
+};
+
+static NSArray *OMDRegexRule(NSString *pattern, NSRegularExpressionOptions options, NSUInteger tokenClass)
+{
+    return [NSArray arrayWithObjects:pattern,
+                                     [NSNumber numberWithUnsignedInteger:(NSUInteger)options],
+                                     [NSNumber numberWithUnsignedInteger:tokenClass],
+                                     nil];
+}
+
+static NSArray *OMDRegexHighlighterRulesForFenceToken(NSString *token)
+{
+    if ([token isEqualToString:@"c"] ||
+        [token isEqualToString:@"objc"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"(?m)^\\s*#\\s*[A-Za-z_][A-Za-z0-9_]*.*$", 0, OMDRegexTokenDirective),
+            OMDRegexRule(@"\\b(?:@interface|@implementation|@end|@property|@synthesize|@dynamic|@protocol|@class|@selector|@autoreleasepool|id|instancetype|self|super|nil|YES|NO|if|else|for|while|switch|case|break|continue|return|typedef|struct|enum|static|const|void|int|float|double|char|long|short|unsigned|signed|BOOL|SEL|Class|namespace|template|typename|using|public|private|protected|virtual|override|constexpr|auto|new|delete|this|nullptr|try|catch|throw|package|import|func|defer|select|go|chan|map|interface|impl|trait|where|match|let|mut|pub|crate|mod|fn|impl|enum|protocol|extension|guard|deinit|class|actor|async|await|yield|throws|throw|nil|true|false|var|val)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"@?\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"(?m)//.*$|/\\*[\\s\\S]*?\\*/", 0, OMDRegexTokenComment),
+            nil];
+    }
+    if ([token isEqualToString:@"python"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"(?m)^\\s*@\\w+", 0, OMDRegexTokenDirective),
+            OMDRegexRule(@"\\b(?:and|as|assert|async|await|break|class|continue|def|del|elif|else|except|False|finally|for|from|global|if|import|in|is|lambda|None|nonlocal|not|or|pass|raise|return|True|try|while|with|yield)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"(?s)(?:'''[\\s\\S]*?'''|\"\"\"[\\s\\S]*?\"\"\"|'(?:[^'\\\\]|\\\\.)*'|\"(?:[^\"\\\\]|\\\\.)*\")", 0, OMDRegexTokenString),
+            OMDRegexRule(@"(?m)#.*$", 0, OMDRegexTokenComment),
+            nil];
+    }
+    if ([token isEqualToString:@"javascript"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"\\b(?:if|else|for|while|do|switch|case|break|continue|return|function|const|let|var|class|extends|new|try|catch|finally|throw|import|export|default|from|as|this|null|undefined|true|false)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"`(?:[^`\\\\]|\\\\.)*`|\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"(?m)//.*$|/\\*[\\s\\S]*?\\*/", 0, OMDRegexTokenComment),
+            nil];
+    }
+    if ([token isEqualToString:@"typescript"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"\\b(?:if|else|for|while|do|switch|case|break|continue|return|function|const|let|var|class|extends|new|try|catch|finally|throw|import|export|default|from|as|this|null|undefined|true|false)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:interface|type|implements|enum|namespace|readonly|public|private|protected|abstract|declare|keyof|infer|unknown|never|any)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"`(?:[^`\\\\]|\\\\.)*`|\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"(?m)//.*$|/\\*[\\s\\S]*?\\*/", 0, OMDRegexTokenComment),
+            nil];
+    }
+    if ([token isEqualToString:@"json"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"\"(?:[^\"\\\\]|\\\\.)*\"", 0, OMDRegexTokenString),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"\\b(?:true|false|null)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\"(?:[^\"\\\\]|\\\\.)*\"\\s*:", 0, OMDRegexTokenDirective),
+            nil];
+    }
+    if ([token isEqualToString:@"bash"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"\\b(?:if|then|else|elif|fi|for|while|do|done|case|esac|function|in|select|until|time)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\$\\{?[A-Za-z_][A-Za-z0-9_]*\\}?", 0, OMDRegexTokenDirective),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"(?m)#.*$", 0, OMDRegexTokenComment),
+            nil];
+    }
+    if ([token isEqualToString:@"markdown"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"(?m)^\\s{0,3}#{1,6}\\s+.*$", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\[[^\\]\\n]+\\]\\([^\\)\\n]+\\)", 0, OMDRegexTokenDirective),
+            OMDRegexRule(@"(?:\\*\\*[^*\\n]+\\*\\*|__[^_\\n]+__)", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"(?<!\\*)\\*[^*\\n]+\\*(?!\\*)|(?<!_)_[^_\\n]+_(?!_)", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"`[^`\\n]+`", 0, OMDRegexTokenString),
+            OMDRegexRule(@"\\$\\$[\\s\\S]*?\\$\\$|\\$[^$\\n]+\\$", 0, OMDRegexTokenNumber),
+            nil];
+    }
+    if ([token isEqualToString:@"yaml"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"(?m)^\\s*#.*$", 0, OMDRegexTokenComment),
+            OMDRegexRule(@"(?m)^\\s*-\\s+", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"(?m)^\\s*[A-Za-z0-9_\\-\"']+\\s*:", 0, OMDRegexTokenDirective),
+            OMDRegexRule(@"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"\\b(?:true|false|null|yes|no|on|off)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            nil];
+    }
+    if ([token isEqualToString:@"toml"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"(?m)^\\s*#.*$", 0, OMDRegexTokenComment),
+            OMDRegexRule(@"(?m)^\\s*\\[[^\\]\\n]+\\]", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"(?m)^\\s*[A-Za-z0-9_\\.-]+\\s*=", 0, OMDRegexTokenDirective),
+            OMDRegexRule(@"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"\\b(?:true|false)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            nil];
+    }
+    if ([token isEqualToString:@"sql"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"\\b(?:SELECT|FROM|WHERE|ORDER|BY|GROUP|HAVING|INSERT|INTO|VALUES|UPDATE|SET|DELETE|CREATE|TABLE|ALTER|DROP|JOIN|LEFT|RIGHT|INNER|OUTER|ON|AS|DISTINCT|LIMIT|OFFSET|UNION|ALL|AND|OR|NOT|NULL|IS|IN|LIKE|CASE|WHEN|THEN|ELSE|END)\\b", NSRegularExpressionCaseInsensitive, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"'(?:[^'\\\\]|\\\\.)*'|\"(?:[^\"\\\\]|\\\\.)*\"", 0, OMDRegexTokenString),
+            OMDRegexRule(@"(?m)--.*$|/\\*[\\s\\S]*?\\*/", 0, OMDRegexTokenComment),
+            nil];
+    }
+    if ([token isEqualToString:@"ruby"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"\\b(?:def|class|module|end|if|elsif|else|unless|case|when|while|until|for|in|do|break|next|redo|retry|return|yield|super|self|nil|true|false|and|or|not|begin|rescue|ensure|require|include|extend|attr_reader|attr_writer|attr_accessor)\\b", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            OMDRegexRule(@"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"(?m)#.*$", 0, OMDRegexTokenComment),
+            OMDRegexRule(@"\\:[A-Za-z_][A-Za-z0-9_]*", 0, OMDRegexTokenDirective),
+            nil];
+    }
+    if ([token isEqualToString:@"html"]) {
+        return [NSArray arrayWithObjects:
+            OMDRegexRule(@"(?m)<!--.*?-->|/\\*[\\s\\S]*?\\*/", NSRegularExpressionDotMatchesLineSeparators, OMDRegexTokenComment),
+            OMDRegexRule(@"</?[A-Za-z][A-Za-z0-9:_-]*", 0, OMDRegexTokenKeyword),
+            OMDRegexRule(@"\\b[A-Za-z_:][A-Za-z0-9_:\\-]*\\s*=", 0, OMDRegexTokenDirective),
+            OMDRegexRule(@"\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'", 0, OMDRegexTokenString),
+            OMDRegexRule(@"\\b(?:0x[0-9A-Fa-f]+|-?\\d+(?:\\.\\d+)?)\\b", 0, OMDRegexTokenNumber),
+            nil];
+    }
+    return nil;
+}
+
+// Token class of every character of code under the reference rules.
+static NSData *OMDRegexHighlighterTokenClasses(NSString *code, NSArray *rules)
+{
+    NSUInteger length = [code length];
+    NSMutableData *classes = [NSMutableData dataWithLength:length];
+    uint8_t *bytes = (uint8_t *)[classes mutableBytes];
+    for (NSArray *rule in rules) {
+        NSRegularExpressionOptions options = (NSRegularExpressionOptions)[[rule objectAtIndex:1] unsignedIntegerValue];
+        NSRegularExpression *regex = [NSRegularExpression regularExpressionWithPattern:[rule objectAtIndex:0]
+                                                                               options:options
+                                                                                 error:NULL];
+        uint8_t tokenClass = (uint8_t)[[rule objectAtIndex:2] unsignedIntegerValue];
+        for (NSTextCheckingResult *match in [regex matchesInString:code options:0 range:NSMakeRange(0, length)]) {
+            NSRange range = [match range];
+            NSUInteger index = range.location;
+            for (; index < NSMaxRange(range); index++) {
+                bytes[index] = tokenClass;
+            }
+        }
+    }
+    return classes;
+}
+
+// Fenced blocks of a Markdown file as (fence token, code) pairs.
+static NSArray *OMDFencedCodeBlocksInFile(NSString *path)
+{
+    NSString *markdown = [NSString stringWithContentsOfFile:path encoding:NSUTF8StringEncoding error:NULL];
+    NSMutableArray *blocks = [NSMutableArray array];
+    NSString *token = nil;
+    NSMutableString *code = nil;
+    for (NSString *line in [markdown componentsSeparatedByString:@"\n"]) {
+        if (code == nil) {
+            if ([line hasPrefix:@"```"] && [line length] > 3) {
+                token = [line substringFromIndex:3];
+                code = [NSMutableString string];
+            }
+        } else if ([line isEqualToString:@"```"]) {
+            [blocks addObject:[NSArray arrayWithObjects:token, code, nil]];
+            code = nil;
+        } else {
+            [code appendString:line];
+            [code appendString:@"\n"];
+        }
+    }
+    return blocks;
+}
+
+
 @interface OMMarkdownRendererTests : XCTestCase
 @end
 
@@ -116,12 +300,17 @@ static BOOL OMDMathToolchainAvailable(void)
 }
 
 - (NSString *)writeTemporaryImage
+{
+    return [self writeTemporaryImageOfSize:NSMakeSize(8.0, 8.0)];
+}
+
+- (NSString *)writeTemporaryImageOfSize:(NSSize)size
 {
     NSString *path = [self temporaryImagePathWithExtension:@"png"];
-    NSImage *image = [[[NSImage alloc] initWithSize:NSMakeSize(8.0, 8.0)] autorelease];
+    NSImage *image = [[[NSImage alloc] initWithSize:size] autorelease];
     [image lockFocus];
     [[NSColor colorWithCalibratedRed:0.15 green:0.45 blue:0.85 alpha:1.0] setFill];
-    NSRectFill(NSMakeRect(0.0, 0.0, 8.0, 8.0));
+    NSRectFill(NSMakeRect(0.0, 0.0, size.width, size.height));
     [image unlockFocus];
 
     NSData *tiff = [image TIFFRepresentation];
@@ -207,6 +396,49 @@ static BOOL OMDMathToolchainAvailable(void)
     return nil;
 }
 
+// Attachments are distinct objects in each render, so they compare by cell
+// class and size; every other attribute compares by value.
+- (void)assertAttributedString:(NSAttributedString *)actual
+         matchesAttributedString:(NSAttributedString *)expected
+{
+    XCTAssertEqualObjects([actual string], [expected string]);
+    if (![[actual string] isEqualToString:[expected string]]) {
+        return;
+    }
+    NSUInteger length = [expected length];
+    NSUInteger index = 0;
+    while (index < length) {
+        NSRange expectedRun = NSMakeRange(0, 0);
+        NSRange actualRun = NSMakeRange(0, 0);
+        NSDictionary *expectedAttrs = [expected attributesAtIndex:index effectiveRange:&expectedRun];
+        NSDictionary *actualAttrs = [actual attributesAtIndex:index effectiveRange:&actualRun];
+        XCTAssertEqualObjects([NSSet setWithArray:[actualAttrs allKeys]],
+                              [NSSet setWithArray:[expectedAttrs allKeys]],
+                              @"attribute names differ at %lu", (unsigned long)index);
+        for (NSString *name in expectedAttrs) {
+            id expectedValue = [expectedAttrs objectForKey:name];
+            id actualValue = [actualAttrs objectForKey:name];
+            if ([name isEqualToString:NSAttachmentAttributeName]) {
+                id expectedCell = [expectedValue attachmentCell];
+                id actualCell = [actualValue attachmentCell];
+                XCTAssertEqualObjects([actualCell class], [expectedCell class],
+                                      @"attachment cell differs at %lu", (unsigned long)index);
+                if ([expectedCell respondsToSelector:@selector(cellSize)] &&
+                    [actualCell respondsToSelector:@selector(cellSize)]) {
+                    NSSize expectedSize = [expectedCell cellSize];
+                    NSSize actualSize = [actualCell cellSize];
+                    XCTAssertEqualWithAccuracy(actualSize.width, expectedSize.width, 0.5);
+                    XCTAssertEqualWithAccuracy(actualSize.height, expectedSize.height, 0.5);
+                }
+            } else {
+                XCTAssertEqualObjects(actualValue, expectedValue,
+                                      @"%@ differs at %lu", name, (unsigned long)index);
+            }
+        }
+        index = MIN(NSMaxRange(expectedRun), NSMaxRange(actualRun));
+    }
+}
+
 - (void)testBasicMarkdownRenders
 {
     OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
@@ -440,6 +672,215 @@ static BOOL OMDMathToolchainAvailable(void)
     }
 }
 
+- (void)testRenderConfigurationKeyTracksZoomWidthAndWarmArtifacts
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [renderer setLayoutWidth:600.0];
+    NSString *key = [renderer renderConfigurationKey];
+    XCTAssertEqualObjects([renderer renderConfigurationKey], key);
+
+    [renderer setZoomScale:1.25];
+    NSString *zoomedKey = [renderer renderConfigurationKey];
+    XCTAssertFalse([zoomedKey isEqualToString:key]);
+
+    [renderer setLayoutWidth:480.0];
+    NSString *narrowKey = [renderer renderConfigurationKey];
+    XCTAssertFalse([narrowKey isEqualToString:zoomedKey]);
+
+    [renderer invalidateBlockRenderCache];
+    XCTAssertFalse([[renderer renderConfigurationKey] isEqualToString:narrowKey]);
+}
+
+- (void)testExportRenderMatchesSerialRenderInDocumentOrder
+{
+    NSString *imagePath = [self writeTemporaryImageOfSize:NSMakeSize(24.0, 16.0)];
+    NSMutableString *markdown = [NSMutableString string];
+    NSUInteger section = 0;
+    for (; section < 40; section++) {
+        [markdown appendFormat:@"## Section %lu\n\nParagraph with *emphasis* and `code` %lu.\n\n", (unsigned long)section, (unsigned long)section];
+        [markdown appendString:@"- first\n- second\n\n> quoted line\n\n```\nlet value = 1\n```\n\n"];
+        if (section % 8 == 0) {
+            [markdown appendString:@"| Name | Value |\n| ---- | ----: |\n| alpha | 1 |\n| beta | 23 |\n\n"];
+            [markdown appendFormat:@"![figure](%@)\n\n", [[NSURL fileURLWithPath:imagePath] absoluteString]];
+        }
+    }
+
+    OMMarkdownRenderer *serial = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [serial setLayoutWidth:540.0];
+    [serial setZoomScale:0.8];
+    NSAttributedString *expected = [serial attributedStringFromMarkdown:markdown];
+
+    OMMarkdownRenderer *exporter = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [exporter setLayoutWidth:540.0];
+    [exporter setZoomScale:0.8];
+    __block NSUInteger lastCompleted = 0;
+    __block NSUInteger lastTotal = 0;
+    NSAttributedString *rendered = [exporter exportAttributedStringFromMarkdown:markdown
+                                                                progressHandler:^(OMMarkdownRendererExportPhase phase,
+                                                                                  NSUInteger completed,
+                                                                                  NSUInteger total) {
+        if (phase == OMMarkdownRendererExportPhaseBlocks) {
+            lastCompleted = completed;
+            lastTotal = total;
+        }
+    }];
+
+    [self assertAttributedString:rendered matchesAttributedString:expected];
+    XCTAssertTrue([self attachmentCharacterCountInRenderedString:rendered] >= 10);
+    XCTAssertEqualObjects([exporter codeBlockRanges], [serial codeBlockRanges]);
+    XCTAssertEqualObjects([exporter blockquoteRanges], [serial blockquoteRanges]);
+    XCTAssertEqual([[exporter blockAnchors] count], [[serial blockAnchors] count]);
+    XCTAssertTrue(lastTotal > 0);
+    XCTAssertEqual(lastCompleted, lastTotal);
+    [self removeFileIfPresent:imagePath];
+}
+
+- (void)testExportAssetWalkQueuesEveryRenderedImageOnly
+{
+    NSMutableArray *paths = [NSMutableArray array];
+    NSUInteger index = 0;
+    for (; index < 4; index++) {
+        [paths addObject:[self writeTemporaryImageOfSize:NSMakeSize(20.0 + index, 12.0)]];
+    }
+    NSString *markdown = [NSString stringWithFormat:
+        @"# Title ![a](%@)\n\nText ![b](%@) here.\n\n- item ![c](%@)\n\n> quoted ![d](%@)\n\n"
+        @"```\n![not](%@)\n```\n\nInline `![not](%@)`.\n",
+        [[NSURL fileURLWithPath:[paths objectAtIndex:0]] absoluteString],
+        [[NSURL fileURLWithPath:[paths objectAtIndex:1]] absoluteString],
+        [[NSURL fileURLWithPath:[paths objectAtIndex:2]] absoluteString],
+        [[NSURL fileURLWithPath:[paths objectAtIndex:3]] absoluteString],
+        [[NSURL fileURLWithPath:[paths objectAtIndex:0]] absoluteString],
+        [[NSURL fileURLWithPath:[paths objectAtIndex:1]] absoluteString]];
+
+    OMMarkdownRenderer *exporter = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [exporter setLayoutWidth:500.0];
+    __block NSUInteger assetTotal = 0;
+    __block NSUInteger assetsFinished = 0;
+    NSAttributedString *rendered = [exporter exportAttributedStringFromMarkdown:markdown
+                                                                progressHandler:^(OMMarkdownRendererExportPhase phase,
+                                                                                  NSUInteger completed,
+                                                                                  NSUInteger total) {
+        if (phase == OMMarkdownRendererExportPhaseAssets) {
+            assetTotal = total;
+            assetsFinished = completed;
+        }
+    }];
+
+    // Images in code are text; the four others are queued by the tree walk
+    // before the single render, which finds them prepared.
+    XCTAssertEqual(assetTotal, (NSUInteger)4);
+    XCTAssertEqual(assetsFinished, (NSUInteger)4);
+    XCTAssertEqual([self attachmentCharacterCountInRenderedString:rendered], (NSUInteger)4);
+    for (NSString *path in paths) {
+        [self removeFileIfPresent:path];
+    }
+}
+
+- (void)testCancelledExportReturnsNil
+{
+    NSMutableString *markdown = [NSMutableString string];
+    NSUInteger section = 0;
+    for (; section < 20; section++) {
+        [markdown appendFormat:@"Paragraph %lu\n\n| A | B |\n| - | - |\n| 1 | 2 |\n\n", (unsigned long)section];
+    }
+    OMMarkdownRenderer *exporter = [[[OMMarkdownRenderer alloc] init] autorelease];
+    NSAttributedString *rendered = [exporter exportAttributedStringFromMarkdown:markdown
+                                                                 renderSettings:[exporter currentRenderSettings]
+                                                                progressHandler:nil
+                                                              cancellationCheck:^BOOL(void) {
+        return YES;
+    }];
+    XCTAssertNil(rendered);
+}
+
+- (void)testLargePipeTableDrawsLazilyFromSingleAttachment
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [renderer setLayoutWidth:600.0];
+    NSMutableString *markdown = [NSMutableString stringWithString:@"| id | name | notes |\n| --- | --- | --- |\n"];
+    NSUInteger rowIndex = 0;
+    for (; rowIndex < 2000; rowIndex++) {
+        if (rowIndex % 100 == 0) {
+            [markdown appendFormat:@"| %lu | row %lu | A much longer note that has to wrap onto several lines inside a narrow preview column. |\n",
+                                   (unsigned long)rowIndex, (unsigned long)rowIndex];
+        } else {
+            [markdown appendFormat:@"| %lu | row %lu | ok |\n", (unsigned long)rowIndex, (unsigned long)rowIndex];
+        }
+    }
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown];
+    XCTAssertNotNil(rendered);
+    XCTAssertEqual([self attachmentCharacterCountInRenderedString:rendered], (NSUInteger)1);
+
+    NSTextAttachment *attachment = [self firstAttachmentInRenderedString:rendered];
+    XCTAssertNotNil(attachment);
+    id cell = [attachment attachmentCell];
+    XCTAssertNotNil(cell);
+    if (cell == nil || ![cell respondsToSelector:@selector(cellSize)]) {
+        return;
+    }
+    NSSize size = [cell cellSize];
+    XCTAssertTrue(size.width <= 600.0);
+    XCTAssertTrue(size.height > 2000.0 * 12.0);
+
+    // Drawing without a view covers every row and settles the wrapped ones.
+    NSImage *canvas = [[[NSImage alloc] initWithSize:NSMakeSize(size.width, 64.0)] autorelease];
+    [canvas lockFocus];
+    [cell drawWithFrame:NSMakeRect(0.0, 0.0, size.width, size.height) inView:nil];
+    [canvas unlockFocus];
+    NSSize measuredSize = [cell cellSize];
+    XCTAssertEqualWithAccuracy(measuredSize.width, size.width, 0.5);
+    XCTAssertTrue(measuredSize.height > 2000.0 * 12.0);
+}
+
+- (void)testPipeTableTileKeyCoversInlineAttributes
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    NSString *plain = @"| a | b |\n| --- | --- |\n| word | y |\n";
+    NSString *emphasized = @"| a | b |\n| --- | --- |\n| **word** | y |\n";
+    id plainCell = [[self firstAttachmentInRenderedString:[renderer attributedStringFromMarkdown:plain]] attachmentCell];
+    id plainAgainCell = [[self firstAttachmentInRenderedString:[renderer attributedStringFromMarkdown:plain]] attachmentCell];
+    id emphasizedCell = [[self firstAttachmentInRenderedString:[renderer attributedStringFromMarkdown:emphasized]] attachmentCell];
+    NSString *plainKey = [plainCell valueForKey:@"tileCacheKey"];
+    XCTAssertNotNil(plainKey);
+    XCTAssertEqualObjects([plainAgainCell valueForKey:@"tileCacheKey"], plainKey);
+    XCTAssertFalse([[emphasizedCell valueForKey:@"tileCacheKey"] isEqual:plainKey]);
+}
+
+- (void)testLargePipeTableDrawnInTextViewRelaysOutThroughItsLayoutManager
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [renderer setLayoutWidth:600.0];
+    NSMutableString *markdown = [NSMutableString stringWithString:@"| id | notes |\n| --- | --- |\n"];
+    NSUInteger rowIndex = 0;
+    for (; rowIndex < 200; rowIndex++) {
+        [markdown appendFormat:@"| %lu | A much longer note that has to wrap onto several lines inside a narrow preview column. |\n",
+                               (unsigned long)rowIndex];
+    }
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown];
+    NSString *attachmentMarker = [NSString stringWithCharacters:(unichar[]){NSAttachmentCharacter} length:1];
+    NSUInteger charIndex = [[rendered string] rangeOfString:attachmentMarker].location;
+    XCTAssertTrue(charIndex != NSNotFound);
+    if (charIndex == NSNotFound) {
+        return;
+    }
+    id cell = [[self firstAttachmentInRenderedString:rendered] attachmentCell];
+    NSSize size = [cell cellSize];
+
+    NSTextView *textView = [[[NSTextView alloc] initWithFrame:NSMakeRect(0.0, 0.0, 640.0, 400.0)] autorelease];
+    [[textView textStorage] setAttributedString:rendered];
+    // The three-argument entry point carries no layout manager; the cell
+    // must still find the text view's to lay out its new height.
+    NSImage *canvas = [[[NSImage alloc] initWithSize:NSMakeSize(size.width, 64.0)] autorelease];
+    [canvas lockFocus];
+    [cell drawWithFrame:NSMakeRect(0.0, 0.0, size.width, size.height) inView:textView characterIndex:charIndex];
+    [canvas unlockFocus];
+    XCTAssertTrue([cell cellSize].height != size.height);
+    XCTAssertEqual([cell valueForKey:@"relayoutManager"], [textView layoutManager]);
+
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    XCTAssertNil([cell valueForKey:@"relayoutManager"]);
+}
+
 - (void)testInlineMathDollarsAreStyled
 {
     OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
@@ -588,6 +1029,80 @@ static BOOL OMDMathToolchainAvailable(void)
     XCTAssertTrue([text rangeOfString:@"D_{nom,yr} ="].location == NSNotFound);
 }
 
+- (NSArray *)attachmentCellSizesInRenderedString:(NSAttributedString *)rendered
+{
+    NSMutableArray *sizes = [NSMutableArray array];
+    NSString *text = [rendered string];
+    NSUInteger index = 0;
+    for (; index < [text length]; index++) {
+        if ([text characterAtIndex:index] != NSAttachmentCharacter) {
+            continue;
+        }
+        NSTextAttachment *attachment = [rendered attribute:NSAttachmentAttributeName atIndex:index effectiveRange:NULL];
+        [sizes addObject:[NSValue valueWithSize:[[attachment attachmentCell] cellSize]]];
+    }
+    return sizes;
+}
+
+- (void)testBatchedMathMatchesPerFormulaCompilation
+{
+    if (!OMDMathToolchainAvailable()) {
+        return;
+    }
+
+    OMMarkdownParsingOptions *options = [OMMarkdownParsingOptions defaultOptions];
+    [options setMathRenderingPolicy:OMMarkdownMathRenderingPolicyExternalTools];
+
+    // Compiled one formula per TeX run. The leading \relax typesets nothing
+    // but keeps these out of the artifact caches the batches fill below.
+    NSArray *singles = [NSArray arrayWithObjects:
+        @"\\relax \\frac{a}{b}",
+        @"\\relax x^{2}+y^{2}",
+        @"\\relax \\sum_{i=1}^{n} i",
+        @"\\relax \\omdbatchleak + 1",
+        nil];
+    NSMutableArray *expectedSizes = [NSMutableArray array];
+    for (NSString *formula in singles) {
+        OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] initWithTheme:nil
+                                                                    parsingOptions:options] autorelease];
+        NSAttributedString *rendered = [renderer attributedStringFromMarkdown:[NSString stringWithFormat:@"$%@$", formula]];
+        [expectedSizes addObjectsFromArray:[self attachmentCellSizesInRenderedString:rendered]];
+    }
+    // The undefined macro fails on its own.
+    XCTAssertEqual([expectedSizes count], (NSUInteger)3);
+
+    // One clean batch, and one where the definition must not reach the next
+    // formula: it is compiled alone, the batch then fails on the undefined
+    // macro and falls back to single runs.
+    NSArray *documents = [NSArray arrayWithObjects:
+        @"$\\frac{a}{b}$\n\n$x^{2}+y^{2}$\n\n$\\sum_{i=1}^{n} i$\n",
+        @"$\\gdef\\omdbatchleak{z} w$\n\n$\\relax\\relax \\frac{a}{b}$\n\n$\\omdbatchleak + 1$\n\n$\\relax\\relax x^{2}+y^{2}$\n\n$\\relax\\relax \\sum_{i=1}^{n} i$\n",
+        nil];
+    NSUInteger documentIndex = 0;
+    for (NSString *markdown in documents) {
+        OMMarkdownRenderer *exporter = [[[OMMarkdownRenderer alloc] initWithTheme:nil
+                                                                    parsingOptions:options] autorelease];
+        NSAttributedString *rendered = [exporter exportAttributedStringFromMarkdown:markdown progressHandler:nil];
+        NSMutableArray *sizes = [[[self attachmentCellSizesInRenderedString:rendered] mutableCopy] autorelease];
+        if (documentIndex == 1) {
+            // The \gdef formula itself renders; only the ones after it compare.
+            XCTAssertEqual([sizes count], (NSUInteger)4);
+            if ([sizes count] > 0) {
+                [sizes removeObjectAtIndex:0];
+            }
+        }
+        XCTAssertEqual([sizes count], [expectedSizes count]);
+        NSUInteger index = 0;
+        for (; index < MIN([sizes count], [expectedSizes count]); index++) {
+            NSSize size = [[sizes objectAtIndex:index] sizeValue];
+            NSSize expected = [[expectedSizes objectAtIndex:index] sizeValue];
+            XCTAssertEqualWithAccuracy(size.width, expected.width, 0.5);
+            XCTAssertEqualWithAccuracy(size.height, expected.height, 0.5);
+        }
+        documentIndex++;
+    }
+}
+
 - (void)testDisplayMathBlockSurvivesSetextHeadingInterpretation
 {
     if (!OMDMathToolchainAvailable()) {
@@ -675,6 +1190,76 @@ static BOOL OMDMathToolchainAvailable(void)
     [self removeFileIfPresent:path];
 }
 
+- (void)testAsynchronousLocalImageUsesSizedPlaceholderUntilWarm
+{
+    NSString *path = [self writeTemporaryImageOfSize:NSMakeSize(1200.0, 300.0)];
+    NSString *markdown = [NSString stringWithFormat:@"Wide: ![wide](%@)", path];
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [renderer setLayoutWidth:420.0];
+    [renderer setAsynchronousImageLoadingEnabled:YES];
+
+    __block BOOL warmed = NO;
+    id observer = [[NSNotificationCenter defaultCenter] addObserverForName:OMMarkdownRendererRemoteImagesDidWarmNotification
+                                                                    object:nil
+                                                                     queue:nil
+                                                                usingBlock:^(NSNotification *notification) {
+        (void)notification;
+        warmed = YES;
+    }];
+
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown];
+    NSTextAttachment *attachment = [self firstAttachmentInRenderedString:rendered];
+    XCTAssertNotNil(attachment);
+    NSSize placeholderSize = [[attachment attachmentCell] cellSize];
+    XCTAssertEqualWithAccuracy(placeholderSize.width, 396.0, 0.5);
+    XCTAssertEqualWithAccuracy(placeholderSize.height, 99.0, 0.5);
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:10.0];
+    while (!warmed && [deadline timeIntervalSinceNow] > 0.0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                                 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    }
+    [[NSNotificationCenter defaultCenter] removeObserver:observer];
+    XCTAssertTrue(warmed);
+
+    rendered = [renderer attributedStringFromMarkdown:markdown];
+    attachment = [self firstAttachmentInRenderedString:rendered];
+    XCTAssertNotNil(attachment);
+    NSImage *image = [[attachment attachmentCell] image];
+    XCTAssertNotNil(image);
+    XCTAssertEqualWithAccuracy([image size].width, 396.0, 0.5);
+    [self removeFileIfPresent:path];
+}
+
+- (void)testPreparedLocalImageIsReadFromDiskByFreshRenderer
+{
+    OMDiskCache *diskCache = [OMMarkdownRenderer imageDiskCache];
+    if (![diskCache isEnabled]) {
+        return;
+    }
+    NSString *path = [self writeTemporaryImageOfSize:NSMakeSize(40.0, 20.0)];
+    NSString *markdown = [NSString stringWithFormat:@"Small: ![small](%@)", path];
+
+    OMMarkdownRenderer *first = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [first setLayoutWidth:420.0];
+    NSUInteger missesBefore = [diskCache missCount];
+    XCTAssertNotNil([self firstAttachmentInRenderedString:[first attributedStringFromMarkdown:markdown]]);
+    XCTAssertEqual([diskCache missCount], missesBefore + 1);
+
+    // A different layout width misses the in-memory cache, but the image is
+    // shown at the same size, so its prepared copy comes from disk.
+    NSUInteger hitsBefore = [diskCache hitCount];
+    OMMarkdownRenderer *fresh = [[[OMMarkdownRenderer alloc] init] autorelease];
+    [fresh setLayoutWidth:520.0];
+    NSTextAttachment *attachment = [self firstAttachmentInRenderedString:[fresh attributedStringFromMarkdown:markdown]];
+    XCTAssertEqual([diskCache hitCount], hitsBefore + 1);
+    NSImage *image = [[attachment attachmentCell] image];
+    XCTAssertNotNil(image);
+    XCTAssertEqualWithAccuracy([image size].width, 40.0, 0.5);
+    XCTAssertEqualWithAccuracy([image size].height, 20.0, 0.5);
+    [self removeFileIfPresent:path];
+}
+
 - (void)testMathPolicyDisabledPreservesDollarSyntax
 {
     OMMarkdownParsingOptions *options = [OMMarkdownParsingOptions defaultOptions];
@@ -804,6 +1389,78 @@ static BOOL OMDMathToolchainAvailable(void)
     XCTAssertTrue([[rendered string] rangeOfString:@"[image: remote-alt]"].location != NSNotFound);
 }
 
+- (void)testRemoteImagesAreFetchedByBoundedWorkersAndResampled
+{
+    OMDTestHTTPServer *server = [[[OMDTestHTTPServer alloc] init] autorelease];
+    XCTAssertNotNil(server);
+    NSString *path = [self writeTemporaryImageOfSize:NSMakeSize(1200.0, 300.0)];
+    NSData *png = [NSData dataWithContentsOfFile:path];
+    [self removeFileIfPresent:path];
+    XCTAssertNotNil(png);
+    [server setBody:png contentType:@"image/png" etag:@"\"wide-v1\"" forPathContaining:@".png"];
+
+    // More images than there are workers, each at a distinct URL.
+    NSUInteger imageCount = 12;
+    NSString *token = [[NSProcessInfo processInfo] globallyUniqueString];
+    NSMutableString *markdown = [NSMutableString string];
+    NSUInteger index = 0;
+    for (; index < imageCount; index++) {
+        [markdown appendFormat:@"![remote-%lu](%@/%@-%lu.png)\n\n",
+                               (unsigned long)index, [server baseURL], token, (unsigned long)index];
+    }
+
+    OMMarkdownParsingOptions *options = [OMMarkdownParsingOptions defaultOptions];
+    [options setAllowRemoteImages:YES];
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] initWithTheme:nil
+                                                                parsingOptions:options] autorelease];
+    [renderer setLayoutWidth:420.0];
+
+    __block BOOL warmed = NO;
+    id observer = [[NSNotificationCenter defaultCenter] addObserverForName:OMMarkdownRendererRemoteImagesDidWarmNotification
+                                                                    object:nil
+                                                                     queue:nil
+                                                                usingBlock:^(NSNotification *notification) {
+        (void)notification;
+        warmed = YES;
+    }];
+
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown];
+    XCTAssertNotNil(rendered);
+
+    // Spinning the run loop also serves the resampling draws the workers
+    // hand to the main thread.
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:20.0];
+    while ([[server requests] count] < imageCount && [deadline timeIntervalSinceNow] > 0.0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                                 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    }
+    while (!warmed && [deadline timeIntervalSinceNow] > 0.0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                                 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    }
+    [[NSNotificationCenter defaultCenter] removeObserver:observer];
+    XCTAssertTrue(warmed);
+    XCTAssertEqual([[server requests] count], imageCount);
+
+    rendered = [renderer attributedStringFromMarkdown:markdown];
+    XCTAssertEqual([self attachmentCharacterCountInRenderedString:rendered], imageCount);
+    NSTextAttachment *attachment = [self firstAttachmentInRenderedString:rendered];
+    NSImage *image = [[attachment attachmentCell] image];
+    XCTAssertNotNil(image);
+    XCTAssertEqualWithAccuracy([image size].width, 396.0, 0.5);
+    NSBitmapImageRep *bitmap = nil;
+    for (NSImageRep *representation in [image representations]) {
+        if ([representation isKindOfClass:[NSBitmapImageRep class]]) {
+            bitmap = (NSBitmapImageRep *)representation;
+        }
+    }
+    XCTAssertNotNil(bitmap);
+    XCTAssertTrue([bitmap pixelsWide] < 1200);
+    // The second pass is served from the attachment cache.
+    XCTAssertEqual([[server requests] count], imageCount);
+    [server stop];
+}
+
 - (void)testBlockAnchorsExposeSourceLineMapping
 {
     OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
@@ -856,6 +1513,128 @@ static BOOL OMDMathToolchainAvailable(void)
     XCTAssertTrue(mappedSecondAlphaLine);
 }
 
+- (void)testIncrementalRenderReusesUnchangedBlocksAndReportsChangedRange
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    OMMarkdownRenderer *fullRenderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    NSString *before = @"# Title\n\nalpha paragraph\n\n- one\n- two\n\n```objc\nint x = 1;\n```\n\nomega\n";
+    NSString *after = @"# Title\n\nalpha paragraph edited\n\n- one\n- two\n\n```objc\nint x = 1;\n```\n\nomega\n";
+
+    NSRange previousChanged = NSMakeRange(NSNotFound, 0);
+    NSRange changed = NSMakeRange(NSNotFound, 0);
+    NSAttributedString *first = [renderer attributedStringFromMarkdown:before
+                                                  previousChangedRange:&previousChanged
+                                                          changedRange:&changed];
+    XCTAssertEqualObjects([first string], [[fullRenderer attributedStringFromMarkdown:before] string]);
+    XCTAssertEqual(previousChanged.location, (NSUInteger)0);
+    XCTAssertEqual(previousChanged.length, (NSUInteger)0);
+    XCTAssertEqual(changed.length, [first length]);
+    XCTAssertEqual([renderer lastReusedBlockCount], (NSUInteger)0);
+
+    NSAttributedString *second = [renderer attributedStringFromMarkdown:after
+                                                   previousChangedRange:&previousChanged
+                                                           changedRange:&changed];
+    NSAttributedString *expected = [fullRenderer attributedStringFromMarkdown:after];
+    XCTAssertEqualObjects([second string], [expected string]);
+    XCTAssertEqual([renderer lastRenderedBlockCount], (NSUInteger)5);
+    XCTAssertEqual([renderer lastReusedBlockCount], (NSUInteger)4);
+    XCTAssertEqual([[renderer blockAnchors] count], [[fullRenderer blockAnchors] count]);
+    XCTAssertEqualObjects([renderer codeBlockRanges], [fullRenderer codeBlockRanges]);
+
+    NSMutableAttributedString *spliced = [[[NSMutableAttributedString alloc] initWithAttributedString:first] autorelease];
+    [spliced replaceCharactersInRange:previousChanged
+                 withAttributedString:[second attributedSubstringFromRange:changed]];
+    XCTAssertEqualObjects([spliced string], [second string]);
+    XCTAssertTrue(changed.length < [second length]);
+
+    NSAttributedString *third = [renderer attributedStringFromMarkdown:after
+                                                  previousChangedRange:&previousChanged
+                                                          changedRange:&changed];
+    XCTAssertEqualObjects([third string], [second string]);
+    XCTAssertEqual(previousChanged.length, (NSUInteger)0);
+    XCTAssertEqual(changed.length, (NSUInteger)0);
+    XCTAssertEqual([renderer lastReusedBlockCount], (NSUInteger)5);
+}
+
+- (void)testCancelledIncrementalRenderLeavesPreviousRenderAsDiffBaseline
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    NSString *before = @"# Title\n\nalpha\n\nomega\n";
+    NSString *abandoned = @"# Title\n\nalpha abandoned\n\nomega\n";
+    NSString *after = @"# Title\n\nalpha\n\nomega edited\n";
+
+    NSRange previousChanged = NSMakeRange(0, 0);
+    NSRange changed = NSMakeRange(0, 0);
+    NSAttributedString *first = [renderer attributedStringFromMarkdown:before
+                                                  previousChangedRange:&previousChanged
+                                                          changedRange:&changed];
+    XCTAssertNotNil(first);
+
+    NSAttributedString *cancelled = [renderer attributedStringFromMarkdown:abandoned
+                                                      previousChangedRange:&previousChanged
+                                                              changedRange:&changed
+                                                         cancellationCheck:^BOOL(void) {
+        return YES;
+    }];
+    XCTAssertNil(cancelled);
+
+    NSAttributedString *second = [renderer attributedStringFromMarkdown:after
+                                                   previousChangedRange:&previousChanged
+                                                           changedRange:&changed];
+    NSMutableAttributedString *spliced = [[[NSMutableAttributedString alloc] initWithAttributedString:first] autorelease];
+    [spliced replaceCharactersInRange:previousChanged
+                 withAttributedString:[second attributedSubstringFromRange:changed]];
+    XCTAssertEqualObjects([spliced string], [second string]);
+    XCTAssertEqual([renderer lastReusedBlockCount], (NSUInteger)2);
+}
+
+- (void)testProgressiveRenderReportsViewportFirstThenAssemblesDocumentInOrder
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    OMMarkdownRenderer *fullRenderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    NSMutableString *markdown = [NSMutableString string];
+    for (NSUInteger index = 0; index < 40; index++) {
+        [markdown appendFormat:@"## Section %lu\n\nParagraph %lu body.\n\n", (unsigned long)index, (unsigned long)index];
+    }
+
+    // Sections start every four lines, so lines 81-88 hold sections 20 and 21.
+    NSMutableAttributedString *assembled = [[[NSMutableAttributedString alloc] init] autorelease];
+    __block NSString *priorityText = nil;
+    __block NSUInteger callCount = 0;
+    __block BOOL offsetsContiguous = YES;
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown
+                                                        priorityLineRange:NSMakeRange(81, 8)
+                                                         progressInterval:64
+                                                          progressHandler:^(NSAttributedString *partial,
+                                                                            NSUInteger offset,
+                                                                            NSArray *codeBlockRanges,
+                                                                            NSArray *blockquoteRanges,
+                                                                            NSArray *blockAnchors,
+                                                                            BOOL priorityOnly) {
+        (void)codeBlockRanges;
+        (void)blockquoteRanges;
+        (void)blockAnchors;
+        if (callCount == 0 && priorityOnly) {
+            priorityText = [[[partial string] copy] autorelease];
+        } else if (!priorityOnly) {
+            offsetsContiguous = offsetsContiguous && (offset == [assembled length]);
+            [assembled appendAttributedString:partial];
+        }
+        callCount += 1;
+    }
+                                                        cancellationCheck:nil];
+
+    XCTAssertEqualObjects([rendered string], [[fullRenderer attributedStringFromMarkdown:markdown] string]);
+    XCTAssertNotNil(priorityText);
+    XCTAssertTrue([priorityText rangeOfString:@"Section 20"].location != NSNotFound);
+    XCTAssertTrue([priorityText rangeOfString:@"Paragraph 21 body."].location != NSNotFound);
+    XCTAssertTrue([priorityText rangeOfString:@"Section 3\n"].location == NSNotFound);
+    XCTAssertTrue(offsetsContiguous);
+    XCTAssertTrue(callCount > 2);
+    XCTAssertTrue([[assembled string] hasPrefix:[rendered string]] ||
+                  [[rendered string] hasPrefix:[assembled string]]);
+}
+
 - (void)testObjectiveCCodeBlockSyntaxHighlightingAppliesDistinctTokenColors
 {
     OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
@@ -998,6 +1777,251 @@ static BOOL OMDMathToolchainAvailable(void)
     }
 }
 
+- (void)testJSONCodeBlockSyntaxHighlightingSeparatesKeysFromValues
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    NSString *markdown = @"```json\n{\"count\": 42, \"name\": \"v2\", \"ok\": true}\n```";
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown];
+    XCTAssertNotNil(rendered);
+
+    NSString *text = [rendered string];
+    NSRange keyRange = [text rangeOfString:@"\"count\":"];
+    NSRange numberRange = [text rangeOfString:@"42"];
+    NSRange stringRange = [text rangeOfString:@"\"v2\""];
+    NSRange keywordRange = [text rangeOfString:@"true"];
+    XCTAssertTrue(keyRange.location != NSNotFound);
+    XCTAssertTrue(numberRange.location != NSNotFound);
+    XCTAssertTrue(stringRange.location != NSNotFound);
+    XCTAssertTrue(keywordRange.location != NSNotFound);
+    if (keyRange.location == NSNotFound ||
+        numberRange.location == NSNotFound ||
+        stringRange.location == NSNotFound ||
+        keywordRange.location == NSNotFound ||
+        ![OMMarkdownRenderer isTreeSitterAvailable]) {
+        return;
+    }
+
+    // The whole key, colon included, is one run in the key color.
+    NSRange keyRun = NSMakeRange(0, 0);
+    NSColor *keyColor = [rendered attribute:NSForegroundColorAttributeName
+                                    atIndex:keyRange.location
+                             effectiveRange:&keyRun];
+    NSColor *numberColor = [[rendered attributesAtIndex:numberRange.location effectiveRange:NULL] objectForKey:NSForegroundColorAttributeName];
+    NSColor *stringColor = [[rendered attributesAtIndex:stringRange.location effectiveRange:NULL] objectForKey:NSForegroundColorAttributeName];
+    NSColor *keywordColor = [[rendered attributesAtIndex:keywordRange.location effectiveRange:NULL] objectForKey:NSForegroundColorAttributeName];
+    XCTAssertTrue(NSLocationInRange(NSMaxRange(keyRange) - 1, keyRun));
+    XCTAssertFalse([keyColor isEqual:stringColor]);
+    XCTAssertFalse([numberColor isEqual:stringColor]);
+    XCTAssertFalse([keywordColor isEqual:stringColor]);
+    XCTAssertFalse([keywordColor isEqual:numberColor]);
+    // The digit inside the string value stays string colored.
+    NSColor *innerDigitColor = [[rendered attributesAtIndex:stringRange.location + 2 effectiveRange:NULL] objectForKey:NSForegroundColorAttributeName];
+    XCTAssertEqualObjects(innerDigitColor, stringColor);
+}
+
+- (void)testLargeCodeBlockSyntaxHighlightingReachesLastLine
+{
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    NSMutableString *markdown = [NSMutableString stringWithString:@"```python\n# first\n"];
+    NSUInteger line = 0;
+    for (; line < 5000; line++) {
+        [markdown appendFormat:@"value_%lu = '%lu'\n", (unsigned long)line, (unsigned long)line];
+    }
+    [markdown appendString:@"# last\n```\n"];
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown];
+    XCTAssertNotNil(rendered);
+
+    NSString *text = [rendered string];
+    NSRange firstRange = [text rangeOfString:@"# first"];
+    NSRange lastRange = [text rangeOfString:@"# last"];
+    NSRange plainRange = [text rangeOfString:@"value_4999"];
+    XCTAssertTrue(firstRange.location != NSNotFound);
+    XCTAssertTrue(lastRange.location != NSNotFound);
+    XCTAssertTrue(plainRange.location != NSNotFound);
+    if (firstRange.location == NSNotFound ||
+        lastRange.location == NSNotFound ||
+        plainRange.location == NSNotFound ||
+        ![OMMarkdownRenderer isTreeSitterAvailable]) {
+        return;
+    }
+
+    NSColor *firstColor = [[rendered attributesAtIndex:firstRange.location effectiveRange:NULL] objectForKey:NSForegroundColorAttributeName];
+    NSColor *lastColor = [[rendered attributesAtIndex:lastRange.location effectiveRange:NULL] objectForKey:NSForegroundColorAttributeName];
+    NSColor *plainColor = [[rendered attributesAtIndex:plainRange.location effectiveRange:NULL] objectForKey:NSForegroundColorAttributeName];
+    XCTAssertEqualObjects(firstColor, lastColor);
+    XCTAssertFalse([lastColor isEqual:plainColor]);
+}
+
+- (void)assertCodeLexerMatchesRegexHighlighterForCode:(NSString *)code
+                                           fenceToken:(NSString *)token
+                                             renderer:(OMMarkdownRenderer *)renderer
+{
+    NSArray *rules = OMDRegexHighlighterRulesForFenceToken(token);
+    XCTAssertNotNil(rules, @"no reference rules for %@", token);
+    NSString *body = [code hasSuffix:@"\n"] ? [code substringToIndex:[code length] - 1] : code;
+    if (rules == nil || [body length] == 0) {
+        return;
+    }
+
+    NSString *markdown = [NSString stringWithFormat:@"```%@\n%@```\n", token, code];
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown];
+    NSRange bodyRange = [[rendered string] rangeOfString:body];
+    XCTAssertTrue(bodyRange.location != NSNotFound, @"%@ block text not found in the rendering", token);
+    if (bodyRange.location == NSNotFound) {
+        return;
+    }
+
+    // Palette colors depend on the theme, so classes are matched to colors
+    // as they are seen: each class must keep one color, and no two classes
+    // (plain text included) may share one.
+    const uint8_t *classes = (const uint8_t *)[OMDRegexHighlighterTokenClasses(code, rules) bytes];
+    NSMutableDictionary *colorsByClass = [NSMutableDictionary dictionary];
+    NSUInteger index = 0;
+    for (; index < bodyRange.length; index++) {
+        id color = [rendered attribute:NSForegroundColorAttributeName
+                               atIndex:bodyRange.location + index
+                        effectiveRange:NULL];
+        if (color == nil) {
+            color = [NSNull null];
+        }
+        NSNumber *tokenClass = [NSNumber numberWithUnsignedInt:classes[index]];
+        id expected = [colorsByClass objectForKey:tokenClass];
+        if (expected == nil) {
+            [colorsByClass setObject:color forKey:tokenClass];
+        } else if (![expected isEqual:color]) {
+            NSRange line = [body lineRangeForRange:NSMakeRange(index, 0)];
+            XCTFail(@"%@: offset %lu (class %u) differs from the regex highlighter in line %@",
+                    token,
+                    (unsigned long)index,
+                    (unsigned)classes[index],
+                    [body substringWithRange:line]);
+            return;
+        }
+    }
+    NSSet *distinctColors = [NSSet setWithArray:[colorsByClass allValues]];
+    XCTAssertEqual([distinctColors count], [colorsByClass count], @"%@: token classes share a color", token);
+}
+
+- (void)testCodeLexerMatchesRegexHighlighterOnCorpus
+{
+    if (![OMMarkdownRenderer isTreeSitterAvailable]) {
+        return;
+    }
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+
+#ifdef OMD_TEST_CORPUS_DIR
+    NSString *corpusPath = [@OMD_TEST_CORPUS_DIR stringByAppendingPathComponent:@"code.md"];
+    NSArray *corpusBlocks = OMDFencedCodeBlocksInFile(corpusPath);
+    XCTAssertTrue([corpusBlocks count] > 0, @"no fenced blocks in %@", corpusPath);
+    for (NSArray *block in corpusBlocks) {
+        [self assertCodeLexerMatchesRegexHighlighterForCode:[block objectAtIndex:1]
+                                                 fenceToken:[block objectAtIndex:0]
+                                                   renderer:renderer];
+    }
+#endif
+
+    // The languages the benchmark corpus leaves out, and the edges of the
+    // patterns: escapes, comment markers inside strings, comments spanning
+    // lines, signed numbers, word boundaries and lookarounds.
+    NSArray *samples = [NSArray arrayWithObjects:
+        @"c", @"#define LIMIT 0x1F\nchar c = '\\''; // it's \"quoted\"\nint x = 3.25 + y2 + 7; /* a\n  b */ return x;\n",
+        @"objc", @"@interface A : NSObject @end\nNSString *s = @\"esc \\\" // not a comment\";\nif (self.value) { id x = nil; }\n",
+        @"python", @"@decorator\ndef f(x=0x10):\n    '''doc # not comment\n    spans'''\n    return \"a\\\"b\" # trailing\n",
+        @"javascript", @"const s = `tpl ${a}` + 'it\\'s'; // c\nlet n = 0xff + 1.5;\n/* block\n comment */ class A extends B {}\n",
+        @"typescript", @"interface Point { readonly x: number; }\nconst s = `tpl`; // c\nlet n: any = 0x1F + 2.5;\nenum E { A }\n",
+        @"json", @"{\"key\": \"value with \\\"quote\\\"\", \"n\": -12.5, \"ok\": true, \"none\": null,\n \"list\": [1, 2, 3]}\n",
+        @"bash", @"for f in *.md; do\n  echo \"${HOME}/$f # not comment\" # comment\ndone\nexport COUNT=10\n",
+        @"markdown", @"# Heading\nSome **bold** and *em* and _u_ and __strong__ text.\n[link](http://x.y) and `code` and $x^2$.\n$$\na+b\n$$\n",
+        @"yaml", @"# comment\n- item: \"quoted # text\"\n  count: -3.5\n  flag: yes\nkey_two: 'single'\n",
+        @"toml", @"# top\n[server]\nhost = \"localhost\"\nport = 8080\nenabled = true\nratio = -0.25\n",
+        @"sql", @"SELECT id, name FROM users WHERE age > 21 -- adults\n  and status = 'active' /* block\n comment */ Order By name LIMIT 10;\n",
+        @"ruby", @"require 'json'\nclass Foo\n  attr_reader :bar # symbol\n  def run(x = 0x10)\n    puts \"#{x}\" unless x.nil?\n  end\nend\n",
+        @"html", @"<!-- header\n comment -->\n<div class=\"box\" data-id='7'>\n  <span style=\"width: 10px\">42</span>\n</div>\n",
+        nil];
+    NSUInteger index = 0;
+    for (; index + 1 < [samples count]; index += 2) {
+        [self assertCodeLexerMatchesRegexHighlighterForCode:[samples objectAtIndex:index + 1]
+                                                 fenceToken:[samples objectAtIndex:index]
+                                                   renderer:renderer];
+    }
+}
+
+// Best of three renders; each adds a distinct paragraph so none is served
+// from the render cache.
+static NSTimeInterval OMDBestRenderSeconds(OMMarkdownRenderer *renderer, NSString *markdown)
+{
+    NSTimeInterval best = 0.0;
+    NSUInteger run = 0;
+    for (; run < 3; run++) {
+        NSString *source = [NSString stringWithFormat:@"%@\nrun %lu\n", markdown, (unsigned long)run];
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        [renderer attributedStringFromMarkdown:source];
+        NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - start;
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+- (void)testCodeLexerIsFasterThanRegexHighlighterOnTenThousandLines
+{
+    if (![OMMarkdownRenderer isTreeSitterAvailable]) {
+        return;
+    }
+    NSString *snippet = @"#import <Foundation/Foundation.h>\n"
+                        @"@implementation Counter\n"
+                        @"- (void)incrementBy:(NSUInteger)step\n"
+                        @"{\n"
+                        @"    /* clamp the step */\n"
+                        @"    if (step > 0x10) { step = 16; }\n"
+                        @"    self.value += step; // 2.5x faster\n"
+                        @"    NSLog(@\"value %lu // not a comment\", (unsigned long)self.value);\n"
+                        @"}\n"
+                        @"@end\n";
+    NSMutableString *code = [NSMutableString string];
+    NSUInteger copy = 0;
+    for (; copy < 1000; copy++) {
+        [code appendString:snippet];
+    }
+    NSString *markdown = [NSString stringWithFormat:@"```objc\n%@```\n", code];
+
+    OMMarkdownParsingOptions *plainOptions = [OMMarkdownParsingOptions defaultOptions];
+    [plainOptions setCodeSyntaxHighlightingEnabled:NO];
+    OMMarkdownRenderer *plain = [[[OMMarkdownRenderer alloc] initWithTheme:nil parsingOptions:plainOptions] autorelease];
+    OMMarkdownParsingOptions *highlightOptions = [OMMarkdownParsingOptions defaultOptions];
+    [highlightOptions setCodeSyntaxHighlightingEnabled:YES];
+    OMMarkdownRenderer *highlighted = [[[OMMarkdownRenderer alloc] initWithTheme:nil parsingOptions:highlightOptions] autorelease];
+    [plain attributedStringFromMarkdown:@"```objc\nint x = 1;\n```\n"];
+    [highlighted attributedStringFromMarkdown:@"```objc\nint x = 1;\n```\n"];
+
+    // The lexer's share of a render, including painting its runs, against
+    // the reference's pattern matching alone.
+    NSTimeInterval lexer = OMDBestRenderSeconds(highlighted, markdown) - OMDBestRenderSeconds(plain, markdown);
+    if (lexer < 0.0001) {
+        lexer = 0.0001;
+    }
+    NSArray *rules = OMDRegexHighlighterRulesForFenceToken(@"objc");
+    NSTimeInterval regex = 0.0;
+    NSUInteger run = 0;
+    for (; run < 3; run++) {
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        OMDRegexHighlighterTokenClasses(code, rules);
+        NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - start;
+        if (run == 0 || elapsed < regex) {
+            regex = elapsed;
+        }
+    }
+    NSLog(@"[Perf][Tests] code-lexer lines=10000 lexer=%.1fms regex=%.1fms speedup=%.1fx",
+          lexer * 1000.0,
+          regex * 1000.0,
+          regex / lexer);
+    XCTAssertTrue(lexer < regex,
+                  @"code lexer took %.1fms on 10k lines, regex reference %.1fms",
+                  lexer * 1000.0,
+                  regex * 1000.0);
+}
+
 - (void)testMathPolicyTransitionsBetweenStyledAndDisabled
 {
     NSString *markdown = @"Transition $a^2+b^2=c^2$ sample.";
@@ -1100,6 +2124,85 @@ static BOOL OMDMathToolchainAvailable(void)
     XCTAssertEqual([failures count], (NSUInteger)0, @"%@", [failures componentsJoinedByString:@"\n"]);
 }
 
+- (void)testDocumentSnapshotIndexesLinesAndBlockAncestry
+{
+    NSString *markdown = @"# Title\r\n\n> quote\n\n- item\n\n```\ncode\n```\n";
+    OMMarkdownDocumentSnapshot *snapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:markdown];
+    XCTAssertNotNil(snapshot);
+    XCTAssertEqual([snapshot lineCount], (NSUInteger)9);
+    XCTAssertTrue(NSEqualRanges([snapshot rangeOfLine:1], NSMakeRange(0, 7)));
+    XCTAssertEqual([snapshot lineNumberForCharacterIndex:8], (NSUInteger)1);
+    XCTAssertEqual([snapshot lineNumberForCharacterIndex:10], (NSUInteger)3);
+    XCTAssertEqualObjects([[snapshot sourceLines] objectAtIndex:2], @"> quote");
+
+    // heading, quote, paragraph, list, item, paragraph, code block
+    XCTAssertEqual([snapshot blockCount], (NSUInteger)7);
+    const OMMarkdownBlockDescriptor *blocks = [snapshot blockDescriptors];
+    XCTAssertTrue((blocks[0].flags & OMMarkdownBlockFlagTopLevel) != 0);
+    XCTAssertTrue((blocks[2].flags & OMMarkdownBlockFlagInBlockquote) != 0);
+    XCTAssertTrue((blocks[2].flags & OMMarkdownBlockFlagTopLevel) == 0);
+    XCTAssertTrue((blocks[5].flags & OMMarkdownBlockFlagInList) != 0);
+    XCTAssertTrue((blocks[6].flags & OMMarkdownBlockFlagInCodeBlock) != 0);
+    XCTAssertEqual(blocks[6].startLine, (NSInteger)7);
+
+    NSString *sameText = [[markdown mutableCopy] autorelease];
+    XCTAssertTrue([OMMarkdownDocumentSnapshot snapshotForMarkdown:sameText] == snapshot);
+}
+
+- (void)testDocumentSnapshotsAreRememberedPerDocument
+{
+    NSString *first = [NSString stringWithFormat:@"# First %@\n\nBody.\n", [[NSProcessInfo processInfo] globallyUniqueString]];
+    NSString *second = [NSString stringWithFormat:@"# Second %@\n\nBody.\n", [[NSProcessInfo processInfo] globallyUniqueString]];
+    OMMarkdownDocumentSnapshot *firstSnapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:first];
+    OMMarkdownDocumentSnapshot *secondSnapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:second];
+    XCTAssertTrue(firstSnapshot != secondSnapshot);
+
+    // Switching back and forth between two documents reuses both parses.
+    XCTAssertTrue([OMMarkdownDocumentSnapshot snapshotForMarkdown:first] == firstSnapshot);
+    XCTAssertTrue([OMMarkdownDocumentSnapshot snapshotForMarkdown:second] == secondSnapshot);
+    XCTAssertTrue([OMMarkdownDocumentSnapshot snapshotForMarkdown:[[first mutableCopy] autorelease]] == firstSnapshot);
+}
+
+- (void)testProgressHandlerMayWaitForRenderOfSameRevision
+{
+    NSMutableString *markdown = [NSMutableString string];
+    NSUInteger section = 0;
+    for (; section < 200; section++) {
+        [markdown appendFormat:@"## Section %lu\n\nParagraph %lu with *emphasis*.\n\n", (unsigned long)section, (unsigned long)section];
+    }
+    OMMarkdownRenderer *renderer = [[[OMMarkdownRenderer alloc] init] autorelease];
+    OMMarkdownRenderer *other = [[[OMMarkdownRenderer alloc] init] autorelease];
+
+    // The handler blocks on a render of the same revision on another thread,
+    // which would never finish if the shared parse stayed locked while the
+    // first render reported progress.
+    __block BOOL otherFinished = YES;
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown
+                                                        priorityLineRange:NSMakeRange(1, 10)
+                                                         progressInterval:256
+                                                          progressHandler:^(NSAttributedString *partial,
+                                                                            NSUInteger offset,
+                                                                            NSArray *codeRanges,
+                                                                            NSArray *blockquoteRanges,
+                                                                            NSArray *anchors,
+                                                                            BOOL priorityOnly) {
+        (void)partial; (void)offset; (void)codeRanges; (void)blockquoteRanges; (void)anchors; (void)priorityOnly;
+        if (!otherFinished) {
+            return;
+        }
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            [other attributedStringFromMarkdown:markdown previousChangedRange:NULL changedRange:NULL cancellationCheck:nil];
+            dispatch_semaphore_signal(done);
+        });
+        otherFinished = OMMarkdownRendererWaitForSemaphore(done, 20.0);
+        dispatch_release(done);
+    }
+                                                        cancellationCheck:nil];
+    XCTAssertNotNil(rendered);
+    XCTAssertTrue(otherFinished);
+}
+
 - (void)testMathHeavyStyledTextRenderPerformanceGuardrail
 {
     NSMutableString *markdown = [NSMutableString string];
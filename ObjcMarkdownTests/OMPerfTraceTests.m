@@ -0,0 +1,102 @@
+// ObjcMarkdownTests
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <XCTest/XCTest.h>
+#import <Foundation/Foundation.h>
+
+#import "OMPerfTrace.h"
+
+@interface OMPerfTraceTests : XCTestCase
+@end
+
+@implementation OMPerfTraceTests
+
+- (void)setUp
+{
+    [super setUp];
+    OMPerfTraceSetEnabled(YES);
+    OMPerfTraceReset();
+}
+
+- (void)tearDown
+{
+    OMPerfTraceReset();
+    OMPerfTraceSetEnabled(NO);
+    [super tearDown];
+}
+
+- (NSArray *)exportedEventsNamed:(NSString *)name
+{
+    NSDictionary *trace = [NSJSONSerialization JSONObjectWithData:OMPerfTraceChromeJSONData()
+                                                          options:0
+                                                            error:NULL];
+    XCTAssertTrue([trace isKindOfClass:[NSDictionary class]]);
+    NSMutableArray *matches = [NSMutableArray array];
+    for (NSDictionary *event in [trace objectForKey:@"traceEvents"]) {
+        if ([[event objectForKey:@"name"] isEqualToString:name]) {
+            [matches addObject:event];
+        }
+    }
+    return matches;
+}
+
+- (void)testScopedSpansAndCountersExportAsChromeTraceEvents
+{
+    {
+        OM_PERF_TRACE_SCOPE("test", "scoped-span");
+        OMPerfTraceCounter("test", "test-counter", 42);
+    }
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        OMPerfTraceEnd(OMPerfTraceBegin("test", "worker-span"));
+    });
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    dispatch_release(group);
+
+    NSArray *spans = [self exportedEventsNamed:@"scoped-span"];
+    XCTAssertEqual([spans count], (NSUInteger)1);
+    XCTAssertEqualObjects([[spans lastObject] objectForKey:@"ph"], @"X");
+    XCTAssertEqualObjects([[spans lastObject] objectForKey:@"cat"], @"test");
+    XCTAssertNotNil([[spans lastObject] objectForKey:@"dur"]);
+
+    NSArray *counters = [self exportedEventsNamed:@"test-counter"];
+    XCTAssertEqual([counters count], (NSUInteger)1);
+    XCTAssertEqualObjects([[counters lastObject] objectForKey:@"ph"], @"C");
+    XCTAssertEqualObjects([[[counters lastObject] objectForKey:@"args"] objectForKey:@"value"], @42);
+
+    NSArray *workerSpans = [self exportedEventsNamed:@"worker-span"];
+    XCTAssertEqual([workerSpans count], (NSUInteger)1);
+    XCTAssertNotEqualObjects([[workerSpans lastObject] objectForKey:@"tid"],
+                             [[spans lastObject] objectForKey:@"tid"]);
+}
+
+- (void)testDisabledTraceRecordsNothing
+{
+    OMPerfTraceSetEnabled(NO);
+    {
+        OM_PERF_TRACE_SCOPE("test", "disabled-span");
+    }
+    OMPerfTraceCounter("test", "disabled-counter", 1);
+    XCTAssertEqual([[self exportedEventsNamed:@"disabled-span"] count], (NSUInteger)0);
+    XCTAssertEqual([[self exportedEventsNamed:@"disabled-counter"] count], (NSUInteger)0);
+}
+
+- (void)testRingBufferKeepsNewestEventsPerThread
+{
+    NSUInteger total = OMPerfTraceEventsPerThread + 100;
+    NSUInteger index = 0;
+    for (; index < total; index++) {
+        OMPerfTraceCounter("test", "ring-counter", (int64_t)index);
+    }
+
+    // The slot the owner could be rewriting is never exported, so a full
+    // buffer yields one event fewer than it holds.
+    NSArray *counters = [self exportedEventsNamed:@"ring-counter"];
+    XCTAssertEqual([counters count], (NSUInteger)OMPerfTraceEventsPerThread - 1);
+    XCTAssertEqualObjects([[[counters lastObject] objectForKey:@"args"] objectForKey:@"value"],
+                          [NSNumber numberWithUnsignedInteger:total - 1]);
+    XCTAssertEqualObjects([[[counters objectAtIndex:0] objectForKey:@"args"] objectForKey:@"value"],
+                          [NSNumber numberWithUnsignedInteger:101]);
+}
+
+@end
@@ -15,6 +15,11 @@ typedef unsigned short mode_t;
 @class OMDFormattingBarView;
 @class GSVVimBindingController;
 @class OMDGitHubClient;
+@class OMDFileWatcher;
+@class OMDTabRenderCache;
+@class OMDPreviewRenderRequest;
+@class OMDPrintRenderJob;
+@class OMDSourceLineStyleIndex;
 
 @interface OMDAppDelegate : NSObject <NSApplicationDelegate, NSToolbarDelegate, NSWindowDelegate, NSTextViewDelegate, NSMenuValidation, NSSplitViewDelegate, NSTableViewDataSource, NSTableViewDelegate, NSComboBoxDelegate, NSControlTextEditingDelegate, OMDSourceTextViewVimEventHandling>
 {
@@ -92,6 +97,7 @@ typedef unsigned short mode_t;
     NSTimer *_sourceSyntaxHighlightTimer;
     NSTimer *_recoveryAutosaveTimer;
     NSTimer *_externalFileMonitorTimer;
+    OMDFileWatcher *_externalFileWatcher;
     NSTimer *_copyFeedbackTimer;
     NSMutableArray *_codeBlockButtons;
     NSButton *_copyFeedbackButton;
@@ -105,6 +111,7 @@ typedef unsigned short mode_t;
     BOOL _postPresentationSetupComplete;
     BOOL _isSecondaryWindow;
     OMDDocumentConverter *_documentConverter;
+    NSMutableArray *_pendingConversionTasks;
     GSVVimBindingController *_sourceVimBindingController;
     NSView *_modeContainer;
     NSSegmentedControl *_modeControl;
@@ -148,6 +155,7 @@ typedef unsigned short mode_t;
     BOOL _previewStatusShowsUpdated;
     BOOL _previewIsUpdating;
     BOOL _sourceHighlightNeedsFullPass;
+    OMDSourceLineStyleIndex *_sourceLineStyleIndex;
     BOOL _showFormattingBar;
     BOOL _zoomUsesDebouncedRendering;
     BOOL _sourceIsDirty;
@@ -158,6 +166,25 @@ typedef unsigned short mode_t;
     BOOL _hasLastToolbarActionState;
     NSUInteger _sourceRevision;
     NSUInteger _lastRenderedSourceRevision;
+    NSUInteger _previewRenderToken;
+    NSUInteger _previewRenderBaselineToken;
+    NSUInteger _previewAppliedRenderToken;
+    NSUInteger _previewTextRevision;
+    OMDPreviewRenderRequest *_previewRenderRequest;
+    NSArray *_previewBlockAnchors;
+    NSArray *_previewCodeBlockRanges;
+    NSArray *_previewBlockquoteRanges;
+    NSAttributedString *_previewRenderedString;
+    NSString *_previewRenderedMarkdown;
+    NSString *_previewRenderedConfigurationKey;
+    OMDTabRenderCache *_tabRenderCache;
+    OMMarkdownRenderer *_printRenderer;
+    OMDPrintRenderJob *_printRenderJob;
+    NSPanel *_printRenderPanel;
+    NSTextField *_printRenderPanelLabel;
+    NSString *_tabRenderRestoreIdentifier;
+    BOOL _previewNeedsProgressiveRender;
+    NSTimeInterval _previewFirstPaintMs;
     NSUInteger _zoomFastRenderStreak;
     NSTimeInterval _lastZoomSliderEventTime;
     CGFloat _lastRenderedLayoutWidth;
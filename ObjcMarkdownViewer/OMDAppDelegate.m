@@ -3,6 +3,7 @@
 
 #import "OMDAppDelegate.h"
 #import "OMMarkdownRenderer.h"
+#import "OMPerfTrace.h"
 #import "OMDTextView.h"
 #import "OMDSourceTextView.h"
 #import "OMDSourceHighlighter.h"
@@ -16,6 +17,9 @@
 #import "OMDGitHubClient.h"
 #import "OMDInlineToggle.h"
 #import "OMDPanelSelection.h"
+#import "OMDFileWatcher.h"
+#import "OMDTabRenderCache.h"
+#import "OMDMappedTextFile.h"
 #import "GSVVimBindingController.h"
 #import "GSVVimConfigLoader.h"
 #import "GSOpenSave.h"
@@ -666,9 +670,15 @@ static const NSTimeInterval OMDSourceSyntaxHighlightDebounceInterval = 0.08;
 static const NSTimeInterval OMDSourceSyntaxHighlightLargeDocDebounceInterval = 0.16;
 static const NSTimeInterval OMDRecoveryAutosaveDebounceInterval = 1.25;
 static const NSTimeInterval OMDExternalFileMonitorInterval = 1.50;
+static const NSUInteger OMDTabRenderCacheDefaultBudgetMB = 192;
+static const unsigned long long OMDLargeFileModeThresholdBytes = 32ULL * 1024ULL * 1024ULL;
+static const NSUInteger OMDLargeFileDefaultWindowMB = 4;
 static const NSTimeInterval OMDCopyFeedbackDisplayInterval = 0.95;
 static const NSUInteger OMDSourceSyntaxIncrementalThreshold = 120000;
 static const NSUInteger OMDSourceSyntaxIncrementalContextChars = 12000;
+static const NSUInteger OMDProgressivePreviewThreshold = 1000000;
+static const NSUInteger OMDProgressivePreviewChunkLength = 131072;
+static const NSUInteger OMDProgressivePreviewViewportLines = 160;
 static const CGFloat OMDFormattingBarHeight = 32.0;
 static const CGFloat OMDFormattingBarInsetX = 8.0;
 static const CGFloat OMDFormattingBarControlHeight = 22.0;
@@ -951,6 +961,11 @@ static NSString * const OMDTabSyntaxLanguageKey = @"syntaxLanguage";
 static NSString * const OMDTabLoadedDiskFingerprintKey = @"loadedDiskFingerprint";
 static NSString * const OMDTabObservedDiskFingerprintKey = @"observedDiskFingerprint";
 static NSString * const OMDTabSuppressedDiskFingerprintKey = @"suppressedDiskFingerprint";
+static NSString * const OMDTabIdentifierKey = @"identifier";
+// Large read-only files: byte offsets of the sections shown so far (the
+// last is on screen) and where the next one starts, absent at the end.
+static NSString * const OMDTabLargeFileSectionStartsKey = @"largeFileSectionStarts";
+static NSString * const OMDTabLargeFileNextSectionKey = @"largeFileNextSection";
 
 static NSString *OMDTrimmedString(NSString *value);
 #if defined(_WIN32)
@@ -1243,6 +1258,16 @@ static NSTimeInterval OMDNow(void)
     return [NSDate timeIntervalSinceReferenceDate];
 }
 
+static dispatch_queue_t OMDPreviewRenderQueue(void)
+{
+    static dispatch_queue_t queue = NULL;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        queue = dispatch_queue_create("org.objcmarkdown.preview-render", DISPATCH_QUEUE_SERIAL);
+    });
+    return queue;
+}
+
 static BOOL OMDTruthyFlagValue(NSString *value)
 {
     if (value == nil) {
@@ -1275,6 +1300,26 @@ static BOOL OMDPerformanceLoggingEnabled(void)
     return enabled;
 }
 
+static NSUInteger OMDLargeFileWindowBytes(void)
+{
+    NSString *value = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_LARGE_FILE_WINDOW_MB"];
+    NSInteger megabytes = (value != nil ? [value integerValue] : (NSInteger)OMDLargeFileDefaultWindowMB);
+    if (megabytes < 1) {
+        megabytes = (NSInteger)OMDLargeFileDefaultWindowMB;
+    }
+    return (NSUInteger)megabytes * 1024 * 1024;
+}
+
+static NSUInteger OMDTabRenderCacheByteBudget(void)
+{
+    NSString *value = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_TAB_CACHE_MB"];
+    NSInteger megabytes = (value != nil ? [value integerValue] : (NSInteger)OMDTabRenderCacheDefaultBudgetMB);
+    if (megabytes < 0) {
+        megabytes = 0;
+    }
+    return (NSUInteger)megabytes * 1024 * 1024;
+}
+
 static BOOL OMDPrintDiagnosticsEnabled(void)
 {
     static BOOL resolved = NO;
@@ -2422,6 +2467,38 @@ static NSString *OMDTrimmedString(NSString *value)
     return [value stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
 }
 
+static NSString *OMDTabIdentifierForRecord(NSDictionary *tab)
+{
+    NSString *identifier = [tab objectForKey:OMDTabIdentifierKey];
+    if ([identifier length] == 0 && [tab isKindOfClass:[NSMutableDictionary class]]) {
+        identifier = [[NSProcessInfo processInfo] globallyUniqueString];
+        [(NSMutableDictionary *)tab setObject:identifier forKey:OMDTabIdentifierKey];
+    }
+    return identifier;
+}
+
+static BOOL OMDTabRecordHasNewerDiskVersion(NSDictionary *tab)
+{
+    NSString *loaded = [tab objectForKey:OMDTabLoadedDiskFingerprintKey];
+    NSString *observed = [tab objectForKey:OMDTabObservedDiskFingerprintKey];
+    if ([loaded length] == 0 || [observed length] == 0 || [observed isEqualToString:loaded]) {
+        return NO;
+    }
+    return ![observed isEqualToString:[tab objectForKey:OMDTabSuppressedDiskFingerprintKey]];
+}
+
+static void OMDTabRecordSetLargeFileSection(NSMutableDictionary *tab,
+                                            NSArray *sectionStarts,
+                                            unsigned long long nextOffset)
+{
+    [tab setObject:sectionStarts forKey:OMDTabLargeFileSectionStartsKey];
+    if (nextOffset > 0) {
+        [tab setObject:[NSNumber numberWithUnsignedLongLong:nextOffset] forKey:OMDTabLargeFileNextSectionKey];
+    } else {
+        [tab removeObjectForKey:OMDTabLargeFileNextSectionKey];
+    }
+}
+
 static NSString *OMDDiskFingerprintForFileAttributes(NSDictionary *attributes)
 {
     if (attributes == nil) {
@@ -4066,6 +4143,132 @@ static OMDRoundedCardView *OMDCreatePreferencesCard(NSRect frame, OMDLayoutMetri
     return card;
 }
 
+// One preview render as handed to OMDPreviewRenderQueue(): the renderer
+// settings captured on the main thread when it was scheduled, and a flag the
+// main thread sets once a newer render supersedes it.
+@interface OMDPreviewRenderRequest : NSObject
+{
+    NSUInteger _token;
+    OMMarkdownRenderSettings *_settings;
+    BOOL _cancelled;
+}
+- (id)initWithToken:(NSUInteger)token settings:(OMMarkdownRenderSettings *)settings;
+- (NSUInteger)token;
+- (OMMarkdownRenderSettings *)settings;
+- (void)cancel;
+- (BOOL)isCancelled;
+@end
+
+@implementation OMDPreviewRenderRequest
+
+- (id)initWithToken:(NSUInteger)token settings:(OMMarkdownRenderSettings *)settings
+{
+    self = [super init];
+    if (self != nil) {
+        _token = token;
+        _settings = [settings retain];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_settings release];
+    [super dealloc];
+}
+
+- (NSUInteger)token
+{
+    return _token;
+}
+
+- (OMMarkdownRenderSettings *)settings
+{
+    return _settings;
+}
+
+- (void)cancel
+{
+    @synchronized (self) {
+        _cancelled = YES;
+    }
+}
+
+- (BOOL)isCancelled
+{
+    @synchronized (self) {
+        return _cancelled;
+    }
+}
+
+@end
+
+// A print or PDF export render in flight. Progress is written by the render
+// worker and shown by the main thread; Cancel sets the flag the render polls.
+@interface OMDPrintRenderJob : NSObject
+{
+    BOOL _cancelled;
+    BOOL _progressUpdateScheduled;
+    OMMarkdownRendererExportPhase _phase;
+    NSUInteger _completed;
+    NSUInteger _total;
+}
+- (void)cancel;
+- (BOOL)isCancelled;
+// Returns YES when the caller should schedule a main-thread update.
+- (BOOL)recordPhase:(OMMarkdownRendererExportPhase)phase completed:(NSUInteger)completed total:(NSUInteger)total;
+- (NSString *)takeProgressText;
+@end
+
+@implementation OMDPrintRenderJob
+
+- (void)cancel
+{
+    @synchronized (self) {
+        _cancelled = YES;
+    }
+}
+
+- (BOOL)isCancelled
+{
+    @synchronized (self) {
+        return _cancelled;
+    }
+}
+
+- (BOOL)recordPhase:(OMMarkdownRendererExportPhase)phase completed:(NSUInteger)completed total:(NSUInteger)total
+{
+    @synchronized (self) {
+        _phase = phase;
+        _completed = completed;
+        _total = total;
+        if (_progressUpdateScheduled) {
+            return NO;
+        }
+        _progressUpdateScheduled = YES;
+        return YES;
+    }
+}
+
+- (NSString *)takeProgressText
+{
+    @synchronized (self) {
+        _progressUpdateScheduled = NO;
+        if (_total == 0) {
+            return nil;
+        }
+        if (_phase == OMMarkdownRendererExportPhaseAssets) {
+            return [NSString stringWithFormat:@"Preparing math and images %lu/%lu...",
+                                              (unsigned long)_completed,
+                                              (unsigned long)_total];
+        }
+        return [NSString stringWithFormat:@"Rendering for export %lu%%...",
+                                          (unsigned long)((_completed * 100) / _total)];
+    }
+}
+
+@end
+
 @interface OMDAppDelegate () <GSVVimBindingControllerDelegate>
 - (void)importDocument:(id)sender;
 - (void)newWindow:(id)sender;
@@ -4078,17 +4281,23 @@ static OMDRoundedCardView *OMDCreatePreferencesCard(NSRect frame, OMDLayoutMetri
                               printInfo:(NSPrintInfo *)printInfo
                                   stage:(NSString *)stage;
 - (void)ensurePrintDefaultPrinterConfigured;
-- (BOOL)exportDocumentAsPDFToPath:(NSString *)path;
+- (BOOL)exportDocumentAsPDFToPath:(NSString *)path completion:(void (^)(BOOL success))completion;
 - (void)exportDocumentAsPDF:(id)sender;
 - (void)exportDocumentAsRTF:(id)sender;
 - (void)exportDocumentAsDOCX:(id)sender;
 - (void)exportDocumentAsODT:(id)sender;
 - (void)exportDocumentAsHTML:(id)sender;
+- (void)exportPerformanceTrace:(id)sender;
 - (BOOL)hasLoadedDocument;
 - (BOOL)ensureDocumentLoadedForActionName:(NSString *)actionName;
 - (BOOL)ensureConverterAvailableForActionName:(NSString *)actionName;
 - (OMDDocumentConverter *)documentConverter;
-- (BOOL)importDocumentAtPath:(NSString *)path;
+- (BOOL)importDocumentAtPath:(NSString *)path completion:(void (^)(NSUInteger openedCount))completion;
+- (void)importDocumentsAtPaths:(NSArray *)paths inNewTab:(BOOL)inNewTab;
+- (void)importDocumentsAtPaths:(NSArray *)paths
+                      inNewTab:(BOOL)inNewTab
+                    completion:(void (^)(NSUInteger openedCount))completion;
+- (void)cancelPendingConversions;
 - (BOOL)isImportableDocumentPath:(NSString *)path;
 - (void)presentConverterError:(NSError *)error fallbackTitle:(NSString *)title;
 - (NSString *)resolvedAbsolutePathForLocalPath:(NSString *)path;
@@ -4100,8 +4309,11 @@ static OMDRoundedCardView *OMDCreatePreferencesCard(NSRect frame, OMDLayoutMetri
                                   suppressed:(NSString *)suppressed;
 - (void)refreshCurrentDocumentDiskStateAllowPrompt:(BOOL)allowPrompt;
 - (void)startExternalFileMonitor;
+- (void)startExternalFileMonitorTimer;
 - (void)stopExternalFileMonitor;
 - (void)externalFileMonitorTimerFired:(NSTimer *)timer;
+- (void)updateExternalFileWatchPaths;
+- (void)externalFileWatcherReportedChangedPaths:(NSSet *)paths;
 - (BOOL)reloadCurrentDocumentFromDiskPreservingViewport;
 - (BOOL)loadDocumentContentsAtPath:(NSString *)path
                         actionName:(NSString *)actionName
@@ -4109,7 +4321,20 @@ static OMDRoundedCardView *OMDCreatePreferencesCard(NSRect frame, OMDLayoutMetri
                       displayTitle:(NSString **)displayTitleOut
                         renderMode:(OMDDocumentRenderMode *)renderModeOut
                     syntaxLanguage:(NSString **)syntaxLanguageOut
-                       fingerprint:(NSString **)fingerprintOut;
+                          readOnly:(BOOL *)readOnlyOut
+                       fingerprint:(NSString **)fingerprintOut
+               largeFileNextOffset:(unsigned long long *)largeFileNextOffsetOut;
+- (NSString *)textOfLargeFileAtPath:(NSString *)path
+                         byteOffset:(unsigned long long)byteOffset
+                           markdown:(BOOL)markdown
+                         actionName:(NSString *)actionName
+                       displayTitle:(NSString **)displayTitleOut
+                         nextOffset:(unsigned long long *)nextOffsetOut;
+- (NSMutableDictionary *)selectedLargeFileTabRecord;
+- (BOOL)showLargeFileSectionAtByteOffset:(unsigned long long)byteOffset
+                           sectionStarts:(NSArray *)sectionStarts;
+- (void)showNextLargeFileSection:(id)sender;
+- (void)showPreviousLargeFileSection:(id)sender;
 - (void)reloadDocumentFromDisk:(id)sender;
 - (void)setCurrentMarkdown:(NSString *)markdown sourcePath:(NSString *)sourcePath;
 - (void)setCurrentDocumentText:(NSString *)text
@@ -4195,6 +4420,7 @@ static OMDRoundedCardView *OMDCreatePreferencesCard(NSRect frame, OMDLayoutMetri
                                      resolvedPath:(NSString **)resolvedPath
                                             error:(NSError **)error;
 - (OMDGitHubClient *)gitHubClient;
+- (void)gitHubCachedResponseDidChange:(NSNotification *)notification;
 - (BOOL)isMarkdownTextPath:(NSString *)path;
 - (NSString *)temporaryPathForRemoteImportWithExtension:(NSString *)extension;
 - (BOOL)ensureOpenFileSizeWithinLimit:(unsigned long long)size
@@ -4256,7 +4482,20 @@ static OMDRoundedCardView *OMDCreatePreferencesCard(NSRect frame, OMDLayoutMetri
                      actionName:(NSString *)actionName;
 - (NSPrintInfo *)configuredPrintInfo;
 - (CGFloat)printableContentWidthForPrintInfo:(NSPrintInfo *)printInfo;
-- (OMDTextView *)newPrintTextViewForPrintInfo:(NSPrintInfo *)printInfo;
+- (OMMarkdownRenderer *)printRenderer;
+- (void)showExportProgressText:(NSString *)text;
+- (void)showPrintRenderPanel;
+- (void)closePrintRenderPanel;
+- (void)cancelPrintRender:(id)sender;
+- (BOOL)preparePrintTextViewForPrintInfo:(NSPrintInfo *)printInfo
+                              completion:(void (^)(OMDTextView *printView))completion;
+- (OMDTextView *)newPrintTextViewWithRenderedString:(NSAttributedString *)rendered
+                                    codeBlockRanges:(NSArray *)codeBlockRanges
+                                   blockquoteRanges:(NSArray *)blockquoteRanges
+                                    backgroundColor:(NSColor *)background
+                                          viewWidth:(CGFloat)viewWidth
+                                        layoutWidth:(CGFloat)layoutWidth;
+- (void)runPrintOperationForPrintView:(OMDTextView *)printView printInfo:(NSPrintInfo *)printInfo;
 #if defined(_WIN32)
 - (NSString *)windowsHeadlessBrowserPath;
 - (NSString *)temporaryHTMLExportPath;
@@ -4277,6 +4516,38 @@ static OMDRoundedCardView *OMDCreatePreferencesCard(NSRect frame, OMDLayoutMetri
 - (NSRect)currentPreviewClipBounds;
 - (CGFloat)currentPreviewLayoutWidth;
 - (void)clearPreviewPresentation;
+- (void)renderCurrentMarkdownAsynchronously:(BOOL)asynchronous;
+- (NSUInteger)advancePreviewRenderToken;
+- (NSDictionary *)renderPreviewMarkdown:(NSString *)markdown
+                           withRenderer:(OMMarkdownRenderer *)renderer
+                                request:(OMDPreviewRenderRequest *)request;
+- (NSDictionary *)renderPreviewMarkdownProgressively:(NSString *)markdown
+                                        withRenderer:(OMMarkdownRenderer *)renderer
+                                             request:(OMDPreviewRenderRequest *)request
+                                   priorityLineRange:(NSRange)priorityLineRange
+                                         renderStart:(NSTimeInterval)renderStart;
+- (NSDictionary *)previewRenderResultWithRenderer:(OMMarkdownRenderer *)renderer
+                                         rendered:(NSAttributedString *)rendered
+                             previousChangedRange:(NSRange)previousChangedRange
+                                     changedRange:(NSRange)changedRange
+                                            token:(NSUInteger)token
+                                    baselineToken:(NSUInteger)baselineToken
+                                    markdownStart:(NSTimeInterval)markdownStart;
+- (void)applyPreviewProgressChunk:(NSDictionary *)chunk
+                            token:(NSUInteger)token
+                      renderStart:(NSTimeInterval)renderStart;
+- (NSRange)previewPriorityLineRange;
+- (void)updatePreviewDecorations;
+- (void)applyPreviewRenderResult:(NSDictionary *)result
+                        markdown:(NSString *)previewMarkdown
+                configurationKey:(NSString *)configurationKey
+                  sourceRevision:(NSUInteger)revisionAtRenderStart
+                     renderStart:(NSTimeInterval)renderStart
+             sampledAsZoomRender:(BOOL)sampledAsZoomRender;
+- (OMDTabRenderCache *)tabRenderCache;
+- (void)storeTabRenderSnapshotForSelectedTab;
+- (void)applyDocumentTabRecordRestoringRender:(NSDictionary *)tabRecord;
+- (void)applyTabRenderSnapshot:(OMDTabRenderSnapshot *)snapshot renderStart:(NSTimeInterval)renderStart;
 - (void)updatePreviewDocumentGeometry;
 - (void)scheduleInteractiveRenderAfterDelay:(NSTimeInterval)delay;
 - (void)interactiveRenderTimerFired:(NSTimer *)timer;
@@ -4518,6 +4789,9 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [[NSNotificationCenter defaultCenter] removeObserver:self
                                                     name:OMMarkdownRendererRemoteImagesDidWarmNotification
                                                   object:nil];
+    [[NSNotificationCenter defaultCenter] removeObserver:self
+                                                    name:OMDGitHubClientCachedResponseDidChangeNotification
+                                                  object:nil];
     if (_sourceScrollView != nil) {
         [[NSNotificationCenter defaultCenter] removeObserver:self
                                                         name:NSViewBoundsDidChangeNotification
@@ -4623,6 +4897,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [_preferencesPanel release];
     [_codeBlockButtons release];
     [_documentConverter release];
+    [_pendingConversionTasks release];
     [_sourceVimBindingController release];
     [_sourceLineNumberRuler release];
     [_splitView release];
@@ -4631,6 +4906,22 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [_sidebarContainer release];
     [_tabStripView release];
     [_renderer release];
+    [_previewBlockAnchors release];
+    [_previewCodeBlockRanges release];
+    [_previewBlockquoteRanges release];
+    [_previewRenderedString release];
+    [_previewRenderedMarkdown release];
+    [_previewRenderedConfigurationKey release];
+    [_previewRenderRequest cancel];
+    [_previewRenderRequest release];
+    [_tabRenderCache release];
+    [_printRenderJob cancel];
+    [_printRenderJob release];
+    [_printRenderPanel close];
+    [_printRenderPanel release];
+    [_printRenderer release];
+    [_tabRenderRestoreIdentifier release];
+    [_sourceLineStyleIndex release];
     [_sourceTextView release];
     [_sourceScrollView release];
     [_previewScrollView release];
@@ -4852,6 +5143,12 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [[fileMenuWin addItemWithTitle:@"Reload from Disk"
                             action:@selector(reloadDocumentFromDisk:)
                      keyEquivalent:@""] setTarget:self];
+    [[fileMenuWin addItemWithTitle:@"Next Section of Large File"
+                            action:@selector(showNextLargeFileSection:)
+                     keyEquivalent:@""] setTarget:self];
+    [[fileMenuWin addItemWithTitle:@"Previous Section of Large File"
+                            action:@selector(showPreviousLargeFileSection:)
+                     keyEquivalent:@""] setTarget:self];
     [fileMenuWin addItem:[NSMenuItem separatorItem]];
     [[fileMenuWin addItemWithTitle:@"Print..."
                             action:@selector(printDocument:)
@@ -4973,6 +5270,16 @@ static NSMutableArray *OMDSecondaryWindows(void)
                                                         keyEquivalent:@""];
     [reloadItem setTarget:self];
 
+    NSMenuItem *nextSectionItem = (NSMenuItem *)[fileMenu addItemWithTitle:@"Next Section of Large File"
+                                                                     action:@selector(showNextLargeFileSection:)
+                                                              keyEquivalent:@""];
+    [nextSectionItem setTarget:self];
+
+    NSMenuItem *previousSectionItem = (NSMenuItem *)[fileMenu addItemWithTitle:@"Previous Section of Large File"
+                                                                         action:@selector(showPreviousLargeFileSection:)
+                                                                  keyEquivalent:@""];
+    [previousSectionItem setTarget:self];
+
     NSMenuItem *exportMenuItem = (NSMenuItem *)[fileMenu addItemWithTitle:@"Export"
                                                                     action:NULL
                                                              keyEquivalent:@""];
@@ -4997,6 +5304,13 @@ static NSMutableArray *OMDSecondaryWindows(void)
                                                                       action:@selector(exportDocumentAsHTML:)
                                                                keyEquivalent:@""];
     [exportHTMLItem setTarget:self];
+    if (OMPerfTraceIsEnabled()) {
+        [exportMenu addItem:[NSMenuItem separatorItem]];
+        NSMenuItem *exportTraceItem = (NSMenuItem *)[exportMenu addItemWithTitle:@"Export Performance Trace..."
+                                                                           action:@selector(exportPerformanceTrace:)
+                                                                    keyEquivalent:@""];
+        [exportTraceItem setTarget:self];
+    }
     [exportMenuItem setSubmenu:exportMenu];
 
     [fileMenu addItem:[NSMenuItem separatorItem]];
@@ -5438,12 +5752,15 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [_renderer setParsingOptions:options];
     [self updateRendererParsingOptionsForSourcePath:nil];
     _lastRenderedLayoutWidth = -1.0;
+    _previewAppliedRenderToken = NSNotFound;
 #if defined(_WIN32)
     // Windows GNUstep should render external math attachments on first paint
     // instead of relying on background warmup callbacks.
     [_renderer setAsynchronousMathGenerationEnabled:NO];
+    [_renderer setAsynchronousImageLoadingEnabled:NO];
 #else
     [_renderer setAsynchronousMathGenerationEnabled:YES];
+    [_renderer setAsynchronousImageLoadingEnabled:YES];
 #endif
     [_renderer setAllowTableHorizontalOverflow:NO];
     [_renderer setZoomScale:_zoomScale];
@@ -6471,6 +6788,13 @@ static NSMutableArray *OMDSecondaryWindows(void)
         return _renderer != nil && [self isTreeSitterAvailable];
     }
 
+    if (action == @selector(showNextLargeFileSection:)) {
+        return [[self selectedLargeFileTabRecord] objectForKey:OMDTabLargeFileNextSectionKey] != nil;
+    }
+    if (action == @selector(showPreviousLargeFileSection:)) {
+        return [[[self selectedLargeFileTabRecord] objectForKey:OMDTabLargeFileSectionStartsKey] count] > 1;
+    }
+
     if (action == @selector(saveDocument:) ||
         action == @selector(reloadDocumentFromDisk:) ||
         action == @selector(saveDocumentAsMarkdown:) ||
@@ -6675,7 +6999,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
 - (void)importDocument:(id)sender
 {
     NSOpenPanel *panel = [NSOpenPanel openPanel];
-    [panel setAllowsMultipleSelection:NO];
+    [panel setAllowsMultipleSelection:YES];
     [panel setCanChooseFiles:YES];
     [panel setCanChooseDirectories:NO];
     [panel setTitle:@"Import"];
@@ -6705,17 +7029,38 @@ static NSMutableArray *OMDSecondaryWindows(void)
         return;
     }
 
+    if ([filenames count] > 1) {
+        if (![self ensureConverterAvailableForActionName:@"Import"]) {
+            return;
+        }
+        NSMutableArray *importable = [NSMutableArray arrayWithCapacity:[filenames count]];
+        for (NSString *candidate in filenames) {
+            if ([OMDDocumentConverter isSupportedExtension:[[candidate pathExtension] lowercaseString]]) {
+                [importable addObject:candidate];
+            }
+        }
+        BOOL windowIsEmpty = ([_documentTabs count] == 0 && _currentPath == nil && _currentMarkdown == nil);
+        [self importDocumentsAtPaths:importable inNewTab:!windowIsEmpty];
+        return;
+    }
+
     NSString *path = [filenames objectAtIndex:0];
     NSString *extension = [[path pathExtension] lowercaseString];
     BOOL supportsFormatNow = [OMDDocumentConverter isSupportedExtension:extension];
 
     if ([_documentTabs count] == 0 && _currentPath == nil && _currentMarkdown == nil) {
-        [self importDocumentAtPath:path];
+        [self importDocumentAtPath:path completion:nil];
     } else if (supportsFormatNow) {
+        // The new window shows the conversion progress; it closes again if
+        // the import fails.
         OMDAppDelegate *controller = [[OMDAppDelegate alloc] init];
         [controller setupWindow];
-        BOOL imported = [controller importDocumentAtPath:path];
-        if (imported) {
+        BOOL started = [controller importDocumentAtPath:path completion:^(NSUInteger openedCount) {
+            if (openedCount == 0) {
+                [controller->_window close];
+            }
+        }];
+        if (started) {
             [controller schedulePostPresentationSetupIfNeeded];
             [controller registerAsSecondaryWindow];
         } else {
@@ -6723,7 +7068,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
         }
         [controller release];
     } else {
-        [self importDocumentAtPath:path];
+        [self importDocumentAtPath:path completion:nil];
     }
 }
 
@@ -6859,6 +7204,25 @@ static NSMutableArray *OMDSecondaryWindows(void)
 }
 
 - (void)startExternalFileMonitor
+{
+    if (_externalFileMonitorTimer != nil || _externalFileWatcher != nil) {
+        return;
+    }
+
+    // Prefer kernel change notification; polling stays as the fallback when
+    // inotify is unavailable.
+    if ([OMDFileWatcher isSupported]) {
+        _externalFileWatcher = [[OMDFileWatcher alloc] initWithChangeHandler:^(NSSet *changedPaths) {
+            [self externalFileWatcherReportedChangedPaths:changedPaths];
+        }];
+        [self updateExternalFileWatchPaths];
+        return;
+    }
+
+    [self startExternalFileMonitorTimer];
+}
+
+- (void)startExternalFileMonitorTimer
 {
     if (_externalFileMonitorTimer != nil) {
         return;
@@ -6873,6 +7237,11 @@ static NSMutableArray *OMDSecondaryWindows(void)
 
 - (void)stopExternalFileMonitor
 {
+    if (_externalFileWatcher != nil) {
+        [_externalFileWatcher invalidate];
+        [_externalFileWatcher release];
+        _externalFileWatcher = nil;
+    }
     if (_externalFileMonitorTimer != nil) {
         [_externalFileMonitorTimer invalidate];
         [_externalFileMonitorTimer release];
@@ -6888,13 +7257,96 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [self refreshCurrentDocumentDiskStateAllowPrompt:YES];
 }
 
+- (void)updateExternalFileWatchPaths
+{
+    if (_externalFileWatcher == nil) {
+        return;
+    }
+
+    NSMutableSet *paths = [NSMutableSet set];
+    for (NSDictionary *tab in _documentTabs) {
+        if ([[tab objectForKey:OMDTabIsGitHubKey] boolValue]) {
+            continue;
+        }
+        NSString *path = [self resolvedAbsolutePathForLocalPath:[tab objectForKey:OMDTabSourcePathKey]];
+        if ([path length] > 0) {
+            [paths addObject:path];
+        }
+    }
+    if ([self isCurrentDocumentReloadableFromDisk]) {
+        NSString *path = [self resolvedAbsolutePathForLocalPath:_currentPath];
+        if ([path length] > 0) {
+            [paths addObject:path];
+        }
+    }
+    if ([paths isEqualToSet:[_externalFileWatcher requestedPaths]]) {
+        return;
+    }
+
+    // A directory that cannot be watched right now (a build tool deleting
+    // and recreating its output folder) stays pending in the watcher, which
+    // reports its files once it is back; the other tabs stay watched.
+    [_externalFileWatcher setWatchedPaths:paths];
+}
+
+- (void)externalFileWatcherReportedChangedPaths:(NSSet *)paths
+{
+    if (_externalFileWatcher == nil || [paths count] == 0) {
+        return;
+    }
+
+    // Background tabs are only re-fingerprinted and marked stale; their
+    // contents are re-read (after a prompt) when the tab is selected.
+    BOOL backgroundTabChanged = NO;
+    NSInteger index = 0;
+    for (; index < (NSInteger)[_documentTabs count]; index++) {
+        if (index == _selectedDocumentTabIndex) {
+            continue;
+        }
+        NSMutableDictionary *tab = [_documentTabs objectAtIndex:index];
+        if ([[tab objectForKey:OMDTabIsGitHubKey] boolValue]) {
+            continue;
+        }
+        NSString *path = [self resolvedAbsolutePathForLocalPath:[tab objectForKey:OMDTabSourcePathKey]];
+        if ([path length] == 0 || ![paths containsObject:path]) {
+            continue;
+        }
+        NSString *observed = [self diskFingerprintForPath:path];
+        NSString *previous = [tab objectForKey:OMDTabObservedDiskFingerprintKey];
+        if (observed == previous || [observed isEqualToString:previous]) {
+            continue;
+        }
+        BOOL wasStale = OMDTabRecordHasNewerDiskVersion(tab);
+        if ([observed length] > 0) {
+            [tab setObject:observed forKey:OMDTabObservedDiskFingerprintKey];
+        } else {
+            [tab removeObjectForKey:OMDTabObservedDiskFingerprintKey];
+        }
+        if (OMDTabRecordHasNewerDiskVersion(tab) != wasStale) {
+            backgroundTabChanged = YES;
+        }
+    }
+    if (backgroundTabChanged) {
+        [self updateTabStrip];
+    }
+
+    if ([self isCurrentDocumentReloadableFromDisk]) {
+        NSString *currentPath = [self resolvedAbsolutePathForLocalPath:_currentPath];
+        if ([currentPath length] > 0 && [paths containsObject:currentPath]) {
+            [self refreshCurrentDocumentDiskStateAllowPrompt:YES];
+        }
+    }
+}
+
 - (BOOL)loadDocumentContentsAtPath:(NSString *)path
                         actionName:(NSString *)actionName
                           markdown:(NSString **)markdownOut
                       displayTitle:(NSString **)displayTitleOut
                         renderMode:(OMDDocumentRenderMode *)renderModeOut
                     syntaxLanguage:(NSString **)syntaxLanguageOut
+                          readOnly:(BOOL *)readOnlyOut
                        fingerprint:(NSString **)fingerprintOut
+               largeFileNextOffset:(unsigned long long *)largeFileNextOffsetOut
 {
     NSString *resolvedPath = [self resolvedAbsolutePathForLocalPath:path];
     if ([resolvedPath length] == 0) {
@@ -6911,21 +7363,45 @@ static NSMutableArray *OMDSecondaryWindows(void)
         return NO;
     }
 
+    NSString *extension = [[resolvedPath pathExtension] lowercaseString];
+    BOOL importable = [OMDDocumentConverter isSupportedExtension:extension];
     NSNumber *sizeValue = [attributes objectForKey:NSFileSize];
-    if ([sizeValue respondsToSelector:@selector(unsignedLongLongValue)]) {
-        if (![self ensureOpenFileSizeWithinLimit:[sizeValue unsignedLongLongValue]
-                                      descriptor:[resolvedPath lastPathComponent]]) {
-            return NO;
-        }
+    unsigned long long fileSize = ([sizeValue respondsToSelector:@selector(unsignedLongLongValue)]
+                                   ? [sizeValue unsignedLongLongValue]
+                                   : 0ULL);
+    // Text beyond the open limit (or simply very large) is shown through a
+    // mapped, read-only window instead of being refused or read whole.
+    BOOL largeFile = (!importable &&
+                      (fileSize > OMDLargeFileModeThresholdBytes ||
+                       fileSize > (unsigned long long)[self explorerMaxOpenFileSizeBytes]));
+    if (importable && ![self ensureOpenFileSizeWithinLimit:fileSize
+                                                descriptor:[resolvedPath lastPathComponent]]) {
+        return NO;
     }
 
-    NSString *extension = [[resolvedPath pathExtension] lowercaseString];
-    BOOL importable = [OMDDocumentConverter isSupportedExtension:extension];
     NSString *markdown = nil;
+    NSString *displayTitle = [resolvedPath lastPathComponent];
     OMDDocumentRenderMode renderMode = OMDDocumentRenderModeMarkdown;
     NSString *syntaxLanguage = nil;
+    unsigned long long largeFileNextOffset = 0;
 
-    if (importable) {
+    if (largeFile) {
+        renderMode = [self isMarkdownTextPath:resolvedPath]
+                     ? OMDDocumentRenderModeMarkdown
+                     : OMDDocumentRenderModeVerbatim;
+        markdown = [self textOfLargeFileAtPath:resolvedPath
+                                    byteOffset:0
+                                      markdown:(renderMode == OMDDocumentRenderModeMarkdown)
+                                    actionName:actionName
+                                  displayTitle:&displayTitle
+                                    nextOffset:&largeFileNextOffset];
+        if (markdown == nil) {
+            return NO;
+        }
+        if (renderMode == OMDDocumentRenderModeVerbatim) {
+            syntaxLanguage = OMDVerbatimSyntaxTokenForExtension(extension);
+        }
+    } else if (importable) {
         if (![self ensureConverterAvailableForActionName:actionName]) {
             return NO;
         }
@@ -6966,7 +7442,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
         *markdownOut = markdown;
     }
     if (displayTitleOut != NULL) {
-        *displayTitleOut = [resolvedPath lastPathComponent];
+        *displayTitleOut = displayTitle;
     }
     if (renderModeOut != NULL) {
         *renderModeOut = renderMode;
@@ -6974,12 +7450,146 @@ static NSMutableArray *OMDSecondaryWindows(void)
     if (syntaxLanguageOut != NULL) {
         *syntaxLanguageOut = syntaxLanguage;
     }
+    if (readOnlyOut != NULL) {
+        *readOnlyOut = largeFile;
+    }
     if (fingerprintOut != NULL) {
         *fingerprintOut = OMDDiskFingerprintForFileAttributes(attributes);
     }
+    if (largeFileNextOffsetOut != NULL) {
+        *largeFileNextOffsetOut = largeFileNextOffset;
+    }
+    return YES;
+}
+
+- (NSString *)textOfLargeFileAtPath:(NSString *)path
+                         byteOffset:(unsigned long long)byteOffset
+                           markdown:(BOOL)markdown
+                         actionName:(NSString *)actionName
+                       displayTitle:(NSString **)displayTitleOut
+                         nextOffset:(unsigned long long *)nextOffsetOut
+{
+    NSTimeInterval start = OMDNow();
+    NSError *error = nil;
+    unsigned long long nextOffset = 0;
+    OMDMappedTextFile *file = [OMDMappedTextFile mappedTextFileAtPath:path error:&error];
+    NSString *text = [file textAtByteOffset:byteOffset
+                               maximumBytes:OMDLargeFileWindowBytes()
+                             markdownBlocks:markdown
+                                 nextOffset:&nextOffset
+                                      error:&error];
+    if (text == nil) {
+        NSAlert *alert = [[[NSAlert alloc] init] autorelease];
+        [alert setMessageText:[NSString stringWithFormat:@"%@ failed", actionName]];
+        [alert setInformativeText:(error != nil ? [error localizedDescription]
+                                                : @"This file cannot be opened as text.")];
+        [alert runModal];
+        return nil;
+    }
+
+    BOOL truncated = (byteOffset > 0 || nextOffset < [file textByteCount]);
+    double startMB = (double)byteOffset / (1024.0 * 1024.0);
+    double endMB = (double)nextOffset / (1024.0 * 1024.0);
+    double totalMB = (double)[file textByteCount] / (1024.0 * 1024.0);
+    if (displayTitleOut != NULL && truncated) {
+        if (byteOffset == 0) {
+            *displayTitleOut = [NSString stringWithFormat:@"%@ (first %.1f of %.1f MB)",
+                                                          [path lastPathComponent],
+                                                          endMB,
+                                                          totalMB];
+        } else {
+            *displayTitleOut = [NSString stringWithFormat:@"%@ (%.1f-%.1f of %.1f MB)",
+                                                          [path lastPathComponent],
+                                                          startMB,
+                                                          endMB,
+                                                          totalMB];
+        }
+    }
+    if (nextOffsetOut != NULL) {
+        *nextOffsetOut = (nextOffset < [file textByteCount] ? nextOffset : 0ULL);
+    }
+    if (OMDPerformanceLoggingEnabled()) {
+        NSLog(@"[Perf][Viewer] large file open: %.1fms mapped=%llu offset=%llu decoded=%llu encoding=%lu truncated=%@ path=%@",
+              (OMDNow() - start) * 1000.0,
+              [file mappedByteCount],
+              byteOffset,
+              [file decodedByteCount],
+              (unsigned long)[file encoding],
+              truncated ? @"yes" : @"no",
+              path);
+    }
+    return text;
+}
+
+- (NSMutableDictionary *)selectedLargeFileTabRecord
+{
+    if (!_currentDocumentReadOnly ||
+        _selectedDocumentTabIndex < 0 ||
+        _selectedDocumentTabIndex >= (NSInteger)[_documentTabs count]) {
+        return nil;
+    }
+    NSMutableDictionary *tab = [_documentTabs objectAtIndex:_selectedDocumentTabIndex];
+    if ([tab objectForKey:OMDTabLargeFileSectionStartsKey] == nil) {
+        return nil;
+    }
+    return tab;
+}
+
+- (BOOL)showLargeFileSectionAtByteOffset:(unsigned long long)byteOffset
+                           sectionStarts:(NSArray *)sectionStarts
+{
+    NSString *path = [self resolvedAbsolutePathForLocalPath:_currentPath];
+    if ([path length] == 0) {
+        return NO;
+    }
+
+    NSString *displayTitle = [path lastPathComponent];
+    unsigned long long nextOffset = 0;
+    NSString *text = [self textOfLargeFileAtPath:path
+                                      byteOffset:byteOffset
+                                        markdown:(_currentDocumentRenderMode == OMDDocumentRenderModeMarkdown)
+                                      actionName:@"Show Section"
+                                    displayTitle:&displayTitle
+                                      nextOffset:&nextOffset];
+    if (text == nil) {
+        return NO;
+    }
+
+    NSMutableDictionary *tab = [self newDocumentTabWithMarkdown:text
+                                                     sourcePath:path
+                                                   displayTitle:displayTitle
+                                                       readOnly:YES
+                                                     renderMode:_currentDocumentRenderMode
+                                                 syntaxLanguage:_currentDocumentSyntaxLanguage
+                                                diskFingerprint:[self diskFingerprintForPath:path]];
+    OMDTabRecordSetLargeFileSection(tab, sectionStarts, nextOffset);
+    [self installDocumentTabRecord:tab inNewTab:NO resetViewport:YES];
     return YES;
 }
 
+- (void)showNextLargeFileSection:(id)sender
+{
+    (void)sender;
+    NSMutableDictionary *tab = [self selectedLargeFileTabRecord];
+    NSNumber *next = [tab objectForKey:OMDTabLargeFileNextSectionKey];
+    if (next == nil) {
+        return;
+    }
+    NSArray *starts = [[tab objectForKey:OMDTabLargeFileSectionStartsKey] arrayByAddingObject:next];
+    [self showLargeFileSectionAtByteOffset:[next unsignedLongLongValue] sectionStarts:starts];
+}
+
+- (void)showPreviousLargeFileSection:(id)sender
+{
+    (void)sender;
+    NSArray *starts = [[self selectedLargeFileTabRecord] objectForKey:OMDTabLargeFileSectionStartsKey];
+    if ([starts count] < 2) {
+        return;
+    }
+    starts = [starts subarrayWithRange:NSMakeRange(0, [starts count] - 1)];
+    [self showLargeFileSectionAtByteOffset:[[starts lastObject] unsignedLongLongValue] sectionStarts:starts];
+}
+
 - (void)setCurrentDocumentText:(NSString *)text
                     sourcePath:(NSString *)sourcePath
                     renderMode:(OMDDocumentRenderMode)renderMode
@@ -7009,6 +7619,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
     _sourceRevision = 0;
     _lastRenderedSourceRevision = 0;
     _lastRenderedLayoutWidth = -1.0;
+    _previewNeedsProgressiveRender = YES;
     _isProgrammaticSelectionSync = NO;
     [self cancelPendingRecoveryAutosave];
 
@@ -7134,23 +7745,34 @@ static NSMutableArray *OMDSecondaryWindows(void)
     NSString *syntaxLanguage = nil;
     NSString *fingerprint = nil;
     OMDDocumentRenderMode renderMode = OMDDocumentRenderModeMarkdown;
+    BOOL readOnly = NO;
+    unsigned long long largeFileNextOffset = 0;
     if (![self loadDocumentContentsAtPath:path
                                actionName:@"Reload from Disk"
                                  markdown:&markdown
                              displayTitle:&displayTitle
                                renderMode:&renderMode
                            syntaxLanguage:&syntaxLanguage
-                              fingerprint:&fingerprint]) {
+                                 readOnly:&readOnly
+                              fingerprint:&fingerprint
+                      largeFileNextOffset:&largeFileNextOffset]) {
         return NO;
     }
 
     NSMutableDictionary *tab = [self newDocumentTabWithMarkdown:(markdown != nil ? markdown : @"")
                                                      sourcePath:path
                                                    displayTitle:displayTitle
-                                                       readOnly:_currentDocumentReadOnly
+                                                       readOnly:(_currentDocumentReadOnly || readOnly)
                                                      renderMode:renderMode
                                                  syntaxLanguage:syntaxLanguage
                                                 diskFingerprint:fingerprint];
+    if (readOnly) {
+        // The file changed underneath, so earlier section offsets may no
+        // longer fall on line boundaries; start over from the top.
+        OMDTabRecordSetLargeFileSection(tab,
+                                        [NSArray arrayWithObject:[NSNumber numberWithUnsignedLongLong:0]],
+                                        largeFileNextOffset);
+    }
     [self installDocumentTabRecord:tab inNewTab:NO resetViewport:NO];
     [self clearRecoverySnapshot];
     return YES;
@@ -7227,7 +7849,9 @@ static NSMutableArray *OMDSecondaryWindows(void)
     return decoded;
 }
 
-- (BOOL)importDocumentAtPath:(NSString *)path
+// Returns whether the conversion was started; completion runs once the
+// document has opened or the import has failed, unless it is cancelled.
+- (BOOL)importDocumentAtPath:(NSString *)path completion:(void (^)(NSUInteger openedCount))completion
 {
     NSString *extension = [[path pathExtension] lowercaseString];
     if (![OMDDocumentConverter isSupportedExtension:extension]) {
@@ -7242,28 +7866,120 @@ static NSMutableArray *OMDSecondaryWindows(void)
         return NO;
     }
 
-    NSString *importedMarkdown = nil;
-    NSError *error = nil;
-    BOOL success = [[self documentConverter] importFileAtPath:path
-                                                     markdown:&importedMarkdown
-                                                        error:&error];
-    if (!success) {
-        [self presentConverterError:error fallbackTitle:@"Import failed"];
-        return NO;
+    [self importDocumentsAtPaths:[NSArray arrayWithObject:path] inNewTab:NO completion:completion];
+    return YES;
+}
+
+- (void)showPendingConversionStatus
+{
+    NSUInteger pending = [_pendingConversionTasks count];
+    if (pending == 0) {
+        [self showExportProgressText:nil];
+    } else if (pending == 1) {
+        OMDConversionTask *task = [_pendingConversionTasks objectAtIndex:0];
+        [self showExportProgressText:[NSString stringWithFormat:@"Converting %@...",
+                                                                [[task path] lastPathComponent]]];
+    } else {
+        [self showExportProgressText:[NSString stringWithFormat:@"Converting %lu documents...",
+                                                                (unsigned long)pending]];
     }
+}
 
-    BOOL opened = [self openDocumentWithMarkdown:(importedMarkdown != nil ? importedMarkdown : @"")
-                                       sourcePath:path
-                                     displayTitle:[path lastPathComponent]
-                                         readOnly:NO
-                                       renderMode:OMDDocumentRenderModeMarkdown
-                                   syntaxLanguage:nil
-                                         inNewTab:NO
-                              requireDirtyConfirm:YES];
-    if (opened) {
-        [self noteRecentDocumentAtPathIfAvailable:path];
+// Conversions run on the converter's worker pool, so the window stays
+// responsive and several files convert at once. Tabs still open in the
+// order the files were chosen, each as soon as it and those before it are
+// done.
+- (void)importDocumentsAtPaths:(NSArray *)paths inNewTab:(BOOL)inNewTab
+{
+    [self importDocumentsAtPaths:paths inNewTab:inNewTab completion:nil];
+}
+
+- (void)importDocumentsAtPaths:(NSArray *)paths
+                      inNewTab:(BOOL)inNewTab
+                    completion:(void (^)(NSUInteger openedCount))completion
+{
+    OMDDocumentConverter *converter = [self documentConverter];
+    NSUInteger count = [paths count];
+    if (converter == nil || count == 0) {
+        if (completion != nil) {
+            completion(0);
+        }
+        return;
     }
-    return opened;
+    void (^finished)(NSUInteger) = [[completion copy] autorelease];
+    if (_pendingConversionTasks == nil) {
+        _pendingConversionTasks = [[NSMutableArray alloc] init];
+    }
+
+    NSMutableArray *results = [NSMutableArray arrayWithCapacity:count];
+    NSUInteger index = 0;
+    for (; index < count; index++) {
+        [results addObject:[NSNull null]];
+    }
+    __block NSUInteger nextToOpen = 0;
+    __block NSUInteger openedCount = 0;
+
+    for (index = 0; index < count; index++) {
+        NSString *path = [paths objectAtIndex:index];
+        NSUInteger resultIndex = index;
+        OMDConversionTask *task = [converter importFileAtPath:path
+                                                   completion:^(NSString *markdown, NSError *error) {
+            for (OMDConversionTask *pending in _pendingConversionTasks) {
+                if ([[pending path] isEqualToString:path]) {
+                    [_pendingConversionTasks removeObjectIdenticalTo:pending];
+                    break;
+                }
+            }
+            [self showPendingConversionStatus];
+
+            id result = (markdown != nil ? (id)markdown : (error != nil ? (id)error : (id)@""));
+            [results replaceObjectAtIndex:resultIndex withObject:result];
+            while (nextToOpen < count && [results objectAtIndex:nextToOpen] != [NSNull null]) {
+                NSString *openPath = [paths objectAtIndex:nextToOpen];
+                id ready = [results objectAtIndex:nextToOpen];
+                BOOL newTab = (inNewTab || nextToOpen > 0);
+                nextToOpen += 1;
+                if ([ready isKindOfClass:[NSError class]]) {
+                    [self presentConverterError:ready
+                                  fallbackTitle:[NSString stringWithFormat:@"Import of %@ failed",
+                                                                           [openPath lastPathComponent]]];
+                    if (nextToOpen == count && finished != nil) {
+                        finished(openedCount);
+                    }
+                    continue;
+                }
+                BOOL opened = [self openDocumentWithMarkdown:ready
+                                                  sourcePath:openPath
+                                                displayTitle:[openPath lastPathComponent]
+                                                    readOnly:NO
+                                                  renderMode:OMDDocumentRenderModeMarkdown
+                                              syntaxLanguage:nil
+                                                    inNewTab:newTab
+                                         requireDirtyConfirm:!newTab];
+                if (opened) {
+                    openedCount += 1;
+                    [self noteRecentDocumentAtPathIfAvailable:openPath];
+                }
+                if (nextToOpen == count && finished != nil) {
+                    finished(openedCount);
+                }
+            }
+        }];
+        [_pendingConversionTasks addObject:task];
+    }
+    [self showPendingConversionStatus];
+}
+
+- (void)cancelPendingConversions
+{
+    if ([_pendingConversionTasks count] == 0) {
+        return;
+    }
+    for (OMDConversionTask *task in _pendingConversionTasks) {
+        [task cancel];
+    }
+    [_pendingConversionTasks removeAllObjects];
+    [self showPendingConversionStatus];
 }
 
 - (NSString *)defaultExportFileNameWithExtension:(NSString *)extension
@@ -7797,13 +8513,18 @@ static NSMutableArray *OMDSecondaryWindows(void)
     }
     [NSApp activateIgnoringOtherApps:YES];
 
-    if ([self exportDocumentAsPDFToPath:path]) {
-        NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
-        unsigned long long fileSize = [[attributes objectForKey:NSFileSize] unsignedLongLongValue];
-        OMDLogPrintDiagnostics([NSString stringWithFormat:@"launch PDF export automation succeeded path=%@ size=%llu",
-                                                          path,
-                                                          fileSize]);
-    } else {
+    BOOL started = [self exportDocumentAsPDFToPath:path completion:^(BOOL success) {
+        if (success) {
+            NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
+            unsigned long long fileSize = [[attributes objectForKey:NSFileSize] unsignedLongLongValue];
+            OMDLogPrintDiagnostics([NSString stringWithFormat:@"launch PDF export automation succeeded path=%@ size=%llu",
+                                                              path,
+                                                              fileSize]);
+        } else {
+            OMDLogPrintDiagnostics([NSString stringWithFormat:@"launch PDF export automation failed path=%@", path]);
+        }
+    }];
+    if (!started) {
         OMDLogPrintDiagnostics([NSString stringWithFormat:@"launch PDF export automation failed path=%@", path]);
     }
 }
@@ -7891,22 +8612,100 @@ static NSMutableArray *OMDSecondaryWindows(void)
     if (width < 240.0) {
         width = 240.0;
     }
-    return width;
+    return width;
+}
+
+// One renderer serves every print and export so that consecutive exports
+// share its warm state; math and image assets are cached process-wide.
+- (OMMarkdownRenderer *)printRenderer
+{
+    if (_printRenderer == nil) {
+        _printRenderer = [[OMMarkdownRenderer alloc] initWithTheme:nil
+                                                    parsingOptions:[OMMarkdownParsingOptions defaultOptions]];
+    }
+    return _printRenderer;
+}
+
+- (void)showExportProgressText:(NSString *)text
+{
+    if (_previewStatusLabel == nil) {
+        return;
+    }
+    if (text == nil) {
+        [self updatePreviewStatusIndicator];
+        return;
+    }
+    [_previewStatusLabel setStringValue:text];
+    [_previewStatusLabel setTextColor:[NSColor colorWithCalibratedRed:0.85 green:0.50 blue:0.10 alpha:1.0]];
+    [_previewStatusLabel setHidden:NO];
+}
+
+// Shown while a print or export render runs; its Cancel button abandons
+// the render.
+- (void)showPrintRenderPanel
+{
+    if (_printRenderPanel == nil) {
+        _printRenderPanel = [[NSPanel alloc] initWithContentRect:NSMakeRect(0.0, 0.0, 340.0, 92.0)
+                                                       styleMask:NSTitledWindowMask
+                                                         backing:NSBackingStoreBuffered
+                                                           defer:NO];
+        [_printRenderPanel setTitle:@"Preparing Document"];
+        [_printRenderPanel setReleasedWhenClosed:NO];
+        NSView *content = [_printRenderPanel contentView];
+
+        _printRenderPanelLabel = [[[NSTextField alloc] initWithFrame:NSMakeRect(16.0, 52.0, 308.0, 22.0)] autorelease];
+        [_printRenderPanelLabel setEditable:NO];
+        [_printRenderPanelLabel setSelectable:NO];
+        [_printRenderPanelLabel setBezeled:NO];
+        [_printRenderPanelLabel setDrawsBackground:NO];
+        [content addSubview:_printRenderPanelLabel];
+
+        NSButton *cancelButton = [[[NSButton alloc] initWithFrame:NSMakeRect(234.0, 12.0, 90.0, 28.0)] autorelease];
+        [cancelButton setTitle:@"Cancel"];
+        [cancelButton setBezelStyle:NSRoundedBezelStyle];
+        [cancelButton setKeyEquivalent:@"\e"];
+        [cancelButton setTarget:self];
+        [cancelButton setAction:@selector(cancelPrintRender:)];
+        [content addSubview:cancelButton];
+    }
+    [_printRenderPanelLabel setStringValue:@"Rendering for export..."];
+    [_printRenderPanel center];
+    [_printRenderPanel makeKeyAndOrderFront:nil];
+}
+
+- (void)closePrintRenderPanel
+{
+    [_printRenderPanel orderOut:nil];
+}
+
+- (void)cancelPrintRender:(id)sender
+{
+    (void)sender;
+    [_printRenderJob cancel];
+    [_printRenderJob release];
+    _printRenderJob = nil;
+    [self closePrintRenderPanel];
 }
 
-- (OMDTextView *)newPrintTextViewForPrintInfo:(NSPrintInfo *)printInfo
+// Print and export render on a worker, so the window stays responsive and
+// the panel can report progress (and be cancelled) while asset generation
+// and the concurrent block pass are under way. The renderer hands its
+// table layout and text measuring back to the main thread meanwhile.
+// completion runs on the main thread with a view the caller may keep only
+// for the duration of the call. Returns NO when there is nothing to render.
+- (BOOL)preparePrintTextViewForPrintInfo:(NSPrintInfo *)printInfo
+                              completion:(void (^)(OMDTextView *printView))completion
 {
     if (_currentMarkdown == nil) {
-        return nil;
+        return NO;
     }
     NSString *previewMarkdown = [self markdownForCurrentPreview];
     if (previewMarkdown == nil) {
-        return nil;
+        return NO;
     }
 
     CGFloat viewWidth = [self printableContentWidthForPrintInfo:printInfo];
     CGFloat insetX = 20.0;
-    CGFloat insetY = 16.0;
     CGFloat layoutWidth = viewWidth - (insetX * 2.0);
     if (layoutWidth < 1.0) {
         layoutWidth = viewWidth;
@@ -7919,11 +8718,73 @@ static NSMutableArray *OMDSecondaryWindows(void)
         printOptions = [OMMarkdownParsingOptions defaultOptions];
     }
 
-    OMMarkdownRenderer *printRenderer = [[OMMarkdownRenderer alloc] initWithTheme:nil
-                                                                   parsingOptions:printOptions];
+    OMMarkdownRenderer *printRenderer = [self printRenderer];
+    [printRenderer setParsingOptions:printOptions];
     [printRenderer setZoomScale:OMDPrintExportZoomScale];
     [printRenderer setLayoutWidth:layoutWidth];
-    NSAttributedString *rendered = [printRenderer attributedStringFromMarkdown:previewMarkdown];
+    OMMarkdownRenderSettings *settings = [printRenderer currentRenderSettings];
+    NSColor *background = [printRenderer backgroundColor];
+
+    [self cancelPrintRender:nil];
+    OMDPrintRenderJob *job = [[OMDPrintRenderJob alloc] init];
+    _printRenderJob = job;
+    [self showPrintRenderPanel];
+
+    NSString *markdown = [[previewMarkdown copy] autorelease];
+    void (^finish)(OMDTextView *) = [[completion copy] autorelease];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+        @autoreleasepool {
+            NSAttributedString *rendered = [printRenderer exportAttributedStringFromMarkdown:markdown
+                                                                              renderSettings:settings
+                                                                             progressHandler:^(OMMarkdownRendererExportPhase phase,
+                                                                                               NSUInteger completed,
+                                                                                               NSUInteger total) {
+                if ([job recordPhase:phase completed:completed total:total]) {
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        NSString *text = [job takeProgressText];
+                        if (job == _printRenderJob && text != nil) {
+                            [_printRenderPanelLabel setStringValue:text];
+                        }
+                    });
+                }
+            }
+                                                                           cancellationCheck:^BOOL(void) {
+                return [job isCancelled];
+            }];
+            NSArray *codeBlockRanges = [printRenderer codeBlockRanges];
+            NSArray *blockquoteRanges = [printRenderer blockquoteRanges];
+            dispatch_async(dispatch_get_main_queue(), ^{
+                if (rendered == nil || [job isCancelled] || job != _printRenderJob) {
+                    return;
+                }
+                [_printRenderJob release];
+                _printRenderJob = nil;
+                [self closePrintRenderPanel];
+                OMDTextView *printView = [self newPrintTextViewWithRenderedString:rendered
+                                                                  codeBlockRanges:codeBlockRanges
+                                                                 blockquoteRanges:blockquoteRanges
+                                                                  backgroundColor:background
+                                                                        viewWidth:viewWidth
+                                                                      layoutWidth:layoutWidth];
+                if (finish != nil) {
+                    finish(printView);
+                }
+                [printView release];
+            });
+        }
+    });
+    return YES;
+}
+
+- (OMDTextView *)newPrintTextViewWithRenderedString:(NSAttributedString *)rendered
+                                    codeBlockRanges:(NSArray *)codeBlockRanges
+                                   blockquoteRanges:(NSArray *)blockquoteRanges
+                                    backgroundColor:(NSColor *)background
+                                          viewWidth:(CGFloat)viewWidth
+                                        layoutWidth:(CGFloat)layoutWidth
+{
+    CGFloat insetX = 20.0;
+    CGFloat insetY = 16.0;
 
     OMDTextView *printView = [[OMDTextView alloc] initWithFrame:NSMakeRect(0.0, 0.0, viewWidth, 100.0)];
     [printView setEditable:NO];
@@ -7933,7 +8794,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [printView setTextContainerInset:NSMakeSize(insetX, insetY)];
     [[printView textContainer] setLineFragmentPadding:0.0];
     [[printView textStorage] setAttributedString:rendered];
-    [printView setCodeBlockRanges:[printRenderer codeBlockRanges]];
+    [printView setCodeBlockRanges:codeBlockRanges];
     [printView setCodeBlockBackgroundColor:[NSColor colorWithCalibratedRed:(239.0 / 255.0)
                                                                       green:(243.0 / 255.0)
                                                                        blue:(247.0 / 255.0)
@@ -7945,11 +8806,10 @@ static NSMutableArray *OMDSecondaryWindows(void)
     [printView setCodeBlockPadding:NSMakeSize(20.0, 14.0)];
     [printView setCodeBlockCornerRadius:6.0];
     [printView setCodeBlockBorderWidth:1.0];
-    [printView setBlockquoteRanges:[printRenderer blockquoteRanges]];
+    [printView setBlockquoteRanges:blockquoteRanges];
     [printView setBlockquoteLineColor:[NSColor colorWithCalibratedWhite:0.82 alpha:1.0]];
     [printView setBlockquoteLineWidth:3.0];
 
-    NSColor *background = [printRenderer backgroundColor];
     if (background != nil) {
         [printView setBackgroundColor:background];
     } else {
@@ -7972,8 +8832,6 @@ static NSMutableArray *OMDSecondaryWindows(void)
     }
     [printView setFrame:NSMakeRect(0.0, 0.0, viewWidth, viewHeight)];
     [printView setNeedsDisplay:YES];
-
-    [printRenderer release];
     return printView;
 }
 
@@ -7985,12 +8843,16 @@ static NSMutableArray *OMDSecondaryWindows(void)
     }
 
     NSPrintInfo *printInfo = [self configuredPrintInfo];
-    OMDTextView *printView = [self newPrintTextViewForPrintInfo:printInfo];
-    if (printView == nil) {
+    BOOL started = [self preparePrintTextViewForPrintInfo:printInfo completion:^(OMDTextView *printView) {
+        [self runPrintOperationForPrintView:printView printInfo:printInfo];
+    }];
+    if (!started) {
         OMDLogPrintDiagnostics(@"printDocument aborting because printView is nil");
-        return;
     }
+}
 
+- (void)runPrintOperationForPrintView:(OMDTextView *)printView printInfo:(NSPrintInfo *)printInfo
+{
     BOOL ok = NO;
 #if defined(_WIN32)
     NSString *temporaryPDFPath = [self temporaryPDFPrintPath];
@@ -8008,7 +8870,6 @@ static NSMutableArray *OMDSecondaryWindows(void)
     ok = [operation runOperation];
     [self logPrintDiagnosticsForOperation:operation printInfo:printInfo stage:@"after runOperation"];
 #endif
-    [printView release];
 
     if (!ok) {
         NSAlert *alert = [[[NSAlert alloc] init] autorelease];
@@ -8334,7 +9195,10 @@ static NSMutableArray *OMDSecondaryWindows(void)
 }
 #endif
 
-- (BOOL)exportDocumentAsPDFToPath:(NSString *)path
+// Returns NO when nothing could be started; otherwise completion runs on
+// the main thread once the PDF is written, or not at all when the render is
+// cancelled.
+- (BOOL)exportDocumentAsPDFToPath:(NSString *)path completion:(void (^)(BOOL success))completion
 {
     if (path == nil || [path length] == 0) {
         OMDLogPrintDiagnostics(@"export PDF aborted because destination path is empty");
@@ -8349,37 +9213,37 @@ static NSMutableArray *OMDSecondaryWindows(void)
     OMDLogPrintDiagnostics([NSString stringWithFormat:@"export PDF destination=%@", normalizedPath]);
 
     NSPrintInfo *printInfo = [self configuredPrintInfo];
-    OMDTextView *printView = [self newPrintTextViewForPrintInfo:printInfo];
-    if (printView == nil) {
-        OMDLogPrintDiagnostics(@"export PDF aborting because printView is nil");
-        return NO;
-    }
-
+    BOOL started = [self preparePrintTextViewForPrintInfo:printInfo completion:^(OMDTextView *printView) {
 #if defined(_WIN32)
-    NSString *browserPath = [self windowsHeadlessBrowserPath];
-    BOOL success = (browserPath != nil &&
-                    [self exportPrintView:printView toPDFAtPath:normalizedPath usingBrowser:browserPath]);
+        NSString *browserPath = [self windowsHeadlessBrowserPath];
+        BOOL success = (browserPath != nil &&
+                        [self exportPrintView:printView toPDFAtPath:normalizedPath usingBrowser:browserPath]);
 #else
-    [printInfo setJobDisposition:NSPrintSaveJob];
-    [[printInfo dictionary] setObject:normalizedPath forKey:NSPrintSavePath];
-
-    NSPrintOperation *operation = [NSPrintOperation printOperationWithView:printView
-                                                                 printInfo:printInfo];
-    [self logPrintDiagnosticsForOperation:operation printInfo:printInfo stage:@"before export runOperation"];
-    [operation setShowsPrintPanel:NO];
-    [operation setShowsProgressPanel:YES];
-    BOOL success = [operation runOperation];
-    [self logPrintDiagnosticsForOperation:operation printInfo:printInfo stage:@"after export runOperation"];
+        [printInfo setJobDisposition:NSPrintSaveJob];
+        [[printInfo dictionary] setObject:normalizedPath forKey:NSPrintSavePath];
+
+        NSPrintOperation *operation = [NSPrintOperation printOperationWithView:printView
+                                                                     printInfo:printInfo];
+        [self logPrintDiagnosticsForOperation:operation printInfo:printInfo stage:@"before export runOperation"];
+        [operation setShowsPrintPanel:NO];
+        [operation setShowsProgressPanel:YES];
+        BOOL success = [operation runOperation];
+        [self logPrintDiagnosticsForOperation:operation printInfo:printInfo stage:@"after export runOperation"];
 #endif
 
-    [printView release];
-
-    BOOL fileExists = [[NSFileManager defaultManager] fileExistsAtPath:normalizedPath];
-    OMDLogPrintDiagnostics([NSString stringWithFormat:@"export PDF result success=%@ fileExists=%@ path=%@",
-                                                      (success ? @"YES" : @"NO"),
-                                                      (fileExists ? @"YES" : @"NO"),
-                                                      normalizedPath]);
-    return success && fileExists;
+        BOOL fileExists = [[NSFileManager defaultManager] fileExistsAtPath:normalizedPath];
+        OMDLogPrintDiagnostics([NSString stringWithFormat:@"export PDF result success=%@ fileExists=%@ path=%@",
+                                                          (success ? @"YES" : @"NO"),
+                                                          (fileExists ? @"YES" : @"NO"),
+                                                          normalizedPath]);
+        if (completion != nil) {
+            completion(success && fileExists);
+        }
+    }];
+    if (!started) {
+        OMDLogPrintDiagnostics(@"export PDF aborting because printView is nil");
+    }
+    return started;
 }
 
 - (void)exportDocumentAsPDF:(id)sender
@@ -8421,13 +9285,19 @@ static NSMutableArray *OMDSecondaryWindows(void)
         return;
     }
 #endif
-    BOOL success = [self exportDocumentAsPDFToPath:path];
-
-    if (!success) {
+    void (^reportFailure)(void) = ^{
         NSAlert *alert = [[[NSAlert alloc] init] autorelease];
         [alert setMessageText:@"Export failed"];
         [alert setInformativeText:@"The PDF could not be created."];
         [alert runModal];
+    };
+    BOOL started = [self exportDocumentAsPDFToPath:path completion:^(BOOL success) {
+        if (!success) {
+            reportFailure();
+        }
+    }];
+    if (!started) {
+        reportFailure();
     }
 }
 
@@ -8459,6 +9329,47 @@ static NSMutableArray *OMDSecondaryWindows(void)
                        actionName:@"Export as HTML"];
 }
 
+- (void)exportPerformanceTrace:(id)sender
+{
+    (void)sender;
+    NSString *fileName = [NSString stringWithFormat:@"MarkdownViewer-trace-%d.json",
+                                                    (int)[[NSProcessInfo processInfo] processIdentifier]];
+#if defined(_WIN32)
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:fileName];
+#else
+    NSSavePanel *panel = [NSSavePanel savePanel];
+    [panel setAllowedFileTypes:[NSArray arrayWithObject:@"json"]];
+    [panel setCanCreateDirectories:YES];
+    [panel setTitle:@"Export Performance Trace"];
+    [panel setPrompt:@"Export"];
+    [panel setNameFieldStringValue:fileName];
+    NSInteger result = [panel runModal];
+    if (result != NSOKButton && result != NSFileHandlingPanelOKButton) {
+        return;
+    }
+    NSString *path = OMDSelectedPathFromSavePanel(panel);
+    if (path == nil || [path length] == 0) {
+        return;
+    }
+#endif
+
+    NSError *error = nil;
+    if (!OMPerfTraceWriteChromeJSON(path, &error)) {
+        NSAlert *alert = [[[NSAlert alloc] init] autorelease];
+        [alert setMessageText:@"Export failed"];
+        [alert setInformativeText:(error != nil ? [error localizedDescription] : @"The trace could not be written.")];
+        [alert runModal];
+        return;
+    }
+    NSLog(@"[Perf][Trace] wrote %@", path);
+#if defined(_WIN32)
+    NSAlert *alert = [[[NSAlert alloc] init] autorelease];
+    [alert setMessageText:@"Performance trace exported"];
+    [alert setInformativeText:path];
+    [alert runModal];
+#endif
+}
+
 - (void)exportDocumentWithTitle:(NSString *)panelTitle
                       extension:(NSString *)extension
                      actionName:(NSString *)actionName
@@ -8507,44 +9418,336 @@ static NSMutableArray *OMDSecondaryWindows(void)
 }
 
 - (void)renderCurrentMarkdown
+{
+    [self renderCurrentMarkdownAsynchronously:NO];
+}
+
+- (void)renderCurrentMarkdownAsynchronously:(BOOL)asynchronous
 {
     NSString *previewMarkdown = [self markdownForCurrentPreview];
     if (previewMarkdown == nil) {
+        [self advancePreviewRenderToken];
         [self clearPreviewPresentation];
         [self setPreviewUpdating:NO];
         return;
     }
     if (![self isPreviewVisible]) {
+        [self advancePreviewRenderToken];
         [self setPreviewUpdating:NO];
         return;
     }
     [self setPreviewUpdating:YES];
     NSTimeInterval renderStart = OMDNow();
     BOOL sampledAsZoomRender = ((renderStart - _lastZoomSliderEventTime) <= OMDZoomAdaptiveSamplingWindow);
-    BOOL perfLogging = OMDPerformanceLoggingEnabled();
     NSUInteger revisionAtRenderStart = _sourceRevision;
     [self cancelPendingInteractiveRender];
     [self cancelPendingMathArtifactRender];
     [self cancelPendingLivePreviewRender];
     [_renderer setZoomScale:_zoomScale];
     [self updateRendererLayoutWidth];
-    NSTimeInterval markdownStart = perfLogging ? OMDNow() : 0.0;
-    NSAttributedString *rendered = [_renderer attributedStringFromMarkdown:previewMarkdown];
-    OMDStartupTrace([NSString stringWithFormat:@"renderCurrentMarkdown: policy=%ld attachments=%lu renderedLength=%lu markdownLength=%lu",
-                                               (long)[self currentMathRenderingPolicy],
-                                               (unsigned long)OMDCountAttachmentsInAttributedString(rendered),
-                                               (unsigned long)(rendered != nil ? [rendered length] : 0),
-                                               (unsigned long)[previewMarkdown length]]);
-    NSTimeInterval markdownMs = perfLogging ? ((OMDNow() - markdownStart) * 1000.0) : 0.0;
-    NSTimeInterval applyStart = perfLogging ? OMDNow() : 0.0;
+    NSString *configurationKey = [_renderer renderConfigurationKey];
+    if (_tabRenderRestoreIdentifier != nil) {
+        NSString *identifier = [_tabRenderRestoreIdentifier autorelease];
+        _tabRenderRestoreIdentifier = nil;
+        OMDTabRenderSnapshot *snapshot = [[self tabRenderCache] snapshotForTabIdentifier:identifier
+                                                                                markdown:previewMarkdown
+                                                                        configurationKey:configurationKey];
+        if (snapshot != nil) {
+            [self applyTabRenderSnapshot:snapshot renderStart:renderStart];
+            return;
+        }
+    }
+
+    // Every render goes through the same serial queue so the renderer's
+    // block cache always diffs against the render that finished last.
+    // Bumping the token cancels whatever render is still in flight. The
+    // worker renders with the settings as they are now and never reads the
+    // token itself; results are matched against it back on main.
+    NSUInteger token = [self advancePreviewRenderToken];
+    OMDPreviewRenderRequest *request = [[OMDPreviewRenderRequest alloc] initWithToken:token
+                                                                             settings:[_renderer currentRenderSettings]];
+    _previewRenderRequest = request;
+    NSString *markdown = [previewMarkdown copy];
+    OMMarkdownRenderer *renderer = [_renderer retain];
+    _previewFirstPaintMs = -1.0;
+    // A freshly opened large document paints its viewport first and streams
+    // the rest in, so time to first paint does not grow with file size.
+    BOOL progressive = (_previewNeedsProgressiveRender &&
+                        [markdown length] >= OMDProgressivePreviewThreshold);
+    _previewNeedsProgressiveRender = NO;
+    if (progressive) {
+        NSRange priorityLineRange = [self previewPriorityLineRange];
+        dispatch_async(OMDPreviewRenderQueue(), ^{
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            NSDictionary *result = [[self renderPreviewMarkdownProgressively:markdown
+                                                                withRenderer:renderer
+                                                                     request:request
+                                                           priorityLineRange:priorityLineRange
+                                                                 renderStart:renderStart] retain];
+            dispatch_async(dispatch_get_main_queue(), ^{
+                if (result != nil && token == _previewRenderToken) {
+                    [self applyPreviewRenderResult:result
+                                          markdown:markdown
+                                  configurationKey:configurationKey
+                                    sourceRevision:revisionAtRenderStart
+                                       renderStart:renderStart
+                               sampledAsZoomRender:sampledAsZoomRender];
+                }
+                [result release];
+                [renderer release];
+                [markdown release];
+            });
+            [pool release];
+        });
+        return;
+    }
+    if (!asynchronous) {
+        // Not dispatch_sync: table layout and text measuring inside the
+        // render run on this thread, which keeps serving them while it waits.
+        __block NSDictionary *result = nil;
+        dispatch_semaphore_t finished = dispatch_semaphore_create(0);
+        dispatch_async(OMDPreviewRenderQueue(), ^{
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            result = [[self renderPreviewMarkdown:markdown withRenderer:renderer request:request] retain];
+            [pool release];
+            dispatch_semaphore_signal(finished);
+        });
+        OMMarkdownRendererWaitForSemaphore(finished, 0.0);
+        dispatch_release(finished);
+        if (result != nil) {
+            [self applyPreviewRenderResult:result
+                                  markdown:markdown
+                          configurationKey:configurationKey
+                            sourceRevision:revisionAtRenderStart
+                               renderStart:renderStart
+                       sampledAsZoomRender:sampledAsZoomRender];
+        }
+        [result release];
+        [renderer release];
+        [markdown release];
+        return;
+    }
+
+    dispatch_async(OMDPreviewRenderQueue(), ^{
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        NSDictionary *result = [[self renderPreviewMarkdown:markdown withRenderer:renderer request:request] retain];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (result != nil && token == _previewRenderToken) {
+                [self applyPreviewRenderResult:result
+                                      markdown:markdown
+                              configurationKey:configurationKey
+                                sourceRevision:revisionAtRenderStart
+                                   renderStart:renderStart
+                           sampledAsZoomRender:sampledAsZoomRender];
+            }
+            [result release];
+            [renderer release];
+            [markdown release];
+        });
+        [pool release];
+    });
+}
+
+- (NSUInteger)advancePreviewRenderToken
+{
+    _previewRenderToken += 1;
+    [_previewRenderRequest cancel];
+    [_previewRenderRequest release];
+    _previewRenderRequest = nil;
+    return _previewRenderToken;
+}
+
+- (NSDictionary *)renderPreviewMarkdown:(NSString *)markdown
+                           withRenderer:(OMMarkdownRenderer *)renderer
+                                request:(OMDPreviewRenderRequest *)request
+{
+    // Runs on OMDPreviewRenderQueue(); _previewRenderBaselineToken is only
+    // touched from there.
+    NSUInteger token = [request token];
+    NSTimeInterval markdownStart = OMDNow();
+    NSRange previousChangedRange = NSMakeRange(0, 0);
+    NSRange changedRange = NSMakeRange(0, 0);
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown
+                                                           renderSettings:[request settings]
+                                                     previousChangedRange:&previousChangedRange
+                                                             changedRange:&changedRange
+                                                        cancellationCheck:^BOOL(void) {
+        return [request isCancelled];
+    }];
+    if (rendered == nil) {
+        return nil;
+    }
+    NSUInteger baselineToken = _previewRenderBaselineToken;
+    _previewRenderBaselineToken = token;
+    return [self previewRenderResultWithRenderer:renderer
+                                        rendered:rendered
+                            previousChangedRange:previousChangedRange
+                                    changedRange:changedRange
+                                           token:token
+                                   baselineToken:baselineToken
+                                   markdownStart:markdownStart];
+}
+
+- (NSDictionary *)renderPreviewMarkdownProgressively:(NSString *)markdown
+                                        withRenderer:(OMMarkdownRenderer *)renderer
+                                             request:(OMDPreviewRenderRequest *)request
+                                   priorityLineRange:(NSRange)priorityLineRange
+                                         renderStart:(NSTimeInterval)renderStart
+{
+    // Runs on OMDPreviewRenderQueue(). Tracks what the chunks put into the
+    // preview so the finished result can be spliced onto them.
+    NSUInteger token = [request token];
+    NSTimeInterval markdownStart = OMDNow();
+    __block NSUInteger deliveredLength = 0;
+    __block BOOL deliveredInOrderPrefix = NO;
+    __block BOOL deliveredAnything = NO;
+    NSAttributedString *rendered = [renderer attributedStringFromMarkdown:markdown
+                                                           renderSettings:[request settings]
+                                                        priorityLineRange:priorityLineRange
+                                                         progressInterval:OMDProgressivePreviewChunkLength
+                                                          progressHandler:^(NSAttributedString *partial,
+                                                                            NSUInteger offset,
+                                                                            NSArray *codeBlockRanges,
+                                                                            NSArray *blockquoteRanges,
+                                                                            NSArray *blockAnchors,
+                                                                            BOOL priorityOnly) {
+        deliveredLength = offset + [partial length];
+        deliveredInOrderPrefix = !priorityOnly;
+        deliveredAnything = YES;
+        NSMutableDictionary *chunk = [NSMutableDictionary dictionaryWithCapacity:6];
+        [chunk setObject:partial forKey:@"partial"];
+        [chunk setObject:[NSNumber numberWithUnsignedInteger:offset] forKey:@"offset"];
+        [chunk setObject:[NSNumber numberWithBool:priorityOnly] forKey:@"priorityOnly"];
+        [chunk setObject:(codeBlockRanges != nil ? codeBlockRanges : [NSArray array]) forKey:@"codeBlockRanges"];
+        [chunk setObject:(blockquoteRanges != nil ? blockquoteRanges : [NSArray array]) forKey:@"blockquoteRanges"];
+        [chunk setObject:(blockAnchors != nil ? blockAnchors : [NSArray array]) forKey:@"blockAnchors"];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self applyPreviewProgressChunk:chunk token:token renderStart:renderStart];
+        });
+    }
+                                                        cancellationCheck:^BOOL(void) {
+        return [request isCancelled];
+    }];
+    if (rendered == nil) {
+        return nil;
+    }
+    _previewRenderBaselineToken = token;
+
+    NSUInteger renderedLength = [rendered length];
+    NSRange previousChangedRange = NSMakeRange(0, deliveredLength);
+    NSRange changedRange = NSMakeRange(0, renderedLength);
+    if (deliveredInOrderPrefix) {
+        // The chunks are a prefix of the untrimmed output; only the tail differs.
+        NSUInteger common = MIN(deliveredLength, renderedLength);
+        previousChangedRange = NSMakeRange(common, deliveredLength - common);
+        changedRange = NSMakeRange(common, renderedLength - common);
+    }
+    // Baseline 0 never matches an applied token, forcing a full replace when
+    // no chunk reached the preview.
+    return [self previewRenderResultWithRenderer:renderer
+                                        rendered:rendered
+                            previousChangedRange:previousChangedRange
+                                    changedRange:changedRange
+                                           token:token
+                                   baselineToken:(deliveredAnything ? token : 0)
+                                   markdownStart:markdownStart];
+}
+
+- (NSDictionary *)previewRenderResultWithRenderer:(OMMarkdownRenderer *)renderer
+                                         rendered:(NSAttributedString *)rendered
+                             previousChangedRange:(NSRange)previousChangedRange
+                                     changedRange:(NSRange)changedRange
+                                            token:(NSUInteger)token
+                                    baselineToken:(NSUInteger)baselineToken
+                                    markdownStart:(NSTimeInterval)markdownStart
+{
+    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:10];
+    [result setObject:rendered forKey:@"rendered"];
+    [result setObject:[NSValue valueWithRange:previousChangedRange] forKey:@"previousChangedRange"];
+    [result setObject:[NSValue valueWithRange:changedRange] forKey:@"changedRange"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:token] forKey:@"token"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:baselineToken] forKey:@"baselineToken"];
+    [result setObject:[NSNumber numberWithDouble:((OMDNow() - markdownStart) * 1000.0)] forKey:@"markdownMs"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:[renderer lastRenderedBlockCount]] forKey:@"renderedBlocks"];
+    [result setObject:[NSNumber numberWithUnsignedInteger:[renderer lastReusedBlockCount]] forKey:@"reusedBlocks"];
+    NSArray *codeBlockRanges = [renderer codeBlockRanges];
+    NSArray *blockquoteRanges = [renderer blockquoteRanges];
+    NSArray *blockAnchors = [renderer blockAnchors];
+    [result setObject:(codeBlockRanges != nil ? codeBlockRanges : [NSArray array]) forKey:@"codeBlockRanges"];
+    [result setObject:(blockquoteRanges != nil ? blockquoteRanges : [NSArray array]) forKey:@"blockquoteRanges"];
+    [result setObject:(blockAnchors != nil ? blockAnchors : [NSArray array]) forKey:@"blockAnchors"];
+    return result;
+}
+
+- (void)applyPreviewProgressChunk:(NSDictionary *)chunk
+                            token:(NSUInteger)token
+                      renderStart:(NSTimeInterval)renderStart
+{
+    if (token != _previewRenderToken) {
+        return;
+    }
+    NSAttributedString *partial = [chunk objectForKey:@"partial"];
+    NSUInteger offset = [[chunk objectForKey:@"offset"] unsignedIntegerValue];
+    BOOL priorityOnly = [[chunk objectForKey:@"priorityOnly"] boolValue];
+    NSTextStorage *previewStorage = [_textView textStorage];
+    if (offset > 0 && (offset > [previewStorage length] || _previewAppliedRenderToken != token)) {
+        return;
+    }
+
     _isProgrammaticPreviewUpdate = YES;
-    [[_textView textStorage] setAttributedString:rendered];
+    [previewStorage beginEditing];
+    [previewStorage replaceCharactersInRange:NSMakeRange(offset, [previewStorage length] - offset)
+                        withAttributedString:partial];
+    [previewStorage endEditing];
     _isProgrammaticPreviewUpdate = NO;
-    [self logPreviewStyleDiagnosticsForRenderedString:rendered];
-    NSTimeInterval applyMs = perfLogging ? ((OMDNow() - applyStart) * 1000.0) : 0.0;
+    _previewTextRevision += 1;
+    _previewAppliedRenderToken = token;
+
+    [_previewCodeBlockRanges release];
+    _previewCodeBlockRanges = [[chunk objectForKey:@"codeBlockRanges"] retain];
+    [_previewBlockquoteRanges release];
+    _previewBlockquoteRanges = [[chunk objectForKey:@"blockquoteRanges"] retain];
+    [_previewBlockAnchors release];
+    _previewBlockAnchors = [[chunk objectForKey:@"blockAnchors"] retain];
+
     [self updatePreviewDocumentGeometry];
-    NSTimeInterval postStart = perfLogging ? OMDNow() : 0.0;
-    [self updateCodeBlockButtons];
+    [self updatePreviewDecorations];
+    if (offset == 0) {
+        if (priorityOnly) {
+            [self scrollScrollViewToDocumentTop:_previewScrollView];
+        } else if (_viewerMode == OMDViewerModeSplit) {
+            [self syncPreviewToSourceInteractionAnchor];
+        }
+    }
+    if (_previewFirstPaintMs < 0.0) {
+        _previewFirstPaintMs = (OMDNow() - renderStart) * 1000.0;
+    }
+}
+
+- (NSRange)previewPriorityLineRange
+{
+    NSUInteger firstLine = 1;
+    if (_viewerMode == OMDViewerModeSplit && _sourceTextView != nil && _sourceScrollView != nil) {
+        NSString *sourceText = [_sourceTextView string];
+        NSUInteger location = [self visibleCharacterIndexForTextView:_sourceTextView
+                                                        inScrollView:_sourceScrollView
+                                                      verticalAnchor:0.0];
+        NSUInteger limit = MIN(location, [sourceText length]);
+        NSRange searchRange = NSMakeRange(0, limit);
+        while (searchRange.length > 0) {
+            NSRange newline = [sourceText rangeOfString:@"\n" options:NSLiteralSearch range:searchRange];
+            if (newline.location == NSNotFound) {
+                break;
+            }
+            firstLine += 1;
+            searchRange = NSMakeRange(NSMaxRange(newline), limit - NSMaxRange(newline));
+        }
+    }
+    return NSMakeRange(firstLine, OMDProgressivePreviewViewportLines);
+}
+
+- (void)updatePreviewDecorations
+{
     NSColor *bg = [_renderer backgroundColor];
     if ([_textView isKindOfClass:[OMDTextView class]]) {
         OMDTextView *codeView = (OMDTextView *)_textView;
@@ -8552,7 +9755,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
         [codeView setDocumentBorderColor:OMDResolvedSubtleSeparatorColor()];
         [codeView setDocumentCornerRadius:OMDPreviewPageCornerRadius];
         [codeView setDocumentBorderWidth:OMDPreviewPageBorderWidth];
-        [codeView setCodeBlockRanges:[_renderer codeBlockRanges]];
+        [codeView setCodeBlockRanges:_previewCodeBlockRanges];
         [codeView setCodeBlockBackgroundColor:[NSColor colorWithCalibratedRed:(239.0 / 255.0)
                                                                          green:(243.0 / 255.0)
                                                                           blue:(247.0 / 255.0)
@@ -8564,7 +9767,7 @@ static NSMutableArray *OMDSecondaryWindows(void)
         [codeView setCodeBlockPadding:NSMakeSize(20.0, 14.0)];
         [codeView setCodeBlockCornerRadius:6.0];
         [codeView setCodeBlockBorderWidth:1.0];
-        [codeView setBlockquoteRanges:[_renderer blockquoteRanges]];
+        [codeView setBlockquoteRanges:_previewBlockquoteRanges];
         [codeView setBlockquoteLineColor:[NSColor colorWithCalibratedWhite:0.82 alpha:1.0]];
         [codeView setBlockquoteLineWidth:3.0];
         [codeView setNeedsDisplay:YES];
@@ -8577,6 +9780,72 @@ static NSMutableArray *OMDSecondaryWindows(void)
         [_previewScrollView setDrawsBackground:YES];
         [_previewScrollView setBackgroundColor:OMDResolvedChromeBackgroundColor()];
     }
+}
+
+- (void)applyPreviewRenderResult:(NSDictionary *)result
+                        markdown:(NSString *)previewMarkdown
+                configurationKey:(NSString *)configurationKey
+                  sourceRevision:(NSUInteger)revisionAtRenderStart
+                     renderStart:(NSTimeInterval)renderStart
+             sampledAsZoomRender:(BOOL)sampledAsZoomRender
+{
+    OM_PERF_TRACE_SCOPE("viewer", "apply");
+    BOOL perfLogging = OMDPerformanceLoggingEnabled();
+    NSAttributedString *rendered = [result objectForKey:@"rendered"];
+    NSRange previousChangedRange = [[result objectForKey:@"previousChangedRange"] rangeValue];
+    NSRange changedRange = [[result objectForKey:@"changedRange"] rangeValue];
+    NSUInteger baselineToken = [[result objectForKey:@"baselineToken"] unsignedIntegerValue];
+    NSUInteger renderedBlocks = [[result objectForKey:@"renderedBlocks"] unsignedIntegerValue];
+    NSUInteger reusedBlocks = [[result objectForKey:@"reusedBlocks"] unsignedIntegerValue];
+    NSTimeInterval markdownMs = [[result objectForKey:@"markdownMs"] doubleValue];
+
+    [_previewCodeBlockRanges release];
+    _previewCodeBlockRanges = [[result objectForKey:@"codeBlockRanges"] retain];
+    [_previewBlockquoteRanges release];
+    _previewBlockquoteRanges = [[result objectForKey:@"blockquoteRanges"] retain];
+    [_previewBlockAnchors release];
+    _previewBlockAnchors = [[result objectForKey:@"blockAnchors"] retain];
+
+    OMDStartupTrace([NSString stringWithFormat:@"renderCurrentMarkdown: policy=%ld attachments=%lu renderedLength=%lu markdownLength=%lu",
+                                               (long)[self currentMathRenderingPolicy],
+                                               (unsigned long)OMDCountAttachmentsInAttributedString(rendered),
+                                               (unsigned long)(rendered != nil ? [rendered length] : 0),
+                                               (unsigned long)[previewMarkdown length]]);
+    NSTimeInterval applyStart = perfLogging ? OMDNow() : 0.0;
+    _isProgrammaticPreviewUpdate = YES;
+    NSTextStorage *previewStorage = [_textView textStorage];
+    // Splicing is only valid when the preview still shows the render this
+    // result was diffed against; discarded renders break that chain.
+    NSUInteger previousRenderedLength = [rendered length] - changedRange.length + previousChangedRange.length;
+    BOOL splicePreview = (baselineToken == _previewAppliedRenderToken &&
+                          [previewStorage length] == previousRenderedLength &&
+                          NSMaxRange(previousChangedRange) <= [previewStorage length] &&
+                          NSMaxRange(changedRange) <= [rendered length]);
+    if (splicePreview) {
+        if (previousChangedRange.length > 0 || changedRange.length > 0) {
+            [previewStorage beginEditing];
+            [previewStorage replaceCharactersInRange:previousChangedRange
+                                withAttributedString:[rendered attributedSubstringFromRange:changedRange]];
+            [previewStorage endEditing];
+        }
+    } else {
+        [previewStorage setAttributedString:rendered];
+    }
+    _previewAppliedRenderToken = [[result objectForKey:@"token"] unsignedIntegerValue];
+    _isProgrammaticPreviewUpdate = NO;
+    _previewTextRevision += 1;
+    [_previewRenderedString release];
+    _previewRenderedString = [rendered retain];
+    [_previewRenderedMarkdown release];
+    _previewRenderedMarkdown = [previewMarkdown copy];
+    [_previewRenderedConfigurationKey release];
+    _previewRenderedConfigurationKey = [configurationKey copy];
+    [self logPreviewStyleDiagnosticsForRenderedString:rendered];
+    NSTimeInterval applyMs = perfLogging ? ((OMDNow() - applyStart) * 1000.0) : 0.0;
+    [self updatePreviewDocumentGeometry];
+    NSTimeInterval postStart = perfLogging ? OMDNow() : 0.0;
+    [self updateCodeBlockButtons];
+    [self updatePreviewDecorations];
     _lastRenderedSourceRevision = revisionAtRenderStart;
     if (_viewerMode == OMDViewerModeSplit) {
         [self syncPreviewToSourceInteractionAnchor];
@@ -8589,16 +9858,25 @@ static NSMutableArray *OMDSecondaryWindows(void)
         [self setPreviewUpdating:NO];
     }
     NSTimeInterval totalMs = (OMDNow() - renderStart) * 1000.0;
+    BOOL progressive = (_previewFirstPaintMs >= 0.0);
+    NSTimeInterval firstPaintMs = progressive ? _previewFirstPaintMs : totalMs;
+    _previewFirstPaintMs = -1.0;
     [self updateAdaptiveZoomDebounceWithRenderDurationMs:totalMs sampledAsZoomRender:sampledAsZoomRender];
     if (perfLogging) {
-        NSLog(@"[Perf][Viewer] total=%.1fms markdown=%.1fms apply=%.1fms post=%.1fms zoom=%.2f charsIn=%lu charsOut=%lu",
+        NSLog(@"[Perf][Viewer] total=%.1fms firstPaint=%.1fms progressive=%@ markdown=%.1fms apply=%.1fms post=%.1fms zoom=%.2f charsIn=%lu charsOut=%lu splice=%@ replaced=%lu blocks=%lu/%lu",
               totalMs,
+              firstPaintMs,
+              progressive ? @"yes" : @"no",
               markdownMs,
               applyMs,
               (OMDNow() - postStart) * 1000.0,
               _zoomScale,
               (unsigned long)[previewMarkdown length],
-              (unsigned long)[rendered length]);
+              (unsigned long)[rendered length],
+              splicePreview ? @"yes" : @"no",
+              (unsigned long)(splicePreview ? changedRange.length : [rendered length]),
+              (unsigned long)(renderedBlocks - reusedBlocks),
+              (unsigned long)renderedBlocks);
     }
 }
 
@@ -8658,6 +9936,20 @@ static NSMutableArray *OMDSecondaryWindows(void)
     NSAttributedString *empty = [[[NSAttributedString alloc] initWithString:@""] autorelease];
     [[_textView textStorage] setAttributedString:empty];
     _isProgrammaticPreviewUpdate = NO;
+    _previewTextRevision += 1;
+    _previewAppliedRenderToken = NSNotFound;
+    [_previewRenderedString release];
+    _previewRenderedString = nil;
+    [_previewRenderedMarkdown release];
+    _previewRenderedMarkdown = nil;
+    [_previewRenderedConfigurationKey release];
+    _previewRenderedConfigurationKey = nil;
+    [_previewCodeBlockRanges release];
+    _previewCodeBlockRanges = nil;
+    [_previewBlockquoteRanges release];
+    _previewBlockquoteRanges = nil;
+    [_previewBlockAnchors release];
+    _previewBlockAnchors = nil;
 
     if ([_textView isKindOfClass:[OMDTextView class]]) {
         OMDTextView *previewTextView = (OMDTextView *)_textView;
@@ -9753,10 +11045,11 @@ constrainSplitPosition:(CGFloat)proposedPosition
         NSUInteger previewLocation = [self visibleCharacterIndexForTextView:_textView
                                                                inScrollView:_previewScrollView
                                                              verticalAnchor:OMDLinkedScrollViewportAnchor];
-        sourceAnchorLocation = OMDMapTargetLocationWithBlockAnchors(sourceAnchorText,
-                                                                    previewText,
-                                                                    previewLocation,
-                                                                    [_renderer blockAnchors]);
+        sourceAnchorLocation = OMDMapTargetLocationWithBlockAnchorsAtRevision(sourceAnchorText,
+                                                                              previewText,
+                                                                              _previewTextRevision,
+                                                                              previewLocation,
+                                                                              _previewBlockAnchors);
         preserveViewportAnchor = YES;
     } else if (previousMode == OMDViewerModeSplit && mode == OMDViewerModeRead) {
         if (_sourceTextView != nil) {
@@ -9830,10 +11123,11 @@ constrainSplitPosition:(CGFloat)proposedPosition
         } else if (_viewerMode == OMDViewerModeRead && sourceAnchorLocation != NSNotFound) {
             NSString *sourceText = sourceAnchorText != nil ? sourceAnchorText : _currentMarkdown;
             NSString *previewText = [[_textView textStorage] string];
-            NSUInteger previewLocation = OMDMapSourceLocationWithBlockAnchors(sourceText,
-                                                                              sourceAnchorLocation,
-                                                                              previewText,
-                                                                              [_renderer blockAnchors]);
+            NSUInteger previewLocation = OMDMapSourceLocationWithBlockAnchorsAtRevision(sourceText,
+                                                                                        sourceAnchorLocation,
+                                                                                        previewText,
+                                                                                        _previewTextRevision,
+                                                                                        _previewBlockAnchors);
             if (preserveViewportAnchor) {
                 [self scrollPreviewToCharacterIndex:previewLocation
                                      verticalAnchor:OMDLinkedScrollViewportAnchor];
@@ -9936,6 +11230,8 @@ constrainSplitPosition:(CGFloat)proposedPosition
 
 - (void)updateTabStrip
 {
+    [self updateExternalFileWatchPaths];
+
     if (_tabStripView == nil) {
         return;
     }
@@ -9985,6 +11281,9 @@ constrainSplitPosition:(CGFloat)proposedPosition
         if ([[tab objectForKey:OMDTabReadOnlyKey] boolValue]) {
             title = [title stringByAppendingString:@" [RO]"];
         }
+        if (index != _selectedDocumentTabIndex && OMDTabRecordHasNewerDiskVersion(tab)) {
+            title = [title stringByAppendingString:@" [changed]"];
+        }
 
         CGFloat width = 30.0 + (CGFloat)[title length] * 6.8;
         if (width < 108.0) {
@@ -10021,6 +11320,16 @@ constrainSplitPosition:(CGFloat)proposedPosition
         [button setAction:@selector(tabButtonPressed:)];
         [button setFont:[NSFont systemFontOfSize:11.0]];
         [button setAlignment:NSLeftTextAlignment];
+        NSString *toolTip = [tab objectForKey:OMDTabSourcePathKey];
+        if ([toolTip length] == 0) {
+            toolTip = title;
+        }
+        NSUInteger cachedBytes = [[self tabRenderCache] costForTabIdentifier:[tab objectForKey:OMDTabIdentifierKey]];
+        if (cachedBytes > 0) {
+            toolTip = [toolTip stringByAppendingFormat:@"\nCached preview: %.1f MB",
+                                                       (double)cachedBytes / (1024.0 * 1024.0)];
+        }
+        [button setToolTip:toolTip];
         [tabContainer addSubview:button];
 
         NSButton *closeButton = [[[NSButton alloc] initWithFrame:NSMakeRect(width - closeButtonSize - closeButtonInset,
@@ -10061,6 +11370,7 @@ constrainSplitPosition:(CGFloat)proposedPosition
     }
 
     [self captureCurrentStateIntoSelectedTab];
+    [self storeTabRenderSnapshotForSelectedTab];
 
     NSDictionary *tabRecord = [_documentTabs objectAtIndex:index];
     BOOL tabIsDirty = [[tabRecord objectForKey:OMDTabDirtyKey] boolValue];
@@ -10087,6 +11397,7 @@ constrainSplitPosition:(CGFloat)proposedPosition
     if (index < 0 || index >= (NSInteger)[_documentTabs count]) {
         return;
     }
+    [[self tabRenderCache] removeSnapshotForTabIdentifier:[[_documentTabs objectAtIndex:index] objectForKey:OMDTabIdentifierKey]];
     [_documentTabs removeObjectAtIndex:index];
 
     if ([_documentTabs count] == 0) {
@@ -10118,7 +11429,7 @@ constrainSplitPosition:(CGFloat)proposedPosition
 
     _selectedDocumentTabIndex = targetSelection;
     NSDictionary *selectedTab = [_documentTabs objectAtIndex:targetSelection];
-    [self applyDocumentTabRecord:selectedTab];
+    [self applyDocumentTabRecordRestoringRender:selectedTab];
     [self updateTabStrip];
 }
 
@@ -10177,6 +11488,7 @@ constrainSplitPosition:(CGFloat)proposedPosition
                                     diskFingerprint:(NSString *)diskFingerprint
 {
     NSMutableDictionary *tab = [NSMutableDictionary dictionary];
+    [tab setObject:[[NSProcessInfo processInfo] globallyUniqueString] forKey:OMDTabIdentifierKey];
     [tab setObject:(markdown != nil ? markdown : @"") forKey:OMDTabMarkdownKey];
     if (sourcePath != nil && [sourcePath length] > 0) {
         [tab setObject:sourcePath forKey:OMDTabSourcePathKey];
@@ -10208,9 +11520,12 @@ constrainSplitPosition:(CGFloat)proposedPosition
 
     if (inNewTab || _selectedDocumentTabIndex < 0 || _selectedDocumentTabIndex >= (NSInteger)[_documentTabs count]) {
         [self captureCurrentStateIntoSelectedTab];
+        [self storeTabRenderSnapshotForSelectedTab];
         [_documentTabs addObject:tab];
         _selectedDocumentTabIndex = (NSInteger)[_documentTabs count] - 1;
     } else {
+        NSDictionary *replacedTab = [_documentTabs objectAtIndex:_selectedDocumentTabIndex];
+        [[self tabRenderCache] removeSnapshotForTabIdentifier:[replacedTab objectForKey:OMDTabIdentifierKey]];
         [_documentTabs replaceObjectAtIndex:_selectedDocumentTabIndex withObject:tab];
     }
 
@@ -10260,6 +11575,106 @@ constrainSplitPosition:(CGFloat)proposedPosition
     [self updateWindowTitle];
 }
 
+- (OMDTabRenderCache *)tabRenderCache
+{
+    if (_tabRenderCache == nil) {
+        _tabRenderCache = [[OMDTabRenderCache alloc] initWithByteBudget:OMDTabRenderCacheByteBudget()];
+    }
+    return _tabRenderCache;
+}
+
+- (void)storeTabRenderSnapshotForSelectedTab
+{
+    if (_selectedDocumentTabIndex < 0 || _selectedDocumentTabIndex >= (NSInteger)[_documentTabs count]) {
+        return;
+    }
+    if (_previewRenderedString == nil || _previewScrollView == nil) {
+        return;
+    }
+    NSString *previewMarkdown = [self markdownForCurrentPreview];
+    if (previewMarkdown == nil || ![_previewRenderedMarkdown isEqualToString:previewMarkdown]) {
+        return;
+    }
+
+    NSDictionary *tab = [_documentTabs objectAtIndex:_selectedDocumentTabIndex];
+    NSString *identifier = OMDTabIdentifierForRecord(tab);
+    OMDTabRenderCache *cache = [self tabRenderCache];
+    OMDTabRenderSnapshot *snapshot = [cache peekSnapshotForTabIdentifier:identifier];
+    if (snapshot == nil ||
+        [snapshot rendered] != _previewRenderedString ||
+        ![[snapshot configurationKey] isEqualToString:_previewRenderedConfigurationKey]) {
+        snapshot = [[[OMDTabRenderSnapshot alloc] initWithMarkdown:_previewRenderedMarkdown
+                                                  configurationKey:_previewRenderedConfigurationKey
+                                                          rendered:_previewRenderedString
+                                                   codeBlockRanges:_previewCodeBlockRanges
+                                                  blockquoteRanges:_previewBlockquoteRanges
+                                                      blockAnchors:_previewBlockAnchors] autorelease];
+    }
+    [snapshot setScrollOrigin:[[_previewScrollView contentView] bounds].origin];
+    [cache storeSnapshot:snapshot forTabIdentifier:identifier];
+}
+
+- (void)applyDocumentTabRecordRestoringRender:(NSDictionary *)tabRecord
+{
+    // The render triggered by applying the record may redisplay the tab's
+    // cached output instead of re-rendering it.
+    [_tabRenderRestoreIdentifier release];
+    _tabRenderRestoreIdentifier = [OMDTabIdentifierForRecord(tabRecord) copy];
+    [self applyDocumentTabRecord:tabRecord];
+    [_tabRenderRestoreIdentifier release];
+    _tabRenderRestoreIdentifier = nil;
+}
+
+- (void)applyTabRenderSnapshot:(OMDTabRenderSnapshot *)snapshot renderStart:(NSTimeInterval)renderStart
+{
+    OM_PERF_TRACE_SCOPE("viewer", "apply-cached");
+    NSAttributedString *rendered = [snapshot rendered];
+    [_previewCodeBlockRanges release];
+    _previewCodeBlockRanges = [[snapshot codeBlockRanges] retain];
+    [_previewBlockquoteRanges release];
+    _previewBlockquoteRanges = [[snapshot blockquoteRanges] retain];
+    [_previewBlockAnchors release];
+    _previewBlockAnchors = [[snapshot blockAnchors] retain];
+
+    _isProgrammaticPreviewUpdate = YES;
+    [[_textView textStorage] setAttributedString:rendered];
+    _isProgrammaticPreviewUpdate = NO;
+    _previewTextRevision += 1;
+    // A token no render has used: the next render cannot splice against the
+    // renderer's own previous output, which belongs to another tab.
+    _previewAppliedRenderToken = [self advancePreviewRenderToken];
+    _previewNeedsProgressiveRender = NO;
+    [_previewRenderedString release];
+    _previewRenderedString = [rendered retain];
+    [_previewRenderedMarkdown release];
+    _previewRenderedMarkdown = [[snapshot markdown] copy];
+    [_previewRenderedConfigurationKey release];
+    _previewRenderedConfigurationKey = [[snapshot configurationKey] copy];
+
+    [self updatePreviewDocumentGeometry];
+    [self updateCodeBlockButtons];
+    [self updatePreviewDecorations];
+    _lastRenderedSourceRevision = _sourceRevision;
+    if (_viewerMode == OMDViewerModeSplit) {
+        [self syncPreviewToSourceInteractionAnchor];
+    } else {
+        NSClipView *clipView = [_previewScrollView contentView];
+        [clipView scrollToPoint:[clipView constrainScrollPoint:[snapshot scrollOrigin]]];
+        [_previewScrollView reflectScrolledClipView:clipView];
+    }
+    [self updatePreviewStatusIndicator];
+    [self updateWindowTitle];
+    [self setPreviewUpdating:NO];
+    if (OMDPerformanceLoggingEnabled()) {
+        NSLog(@"[Perf][Viewer] tab cache hit total=%.1fms charsOut=%lu cached=%luKB budget=%lu/%luKB",
+              (OMDNow() - renderStart) * 1000.0,
+              (unsigned long)[rendered length],
+              (unsigned long)([snapshot cost] / 1024),
+              (unsigned long)([[self tabRenderCache] totalCost] / 1024),
+              (unsigned long)([[self tabRenderCache] byteBudget] / 1024));
+    }
+}
+
 - (void)selectDocumentTabAtIndex:(NSInteger)index
 {
     if (index < 0 || index >= (NSInteger)[_documentTabs count]) {
@@ -10270,9 +11685,10 @@ constrainSplitPosition:(CGFloat)proposedPosition
     }
 
     [self captureCurrentStateIntoSelectedTab];
+    [self storeTabRenderSnapshotForSelectedTab];
     _selectedDocumentTabIndex = index;
     NSDictionary *tab = [_documentTabs objectAtIndex:index];
-    [self applyDocumentTabRecord:tab];
+    [self applyDocumentTabRecordRestoringRender:tab];
     [self updateTabStrip];
     [self refreshCurrentDocumentDiskStateAllowPrompt:YES];
 }
@@ -10687,10 +12103,48 @@ constrainSplitPosition:(CGFloat)proposedPosition
 {
     if (_gitHubClient == nil) {
         _gitHubClient = [[OMDGitHubClient alloc] init];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(gitHubCachedResponseDidChange:)
+                                                     name:OMDGitHubClientCachedResponseDidChangeNotification
+                                                   object:_gitHubClient];
     }
     return _gitHubClient;
 }
 
+// Repository lists are served from the client's cache and revalidated in
+// the background. When the list shown turns out to have changed, refresh
+// the picker in place rather than leaving the folder being browsed.
+- (void)gitHubCachedResponseDidChange:(NSNotification *)notification
+{
+    NSString *user = OMDTrimmedString(_explorerGitHubUser);
+    if (_explorerSourceMode != OMDExplorerSourceModeGitHub || [user length] == 0) {
+        return;
+    }
+    NSString *url = [[notification userInfo] objectForKey:@"url"];
+    NSString *marker = [NSString stringWithFormat:@"/users/%@/repos",
+                                                  [user stringByAddingPercentEscapesUsingEncoding:NSUTF8StringEncoding]];
+    if (![url isKindOfClass:[NSString class]] || [url rangeOfString:marker].location == NSNotFound) {
+        return;
+    }
+
+    NSArray *repos = [[self gitHubClient] publicRepositoriesForUser:user
+                                            includeForksAndArchived:[self isExplorerIncludeForkArchivedEnabled]
+                                                              error:NULL];
+    if (repos == nil) {
+        return;
+    }
+    [_explorerGitHubRepos release];
+    _explorerGitHubRepos = [repos copy];
+    [_explorerGitHubRepoComboBox removeAllItems];
+    for (NSDictionary *repoRecord in _explorerGitHubRepos) {
+        NSString *repoName = [repoRecord objectForKey:@"name"];
+        if (repoName != nil && [repoName length] > 0) {
+            [_explorerGitHubRepoComboBox addItemWithObjectValue:repoName];
+        }
+    }
+    [_explorerGitHubRepoComboBox setStringValue:(_explorerGitHubRepo != nil ? _explorerGitHubRepo : @"")];
+}
+
 - (void)setupExplorerSidebar
 {
     OMDLayoutMetrics metrics = OMDLayoutMetricsForMode([self effectiveLayoutDensityMode]);
@@ -12147,38 +13601,26 @@ constrainSplitPosition:(CGFloat)proposedPosition
 
     NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
     NSNumber *sizeValue = [attributes objectForKey:NSFileSize];
+    NSString *extension = [[path pathExtension] lowercaseString];
+    BOOL importable = [OMDDocumentConverter isSupportedExtension:extension];
     if ([sizeValue respondsToSelector:@selector(unsignedLongLongValue)]) {
-        if (![self ensureOpenFileSizeWithinLimit:[sizeValue unsignedLongLongValue]
-                                      descriptor:[path lastPathComponent]]) {
+        unsigned long long fileSize = [sizeValue unsignedLongLongValue];
+        if (!importable &&
+            (fileSize > OMDLargeFileModeThresholdBytes ||
+             fileSize > (unsigned long long)[self explorerMaxOpenFileSizeBytes])) {
+            [self openDocumentAtPath:path inNewTab:inNewTab requireDirtyConfirm:!inNewTab];
             return;
         }
-    }
-
-    NSString *extension = [[path pathExtension] lowercaseString];
-    if ([OMDDocumentConverter isSupportedExtension:extension]) {
-        if (![self ensureConverterAvailableForActionName:@"Import"]) {
+        if (![self ensureOpenFileSizeWithinLimit:fileSize descriptor:[path lastPathComponent]]) {
             return;
         }
+    }
 
-        NSString *importedMarkdown = nil;
-        NSError *error = nil;
-        BOOL success = [[self documentConverter] importFileAtPath:path markdown:&importedMarkdown error:&error];
-        if (!success) {
-            [self presentConverterError:error fallbackTitle:@"Import failed"];
+    if (importable) {
+        if (![self ensureConverterAvailableForActionName:@"Import"]) {
             return;
         }
-
-        BOOL opened = [self openDocumentWithMarkdown:(importedMarkdown != nil ? importedMarkdown : @"")
-                                          sourcePath:path
-                                        displayTitle:[path lastPathComponent]
-                                            readOnly:NO
-                                          renderMode:OMDDocumentRenderModeMarkdown
-                                      syntaxLanguage:nil
-                                            inNewTab:inNewTab
-                                 requireDirtyConfirm:!inNewTab];
-        if (opened) {
-            [self noteRecentDocumentAtPathIfAvailable:path];
-        }
+        [self importDocumentsAtPaths:[NSArray arrayWithObject:path] inNewTab:inNewTab];
         return;
     }
 
@@ -12939,6 +14381,7 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
 
 - (void)syncPreviewToSourceScrollPosition
 {
+    OM_PERF_TRACE_SCOPE("viewer", "scroll-sync");
     if (_viewerMode != OMDViewerModeSplit || _sourceTextView == nil || _textView == nil) {
         return;
     }
@@ -12955,10 +14398,11 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
     NSUInteger sourceLocation = [self visibleCharacterIndexForTextView:_sourceTextView
                                                           inScrollView:_sourceScrollView
                                                         verticalAnchor:OMDLinkedScrollViewportAnchor];
-    NSUInteger previewLocation = OMDMapSourceLocationWithBlockAnchors(sourceText,
-                                                                      sourceLocation,
-                                                                      previewText,
-                                                                      [_renderer blockAnchors]);
+    NSUInteger previewLocation = OMDMapSourceLocationWithBlockAnchorsAtRevision(sourceText,
+                                                                                sourceLocation,
+                                                                                previewText,
+                                                                                _previewTextRevision,
+                                                                                _previewBlockAnchors);
     _isProgrammaticScrollSync = YES;
     [self scrollPreviewToCharacterIndex:previewLocation verticalAnchor:OMDLinkedScrollViewportAnchor];
     _isProgrammaticScrollSync = NO;
@@ -12966,6 +14410,7 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
 
 - (void)syncSourceToPreviewScrollPosition
 {
+    OM_PERF_TRACE_SCOPE("viewer", "scroll-sync");
     if (_viewerMode != OMDViewerModeSplit || _sourceTextView == nil || _textView == nil) {
         return;
     }
@@ -12982,10 +14427,11 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
     NSUInteger previewLocation = [self visibleCharacterIndexForTextView:_textView
                                                            inScrollView:_previewScrollView
                                                          verticalAnchor:OMDLinkedScrollViewportAnchor];
-    NSUInteger sourceLocation = OMDMapTargetLocationWithBlockAnchors(sourceText,
-                                                                     previewText,
-                                                                     previewLocation,
-                                                                     [_renderer blockAnchors]);
+    NSUInteger sourceLocation = OMDMapTargetLocationWithBlockAnchorsAtRevision(sourceText,
+                                                                               previewText,
+                                                                               _previewTextRevision,
+                                                                               previewLocation,
+                                                                               _previewBlockAnchors);
     _isProgrammaticScrollSync = YES;
     [self scrollSourceToCharacterIndex:sourceLocation verticalAnchor:OMDLinkedScrollViewportAnchor];
     _isProgrammaticScrollSync = NO;
@@ -13064,10 +14510,11 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
         return;
     }
 
-    NSUInteger previewLocation = OMDMapSourceLocationWithBlockAnchors(sourceText,
-                                                                      sourceLocation,
-                                                                      previewText,
-                                                                      [_renderer blockAnchors]);
+    NSUInteger previewLocation = OMDMapSourceLocationWithBlockAnchorsAtRevision(sourceText,
+                                                                                sourceLocation,
+                                                                                previewText,
+                                                                                _previewTextRevision,
+                                                                                _previewBlockAnchors);
     _isProgrammaticScrollSync = YES;
     [self scrollPreviewToCharacterIndex:previewLocation verticalAnchor:0.35];
     _isProgrammaticScrollSync = NO;
@@ -13097,10 +14544,11 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
         previewLocation = previewLength;
     }
 
-    NSUInteger sourceLocation = OMDMapTargetLocationWithBlockAnchors(sourceText,
-                                                                     previewText,
-                                                                     previewLocation,
-                                                                     [_renderer blockAnchors]);
+    NSUInteger sourceLocation = OMDMapTargetLocationWithBlockAnchorsAtRevision(sourceText,
+                                                                               previewText,
+                                                                               _previewTextRevision,
+                                                                               previewLocation,
+                                                                               _previewBlockAnchors);
     if (atPreviewEnd) {
         sourceLocation = sourceLength;
     }
@@ -13141,7 +14589,7 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
     [_livePreviewRenderTimer invalidate];
     [_livePreviewRenderTimer release];
     _livePreviewRenderTimer = nil;
-    [self renderCurrentMarkdown];
+    [self renderCurrentMarkdownAsynchronously:YES];
 }
 
 - (void)cancelPendingLivePreviewRender
@@ -13745,6 +15193,7 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
 
 - (void)applySourceSyntaxHighlightingNow
 {
+    OM_PERF_TRACE_SCOPE("viewer", "highlight");
     BOOL profiling = OMDKeyLatencyProfilingEnabled();
     NSTimeInterval start = profiling ? OMDKeyLatencyNow() : 0.0;
     if (_sourceTextView == nil) {
@@ -13777,6 +15226,13 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
 
     NSRange targetRange = [self sourceSyntaxHighlightIncrementalRangeForStorage:storage];
     BOOL fullPass = targetRange.location == NSNotFound;
+    if (_sourceLineStyleIndex == nil) {
+        _sourceLineStyleIndex = [[OMDSourceLineStyleIndex alloc] init];
+    } else if (_sourceHighlightNeedsFullPass) {
+        // A different buffer (tab switch, reload): skip the diff.
+        [_sourceLineStyleIndex invalidate];
+    }
+    [highlightOptions setObject:_sourceLineStyleIndex forKey:OMDSourceHighlighterOptionLineStyleIndex];
     NSTimeInterval afterRange = profiling ? OMDKeyLatencyNow() : 0.0;
 
     _isProgrammaticSourceHighlightUpdate = YES;
@@ -15396,7 +16852,7 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
     }
     [_codeBlockButtons removeAllObjects];
 
-    NSArray *ranges = [_renderer codeBlockRanges];
+    NSArray *ranges = _previewCodeBlockRanges;
     if ([ranges count] == 0) {
         return;
     }
@@ -15611,7 +17067,7 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
 - (void)copyCodeBlock:(id)sender
 {
     NSInteger index = [sender tag];
-    NSArray *ranges = [_renderer codeBlockRanges];
+    NSArray *ranges = _previewCodeBlockRanges;
     if (index < 0 || index >= (NSInteger)[ranges count]) {
         return;
     }
@@ -16516,26 +17972,38 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
     NSString *displayTitle = nil;
     NSString *syntaxLanguage = nil;
     OMDDocumentRenderMode renderMode = OMDDocumentRenderModeMarkdown;
+    BOOL readOnly = NO;
+    unsigned long long largeFileNextOffset = 0;
     if (![self loadDocumentContentsAtPath:resolvedPath
                                actionName:@"Open"
                                  markdown:&markdown
                              displayTitle:&displayTitle
                                renderMode:&renderMode
                            syntaxLanguage:&syntaxLanguage
-                              fingerprint:NULL]) {
+                                 readOnly:&readOnly
+                              fingerprint:NULL
+                      largeFileNextOffset:&largeFileNextOffset]) {
         return NO;
     }
 
     BOOL opened = [self openDocumentWithMarkdown:markdown
                                        sourcePath:resolvedPath
                                      displayTitle:displayTitle
-                                         readOnly:NO
+                                         readOnly:readOnly
                                        renderMode:renderMode
                                    syntaxLanguage:syntaxLanguage
                                          inNewTab:inNewTab
                               requireDirtyConfirm:requireDirtyConfirm];
     if (opened) {
         [self noteRecentDocumentAtPathIfAvailable:resolvedPath];
+        // A tab that already showed this file keeps the section it is on.
+        if (readOnly &&
+            _currentDocumentReadOnly &&
+            [[_documentTabs objectAtIndex:_selectedDocumentTabIndex] objectForKey:OMDTabLargeFileSectionStartsKey] == nil) {
+            OMDTabRecordSetLargeFileSection([_documentTabs objectAtIndex:_selectedDocumentTabIndex],
+                                            [NSArray arrayWithObject:[NSNumber numberWithUnsignedLongLong:0]],
+                                            largeFileNextOffset);
+        }
     }
     return opened;
 }
@@ -16597,12 +18065,16 @@ objectValueForTableColumn:(NSTableColumn *)tableColumn
 {
     (void)notification;
     [self stopExternalFileMonitor];
+    [self advancePreviewRenderToken];
     [self cancelPendingInteractiveRender];
     [self cancelPendingMathArtifactRender];
     [self cancelPendingLivePreviewRender];
     [self cancelPendingPreviewStatusUpdatingVisibility];
     [self cancelPendingPreviewStatusAutoHide];
     [self cancelPendingRecoveryAutosave];
+    [self cancelPendingConversions];
+    [self cancelPrintRender:nil];
+    OMDForgetRevisedText([[_textView textStorage] string]);
     [self clearRecoverySnapshot];
     [self setPreviewUpdating:NO];
     _externalReloadPromptVisible = NO;
@@ -0,0 +1,33 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <Foundation/Foundation.h>
+
+// Content-addressed disk cache for document conversions. An entry is named
+// by the source bytes, the converter version and the target format, so an
+// unchanged file reopened later (or a tab restored at launch) skips the
+// external converter entirely, and upgrading the converter invalidates
+// every entry. Storage, LRU eviction and the disk budget are OMDiskCache's.
+@interface OMDConversionCache : NSObject
+
+// Lives under the user cache directory ("ObjcMarkdown/conversions").
+// OMD_CONVERT_CACHE_DIR moves it (an empty value disables it) and
+// OMD_CONVERT_CACHE_MB sets the disk budget.
++ (OMDConversionCache *)sharedCache;
+
++ (NSString *)keyForSourceData:(NSData *)sourceData
+                backendVersion:(NSString *)backendVersion
+                  targetFormat:(NSString *)targetFormat;
+
+- (id)initWithDirectory:(NSString *)directory byteLimit:(unsigned long long)byteLimit;
+
+// nil when the cache is disabled.
+@property (nonatomic, readonly) NSString *directory;
+@property (nonatomic, readonly) unsigned long long byteLimit;
+
+// Where key's entry lives, whether or not it exists.
+- (NSString *)pathForKey:(NSString *)key;
+- (NSData *)dataForKey:(NSString *)key;
+- (void)storeData:(NSData *)data forKey:(NSString *)key;
+
+@end
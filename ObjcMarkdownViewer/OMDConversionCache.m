@@ -0,0 +1,104 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import "OMDConversionCache.h"
+#import "OMDiskCache.h"
+
+static NSString * const OMDConversionCacheExtension = @"out";
+static const unsigned long long OMDConversionCacheDefaultLimitBytes = 128ULL * 1024ULL * 1024ULL;
+
+static NSString *OMDConversionCacheDefaultDirectory(void)
+{
+    NSString *path = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_CONVERT_CACHE_DIR"];
+    if (path != nil) {
+        // An empty override disables the cache.
+        return [path length] > 0 ? path : nil;
+    }
+    return OMDiskCacheUserDirectory(@"conversions");
+}
+
+@implementation OMDConversionCache
+{
+    OMDiskCache *_diskCache;
+}
+
++ (OMDConversionCache *)sharedCache
+{
+    static OMDConversionCache *cache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        unsigned long long limit = OMDiskCacheLimitSetting([NSArray arrayWithObject:@"OMD_CONVERT_CACHE_MB"],
+                                                           @"ObjcMarkdownConversionCacheMB",
+                                                           OMDConversionCacheDefaultLimitBytes);
+        cache = [[OMDConversionCache alloc] initWithDirectory:OMDConversionCacheDefaultDirectory()
+                                                    byteLimit:limit];
+    });
+    return cache;
+}
+
++ (NSString *)keyForSourceData:(NSData *)sourceData
+                backendVersion:(NSString *)backendVersion
+                  targetFormat:(NSString *)targetFormat
+{
+    if (sourceData == nil || [targetFormat length] == 0) {
+        return nil;
+    }
+    // Two independent 64-bit FNV-1a hashes over the content, then over the
+    // version and format, as the renderer's artifact caches do.
+    const unsigned char *bytes = (const unsigned char *)[sourceData bytes];
+    NSUInteger length = [sourceData length];
+    uint64_t high = OMDiskCacheFNV1aHash64(bytes, length, 14695981039346656037ULL);
+    uint64_t low = OMDiskCacheFNV1aHash64(bytes, length, 0x84222325cbf29ce4ULL ^ (uint64_t)length);
+
+    NSString *suffix = [NSString stringWithFormat:@"|%@|%@",
+                        backendVersion != nil ? backendVersion : @"",
+                        targetFormat];
+    NSData *suffixData = [suffix dataUsingEncoding:NSUTF8StringEncoding];
+    high = OMDiskCacheFNV1aHash64((const unsigned char *)[suffixData bytes], [suffixData length], high);
+    low = OMDiskCacheFNV1aHash64((const unsigned char *)[suffixData bytes], [suffixData length], low);
+    return [NSString stringWithFormat:@"%016llx%016llx",
+            (unsigned long long)high,
+            (unsigned long long)low];
+}
+
+- (id)initWithDirectory:(NSString *)directory byteLimit:(unsigned long long)byteLimit
+{
+    self = [super init];
+    if (self != nil) {
+        _diskCache = [[OMDiskCache alloc] initWithDirectory:directory byteLimit:byteLimit];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_diskCache release];
+    [super dealloc];
+}
+
+- (NSString *)directory
+{
+    return [_diskCache directory];
+}
+
+- (unsigned long long)byteLimit
+{
+    return [_diskCache byteLimit];
+}
+
+- (NSString *)pathForKey:(NSString *)key
+{
+    return [_diskCache pathForKey:key extension:OMDConversionCacheExtension];
+}
+
+- (NSData *)dataForKey:(NSString *)key
+{
+    return [_diskCache dataForKey:key extension:OMDConversionCacheExtension];
+}
+
+- (void)storeData:(NSData *)data forKey:(NSString *)key
+{
+    [_diskCache storeData:data forKey:key extension:OMDConversionCacheExtension];
+}
+
+@end
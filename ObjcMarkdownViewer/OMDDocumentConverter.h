@@ -12,6 +12,25 @@ typedef NS_ENUM(NSInteger, OMDDocumentConverterErrorCode) {
     OMDDocumentConverterErrorOutputReadFailed = 4
 };
 
+typedef void (^OMDDocumentImportCompletion)(NSString *markdown, NSError *error);
+typedef void (^OMDDocumentExportCompletion)(NSError *error);
+
+// Handle for a conversion started with one of the asynchronous methods.
+// Cancelling terminates the backend process if it is already running; the
+// completion of a cancelled conversion is never called.
+@interface OMDConversionTask : NSObject
+
+@property (nonatomic, readonly) NSString *path;
+
+- (void)cancel;
+- (BOOL)isCancelled;
+
+// For backends: the external process doing the work, so that -cancel can
+// stop it. Terminates the process at once if the task is already cancelled.
+- (void)setRunningProcess:(NSTask *)process;
+
+@end
+
 @interface OMDDocumentConverter : NSObject
 
 + (OMDDocumentConverter *)defaultConverter;
@@ -28,4 +47,27 @@ typedef NS_ENUM(NSInteger, OMDDocumentConverterErrorCode) {
                 toPath:(NSString *)path
                  error:(NSError **)error;
 
+// Asynchronous forms of the above. Conversions share one pool of workers
+// across every window, so several files convert in parallel while the UI
+// stays responsive; completions run on the main queue.
+- (OMDConversionTask *)importFileAtPath:(NSString *)path
+                             completion:(OMDDocumentImportCompletion)completion;
+- (OMDConversionTask *)exportMarkdown:(NSString *)markdown
+                               toPath:(NSString *)path
+                           completion:(OMDDocumentExportCompletion)completion;
+
+// Parallel conversions: OMD_CONVERT_WORKERS, or the
+// ObjcMarkdownConversionWorkers default, else up to four by processor count.
++ (NSUInteger)conversionWorkerCount;
+
+// Backends override these; the synchronous methods pass a nil task.
+- (BOOL)importFileAtPath:(NSString *)path
+                markdown:(NSString **)markdown
+                    task:(OMDConversionTask *)task
+                   error:(NSError **)error;
+- (BOOL)exportMarkdown:(NSString *)markdown
+                toPath:(NSString *)path
+                  task:(OMDConversionTask *)task
+                 error:(NSError **)error;
+
 @end
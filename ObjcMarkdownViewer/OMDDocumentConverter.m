@@ -3,9 +3,132 @@
 
 #import "OMDDocumentConverter.h"
 #import "OMDPandocConverter.h"
+#import "OMBoundedWorkQueue.h"
 
 NSString * const OMDDocumentConverterErrorDomain = @"OMDDocumentConverterErrorDomain";
 
+static NSUInteger OMDConversionWorkerLimit(void)
+{
+    static NSUInteger limit = 0;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSInteger resolved = [[NSProcessInfo processInfo] activeProcessorCount];
+        if (resolved > 4) {
+            resolved = 4;
+        }
+        NSString *value = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_CONVERT_WORKERS"];
+        if ([value length] > 0 && [value integerValue] > 0) {
+            resolved = [value integerValue];
+        } else {
+            id defaultsValue = [[NSUserDefaults standardUserDefaults] objectForKey:@"ObjcMarkdownConversionWorkers"];
+            if ([defaultsValue respondsToSelector:@selector(integerValue)] && [defaultsValue integerValue] > 0) {
+                resolved = [defaultsValue integerValue];
+            }
+        }
+        if (resolved < 1) {
+            resolved = 1;
+        } else if (resolved > 16) {
+            resolved = 16;
+        }
+        limit = (NSUInteger)resolved;
+    });
+    return limit;
+}
+
+static dispatch_queue_t OMDConversionQueue(void)
+{
+    static dispatch_queue_t queue = NULL;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        queue = dispatch_queue_create("org.objcmarkdown.conversions", DISPATCH_QUEUE_CONCURRENT);
+    });
+    return queue;
+}
+
+static OMBoundedWorkQueue *OMDConversionWorkQueue(void)
+{
+    static OMBoundedWorkQueue *workQueue = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        workQueue = [[OMBoundedWorkQueue alloc] initWithQueue:OMDConversionQueue()
+                                                  workerLimit:OMDConversionWorkerLimit()];
+    });
+    return workQueue;
+}
+
+// Runs work on the conversion pool unless the task is cancelled before a
+// worker frees up. Queued conversions wait in the pool's FIFO, not on a
+// parked thread each.
+static void OMDRunConversionTask(OMDConversionTask *task, void (^work)(void))
+{
+    [OMDConversionWorkQueue() addWork:^{
+        if (![task isCancelled]) {
+            work();
+        }
+    }];
+}
+
+@implementation OMDConversionTask
+{
+    NSTask *_process;
+    BOOL _cancelled;
+}
+
+@synthesize path = _path;
+
+- (id)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self != nil) {
+        _path = [path copy];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_path release];
+    [_process release];
+    [super dealloc];
+}
+
+- (void)cancel
+{
+    NSTask *process = nil;
+    @synchronized (self) {
+        _cancelled = YES;
+        process = [_process retain];
+    }
+    if (process != nil && [process isRunning]) {
+        [process terminate];
+    }
+    [process release];
+}
+
+- (BOOL)isCancelled
+{
+    @synchronized (self) {
+        return _cancelled;
+    }
+}
+
+- (void)setRunningProcess:(NSTask *)process
+{
+    BOOL cancelled = NO;
+    @synchronized (self) {
+        if (process != _process) {
+            [_process release];
+            _process = [process retain];
+        }
+        cancelled = _cancelled;
+    }
+    if (cancelled && process != nil && [process isRunning]) {
+        [process terminate];
+    }
+}
+
+@end
+
 static NSSet *OMDSupportedExtensions(void)
 {
     static NSSet *extensions = nil;
@@ -54,6 +177,63 @@ static NSSet *OMDSupportedExtensions(void)
 - (BOOL)importFileAtPath:(NSString *)path
                 markdown:(NSString **)markdown
                    error:(NSError **)error
+{
+    return [self importFileAtPath:path markdown:markdown task:nil error:error];
+}
+
+- (BOOL)exportMarkdown:(NSString *)markdown
+                toPath:(NSString *)path
+                 error:(NSError **)error
+{
+    return [self exportMarkdown:markdown toPath:path task:nil error:error];
+}
+
++ (NSUInteger)conversionWorkerCount
+{
+    return OMDConversionWorkerLimit();
+}
+
+- (OMDConversionTask *)importFileAtPath:(NSString *)path
+                             completion:(OMDDocumentImportCompletion)completion
+{
+    OMDConversionTask *task = [[[OMDConversionTask alloc] initWithPath:path] autorelease];
+    OMDRunConversionTask(task, ^{
+        NSString *markdown = nil;
+        NSError *error = nil;
+        if (![self importFileAtPath:path markdown:&markdown task:task error:&error]) {
+            markdown = nil;
+        }
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (![task isCancelled] && completion != nil) {
+                completion(markdown, error);
+            }
+        });
+    });
+    return task;
+}
+
+- (OMDConversionTask *)exportMarkdown:(NSString *)markdown
+                               toPath:(NSString *)path
+                           completion:(OMDDocumentExportCompletion)completion
+{
+    OMDConversionTask *task = [[[OMDConversionTask alloc] initWithPath:path] autorelease];
+    NSString *source = [[markdown copy] autorelease];
+    OMDRunConversionTask(task, ^{
+        NSError *error = nil;
+        [self exportMarkdown:source toPath:path task:task error:&error];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (![task isCancelled] && completion != nil) {
+                completion(error);
+            }
+        });
+    });
+    return task;
+}
+
+- (BOOL)importFileAtPath:(NSString *)path
+                markdown:(NSString **)markdown
+                    task:(OMDConversionTask *)task
+                   error:(NSError **)error
 {
     if (error != NULL) {
         *error = [NSError errorWithDomain:OMDDocumentConverterErrorDomain
@@ -67,6 +247,7 @@ static NSSet *OMDSupportedExtensions(void)
 
 - (BOOL)exportMarkdown:(NSString *)markdown
                 toPath:(NSString *)path
+                  task:(OMDConversionTask *)task
                  error:(NSError **)error
 {
     if (error != NULL) {
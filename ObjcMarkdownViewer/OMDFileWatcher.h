@@ -0,0 +1,44 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <Foundation/Foundation.h>
+
+// Called on the main thread with the absolute paths that saw writes,
+// renames or deletions since the previous call.
+typedef void (^OMDFileWatcherChangeHandler)(NSSet *changedPaths);
+
+// Event-driven change notification for a set of files (inotify on Linux).
+// Parent directories are watched rather than the files themselves, so
+// editors and build tools that replace a file by renaming over it are still
+// seen. Events are coalesced: the handler runs once a burst has been quiet
+// for the coalescing interval, or after maximumDelay at the latest.
+@interface OMDFileWatcher : NSObject
+
++ (BOOL)isSupported;
+
+- (instancetype)initWithChangeHandler:(OMDFileWatcherChangeHandler)handler;
+
+@property (nonatomic, assign) NSTimeInterval coalescingInterval;
+@property (nonatomic, assign) NSTimeInterval maximumDelay;
+// How often directories that cannot be watched are tried again; 2 seconds
+// by default.
+@property (nonatomic, assign) NSTimeInterval retryInterval;
+
+// Replaces the requested set. Returns NO when some directory could not be
+// watched (unsupported platform, watch limit, missing directory); the
+// others are watched regardless. A missing directory stays pending: its
+// nearest existing ancestor is watched for its creation, it is also retried
+// every retryInterval, and once it is watched its files are reported as
+// changed.
+- (BOOL)setWatchedPaths:(NSSet *)paths;
+// Everything passed to the last -setWatchedPaths:.
+- (NSSet *)requestedPaths;
+// The requested paths whose directory is watched right now. A deleted or
+// moved directory reports its files as changed, drops them from this set
+// and becomes pending until it reappears.
+- (NSSet *)watchedPaths;
+
+// Stops delivery and closes the descriptor. Call before releasing the watcher.
+- (void)invalidate;
+
+@end
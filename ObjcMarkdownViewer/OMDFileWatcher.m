@@ -0,0 +1,466 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import "OMDFileWatcher.h"
+#import <dispatch/dispatch.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define OMD_FILE_WATCHER_INOTIFY 1
+#else
+#define OMD_FILE_WATCHER_INOTIFY 0
+#endif
+
+static const NSTimeInterval OMDFileWatcherDefaultCoalescingInterval = 0.15;
+static const NSTimeInterval OMDFileWatcherDefaultMaximumDelay = 1.0;
+static const NSTimeInterval OMDFileWatcherDefaultRetryInterval = 2.0;
+
+#if OMD_FILE_WATCHER_INOTIFY
+static const uint32_t OMDFileWatcherDirectoryMask = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB |
+                                                    IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                                    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                                                    IN_ONLYDIR;
+#endif
+
+@interface OMDFileWatcher ()
+- (void)om_handleReadableDescriptor;
+- (BOOL)om_addWatchForDirectory:(NSString *)directory;
+- (NSSet *)om_syncWatches;
+- (void)om_retryMissingDirectories;
+- (void)om_notePendingPaths:(NSSet *)paths;
+- (void)om_scheduleFlushAfter:(NSTimeInterval)delay;
+- (void)om_flushIfQuiet;
+@end
+
+@implementation OMDFileWatcher
+{
+    OMDFileWatcherChangeHandler _handler;
+    dispatch_queue_t _queue;
+    dispatch_source_t _source;
+    int _fd;
+    NSMutableDictionary *_directoryByWatch;
+    NSMutableDictionary *_watchByDirectory;
+    NSMutableDictionary *_pathsByDirectory;
+    NSMutableSet *_missingDirectories;
+    NSSet *_watchedPaths;
+    NSMutableSet *_pendingPaths;
+    NSTimeInterval _firstPendingTime;
+    NSTimeInterval _lastPendingTime;
+    BOOL _flushScheduled;
+    BOOL _retryScheduled;
+    BOOL _invalidated;
+}
+
+@synthesize coalescingInterval = _coalescingInterval;
+@synthesize maximumDelay = _maximumDelay;
+@synthesize retryInterval = _retryInterval;
+
++ (BOOL)isSupported
+{
+#if OMD_FILE_WATCHER_INOTIFY
+    static BOOL supported = NO;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd >= 0) {
+            supported = YES;
+            close(fd);
+        }
+    });
+    return supported;
+#else
+    return NO;
+#endif
+}
+
+- (instancetype)initWithChangeHandler:(OMDFileWatcherChangeHandler)handler
+{
+    self = [super init];
+    if (self) {
+        _handler = [handler copy];
+        _queue = dispatch_queue_create("org.objcmarkdown.file-watcher", DISPATCH_QUEUE_SERIAL);
+        _fd = -1;
+        _directoryByWatch = [[NSMutableDictionary alloc] init];
+        _watchByDirectory = [[NSMutableDictionary alloc] init];
+        _pathsByDirectory = [[NSMutableDictionary alloc] init];
+        _missingDirectories = [[NSMutableSet alloc] init];
+        _watchedPaths = [[NSSet alloc] init];
+        _pendingPaths = [[NSMutableSet alloc] init];
+        _coalescingInterval = OMDFileWatcherDefaultCoalescingInterval;
+        _maximumDelay = OMDFileWatcherDefaultMaximumDelay;
+        _retryInterval = OMDFileWatcherDefaultRetryInterval;
+
+#if OMD_FILE_WATCHER_INOTIFY
+        _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_fd >= 0) {
+            _source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t)_fd, 0, _queue);
+            if (_source != NULL) {
+                // The source is cancelled in -invalidate (or -dealloc), so an
+                // unretained reference avoids a retain cycle through the handler.
+                __block OMDFileWatcher *watcher = self;
+                int fd = _fd;
+                dispatch_source_set_event_handler(_source, ^{
+                    [watcher om_handleReadableDescriptor];
+                });
+                dispatch_source_set_cancel_handler(_source, ^{
+                    close(fd);
+                });
+                dispatch_resume(_source);
+            } else {
+                close(_fd);
+                _fd = -1;
+            }
+        }
+#endif
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // Pending coalescing blocks retain the watcher, so the last release may
+    // happen on _queue itself; tear down without dispatch_sync here.
+    if (_source != NULL) {
+        dispatch_source_cancel(_source);
+        dispatch_release(_source);
+        _source = NULL;
+    }
+    [_handler release];
+    if (_queue != NULL) {
+        dispatch_release(_queue);
+    }
+    [_directoryByWatch release];
+    [_watchByDirectory release];
+    [_pathsByDirectory release];
+    [_missingDirectories release];
+    [_watchedPaths release];
+    [_pendingPaths release];
+    [super dealloc];
+}
+
+- (void)invalidate
+{
+    if (_invalidated) {
+        return;
+    }
+    _invalidated = YES;
+    dispatch_sync(_queue, ^{
+        if (_source != NULL) {
+            dispatch_source_cancel(_source);
+            dispatch_release(_source);
+            _source = NULL;
+        }
+        _fd = -1;
+        [_directoryByWatch removeAllObjects];
+        [_watchByDirectory removeAllObjects];
+        [_pathsByDirectory removeAllObjects];
+        [_missingDirectories removeAllObjects];
+        [_pendingPaths removeAllObjects];
+    });
+}
+
+- (NSSet *)watchedPaths
+{
+    __block NSSet *paths = nil;
+    dispatch_sync(_queue, ^{
+        paths = [_watchedPaths retain];
+    });
+    return [paths autorelease];
+}
+
+- (NSSet *)requestedPaths
+{
+    NSMutableSet *paths = [NSMutableSet set];
+    dispatch_sync(_queue, ^{
+        for (NSDictionary *names in [_pathsByDirectory allValues]) {
+            [paths addObjectsFromArray:[names allValues]];
+        }
+    });
+    return paths;
+}
+
+- (BOOL)setWatchedPaths:(NSSet *)paths
+{
+    if (_invalidated || _source == NULL) {
+        return NO;
+    }
+
+    // Group files by parent directory; one watch covers every open file in
+    // the same folder.
+    NSMutableDictionary *requested = [NSMutableDictionary dictionary];
+    for (id value in paths) {
+        if (![value isKindOfClass:[NSString class]] || [(NSString *)value length] == 0) {
+            continue;
+        }
+        NSString *path = (NSString *)value;
+        NSString *standardized = [path stringByStandardizingPath];
+        NSString *directory = [standardized stringByDeletingLastPathComponent];
+        NSString *name = [standardized lastPathComponent];
+        if ([directory length] == 0 || [name length] == 0) {
+            continue;
+        }
+        NSMutableDictionary *names = [requested objectForKey:directory];
+        if (names == nil) {
+            names = [NSMutableDictionary dictionary];
+            [requested setObject:names forKey:directory];
+        }
+        [names setObject:path forKey:name];
+    }
+
+    __block BOOL allWatched = YES;
+    dispatch_sync(_queue, ^{
+#if OMD_FILE_WATCHER_INOTIFY
+        [_pathsByDirectory removeAllObjects];
+        [_pathsByDirectory addEntriesFromDictionary:requested];
+        NSSet *appeared = [self om_syncWatches];
+        if ([appeared count] > 0) {
+            [self om_notePendingPaths:appeared];
+        }
+        allWatched = ([_missingDirectories count] == 0);
+#else
+        allWatched = NO;
+#endif
+    });
+    return allWatched;
+}
+
+- (BOOL)om_addWatchForDirectory:(NSString *)directory
+{
+#if OMD_FILE_WATCHER_INOTIFY
+    int wd = inotify_add_watch(_fd, [directory fileSystemRepresentation], OMDFileWatcherDirectoryMask);
+    if (wd < 0) {
+        return NO;
+    }
+    NSNumber *watch = [NSNumber numberWithInt:wd];
+    [_directoryByWatch setObject:directory forKey:watch];
+    [_watchByDirectory setObject:watch forKey:directory];
+    return YES;
+#else
+    (void)directory;
+    return NO;
+#endif
+}
+
+// Watches every requested directory that lacks a watch. One that cannot be
+// watched (missing, or the watch limit) stays in _missingDirectories; its
+// nearest existing ancestor is watched instead so that the directory's
+// creation triggers another attempt, and a retry is scheduled in case that
+// event never comes. Watches nothing needs any more are dropped. Returns the
+// paths of directories that were missing and are now watched. Runs on
+// _queue.
+- (NSSet *)om_syncWatches
+{
+    NSMutableSet *appeared = [NSMutableSet set];
+#if OMD_FILE_WATCHER_INOTIFY
+    NSSet *previouslyMissing = [[_missingDirectories copy] autorelease];
+    NSMutableSet *needed = [NSMutableSet set];
+    [_missingDirectories removeAllObjects];
+    for (NSString *directory in _pathsByDirectory) {
+        if ([_watchByDirectory objectForKey:directory] == nil) {
+            if (![self om_addWatchForDirectory:directory]) {
+                [_missingDirectories addObject:directory];
+                continue;
+            }
+            if ([previouslyMissing containsObject:directory]) {
+                [appeared addObjectsFromArray:[[_pathsByDirectory objectForKey:directory] allValues]];
+            }
+        }
+        [needed addObject:directory];
+    }
+    for (NSString *directory in _missingDirectories) {
+        NSString *ancestor = [directory stringByDeletingLastPathComponent];
+        while ([ancestor length] > 0) {
+            if ([_watchByDirectory objectForKey:ancestor] != nil || [self om_addWatchForDirectory:ancestor]) {
+                [needed addObject:ancestor];
+                break;
+            }
+            NSString *parent = [ancestor stringByDeletingLastPathComponent];
+            if ([parent isEqualToString:ancestor]) {
+                break;
+            }
+            ancestor = parent;
+        }
+    }
+    for (NSString *directory in [_watchByDirectory allKeys]) {
+        if ([needed containsObject:directory]) {
+            continue;
+        }
+        NSNumber *watch = [_watchByDirectory objectForKey:directory];
+        inotify_rm_watch(_fd, [watch intValue]);
+        [_directoryByWatch removeObjectForKey:watch];
+        [_watchByDirectory removeObjectForKey:directory];
+    }
+
+    NSMutableSet *watched = [NSMutableSet set];
+    for (NSString *directory in _pathsByDirectory) {
+        if ([_watchByDirectory objectForKey:directory] != nil) {
+            [watched addObjectsFromArray:[[_pathsByDirectory objectForKey:directory] allValues]];
+        }
+    }
+    [_watchedPaths release];
+    _watchedPaths = [watched copy];
+
+    if ([_missingDirectories count] > 0 && !_retryScheduled) {
+        _retryScheduled = YES;
+        NSTimeInterval delay = MAX(_retryInterval, 0.05);
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), _queue, ^{
+            [self om_retryMissingDirectories];
+        });
+    }
+#endif
+    return appeared;
+}
+
+- (void)om_retryMissingDirectories
+{
+    _retryScheduled = NO;
+    if (_invalidated || _source == NULL || [_missingDirectories count] == 0) {
+        return;
+    }
+    NSSet *appeared = [self om_syncWatches];
+    if ([appeared count] > 0) {
+        [self om_notePendingPaths:appeared];
+    }
+}
+
+- (void)om_handleReadableDescriptor
+{
+#if OMD_FILE_WATCHER_INOTIFY
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    NSMutableSet *changed = [NSMutableSet set];
+    BOOL overflowed = NO;
+    BOOL needsSync = NO;
+
+    for (;;) {
+        ssize_t length = read(_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        const char *cursor = buffer;
+        const char *end = buffer + length;
+        while (cursor < end) {
+            const struct inotify_event *event = (const struct inotify_event *)cursor;
+            cursor += sizeof(struct inotify_event) + event->len;
+
+            if ((event->mask & IN_Q_OVERFLOW) != 0) {
+                overflowed = YES;
+                continue;
+            }
+
+            NSNumber *watch = [NSNumber numberWithInt:event->wd];
+            NSString *directory = [_directoryByWatch objectForKey:watch];
+            if (directory == nil) {
+                continue;
+            }
+            NSDictionary *names = [_pathsByDirectory objectForKey:directory];
+
+            if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) != 0) {
+                // The directory itself went away; every file in it changed.
+                // A moved directory keeps its watch, so drop it here rather
+                // than follow the new name. The directory stays requested
+                // and becomes missing in the sync below.
+                if ((event->mask & IN_IGNORED) == 0) {
+                    inotify_rm_watch(_fd, event->wd);
+                }
+                [[directory retain] autorelease];
+                [_directoryByWatch removeObjectForKey:watch];
+                [_watchByDirectory removeObjectForKey:directory];
+                if (names != nil) {
+                    [changed addObjectsFromArray:[names allValues]];
+                }
+                needsSync = YES;
+                continue;
+            }
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0 &&
+                (event->mask & IN_ISDIR) != 0 &&
+                [_missingDirectories count] > 0) {
+                // Possibly a missing directory, or one of its ancestors.
+                needsSync = YES;
+            }
+
+            if (event->len == 0 || names == nil) {
+                continue;
+            }
+            NSString *name = [NSString stringWithUTF8String:event->name];
+            NSString *path = (name != nil ? [names objectForKey:name] : nil);
+            if (path != nil) {
+                [changed addObject:path];
+            }
+        }
+    }
+
+    if (needsSync) {
+        [changed unionSet:[self om_syncWatches]];
+    }
+    if (overflowed) {
+        // The kernel dropped events; let the caller re-check everything.
+        for (NSDictionary *names in [_pathsByDirectory allValues]) {
+            [changed addObjectsFromArray:[names allValues]];
+        }
+    }
+    if ([changed count] > 0) {
+        [self om_notePendingPaths:changed];
+    }
+#endif
+}
+
+- (void)om_notePendingPaths:(NSSet *)paths
+{
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    if ([_pendingPaths count] == 0) {
+        _firstPendingTime = now;
+    }
+    _lastPendingTime = now;
+    [_pendingPaths unionSet:paths];
+    if (!_flushScheduled) {
+        _flushScheduled = YES;
+        [self om_scheduleFlushAfter:_coalescingInterval];
+    }
+}
+
+- (void)om_scheduleFlushAfter:(NSTimeInterval)delay
+{
+    if (delay < 0.0) {
+        delay = 0.0;
+    }
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), _queue, ^{
+        [self om_flushIfQuiet];
+    });
+}
+
+- (void)om_flushIfQuiet
+{
+    if ([_pendingPaths count] == 0) {
+        _flushScheduled = NO;
+        return;
+    }
+
+    // Trailing-edge debounce: an editor saving via write+fsync+rename, or a
+    // generator rewriting a file in chunks, produces a single callback.
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSTimeInterval quietFor = now - _lastPendingTime;
+    NSTimeInterval pendingFor = now - _firstPendingTime;
+    if (quietFor < _coalescingInterval && pendingFor < _maximumDelay) {
+        NSTimeInterval untilQuiet = _coalescingInterval - quietFor;
+        NSTimeInterval untilDeadline = _maximumDelay - pendingFor;
+        [self om_scheduleFlushAfter:MIN(untilQuiet, untilDeadline)];
+        return;
+    }
+
+    _flushScheduled = NO;
+    NSSet *changed = [[_pendingPaths copy] autorelease];
+    [_pendingPaths removeAllObjects];
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (!_invalidated && _handler != nil) {
+            _handler(changed);
+        }
+    });
+}
+
+@end
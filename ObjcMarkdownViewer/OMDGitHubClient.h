@@ -4,6 +4,9 @@
 #import <Foundation/Foundation.h>
 
 extern NSString * const OMDGitHubClientErrorDomain;
+// Posted on the main queue when a background revalidation finds that a
+// cached response has changed; userInfo holds the request URL under "url".
+extern NSString * const OMDGitHubClientCachedResponseDidChangeNotification;
 
 typedef NS_ENUM(NSInteger, OMDGitHubClientErrorCode) {
     OMDGitHubClientErrorCurlUnavailable = 1,
@@ -15,8 +18,34 @@ typedef NS_ENUM(NSInteger, OMDGitHubClientErrorCode) {
     OMDGitHubClientErrorRateLimited = 7
 };
 
+// Successful responses are kept in a persistent cache together with their
+// ETag and Last-Modified validators. A cached response is returned at once
+// without touching the network; once it is older than the revalidation
+// interval a conditional request refreshes it in the background. A 304
+// answer does not count against the GitHub rate limit. Entries are keyed by
+// URL, Accept header and token, and the least recently used are evicted
+// once the cache outgrows its byte budget.
 @interface OMDGitHubClient : NSObject
 
+// api.github.com (or OMD_GITHUB_API_URL) with the cache under the user
+// cache directory ("ObjcMarkdown/github", or OMD_GITHUB_CACHE_DIR).
+- (id)init;
+// The byte budget comes from OMD_GITHUB_CACHE_MB or the
+// ObjcMarkdownGitHubCacheMB default (32 MB otherwise).
+- (id)initWithAPIBaseURL:(NSString *)apiBaseURL cacheDirectory:(NSString *)cacheDirectory;
+// A nil cache directory or a zero byteLimit disables the response cache.
+- (id)initWithAPIBaseURL:(NSString *)apiBaseURL
+          cacheDirectory:(NSString *)cacheDirectory
+               byteLimit:(unsigned long long)byteLimit;
+
+@property (nonatomic, readonly) NSString *apiBaseURL;
+// nil when the response cache is disabled.
+@property (nonatomic, readonly) NSString *cacheDirectory;
+@property (nonatomic, readonly) unsigned long long cacheByteLimit;
+// Seconds a cached response is served before it is revalidated; defaults to
+// OMD_GITHUB_CACHE_FRESH_SECONDS or 60.
+@property (nonatomic, assign) NSTimeInterval revalidationInterval;
+
 - (NSArray *)publicRepositoriesForUser:(NSString *)user
                includeForksAndArchived:(BOOL)includeForksAndArchived
                                  error:(NSError **)error;
@@ -27,4 +56,12 @@ typedef NS_ENUM(NSInteger, OMDGitHubClientErrorCode) {
 - (NSData *)downloadDataFromURLString:(NSString *)urlString
                                 error:(NSError **)error;
 
+// Warms the cache with the listings of the given directories (for example
+// the subfolders of an expanded folder) on a background queue.
+- (void)prefetchContentsForUser:(NSString *)user
+                     repository:(NSString *)repository
+                          paths:(NSArray *)paths;
+// Blocks until background revalidations and prefetches have finished.
+- (void)waitForBackgroundRequests;
+
 @end
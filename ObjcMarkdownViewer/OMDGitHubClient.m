@@ -2,9 +2,16 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #import "OMDGitHubClient.h"
+#import "OMDiskCache.h"
 
 NSString * const OMDGitHubClientErrorDomain = @"OMDGitHubClientErrorDomain";
+NSString * const OMDGitHubClientCachedResponseDidChangeNotification = @"OMDGitHubClientCachedResponseDidChangeNotification";
 static NSString * const OMDGitHubTokenDefaultsKey = @"ObjcMarkdownGitHubToken";
+static NSString * const OMDGitHubDefaultAPIBaseURL = @"https://api.github.com";
+static NSString * const OMDGitHubJSONAcceptHeader = @"application/vnd.github+json";
+static NSString * const OMDGitHubCacheExtension = @"plist";
+static const NSTimeInterval OMDGitHubDefaultRevalidationInterval = 60.0;
+static const unsigned long long OMDGitHubCacheDefaultLimitBytes = 32ULL * 1024ULL * 1024ULL;
 
 static NSArray *OMDExecutableCandidateNames(NSString *name)
 {
@@ -146,22 +153,175 @@ static NSString *OMDPercentEscapedPath(NSString *value)
     return [escaped componentsJoinedByString:@"/"];
 }
 
+static NSString *OMDGitHubDefaultCacheDirectory(void)
+{
+    NSDictionary *environment = [[NSProcessInfo processInfo] environment];
+    NSString *path = [environment objectForKey:@"OMD_GITHUB_CACHE_DIR"];
+    if (path != nil) {
+        // An empty override disables the response cache.
+        return [path length] > 0 ? [path stringByExpandingTildeInPath] : nil;
+    }
+    return OMDiskCacheUserDirectory(@"github");
+}
+
+static unsigned long long OMDGitHubDefaultCacheLimitBytes(void)
+{
+    return OMDiskCacheLimitSetting([NSArray arrayWithObject:@"OMD_GITHUB_CACHE_MB"],
+                                   @"ObjcMarkdownGitHubCacheMB",
+                                   OMDGitHubCacheDefaultLimitBytes);
+}
+
+static NSTimeInterval OMDGitHubDefaultRevalidationSeconds(void)
+{
+    NSString *value = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_GITHUB_CACHE_FRESH_SECONDS"];
+    if (value != nil && [value length] > 0) {
+        return MAX([value doubleValue], 0.0);
+    }
+    return OMDGitHubDefaultRevalidationInterval;
+}
+
+// A response depends on who asked and what representation was asked for,
+// not only on the URL: a token can see private repositories and has its own
+// rate limit, and another Accept header yields another body. Both are part
+// of the key; the token only as a hash, so it never reaches the disk.
+static NSString *OMDGitHubCacheKeyForURL(NSString *urlString, BOOL acceptJSON)
+{
+    NSString *identity = @"anonymous";
+    NSData *token = [OMDGitHubAccessToken() dataUsingEncoding:NSUTF8StringEncoding];
+    if ([token length] > 0) {
+        uint64_t hash = OMDiskCacheFNV1aHash64((const unsigned char *)[token bytes],
+                                               [token length],
+                                               14695981039346656037ULL);
+        identity = [NSString stringWithFormat:@"token-%016llx", (unsigned long long)hash];
+    }
+    return [NSString stringWithFormat:@"%@|%@|%@",
+            (acceptJSON ? OMDGitHubJSONAcceptHeader : @"*/*"),
+            identity,
+            urlString];
+}
+
+// Header fields of the final response in a curl -D dump (redirects add
+// earlier blocks), keyed by lowercased field name.
+static NSDictionary *OMDParsedResponseHeaders(NSString *text)
+{
+    NSMutableDictionary *headers = [NSMutableDictionary dictionary];
+    for (NSString *rawLine in [text componentsSeparatedByString:@"\n"]) {
+        NSString *line = OMDTrimmedString(rawLine);
+        if ([line hasPrefix:@"HTTP/"]) {
+            [headers removeAllObjects];
+            continue;
+        }
+        NSRange colon = [line rangeOfString:@":"];
+        if (colon.location == NSNotFound || colon.location == 0) {
+            continue;
+        }
+        NSString *name = [[line substringToIndex:colon.location] lowercaseString];
+        NSString *value = OMDTrimmedString([line substringFromIndex:NSMaxRange(colon)]);
+        [headers setObject:value forKey:name];
+    }
+    return headers;
+}
+
 @interface OMDGitHubClient ()
+{
+    OMDiskCache *_diskCache;
+    NSMutableSet *_revalidatingURLs;
+    dispatch_queue_t _backgroundQueue;
+    dispatch_group_t _backgroundGroup;
+}
 - (NSError *)errorWithCode:(OMDGitHubClientErrorCode)code
                description:(NSString *)description
                     reason:(NSString *)reason
                 statusCode:(NSInteger)statusCode;
 - (BOOL)performRequestToURL:(NSString *)urlString
                  acceptJSON:(BOOL)acceptJSON
+             requestHeaders:(NSArray *)requestHeaders
                    bodyData:(NSData **)bodyData
                  statusCode:(NSInteger *)statusCode
+            responseHeaders:(NSDictionary **)responseHeaders
                       error:(NSError **)error;
+- (BOOL)loadURL:(NSString *)urlString
+     acceptJSON:(BOOL)acceptJSON
+       bodyData:(NSData **)bodyData
+     statusCode:(NSInteger *)statusCode
+          error:(NSError **)error;
+- (NSDictionary *)cacheEntryForURL:(NSString *)urlString acceptJSON:(BOOL)acceptJSON;
+- (void)storeCacheEntry:(NSDictionary *)entry forURL:(NSString *)urlString acceptJSON:(BOOL)acceptJSON;
+- (BOOL)fetchAndCacheURL:(NSString *)urlString
+              acceptJSON:(BOOL)acceptJSON
+               revalidate:(NSDictionary *)entry
+                 bodyData:(NSData **)bodyData
+               statusCode:(NSInteger *)statusCode
+                    error:(NSError **)error;
+- (void)scheduleRevalidationOfURL:(NSString *)urlString acceptJSON:(BOOL)acceptJSON;
+- (NSString *)contentsURLForUser:(NSString *)user repository:(NSString *)repository path:(NSString *)path;
 - (id)JSONObjectFromData:(NSData *)data error:(NSError **)error;
 - (NSError *)apiErrorForStatusCode:(NSInteger)statusCode data:(NSData *)data fallback:(NSString *)fallback;
 @end
 
 @implementation OMDGitHubClient
 
+@synthesize apiBaseURL = _apiBaseURL;
+@synthesize revalidationInterval = _revalidationInterval;
+
+- (id)init
+{
+    NSString *baseURL = OMDTrimmedString([[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_GITHUB_API_URL"]);
+    return [self initWithAPIBaseURL:([baseURL length] > 0 ? baseURL : OMDGitHubDefaultAPIBaseURL)
+                     cacheDirectory:OMDGitHubDefaultCacheDirectory()];
+}
+
+- (id)initWithAPIBaseURL:(NSString *)apiBaseURL cacheDirectory:(NSString *)cacheDirectory
+{
+    return [self initWithAPIBaseURL:apiBaseURL
+                     cacheDirectory:cacheDirectory
+                          byteLimit:OMDGitHubDefaultCacheLimitBytes()];
+}
+
+- (id)initWithAPIBaseURL:(NSString *)apiBaseURL
+          cacheDirectory:(NSString *)cacheDirectory
+               byteLimit:(unsigned long long)byteLimit
+{
+    self = [super init];
+    if (self != nil) {
+        NSString *baseURL = OMDTrimmedString(apiBaseURL);
+        while ([baseURL hasSuffix:@"/"]) {
+            baseURL = [baseURL substringToIndex:[baseURL length] - 1];
+        }
+        _apiBaseURL = [([baseURL length] > 0 ? baseURL : OMDGitHubDefaultAPIBaseURL) copy];
+        _diskCache = [[OMDiskCache alloc] initWithDirectory:cacheDirectory byteLimit:byteLimit];
+        _revalidationInterval = OMDGitHubDefaultRevalidationSeconds();
+        _revalidatingURLs = [[NSMutableSet alloc] init];
+        _backgroundQueue = dispatch_queue_create("org.objcmarkdown.github", DISPATCH_QUEUE_CONCURRENT);
+        _backgroundGroup = dispatch_group_create();
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_apiBaseURL release];
+    [_diskCache release];
+    [_revalidatingURLs release];
+    if (_backgroundQueue != NULL) {
+        dispatch_release(_backgroundQueue);
+    }
+    if (_backgroundGroup != NULL) {
+        dispatch_release(_backgroundGroup);
+    }
+    [super dealloc];
+}
+
+- (NSString *)cacheDirectory
+{
+    return [_diskCache directory];
+}
+
+- (unsigned long long)cacheByteLimit
+{
+    return [_diskCache isEnabled] ? [_diskCache byteLimit] : 0;
+}
+
 - (NSError *)errorWithCode:(OMDGitHubClientErrorCode)code
                description:(NSString *)description
                     reason:(NSString *)reason
@@ -182,8 +342,10 @@ static NSString *OMDPercentEscapedPath(NSString *value)
 
 - (BOOL)performRequestToURL:(NSString *)urlString
                  acceptJSON:(BOOL)acceptJSON
+             requestHeaders:(NSArray *)requestHeaders
                    bodyData:(NSData **)bodyData
                  statusCode:(NSInteger *)statusCode
+            responseHeaders:(NSDictionary **)responseHeaders
                       error:(NSError **)error
 {
     NSString *curlPath = OMDResolveCurlPath();
@@ -204,6 +366,7 @@ static NSString *OMDPercentEscapedPath(NSString *value)
     NSString *outputPath = [temporaryDirectory stringByAppendingPathComponent:
                             [NSString stringWithFormat:@"objcmarkdown-github-%@.tmp",
                                                        [[NSProcessInfo processInfo] globallyUniqueString]]];
+    NSString *headerPath = [outputPath stringByAppendingPathExtension:@"headers"];
 
     NSMutableArray *arguments = [NSMutableArray arrayWithObjects:
                                  @"-sS",
@@ -214,7 +377,7 @@ static NSString *OMDPercentEscapedPath(NSString *value)
                                  nil];
     if (acceptJSON) {
         [arguments addObjectsFromArray:[NSArray arrayWithObjects:@"-H",
-                                                     @"Accept: application/vnd.github+json",
+                                                     [NSString stringWithFormat:@"Accept: %@", OMDGitHubJSONAcceptHeader],
                                                      nil]];
     }
     NSString *token = OMDGitHubAccessToken();
@@ -223,6 +386,14 @@ static NSString *OMDPercentEscapedPath(NSString *value)
                                                      [NSString stringWithFormat:@"Authorization: Bearer %@", token],
                                                      nil]];
     }
+    for (NSString *header in requestHeaders) {
+        [arguments addObject:@"-H"];
+        [arguments addObject:header];
+    }
+    if (responseHeaders != NULL) {
+        [arguments addObject:@"-D"];
+        [arguments addObject:headerPath];
+    }
     [arguments addObjectsFromArray:[NSArray arrayWithObjects:
                                     @"-o", outputPath,
                                     @"-w", @"%{http_code}",
@@ -269,6 +440,13 @@ static NSString *OMDPercentEscapedPath(NSString *value)
     if (bodyData != NULL) {
         *bodyData = responseData;
     }
+    if (responseHeaders != NULL) {
+        NSString *headerText = [NSString stringWithContentsOfFile:headerPath
+                                                         encoding:NSISOLatin1StringEncoding
+                                                            error:NULL];
+        *responseHeaders = OMDParsedResponseHeaders(headerText);
+        [[NSFileManager defaultManager] removeItemAtPath:headerPath error:NULL];
+    }
 
     if (!launched || [task terminationStatus] != 0) {
         if (error != NULL) {
@@ -287,6 +465,238 @@ static NSString *OMDPercentEscapedPath(NSString *value)
     return YES;
 }
 
+- (NSDictionary *)cacheEntryForURL:(NSString *)urlString acceptJSON:(BOOL)acceptJSON
+{
+    if (![_diskCache isEnabled]) {
+        return nil;
+    }
+    NSData *data = [_diskCache dataForKey:OMDGitHubCacheKeyForURL(urlString, acceptJSON)
+                                extension:OMDGitHubCacheExtension];
+    if (data == nil) {
+        return nil;
+    }
+    id entry = [NSPropertyListSerialization propertyListWithData:data
+                                                         options:NSPropertyListImmutable
+                                                          format:NULL
+                                                           error:NULL];
+    if (![entry isKindOfClass:[NSDictionary class]] ||
+        ![[entry objectForKey:@"url"] isEqual:urlString] ||
+        ![[entry objectForKey:@"body"] isKindOfClass:[NSData class]]) {
+        return nil;
+    }
+    return entry;
+}
+
+- (void)storeCacheEntry:(NSDictionary *)entry forURL:(NSString *)urlString acceptJSON:(BOOL)acceptJSON
+{
+    if (![_diskCache isEnabled]) {
+        return;
+    }
+    NSString *key = OMDGitHubCacheKeyForURL(urlString, acceptJSON);
+    if (entry == nil) {
+        [_diskCache removeDataForKey:key extension:OMDGitHubCacheExtension];
+        return;
+    }
+    NSData *data = [NSPropertyListSerialization dataWithPropertyList:entry
+                                                              format:NSPropertyListBinaryFormat_v1_0
+                                                             options:0
+                                                               error:NULL];
+    if (data != nil) {
+        [_diskCache storeData:data forKey:key extension:OMDGitHubCacheExtension];
+    }
+}
+
+// One network round trip. With a cached entry the request is conditional,
+// and a 304 answer yields the cached body. Successful answers are cached.
+- (BOOL)fetchAndCacheURL:(NSString *)urlString
+              acceptJSON:(BOOL)acceptJSON
+               revalidate:(NSDictionary *)entry
+                 bodyData:(NSData **)bodyData
+               statusCode:(NSInteger *)statusCode
+                    error:(NSError **)error
+{
+    NSMutableArray *conditions = [NSMutableArray array];
+    NSString *etag = [entry objectForKey:@"etag"];
+    NSString *lastModified = [entry objectForKey:@"lastModified"];
+    if ([etag length] > 0) {
+        [conditions addObject:[NSString stringWithFormat:@"If-None-Match: %@", etag]];
+    }
+    if ([lastModified length] > 0) {
+        [conditions addObject:[NSString stringWithFormat:@"If-Modified-Since: %@", lastModified]];
+    }
+
+    NSData *body = nil;
+    NSInteger status = 0;
+    NSDictionary *headers = nil;
+    if (![self performRequestToURL:urlString
+                        acceptJSON:acceptJSON
+                    requestHeaders:conditions
+                          bodyData:&body
+                        statusCode:&status
+                   responseHeaders:&headers
+                             error:error]) {
+        return NO;
+    }
+
+    if (status == 304 && entry != nil) {
+        NSMutableDictionary *refreshed = [[entry mutableCopy] autorelease];
+        [refreshed setObject:[NSDate date] forKey:@"validatedAt"];
+        [self storeCacheEntry:refreshed forURL:urlString acceptJSON:acceptJSON];
+        body = [entry objectForKey:@"body"];
+        status = 200;
+    } else if (status >= 200 && status < 300 && body != nil) {
+        NSMutableDictionary *stored = [NSMutableDictionary dictionary];
+        [stored setObject:urlString forKey:@"url"];
+        [stored setObject:body forKey:@"body"];
+        [stored setObject:[NSDate date] forKey:@"validatedAt"];
+        if ([[headers objectForKey:@"etag"] length] > 0) {
+            [stored setObject:[headers objectForKey:@"etag"] forKey:@"etag"];
+        }
+        if ([[headers objectForKey:@"last-modified"] length] > 0) {
+            [stored setObject:[headers objectForKey:@"last-modified"] forKey:@"lastModified"];
+        }
+        [self storeCacheEntry:stored forURL:urlString acceptJSON:acceptJSON];
+    } else if (status == 404 || status == 410) {
+        [self storeCacheEntry:nil forURL:urlString acceptJSON:acceptJSON];
+    }
+
+    if (bodyData != NULL) {
+        *bodyData = body;
+    }
+    if (statusCode != NULL) {
+        *statusCode = status;
+    }
+    return YES;
+}
+
+- (void)scheduleRevalidationOfURL:(NSString *)urlString acceptJSON:(BOOL)acceptJSON
+{
+    @synchronized (_revalidatingURLs) {
+        if ([_revalidatingURLs containsObject:urlString]) {
+            return;
+        }
+        [_revalidatingURLs addObject:urlString];
+    }
+    NSString *requestURL = [[urlString copy] autorelease];
+    dispatch_group_async(_backgroundGroup, _backgroundQueue, ^{
+        @autoreleasepool {
+            NSDictionary *entry = [self cacheEntryForURL:requestURL acceptJSON:acceptJSON];
+            NSData *body = nil;
+            NSInteger status = 0;
+            BOOL fetched = [self fetchAndCacheURL:requestURL
+                                       acceptJSON:acceptJSON
+                                       revalidate:entry
+                                         bodyData:&body
+                                       statusCode:&status
+                                            error:NULL];
+            @synchronized (_revalidatingURLs) {
+                [_revalidatingURLs removeObject:requestURL];
+            }
+            // Failures (offline, rate limited) keep serving the cached copy.
+            if (fetched && status == 200 && entry != nil && ![body isEqual:[entry objectForKey:@"body"]]) {
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    [[NSNotificationCenter defaultCenter]
+                        postNotificationName:OMDGitHubClientCachedResponseDidChangeNotification
+                                      object:self
+                                    userInfo:[NSDictionary dictionaryWithObject:requestURL forKey:@"url"]];
+                });
+            }
+        }
+    });
+}
+
+// Serves a cached response without a round trip, revalidating it in the
+// background once it is older than the revalidation interval.
+- (BOOL)loadURL:(NSString *)urlString
+     acceptJSON:(BOOL)acceptJSON
+       bodyData:(NSData **)bodyData
+     statusCode:(NSInteger *)statusCode
+          error:(NSError **)error
+{
+    NSDictionary *entry = [self cacheEntryForURL:urlString acceptJSON:acceptJSON];
+    if (entry == nil) {
+        return [self fetchAndCacheURL:urlString
+                           acceptJSON:acceptJSON
+                           revalidate:nil
+                             bodyData:bodyData
+                           statusCode:statusCode
+                                error:error];
+    }
+
+    NSDate *validatedAt = [entry objectForKey:@"validatedAt"];
+    if (![validatedAt isKindOfClass:[NSDate class]] ||
+        -[validatedAt timeIntervalSinceNow] >= _revalidationInterval) {
+        [self scheduleRevalidationOfURL:urlString acceptJSON:acceptJSON];
+    }
+    if (bodyData != NULL) {
+        *bodyData = [entry objectForKey:@"body"];
+    }
+    if (statusCode != NULL) {
+        *statusCode = 200;
+    }
+    return YES;
+}
+
+- (NSString *)contentsURLForUser:(NSString *)user repository:(NSString *)repository path:(NSString *)path
+{
+    NSString *urlString = [NSString stringWithFormat:@"%@/repos/%@/%@/contents",
+                           _apiBaseURL,
+                           OMDPercentEscapedString(OMDTrimmedString(user)),
+                           OMDPercentEscapedString(OMDTrimmedString(repository))];
+    NSString *encodedPath = OMDPercentEscapedPath(path);
+    if ([encodedPath length] > 0) {
+        urlString = [urlString stringByAppendingFormat:@"/%@", encodedPath];
+    }
+    return urlString;
+}
+
+- (void)prefetchContentsForUser:(NSString *)user
+                     repository:(NSString *)repository
+                          paths:(NSArray *)paths
+{
+    if (![_diskCache isEnabled] ||
+        [OMDTrimmedString(user) length] == 0 ||
+        [OMDTrimmedString(repository) length] == 0) {
+        return;
+    }
+    for (NSString *path in paths) {
+        NSString *urlString = [self contentsURLForUser:user repository:repository path:path];
+        NSDictionary *entry = [self cacheEntryForURL:urlString acceptJSON:YES];
+        if (entry == nil) {
+            @synchronized (_revalidatingURLs) {
+                if ([_revalidatingURLs containsObject:urlString]) {
+                    continue;
+                }
+                [_revalidatingURLs addObject:urlString];
+            }
+            dispatch_group_async(_backgroundGroup, _backgroundQueue, ^{
+                @autoreleasepool {
+                    [self fetchAndCacheURL:urlString
+                                acceptJSON:YES
+                                revalidate:nil
+                                  bodyData:NULL
+                                statusCode:NULL
+                                     error:NULL];
+                    @synchronized (_revalidatingURLs) {
+                        [_revalidatingURLs removeObject:urlString];
+                    }
+                }
+            });
+        } else {
+            NSDate *validatedAt = [entry objectForKey:@"validatedAt"];
+            if (![validatedAt isKindOfClass:[NSDate class]] ||
+                -[validatedAt timeIntervalSinceNow] >= _revalidationInterval) {
+                [self scheduleRevalidationOfURL:urlString acceptJSON:YES];
+            }
+        }
+    }
+}
+
+- (void)waitForBackgroundRequests
+{
+    dispatch_group_wait(_backgroundGroup, DISPATCH_TIME_FOREVER);
+}
+
 - (id)JSONObjectFromData:(NSData *)data error:(NSError **)error
 {
     if (data == nil || [data length] == 0) {
@@ -361,15 +771,16 @@ static NSString *OMDPercentEscapedPath(NSString *value)
 
     NSString *encodedUser = OMDPercentEscapedString(trimmedUser);
     NSString *urlString = [NSString stringWithFormat:
-                           @"https://api.github.com/users/%@/repos?per_page=100&sort=updated&direction=desc&type=public",
+                           @"%@/users/%@/repos?per_page=100&sort=updated&direction=desc&type=public",
+                           _apiBaseURL,
                            encodedUser];
     NSData *bodyData = nil;
     NSInteger statusCode = 0;
-    if (![self performRequestToURL:urlString
-                        acceptJSON:YES
-                          bodyData:&bodyData
-                        statusCode:&statusCode
-                             error:error]) {
+    if (![self loadURL:urlString
+            acceptJSON:YES
+              bodyData:&bodyData
+            statusCode:&statusCode
+                 error:error]) {
         return nil;
     }
 
@@ -452,24 +863,15 @@ static NSString *OMDPercentEscapedPath(NSString *value)
         return [NSArray array];
     }
 
-    NSString *encodedUser = OMDPercentEscapedString(trimmedUser);
-    NSString *encodedRepository = OMDPercentEscapedString(trimmedRepository);
-    NSString *encodedPath = OMDPercentEscapedPath(path);
-
-    NSString *urlString = [NSString stringWithFormat:@"https://api.github.com/repos/%@/%@/contents",
-                           encodedUser,
-                           encodedRepository];
-    if ([encodedPath length] > 0) {
-        urlString = [urlString stringByAppendingFormat:@"/%@", encodedPath];
-    }
+    NSString *urlString = [self contentsURLForUser:trimmedUser repository:trimmedRepository path:path];
 
     NSData *bodyData = nil;
     NSInteger statusCode = 0;
-    if (![self performRequestToURL:urlString
-                        acceptJSON:YES
-                          bodyData:&bodyData
-                        statusCode:&statusCode
-                             error:error]) {
+    if (![self loadURL:urlString
+            acceptJSON:YES
+              bodyData:&bodyData
+            statusCode:&statusCode
+                 error:error]) {
         return nil;
     }
 
@@ -571,11 +973,11 @@ static NSString *OMDPercentEscapedPath(NSString *value)
 
     NSData *bodyData = nil;
     NSInteger statusCode = 0;
-    if (![self performRequestToURL:trimmed
-                        acceptJSON:NO
-                          bodyData:&bodyData
-                        statusCode:&statusCode
-                             error:error]) {
+    if (![self loadURL:trimmed
+            acceptJSON:NO
+              bodyData:&bodyData
+            statusCode:&statusCode
+                 error:error]) {
         return nil;
     }
 
@@ -2,51 +2,90 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #import "OMDLineNumberRulerView.h"
+#import "OMPerfTrace.h"
 
-static BOOL OMDKeyLatencyProfilingEnabled(void)
-{
-    static NSInteger enabled = -1;
-    if (enabled < 0) {
-        NSString *value = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_KEYLATENCY"];
-        enabled = ([value length] > 0 && ![value isEqualToString:@"0"]) ? 1 : 0;
-    }
-    return enabled == 1;
-}
+static const NSUInteger OMDLineScanChunkLength = 1024;
 
-static NSTimeInterval OMDKeyLatencyNow(void)
+static void OMDEnsureLineStartCapacity(NSUInteger **lineStarts, NSUInteger *capacity, NSUInteger needed)
 {
-    return [NSDate timeIntervalSinceReferenceDate];
+    if (needed <= *capacity) {
+        return;
+    }
+    NSUInteger newCapacity = *capacity > 0 ? *capacity : 256;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    *lineStarts = (NSUInteger *)realloc(*lineStarts, newCapacity * sizeof(NSUInteger));
+    *capacity = newCapacity;
 }
 
-static double OMDKeyLatencyThresholdMS(void)
+// Appends i + 1 for every newline at index i in range.
+static void OMDAppendLineStartsInRange(NSString *text,
+                                       NSRange range,
+                                       NSUInteger **lineStarts,
+                                       NSUInteger *count,
+                                       NSUInteger *capacity)
 {
-    static double threshold = -1.0;
-    if (threshold < 0.0) {
-        NSString *value = [[[NSProcessInfo processInfo] environment] objectForKey:@"OMD_KEYLATENCY_THRESHOLD_MS"];
-        threshold = [value length] > 0 ? [value doubleValue] : 4.0;
-        if (threshold < 0.0) {
-            threshold = 0.0;
+    unichar buffer[OMDLineScanChunkLength];
+    NSUInteger offset = range.location;
+    NSUInteger end = NSMaxRange(range);
+    while (offset < end) {
+        NSUInteger chunk = MIN(OMDLineScanChunkLength, end - offset);
+        [text getCharacters:buffer range:NSMakeRange(offset, chunk)];
+        NSUInteger i = 0;
+        for (; i < chunk; i++) {
+            if (buffer[i] == '\n') {
+                OMDEnsureLineStartCapacity(lineStarts, capacity, *count + 1);
+                (*lineStarts)[*count] = offset + i + 1;
+                *count += 1;
+            }
         }
+        offset += chunk;
     }
-    return threshold;
 }
 
-static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
+// Index of the first entry greater than value.
+static NSUInteger OMDUpperBound(const NSUInteger *values, NSUInteger count, NSUInteger value)
 {
-    return (end - start) * 1000.0;
+    NSUInteger low = 0;
+    NSUInteger high = count;
+    while (low < high) {
+        NSUInteger mid = low + (high - low) / 2;
+        if (values[mid] <= value) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
 
 @interface OMDLineNumberRulerView ()
 - (void)textDidChange:(NSNotification *)notification;
+- (void)textStorageDidProcessEditing:(NSNotification *)notification;
+- (void)observeCurrentTextStorage;
 - (void)clipViewBoundsDidChange:(NSNotification *)notification;
 - (void)updateRuleThickness;
+- (void)rebuildLineStartIndex;
+- (BOOL)ensureLineStartIndex;
 - (NSArray *)lineStartIndexesForString:(NSString *)text;
-- (NSUInteger)lineNumberForCharacterIndex:(NSUInteger)characterIndex inString:(NSString *)text;
+- (NSUInteger)lineNumberForCharacterIndex:(NSUInteger)characterIndex;
 @end
 
 @implementation OMDLineNumberRulerView
 {
     NSTextView *_textView;
+    // The storage whose edits maintain the index. Text views can be handed
+    // a new storage (e.g. -[NSLayoutManager replaceTextStorage:]) without
+    // any notification, so it is compared before the index is used.
+    NSTextStorage *_observedTextStorage;
+    // Start of every line of the text view's string, ascending; the first
+    // entry is always 0. Maintained from text storage edits.
+    NSUInteger *_lineStarts;
+    NSUInteger _lineStartCount;
+    NSUInteger _lineStartCapacity;
+    NSUInteger _indexedLength;
+    BOOL _lineStartIndexValid;
 }
 
 - (instancetype)initWithScrollView:(NSScrollView *)scrollView textView:(NSTextView *)textView
@@ -72,6 +111,7 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
                    selector:@selector(clipViewBoundsDidChange:)
                        name:NSViewFrameDidChangeNotification
                      object:clipView];
+        [self observeCurrentTextStorage];
 
         [self updateRuleThickness];
     }
@@ -81,25 +121,40 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
 - (void)dealloc
 {
     [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [_observedTextStorage release];
     [_textView release];
+    free(_lineStarts);
     [super dealloc];
 }
 
 - (void)invalidateLineNumbers
 {
-    BOOL profiling = OMDKeyLatencyProfilingEnabled();
-    NSTimeInterval start = profiling ? OMDKeyLatencyNow() : 0.0;
+    OM_PERF_TRACE_SCOPE("viewer", "line-numbers-invalidate");
     [self updateRuleThickness];
     [self setNeedsDisplay:YES];
-    if (profiling) {
-        NSTimeInterval end = OMDKeyLatencyNow();
-        double totalMS = OMDKeyLatencyMS(start, end);
-        if (totalMS >= OMDKeyLatencyThresholdMS()) {
-            NSLog(@"OMDKeyLatency lineNumbersInvalidate total=%.2fms length=%lu",
-                  totalMS,
-                  (unsigned long)[[_textView string] length]);
-        }
+}
+
+- (void)observeCurrentTextStorage
+{
+    NSTextStorage *storage = [_textView textStorage];
+    if (storage == _observedTextStorage) {
+        return;
     }
+    NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+    if (_observedTextStorage != nil) {
+        [center removeObserver:self
+                          name:NSTextStorageDidProcessEditingNotification
+                        object:_observedTextStorage];
+        [_observedTextStorage release];
+    }
+    _observedTextStorage = [storage retain];
+    if (storage != nil) {
+        [center addObserver:self
+                   selector:@selector(textStorageDidProcessEditing:)
+                       name:NSTextStorageDidProcessEditingNotification
+                     object:storage];
+    }
+    _lineStartIndexValid = NO;
 }
 
 - (void)textDidChange:(NSNotification *)notification
@@ -107,6 +162,85 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
     [self invalidateLineNumbers];
 }
 
+- (void)textStorageDidProcessEditing:(NSNotification *)notification
+{
+    NSTextStorage *storage = [notification object];
+    if (([storage editedMask] & NSTextStorageEditedCharacters) == 0) {
+        return;
+    }
+    if (!_lineStartIndexValid) {
+        return;
+    }
+
+    OM_PERF_TRACE_SCOPE("viewer", "line-numbers-index-update");
+    NSRange editedRange = [storage editedRange];
+    NSInteger changeInLength = [storage changeInLength];
+    NSUInteger length = [storage length];
+    NSInteger oldEditedLength = (NSInteger)editedRange.length - changeInLength;
+    if (editedRange.location == NSNotFound ||
+        NSMaxRange(editedRange) > length ||
+        oldEditedLength < 0 ||
+        (NSInteger)_indexedLength + changeInLength != (NSInteger)length) {
+        _lineStartIndexValid = NO;
+        return;
+    }
+
+    // A line start s belongs to the newline at s - 1. Starts whose newline
+    // was inside the replaced text go; later ones shift by changeInLength.
+    NSUInteger oldEditedEnd = editedRange.location + (NSUInteger)oldEditedLength;
+    NSUInteger firstRemoved = OMDUpperBound(_lineStarts, _lineStartCount, editedRange.location);
+    NSUInteger firstKept = OMDUpperBound(_lineStarts, _lineStartCount, oldEditedEnd);
+    NSUInteger tailCount = _lineStartCount - firstKept;
+
+    NSUInteger *inserted = NULL;
+    NSUInteger insertedCount = 0;
+    NSUInteger insertedCapacity = 0;
+    OMDAppendLineStartsInRange([storage string], editedRange, &inserted, &insertedCount, &insertedCapacity);
+
+    NSUInteger newCount = firstRemoved + insertedCount + tailCount;
+    OMDEnsureLineStartCapacity(&_lineStarts, &_lineStartCapacity, newCount);
+    memmove(_lineStarts + firstRemoved + insertedCount,
+            _lineStarts + firstKept,
+            tailCount * sizeof(NSUInteger));
+    if (insertedCount > 0) {
+        memcpy(_lineStarts + firstRemoved, inserted, insertedCount * sizeof(NSUInteger));
+    }
+    free(inserted);
+    if (changeInLength != 0) {
+        NSUInteger i = firstRemoved + insertedCount;
+        for (; i < newCount; i++) {
+            _lineStarts[i] = (NSUInteger)((NSInteger)_lineStarts[i] + changeInLength);
+        }
+    }
+    _lineStartCount = newCount;
+    _indexedLength = length;
+}
+
+- (void)rebuildLineStartIndex
+{
+    OM_PERF_TRACE_SCOPE("viewer", "line-numbers-index-rebuild");
+    NSString *text = [_textView string];
+    NSUInteger length = [text length];
+    OMDEnsureLineStartCapacity(&_lineStarts, &_lineStartCapacity, 1);
+    _lineStarts[0] = 0;
+    _lineStartCount = 1;
+    OMDAppendLineStartsInRange(text, NSMakeRange(0, length), &_lineStarts, &_lineStartCount, &_lineStartCapacity);
+    _indexedLength = length;
+    _lineStartIndexValid = YES;
+}
+
+- (BOOL)ensureLineStartIndex
+{
+    // The storage notification is the normal path; a new storage, or a
+    // length mismatch, means the text changed behind it.
+    [self observeCurrentTextStorage];
+    if (!_lineStartIndexValid || _indexedLength != [[_textView string] length]) {
+        [self rebuildLineStartIndex];
+        return YES;
+    }
+    return NO;
+}
+
 - (void)clipViewBoundsDidChange:(NSNotification *)notification
 {
     [self setNeedsDisplay:YES];
@@ -114,9 +248,9 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
 
 - (void)updateRuleThickness
 {
-    BOOL profiling = OMDKeyLatencyProfilingEnabled();
-    NSTimeInterval start = profiling ? OMDKeyLatencyNow() : 0.0;
-    NSUInteger lineCount = [[self lineStartIndexesForString:[_textView string]] count];
+    OM_PERF_TRACE_SCOPE("viewer", "line-numbers-thickness");
+    [self ensureLineStartIndex];
+    NSUInteger lineCount = _lineStartCount;
 
     NSUInteger digits = 1;
     NSUInteger value = lineCount;
@@ -130,55 +264,37 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
         thickness = 30.0;
     }
     [self setRuleThickness:thickness];
-    if (profiling) {
-        NSTimeInterval end = OMDKeyLatencyNow();
-        double totalMS = OMDKeyLatencyMS(start, end);
-        if (totalMS >= OMDKeyLatencyThresholdMS()) {
-            NSLog(@"OMDKeyLatency lineNumbersThickness total=%.2fms lines=%lu length=%lu thickness=%.1f",
-                  totalMS,
-                  (unsigned long)lineCount,
-                  (unsigned long)[[_textView string] length],
-                  thickness);
-        }
-    }
 }
 
+// Standalone scan of an arbitrary string; drawing uses the maintained index.
 - (NSArray *)lineStartIndexesForString:(NSString *)text
 {
-    NSMutableArray *lineStarts = [NSMutableArray arrayWithObject:[NSNumber numberWithUnsignedInteger:0]];
-    NSUInteger length = [text length];
-    for (NSUInteger i = 0; i < length; i++) {
-        if ([text characterAtIndex:i] == '\n') {
-            [lineStarts addObject:[NSNumber numberWithUnsignedInteger:i + 1]];
-        }
+    NSUInteger *starts = NULL;
+    NSUInteger count = 1;
+    NSUInteger capacity = 0;
+    OMDEnsureLineStartCapacity(&starts, &capacity, 1);
+    starts[0] = 0;
+    OMDAppendLineStartsInRange(text, NSMakeRange(0, [text length]), &starts, &count, &capacity);
+
+    NSMutableArray *lineStarts = [NSMutableArray arrayWithCapacity:count];
+    NSUInteger i = 0;
+    for (; i < count; i++) {
+        [lineStarts addObject:[NSNumber numberWithUnsignedInteger:starts[i]]];
     }
+    free(starts);
     return lineStarts;
 }
 
-- (NSUInteger)lineNumberForCharacterIndex:(NSUInteger)characterIndex inString:(NSString *)text
+- (NSUInteger)lineNumberForCharacterIndex:(NSUInteger)characterIndex
 {
-    if (text == nil || [text length] == 0) {
-        return 1;
-    }
-
-    NSUInteger cappedIndex = characterIndex;
-    if (cappedIndex > [text length]) {
-        cappedIndex = [text length];
-    }
-
-    NSUInteger line = 1;
-    for (NSUInteger i = 0; i < cappedIndex; i++) {
-        if ([text characterAtIndex:i] == '\n') {
-            line += 1;
-        }
-    }
-    return line;
+    [self ensureLineStartIndex];
+    NSUInteger cappedIndex = MIN(characterIndex, _indexedLength);
+    return OMDUpperBound(_lineStarts, _lineStartCount, cappedIndex);
 }
 
 - (void)drawHashMarksAndLabelsInRect:(NSRect)rect
 {
-    BOOL profiling = OMDKeyLatencyProfilingEnabled();
-    NSTimeInterval start = profiling ? OMDKeyLatencyNow() : 0.0;
+    OM_PERF_TRACE_SCOPE("viewer", "line-numbers-draw");
     NSUInteger drawnLabels = 0;
     NSScrollView *scrollView = [self scrollView];
     if (scrollView == nil || _textView == nil) {
@@ -208,7 +324,7 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
 
     NSString *text = [_textView string];
     NSUInteger textLength = [text length];
-    NSArray *lineStarts = [self lineStartIndexesForString:text];
+    [self ensureLineStartIndex];
 
     NSRect visibleRect = [[scrollView contentView] bounds];
     NSPoint textOrigin = [_textView textContainerOrigin];
@@ -261,25 +377,16 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
     NSUInteger firstVisibleGlyph = visibleGlyphRange.location;
     NSUInteger firstVisibleCharacter = [layoutManager characterIndexForGlyphAtIndex:firstVisibleGlyph];
 
-    NSRange firstLineRange = [text lineRangeForRange:NSMakeRange(firstVisibleCharacter, 0)];
-    NSUInteger firstLineStart = firstLineRange.location;
-    NSUInteger lineNumber = [self lineNumberForCharacterIndex:firstLineStart inString:text];
-    NSUInteger firstLineIndex = 0;
-    NSUInteger lineStartCount = [lineStarts count];
-    for (NSUInteger i = 0; i < lineStartCount; i++) {
-        NSUInteger candidate = [[lineStarts objectAtIndex:i] unsignedIntegerValue];
-        if (candidate >= firstLineStart) {
-            firstLineIndex = i;
-            lineNumber = i + 1;
-            break;
-        }
-    }
+    NSUInteger lineNumber = [self lineNumberForCharacterIndex:firstVisibleCharacter];
+    NSUInteger firstLineIndex = lineNumber - 1;
+    NSUInteger lineStartCount = _lineStartCount;
+    OMPerfTraceSpan labelsSpan = OMPerfTraceBegin("viewer", "line-numbers-labels");
 
     for (NSUInteger i = firstLineIndex; i < lineStartCount; i++) {
-        NSUInteger lineStart = [[lineStarts objectAtIndex:i] unsignedIntegerValue];
+        NSUInteger lineStart = _lineStarts[i];
 
         BOOL emptyTrailingLine = (lineStart == textLength && textLength > 0);
-        NSRange lineRange = emptyTrailingLine ? NSMakeRange(lineStart, 0) : [text lineRangeForRange:NSMakeRange(lineStart, 0)];
+        NSRange lineRange = NSMakeRange(lineStart, lineStart < textLength ? 1 : 0);
 
         NSRange glyphRangeForLine = NSMakeRange(NSNotFound, 0);
         if (emptyTrailingLine) {
@@ -321,18 +428,8 @@ static double OMDKeyLatencyMS(NSTimeInterval start, NSTimeInterval end)
 
         lineNumber += 1;
     }
-
-    if (profiling) {
-        NSTimeInterval end = OMDKeyLatencyNow();
-        double totalMS = OMDKeyLatencyMS(start, end);
-        if (totalMS >= OMDKeyLatencyThresholdMS()) {
-            NSLog(@"OMDKeyLatency lineNumbersDraw total=%.2fms labels=%lu length=%lu rect=%@",
-                  totalMS,
-                  (unsigned long)drawnLabels,
-                  (unsigned long)textLength,
-                  NSStringFromRect(rect));
-        }
-    }
+    OMPerfTraceEnd(labelsSpan);
+    OMPerfTraceCounter("viewer", "line-numbers-drawn", (int64_t)drawnLabels);
 }
 
 - (void)mouseDown:(NSEvent *)event
@@ -0,0 +1,55 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <Foundation/Foundation.h>
+
+extern NSString * const OMDMappedTextFileErrorDomain;
+
+typedef NS_ENUM(NSInteger, OMDMappedTextFileErrorCode) {
+    OMDMappedTextFileErrorUnreadable = 1,
+    OMDMappedTextFileErrorBinary = 2,
+    OMDMappedTextFileErrorUndecodable = 3
+};
+
+// Read-only view of a large text file. The file is memory-mapped and only
+// the pages that are sniffed or decoded are ever touched, so opening a file
+// of hundreds of megabytes costs roughly the size of the decoded window.
+@interface OMDMappedTextFile : NSObject
+
++ (instancetype)mappedTextFileAtPath:(NSString *)path error:(NSError **)error;
+
+@property (nonatomic, readonly) NSString *path;
+@property (nonatomic, readonly) unsigned long long fileSize;
+// Bytes in the mapping (the whole file); nothing is resident until read.
+@property (nonatomic, readonly) unsigned long long mappedByteCount;
+// Bytes converted into NSString form so far.
+@property (nonatomic, readonly) unsigned long long decodedByteCount;
+// Sniffed from a BOM or the first 64 KB; leading BOM bytes are skipped.
+@property (nonatomic, readonly) NSStringEncoding encoding;
+
+// Bytes of text after any BOM; window offsets count from there.
+@property (nonatomic, readonly) unsigned long long textByteCount;
+
+// Decodes at most maximumBytes from the start of the file. The window ends
+// on a line boundary, and for Markdown on a blank line outside fenced code,
+// so the prefix renders the same as it would inside the whole document.
+- (NSString *)leadingTextWithMaximumBytes:(NSUInteger)maximumBytes
+                           markdownBlocks:(BOOL)markdownBlocks
+                                truncated:(BOOL *)truncatedOut
+                                    error:(NSError **)error;
+
+// Same cut for the window starting at byteOffset, which must be 0 or a
+// nextOffset from an earlier call, so consecutive windows tile the file
+// without splitting a line (or a Markdown block). nextOffsetOut receives
+// where the following window starts, textByteCount after the last one.
+- (NSString *)textAtByteOffset:(unsigned long long)byteOffset
+                  maximumBytes:(NSUInteger)maximumBytes
+                markdownBlocks:(BOOL)markdownBlocks
+                    nextOffset:(unsigned long long *)nextOffsetOut
+                         error:(NSError **)error;
+
+@end
+
+FOUNDATION_EXPORT NSStringEncoding OMDSniffTextEncoding(const unsigned char *bytes,
+                                                        NSUInteger length,
+                                                        NSUInteger *bomLengthOut);
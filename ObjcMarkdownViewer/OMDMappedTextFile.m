@@ -0,0 +1,332 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import "OMDMappedTextFile.h"
+
+NSString * const OMDMappedTextFileErrorDomain = @"OMDMappedTextFileErrorDomain";
+
+static const NSUInteger OMDMappedTextSniffLength = 64 * 1024;
+static const NSUInteger OMDMappedTextBinarySampleLength = 8192;
+
+static NSError *OMDMappedTextFileError(OMDMappedTextFileErrorCode code, NSString *description)
+{
+    return [NSError errorWithDomain:OMDMappedTextFileErrorDomain
+                               code:code
+                           userInfo:[NSDictionary dictionaryWithObject:description
+                                                                forKey:NSLocalizedDescriptionKey]];
+}
+
+static BOOL OMDBytesAreValidUTF8Prefix(const unsigned char *bytes, NSUInteger length)
+{
+    NSUInteger index = 0;
+    while (index < length) {
+        unsigned char lead = bytes[index];
+        NSUInteger trailing = 0;
+        if (lead < 0x80) {
+            index += 1;
+            continue;
+        } else if (lead >= 0xC2 && lead <= 0xDF) {
+            trailing = 1;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            trailing = 2;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            trailing = 3;
+        } else {
+            return NO;
+        }
+        if (index + trailing >= length) {
+            // A sequence cut off by the sample boundary is not evidence
+            // against UTF-8.
+            return YES;
+        }
+        NSUInteger offset = 1;
+        for (; offset <= trailing; offset++) {
+            if ((bytes[index + offset] & 0xC0) != 0x80) {
+                return NO;
+            }
+        }
+        index += trailing + 1;
+    }
+    return YES;
+}
+
+NSStringEncoding OMDSniffTextEncoding(const unsigned char *bytes,
+                                      NSUInteger length,
+                                      NSUInteger *bomLengthOut)
+{
+    NSUInteger bomLength = 0;
+    NSStringEncoding encoding = NSUTF8StringEncoding;
+
+    if (length >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+        bomLength = 3;
+    } else if (length >= 4 && bytes[0] == 0xFF && bytes[1] == 0xFE && bytes[2] == 0x00 && bytes[3] == 0x00) {
+        encoding = NSUTF32LittleEndianStringEncoding;
+        bomLength = 4;
+    } else if (length >= 4 && bytes[0] == 0x00 && bytes[1] == 0x00 && bytes[2] == 0xFE && bytes[3] == 0xFF) {
+        encoding = NSUTF32BigEndianStringEncoding;
+        bomLength = 4;
+    } else if (length >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        encoding = NSUTF16LittleEndianStringEncoding;
+        bomLength = 2;
+    } else if (length >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
+        encoding = NSUTF16BigEndianStringEncoding;
+        bomLength = 2;
+    } else {
+        // BOM-less UTF-16 is recognisable by ASCII text leaving every other
+        // byte zero.
+        NSUInteger sample = MIN(length, (NSUInteger)4096);
+        NSUInteger evenZeros = 0;
+        NSUInteger oddZeros = 0;
+        NSUInteger index = 0;
+        for (; index < sample; index++) {
+            if (bytes[index] == 0) {
+                if ((index & 1) == 0) {
+                    evenZeros += 1;
+                } else {
+                    oddZeros += 1;
+                }
+            }
+        }
+        NSUInteger pairs = sample / 2;
+        if (pairs > 0 && oddZeros * 10 > pairs * 3 && evenZeros * 10 < pairs) {
+            encoding = NSUTF16LittleEndianStringEncoding;
+        } else if (pairs > 0 && evenZeros * 10 > pairs * 3 && oddZeros * 10 < pairs) {
+            encoding = NSUTF16BigEndianStringEncoding;
+        } else if (!OMDBytesAreValidUTF8Prefix(bytes, MIN(length, OMDMappedTextSniffLength))) {
+            encoding = NSWindowsCP1252StringEncoding;
+        }
+    }
+
+    if (bomLengthOut != NULL) {
+        *bomLengthOut = bomLength;
+    }
+    return encoding;
+}
+
+static NSUInteger OMDCodeUnitWidthForEncoding(NSStringEncoding encoding)
+{
+    if (encoding == NSUTF16LittleEndianStringEncoding || encoding == NSUTF16BigEndianStringEncoding) {
+        return 2;
+    }
+    if (encoding == NSUTF32LittleEndianStringEncoding || encoding == NSUTF32BigEndianStringEncoding) {
+        return 4;
+    }
+    return 1;
+}
+
+static BOOL OMDCodeUnitIsNewline(const unsigned char *unit, NSUInteger width, NSStringEncoding encoding)
+{
+    if (width == 1) {
+        return unit[0] == '\n';
+    }
+    BOOL littleEndian = (encoding == NSUTF16LittleEndianStringEncoding ||
+                         encoding == NSUTF32LittleEndianStringEncoding);
+    NSUInteger index = 0;
+    for (; index < width; index++) {
+        unsigned char expected = ((littleEndian ? index == 0 : index == width - 1) ? '\n' : 0);
+        if (unit[index] != expected) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+static BOOL OMDSampleAppearsBinary(const unsigned char *bytes, NSUInteger length)
+{
+    NSUInteger sample = MIN(length, OMDMappedTextBinarySampleLength);
+    NSUInteger controlCount = 0;
+    NSUInteger index = 0;
+    for (; index < sample; index++) {
+        unsigned char value = bytes[index];
+        if (value == 0) {
+            return YES;
+        }
+        if (value < 0x09 || (value > 0x0D && value < 0x20)) {
+            controlCount += 1;
+        }
+    }
+    return controlCount > ((sample / 16) + 1);
+}
+
+// Offset just past the last blank line that is outside fenced code, or
+// NSNotFound when the text has none in its second half.
+static NSUInteger OMDMarkdownBlockBoundaryBeforeEnd(NSString *text)
+{
+    NSUInteger length = [text length];
+    NSUInteger boundary = NSNotFound;
+    NSUInteger location = 0;
+    unichar fenceCharacter = 0;
+    while (location < length) {
+        NSUInteger lineStart = 0;
+        NSUInteger lineEnd = 0;
+        NSUInteger contentsEnd = 0;
+        [text getLineStart:&lineStart end:&lineEnd contentsEnd:&contentsEnd forRange:NSMakeRange(location, 0)];
+
+        NSUInteger index = lineStart;
+        while (index < contentsEnd && index - lineStart < 3 && [text characterAtIndex:index] == ' ') {
+            index += 1;
+        }
+        if (index == contentsEnd) {
+            if (fenceCharacter == 0) {
+                boundary = lineEnd;
+            }
+        } else if (index + 3 <= contentsEnd) {
+            unichar first = [text characterAtIndex:index];
+            if ((first == '`' || first == '~') &&
+                [text characterAtIndex:index + 1] == first &&
+                [text characterAtIndex:index + 2] == first) {
+                if (fenceCharacter == 0) {
+                    fenceCharacter = first;
+                } else if (fenceCharacter == first) {
+                    fenceCharacter = 0;
+                }
+            }
+        }
+        location = lineEnd;
+    }
+    if (boundary == NSNotFound || boundary < length / 2) {
+        return NSNotFound;
+    }
+    return boundary;
+}
+
+@implementation OMDMappedTextFile
+{
+    NSData *_data;
+    NSUInteger _bomLength;
+}
+
+@synthesize path = _path;
+@synthesize fileSize = _fileSize;
+@synthesize mappedByteCount = _mappedByteCount;
+@synthesize decodedByteCount = _decodedByteCount;
+@synthesize encoding = _encoding;
+
++ (instancetype)mappedTextFileAtPath:(NSString *)path error:(NSError **)error
+{
+    NSData *data = ([path length] > 0 ? [[[NSData alloc] initWithContentsOfMappedFile:path] autorelease] : nil);
+    if (data == nil) {
+        if (error != NULL) {
+            *error = OMDMappedTextFileError(OMDMappedTextFileErrorUnreadable, @"Unable to read file data.");
+        }
+        return nil;
+    }
+
+    const unsigned char *bytes = (const unsigned char *)[data bytes];
+    NSUInteger length = [data length];
+    NSUInteger bomLength = 0;
+    NSStringEncoding encoding = OMDSniffTextEncoding(bytes, length, &bomLength);
+    if (OMDCodeUnitWidthForEncoding(encoding) == 1 && OMDSampleAppearsBinary(bytes + bomLength, length - bomLength)) {
+        if (error != NULL) {
+            *error = OMDMappedTextFileError(OMDMappedTextFileErrorBinary,
+                                            @"This file appears to be binary and cannot be previewed as text.");
+        }
+        return nil;
+    }
+
+    OMDMappedTextFile *file = [[[self alloc] init] autorelease];
+    file->_data = [data retain];
+    file->_path = [path copy];
+    file->_fileSize = length;
+    file->_mappedByteCount = length;
+    file->_encoding = encoding;
+    file->_bomLength = bomLength;
+    return file;
+}
+
+- (void)dealloc
+{
+    [_data release];
+    [_path release];
+    [super dealloc];
+}
+
+- (unsigned long long)textByteCount
+{
+    return [_data length] - _bomLength;
+}
+
+- (NSString *)leadingTextWithMaximumBytes:(NSUInteger)maximumBytes
+                           markdownBlocks:(BOOL)markdownBlocks
+                                truncated:(BOOL *)truncatedOut
+                                    error:(NSError **)error
+{
+    unsigned long long nextOffset = 0;
+    NSString *text = [self textAtByteOffset:0
+                               maximumBytes:maximumBytes
+                             markdownBlocks:markdownBlocks
+                                 nextOffset:&nextOffset
+                                      error:error];
+    if (text != nil && truncatedOut != NULL) {
+        *truncatedOut = (nextOffset < [self textByteCount]);
+    }
+    return text;
+}
+
+- (NSString *)textAtByteOffset:(unsigned long long)byteOffset
+                  maximumBytes:(NSUInteger)maximumBytes
+                markdownBlocks:(BOOL)markdownBlocks
+                    nextOffset:(unsigned long long *)nextOffsetOut
+                         error:(NSError **)error
+{
+    NSUInteger width = OMDCodeUnitWidthForEncoding(_encoding);
+    NSUInteger textLength = [_data length] - _bomLength;
+    NSUInteger start = (NSUInteger)MIN(byteOffset, (unsigned long long)textLength);
+    start -= start % width;
+    const unsigned char *bytes = (const unsigned char *)[_data bytes] + _bomLength + start;
+    NSUInteger available = textLength - start;
+    NSUInteger take = MIN(available, maximumBytes);
+    BOOL truncated = (take < available);
+
+    if (truncated) {
+        take -= take % width;
+        if (width == 1) {
+            while (take > 0 && (bytes[take] & 0xC0) == 0x80) {
+                take -= 1;
+            }
+        }
+        NSUInteger scan = take;
+        while (scan >= width) {
+            scan -= width;
+            if (OMDCodeUnitIsNewline(bytes + scan, width, _encoding)) {
+                take = scan + width;
+                break;
+            }
+        }
+        if (take == 0) {
+            // Nothing decodable fits; move on by one code unit rather than
+            // return the same window forever.
+            take = MIN(available, width);
+        }
+    }
+
+    NSStringEncoding encoding = _encoding;
+    NSString *text = [[[NSString alloc] initWithBytes:bytes length:take encoding:encoding] autorelease];
+    if (text == nil && encoding == NSUTF8StringEncoding) {
+        encoding = NSWindowsCP1252StringEncoding;
+        text = [[[NSString alloc] initWithBytes:bytes length:take encoding:encoding] autorelease];
+    }
+    if (text == nil) {
+        if (error != NULL) {
+            *error = OMDMappedTextFileError(OMDMappedTextFileErrorUndecodable,
+                                            @"Unable to decode this file as text.");
+        }
+        return nil;
+    }
+
+    if (truncated && markdownBlocks) {
+        NSUInteger boundary = OMDMarkdownBlockBoundaryBeforeEnd(text);
+        if (boundary != NSNotFound && boundary < [text length]) {
+            text = [text substringToIndex:boundary];
+            take = [text lengthOfBytesUsingEncoding:encoding];
+        }
+    }
+
+    _decodedByteCount += take;
+    if (nextOffsetOut != NULL) {
+        *nextOffsetOut = (unsigned long long)(start + take);
+    }
+    return text;
+}
+
+@end
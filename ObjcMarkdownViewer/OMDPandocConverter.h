@@ -9,3 +9,8 @@
 - (id)initWithPandocPath:(NSString *)pandocPath;
 
 @end
+
+// What an export reads besides the Markdown: the working directory and the
+// path, size and modification date of each local image the text references.
+// Part of the export cache key.
+FOUNDATION_EXPORT NSString *OMDPandocLocalResourceFingerprint(NSString *markdown, NSString *workingDirectory);
@@ -2,6 +2,10 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #import "OMDPandocConverter.h"
+#import "OMDConversionCache.h"
+#import "OMPerfTrace.h"
+
+#include <cmark.h>
 
 @interface OMDPandocConverter ()
 {
@@ -11,15 +15,112 @@
 - (NSString *)pandocFormatForExtension:(NSString *)extension;
 - (NSString *)temporaryPathWithPrefix:(NSString *)prefix extension:(NSString *)extension;
 - (BOOL)runPandocWithArguments:(NSArray *)arguments
+                          task:(OMDConversionTask *)conversionTask
                        logText:(NSString **)logText
               terminationStatus:(int *)terminationStatus
                     launchError:(NSError **)launchError;
+- (NSString *)pandocVersion;
+- (NSString *)probePandocVersion;
 - (NSError *)conversionErrorWithDescription:(NSString *)description
                                      reason:(NSString *)reason
                                        code:(OMDDocumentConverterErrorCode)code;
 - (NSString *)trimmedLogText:(NSString *)text;
 @end
 
+static void OMDAppendHTMLSourceAttributes(NSString *html, NSMutableArray *destinations)
+{
+    static NSRegularExpression *expression = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        expression = [[NSRegularExpression alloc] initWithPattern:@"\\bsrc\\s*=\\s*[\"']([^\"']+)[\"']"
+                                                          options:NSRegularExpressionCaseInsensitive
+                                                            error:NULL];
+    });
+    if (expression == nil || [html length] == 0) {
+        return;
+    }
+    for (NSTextCheckingResult *match in [expression matchesInString:html options:0 range:NSMakeRange(0, [html length])]) {
+        [destinations addObject:[html substringWithRange:[match rangeAtIndex:1]]];
+    }
+}
+
+// Pandoc reads local images (embedding them in .docx and .odt) relative to
+// its working directory, so the Markdown text alone does not determine an
+// export. Remote and data URLs are covered by the text itself.
+NSString *OMDPandocLocalResourceFingerprint(NSString *markdown, NSString *workingDirectory)
+{
+    NSMutableArray *destinations = [NSMutableArray array];
+    NSData *utf8 = [(markdown != nil ? markdown : @"") dataUsingEncoding:NSUTF8StringEncoding];
+    cmark_node *document = cmark_parse_document((const char *)[utf8 bytes], [utf8 length], CMARK_OPT_DEFAULT);
+    if (document != NULL) {
+        cmark_iter *iterator = cmark_iter_new(document);
+        cmark_event_type event;
+        while ((event = cmark_iter_next(iterator)) != CMARK_EVENT_DONE) {
+            if (event != CMARK_EVENT_ENTER) {
+                continue;
+            }
+            cmark_node *node = cmark_iter_get_node(iterator);
+            cmark_node_type type = cmark_node_get_type(node);
+            if (type == CMARK_NODE_IMAGE) {
+                const char *url = cmark_node_get_url(node);
+                NSString *destination = (url != NULL ? [NSString stringWithUTF8String:url] : nil);
+                if (destination != nil) {
+                    [destinations addObject:destination];
+                }
+            } else if (type == CMARK_NODE_HTML_BLOCK || type == CMARK_NODE_HTML_INLINE) {
+                const char *literal = cmark_node_get_literal(node);
+                NSString *html = (literal != NULL ? [NSString stringWithUTF8String:literal] : nil);
+                OMDAppendHTMLSourceAttributes(html, destinations);
+            }
+        }
+        cmark_iter_free(iterator);
+        cmark_node_free(document);
+    }
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableSet *resources = [NSMutableSet set];
+    for (NSString *destination in destinations) {
+        NSString *trimmed = [destination stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+        if ([trimmed length] == 0 || [trimmed hasPrefix:@"#"]) {
+            continue;
+        }
+        NSString *path = nil;
+        NSURL *url = [NSURL URLWithString:trimmed];
+        NSString *scheme = [[url scheme] lowercaseString];
+        if ([scheme isEqualToString:@"file"]) {
+            path = [url path];
+        } else if ([scheme length] > 1) {
+            // http, https, data and the like; a one-letter scheme is a
+            // Windows drive.
+            continue;
+        } else {
+            NSString *decoded = [trimmed stringByRemovingPercentEncoding];
+            path = (decoded != nil ? decoded : trimmed);
+        }
+        if ([path length] == 0) {
+            continue;
+        }
+        if (![path isAbsolutePath] && [workingDirectory length] > 0) {
+            path = [workingDirectory stringByAppendingPathComponent:path];
+        }
+        path = [path stringByStandardizingPath];
+        NSDictionary *attributes = [fileManager attributesOfItemAtPath:path error:NULL];
+        if (attributes == nil) {
+            [resources addObject:[path stringByAppendingString:@"|missing"]];
+            continue;
+        }
+        [resources addObject:[NSString stringWithFormat:@"%@|%llu|%.6f",
+                              path,
+                              [[attributes objectForKey:NSFileSize] unsignedLongLongValue],
+                              [[attributes objectForKey:NSFileModificationDate] timeIntervalSinceReferenceDate]]];
+    }
+
+    NSArray *sorted = [[resources allObjects] sortedArrayUsingSelector:@selector(compare:)];
+    return [NSString stringWithFormat:@"%@\n%@",
+                                      workingDirectory != nil ? workingDirectory : @"",
+                                      [sorted componentsJoinedByString:@"\n"]];
+}
+
 static NSString *OMDExecutablePathNamed(NSString *name)
 {
     if (name == nil || [name length] == 0) {
@@ -163,6 +264,13 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
     if (self != nil) {
         _pandocPath = [pandocPath copy];
         _pandocDataDirectory = [OMDResolvePandocDataDirectory(pandocPath) copy];
+        // Launching pandoc takes long enough to stall a window, so the
+        // version behind the conversion cache keys is learned up front.
+        [self retain];
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+            [self probePandocVersion];
+            [self release];
+        });
     }
     return self;
 }
@@ -248,6 +356,7 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
 }
 
 - (BOOL)runPandocWithArguments:(NSArray *)arguments
+                          task:(OMDConversionTask *)conversionTask
                        logText:(NSString **)logText
               terminationStatus:(int *)terminationStatus
                     launchError:(NSError **)launchError
@@ -278,7 +387,9 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
     BOOL launched = YES;
     @try {
         [task launch];
+        [conversionTask setRunningProcess:task];
         [task waitUntilExit];
+        [conversionTask setRunningProcess:nil];
     } @catch (NSException *exception) {
         launched = NO;
         if (launchError != NULL) {
@@ -308,10 +419,73 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
     return launched && [task terminationStatus] == 0;
 }
 
+static NSMutableDictionary *OMDPandocVersions(void)
+{
+    static NSMutableDictionary *versions = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        versions = [[NSMutableDictionary alloc] init];
+    });
+    return versions;
+}
+
+- (NSString *)pandocVersion
+{
+    NSMutableDictionary *versions = OMDPandocVersions();
+    NSString *identity = [NSString stringWithFormat:@"%@|%@",
+                          _pandocPath,
+                          _pandocDataDirectory != nil ? _pandocDataDirectory : @""];
+    @synchronized (versions) {
+        NSString *known = [versions objectForKey:identity];
+        if (known != nil) {
+            return known;
+        }
+    }
+    if ([NSThread isMainThread]) {
+        // Never run pandoc --version on the main thread; the probe started
+        // by -initWithPandocPath: fills this in, and until then the
+        // conversion just goes uncached.
+        return nil;
+    }
+    return [self probePandocVersion];
+}
+
+- (NSString *)probePandocVersion
+{
+    NSMutableDictionary *versions = OMDPandocVersions();
+    NSString *identity = [NSString stringWithFormat:@"%@|%@",
+                          _pandocPath,
+                          _pandocDataDirectory != nil ? _pandocDataDirectory : @""];
+    OM_PERF_TRACE_SCOPE("convert", "pandoc-version");
+    // "pandoc 3.1.3" plus the data directory, whose templates and reference
+    // documents shape the output as much as the binary does.
+    NSString *logText = nil;
+    NSString *version = nil;
+    if ([self runPandocWithArguments:[NSArray arrayWithObject:@"--version"]
+                                task:nil
+                             logText:&logText
+                    terminationStatus:NULL
+                          launchError:NULL] && [logText length] > 0) {
+        NSString *firstLine = [[logText componentsSeparatedByString:@"\n"] objectAtIndex:0];
+        version = [NSString stringWithFormat:@"%@|%@", [self trimmedLogText:firstLine], identity];
+    }
+    if (version == nil) {
+        // Unknown versions are not cached; a conversion that cannot be
+        // attributed to a backend build must not be reused after upgrades.
+        return nil;
+    }
+    @synchronized (versions) {
+        [versions setObject:version forKey:identity];
+    }
+    return version;
+}
+
 - (BOOL)importFileAtPath:(NSString *)path
                 markdown:(NSString **)markdown
+                    task:(OMDConversionTask *)conversionTask
                    error:(NSError **)error
 {
+    OM_PERF_TRACE_SCOPE("convert", "pandoc-import");
     NSString *extension = [[path pathExtension] lowercaseString];
     NSString *sourceFormat = [self pandocFormatForExtension:extension];
     if (sourceFormat == nil) {
@@ -323,6 +497,28 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
         return NO;
     }
 
+    OMDConversionCache *cache = [OMDConversionCache sharedCache];
+    NSString *version = [self pandocVersion];
+    NSString *cacheKey = nil;
+    if (version != nil && [cache directory] != nil) {
+        NSData *sourceData = [[[NSData alloc] initWithContentsOfMappedFile:path] autorelease];
+        cacheKey = [OMDConversionCache keyForSourceData:sourceData
+                                         backendVersion:version
+                                           targetFormat:[sourceFormat stringByAppendingString:@">commonmark"]];
+        NSData *cached = [cache dataForKey:cacheKey];
+        NSString *cachedMarkdown = (cached != nil
+                                    ? [[[NSString alloc] initWithData:cached
+                                                             encoding:NSUTF8StringEncoding] autorelease]
+                                    : nil);
+        if (cachedMarkdown != nil) {
+            OMPerfTraceCounter("convert", "conversion-cache-hit", 1);
+            if (markdown != NULL) {
+                *markdown = cachedMarkdown;
+            }
+            return YES;
+        }
+    }
+
     NSString *outputMarkdownPath = [self temporaryPathWithPrefix:@"objcmarkdown-import"
                                                        extension:@"md"];
     NSArray *arguments = [NSArray arrayWithObjects:
@@ -337,6 +533,7 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
     int status = 0;
     NSError *launchError = nil;
     BOOL success = [self runPandocWithArguments:arguments
+                                           task:conversionTask
                                         logText:&logText
                                terminationStatus:&status
                                      launchError:&launchError];
@@ -373,6 +570,9 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
         return NO;
     }
 
+    if (cacheKey != nil) {
+        [cache storeData:[importedMarkdown dataUsingEncoding:NSUTF8StringEncoding] forKey:cacheKey];
+    }
     if (markdown != NULL) {
         *markdown = importedMarkdown;
     }
@@ -381,8 +581,10 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
 
 - (BOOL)exportMarkdown:(NSString *)markdown
                 toPath:(NSString *)path
+                  task:(OMDConversionTask *)conversionTask
                  error:(NSError **)error
 {
+    OM_PERF_TRACE_SCOPE("convert", "pandoc-export");
     NSString *extension = [[path pathExtension] lowercaseString];
     NSString *targetFormat = [self pandocFormatForExtension:extension];
     if (targetFormat == nil) {
@@ -394,6 +596,26 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
         return NO;
     }
 
+    OMDConversionCache *cache = [OMDConversionCache sharedCache];
+    NSString *version = [self pandocVersion];
+    NSString *cacheKey = nil;
+    if (version != nil && [cache directory] != nil) {
+        NSData *sourceData = [(markdown != nil ? markdown : @"") dataUsingEncoding:NSUTF8StringEncoding];
+        // pandoc inherits this process's working directory.
+        NSString *resources = OMDPandocLocalResourceFingerprint(markdown,
+                                                                [[NSFileManager defaultManager] currentDirectoryPath]);
+        cacheKey = [OMDConversionCache keyForSourceData:sourceData
+                                         backendVersion:version
+                                           targetFormat:[NSString stringWithFormat:@"gfm>%@|%@",
+                                                                                   targetFormat,
+                                                                                   resources]];
+        NSData *cached = [cache dataForKey:cacheKey];
+        if (cached != nil && [cached writeToFile:path atomically:YES]) {
+            OMPerfTraceCounter("convert", "conversion-cache-hit", 1);
+            return YES;
+        }
+    }
+
     NSString *inputMarkdownPath = [self temporaryPathWithPrefix:@"objcmarkdown-export"
                                                       extension:@"md"];
     NSError *writeError = nil;
@@ -422,6 +644,7 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
     int status = 0;
     NSError *launchError = nil;
     BOOL success = [self runPandocWithArguments:arguments
+                                           task:conversionTask
                                         logText:&logText
                                terminationStatus:&status
                                      launchError:&launchError];
@@ -443,6 +666,9 @@ static NSString *OMDResolvePandocDataDirectory(NSString *pandocPath)
         return NO;
     }
 
+    if (cacheKey != nil) {
+        [cache storeData:[NSData dataWithContentsOfFile:path] forKey:cacheKey];
+    }
     return YES;
 }
 
@@ -18,3 +18,22 @@ NSUInteger OMDMapTargetLocationWithBlockAnchors(NSString *sourceText,
                                                 NSString *targetText,
                                                 NSUInteger targetLocation,
                                                 NSArray *blockAnchors);
+
+// Same mappings for a target text whose contents change in place, such as
+// the string of the preview's text storage. targetRevision must change
+// whenever the target's contents do; the target's cached line table is then
+// reused without comparing characters. 0 means unknown.
+NSUInteger OMDMapSourceLocationWithBlockAnchorsAtRevision(NSString *sourceText,
+                                                          NSUInteger sourceLocation,
+                                                          NSString *targetText,
+                                                          NSUInteger targetRevision,
+                                                          NSArray *blockAnchors);
+NSUInteger OMDMapTargetLocationWithBlockAnchorsAtRevision(NSString *sourceText,
+                                                          NSString *targetText,
+                                                          NSUInteger targetRevision,
+                                                          NSUInteger targetLocation,
+                                                          NSArray *blockAnchors);
+
+// The cache does not retain a target passed with a revision; call this
+// before such a target is released, for example when its window closes.
+void OMDForgetRevisedText(NSString *targetText);
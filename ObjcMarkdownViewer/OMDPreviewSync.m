@@ -2,10 +2,14 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #import "OMDPreviewSync.h"
+#import "OMDTextDiff.h"
+#import "OMMarkdownRenderer.h"
 
 #include <cmark.h>
 #include <float.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 typedef NS_ENUM(NSUInteger, OMDAnchorLineFamily) {
     OMDAnchorLineFamilyBlank = 0,
@@ -15,27 +19,96 @@ typedef NS_ENUM(NSUInteger, OMDAnchorLineFamily) {
     OMDAnchorLineFamilyRule = 4
 };
 
-static NSString * const OMDLineStartKey = @"start";
-static NSString * const OMDLineLengthKey = @"length";
-static NSString * const OMDLineTokensKey = @"tokens";
-static NSString * const OMDLineNormalizedKey = @"normalized";
-static NSString * const OMDLineFamilyKey = @"family";
 static NSString * const OMDAnchorSourceStartLineKey = @"sourceStartLine";
 static NSString * const OMDAnchorSourceEndLineKey = @"sourceEndLine";
 static NSString * const OMDAnchorTargetStartKey = @"targetStart";
 static NSString * const OMDAnchorTargetLengthKey = @"targetLength";
 static NSString * const OMDAnchorBlockIDKey = @"blockID";
 enum {
-    OMDLineInfoCacheSlotCount = 4
+    OMDLineInfoCacheSlotCount = 4,
+    OMDLineInfoMaxTokens = 8,
+    OMDContextMaxTokens = 14,
+    OMDInternedStringLimit = 1 << 18
 };
 
-static NSString *OMDCachedSourceDescriptorText = nil;
-static NSArray *OMDCachedSourceDescriptors = nil;
-static NSString *OMDCachedLineInfoTexts[OMDLineInfoCacheSlotCount];
-static NSArray *OMDCachedLineInfos[OMDLineInfoCacheSlotCount];
-static BOOL OMDCachedLineInfoMarkdownFlags[OMDLineInfoCacheSlotCount];
-static NSUInteger OMDCachedLineInfoAges[OMDLineInfoCacheSlotCount];
+// One line of a sync text. tokens and normalizedID are interned string IDs
+// (0 for none) and are only filled once the owning table is analyzed.
+typedef struct {
+    NSUInteger start;
+    NSUInteger length;
+    uint32_t tokens[OMDLineInfoMaxTokens];
+    uint32_t normalizedID;
+    uint8_t tokenCount;
+    uint8_t family;
+    BOOL startsInsideFence;
+} OMDLineInfo;
+
+typedef struct {
+    NSString *text;
+    NSString *textOwner; // Not retained; cleared by OMDForgetRevisedText().
+    NSUInteger textRevision;
+    NSString *lowercaseText;
+    BOOL markdownSource;
+    BOOL analyzed;
+    NSUInteger age;
+    OMDLineInfo *lines;
+    NSUInteger lineCount;
+    NSUInteger lineCapacity;
+} OMDLineInfoTable;
+
+// Entries sorted by interval start, with the running maximum of the
+// (inclusive) interval ends, so containment queries binary-search the last
+// possible start and walk back only while an earlier interval can reach.
+typedef struct {
+    NSUInteger *order;
+    NSInteger *starts;
+    NSInteger *maxEnds;
+    NSUInteger count;
+} OMDIntervalIndex;
+
+typedef struct {
+    NSInteger sourceStartLine;
+    NSInteger sourceEndLine;
+    NSUInteger targetStart;
+    NSUInteger targetLength;
+    NSString *blockID;
+    NSUInteger nextWithBlockID;
+    BOOL valid;
+} OMDAnchorEntry;
+
+// Compiled form of a renderer anchor array; block IDs are borrowed from the
+// retained anchor dictionaries.
+typedef struct {
+    NSArray *anchors;
+    NSUInteger anchorCount;
+    OMDAnchorEntry *entries;
+    NSMutableDictionary *firstEntryByBlockID;
+    OMDIntervalIndex bySourceLine;
+    OMDIntervalIndex byTargetLocation;
+} OMDAnchorTable;
+
+typedef struct {
+    NSInteger startLine;
+    NSInteger endLine;
+    NSString *blockID;
+    NSUInteger nextWithBlockID;
+} OMDSourceBlock;
+
+typedef struct {
+    NSString *markdown;
+    NSMutableArray *blockIDs;
+    OMDSourceBlock *blocks;
+    NSUInteger blockCount;
+    NSMutableDictionary *firstBlockByBlockID;
+    OMDIntervalIndex byLine;
+} OMDSourceBlockTable;
+
+static OMDLineInfoTable OMDCachedLineInfoTables[OMDLineInfoCacheSlotCount];
 static NSUInteger OMDCachedLineInfoAgeCounter = 1;
+static NSMutableDictionary *OMDInternedStringIDs = nil;
+static NSMutableArray *OMDInternedStrings = nil;
+static OMDAnchorTable OMDCachedAnchorTable;
+static OMDSourceBlockTable OMDCachedSourceBlockTable;
 
 static NSString *OMDTrimLeadingWhitespace(NSString *line)
 {
@@ -62,27 +135,66 @@ static NSString *OMDNormalizeAnchorLine(NSString *line)
         return @"";
     }
 
-    NSMutableString *normalized = [NSMutableString stringWithCapacity:[line length]];
+    NSUInteger length = [line length];
+    NSUInteger capacity = length + 8;
+    NSUInteger outputLength = 0;
+    unichar *output = (unichar *)malloc(capacity * sizeof(unichar));
+    unichar buffer[OMDTextChunkLength];
     NSCharacterSet *alphanumeric = [NSCharacterSet alphanumericCharacterSet];
     BOOL previousWasSpace = YES;
-    NSUInteger length = [line length];
 
-    NSUInteger i = 0;
-    for (; i < length; i++) {
-        unichar ch = [line characterAtIndex:i];
-        if ([alphanumeric characterIsMember:ch]) {
-            NSString *s = [[NSString stringWithCharacters:&ch length:1] lowercaseString];
-            [normalized appendString:s];
-            previousWasSpace = NO;
-        } else if (!previousWasSpace) {
-            [normalized appendString:@" "];
-            previousWasSpace = YES;
+    NSUInteger offset = 0;
+    while (offset < length) {
+        NSUInteger chunk = MIN((NSUInteger)OMDTextChunkLength, length - offset);
+        [line getCharacters:buffer range:NSMakeRange(offset, chunk)];
+        NSUInteger i = 0;
+        for (; i < chunk; i++) {
+            unichar ch = buffer[i];
+            BOOL isAlphanumeric = NO;
+            if (ch < 0x80) {
+                isAlphanumeric = (ch >= '0' && ch <= '9') ||
+                                 (ch >= 'a' && ch <= 'z') ||
+                                 (ch >= 'A' && ch <= 'Z');
+            } else {
+                isAlphanumeric = [alphanumeric characterIsMember:ch];
+            }
+
+            if (isAlphanumeric) {
+                if (ch < 0x80) {
+                    if (outputLength + 1 > capacity) {
+                        capacity = capacity * 2;
+                        output = (unichar *)realloc(output, capacity * sizeof(unichar));
+                    }
+                    output[outputLength++] = (ch >= 'A' && ch <= 'Z') ? (unichar)(ch + ('a' - 'A')) : ch;
+                } else {
+                    // Case mapping can change the length outside ASCII.
+                    NSString *lowered = [[NSString stringWithCharacters:&ch length:1] lowercaseString];
+                    NSUInteger loweredLength = [lowered length];
+                    if (outputLength + loweredLength > capacity) {
+                        capacity = (capacity + loweredLength) * 2;
+                        output = (unichar *)realloc(output, capacity * sizeof(unichar));
+                    }
+                    [lowered getCharacters:output + outputLength range:NSMakeRange(0, loweredLength)];
+                    outputLength += loweredLength;
+                }
+                previousWasSpace = NO;
+            } else if (!previousWasSpace) {
+                if (outputLength + 1 > capacity) {
+                    capacity = capacity * 2;
+                    output = (unichar *)realloc(output, capacity * sizeof(unichar));
+                }
+                output[outputLength++] = ' ';
+                previousWasSpace = YES;
+            }
         }
+        offset += chunk;
     }
 
-    while ([normalized hasSuffix:@" "]) {
-        [normalized deleteCharactersInRange:NSMakeRange([normalized length] - 1, 1)];
+    while (outputLength > 0 && output[outputLength - 1] == ' ') {
+        outputLength -= 1;
     }
+    NSString *normalized = [NSString stringWithCharacters:output length:outputLength];
+    free(output);
     return normalized;
 }
 
@@ -321,162 +433,370 @@ static OMDAnchorLineFamily OMDRenderedLineFamilyForLine(NSString *line)
     return OMDAnchorLineFamilyText;
 }
 
-static NSUInteger OMDLineInfoCacheSlotForText(NSString *text, BOOL markdownSource)
+static uint32_t OMDInternString(NSString *string)
 {
-    if (text == nil) {
-        return NSNotFound;
+    if (string == nil || [string length] == 0) {
+        return 0;
+    }
+    if (OMDInternedStringIDs == nil) {
+        OMDInternedStringIDs = [[NSMutableDictionary alloc] init];
+        OMDInternedStrings = [[NSMutableArray alloc] init];
+    }
+
+    NSNumber *existing = [OMDInternedStringIDs objectForKey:string];
+    if (existing != nil) {
+        return (uint32_t)[existing unsignedIntValue];
     }
+    [OMDInternedStrings addObject:string];
+    uint32_t stringID = (uint32_t)[OMDInternedStrings count];
+    [OMDInternedStringIDs setObject:[NSNumber numberWithUnsignedInt:stringID] forKey:string];
+    return stringID;
+}
 
+static NSString *OMDInternedString(uint32_t stringID)
+{
+    if (stringID == 0 || stringID > [OMDInternedStrings count]) {
+        return @"";
+    }
+    return [OMDInternedStrings objectAtIndex:stringID - 1];
+}
+
+// Interned strings are never dropped individually; once the table grows past
+// the limit it starts over and cached line tables are analyzed again.
+static void OMDTrimInternedStringsIfNeeded(void)
+{
+    if ([OMDInternedStrings count] < OMDInternedStringLimit) {
+        return;
+    }
+    [OMDInternedStringIDs removeAllObjects];
+    [OMDInternedStrings removeAllObjects];
     NSUInteger slot = 0;
     for (; slot < OMDLineInfoCacheSlotCount; slot++) {
-        NSString *cachedText = OMDCachedLineInfoTexts[slot];
-        if (cachedText == nil) {
-            continue;
-        }
-        if (OMDCachedLineInfoMarkdownFlags[slot] != markdownSource) {
+        OMDCachedLineInfoTables[slot].analyzed = NO;
+    }
+}
+
+// Whether a table built from cachedText still describes text. An immutable
+// text is usually the very object that was cached; a text storage's string
+// is one object whose contents change, so its owner's revision is recorded
+// alongside and a matching nonzero revision is trusted without looking at
+// the characters. Anything else is compared, stopping at the first
+// difference.
+static BOOL OMDCachedTextIsCurrent(NSString *cachedText,
+                                   NSString *cachedOwner,
+                                   NSUInteger cachedRevision,
+                                   NSString *text,
+                                   NSUInteger revision)
+{
+    if (cachedText == nil || text == nil) {
+        return NO;
+    }
+    if (cachedText == text) {
+        return YES;
+    }
+    if (revision != 0 && cachedOwner == text) {
+        return cachedRevision == revision;
+    }
+    return [cachedText length] == [text length] && [cachedText isEqualToString:text];
+}
+
+static void OMDEnsureLineInfoCapacity(OMDLineInfo **lines, NSUInteger *capacity, NSUInteger needed)
+{
+    if (needed <= *capacity) {
+        return;
+    }
+    NSUInteger newCapacity = *capacity > 0 ? *capacity : 64;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    *lines = (OMDLineInfo *)realloc(*lines, newCapacity * sizeof(OMDLineInfo));
+    *capacity = newCapacity;
+}
+
+// Reads the line starting at cursor into line (content without its
+// terminator) and returns where the next line starts.
+static NSUInteger OMDScanLine(NSString *text, NSUInteger cursor, OMDLineInfo *line)
+{
+    NSRange lineRange = [text lineRangeForRange:NSMakeRange(cursor, 0)];
+    NSUInteger lineStart = lineRange.location;
+    NSUInteger contentLength = lineRange.length;
+
+    while (contentLength > 0) {
+        unichar ch = [text characterAtIndex:lineStart + contentLength - 1];
+        if (ch == '\n' || ch == '\r') {
+            contentLength -= 1;
             continue;
         }
-        if (cachedText == text || [cachedText isEqualToString:text]) {
-            OMDCachedLineInfoAges[slot] = OMDCachedLineInfoAgeCounter++;
-            return slot;
-        }
+        break;
     }
 
-    return NSNotFound;
+    memset(line, 0, sizeof(OMDLineInfo));
+    line->start = lineStart;
+    line->length = contentLength;
+    line->family = OMDAnchorLineFamilyBlank;
+    return NSMaxRange(lineRange);
 }
 
-static NSUInteger OMDLineInfoCacheReplacementSlot(void)
+static void OMDAnalyzeLine(OMDLineInfo *line, NSString *text, BOOL markdownSource, BOOL *insideFence)
 {
-    NSUInteger slot = 0;
-    NSUInteger replacement = 0;
-    NSUInteger bestAge = NSUIntegerMax;
+    line->startsInsideFence = *insideFence;
+    NSString *content = [text substringWithRange:NSMakeRange(line->start, line->length)];
+    OMDAnchorLineFamily family = OMDAnchorLineFamilyText;
+    NSString *anchorText = nil;
+    if (markdownSource) {
+        anchorText = OMDStripMarkdownDecorations(content, &family, insideFence);
+    } else {
+        family = OMDRenderedLineFamilyForLine(content);
+        anchorText = content;
+    }
 
-    for (; slot < OMDLineInfoCacheSlotCount; slot++) {
-        if (OMDCachedLineInfoTexts[slot] == nil || OMDCachedLineInfos[slot] == nil) {
-            return slot;
-        }
-        if (OMDCachedLineInfoAges[slot] < bestAge) {
-            bestAge = OMDCachedLineInfoAges[slot];
-            replacement = slot;
+    NSString *normalized = OMDNormalizeAnchorLine(anchorText);
+    NSArray *tokens = OMDAnchorTokensForNormalizedLine(normalized);
+    line->family = (uint8_t)family;
+    line->normalizedID = OMDInternString(normalized);
+    line->tokenCount = 0;
+    for (NSString *token in tokens) {
+        if (line->tokenCount >= OMDLineInfoMaxTokens) {
+            break;
         }
+        line->tokens[line->tokenCount] = OMDInternString(token);
+        line->tokenCount += 1;
     }
+}
 
-    return replacement;
+static void OMDLineInfoTableAnalyze(OMDLineInfoTable *table)
+{
+    if (table->analyzed) {
+        return;
+    }
+    BOOL insideFence = NO;
+    NSUInteger i = 0;
+    for (; i < table->lineCount; i++) {
+        OMDAnalyzeLine(&table->lines[i], table->text, table->markdownSource, &insideFence);
+    }
+    table->analyzed = YES;
 }
 
-static NSArray *OMDCreateLineInfosForText(NSString *text, BOOL markdownSource)
+static void OMDLineInfoTableSetText(OMDLineInfoTable *table, NSString *text)
 {
-    NSMutableArray *infos = [NSMutableArray array];
-    NSUInteger totalLength = [text length];
+    NSString *copied = [text copy];
+    [table->text release];
+    table->text = copied;
+    [table->lowercaseText release];
+    table->lowercaseText = nil;
+}
+
+static void OMDLineInfoTableRebuild(OMDLineInfoTable *table, NSString *text, BOOL markdownSource)
+{
+    OMDLineInfoTableSetText(table, text);
+    table->markdownSource = markdownSource;
+    table->analyzed = NO;
+    table->lineCount = 0;
+
+    NSUInteger totalLength = [table->text length];
     if (totalLength == 0) {
-        NSDictionary *empty = [NSDictionary dictionaryWithObjectsAndKeys:
-                               [NSNumber numberWithUnsignedInteger:0], OMDLineStartKey,
-                               [NSNumber numberWithUnsignedInteger:0], OMDLineLengthKey,
-                               [NSArray array], OMDLineTokensKey,
-                               @"", OMDLineNormalizedKey,
-                               [NSNumber numberWithUnsignedInteger:OMDAnchorLineFamilyBlank], OMDLineFamilyKey,
-                               nil];
-        [infos addObject:empty];
-        return infos;
-    }
-
-    NSUInteger cursor = 0;
-    BOOL insideFence = NO;
-    while (cursor < totalLength) {
-        NSRange lineRange = [text lineRangeForRange:NSMakeRange(cursor, 0)];
-        NSUInteger lineStart = lineRange.location;
-        NSUInteger contentLength = lineRange.length;
-
-        while (contentLength > 0) {
-            unichar ch = [text characterAtIndex:lineStart + contentLength - 1];
-            if (ch == '\n' || ch == '\r') {
-                contentLength -= 1;
-                continue;
-            }
-            break;
-        }
-
-        NSString *line = [text substringWithRange:NSMakeRange(lineStart, contentLength)];
-        OMDAnchorLineFamily family = OMDAnchorLineFamilyText;
-        NSString *anchorText = nil;
-        if (markdownSource) {
-            anchorText = OMDStripMarkdownDecorations(line, &family, &insideFence);
-        } else {
-            family = OMDRenderedLineFamilyForLine(line);
-            anchorText = line;
-        }
-
-        NSString *normalized = OMDNormalizeAnchorLine(anchorText);
-        NSArray *tokens = OMDAnchorTokensForNormalizedLine(normalized);
-        NSDictionary *info = [NSDictionary dictionaryWithObjectsAndKeys:
-                              [NSNumber numberWithUnsignedInteger:lineStart], OMDLineStartKey,
-                              [NSNumber numberWithUnsignedInteger:contentLength], OMDLineLengthKey,
-                              tokens, OMDLineTokensKey,
-                              normalized, OMDLineNormalizedKey,
-                              [NSNumber numberWithUnsignedInteger:family], OMDLineFamilyKey,
-                              nil];
-        [infos addObject:info];
-        cursor = NSMaxRange(lineRange);
-    }
+        OMDEnsureLineInfoCapacity(&table->lines, &table->lineCapacity, 1);
+        memset(&table->lines[0], 0, sizeof(OMDLineInfo));
+        table->lines[0].family = OMDAnchorLineFamilyBlank;
+        table->lineCount = 1;
+        return;
+    }
 
-    return infos;
+    NSUInteger cursor = 0;
+    while (cursor < totalLength) {
+        OMDEnsureLineInfoCapacity(&table->lines, &table->lineCapacity, table->lineCount + 1);
+        cursor = OMDScanLine(table->text, cursor, &table->lines[table->lineCount]);
+        table->lineCount += 1;
+    }
 }
 
-static NSArray *OMDLineInfosForText(NSString *text, BOOL markdownSource)
+// Largest line index whose start is at or before location.
+static NSUInteger OMDLineIndexStartingAtOrBefore(const OMDLineInfoTable *table, NSUInteger location)
 {
-    NSUInteger slot = OMDLineInfoCacheSlotForText(text, markdownSource);
-    if (slot != NSNotFound) {
-        return OMDCachedLineInfos[slot] != nil ? OMDCachedLineInfos[slot] : [NSArray array];
+    NSUInteger low = 0;
+    NSUInteger high = table->lineCount;
+    while (low < high) {
+        NSUInteger mid = low + ((high - low) / 2);
+        if (table->lines[mid].start <= location) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    return low > 0 ? low - 1 : 0;
+}
 
-    NSArray *infos = OMDCreateLineInfosForText(text, markdownSource);
+// Brings table from its cached text to text by rescanning only the lines
+// around the edit. Lines after it are reused, shifted, from the first old
+// line start past the edit where the fence state agrees again.
+static void OMDLineInfoTableUpdate(OMDLineInfoTable *table,
+                                   NSString *text,
+                                   NSUInteger prefix,
+                                   NSUInteger suffix)
+{
+    NSUInteger oldLength = [table->text length];
+    NSUInteger newLength = [text length];
+    NSUInteger oldChangeEnd = oldLength - suffix;
+    NSUInteger newChangeEnd = newLength - suffix;
+    NSInteger delta = (NSInteger)newLength - (NSInteger)oldLength;
+
+    // Start from the line holding the character before the edit: a CR there
+    // can pair with an inserted LF.
+    NSUInteger firstLine = OMDLineIndexStartingAtOrBefore(table, prefix > 0 ? prefix - 1 : 0);
+    NSUInteger cursor = table->lines[firstLine].start;
+    BOOL trackFence = table->analyzed && table->markdownSource;
+    BOOL insideFence = table->analyzed ? table->lines[firstLine].startsInsideFence : NO;
+    NSUInteger reuseLine = firstLine + 1;
+
+    OMDLineInfo *scanned = NULL;
+    NSUInteger scannedCount = 0;
+    NSUInteger scannedCapacity = 0;
+    BOOL matched = NO;
+    while (cursor < newLength) {
+        if (cursor >= newChangeEnd) {
+            while (reuseLine < table->lineCount &&
+                   (NSInteger)table->lines[reuseLine].start + delta < (NSInteger)cursor) {
+                reuseLine += 1;
+            }
+            if (reuseLine < table->lineCount &&
+                table->lines[reuseLine].start >= oldChangeEnd &&
+                (NSInteger)table->lines[reuseLine].start + delta == (NSInteger)cursor &&
+                (!trackFence || table->lines[reuseLine].startsInsideFence == insideFence)) {
+                matched = YES;
+                break;
+            }
+        }
+
+        OMDEnsureLineInfoCapacity(&scanned, &scannedCapacity, scannedCount + 1);
+        OMDLineInfo *line = &scanned[scannedCount];
+        cursor = OMDScanLine(text, cursor, line);
+        if (table->analyzed) {
+            OMDAnalyzeLine(line, text, table->markdownSource, &insideFence);
+        }
+        scannedCount += 1;
+    }
+    if (!matched) {
+        reuseLine = table->lineCount;
+    }
+
+    NSUInteger tailCount = table->lineCount - reuseLine;
+    NSUInteger newCount = firstLine + scannedCount + tailCount;
+    OMDEnsureLineInfoCapacity(&table->lines, &table->lineCapacity, newCount);
+    memmove(table->lines + firstLine + scannedCount,
+            table->lines + reuseLine,
+            tailCount * sizeof(OMDLineInfo));
+    if (scannedCount > 0) {
+        memcpy(table->lines + firstLine, scanned, scannedCount * sizeof(OMDLineInfo));
+    }
+    free(scanned);
+    if (delta != 0) {
+        NSUInteger i = firstLine + scannedCount;
+        for (; i < newCount; i++) {
+            table->lines[i].start = (NSUInteger)((NSInteger)table->lines[i].start + delta);
+        }
+    }
+    table->lineCount = newCount;
+    OMDLineInfoTableSetText(table, text);
+}
+
+// Line table for text, from the cache when possible. revision is the text
+// owner's revision, or 0 when unknown (see OMDCachedTextIsCurrent). On a
+// miss the cached revision sharing the most text with it is updated in
+// place. The result stays valid until the next lookup with the same
+// markdownSource flag.
+static OMDLineInfoTable *OMDLineInfoTableForText(NSString *text,
+                                                 NSUInteger revision,
+                                                 BOOL markdownSource,
+                                                 BOOL needsAnalysis)
+{
     if (text == nil) {
-        return infos;
+        text = @"";
     }
 
-    slot = OMDLineInfoCacheReplacementSlot();
-    [OMDCachedLineInfoTexts[slot] release];
-    OMDCachedLineInfoTexts[slot] = [text copy];
-    [OMDCachedLineInfos[slot] release];
-    OMDCachedLineInfos[slot] = [infos copy];
-    OMDCachedLineInfoMarkdownFlags[slot] = markdownSource;
-    OMDCachedLineInfoAges[slot] = OMDCachedLineInfoAgeCounter++;
-    return OMDCachedLineInfos[slot] != nil ? OMDCachedLineInfos[slot] : infos;
+    OMDLineInfoTable *table = NULL;
+    NSUInteger length = [text length];
+    NSUInteger slot = 0;
+    for (; slot < OMDLineInfoCacheSlotCount && table == NULL; slot++) {
+        OMDLineInfoTable *candidate = &OMDCachedLineInfoTables[slot];
+        if (candidate->markdownSource == markdownSource &&
+            (candidate->text == text ||
+             (revision != 0 && candidate->textOwner == text && candidate->textRevision == revision))) {
+            table = candidate;
+        }
+    }
+    for (slot = 0; slot < OMDLineInfoCacheSlotCount && table == NULL; slot++) {
+        OMDLineInfoTable *candidate = &OMDCachedLineInfoTables[slot];
+        if (candidate->markdownSource == markdownSource &&
+            OMDCachedTextIsCurrent(candidate->text, candidate->textOwner, candidate->textRevision,
+                                   text, revision)) {
+            table = candidate;
+        }
+    }
+
+    if (table == NULL) {
+        OMDLineInfoTable *base = NULL;
+        NSUInteger basePrefix = 0;
+        NSUInteger baseSuffix = 0;
+        for (slot = 0; slot < OMDLineInfoCacheSlotCount; slot++) {
+            OMDLineInfoTable *candidate = &OMDCachedLineInfoTables[slot];
+            if (candidate->text == nil || candidate->markdownSource != markdownSource ||
+                [candidate->text length] == 0 || length == 0) {
+                continue;
+            }
+            NSUInteger prefix = OMDCommonPrefixLength(candidate->text, text);
+            NSUInteger limit = MIN([candidate->text length], length) - prefix;
+            NSUInteger suffix = OMDCommonSuffixLength(candidate->text, text, limit);
+            if (base == NULL || prefix + suffix > basePrefix + baseSuffix) {
+                base = candidate;
+                basePrefix = prefix;
+                baseSuffix = suffix;
+            }
+        }
+
+        if (base != NULL && (basePrefix + baseSuffix) * 2 >= length) {
+            table = base;
+            OMDLineInfoTableUpdate(table, text, basePrefix, baseSuffix);
+        } else {
+            NSUInteger replacement = 0;
+            NSUInteger bestAge = NSUIntegerMax;
+            for (slot = 0; slot < OMDLineInfoCacheSlotCount; slot++) {
+                if (OMDCachedLineInfoTables[slot].text == nil) {
+                    replacement = slot;
+                    break;
+                }
+                if (OMDCachedLineInfoTables[slot].age < bestAge) {
+                    bestAge = OMDCachedLineInfoTables[slot].age;
+                    replacement = slot;
+                }
+            }
+            table = &OMDCachedLineInfoTables[replacement];
+            OMDLineInfoTableRebuild(table, text, markdownSource);
+        }
+    }
+
+    // A text storage's string would keep the whole storage alive from here,
+    // so the owner is only compared by pointer; the copy in table->text is
+    // what the table describes.
+    table->textOwner = text;
+    table->textRevision = revision;
+    table->age = OMDCachedLineInfoAgeCounter++;
+    if (needsAnalysis) {
+        OMDLineInfoTableAnalyze(table);
+    }
+    return table;
 }
-
-static NSUInteger OMDLineInfoStart(NSDictionary *lineInfo)
-{
-    NSNumber *number = [lineInfo objectForKey:OMDLineStartKey];
-    return number != nil ? [number unsignedIntegerValue] : 0;
-}
-
-static NSUInteger OMDLineInfoLength(NSDictionary *lineInfo)
-{
-    NSNumber *number = [lineInfo objectForKey:OMDLineLengthKey];
-    return number != nil ? [number unsignedIntegerValue] : 0;
-}
-
-static NSArray *OMDLineInfoTokens(NSDictionary *lineInfo)
-{
-    NSArray *tokens = [lineInfo objectForKey:OMDLineTokensKey];
-    return tokens != nil ? tokens : [NSArray array];
-}
-
-static NSString *OMDLineInfoNormalized(NSDictionary *lineInfo)
-{
-    NSString *normalized = [lineInfo objectForKey:OMDLineNormalizedKey];
-    return normalized != nil ? normalized : @"";
-}
-
-static OMDAnchorLineFamily OMDLineInfoFamily(NSDictionary *lineInfo)
-{
-    NSNumber *number = [lineInfo objectForKey:OMDLineFamilyKey];
-    return number != nil ? (OMDAnchorLineFamily)[number unsignedIntegerValue] : OMDAnchorLineFamilyText;
-}
-
-static NSUInteger OMDLineIndexForLocation(NSArray *lineInfos, NSUInteger location)
+
+static NSString *OMDLineInfoTableLowercaseText(OMDLineInfoTable *table)
+{
+    if (table->lowercaseText == nil) {
+        table->lowercaseText = [[table->text lowercaseString] copy];
+    }
+    return table->lowercaseText;
+}
+
+static NSUInteger OMDLineIndexForLocation(const OMDLineInfoTable *table, NSUInteger location)
 {
-    NSUInteger count = [lineInfos count];
+    NSUInteger count = table->lineCount;
     if (count == 0) {
         return NSNotFound;
     }
@@ -485,10 +805,8 @@ static NSUInteger OMDLineIndexForLocation(NSArray *lineInfos, NSUInteger locatio
     NSUInteger high = count;
     while (low < high) {
         NSUInteger mid = low + ((high - low) / 2);
-        NSDictionary *lineInfo = [lineInfos objectAtIndex:mid];
-        NSUInteger start = OMDLineInfoStart(lineInfo);
-        NSUInteger length = OMDLineInfoLength(lineInfo);
-        NSUInteger end = start + length;
+        NSUInteger start = table->lines[mid].start;
+        NSUInteger end = start + table->lines[mid].length;
         if (location < start) {
             high = mid;
         } else if (location > end) {
@@ -516,72 +834,87 @@ static BOOL OMDLineFamiliesCompatible(OMDAnchorLineFamily left, OMDAnchorLineFam
     return NO;
 }
 
-static void OMDAppendUniqueTokens(NSMutableArray *destination, NSArray *source, NSUInteger maxCount)
+static void OMDAppendUniqueTokens(uint32_t *destination,
+                                  NSUInteger *destinationCount,
+                                  const uint32_t *source,
+                                  NSUInteger sourceCount,
+                                  NSUInteger maxCount)
 {
-    if (destination == nil || source == nil || maxCount == 0) {
-        return;
-    }
-
-    NSMutableSet *seen = [NSMutableSet setWithArray:destination];
-    for (NSString *token in source) {
-        if ([token length] == 0 || [seen containsObject:token]) {
+    NSUInteger i = 0;
+    for (; i < sourceCount && *destinationCount < maxCount; i++) {
+        uint32_t token = source[i];
+        if (token == 0) {
             continue;
         }
-        [destination addObject:token];
-        [seen addObject:token];
-        if ([destination count] >= maxCount) {
-            break;
+        BOOL seen = NO;
+        NSUInteger j = 0;
+        for (; j < *destinationCount; j++) {
+            if (destination[j] == token) {
+                seen = YES;
+                break;
+            }
+        }
+        if (!seen) {
+            destination[*destinationCount] = token;
+            *destinationCount += 1;
         }
     }
 }
 
-static NSArray *OMDContextTokensForSourceLine(NSArray *sourceInfos,
-                                              NSUInteger sourceIndex,
-                                              OMDAnchorLineFamily sourceFamily)
+static NSUInteger OMDContextTokensForSourceLine(const OMDLineInfoTable *sourceTable,
+                                                NSUInteger sourceIndex,
+                                                OMDAnchorLineFamily sourceFamily,
+                                                uint32_t *tokens)
 {
-    if ([sourceInfos count] == 0 || sourceIndex >= [sourceInfos count]) {
-        return [NSArray array];
+    NSUInteger count = 0;
+    if (sourceIndex >= sourceTable->lineCount) {
+        return 0;
     }
 
-    NSMutableArray *tokens = [NSMutableArray array];
-    NSDictionary *center = [sourceInfos objectAtIndex:sourceIndex];
-    OMDAppendUniqueTokens(tokens, OMDLineInfoTokens(center), 14);
+    const OMDLineInfo *center = &sourceTable->lines[sourceIndex];
+    OMDAppendUniqueTokens(tokens, &count, center->tokens, center->tokenCount, OMDContextMaxTokens);
 
     NSInteger radius = 1;
-    while ([tokens count] < 14 && radius <= 3) {
+    while (count < OMDContextMaxTokens && radius <= 3) {
         NSInteger left = (NSInteger)sourceIndex - radius;
         NSInteger right = (NSInteger)sourceIndex + radius;
 
         if (left >= 0) {
-            NSDictionary *lineInfo = [sourceInfos objectAtIndex:(NSUInteger)left];
-            if (OMDLineFamiliesCompatible(sourceFamily, OMDLineInfoFamily(lineInfo))) {
-                OMDAppendUniqueTokens(tokens, OMDLineInfoTokens(lineInfo), 14);
+            const OMDLineInfo *line = &sourceTable->lines[left];
+            if (OMDLineFamiliesCompatible(sourceFamily, (OMDAnchorLineFamily)line->family)) {
+                OMDAppendUniqueTokens(tokens, &count, line->tokens, line->tokenCount, OMDContextMaxTokens);
             }
         }
-        if (right < (NSInteger)[sourceInfos count]) {
-            NSDictionary *lineInfo = [sourceInfos objectAtIndex:(NSUInteger)right];
-            if (OMDLineFamiliesCompatible(sourceFamily, OMDLineInfoFamily(lineInfo))) {
-                OMDAppendUniqueTokens(tokens, OMDLineInfoTokens(lineInfo), 14);
+        if (right < (NSInteger)sourceTable->lineCount) {
+            const OMDLineInfo *line = &sourceTable->lines[right];
+            if (OMDLineFamiliesCompatible(sourceFamily, (OMDAnchorLineFamily)line->family)) {
+                OMDAppendUniqueTokens(tokens, &count, line->tokens, line->tokenCount, OMDContextMaxTokens);
             }
         }
         radius += 1;
     }
 
-    return tokens;
+    return count;
 }
 
-static double OMDTokenOverlapScore(NSArray *anchorTokens, NSArray *candidateTokens)
+static double OMDTokenOverlapScore(const uint32_t *anchorTokens,
+                                   NSUInteger anchorCount,
+                                   const uint32_t *candidateTokens,
+                                   NSUInteger candidateCount)
 {
-    NSUInteger anchorCount = [anchorTokens count];
-    NSUInteger candidateCount = [candidateTokens count];
     if (anchorCount == 0 || candidateCount == 0) {
         return 0.0;
     }
 
     NSUInteger matches = 0;
-    for (NSString *token in anchorTokens) {
-        if ([candidateTokens containsObject:token]) {
-            matches += 1;
+    NSUInteger i = 0;
+    for (; i < anchorCount; i++) {
+        NSUInteger j = 0;
+        for (; j < candidateCount; j++) {
+            if (anchorTokens[i] == candidateTokens[j]) {
+                matches += 1;
+                break;
+            }
         }
     }
     if (matches == 0) {
@@ -593,14 +926,16 @@ static double OMDTokenOverlapScore(NSArray *anchorTokens, NSArray *candidateToke
     return (recall * 70.0) + (precision * 30.0);
 }
 
-static double OMDNormalizedLineBonus(NSString *anchorNormalized, NSString *candidateNormalized)
+static double OMDNormalizedLineBonus(uint32_t anchorNormalizedID, uint32_t candidateNormalizedID)
 {
-    if ([anchorNormalized length] == 0 || [candidateNormalized length] == 0) {
+    if (anchorNormalizedID == 0 || candidateNormalizedID == 0) {
         return 0.0;
     }
-    if ([anchorNormalized isEqualToString:candidateNormalized]) {
+    if (anchorNormalizedID == candidateNormalizedID) {
         return 35.0;
     }
+    NSString *anchorNormalized = OMDInternedString(anchorNormalizedID);
+    NSString *candidateNormalized = OMDInternedString(candidateNormalizedID);
     if ([candidateNormalized rangeOfString:anchorNormalized].location != NSNotFound ||
         [anchorNormalized rangeOfString:candidateNormalized].location != NSNotFound) {
         return 16.0;
@@ -608,13 +943,14 @@ static double OMDNormalizedLineBonus(NSString *anchorNormalized, NSString *candi
     return 0.0;
 }
 
-static NSUInteger OMDSelectBestTargetLine(NSArray *targetInfos,
-                                          NSArray *anchorTokens,
-                                          NSString *anchorNormalized,
+static NSUInteger OMDSelectBestTargetLine(const OMDLineInfoTable *targetTable,
+                                          const uint32_t *anchorTokens,
+                                          NSUInteger anchorTokenCount,
+                                          uint32_t anchorNormalizedID,
                                           OMDAnchorLineFamily sourceFamily,
                                           NSUInteger expectedLineIndex)
 {
-    NSUInteger count = [targetInfos count];
+    NSUInteger count = targetTable->lineCount;
     if (count == 0) {
         return NSNotFound;
     }
@@ -624,13 +960,14 @@ static NSUInteger OMDSelectBestTargetLine(NSArray *targetInfos,
 
     NSUInteger i = 0;
     for (; i < count; i++) {
-        NSDictionary *candidate = [targetInfos objectAtIndex:i];
-        NSArray *candidateTokens = OMDLineInfoTokens(candidate);
-        NSString *candidateNormalized = OMDLineInfoNormalized(candidate);
-        OMDAnchorLineFamily candidateFamily = OMDLineInfoFamily(candidate);
+        const OMDLineInfo *candidate = &targetTable->lines[i];
+        OMDAnchorLineFamily candidateFamily = (OMDAnchorLineFamily)candidate->family;
 
-        double score = OMDTokenOverlapScore(anchorTokens, candidateTokens);
-        score += OMDNormalizedLineBonus(anchorNormalized, candidateNormalized);
+        double score = OMDTokenOverlapScore(anchorTokens,
+                                            anchorTokenCount,
+                                            candidate->tokens,
+                                            candidate->tokenCount);
+        score += OMDNormalizedLineBonus(anchorNormalizedID, candidate->normalizedID);
 
         if (sourceFamily == candidateFamily) {
             score += 18.0;
@@ -655,15 +992,15 @@ static NSUInteger OMDSelectBestTargetLine(NSArray *targetInfos,
     return bestIndex;
 }
 
-static NSUInteger OMDLocationUsingLineAndColumnRatio(NSDictionary *sourceInfo,
+static NSUInteger OMDLocationUsingLineAndColumnRatio(const OMDLineInfo *sourceInfo,
                                                      NSUInteger sourceLocation,
-                                                     NSDictionary *targetInfo,
+                                                     const OMDLineInfo *targetInfo,
                                                      NSUInteger targetTextLength)
 {
-    NSUInteger sourceStart = OMDLineInfoStart(sourceInfo);
-    NSUInteger sourceLength = OMDLineInfoLength(sourceInfo);
-    NSUInteger targetStart = OMDLineInfoStart(targetInfo);
-    NSUInteger targetLength = OMDLineInfoLength(targetInfo);
+    NSUInteger sourceStart = sourceInfo->start;
+    NSUInteger sourceLength = sourceInfo->length;
+    NSUInteger targetStart = targetInfo->start;
+    NSUInteger targetLength = targetInfo->length;
 
     double columnRatio = 0.0;
     if (sourceLength > 0) {
@@ -692,24 +1029,27 @@ static NSUInteger OMDLocationUsingLineAndColumnRatio(NSDictionary *sourceInfo,
     return mapped;
 }
 
-static NSUInteger OMDBestMatchLocationInText(NSString *targetText,
-                                             NSArray *tokens,
+static NSUInteger OMDBestMatchLocationInText(OMDLineInfoTable *targetTable,
+                                             const uint32_t *tokens,
+                                             NSUInteger tokenCount,
                                              NSUInteger expectedLocation)
 {
-    if (targetText == nil || [targetText length] == 0 || [tokens count] == 0) {
+    NSUInteger targetLength = [targetTable->text length];
+    if (targetLength == 0 || tokenCount == 0) {
         return expectedLocation;
     }
 
-    NSUInteger targetLength = [targetText length];
     if (expectedLocation >= targetLength) {
         expectedLocation = targetLength - 1;
     }
 
-    NSString *targetLower = [targetText lowercaseString];
+    NSString *targetLower = OMDLineInfoTableLowercaseText(targetTable);
     NSUInteger bestLocation = expectedLocation;
     double bestScore = DBL_MAX;
 
-    for (NSString *token in tokens) {
+    NSUInteger tokenIndex = 0;
+    for (; tokenIndex < tokenCount; tokenIndex++) {
+        NSString *token = OMDInternedString(tokens[tokenIndex]);
         if ([token length] == 0) {
             continue;
         }
@@ -742,129 +1082,11 @@ static NSUInteger OMDBestMatchLocationInText(NSString *targetText,
     return bestLocation;
 }
 
-static BOOL OMDExtractAnchor(NSDictionary *anchor,
-                             NSInteger *sourceStartLineOut,
-                             NSInteger *sourceEndLineOut,
-                             NSUInteger *targetStartOut,
-                             NSUInteger *targetLengthOut)
-{
-    if (anchor == nil) {
-        return NO;
-    }
-
-    NSNumber *sourceStartNumber = [anchor objectForKey:OMDAnchorSourceStartLineKey];
-    NSNumber *sourceEndNumber = [anchor objectForKey:OMDAnchorSourceEndLineKey];
-    NSNumber *targetStartNumber = [anchor objectForKey:OMDAnchorTargetStartKey];
-    NSNumber *targetLengthNumber = [anchor objectForKey:OMDAnchorTargetLengthKey];
-    if (sourceStartNumber == nil || sourceEndNumber == nil || targetStartNumber == nil || targetLengthNumber == nil) {
-        return NO;
-    }
-
-    NSInteger sourceStartLine = [sourceStartNumber integerValue];
-    NSInteger sourceEndLine = [sourceEndNumber integerValue];
-    NSUInteger targetStart = [targetStartNumber unsignedIntegerValue];
-    NSUInteger targetLength = [targetLengthNumber unsignedIntegerValue];
-
-    if (sourceStartLine <= 0) {
-        return NO;
-    }
-    if (sourceEndLine < sourceStartLine) {
-        sourceEndLine = sourceStartLine;
-    }
-
-    if (sourceStartLineOut != NULL) {
-        *sourceStartLineOut = sourceStartLine;
-    }
-    if (sourceEndLineOut != NULL) {
-        *sourceEndLineOut = sourceEndLine;
-    }
-    if (targetStartOut != NULL) {
-        *targetStartOut = targetStart;
-    }
-    if (targetLengthOut != NULL) {
-        *targetLengthOut = targetLength;
-    }
-    return YES;
-}
-
-static NSDictionary *OMDBestAnchorForSourceLine(NSArray *blockAnchors, NSInteger sourceLine)
+static const OMDLineInfo *OMDLineInfoForOneBasedLine(const OMDLineInfoTable *table, NSInteger lineNumber)
 {
-    NSDictionary *bestAnchor = nil;
-    NSInteger bestLineSpan = NSIntegerMax;
-    NSUInteger bestTargetLength = NSUIntegerMax;
-
-    for (NSDictionary *anchor in blockAnchors) {
-        NSInteger sourceStartLine = 0;
-        NSInteger sourceEndLine = 0;
-        NSUInteger targetLength = 0;
-        if (!OMDExtractAnchor(anchor, &sourceStartLine, &sourceEndLine, NULL, &targetLength)) {
-            continue;
-        }
-        if (targetLength == 0) {
-            continue;
-        }
-        if (sourceLine < sourceStartLine || sourceLine > sourceEndLine) {
-            continue;
-        }
-
-        NSInteger lineSpan = sourceEndLine - sourceStartLine + 1;
-        if (lineSpan < 1) {
-            lineSpan = 1;
-        }
-        if (bestAnchor == nil ||
-            lineSpan < bestLineSpan ||
-            (lineSpan == bestLineSpan && targetLength < bestTargetLength)) {
-            bestAnchor = anchor;
-            bestLineSpan = lineSpan;
-            bestTargetLength = targetLength;
-        }
-    }
-    return bestAnchor;
-}
-
-static NSDictionary *OMDBestAnchorForTargetLocation(NSArray *blockAnchors, NSUInteger targetLocation)
-{
-    NSDictionary *bestAnchor = nil;
-    NSUInteger bestTargetLength = NSUIntegerMax;
-    NSInteger bestLineSpan = NSIntegerMax;
-
-    for (NSDictionary *anchor in blockAnchors) {
-        NSInteger sourceStartLine = 0;
-        NSInteger sourceEndLine = 0;
-        NSUInteger targetStart = 0;
-        NSUInteger targetLength = 0;
-        if (!OMDExtractAnchor(anchor, &sourceStartLine, &sourceEndLine, &targetStart, &targetLength)) {
-            continue;
-        }
-        if (targetLength == 0) {
-            continue;
-        }
-
-        NSUInteger targetEnd = targetStart + targetLength;
-        if (targetLocation < targetStart || targetLocation >= targetEnd) {
-            continue;
-        }
-
-        NSInteger lineSpan = sourceEndLine - sourceStartLine + 1;
-        if (lineSpan < 1) {
-            lineSpan = 1;
-        }
-        if (bestAnchor == nil ||
-            targetLength < bestTargetLength ||
-            (targetLength == bestTargetLength && lineSpan < bestLineSpan)) {
-            bestAnchor = anchor;
-            bestTargetLength = targetLength;
-            bestLineSpan = lineSpan;
-        }
-    }
-    return bestAnchor;
-}
-
-static NSDictionary *OMDLineInfoForOneBasedLine(NSArray *lineInfos, NSInteger lineNumber)
-{
-    NSUInteger count = [lineInfos count];
+    NSUInteger count = table->lineCount;
     if (count == 0) {
-        return nil;
+        return NULL;
     }
 
     NSInteger index = lineNumber - 1;
@@ -874,13 +1096,13 @@ static NSDictionary *OMDLineInfoForOneBasedLine(NSArray *lineInfos, NSInteger li
     if (index >= (NSInteger)count) {
         index = (NSInteger)count - 1;
     }
-    return [lineInfos objectAtIndex:(NSUInteger)index];
+    return &table->lines[index];
 }
 
-static double OMDLineColumnRatioForLocation(NSDictionary *lineInfo, NSUInteger location)
+static double OMDLineColumnRatioForLocation(const OMDLineInfo *lineInfo, NSUInteger location)
 {
-    NSUInteger lineStart = OMDLineInfoStart(lineInfo);
-    NSUInteger lineLength = OMDLineInfoLength(lineInfo);
+    NSUInteger lineStart = lineInfo->start;
+    NSUInteger lineLength = lineInfo->length;
     if (lineLength == 0) {
         return 0.0;
     }
@@ -892,18 +1114,18 @@ static double OMDLineColumnRatioForLocation(NSDictionary *lineInfo, NSUInteger l
     return (double)column / (double)lineLength;
 }
 
-static NSUInteger OMDSourceLocationFromLineAndRatio(NSArray *sourceInfos,
+static NSUInteger OMDSourceLocationFromLineAndRatio(const OMDLineInfoTable *sourceTable,
                                                     NSInteger lineNumber,
                                                     double columnRatio,
                                                     NSUInteger sourceLength)
 {
-    NSDictionary *lineInfo = OMDLineInfoForOneBasedLine(sourceInfos, lineNumber);
-    if (lineInfo == nil) {
+    const OMDLineInfo *lineInfo = OMDLineInfoForOneBasedLine(sourceTable, lineNumber);
+    if (lineInfo == NULL) {
         return sourceLength;
     }
 
-    NSUInteger lineStart = OMDLineInfoStart(lineInfo);
-    NSUInteger lineLength = OMDLineInfoLength(lineInfo);
+    NSUInteger lineStart = lineInfo->start;
+    NSUInteger lineLength = lineInfo->length;
     if (columnRatio < 0.0) {
         columnRatio = 0.0;
     } else if (columnRatio > 1.0) {
@@ -925,14 +1147,16 @@ static NSUInteger OMDSourceLocationFromLineAndRatio(NSArray *sourceInfos,
     return mapped;
 }
 
-static BOOL OMDNodeLineBounds(cmark_node *node, NSInteger *startLineOut, NSInteger *endLineOut)
+static BOOL OMDBlockLineBounds(const OMMarkdownBlockDescriptor *block,
+                               NSInteger *startLineOut,
+                               NSInteger *endLineOut)
 {
-    if (node == NULL) {
+    if (block == NULL) {
         return NO;
     }
 
-    int startLine = cmark_node_get_start_line(node);
-    int endLine = cmark_node_get_end_line(node);
+    NSInteger startLine = block->startLine;
+    NSInteger endLine = block->endLine;
     if (startLine <= 0) {
         return NO;
     }
@@ -941,10 +1165,10 @@ static BOOL OMDNodeLineBounds(cmark_node *node, NSInteger *startLineOut, NSInteg
     }
 
     if (startLineOut != NULL) {
-        *startLineOut = (NSInteger)startLine;
+        *startLineOut = startLine;
     }
     if (endLineOut != NULL) {
-        *endLineOut = (NSInteger)endLine;
+        *endLineOut = endLine;
     }
     return YES;
 }
@@ -965,36 +1189,6 @@ static BOOL OMDNodeTypeHasBlockAnchor(cmark_node_type type)
     }
 }
 
-static NSArray *OMDSourceLinesForMarkdown(NSString *sourceText)
-{
-    NSMutableArray *lines = [NSMutableArray array];
-    if (sourceText == nil || [sourceText length] == 0) {
-        return lines;
-    }
-
-    NSUInteger totalLength = [sourceText length];
-    NSUInteger cursor = 0;
-    while (cursor < totalLength) {
-        NSRange lineRange = [sourceText lineRangeForRange:NSMakeRange(cursor, 0)];
-        NSUInteger lineStart = lineRange.location;
-        NSUInteger contentLength = lineRange.length;
-
-        while (contentLength > 0) {
-            unichar ch = [sourceText characterAtIndex:lineStart + contentLength - 1];
-            if (ch == '\n' || ch == '\r') {
-                contentLength -= 1;
-                continue;
-            }
-            break;
-        }
-
-        NSString *line = [sourceText substringWithRange:NSMakeRange(lineStart, contentLength)];
-        [lines addObject:line];
-        cursor = NSMaxRange(lineRange);
-    }
-    return lines;
-}
-
 static NSString *OMDBlockSignatureForLineRange(NSArray *sourceLines,
                                                NSInteger startLine,
                                                NSInteger endLine)
@@ -1026,15 +1220,11 @@ static NSString *OMDBlockSignatureForLineRange(NSArray *sourceLines,
     return OMDNormalizeAnchorLine(joined);
 }
 
-static NSString *OMDStableBlockIDForNode(cmark_node *node, NSArray *sourceLines)
+static NSString *OMDStableBlockIDForBlock(const OMMarkdownBlockDescriptor *block, NSArray *sourceLines)
 {
-    if (node == NULL) {
-        return nil;
-    }
-
     NSInteger startLine = 0;
     NSInteger endLine = 0;
-    if (!OMDNodeLineBounds(node, &startLine, &endLine)) {
+    if (!OMDBlockLineBounds(block, &startLine, &endLine)) {
         return nil;
     }
 
@@ -1042,83 +1232,135 @@ static NSString *OMDStableBlockIDForNode(cmark_node *node, NSArray *sourceLines)
     if (signature == nil || [signature length] == 0) {
         signature = @"_";
     }
-    return [NSString stringWithFormat:@"%d|%@", (int)cmark_node_get_type(node), signature];
+    return [NSString stringWithFormat:@"%d|%@", (int)block->nodeType, signature];
 }
 
-static void OMDCollectSourceBlockDescriptors(cmark_node *node,
-                                             NSArray *sourceLines,
-                                             NSMutableArray *descriptors)
+static BOOL OMDExtractAnchor(NSDictionary *anchor,
+                             NSInteger *sourceStartLineOut,
+                             NSInteger *sourceEndLineOut,
+                             NSUInteger *targetStartOut,
+                             NSUInteger *targetLengthOut)
 {
-    if (node == NULL) {
-        return;
+    if (anchor == nil) {
+        return NO;
     }
 
-    cmark_node_type type = cmark_node_get_type(node);
-    if (OMDNodeTypeHasBlockAnchor(type)) {
-        NSInteger startLine = 0;
-        NSInteger endLine = 0;
-        if (OMDNodeLineBounds(node, &startLine, &endLine)) {
-            NSString *blockID = OMDStableBlockIDForNode(node, sourceLines);
-            NSMutableDictionary *descriptor = [NSMutableDictionary dictionaryWithObjectsAndKeys:
-                                               [NSNumber numberWithInteger:startLine], OMDAnchorSourceStartLineKey,
-                                               [NSNumber numberWithInteger:endLine], OMDAnchorSourceEndLineKey,
-                                               nil];
-            if (blockID != nil && [blockID length] > 0) {
-                [descriptor setObject:blockID forKey:OMDAnchorBlockIDKey];
-            }
-            [descriptors addObject:descriptor];
-        }
+    NSNumber *sourceStartNumber = [anchor objectForKey:OMDAnchorSourceStartLineKey];
+    NSNumber *sourceEndNumber = [anchor objectForKey:OMDAnchorSourceEndLineKey];
+    NSNumber *targetStartNumber = [anchor objectForKey:OMDAnchorTargetStartKey];
+    NSNumber *targetLengthNumber = [anchor objectForKey:OMDAnchorTargetLengthKey];
+    if (sourceStartNumber == nil || sourceEndNumber == nil || targetStartNumber == nil || targetLengthNumber == nil) {
+        return NO;
     }
 
-    cmark_node *child = cmark_node_first_child(node);
-    while (child != NULL) {
-        OMDCollectSourceBlockDescriptors(child, sourceLines, descriptors);
-        child = cmark_node_next(child);
-    }
-}
+    NSInteger sourceStartLine = [sourceStartNumber integerValue];
+    NSInteger sourceEndLine = [sourceEndNumber integerValue];
+    NSUInteger targetStart = [targetStartNumber unsignedIntegerValue];
+    NSUInteger targetLength = [targetLengthNumber unsignedIntegerValue];
 
-static NSArray *OMDSourceBlockDescriptorsForMarkdown(NSString *sourceText)
-{
-    if (sourceText == nil || [sourceText length] == 0) {
-        return [NSArray array];
+    if (sourceStartLine <= 0) {
+        return NO;
+    }
+    if (sourceEndLine < sourceStartLine) {
+        sourceEndLine = sourceStartLine;
     }
 
-    NSData *sourceData = [sourceText dataUsingEncoding:NSUTF8StringEncoding];
-    if (sourceData == nil || [sourceData length] == 0) {
-        return [NSArray array];
+    if (sourceStartLineOut != NULL) {
+        *sourceStartLineOut = sourceStartLine;
+    }
+    if (sourceEndLineOut != NULL) {
+        *sourceEndLineOut = sourceEndLine;
+    }
+    if (targetStartOut != NULL) {
+        *targetStartOut = targetStart;
+    }
+    if (targetLengthOut != NULL) {
+        *targetLengthOut = targetLength;
     }
+    return YES;
+}
 
-    const char *bytes = (const char *)[sourceData bytes];
-    size_t length = (size_t)[sourceData length];
-    cmark_node *document = cmark_parse_document(bytes, length, CMARK_OPT_DEFAULT);
-    if (document == NULL) {
-        return [NSArray array];
+typedef struct {
+    NSInteger key;
+    NSUInteger index;
+} OMDIntervalSortEntry;
+
+static int OMDCompareIntervalSortEntries(const void *left, const void *right)
+{
+    const OMDIntervalSortEntry *a = (const OMDIntervalSortEntry *)left;
+    const OMDIntervalSortEntry *b = (const OMDIntervalSortEntry *)right;
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    if (a->index != b->index) {
+        return a->index < b->index ? -1 : 1;
     }
+    return 0;
+}
 
-    NSArray *sourceLines = OMDSourceLinesForMarkdown(sourceText);
-    NSMutableArray *descriptors = [NSMutableArray array];
-    OMDCollectSourceBlockDescriptors(document, sourceLines, descriptors);
-    cmark_node_free(document);
-    return descriptors;
+static void OMDIntervalIndexFree(OMDIntervalIndex *index)
+{
+    free(index->order);
+    free(index->starts);
+    free(index->maxEnds);
+    memset(index, 0, sizeof(OMDIntervalIndex));
 }
 
-static NSArray *OMDSourceBlockDescriptorsForMarkdownCached(NSString *sourceText)
+// starts and ends (inclusive) are indexed by entry; entries whose include
+// flag is NO are left out. A NULL include takes every entry.
+static void OMDIntervalIndexBuild(OMDIntervalIndex *index,
+                                  const NSInteger *starts,
+                                  const NSInteger *ends,
+                                  const BOOL *include,
+                                  NSUInteger count)
 {
-    if (sourceText == nil || [sourceText length] == 0) {
-        return [NSArray array];
+    OMDIntervalIndexFree(index);
+    NSUInteger allocationCount = count > 0 ? count : 1;
+    OMDIntervalSortEntry *sorted = (OMDIntervalSortEntry *)malloc(allocationCount * sizeof(OMDIntervalSortEntry));
+    NSUInteger sortedCount = 0;
+    NSUInteger i = 0;
+    for (; i < count; i++) {
+        if (include != NULL && !include[i]) {
+            continue;
+        }
+        sorted[sortedCount].key = starts[i];
+        sorted[sortedCount].index = i;
+        sortedCount += 1;
     }
+    qsort(sorted, sortedCount, sizeof(OMDIntervalSortEntry), OMDCompareIntervalSortEntries);
 
-    if ((OMDCachedSourceDescriptorText == sourceText) ||
-        [OMDCachedSourceDescriptorText isEqualToString:sourceText]) {
-        return OMDCachedSourceDescriptors != nil ? OMDCachedSourceDescriptors : [NSArray array];
+    index->order = (NSUInteger *)malloc(allocationCount * sizeof(NSUInteger));
+    index->starts = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    index->maxEnds = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    NSInteger maxEnd = NSIntegerMin;
+    for (i = 0; i < sortedCount; i++) {
+        NSUInteger entry = sorted[i].index;
+        index->order[i] = entry;
+        index->starts[i] = sorted[i].key;
+        if (ends[entry] > maxEnd) {
+            maxEnd = ends[entry];
+        }
+        index->maxEnds[i] = maxEnd;
     }
+    index->count = sortedCount;
+    free(sorted);
+}
 
-    NSArray *descriptors = OMDSourceBlockDescriptorsForMarkdown(sourceText);
-    [OMDCachedSourceDescriptorText release];
-    OMDCachedSourceDescriptorText = [sourceText copy];
-    [OMDCachedSourceDescriptors release];
-    OMDCachedSourceDescriptors = [descriptors copy];
-    return OMDCachedSourceDescriptors != nil ? OMDCachedSourceDescriptors : [NSArray array];
+// Number of entries starting at or before point. Entries containing point
+// are found walking down from there while maxEnds still reaches it.
+static NSUInteger OMDIntervalIndexUpperBound(const OMDIntervalIndex *index, NSInteger point)
+{
+    NSUInteger low = 0;
+    NSUInteger high = index->count;
+    while (low < high) {
+        NSUInteger mid = low + ((high - low) / 2);
+        if (index->starts[mid] <= point) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
 
 static NSString *OMDAnchorBlockID(NSDictionary *anchor)
@@ -1130,118 +1372,194 @@ static NSString *OMDAnchorBlockID(NSDictionary *anchor)
     return nil;
 }
 
-static NSString *OMDSourceDescriptorBlockID(NSDictionary *descriptor)
+static void OMDAnchorTableReset(OMDAnchorTable *table)
 {
-    id value = [descriptor objectForKey:OMDAnchorBlockIDKey];
-    if ([value isKindOfClass:[NSString class]] && [(NSString *)value length] > 0) {
-        return (NSString *)value;
-    }
-    return nil;
+    [table->anchors release];
+    table->anchors = nil;
+    table->anchorCount = 0;
+    free(table->entries);
+    table->entries = NULL;
+    [table->firstEntryByBlockID release];
+    table->firstEntryByBlockID = nil;
+    OMDIntervalIndexFree(&table->bySourceLine);
+    OMDIntervalIndexFree(&table->byTargetLocation);
 }
 
-static BOOL OMDAnchorsContainBlockIDs(NSArray *anchors)
+// Anchor arrays are replaced, not mutated, on each render, so the compiled
+// table is keyed by the array itself.
+static OMDAnchorTable *OMDAnchorTableForAnchors(NSArray *blockAnchors)
 {
-    for (NSDictionary *anchor in anchors) {
-        if (OMDAnchorBlockID(anchor) != nil) {
-            return YES;
+    OMDAnchorTable *table = &OMDCachedAnchorTable;
+    NSUInteger count = [blockAnchors count];
+    if (table->anchors == blockAnchors && table->anchorCount == count) {
+        return table;
+    }
+
+    OMDAnchorTableReset(table);
+    table->anchors = [blockAnchors retain];
+    table->anchorCount = count;
+    NSUInteger allocationCount = count > 0 ? count : 1;
+    table->entries = (OMDAnchorEntry *)calloc(allocationCount, sizeof(OMDAnchorEntry));
+    table->firstEntryByBlockID = [[NSMutableDictionary alloc] init];
+
+    NSInteger *sourceStarts = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    NSInteger *sourceEnds = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    NSInteger *targetStarts = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    NSInteger *targetEnds = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    BOOL *valid = (BOOL *)malloc(allocationCount * sizeof(BOOL));
+    NSMutableDictionary *lastEntryByBlockID = [NSMutableDictionary dictionary];
+
+    NSUInteger index = 0;
+    for (NSDictionary *anchor in blockAnchors) {
+        OMDAnchorEntry *entry = &table->entries[index];
+        entry->nextWithBlockID = NSNotFound;
+        entry->valid = OMDExtractAnchor(anchor,
+                                        &entry->sourceStartLine,
+                                        &entry->sourceEndLine,
+                                        &entry->targetStart,
+                                        &entry->targetLength) && entry->targetLength > 0;
+        entry->blockID = OMDAnchorBlockID(anchor);
+        if (entry->blockID != nil) {
+            NSNumber *entryNumber = [NSNumber numberWithUnsignedInteger:index];
+            NSNumber *lastNumber = [lastEntryByBlockID objectForKey:entry->blockID];
+            if (lastNumber == nil) {
+                [table->firstEntryByBlockID setObject:entryNumber forKey:entry->blockID];
+            } else {
+                table->entries[[lastNumber unsignedIntegerValue]].nextWithBlockID = index;
+            }
+            [lastEntryByBlockID setObject:entryNumber forKey:entry->blockID];
         }
+
+        valid[index] = entry->valid;
+        sourceStarts[index] = entry->sourceStartLine;
+        sourceEnds[index] = entry->sourceEndLine;
+        targetStarts[index] = (NSInteger)entry->targetStart;
+        targetEnds[index] = entry->valid ? (NSInteger)(entry->targetStart + entry->targetLength - 1) : 0;
+        index += 1;
     }
-    return NO;
+
+    OMDIntervalIndexBuild(&table->bySourceLine, sourceStarts, sourceEnds, valid, count);
+    OMDIntervalIndexBuild(&table->byTargetLocation, targetStarts, targetEnds, valid, count);
+    free(sourceStarts);
+    free(sourceEnds);
+    free(targetStarts);
+    free(targetEnds);
+    free(valid);
+    return table;
 }
 
-static NSDictionary *OMDBestSourceDescriptorForLine(NSArray *descriptors, NSInteger sourceLine)
+static BOOL OMDAnchorTableHasBlockIDs(const OMDAnchorTable *table)
 {
-    NSDictionary *best = nil;
-    NSInteger bestSpan = NSIntegerMax;
-    for (NSDictionary *descriptor in descriptors) {
-        NSNumber *startNumber = [descriptor objectForKey:OMDAnchorSourceStartLineKey];
-        NSNumber *endNumber = [descriptor objectForKey:OMDAnchorSourceEndLineKey];
-        if (startNumber == nil || endNumber == nil) {
-            continue;
-        }
+    return [table->firstEntryByBlockID count] > 0;
+}
 
-        NSInteger startLine = [startNumber integerValue];
-        NSInteger endLine = [endNumber integerValue];
-        if (endLine < startLine) {
-            endLine = startLine;
-        }
-        if (sourceLine < startLine || sourceLine > endLine) {
+static NSUInteger OMDFirstAnchorWithBlockID(const OMDAnchorTable *table, NSString *blockID)
+{
+    if (blockID == nil || [blockID length] == 0) {
+        return NSNotFound;
+    }
+    NSNumber *first = [table->firstEntryByBlockID objectForKey:blockID];
+    return first != nil ? [first unsignedIntegerValue] : NSNotFound;
+}
+
+static NSUInteger OMDBestAnchorForSourceLine(const OMDAnchorTable *table, NSInteger sourceLine)
+{
+    const OMDIntervalIndex *index = &table->bySourceLine;
+    NSUInteger best = NSNotFound;
+    NSInteger bestLineSpan = NSIntegerMax;
+    NSUInteger bestTargetLength = NSUIntegerMax;
+
+    NSUInteger position = OMDIntervalIndexUpperBound(index, sourceLine);
+    for (; position > 0 && index->maxEnds[position - 1] >= sourceLine; position--) {
+        NSUInteger entryIndex = index->order[position - 1];
+        const OMDAnchorEntry *entry = &table->entries[entryIndex];
+        if (sourceLine > entry->sourceEndLine) {
             continue;
         }
 
-        NSInteger span = endLine - startLine + 1;
-        if (span < 1) {
-            span = 1;
+        NSInteger lineSpan = entry->sourceEndLine - entry->sourceStartLine + 1;
+        if (lineSpan < 1) {
+            lineSpan = 1;
         }
-        if (best == nil || span < bestSpan) {
-            best = descriptor;
-            bestSpan = span;
+        if (best == NSNotFound ||
+            lineSpan < bestLineSpan ||
+            (lineSpan == bestLineSpan && entry->targetLength < bestTargetLength) ||
+            (lineSpan == bestLineSpan && entry->targetLength == bestTargetLength && entryIndex < best)) {
+            best = entryIndex;
+            bestLineSpan = lineSpan;
+            bestTargetLength = entry->targetLength;
         }
     }
     return best;
 }
 
-static NSDictionary *OMDBestSourceDescriptorForBlockID(NSArray *descriptors,
-                                                        NSString *blockID,
-                                                        NSInteger expectedLine)
+static NSUInteger OMDBestAnchorForTargetLocation(const OMDAnchorTable *table, NSUInteger targetLocation)
 {
-    if (blockID == nil || [blockID length] == 0) {
-        return nil;
-    }
-
-    NSDictionary *best = nil;
-    double bestScore = DBL_MAX;
-    for (NSDictionary *descriptor in descriptors) {
-        NSString *descriptorID = OMDSourceDescriptorBlockID(descriptor);
-        if (descriptorID == nil || ![descriptorID isEqualToString:blockID]) {
-            continue;
-        }
+    const OMDIntervalIndex *index = &table->byTargetLocation;
+    NSInteger point = (NSInteger)targetLocation;
+    NSUInteger best = NSNotFound;
+    NSUInteger bestTargetLength = NSUIntegerMax;
+    NSInteger bestLineSpan = NSIntegerMax;
 
-        NSNumber *startNumber = [descriptor objectForKey:OMDAnchorSourceStartLineKey];
-        NSNumber *endNumber = [descriptor objectForKey:OMDAnchorSourceEndLineKey];
-        if (startNumber == nil || endNumber == nil) {
+    NSUInteger position = OMDIntervalIndexUpperBound(index, point);
+    for (; position > 0 && index->maxEnds[position - 1] >= point; position--) {
+        NSUInteger entryIndex = index->order[position - 1];
+        const OMDAnchorEntry *entry = &table->entries[entryIndex];
+        if (targetLocation >= entry->targetStart + entry->targetLength) {
             continue;
         }
 
-        NSInteger startLine = [startNumber integerValue];
-        NSInteger endLine = [endNumber integerValue];
-        if (endLine < startLine) {
-            endLine = startLine;
+        NSInteger lineSpan = entry->sourceEndLine - entry->sourceStartLine + 1;
+        if (lineSpan < 1) {
+            lineSpan = 1;
         }
-        NSInteger span = endLine - startLine + 1;
-        if (span < 1) {
-            span = 1;
+        if (best == NSNotFound ||
+            entry->targetLength < bestTargetLength ||
+            (entry->targetLength == bestTargetLength && lineSpan < bestLineSpan) ||
+            (entry->targetLength == bestTargetLength && lineSpan == bestLineSpan && entryIndex < best)) {
+            best = entryIndex;
+            bestTargetLength = entry->targetLength;
+            bestLineSpan = lineSpan;
         }
+    }
+    return best;
+}
 
-        double distance = 0.0;
-        if (expectedLine > 0) {
-            NSInteger center = startLine + (span / 2);
-            distance = fabs((double)(center - expectedLine));
+static NSUInteger OMDBestAnchorForBlockID(const OMDAnchorTable *table,
+                                          NSString *blockID,
+                                          NSUInteger expectedTargetLocation)
+{
+    NSUInteger best = NSNotFound;
+    double bestScore = DBL_MAX;
+    NSUInteger entryIndex = OMDFirstAnchorWithBlockID(table, blockID);
+    for (; entryIndex != NSNotFound; entryIndex = table->entries[entryIndex].nextWithBlockID) {
+        const OMDAnchorEntry *entry = &table->entries[entryIndex];
+        if (!entry->valid) {
+            continue;
         }
-        double score = (distance * 1000.0) + (double)span;
+
+        NSUInteger center = entry->targetStart + (entry->targetLength / 2);
+        double distance = fabs((double)((NSInteger)center - (NSInteger)expectedTargetLocation));
+        double score = (distance * 1000.0) + (double)entry->targetLength;
         if (score < bestScore) {
             bestScore = score;
-            best = descriptor;
+            best = entryIndex;
         }
     }
     return best;
 }
 
-static NSInteger OMDSourceDescriptorOrdinalForBlockID(NSArray *descriptors,
-                                                      NSDictionary *targetDescriptor,
-                                                      NSString *blockID)
+// Counts every anchor carrying the block ID, valid or not.
+static NSInteger OMDAnchorOrdinalForBlockID(const OMDAnchorTable *table, NSUInteger targetIndex)
 {
-    if (blockID == nil || [blockID length] == 0 || targetDescriptor == nil) {
+    if (targetIndex == NSNotFound) {
         return NSNotFound;
     }
 
     NSInteger ordinal = 0;
-    for (NSDictionary *descriptor in descriptors) {
-        NSString *descriptorID = OMDSourceDescriptorBlockID(descriptor);
-        if (descriptorID == nil || ![descriptorID isEqualToString:blockID]) {
-            continue;
-        }
-        if (descriptor == targetDescriptor || [descriptor isEqual:targetDescriptor]) {
+    NSUInteger entryIndex = OMDFirstAnchorWithBlockID(table, table->entries[targetIndex].blockID);
+    for (; entryIndex != NSNotFound; entryIndex = table->entries[entryIndex].nextWithBlockID) {
+        if (entryIndex == targetIndex) {
             return ordinal;
         }
         ordinal += 1;
@@ -1249,111 +1567,212 @@ static NSInteger OMDSourceDescriptorOrdinalForBlockID(NSArray *descriptors,
     return NSNotFound;
 }
 
-static NSDictionary *OMDBestAnchorForBlockID(NSArray *blockAnchors,
-                                              NSString *blockID,
-                                              NSUInteger expectedTargetLocation)
+// Counts only anchors with a usable target range.
+static NSUInteger OMDAnchorForBlockIDWithOrdinal(const OMDAnchorTable *table,
+                                                 NSString *blockID,
+                                                 NSInteger preferredOrdinal,
+                                                 NSUInteger expectedTargetLocation)
 {
-    if (blockID == nil || [blockID length] == 0) {
-        return nil;
+    NSInteger ordinal = 0;
+    NSUInteger entryIndex = OMDFirstAnchorWithBlockID(table, blockID);
+    if (entryIndex == NSNotFound) {
+        return NSNotFound;
     }
-
-    NSDictionary *best = nil;
-    double bestScore = DBL_MAX;
-    for (NSDictionary *anchor in blockAnchors) {
-        NSString *anchorID = OMDAnchorBlockID(anchor);
-        if (anchorID == nil || ![anchorID isEqualToString:blockID]) {
+    for (; entryIndex != NSNotFound; entryIndex = table->entries[entryIndex].nextWithBlockID) {
+        if (!table->entries[entryIndex].valid) {
             continue;
         }
+        if (preferredOrdinal != NSNotFound && preferredOrdinal >= 0 && ordinal == preferredOrdinal) {
+            return entryIndex;
+        }
+        ordinal += 1;
+    }
+    return OMDBestAnchorForBlockID(table, blockID, expectedTargetLocation);
+}
 
-        NSUInteger targetStart = 0;
-        NSUInteger targetLength = 0;
-        if (!OMDExtractAnchor(anchor, NULL, NULL, &targetStart, &targetLength) || targetLength == 0) {
+static void OMDSourceBlockTableReset(OMDSourceBlockTable *table)
+{
+    [table->markdown release];
+    table->markdown = nil;
+    [table->blockIDs release];
+    table->blockIDs = nil;
+    free(table->blocks);
+    table->blocks = NULL;
+    table->blockCount = 0;
+    [table->firstBlockByBlockID release];
+    table->firstBlockByBlockID = nil;
+    OMDIntervalIndexFree(&table->byLine);
+}
+
+static OMDSourceBlockTable *OMDSourceBlockTableForMarkdown(NSString *sourceText)
+{
+    if (sourceText == nil || [sourceText length] == 0) {
+        return NULL;
+    }
+
+    OMDSourceBlockTable *table = &OMDCachedSourceBlockTable;
+    if (OMDCachedTextIsCurrent(table->markdown, nil, 0, sourceText, 0)) {
+        return table;
+    }
+
+    OMDSourceBlockTableReset(table);
+    table->markdown = [sourceText copy];
+
+    // Usually the snapshot the highlighter or the last render already built.
+    OMMarkdownDocumentSnapshot *snapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:table->markdown];
+    NSArray *sourceLines = [snapshot sourceLines];
+    const OMMarkdownBlockDescriptor *descriptors = [snapshot blockDescriptors];
+    NSUInteger descriptorCount = [snapshot blockCount];
+    NSUInteger allocationCount = descriptorCount > 0 ? descriptorCount : 1;
+    table->blocks = (OMDSourceBlock *)malloc(allocationCount * sizeof(OMDSourceBlock));
+    table->blockIDs = [[NSMutableArray alloc] init];
+    table->firstBlockByBlockID = [[NSMutableDictionary alloc] init];
+    NSInteger *starts = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    NSInteger *ends = (NSInteger *)malloc(allocationCount * sizeof(NSInteger));
+    NSMutableDictionary *lastBlockByBlockID = [NSMutableDictionary dictionary];
+
+    NSUInteger index = 0;
+    for (; index < descriptorCount; index++) {
+        const OMMarkdownBlockDescriptor *descriptor = &descriptors[index];
+        if (!OMDNodeTypeHasBlockAnchor((cmark_node_type)descriptor->nodeType)) {
+            continue;
+        }
+        NSInteger startLine = 0;
+        NSInteger endLine = 0;
+        if (!OMDBlockLineBounds(descriptor, &startLine, &endLine)) {
             continue;
         }
 
-        NSUInteger center = targetStart + (targetLength / 2);
-        double distance = fabs((double)((NSInteger)center - (NSInteger)expectedTargetLocation));
-        double score = (distance * 1000.0) + (double)targetLength;
-        if (score < bestScore) {
-            bestScore = score;
-            best = anchor;
+        NSUInteger blockIndex = table->blockCount;
+        OMDSourceBlock *block = &table->blocks[blockIndex];
+        block->startLine = startLine;
+        block->endLine = endLine;
+        block->blockID = nil;
+        block->nextWithBlockID = NSNotFound;
+        NSString *blockID = OMDStableBlockIDForBlock(descriptor, sourceLines);
+        if (blockID != nil && [blockID length] > 0) {
+            [table->blockIDs addObject:blockID];
+            block->blockID = blockID;
+            NSNumber *blockNumber = [NSNumber numberWithUnsignedInteger:blockIndex];
+            NSNumber *lastNumber = [lastBlockByBlockID objectForKey:blockID];
+            if (lastNumber == nil) {
+                [table->firstBlockByBlockID setObject:blockNumber forKey:blockID];
+            } else {
+                table->blocks[[lastNumber unsignedIntegerValue]].nextWithBlockID = blockIndex;
+            }
+            [lastBlockByBlockID setObject:blockNumber forKey:blockID];
         }
+        starts[blockIndex] = startLine;
+        ends[blockIndex] = endLine;
+        table->blockCount += 1;
     }
-    return best;
+
+    OMDIntervalIndexBuild(&table->byLine, starts, ends, NULL, table->blockCount);
+    free(starts);
+    free(ends);
+    return table;
 }
 
-static NSInteger OMDAnchorOrdinalForBlockID(NSArray *blockAnchors,
-                                            NSDictionary *targetAnchor,
-                                            NSString *blockID)
+static NSUInteger OMDFirstSourceBlockWithBlockID(const OMDSourceBlockTable *table, NSString *blockID)
 {
-    if (blockID == nil || [blockID length] == 0 || targetAnchor == nil) {
+    if (table == NULL || blockID == nil || [blockID length] == 0) {
         return NSNotFound;
     }
+    NSNumber *first = [table->firstBlockByBlockID objectForKey:blockID];
+    return first != nil ? [first unsignedIntegerValue] : NSNotFound;
+}
 
-    NSInteger ordinal = 0;
-    for (NSDictionary *anchor in blockAnchors) {
-        NSString *anchorID = OMDAnchorBlockID(anchor);
-        if (anchorID == nil || ![anchorID isEqualToString:blockID]) {
+static NSUInteger OMDBestSourceBlockForLine(const OMDSourceBlockTable *table, NSInteger sourceLine)
+{
+    if (table == NULL) {
+        return NSNotFound;
+    }
+
+    const OMDIntervalIndex *index = &table->byLine;
+    NSUInteger best = NSNotFound;
+    NSInteger bestSpan = NSIntegerMax;
+    NSUInteger position = OMDIntervalIndexUpperBound(index, sourceLine);
+    for (; position > 0 && index->maxEnds[position - 1] >= sourceLine; position--) {
+        NSUInteger blockIndex = index->order[position - 1];
+        const OMDSourceBlock *block = &table->blocks[blockIndex];
+        if (sourceLine > block->endLine) {
             continue;
         }
-        if (anchor == targetAnchor || [anchor isEqual:targetAnchor]) {
-            return ordinal;
+
+        NSInteger span = block->endLine - block->startLine + 1;
+        if (span < 1) {
+            span = 1;
+        }
+        if (best == NSNotFound || span < bestSpan || (span == bestSpan && blockIndex < best)) {
+            best = blockIndex;
+            bestSpan = span;
         }
-        ordinal += 1;
     }
-    return NSNotFound;
+    return best;
 }
 
-static NSDictionary *OMDSourceDescriptorForBlockIDWithOrdinal(NSArray *descriptors,
-                                                               NSString *blockID,
-                                                               NSInteger preferredOrdinal,
-                                                               NSInteger expectedLine)
+static NSUInteger OMDBestSourceBlockForBlockID(const OMDSourceBlockTable *table,
+                                               NSString *blockID,
+                                               NSInteger expectedLine)
 {
-    if (blockID == nil || [blockID length] == 0) {
-        return nil;
-    }
+    NSUInteger best = NSNotFound;
+    double bestScore = DBL_MAX;
+    NSUInteger blockIndex = OMDFirstSourceBlockWithBlockID(table, blockID);
+    for (; blockIndex != NSNotFound; blockIndex = table->blocks[blockIndex].nextWithBlockID) {
+        const OMDSourceBlock *block = &table->blocks[blockIndex];
+        NSInteger span = block->endLine - block->startLine + 1;
+        if (span < 1) {
+            span = 1;
+        }
 
-    NSInteger ordinal = 0;
-    for (NSDictionary *descriptor in descriptors) {
-        NSString *descriptorID = OMDSourceDescriptorBlockID(descriptor);
-        if (descriptorID == nil || ![descriptorID isEqualToString:blockID]) {
-            continue;
+        double distance = 0.0;
+        if (expectedLine > 0) {
+            NSInteger center = block->startLine + (span / 2);
+            distance = fabs((double)(center - expectedLine));
         }
-        if (preferredOrdinal != NSNotFound && preferredOrdinal >= 0 && ordinal == preferredOrdinal) {
-            return descriptor;
+        double score = (distance * 1000.0) + (double)span;
+        if (score < bestScore) {
+            bestScore = score;
+            best = blockIndex;
         }
-        ordinal += 1;
     }
-    return OMDBestSourceDescriptorForBlockID(descriptors, blockID, expectedLine);
+    return best;
 }
 
-static NSDictionary *OMDAnchorForBlockIDWithOrdinal(NSArray *blockAnchors,
-                                                     NSString *blockID,
-                                                     NSInteger preferredOrdinal,
-                                                     NSUInteger expectedTargetLocation)
+static NSInteger OMDSourceBlockOrdinalForBlockID(const OMDSourceBlockTable *table, NSUInteger targetIndex)
 {
-    if (blockID == nil || [blockID length] == 0) {
-        return nil;
+    if (table == NULL || targetIndex == NSNotFound) {
+        return NSNotFound;
     }
 
     NSInteger ordinal = 0;
-    for (NSDictionary *anchor in blockAnchors) {
-        NSString *anchorID = OMDAnchorBlockID(anchor);
-        if (anchorID == nil || ![anchorID isEqualToString:blockID]) {
-            continue;
-        }
-
-        NSUInteger targetLength = 0;
-        if (!OMDExtractAnchor(anchor, NULL, NULL, NULL, &targetLength) || targetLength == 0) {
-            continue;
+    NSUInteger blockIndex = OMDFirstSourceBlockWithBlockID(table, table->blocks[targetIndex].blockID);
+    for (; blockIndex != NSNotFound; blockIndex = table->blocks[blockIndex].nextWithBlockID) {
+        if (blockIndex == targetIndex) {
+            return ordinal;
         }
+        ordinal += 1;
+    }
+    return NSNotFound;
+}
 
+static NSUInteger OMDSourceBlockForBlockIDWithOrdinal(const OMDSourceBlockTable *table,
+                                                      NSString *blockID,
+                                                      NSInteger preferredOrdinal,
+                                                      NSInteger expectedLine)
+{
+    NSInteger ordinal = 0;
+    NSUInteger blockIndex = OMDFirstSourceBlockWithBlockID(table, blockID);
+    if (blockIndex == NSNotFound) {
+        return NSNotFound;
+    }
+    for (; blockIndex != NSNotFound; blockIndex = table->blocks[blockIndex].nextWithBlockID) {
         if (preferredOrdinal != NSNotFound && preferredOrdinal >= 0 && ordinal == preferredOrdinal) {
-            return anchor;
+            return blockIndex;
         }
         ordinal += 1;
     }
-    return OMDBestAnchorForBlockID(blockAnchors, blockID, expectedTargetLocation);
+    return OMDBestSourceBlockForBlockID(table, blockID, expectedLine);
 }
 
 double OMDNormalizedLocationRatio(NSUInteger location, NSUInteger length)
@@ -1391,9 +1810,11 @@ NSUInteger OMDMapLocationBetweenLengths(NSUInteger location,
     return mapped;
 }
 
-NSUInteger OMDMapLocationBetweenTexts(NSString *sourceText,
-                                      NSUInteger sourceLocation,
-                                      NSString *targetText)
+static NSUInteger OMDMapLocationBetweenRevisedTexts(NSString *sourceText,
+                                                    NSUInteger sourceRevision,
+                                                    NSUInteger sourceLocation,
+                                                    NSString *targetText,
+                                                    NSUInteger targetRevision)
 {
     NSUInteger sourceLength = [sourceText length];
     NSUInteger targetLength = [targetText length];
@@ -1405,48 +1826,52 @@ NSUInteger OMDMapLocationBetweenTexts(NSString *sourceText,
         return expected;
     }
 
-    NSArray *sourceInfos = OMDLineInfosForText(sourceText, YES);
-    NSArray *targetInfos = OMDLineInfosForText(targetText, NO);
-    if ([sourceInfos count] == 0 || [targetInfos count] == 0) {
+    OMDTrimInternedStringsIfNeeded();
+    OMDLineInfoTable *sourceTable = OMDLineInfoTableForText(sourceText, sourceRevision, YES, YES);
+    OMDLineInfoTable *targetTable = OMDLineInfoTableForText(targetText, targetRevision, NO, YES);
+    if (sourceTable->lineCount == 0 || targetTable->lineCount == 0) {
         return expected;
     }
 
-    NSUInteger sourceLineIndex = OMDLineIndexForLocation(sourceInfos, sourceLocation);
-    if (sourceLineIndex == NSNotFound || sourceLineIndex >= [sourceInfos count]) {
+    NSUInteger sourceLineIndex = OMDLineIndexForLocation(sourceTable, sourceLocation);
+    if (sourceLineIndex == NSNotFound || sourceLineIndex >= sourceTable->lineCount) {
         return expected;
     }
-    NSDictionary *sourceLineInfo = [sourceInfos objectAtIndex:sourceLineIndex];
-    OMDAnchorLineFamily sourceFamily = OMDLineInfoFamily(sourceLineInfo);
-    NSString *sourceNormalized = OMDLineInfoNormalized(sourceLineInfo);
-    NSArray *sourceLineTokens = OMDLineInfoTokens(sourceLineInfo);
-    NSArray *anchorTokens = OMDContextTokensForSourceLine(sourceInfos, sourceLineIndex, sourceFamily);
-    if ([sourceNormalized length] == 0 && [anchorTokens count] == 0) {
+    const OMDLineInfo *sourceLineInfo = &sourceTable->lines[sourceLineIndex];
+    OMDAnchorLineFamily sourceFamily = (OMDAnchorLineFamily)sourceLineInfo->family;
+    uint32_t anchorTokens[OMDContextMaxTokens];
+    NSUInteger anchorTokenCount = OMDContextTokensForSourceLine(sourceTable,
+                                                                sourceLineIndex,
+                                                                sourceFamily,
+                                                                anchorTokens);
+    if (sourceLineInfo->normalizedID == 0 && anchorTokenCount == 0) {
         return expected;
     }
 
-    NSUInteger expectedLineIndex = OMDLineIndexForLocation(targetInfos, expected);
-    NSUInteger targetLineIndex = OMDSelectBestTargetLine(targetInfos,
+    NSUInteger expectedLineIndex = OMDLineIndexForLocation(targetTable, expected);
+    NSUInteger targetLineIndex = OMDSelectBestTargetLine(targetTable,
                                                          anchorTokens,
-                                                         sourceNormalized,
+                                                         anchorTokenCount,
+                                                         sourceLineInfo->normalizedID,
                                                          sourceFamily,
                                                          expectedLineIndex);
 
-    if (targetLineIndex == NSNotFound || targetLineIndex >= [targetInfos count]) {
-        if ([anchorTokens count] > 0) {
-            return OMDBestMatchLocationInText(targetText, anchorTokens, expected);
+    if (targetLineIndex == NSNotFound || targetLineIndex >= targetTable->lineCount) {
+        if (anchorTokenCount > 0) {
+            return OMDBestMatchLocationInText(targetTable, anchorTokens, anchorTokenCount, expected);
         }
         return expected;
     }
 
-    NSDictionary *targetLineInfo = [targetInfos objectAtIndex:targetLineIndex];
     NSUInteger mapped = OMDLocationUsingLineAndColumnRatio(sourceLineInfo,
                                                            sourceLocation,
-                                                           targetLineInfo,
+                                                           &targetTable->lines[targetLineIndex],
                                                            targetLength);
 
-    NSArray *adjustTokens = [sourceLineTokens count] > 0 ? sourceLineTokens : anchorTokens;
-    if ([adjustTokens count] > 0) {
-        NSUInteger tokenAdjusted = OMDBestMatchLocationInText(targetText, adjustTokens, mapped);
+    const uint32_t *adjustTokens = sourceLineInfo->tokenCount > 0 ? sourceLineInfo->tokens : anchorTokens;
+    NSUInteger adjustTokenCount = sourceLineInfo->tokenCount > 0 ? sourceLineInfo->tokenCount : anchorTokenCount;
+    if (adjustTokenCount > 0) {
+        NSUInteger tokenAdjusted = OMDBestMatchLocationInText(targetTable, adjustTokens, adjustTokenCount, mapped);
         NSInteger delta = (NSInteger)tokenAdjusted - (NSInteger)mapped;
         if (delta < 0) {
             delta = -delta;
@@ -1459,15 +1884,22 @@ NSUInteger OMDMapLocationBetweenTexts(NSString *sourceText,
     return mapped;
 }
 
-NSUInteger OMDMapSourceLocationWithBlockAnchors(NSString *sourceText,
-                                                NSUInteger sourceLocation,
-                                                NSString *targetText,
-                                                NSArray *blockAnchors)
+NSUInteger OMDMapLocationBetweenTexts(NSString *sourceText,
+                                      NSUInteger sourceLocation,
+                                      NSString *targetText)
+{
+    return OMDMapLocationBetweenRevisedTexts(sourceText, 0, sourceLocation, targetText, 0);
+}
+
+NSUInteger OMDMapSourceLocationWithBlockAnchorsAtRevision(NSString *sourceText,
+                                                          NSUInteger sourceLocation,
+                                                          NSString *targetText,
+                                                          NSUInteger targetRevision,
+                                                          NSArray *blockAnchors)
 {
     NSUInteger sourceLength = [sourceText length];
     NSUInteger targetLength = [targetText length];
     NSUInteger expected = OMDMapLocationBetweenLengths(sourceLocation, sourceLength, targetLength);
-    BOOL resolvedFallback = NO;
     if (targetLength == 0) {
         return 0;
     }
@@ -1475,77 +1907,59 @@ NSUInteger OMDMapSourceLocationWithBlockAnchors(NSString *sourceText,
         return expected;
     }
     if ([blockAnchors count] == 0) {
-        return OMDMapLocationBetweenTexts(sourceText, sourceLocation, targetText);
+        return OMDMapLocationBetweenRevisedTexts(sourceText, 0, sourceLocation, targetText, targetRevision);
     }
 
-    NSArray *sourceInfos = OMDLineInfosForText(sourceText, NO);
-    if ([sourceInfos count] == 0) {
+    OMDLineInfoTable *sourceTable = OMDLineInfoTableForText(sourceText, 0, NO, NO);
+    if (sourceTable->lineCount == 0) {
         return expected;
     }
 
-    NSUInteger sourceLineIndex = OMDLineIndexForLocation(sourceInfos, sourceLocation);
-    if (sourceLineIndex == NSNotFound || sourceLineIndex >= [sourceInfos count]) {
+    NSUInteger sourceLineIndex = OMDLineIndexForLocation(sourceTable, sourceLocation);
+    if (sourceLineIndex == NSNotFound || sourceLineIndex >= sourceTable->lineCount) {
         return expected;
     }
+    // Copied out: the fallback below may look up another line table.
+    OMDLineInfo sourceLineInfo = sourceTable->lines[sourceLineIndex];
 
     NSInteger sourceLine = (NSInteger)sourceLineIndex + 1;
-    NSArray *sourceDescriptors = [NSArray array];
-    NSDictionary *sourceDescriptor = nil;
+    OMDAnchorTable *anchorTable = OMDAnchorTableForAnchors(blockAnchors);
+    OMDSourceBlockTable *sourceBlocks = NULL;
+    NSUInteger sourceBlockIndex = NSNotFound;
     NSString *sourceBlockID = nil;
     NSInteger sourceBlockOrdinal = NSNotFound;
-    if (OMDAnchorsContainBlockIDs(blockAnchors)) {
-        sourceDescriptors = OMDSourceBlockDescriptorsForMarkdownCached(sourceText);
-        sourceDescriptor = OMDBestSourceDescriptorForLine(sourceDescriptors, sourceLine);
-        sourceBlockID = OMDSourceDescriptorBlockID(sourceDescriptor);
-        sourceBlockOrdinal = OMDSourceDescriptorOrdinalForBlockID(sourceDescriptors,
-                                                                  sourceDescriptor,
-                                                                  sourceBlockID);
+    if (OMDAnchorTableHasBlockIDs(anchorTable)) {
+        sourceBlocks = OMDSourceBlockTableForMarkdown(sourceText);
+        sourceBlockIndex = OMDBestSourceBlockForLine(sourceBlocks, sourceLine);
+        if (sourceBlockIndex != NSNotFound) {
+            sourceBlockID = sourceBlocks->blocks[sourceBlockIndex].blockID;
+            sourceBlockOrdinal = OMDSourceBlockOrdinalForBlockID(sourceBlocks, sourceBlockIndex);
+        }
     }
 
-    NSDictionary *anchor = nil;
+    NSUInteger anchorIndex = NSNotFound;
     if (sourceBlockID != nil) {
-        anchor = OMDAnchorForBlockIDWithOrdinal(blockAnchors,
-                                                sourceBlockID,
-                                                sourceBlockOrdinal,
-                                                expected);
+        anchorIndex = OMDAnchorForBlockIDWithOrdinal(anchorTable,
+                                                     sourceBlockID,
+                                                     sourceBlockOrdinal,
+                                                     expected);
     }
-    if (anchor == nil) {
-        anchor = OMDBestAnchorForSourceLine(blockAnchors, sourceLine);
-    }
-    if (anchor == nil) {
-        if (!resolvedFallback) {
-            expected = OMDMapLocationBetweenTexts(sourceText, sourceLocation, targetText);
-            resolvedFallback = YES;
-        }
-        return expected;
+    if (anchorIndex == NSNotFound) {
+        anchorIndex = OMDBestAnchorForSourceLine(anchorTable, sourceLine);
     }
-
-    NSInteger sourceStartLine = 0;
-    NSInteger sourceEndLine = 0;
-    NSUInteger targetStart = 0;
-    NSUInteger targetAnchorLength = 0;
-    if (!OMDExtractAnchor(anchor, &sourceStartLine, &sourceEndLine, &targetStart, &targetAnchorLength) ||
-        targetAnchorLength == 0) {
-        if (!resolvedFallback) {
-            expected = OMDMapLocationBetweenTexts(sourceText, sourceLocation, targetText);
-            resolvedFallback = YES;
-        }
-        return expected;
+    if (anchorIndex == NSNotFound || !anchorTable->entries[anchorIndex].valid) {
+        return OMDMapLocationBetweenRevisedTexts(sourceText, 0, sourceLocation, targetText, targetRevision);
     }
 
-    NSInteger progressStartLine = sourceStartLine;
-    NSInteger progressEndLine = sourceEndLine;
-    NSString *anchorBlockID = OMDAnchorBlockID(anchor);
-    if (sourceDescriptor != nil && anchorBlockID != nil) {
-        NSString *descriptorBlockID = OMDSourceDescriptorBlockID(sourceDescriptor);
-        if (descriptorBlockID != nil && [descriptorBlockID isEqualToString:anchorBlockID]) {
-            NSNumber *descriptorStart = [sourceDescriptor objectForKey:OMDAnchorSourceStartLineKey];
-            NSNumber *descriptorEnd = [sourceDescriptor objectForKey:OMDAnchorSourceEndLineKey];
-            if (descriptorStart != nil && descriptorEnd != nil) {
-                progressStartLine = [descriptorStart integerValue];
-                progressEndLine = [descriptorEnd integerValue];
-            }
-        }
+    const OMDAnchorEntry *anchor = &anchorTable->entries[anchorIndex];
+    NSUInteger targetStart = anchor->targetStart;
+    NSUInteger targetAnchorLength = anchor->targetLength;
+    NSInteger progressStartLine = anchor->sourceStartLine;
+    NSInteger progressEndLine = anchor->sourceEndLine;
+    if (sourceBlockIndex != NSNotFound && anchor->blockID != nil && sourceBlockID != nil &&
+        [sourceBlockID isEqualToString:anchor->blockID]) {
+        progressStartLine = sourceBlocks->blocks[sourceBlockIndex].startLine;
+        progressEndLine = sourceBlocks->blocks[sourceBlockIndex].endLine;
     }
 
     NSInteger sourceLineSpan = progressEndLine - progressStartLine + 1;
@@ -1560,8 +1974,7 @@ NSUInteger OMDMapSourceLocationWithBlockAnchors(NSString *sourceText,
         sourceLineOffset = sourceLineSpan - 1;
     }
 
-    NSDictionary *sourceLineInfo = [sourceInfos objectAtIndex:sourceLineIndex];
-    double columnRatio = OMDLineColumnRatioForLocation(sourceLineInfo, sourceLocation);
+    double columnRatio = OMDLineColumnRatioForLocation(&sourceLineInfo, sourceLocation);
     double progress = ((double)sourceLineOffset + columnRatio) / (double)sourceLineSpan;
     if (progress < 0.0) {
         progress = 0.0;
@@ -1579,15 +1992,23 @@ NSUInteger OMDMapSourceLocationWithBlockAnchors(NSString *sourceText,
     return mapped;
 }
 
-NSUInteger OMDMapTargetLocationWithBlockAnchors(NSString *sourceText,
+NSUInteger OMDMapSourceLocationWithBlockAnchors(NSString *sourceText,
+                                                NSUInteger sourceLocation,
                                                 NSString *targetText,
-                                                NSUInteger targetLocation,
                                                 NSArray *blockAnchors)
+{
+    return OMDMapSourceLocationWithBlockAnchorsAtRevision(sourceText, sourceLocation, targetText, 0, blockAnchors);
+}
+
+NSUInteger OMDMapTargetLocationWithBlockAnchorsAtRevision(NSString *sourceText,
+                                                          NSString *targetText,
+                                                          NSUInteger targetRevision,
+                                                          NSUInteger targetLocation,
+                                                          NSArray *blockAnchors)
 {
     NSUInteger sourceLength = [sourceText length];
     NSUInteger targetLength = [targetText length];
     NSUInteger expected = OMDMapLocationBetweenLengths(targetLocation, targetLength, sourceLength);
-    BOOL resolvedFallback = NO;
     if (sourceLength == 0) {
         return 0;
     }
@@ -1598,7 +2019,7 @@ NSUInteger OMDMapTargetLocationWithBlockAnchors(NSString *sourceText,
         return expected;
     }
     if ([blockAnchors count] == 0) {
-        return OMDMapLocationBetweenTexts(targetText, targetLocation, sourceText);
+        return OMDMapLocationBetweenRevisedTexts(targetText, targetRevision, targetLocation, sourceText, 0);
     }
 
     NSUInteger lookupLocation = targetLocation;
@@ -1606,50 +2027,33 @@ NSUInteger OMDMapTargetLocationWithBlockAnchors(NSString *sourceText,
         lookupLocation = targetLength - 1;
     }
 
-    NSDictionary *anchor = OMDBestAnchorForTargetLocation(blockAnchors, lookupLocation);
-    if (anchor == nil) {
-        if (!resolvedFallback) {
-            expected = OMDMapLocationBetweenTexts(targetText, targetLocation, sourceText);
-            resolvedFallback = YES;
-        }
-        return expected;
+    OMDAnchorTable *anchorTable = OMDAnchorTableForAnchors(blockAnchors);
+    NSUInteger anchorIndex = OMDBestAnchorForTargetLocation(anchorTable, lookupLocation);
+    if (anchorIndex == NSNotFound) {
+        return OMDMapLocationBetweenRevisedTexts(targetText, targetRevision, targetLocation, sourceText, 0);
     }
 
-    NSInteger sourceStartLine = 0;
-    NSInteger sourceEndLine = 0;
-    NSUInteger targetStart = 0;
-    NSUInteger targetAnchorLength = 0;
-    if (!OMDExtractAnchor(anchor, &sourceStartLine, &sourceEndLine, &targetStart, &targetAnchorLength) ||
-        targetAnchorLength == 0) {
-        if (!resolvedFallback) {
-            expected = OMDMapLocationBetweenTexts(targetText, targetLocation, sourceText);
-            resolvedFallback = YES;
-        }
-        return expected;
-    }
+    const OMDAnchorEntry *anchor = &anchorTable->entries[anchorIndex];
+    NSInteger sourceStartLine = anchor->sourceStartLine;
+    NSInteger sourceEndLine = anchor->sourceEndLine;
+    NSUInteger targetStart = anchor->targetStart;
+    NSUInteger targetAnchorLength = anchor->targetLength;
 
-    NSString *anchorBlockID = OMDAnchorBlockID(anchor);
-    if (anchorBlockID != nil) {
-        NSInteger anchorBlockOrdinal = OMDAnchorOrdinalForBlockID(blockAnchors,
-                                                                  anchor,
-                                                                  anchorBlockID);
-        NSArray *sourceDescriptors = OMDSourceBlockDescriptorsForMarkdownCached(sourceText);
-        NSDictionary *sourceDescriptor = OMDSourceDescriptorForBlockIDWithOrdinal(sourceDescriptors,
-                                                                                  anchorBlockID,
-                                                                                  anchorBlockOrdinal,
-                                                                                  sourceStartLine);
-        if (sourceDescriptor != nil) {
-            NSNumber *descriptorStart = [sourceDescriptor objectForKey:OMDAnchorSourceStartLineKey];
-            NSNumber *descriptorEnd = [sourceDescriptor objectForKey:OMDAnchorSourceEndLineKey];
-            if (descriptorStart != nil && descriptorEnd != nil) {
-                sourceStartLine = [descriptorStart integerValue];
-                sourceEndLine = [descriptorEnd integerValue];
-            }
+    if (anchor->blockID != nil) {
+        NSInteger anchorBlockOrdinal = OMDAnchorOrdinalForBlockID(anchorTable, anchorIndex);
+        OMDSourceBlockTable *sourceBlocks = OMDSourceBlockTableForMarkdown(sourceText);
+        NSUInteger sourceBlockIndex = OMDSourceBlockForBlockIDWithOrdinal(sourceBlocks,
+                                                                          anchor->blockID,
+                                                                          anchorBlockOrdinal,
+                                                                          sourceStartLine);
+        if (sourceBlockIndex != NSNotFound) {
+            sourceStartLine = sourceBlocks->blocks[sourceBlockIndex].startLine;
+            sourceEndLine = sourceBlocks->blocks[sourceBlockIndex].endLine;
         }
     }
 
-    NSArray *sourceInfos = OMDLineInfosForText(sourceText, NO);
-    if ([sourceInfos count] == 0) {
+    OMDLineInfoTable *sourceTable = OMDLineInfoTableForText(sourceText, 0, NO, NO);
+    if (sourceTable->lineCount == 0) {
         return expected;
     }
 
@@ -1676,7 +2080,7 @@ NSUInteger OMDMapTargetLocationWithBlockAnchors(NSString *sourceText,
     }
 
     NSInteger sourceLineNumber = sourceStartLine + sourceLineOffset;
-    NSUInteger mapped = OMDSourceLocationFromLineAndRatio(sourceInfos,
+    NSUInteger mapped = OMDSourceLocationFromLineAndRatio(sourceTable,
                                                           sourceLineNumber,
                                                           sourceColumnRatio,
                                                           sourceLength);
@@ -1685,3 +2089,25 @@ NSUInteger OMDMapTargetLocationWithBlockAnchors(NSString *sourceText,
     }
     return mapped;
 }
+
+NSUInteger OMDMapTargetLocationWithBlockAnchors(NSString *sourceText,
+                                                NSString *targetText,
+                                                NSUInteger targetLocation,
+                                                NSArray *blockAnchors)
+{
+    return OMDMapTargetLocationWithBlockAnchorsAtRevision(sourceText, targetText, 0, targetLocation, blockAnchors);
+}
+
+void OMDForgetRevisedText(NSString *targetText)
+{
+    if (targetText == nil) {
+        return;
+    }
+    NSUInteger slot = 0;
+    for (; slot < OMDLineInfoCacheSlotCount; slot++) {
+        if (OMDCachedLineInfoTables[slot].textOwner == targetText) {
+            OMDCachedLineInfoTables[slot].textOwner = nil;
+            OMDCachedLineInfoTables[slot].textRevision = 0;
+        }
+    }
+}
@@ -5,6 +5,34 @@
 
 FOUNDATION_EXPORT NSString * const OMDSourceHighlighterOptionHighContrast;
 FOUNDATION_EXPORT NSString * const OMDSourceHighlighterOptionAccentColor;
+// An OMDSourceLineStyleIndex kept by the caller for one editor buffer. With
+// it, block styles come from the index at any document size, and a partial
+// targetRange is widened to cover lines whose block styles were re-parsed.
+FOUNDATION_EXPORT NSString * const OMDSourceHighlighterOptionLineStyleIndex;
+
+// Block-level line styles of an editor buffer, maintained across edits. An
+// update diffs against the previous text and re-parses only from the last
+// line the old parse entered with no open blocks, up to the first such line
+// after the edit where the new parse agrees again.
+@interface OMDSourceLineStyleIndex : NSObject
+{
+    NSString *_text;
+    NSUInteger *_lineStarts;
+    uint8_t *_lineInfo;
+    NSUInteger _lineCount;
+    NSRange _lastReparsedRange;
+    NSUInteger _lastReparsedLineCount;
+}
+
+- (void)updateWithText:(NSString *)text;
+- (void)invalidate;
+@property (nonatomic, readonly) NSUInteger lineCount;
+// Character range of the current text whose lines were re-parsed by the last
+// update; {NSNotFound, 0} when nothing changed.
+@property (nonatomic, readonly) NSRange lastReparsedRange;
+@property (nonatomic, readonly) NSUInteger lastReparsedLineCount;
+
+@end
 
 @interface OMDSourceHighlighter : NSObject
 
@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #import "OMDSourceHighlighter.h"
+#import "OMDTextDiff.h"
+#import "OMMarkdownRenderer.h"
 
 #include <cmark.h>
 
@@ -25,6 +27,7 @@ typedef NS_ENUM(NSUInteger, OMDSourceBlockStyle) {
 
 NSString * const OMDSourceHighlighterOptionHighContrast = @"OMDSourceHighlighterOptionHighContrast";
 NSString * const OMDSourceHighlighterOptionAccentColor = @"OMDSourceHighlighterOptionAccentColor";
+NSString * const OMDSourceHighlighterOptionLineStyleIndex = @"OMDSourceHighlighterOptionLineStyleIndex";
 
 static const NSUInteger OMDParserBackedHighlightMaxLength = 120000;
 
@@ -324,16 +327,16 @@ static void OMDSetLineStyle(NSMutableDictionary *lineStyles,
     [lineStyles setObject:[NSNumber numberWithUnsignedInteger:(NSUInteger)style] forKey:key];
 }
 
-static void OMDApplyNodeStyleToLines(cmark_node *node,
-                                     NSMutableDictionary *lineStyles,
-                                     OMDSourceBlockStyle style)
+static void OMDApplyBlockStyleToLines(const OMMarkdownBlockDescriptor *block,
+                                      NSMutableDictionary *lineStyles,
+                                      OMDSourceBlockStyle style)
 {
-    if (node == NULL || lineStyles == nil || style == OMDSourceBlockStyleNone) {
+    if (block == NULL || lineStyles == nil || style == OMDSourceBlockStyleNone) {
         return;
     }
 
-    int startLine = cmark_node_get_start_line(node);
-    int endLine = cmark_node_get_end_line(node);
+    NSInteger startLine = block->startLine;
+    NSInteger endLine = block->endLine;
     if (startLine <= 0 || endLine <= 0 || endLine < startLine) {
         return;
     }
@@ -345,42 +348,21 @@ static void OMDApplyNodeStyleToLines(cmark_node *node,
     }
 }
 
-static void OMDCollectParserLineStyles(cmark_node *node,
-                                       NSMutableDictionary *lineStyles,
-                                       BOOL inBlockquote,
-                                       BOOL inList,
-                                       BOOL inCode)
-{
-    cmark_node *cursor = node;
-    while (cursor != NULL) {
-        cmark_node_type type = cmark_node_get_type(cursor);
-        BOOL nodeInBlockquote = inBlockquote || type == CMARK_NODE_BLOCK_QUOTE;
-        BOOL nodeInList = inList || type == CMARK_NODE_LIST || type == CMARK_NODE_ITEM;
-        BOOL nodeInCode = inCode || type == CMARK_NODE_CODE_BLOCK;
-
-        OMDSourceBlockStyle style = OMDSourceBlockStyleNone;
-        if (nodeInCode) {
-            style = OMDSourceBlockStyleCode;
-        } else if (type == CMARK_NODE_HEADING) {
-            style = OMDSourceBlockStyleHeading;
-        } else if (nodeInBlockquote) {
-            style = OMDSourceBlockStyleBlockquote;
-        } else if (nodeInList) {
-            style = OMDSourceBlockStyleList;
-        }
-
-        OMDApplyNodeStyleToLines(cursor, lineStyles, style);
-
-        cmark_node *child = cmark_node_first_child(cursor);
-        if (child != NULL) {
-            OMDCollectParserLineStyles(child,
-                                       lineStyles,
-                                       nodeInBlockquote,
-                                       nodeInList,
-                                       nodeInCode);
-        }
-        cursor = cmark_node_next(cursor);
+static OMDSourceBlockStyle OMDSourceBlockStyleForBlock(const OMMarkdownBlockDescriptor *block)
+{
+    if ((block->flags & OMMarkdownBlockFlagInCodeBlock) != 0) {
+        return OMDSourceBlockStyleCode;
+    }
+    if (block->nodeType == CMARK_NODE_HEADING) {
+        return OMDSourceBlockStyleHeading;
+    }
+    if ((block->flags & OMMarkdownBlockFlagInBlockquote) != 0) {
+        return OMDSourceBlockStyleBlockquote;
     }
+    if ((block->flags & OMMarkdownBlockFlagInList) != 0) {
+        return OMDSourceBlockStyleList;
+    }
+    return OMDSourceBlockStyleNone;
 }
 
 static NSDictionary *OMDParserBackedLineStyles(NSString *markdown)
@@ -392,26 +374,454 @@ static NSDictionary *OMDParserBackedLineStyles(NSString *markdown)
         return nil;
     }
 
-    NSData *utf8 = [markdown dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:NO];
-    if (utf8 == nil || [utf8 length] == 0) {
+    // Block descriptors carry the blockquote/list/code ancestry, so no tree
+    // walk is needed here; inline nodes never add to their block's style.
+    OMMarkdownDocumentSnapshot *snapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:markdown];
+    const OMMarkdownBlockDescriptor *blocks = [snapshot blockDescriptors];
+    NSUInteger blockCount = [snapshot blockCount];
+    if (blocks == NULL || blockCount == 0) {
         return nil;
     }
 
-    cmark_node *document = cmark_parse_document((const char *)[utf8 bytes],
-                                                (size_t)[utf8 length],
-                                                CMARK_OPT_DEFAULT | CMARK_OPT_SOURCEPOS);
-    if (document == NULL) {
-        return nil;
+    NSMutableDictionary *lineStyles = [NSMutableDictionary dictionary];
+    NSUInteger index = 0;
+    for (; index < blockCount; index++) {
+        OMDApplyBlockStyleToLines(&blocks[index],
+                                  lineStyles,
+                                  OMDSourceBlockStyleForBlock(&blocks[index]));
     }
+    return lineStyles;
+}
 
-    NSMutableDictionary *lineStyles = [NSMutableDictionary dictionary];
-    cmark_node *rootChild = cmark_node_first_child(document);
-    if (rootChild != NULL) {
-        OMDCollectParserLineStyles(rootChild, lineStyles, NO, NO, NO);
+enum {
+    OMDLineStyleMask = 0x07,
+    OMDLineCovered = 0x08,
+    OMDLineBlank = 0x10,
+    OMDLineRestartable = 0x20
+};
+
+// Line breaks follow cmark (LF, CR, CRLF) so indices match its source lines.
+static NSUInteger OMDNextLineStart(NSString *text, NSUInteger location)
+{
+    NSUInteger length = [text length];
+    while (location < length) {
+        unichar ch = [text characterAtIndex:location];
+        location += 1;
+        if (ch == '\n') {
+            break;
+        }
+        if (ch == '\r') {
+            if (location < length && [text characterAtIndex:location] == '\n') {
+                location += 1;
+            }
+            break;
+        }
     }
-    cmark_node_free(document);
+    return location;
+}
 
-    return lineStyles;
+static void OMDAppendLineStart(NSUInteger location,
+                               NSUInteger **starts,
+                               NSUInteger *count,
+                               NSUInteger *capacity)
+{
+    if (*count == *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : 1024;
+        *starts = (NSUInteger *)realloc(*starts, *capacity * sizeof(NSUInteger));
+    }
+    (*starts)[*count] = location;
+    *count += 1;
+}
+
+static void OMDAppendAllLineStarts(NSString *text,
+                                   NSUInteger from,
+                                   NSUInteger **starts,
+                                   NSUInteger *count,
+                                   NSUInteger *capacity)
+{
+    NSUInteger length = [text length];
+    unichar buffer[OMDTextChunkLength];
+    NSUInteger bufferStart = 0;
+    NSUInteger bufferLength = 0;
+    NSUInteger index = from;
+    BOOL atLineStart = YES;
+    BOOL afterCR = NO;
+    while (index < length) {
+        if (index >= bufferStart + bufferLength) {
+            bufferStart = index;
+            bufferLength = MIN((NSUInteger)OMDTextChunkLength, length - index);
+            [text getCharacters:buffer range:NSMakeRange(bufferStart, bufferLength)];
+        }
+        unichar ch = buffer[index - bufferStart];
+        if (afterCR && ch == '\n') {
+            afterCR = NO;
+            index += 1;
+            continue;
+        }
+        afterCR = NO;
+        if (atLineStart) {
+            OMDAppendLineStart(index, starts, count, capacity);
+            atLineStart = NO;
+        }
+        if (ch == '\n') {
+            atLineStart = YES;
+        } else if (ch == '\r') {
+            atLineStart = YES;
+            afterCR = YES;
+        }
+        index += 1;
+    }
+}
+
+static NSUInteger OMDLineIndexForLocation(const NSUInteger *starts, NSUInteger count, NSUInteger location)
+{
+    if (count == 0) {
+        return 0;
+    }
+    NSUInteger low = 0;
+    NSUInteger high = count;
+    while (high - low > 1) {
+        NSUInteger mid = low + (high - low) / 2;
+        if (starts[mid] <= location) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static BOOL OMDLineIsBlank(NSString *text, NSUInteger start, NSUInteger end)
+{
+    NSUInteger index = start;
+    for (; index < end; index++) {
+        unichar ch = [text characterAtIndex:index];
+        if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n') {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+// Fills info for `count` lines parsed as one document. A line is restartable
+// when the parse reaches it with no open blocks: the line before is blank and
+// outside every block, and the last top-level block was not a list (a list
+// can still absorb indented lines after a blank line). Callers flag the
+// first line themselves. Returns whether the line after the last one would
+// be restartable too.
+static BOOL OMDFillLineInfo(uint8_t *info,
+                            NSUInteger count,
+                            OMMarkdownDocumentSnapshot *snapshot,
+                            NSString *text,
+                            const NSUInteger *starts,
+                            NSUInteger textEnd)
+{
+    NSUInteger line = 0;
+    for (; line < count; line++) {
+        NSUInteger start = starts[line];
+        NSUInteger end = (line + 1 < count) ? starts[line + 1] : textEnd;
+        info[line] = OMDLineIsBlank(text, start, end) ? OMDLineBlank : 0;
+    }
+
+    // lastTopLevelType[i] is the type of the last top-level block ending
+    // before line i, or -1.
+    NSInteger *lastTopLevelType = (NSInteger *)malloc((count + 1) * sizeof(NSInteger));
+    for (line = 0; line <= count; line++) {
+        lastTopLevelType[line] = -1;
+    }
+
+    const OMMarkdownBlockDescriptor *blocks = [snapshot blockDescriptors];
+    NSUInteger blockCount = [snapshot blockCount];
+    NSUInteger index = 0;
+    for (; index < blockCount; index++) {
+        const OMMarkdownBlockDescriptor *block = &blocks[index];
+        NSInteger startLine = block->startLine;
+        NSInteger endLine = block->endLine;
+        if (startLine <= 0 || endLine < startLine || (NSUInteger)startLine > count) {
+            continue;
+        }
+        if ((NSUInteger)endLine > count) {
+            endLine = (NSInteger)count;
+        }
+        OMDSourceBlockStyle style = OMDSourceBlockStyleForBlock(block);
+        BOOL topLevel = (block->flags & OMMarkdownBlockFlagTopLevel) != 0;
+        NSUInteger priority = OMDSourceBlockStylePriority(style);
+        for (line = (NSUInteger)startLine - 1; line < (NSUInteger)endLine; line++) {
+            if (priority > OMDSourceBlockStylePriority((OMDSourceBlockStyle)(info[line] & OMDLineStyleMask))) {
+                info[line] = (uint8_t)((info[line] & ~OMDLineStyleMask) | style);
+            }
+            if (topLevel) {
+                info[line] |= OMDLineCovered;
+            }
+        }
+        if (topLevel) {
+            lastTopLevelType[endLine] = block->nodeType;
+        }
+    }
+    for (line = 1; line <= count; line++) {
+        if (lastTopLevelType[line] < 0) {
+            lastTopLevelType[line] = lastTopLevelType[line - 1];
+        }
+    }
+
+    BOOL endRestartable = NO;
+    for (line = 1; line <= count; line++) {
+        uint8_t previous = info[line - 1];
+        BOOL restartable = ((previous & OMDLineBlank) != 0 &&
+                            (previous & OMDLineCovered) == 0 &&
+                            lastTopLevelType[line] != CMARK_NODE_LIST);
+        if (line == count) {
+            endRestartable = restartable;
+        } else if (restartable) {
+            info[line] |= OMDLineRestartable;
+        }
+    }
+    free(lastTopLevelType);
+    return endRestartable;
+}
+
+@interface OMDSourceLineStyleIndex ()
+- (void)rebuildWithText:(NSString *)text;
+- (NSUInteger)lineIndexForLocation:(NSUInteger)location;
+- (NSUInteger)startOfLine:(NSUInteger)line;
+- (NSUInteger)contentEndOfLine:(NSUInteger)line;
+- (OMDSourceBlockStyle)styleOfLine:(NSUInteger)line;
+@end
+
+@implementation OMDSourceLineStyleIndex
+
+@synthesize lineCount = _lineCount;
+@synthesize lastReparsedRange = _lastReparsedRange;
+@synthesize lastReparsedLineCount = _lastReparsedLineCount;
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _lastReparsedRange = NSMakeRange(NSNotFound, 0);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_lineStarts);
+    free(_lineInfo);
+    [_text release];
+    [super dealloc];
+}
+
+- (void)invalidate
+{
+    [_text release];
+    _text = nil;
+}
+
+- (void)rebuildWithText:(NSString *)text
+{
+    NSUInteger *starts = NULL;
+    NSUInteger count = 0;
+    NSUInteger capacity = 0;
+    OMDAppendAllLineStarts(text, 0, &starts, &count, &capacity);
+
+    // The whole buffer is what the renderer and preview sync parse as well.
+    OMMarkdownDocumentSnapshot *snapshot = [OMMarkdownDocumentSnapshot snapshotForMarkdown:text];
+    uint8_t *info = (uint8_t *)malloc(count > 0 ? count : 1);
+    if (count > 0) {
+        OMDFillLineInfo(info, count, snapshot, text, starts, [text length]);
+        info[0] |= OMDLineRestartable;
+    }
+
+    free(_lineStarts);
+    free(_lineInfo);
+    _lineStarts = starts;
+    _lineInfo = info;
+    _lineCount = count;
+    [_text release];
+    _text = [text copy];
+    _lastReparsedRange = NSMakeRange(0, [text length]);
+    _lastReparsedLineCount = count;
+}
+
+- (void)updateWithText:(NSString *)text
+{
+    if (text == nil) {
+        text = @"";
+    }
+    if (_text == nil || _lineCount == 0) {
+        [self rebuildWithText:text];
+        return;
+    }
+
+    NSUInteger oldLength = [_text length];
+    NSUInteger newLength = [text length];
+    NSUInteger prefix = OMDCommonPrefixLength(_text, text);
+    if (prefix == oldLength && prefix == newLength) {
+        _lastReparsedRange = NSMakeRange(NSNotFound, 0);
+        _lastReparsedLineCount = 0;
+        return;
+    }
+    NSUInteger suffix = OMDCommonSuffixLength(_text, text, MIN(oldLength, newLength) - prefix);
+    NSUInteger newChangeEnd = newLength - suffix;
+    NSInteger delta = (NSInteger)newLength - (NSInteger)oldLength;
+
+    // Start one character early so a CR/LF pair split by the edit is rescanned.
+    NSUInteger firstLine = OMDLineIndexForLocation(_lineStarts, _lineCount, prefix > 0 ? prefix - 1 : 0);
+    NSUInteger restartLine = firstLine;
+    while (restartLine > 0 && (_lineInfo[restartLine] & OMDLineRestartable) == 0) {
+        restartLine -= 1;
+    }
+
+    // New line table: unchanged head, rescanned middle, shifted tail. The
+    // middle ends at the first line start whose break lies wholly after the
+    // edit; from there on the old starts apply, shifted by delta.
+    NSUInteger capacity = _lineCount + 64;
+    NSUInteger *starts = (NSUInteger *)malloc(capacity * sizeof(NSUInteger));
+    memcpy(starts, _lineStarts, firstLine * sizeof(NSUInteger));
+    NSUInteger count = firstLine;
+    NSUInteger alignedOldLine = _lineCount;
+    NSUInteger location = _lineStarts[firstLine];
+    while (location < newLength) {
+        if (location > newChangeEnd) {
+            NSUInteger oldLocation = (NSUInteger)((NSInteger)location - delta);
+            NSUInteger oldLine = OMDLineIndexForLocation(_lineStarts, _lineCount, oldLocation);
+            if (_lineStarts[oldLine] == oldLocation) {
+                alignedOldLine = oldLine;
+                break;
+            }
+        }
+        OMDAppendLineStart(location, &starts, &count, &capacity);
+        location = OMDNextLineStart(text, location);
+    }
+    NSUInteger tailCount = _lineCount - alignedOldLine;
+    NSUInteger newCount = count + tailCount;
+    if (newCount > capacity) {
+        capacity = newCount;
+        starts = (NSUInteger *)realloc(starts, capacity * sizeof(NSUInteger));
+    }
+    NSUInteger index = 0;
+    for (; index < tailCount; index++) {
+        starts[count + index] = (NSUInteger)((NSInteger)_lineStarts[alignedOldLine + index] + delta);
+    }
+    NSInteger lineDelta = (NSInteger)count - (NSInteger)alignedOldLine;
+
+    // Re-parse from restartLine to an old restartable line at or after the
+    // aligned tail, widening the window until the new parse also reaches
+    // that line with no open blocks.
+    uint8_t *info = (uint8_t *)malloc(newCount > 0 ? newCount : 1);
+    memcpy(info, _lineInfo, restartLine);
+    NSUInteger endOldLine = alignedOldLine;
+    while (endOldLine < _lineCount && (_lineInfo[endOldLine] & OMDLineRestartable) == 0) {
+        endOldLine += 1;
+    }
+    NSUInteger segmentStart = starts[restartLine];
+    for (;;) {
+        NSUInteger endNewLine = (NSUInteger)((NSInteger)endOldLine + lineDelta);
+        NSUInteger segmentEnd = endOldLine < _lineCount ? starts[endNewLine] : newLength;
+        NSString *segment = [text substringWithRange:NSMakeRange(segmentStart, segmentEnd - segmentStart)];
+        OMMarkdownDocumentSnapshot *snapshot = [[OMMarkdownDocumentSnapshot alloc] initWithMarkdown:segment
+                                                                                       cmarkOptions:0];
+        NSUInteger segmentLines = endNewLine - restartLine;
+        BOOL endRestartable = OMDFillLineInfo(info + restartLine,
+                                              segmentLines,
+                                              snapshot,
+                                              text,
+                                              starts + restartLine,
+                                              segmentEnd);
+        [snapshot release];
+        if (segmentLines > 0) {
+            info[restartLine] |= OMDLineRestartable;
+        }
+
+        if (endOldLine >= _lineCount || endRestartable) {
+            if (endOldLine < _lineCount) {
+                memcpy(info + endNewLine, _lineInfo + endOldLine, _lineCount - endOldLine);
+            }
+            _lastReparsedRange = NSMakeRange(segmentStart, segmentEnd - segmentStart);
+            _lastReparsedLineCount = segmentLines;
+            break;
+        }
+
+        // Double the window, then move on to the next restartable line.
+        NSUInteger next = endOldLine + MAX((NSUInteger)1, endNewLine - restartLine);
+        while (next < _lineCount && (_lineInfo[next] & OMDLineRestartable) == 0) {
+            next += 1;
+        }
+        endOldLine = MIN(next, _lineCount);
+    }
+
+    free(_lineStarts);
+    free(_lineInfo);
+    _lineStarts = starts;
+    _lineInfo = info;
+    _lineCount = newCount;
+    [_text release];
+    _text = [text copy];
+}
+
+- (NSUInteger)lineIndexForLocation:(NSUInteger)location
+{
+    return OMDLineIndexForLocation(_lineStarts, _lineCount, location);
+}
+
+- (NSUInteger)startOfLine:(NSUInteger)line
+{
+    return line < _lineCount ? _lineStarts[line] : [_text length];
+}
+
+- (NSUInteger)contentEndOfLine:(NSUInteger)line
+{
+    NSUInteger end = [self startOfLine:line + 1];
+    NSUInteger start = [self startOfLine:line];
+    while (end > start) {
+        unichar ch = [_text characterAtIndex:end - 1];
+        if (ch != '\n' && ch != '\r') {
+            break;
+        }
+        end -= 1;
+    }
+    return end;
+}
+
+- (OMDSourceBlockStyle)styleOfLine:(NSUInteger)line
+{
+    if (line >= _lineCount) {
+        return OMDSourceBlockStyleNone;
+    }
+    return (OMDSourceBlockStyle)(_lineInfo[line] & OMDLineStyleMask);
+}
+
+@end
+
+static OMDSourceBlockStyle OMDHeuristicBlockStyle(NSString *trimmedLine)
+{
+    if (OMDHasHeadingMarker(trimmedLine)) {
+        return OMDSourceBlockStyleHeading;
+    }
+    if ([trimmedLine hasPrefix:@">"]) {
+        return OMDSourceBlockStyleBlockquote;
+    }
+    if (OMDHasListMarker(trimmedLine)) {
+        return OMDSourceBlockStyleList;
+    }
+    return OMDSourceBlockStyleNone;
+}
+
+static NSColor *OMDColorForBlockStyle(OMDSourceBlockStyle style, const OMDSourceHighlightPalette *palette)
+{
+    switch (style) {
+        case OMDSourceBlockStyleHeading:
+            return palette->headingColor;
+        case OMDSourceBlockStyleBlockquote:
+            return palette->blockquoteColor;
+        case OMDSourceBlockStyleList:
+            return palette->listColor;
+        case OMDSourceBlockStyleCode:
+            return palette->codeColor;
+        case OMDSourceBlockStyleNone:
+        default:
+            return nil;
+    }
 }
 
 static NSRange OMDNormalizedTargetRange(NSRange targetRange, NSUInteger totalLength)
@@ -548,105 +958,133 @@ static BOOL OMDRangesIntersect(NSRange left, NSRange right)
     OMDSourceHighlightPalette palette = OMDPaletteForBackground(backgroundColor, highContrast, accentColor);
 
     NSString *text = [attributedString string];
-    NSDictionary *parserLineStyles = OMDParserBackedLineStyles(text);
+    OMDSourceLineStyleIndex *lineStyleIndex = [options objectForKey:OMDSourceHighlighterOptionLineStyleIndex];
+    if (lineStyleIndex != nil && ![lineStyleIndex isKindOfClass:[OMDSourceLineStyleIndex class]]) {
+        lineStyleIndex = nil;
+    }
+    NSDictionary *parserLineStyles = nil;
+    if (lineStyleIndex != nil) {
+        [lineStyleIndex updateWithText:text];
+        // Lines outside the caller's window may have changed block style too
+        // (e.g. an opened fence); recolor everything that was re-parsed.
+        NSRange reparsedRange = [lineStyleIndex lastReparsedRange];
+        if (reparsedRange.location != NSNotFound && reparsedRange.location < length) {
+            if (NSMaxRange(reparsedRange) > length) {
+                reparsedRange.length = length - reparsedRange.location;
+            }
+            effectiveRange = NSUnionRange(effectiveRange, reparsedRange);
+        }
+    } else {
+        parserLineStyles = OMDParserBackedLineStyles(text);
+    }
     NSMutableArray *fencedRanges = [NSMutableArray array];
 
     [attributedString beginEditing];
     [attributedString addAttribute:NSForegroundColorAttributeName value:baseColor range:effectiveRange];
 
-    BOOL insideFence = NO;
-    unichar activeFenceMarker = 0;
-    NSUInteger cursor = 0;
-    NSUInteger lineNumber = 1;
-    while (cursor < length) {
-        NSRange lineRange = [text lineRangeForRange:NSMakeRange(cursor, 0)];
-        NSUInteger lineStart = lineRange.location;
-        NSUInteger contentLength = lineRange.length;
-
-        while (contentLength > 0) {
-            unichar ch = [text characterAtIndex:lineStart + contentLength - 1];
-            if (ch == '\n' || ch == '\r') {
-                contentLength -= 1;
+    if (lineStyleIndex != nil) {
+        // Parser styles are available for every line, fences included, so
+        // only the lines in range are visited. Code lines are colored after
+        // the inline passes, like fenced lines below.
+        NSUInteger lineCount = [lineStyleIndex lineCount];
+        NSUInteger line = [lineStyleIndex lineIndexForLocation:effectiveRange.location];
+        for (; line < lineCount; line++) {
+            NSUInteger lineStart = [lineStyleIndex startOfLine:line];
+            if (lineStart >= NSMaxRange(effectiveRange)) {
+                break;
+            }
+            NSUInteger contentEnd = [lineStyleIndex contentEndOfLine:line];
+            if (contentEnd <= lineStart) {
                 continue;
             }
-            break;
+            NSRange contentRange = NSMakeRange(lineStart, contentEnd - lineStart);
+            OMDSourceBlockStyle style = [lineStyleIndex styleOfLine:line];
+            if (style == OMDSourceBlockStyleCode) {
+                [fencedRanges addObject:[NSValue valueWithRange:contentRange]];
+                continue;
+            }
+            if (style == OMDSourceBlockStyleNone) {
+                style = OMDHeuristicBlockStyle(OMDTrimLeadingWhitespace([text substringWithRange:contentRange]));
+            }
+            NSColor *color = OMDColorForBlockStyle(style, &palette);
+            if (color != nil) {
+                [attributedString addAttribute:NSForegroundColorAttributeName
+                                         value:color
+                                         range:contentRange];
+            }
         }
+    } else {
+        BOOL insideFence = NO;
+        unichar activeFenceMarker = 0;
+        NSUInteger cursor = 0;
+        NSUInteger lineNumber = 1;
+        while (cursor < length) {
+            NSRange lineRange = [text lineRangeForRange:NSMakeRange(cursor, 0)];
+            NSUInteger lineStart = lineRange.location;
+            NSUInteger contentLength = lineRange.length;
+
+            while (contentLength > 0) {
+                unichar ch = [text characterAtIndex:lineStart + contentLength - 1];
+                if (ch == '\n' || ch == '\r') {
+                    contentLength -= 1;
+                    continue;
+                }
+                break;
+            }
 
-        NSRange contentRange = NSMakeRange(lineStart, contentLength);
-        BOOL shouldColorLine = OMDRangesIntersect(contentRange, effectiveRange);
-
-        NSString *line = [text substringWithRange:contentRange];
-        NSString *trimmed = OMDTrimLeadingWhitespace(line);
+            NSRange contentRange = NSMakeRange(lineStart, contentLength);
+            BOOL shouldColorLine = OMDRangesIntersect(contentRange, effectiveRange);
 
-        OMDSourceBlockStyle parserStyle = OMDSourceBlockStyleNone;
-        NSNumber *styleValue = [parserLineStyles objectForKey:[NSNumber numberWithUnsignedInteger:lineNumber]];
-        if (styleValue != nil) {
-            parserStyle = (OMDSourceBlockStyle)[styleValue unsignedIntegerValue];
-        }
+            NSString *line = [text substringWithRange:contentRange];
+            NSString *trimmed = OMDTrimLeadingWhitespace(line);
 
-        if (insideFence) {
-            if (shouldColorLine) {
-                [fencedRanges addObject:[NSValue valueWithRange:contentRange]];
-            }
-            if (OMDIsFenceDelimiter(trimmed, activeFenceMarker)) {
-                insideFence = NO;
-                activeFenceMarker = 0;
+            OMDSourceBlockStyle parserStyle = OMDSourceBlockStyleNone;
+            NSNumber *styleValue = [parserLineStyles objectForKey:[NSNumber numberWithUnsignedInteger:lineNumber]];
+            if (styleValue != nil) {
+                parserStyle = (OMDSourceBlockStyle)[styleValue unsignedIntegerValue];
             }
-            cursor = NSMaxRange(lineRange);
-            lineNumber += 1;
-            continue;
-        }
 
-        if (OMDIsFenceDelimiter(trimmed, 0)) {
-            insideFence = YES;
-            activeFenceMarker = [trimmed characterAtIndex:0];
-            if (shouldColorLine) {
-                [fencedRanges addObject:[NSValue valueWithRange:contentRange]];
+            if (insideFence) {
+                if (shouldColorLine) {
+                    [fencedRanges addObject:[NSValue valueWithRange:contentRange]];
+                }
+                if (OMDIsFenceDelimiter(trimmed, activeFenceMarker)) {
+                    insideFence = NO;
+                    activeFenceMarker = 0;
+                }
+                cursor = NSMaxRange(lineRange);
+                lineNumber += 1;
+                continue;
             }
-            cursor = NSMaxRange(lineRange);
-            lineNumber += 1;
-            continue;
-        }
 
-        OMDSourceBlockStyle effectiveStyle = parserStyle;
-        if (effectiveStyle == OMDSourceBlockStyleNone) {
-            if (OMDHasHeadingMarker(trimmed)) {
-                effectiveStyle = OMDSourceBlockStyleHeading;
-            } else if ([trimmed hasPrefix:@">"]) {
-                effectiveStyle = OMDSourceBlockStyleBlockquote;
-            } else if (OMDHasListMarker(trimmed)) {
-                effectiveStyle = OMDSourceBlockStyleList;
+            if (OMDIsFenceDelimiter(trimmed, 0)) {
+                insideFence = YES;
+                activeFenceMarker = [trimmed characterAtIndex:0];
+                if (shouldColorLine) {
+                    [fencedRanges addObject:[NSValue valueWithRange:contentRange]];
+                }
+                cursor = NSMaxRange(lineRange);
+                lineNumber += 1;
+                continue;
             }
-        }
 
-        if (shouldColorLine && contentRange.length > 0) {
-            NSColor *color = nil;
-            switch (effectiveStyle) {
-                case OMDSourceBlockStyleHeading:
-                    color = palette.headingColor;
-                    break;
-                case OMDSourceBlockStyleBlockquote:
-                    color = palette.blockquoteColor;
-                    break;
-                case OMDSourceBlockStyleList:
-                    color = palette.listColor;
-                    break;
-                case OMDSourceBlockStyleCode:
-                    color = palette.codeColor;
-                    break;
-                case OMDSourceBlockStyleNone:
-                default:
-                    break;
+            OMDSourceBlockStyle effectiveStyle = parserStyle;
+            if (effectiveStyle == OMDSourceBlockStyleNone) {
+                effectiveStyle = OMDHeuristicBlockStyle(trimmed);
             }
-            if (color != nil) {
-                [attributedString addAttribute:NSForegroundColorAttributeName
-                                         value:color
-                                         range:contentRange];
+
+            if (shouldColorLine && contentRange.length > 0) {
+                NSColor *color = OMDColorForBlockStyle(effectiveStyle, &palette);
+                if (color != nil) {
+                    [attributedString addAttribute:NSForegroundColorAttributeName
+                                             value:color
+                                             range:contentRange];
+                }
             }
-        }
 
-        cursor = NSMaxRange(lineRange);
-        lineNumber += 1;
+            cursor = NSMaxRange(lineRange);
+            lineNumber += 1;
+        }
     }
 
     [self omdApplyRegex:OMDLinkRegex()
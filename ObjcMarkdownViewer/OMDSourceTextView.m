@@ -2,11 +2,14 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #import "OMDSourceTextView.h"
+#import "OMPerfTrace.h"
 
 static NSString * const OMDWordSelectionShimEnabledDefaultsKey = @"ObjcMarkdownWordSelectionShimEnabled";
 
 static NSTimeInterval OMDSourceLastKeyDownStart = 0.0;
 static BOOL OMDSourcePendingPaintSample = NO;
+// Trace clock time of the last key press not yet followed by a paint.
+static uint64_t OMDSourcePendingPaintTraceStart = 0;
 
 static BOOL OMDKeyLatencyProfilingEnabled(void)
 {
@@ -260,8 +263,14 @@ static NSUInteger OMDPositionAfterRemovingRange(NSUInteger position, NSRange rem
 {
     BOOL profiling = OMDKeyLatencyProfilingEnabled();
     NSTimeInterval start = profiling ? OMDKeyLatencyNow() : 0.0;
+    OMPerfTraceSpan drawSpan = OMPerfTraceBegin("viewer", "source-draw");
     [super drawRect:dirtyRect];
     [self omdDrawSelectedSyntaxOverlayInRect:dirtyRect];
+    OMPerfTraceEnd(drawSpan);
+    if (OMDSourcePendingPaintTraceStart != 0) {
+        OMPerfTraceRecordSpan("input", "keystroke-to-paint", OMDSourcePendingPaintTraceStart, OMPerfTraceNowMicros());
+        OMDSourcePendingPaintTraceStart = 0;
+    }
     if (profiling) {
         NSTimeInterval end = OMDKeyLatencyNow();
         double drawMS = OMDKeyLatencyMS(start, end);
@@ -428,6 +437,7 @@ static NSUInteger OMDPositionAfterRemovingRange(NSUInteger position, NSRange rem
 {
     BOOL profiling = OMDKeyLatencyProfilingEnabled();
     NSTimeInterval keyStart = profiling ? OMDKeyLatencyNow() : 0.0;
+    OMPerfTraceSpan keySpan = OMPerfTraceBegin("input", "key-down");
     NSTimeInterval afterCursorStart = 0.0;
     NSTimeInterval afterContext = 0.0;
     NSTimeInterval afterShortcut = 0.0;
@@ -441,6 +451,9 @@ static NSUInteger OMDPositionAfterRemovingRange(NSUInteger position, NSRange rem
         OMDSourceLastKeyDownStart = keyStart;
         OMDSourcePendingPaintSample = YES;
     }
+    if (keySpan.name != NULL) {
+        OMDSourcePendingPaintTraceStart = keySpan.startMicros;
+    }
 
     [self omdEnsureEditorCursorShape];
     if (profiling) {
@@ -534,6 +547,7 @@ static NSUInteger OMDPositionAfterRemovingRange(NSUInteger position, NSRange rem
     [self omdEnsureEditorCursorShape];
 
 logKeyDown:
+    OMPerfTraceEnd(keySpan);
     if (profiling) {
         NSTimeInterval end = OMDKeyLatencyNow();
         if (afterSuper == 0.0) {
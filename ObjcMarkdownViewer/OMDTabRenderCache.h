@@ -0,0 +1,52 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <Foundation/Foundation.h>
+
+// The preview output of one tab as it was last displayed.
+@interface OMDTabRenderSnapshot : NSObject
+
+- (instancetype)initWithMarkdown:(NSString *)markdown
+                configurationKey:(NSString *)configurationKey
+                        rendered:(NSAttributedString *)rendered
+                 codeBlockRanges:(NSArray *)codeBlockRanges
+                blockquoteRanges:(NSArray *)blockquoteRanges
+                    blockAnchors:(NSArray *)blockAnchors;
+
+@property (nonatomic, readonly) NSString *markdown;
+@property (nonatomic, readonly) NSString *configurationKey;
+@property (nonatomic, readonly) NSAttributedString *rendered;
+@property (nonatomic, readonly) NSArray *codeBlockRanges;
+@property (nonatomic, readonly) NSArray *blockquoteRanges;
+@property (nonatomic, readonly) NSArray *blockAnchors;
+@property (nonatomic, assign) NSPoint scrollOrigin;
+// Approximate resident bytes, fixed at creation.
+@property (nonatomic, readonly) NSUInteger cost;
+
+- (BOOL)matchesMarkdown:(NSString *)markdown configurationKey:(NSString *)configurationKey;
+
+@end
+
+FOUNDATION_EXPORT NSUInteger OMDEstimatedAttributedStringCost(NSAttributedString *string);
+
+// Per-tab snapshots under one byte budget. The least recently stored or
+// fetched tab is evicted first; the selected tab is normally the most recent.
+@interface OMDTabRenderCache : NSObject
+
+- (instancetype)initWithByteBudget:(NSUInteger)byteBudget;
+
+@property (nonatomic, assign) NSUInteger byteBudget;
+@property (nonatomic, readonly) NSUInteger totalCost;
+
+- (void)storeSnapshot:(OMDTabRenderSnapshot *)snapshot forTabIdentifier:(NSString *)identifier;
+// Returns nil, and drops the entry, when the tab's markdown or the render
+// configuration changed since the snapshot was taken.
+- (OMDTabRenderSnapshot *)snapshotForTabIdentifier:(NSString *)identifier
+                                          markdown:(NSString *)markdown
+                                  configurationKey:(NSString *)configurationKey;
+- (OMDTabRenderSnapshot *)peekSnapshotForTabIdentifier:(NSString *)identifier;
+- (NSUInteger)costForTabIdentifier:(NSString *)identifier;
+- (void)removeSnapshotForTabIdentifier:(NSString *)identifier;
+- (void)removeAllSnapshots;
+
+@end
@@ -0,0 +1,230 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import "OMDTabRenderCache.h"
+#import <AppKit/AppKit.h>
+
+static const NSUInteger OMDTabRenderRunCost = 64;
+static const NSUInteger OMDTabRenderAttachmentCost = 256;
+static const NSUInteger OMDTabRenderRangeEntryCost = 48;
+
+NSUInteger OMDEstimatedAttributedStringCost(NSAttributedString *string)
+{
+    NSUInteger length = [string length];
+    if (length == 0) {
+        return 0;
+    }
+
+    __block NSUInteger cost = length * sizeof(unichar);
+    [string enumerateAttributesInRange:NSMakeRange(0, length)
+                               options:0
+                            usingBlock:^(NSDictionary *attributes, NSRange range, BOOL *stop) {
+        (void)range;
+        (void)stop;
+        cost += OMDTabRenderRunCost;
+        NSTextAttachment *attachment = [attributes objectForKey:NSAttachmentAttributeName];
+        if (attachment == nil) {
+            return;
+        }
+        cost += OMDTabRenderAttachmentCost;
+        id<NSTextAttachmentCell> cell = [attachment attachmentCell];
+        if ([(NSObject *)cell respondsToSelector:@selector(image)]) {
+            NSImage *image = [(NSTextAttachmentCell *)cell image];
+            NSSize size = (image != nil ? [image size] : NSZeroSize);
+            if (size.width > 0.0 && size.height > 0.0) {
+                cost += (NSUInteger)(size.width * size.height) * 4;
+            }
+        }
+    }];
+    return cost;
+}
+
+@implementation OMDTabRenderSnapshot
+
+@synthesize markdown = _markdown;
+@synthesize configurationKey = _configurationKey;
+@synthesize rendered = _rendered;
+@synthesize codeBlockRanges = _codeBlockRanges;
+@synthesize blockquoteRanges = _blockquoteRanges;
+@synthesize blockAnchors = _blockAnchors;
+@synthesize scrollOrigin = _scrollOrigin;
+@synthesize cost = _cost;
+
+- (instancetype)initWithMarkdown:(NSString *)markdown
+                configurationKey:(NSString *)configurationKey
+                        rendered:(NSAttributedString *)rendered
+                 codeBlockRanges:(NSArray *)codeBlockRanges
+                blockquoteRanges:(NSArray *)blockquoteRanges
+                    blockAnchors:(NSArray *)blockAnchors
+{
+    self = [super init];
+    if (self) {
+        _markdown = [markdown copy];
+        _configurationKey = [configurationKey copy];
+        _rendered = [rendered retain];
+        _codeBlockRanges = [(codeBlockRanges != nil ? codeBlockRanges : [NSArray array]) retain];
+        _blockquoteRanges = [(blockquoteRanges != nil ? blockquoteRanges : [NSArray array]) retain];
+        _blockAnchors = [(blockAnchors != nil ? blockAnchors : [NSArray array]) retain];
+        _scrollOrigin = NSZeroPoint;
+        _cost = OMDEstimatedAttributedStringCost(rendered) +
+                [_markdown length] * sizeof(unichar) +
+                ([_codeBlockRanges count] + [_blockquoteRanges count] + [_blockAnchors count]) *
+                OMDTabRenderRangeEntryCost;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_markdown release];
+    [_configurationKey release];
+    [_rendered release];
+    [_codeBlockRanges release];
+    [_blockquoteRanges release];
+    [_blockAnchors release];
+    [super dealloc];
+}
+
+- (BOOL)matchesMarkdown:(NSString *)markdown configurationKey:(NSString *)configurationKey
+{
+    if (markdown == nil || configurationKey == nil) {
+        return NO;
+    }
+    if (![_configurationKey isEqualToString:configurationKey]) {
+        return NO;
+    }
+    return (_markdown == markdown || [_markdown isEqualToString:markdown]);
+}
+
+@end
+
+@implementation OMDTabRenderCache
+{
+    NSMutableDictionary *_snapshots;
+    NSMutableArray *_recency;
+    NSUInteger _totalCost;
+}
+
+@synthesize byteBudget = _byteBudget;
+@synthesize totalCost = _totalCost;
+
+- (instancetype)init
+{
+    return [self initWithByteBudget:128 * 1024 * 1024];
+}
+
+- (instancetype)initWithByteBudget:(NSUInteger)byteBudget
+{
+    self = [super init];
+    if (self) {
+        _snapshots = [[NSMutableDictionary alloc] init];
+        _recency = [[NSMutableArray alloc] init];
+        _byteBudget = byteBudget;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_snapshots release];
+    [_recency release];
+    [super dealloc];
+}
+
+- (void)om_touchIdentifier:(NSString *)identifier
+{
+    identifier = [[identifier retain] autorelease];
+    [_recency removeObject:identifier];
+    [_recency addObject:identifier];
+}
+
+- (void)om_evictToBudgetSparing:(NSString *)identifier
+{
+    while (_totalCost > _byteBudget && [_recency count] > 0) {
+        NSString *oldest = [[[_recency objectAtIndex:0] retain] autorelease];
+        if (identifier != nil && [oldest isEqualToString:identifier]) {
+            if ([_recency count] == 1) {
+                break;
+            }
+            [self om_touchIdentifier:oldest];
+            continue;
+        }
+        [self removeSnapshotForTabIdentifier:oldest];
+    }
+}
+
+- (void)setByteBudget:(NSUInteger)byteBudget
+{
+    _byteBudget = byteBudget;
+    [self om_evictToBudgetSparing:nil];
+}
+
+- (void)storeSnapshot:(OMDTabRenderSnapshot *)snapshot forTabIdentifier:(NSString *)identifier
+{
+    if ([identifier length] == 0) {
+        return;
+    }
+    [self removeSnapshotForTabIdentifier:identifier];
+    if (snapshot == nil || [snapshot cost] > _byteBudget) {
+        return;
+    }
+
+    [_snapshots setObject:snapshot forKey:identifier];
+    [_recency addObject:identifier];
+    _totalCost += [snapshot cost];
+    [self om_evictToBudgetSparing:identifier];
+}
+
+- (OMDTabRenderSnapshot *)snapshotForTabIdentifier:(NSString *)identifier
+                                          markdown:(NSString *)markdown
+                                  configurationKey:(NSString *)configurationKey
+{
+    OMDTabRenderSnapshot *snapshot = [self peekSnapshotForTabIdentifier:identifier];
+    if (snapshot == nil) {
+        return nil;
+    }
+    if (![snapshot matchesMarkdown:markdown configurationKey:configurationKey]) {
+        [self removeSnapshotForTabIdentifier:identifier];
+        return nil;
+    }
+    [self om_touchIdentifier:identifier];
+    return snapshot;
+}
+
+- (OMDTabRenderSnapshot *)peekSnapshotForTabIdentifier:(NSString *)identifier
+{
+    if ([identifier length] == 0) {
+        return nil;
+    }
+    return [[[_snapshots objectForKey:identifier] retain] autorelease];
+}
+
+- (NSUInteger)costForTabIdentifier:(NSString *)identifier
+{
+    return [[self peekSnapshotForTabIdentifier:identifier] cost];
+}
+
+- (void)removeSnapshotForTabIdentifier:(NSString *)identifier
+{
+    if ([identifier length] == 0) {
+        return;
+    }
+    OMDTabRenderSnapshot *snapshot = [_snapshots objectForKey:identifier];
+    if (snapshot == nil) {
+        return;
+    }
+    identifier = [[identifier retain] autorelease];
+    NSUInteger cost = [snapshot cost];
+    _totalCost = (_totalCost > cost ? _totalCost - cost : 0);
+    [_recency removeObject:identifier];
+    [_snapshots removeObjectForKey:identifier];
+}
+
+- (void)removeAllSnapshots
+{
+    [_snapshots removeAllObjects];
+    [_recency removeAllObjects];
+    _totalCost = 0;
+}
+
+@end
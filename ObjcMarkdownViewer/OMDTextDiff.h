@@ -0,0 +1,17 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import <Foundation/Foundation.h>
+
+// Characters copied out of an NSString per getCharacters:range: call by the
+// chunked text scanners.
+enum {
+    OMDTextChunkLength = 1024
+};
+
+// Length of the longest common prefix of left and right.
+NSUInteger OMDCommonPrefixLength(NSString *left, NSString *right);
+// Length of the longest common suffix, comparing at most limit characters
+// (pass the shorter length minus the common prefix so the two do not
+// overlap). limit must not exceed either length.
+NSUInteger OMDCommonSuffixLength(NSString *left, NSString *right, NSUInteger limit);
@@ -0,0 +1,49 @@
+// ObjcMarkdownViewer
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#import "OMDTextDiff.h"
+
+NSUInteger OMDCommonPrefixLength(NSString *left, NSString *right)
+{
+    NSUInteger limit = MIN([left length], [right length]);
+    unichar leftBuffer[OMDTextChunkLength];
+    unichar rightBuffer[OMDTextChunkLength];
+    NSUInteger offset = 0;
+    while (offset < limit) {
+        NSUInteger chunk = MIN((NSUInteger)OMDTextChunkLength, limit - offset);
+        [left getCharacters:leftBuffer range:NSMakeRange(offset, chunk)];
+        [right getCharacters:rightBuffer range:NSMakeRange(offset, chunk)];
+        NSUInteger index = 0;
+        while (index < chunk && leftBuffer[index] == rightBuffer[index]) {
+            index += 1;
+        }
+        offset += index;
+        if (index < chunk) {
+            break;
+        }
+    }
+    return offset;
+}
+
+NSUInteger OMDCommonSuffixLength(NSString *left, NSString *right, NSUInteger limit)
+{
+    NSUInteger leftLength = [left length];
+    NSUInteger rightLength = [right length];
+    unichar leftBuffer[OMDTextChunkLength];
+    unichar rightBuffer[OMDTextChunkLength];
+    NSUInteger matched = 0;
+    while (matched < limit) {
+        NSUInteger chunk = MIN((NSUInteger)OMDTextChunkLength, limit - matched);
+        [left getCharacters:leftBuffer range:NSMakeRange(leftLength - matched - chunk, chunk)];
+        [right getCharacters:rightBuffer range:NSMakeRange(rightLength - matched - chunk, chunk)];
+        NSUInteger index = 0;
+        while (index < chunk && leftBuffer[chunk - 1 - index] == rightBuffer[chunk - 1 - index]) {
+            index += 1;
+        }
+        matched += index;
+        if (index < chunk) {
+            break;
+        }
+    }
+    return matched;
+}